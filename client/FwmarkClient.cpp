@@ -19,13 +19,17 @@
 #include "FwmarkCommand.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <algorithm>  // std::size()
+#include <atomic>
 #include <iterator>
 
 namespace {
@@ -37,7 +41,266 @@ inline constexpr char ANDROID_NO_USE_FWMARK_CLIENT[] = "ANDROID_NO_USE_FWMARK_CL
 const sockaddr_un FWMARK_SERVER_PATH = {AF_UNIX, "/dev/socket/fwmarkd"};
 
 bool commandHasFd(int cmdId) {
-    return (cmdId != FwmarkCommand::QUERY_USER_ACCESS);
+    return (cmdId != FwmarkCommand::QUERY_USER_ACCESS &&
+            cmdId != FwmarkCommand::ENABLE_PERSISTENT_CONNECTION &&
+            cmdId != FwmarkCommand::GET_SHARED_STATE);
+}
+
+int connectToServer() {
+    int channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel == -1) {
+        return -errno;
+    }
+    if (TEMP_FAILURE_RETRY(connect(channel, reinterpret_cast<const sockaddr*>(&FWMARK_SERVER_PATH),
+                                   sizeof(FWMARK_SERVER_PATH))) == -1) {
+        const int error = -errno;
+        close(channel);
+        return error;
+    }
+    return channel;
+}
+
+// Sends |data| on |channel|, followed by the |payloadLen| bytes at |payload| and along with the
+// |numFds| file descriptors in |fds|, and waits for the server's reply. Returns the reply, or a
+// negative errno value if the command could not be sent or the reply could not be read. Sets
+// |*replied| to whether a reply was received; it is false if the server closed the connection
+// without replying. If |receivedFd| is not null, it is set to the file descriptor sent with the
+// reply, or -1.
+int transact(int channel, FwmarkCommand* data, const int* fds, size_t numFds, const void* payload,
+             size_t payloadLen, int sendFlags, bool* replied, int* receivedFd = nullptr) {
+    *replied = false;
+
+    iovec iov[2] = {
+        { data, sizeof(*data) },
+        { const_cast<void*>(payload), payloadLen },
+    };
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = std::size(iov);
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(int) * FwmarkCommand::MAX_BATCH_FDS)];
+    } cmsgu;
+
+    if (numFds > FwmarkCommand::MAX_BATCH_FDS) {
+        return -EINVAL;
+    }
+    if (numFds > 0) {
+        memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+        message.msg_control = cmsgu.cmsg;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+
+        cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+        cmsgh->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+        cmsgh->cmsg_level = SOL_SOCKET;
+        cmsgh->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsgh), fds, sizeof(int) * numFds);
+    }
+
+    if (TEMP_FAILURE_RETRY(sendmsg(channel, &message, sendFlags)) == -1) {
+        return -errno;
+    }
+
+    int error = 0;
+    if (receivedFd == nullptr) {
+        const ssize_t len = TEMP_FAILURE_RETRY(recv(channel, &error, sizeof(error), 0));
+        if (len == -1) {
+            return -errno;
+        }
+        *replied = (len == sizeof(error));
+        return error;
+    }
+
+    *receivedFd = -1;
+    iovec replyIov = {&error, sizeof(error)};
+    msghdr reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.msg_iov = &replyIov;
+    reply.msg_iovlen = 1;
+    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+    reply.msg_control = cmsgu.cmsg;
+    reply.msg_controllen = sizeof(cmsgu.cmsg);
+    const ssize_t len = TEMP_FAILURE_RETRY(recvmsg(channel, &reply, MSG_CMSG_CLOEXEC));
+    if (len == -1) {
+        return -errno;
+    }
+    *replied = (len == sizeof(error));
+    const cmsghdr* const cmsgh = CMSG_FIRSTHDR(&reply);
+    if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS &&
+        cmsgh->cmsg_len == CMSG_LEN(sizeof(*receivedFd))) {
+        memcpy(receivedFd, CMSG_DATA(cmsgh), sizeof(*receivedFd));
+    }
+    return error;
+}
+
+// Set once the server has refused a persistent connection, for example because it is too old to
+// support them or has too many. After that, every command uses its own connection.
+std::atomic_bool persistentConnectionRefused(false);
+
+// A connection to the fwmark server that is kept open for the lifetime of the calling thread, so
+// that each command costs a round trip instead of a connection. Each thread has its own connection,
+// so commands on it are never interleaved.
+class PersistentChannel {
+  public:
+    ~PersistentChannel() { reset(); }
+
+    // Closes the connection. Called before fork(), because some processes, such as the zygote,
+    // abort if the child inherits file descriptors they do not know about.
+    void disconnect() { reset(); }
+
+    // Sends |data| on the persistent connection, opening it if necessary. Returns false if no
+    // persistent connection could be used, in which case the caller must send the command on a
+    // connection of its own.
+    bool send(FwmarkCommand* data, const int* fds, size_t numFds, const void* payload,
+              size_t payloadLen, int* error) {
+        // If the server went away, for example because netd restarted, reconnect once.
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (!isUsable() && !open()) {
+                return false;
+            }
+            bool replied;
+            const int ret = transact(mChannel, data, fds, numFds, payload, payloadLen, MSG_NOSIGNAL,
+                                     &replied);
+            if (replied) {
+                *error = ret;
+                return true;
+            }
+            reset();
+        }
+        return false;
+    }
+
+  private:
+    static void disconnectBeforeFork();
+
+    // The file descriptor may have been inherited across fork(), in which case it is shared with
+    // the parent, or closed and reused by code that closes file descriptors it does not own.
+    bool isUsable() {
+        if (mChannel < 0) {
+            return false;
+        }
+        // The server identifies the caller by the credentials it had when it connected.
+        if (mPid == getpid() && mEuid == geteuid() && isSameSocket()) {
+            return true;
+        }
+        reset();
+        return false;
+    }
+
+    bool isSameSocket() const {
+        struct stat st;
+        return fstat(mChannel, &st) == 0 && st.st_dev == mDev && st.st_ino == mIno;
+    }
+
+    bool open() {
+        if (persistentConnectionRefused) {
+            return false;
+        }
+        static const int atforkRegistered = pthread_atfork(disconnectBeforeFork, nullptr, nullptr);
+        if (atforkRegistered != 0) {
+            return false;
+        }
+        const int channel = connectToServer();
+        if (channel < 0) {
+            return false;
+        }
+        FwmarkCommand command = {FwmarkCommand::ENABLE_PERSISTENT_CONNECTION, 0, 0, 0};
+        bool replied;
+        const int ret =
+                transact(channel, &command, nullptr, 0, nullptr, 0, MSG_NOSIGNAL, &replied);
+        struct stat st;
+        if (!replied || ret != 0 || fstat(channel, &st) != 0) {
+            if (replied) {
+                persistentConnectionRefused = true;
+            }
+            close(channel);
+            return false;
+        }
+        mChannel = channel;
+        mPid = getpid();
+        mEuid = geteuid();
+        mDev = st.st_dev;
+        mIno = st.st_ino;
+        return true;
+    }
+
+    void reset() {
+        // Only close the file descriptor if it is still ours.
+        if (mChannel >= 0 && isSameSocket()) {
+            close(mChannel);
+        }
+        mChannel = -1;
+    }
+
+    int mChannel = -1;
+    pid_t mPid = 0;
+    uid_t mEuid = 0;
+    dev_t mDev = 0;
+    ino_t mIno = 0;
+};
+
+thread_local PersistentChannel persistentChannel;
+
+void PersistentChannel::disconnectBeforeFork() {
+    persistentChannel.disconnect();
+}
+
+// The server's shared state, mapped read-only, or null if it has not been mapped yet. Mappings are
+// inherited across fork(), so this is valid in child processes too.
+std::atomic<const FwmarkSharedState*> sharedState(nullptr);
+std::atomic_bool sharedStateUnavailable(false);
+
+const FwmarkSharedState* mapSharedState() {
+    const int channel = connectToServer();
+    if (channel < 0) {
+        return nullptr;
+    }
+    FwmarkCommand command = {FwmarkCommand::GET_SHARED_STATE, 0, 0, 0};
+    bool replied;
+    int fd = -1;
+    const int ret =
+            transact(channel, &command, nullptr, 0, nullptr, 0, MSG_NOSIGNAL, &replied, &fd);
+    close(channel);
+    if (!replied || ret != 0 || fd == -1) {
+        if (fd != -1) close(fd);
+        return nullptr;
+    }
+    // Servers that predate the fields at the end share less. Reading past the end of the file
+    // would raise SIGBUS.
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(FwmarkSharedState))) {
+        close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, sizeof(FwmarkSharedState), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return (addr == MAP_FAILED) ? nullptr : static_cast<const FwmarkSharedState*>(addr);
+}
+
+// Returns the server's shared state, mapping it on first use, or null if the server does not share
+// it.
+const FwmarkSharedState* getSharedState() {
+    const FwmarkSharedState* state = sharedState.load(std::memory_order_acquire);
+    if (state == nullptr) {
+        if (sharedStateUnavailable) {
+            return nullptr;
+        }
+        state = mapSharedState();
+        if (state == nullptr) {
+            // Don't ask again: the server is too old, or cannot share its state on this kernel.
+            sharedStateUnavailable = true;
+            return nullptr;
+        }
+        const FwmarkSharedState* expected = nullptr;
+        if (!sharedState.compare_exchange_strong(expected, state, std::memory_order_acq_rel)) {
+            // Another thread mapped it first.
+            munmap(const_cast<FwmarkSharedState*>(state), sizeof(FwmarkSharedState));
+            state = expected;
+        }
+    }
+    return state;
 }
 
 }  // namespace
@@ -68,7 +331,57 @@ FwmarkClient::~FwmarkClient() {
     }
 }
 
+bool FwmarkClient::getStateGeneration(uint32_t* generation) {
+    const FwmarkSharedState* state = getSharedState();
+    if (state == nullptr) {
+        return false;
+    }
+    *generation = state->generation.load(std::memory_order_acquire);
+    return *generation != 0;
+}
+
+bool FwmarkClient::getNetworkState(NetworkState* networkState) {
+    const FwmarkSharedState* state = getSharedState();
+    if (state == nullptr) {
+        return false;
+    }
+    // The server only holds the sequence odd for a few stores, so this rarely loops more than
+    // once. Give up rather than spin if it keeps changing.
+    for (int attempt = 0; attempt < 8; attempt++) {
+        const uint32_t before = state->sequence.load(std::memory_order_acquire);
+        if (before == 0) {
+            return false;
+        }
+        if (before & 1) {
+            continue;
+        }
+        const unsigned defaultNetId = state->defaultNetId.load(std::memory_order_relaxed);
+        const bool hasUidRanges = state->hasUidRanges.load(std::memory_order_relaxed) != 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (state->sequence.load(std::memory_order_relaxed) == before) {
+            *networkState = {.defaultNetId = defaultNetId, .hasUidRanges = hasUidRanges};
+            return true;
+        }
+    }
+    return false;
+}
+
 int FwmarkClient::send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo) {
+    return send(data, &fd, commandHasFd(data->cmdId) ? 1 : 0, connectInfo);
+}
+
+int FwmarkClient::send(FwmarkCommand* data, const int* fds, size_t numFds,
+                       FwmarkConnectInfo* connectInfo) {
+    return send(data, fds, numFds, connectInfo, connectInfo ? sizeof(*connectInfo) : 0);
+}
+
+int FwmarkClient::send(FwmarkCommand* data, const int* fds, size_t numFds, const void* payload,
+                       size_t payloadLen) {
+    int error = 0;
+    if (persistentChannel.send(data, fds, numFds, payload, payloadLen, &error)) {
+        return error;
+    }
+
     mChannel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (mChannel == -1) {
         return -errno;
@@ -83,41 +396,6 @@ int FwmarkClient::send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectIn
         return 0;
     }
 
-    iovec iov[2] = {
-        { data, sizeof(*data) },
-        { connectInfo, (connectInfo ? sizeof(*connectInfo) : 0) },
-    };
-    msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = iov;
-    message.msg_iovlen = std::size(iov);
-
-    union {
-        cmsghdr cmh;
-        char cmsg[CMSG_SPACE(sizeof(fd))];
-    } cmsgu;
-
-    if (commandHasFd(data->cmdId)) {
-        memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
-        message.msg_control = cmsgu.cmsg;
-        message.msg_controllen = sizeof(cmsgu.cmsg);
-
-        cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
-        cmsgh->cmsg_len = CMSG_LEN(sizeof(fd));
-        cmsgh->cmsg_level = SOL_SOCKET;
-        cmsgh->cmsg_type = SCM_RIGHTS;
-        memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
-    }
-
-    if (TEMP_FAILURE_RETRY(sendmsg(mChannel, &message, 0)) == -1) {
-        return -errno;
-    }
-
-    int error = 0;
-
-    if (TEMP_FAILURE_RETRY(recv(mChannel, &error, sizeof(error), 0)) == -1) {
-        return -errno;
-    }
-
-    return error;
+    bool replied;
+    return transact(mChannel, data, fds, numFds, payload, payloadLen, 0, &replied);
 }
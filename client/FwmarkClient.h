@@ -17,6 +17,8 @@
 #ifndef NETD_CLIENT_FWMARK_CLIENT_H
 #define NETD_CLIENT_FWMARK_CLIENT_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 struct FwmarkCommand;
@@ -36,6 +38,31 @@ public:
     // Returns 0 on success or a negative errno value on failure.
     int send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo);
 
+    // Like send(), but sends the |numFds| file descriptors in |fds|, which may be none. At most
+    // FwmarkCommand::MAX_BATCH_FDS can be sent.
+    int send(FwmarkCommand* data, const int* fds, size_t numFds, FwmarkConnectInfo* connectInfo);
+
+    // Like send(), but sends the |payloadLen| bytes at |payload| after |data| instead of a
+    // FwmarkConnectInfo.
+    int send(FwmarkCommand* data, const int* fds, size_t numFds, const void* payload,
+             size_t payloadLen);
+
+    // Sets |*generation| to the current generation of the fwmark server's network state, mapping
+    // the server's shared state on first use. Returns false if the server does not share it.
+    static bool getStateGeneration(uint32_t* generation);
+
+    // The network state that the fwmark server publishes to all clients.
+    struct NetworkState {
+        unsigned defaultNetId;
+        // Whether any network applies to only some UIDs, such as a VPN or a per-app default
+        // network. If not, every UID that did not select a network uses the default network.
+        bool hasUidRanges;
+    };
+    // Reads a consistent copy of the network state that the server publishes, mapping the server's
+    // shared state on first use. Returns false if the server does not share it, or has not
+    // published it yet.
+    static bool getNetworkState(NetworkState* state);
+
 private:
     int mChannel;
 };
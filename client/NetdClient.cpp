@@ -21,13 +21,18 @@
 #include <math.h>
 #include <resolv.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/system_properties.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <DnsProxydProtocol.h>  // NETID_USE_LOCAL_NAMESERVERS
@@ -62,6 +67,10 @@ std::atomic_uint netIdForProcess(NETID_UNSET);
 std::atomic_uint netIdForResolv(NETID_UNSET);
 std::atomic_bool allowNetworkingForProcess(true);
 
+// The outstanding queries of each resNetworkChannel, keyed by channel fd and then by tag.
+std::mutex channelsLock;
+std::unordered_map<int, std::unordered_map<uint32_t, int>> channels;
+
 typedef int (*Accept4FunctionType)(int, sockaddr*, socklen_t*, int);
 typedef int (*ConnectFunctionType)(int, const sockaddr*, socklen_t);
 typedef int (*SocketFunctionType)(int, int, int);
@@ -90,6 +99,58 @@ static bool propertyValueIsTrue(const char* prop_name) {
     return false;
 }
 
+// Caches the value of a boolean system property by serial number, so that reading it when it has
+// not changed costs a few atomic loads instead of a lookup and a copy of the value. Threadsafe.
+class CachedBooleanProperty {
+  public:
+    explicit constexpr CachedBooleanProperty(const char* name) : mName(name) {}
+
+    bool isTrue() {
+        const prop_info* pi = mPropInfo.load(std::memory_order_acquire);
+        if (pi == nullptr) {
+            // The property area serial changes whenever a property is added, so only look the
+            // property up again after that.
+            const uint32_t areaSerial = __system_property_area_serial();
+            if (mAreaSerial.load(std::memory_order_relaxed) == areaSerial) {
+                return false;
+            }
+            pi = __system_property_find(mName);
+            if (pi == nullptr) {
+                mAreaSerial.store(areaSerial, std::memory_order_relaxed);
+                return false;
+            }
+            mPropInfo.store(pi, std::memory_order_release);
+        }
+
+        // The value and the serial it was read at are stored together, so that concurrent
+        // updates cannot leave a value tagged with the wrong serial.
+        const uint64_t state = mState.load(std::memory_order_acquire);
+        if (state != UNKNOWN_STATE && (state >> 1) == __system_property_serial(pi)) {
+            return state & 1;
+        }
+        uint64_t newState = UNKNOWN_STATE;
+        __system_property_read_callback(
+                pi,
+                [](void* cookie, const char*, const char* value, uint32_t serial) {
+                    *static_cast<uint64_t*>(cookie) =
+                            (static_cast<uint64_t>(serial) << 1) | (strcmp(value, "true") == 0);
+                },
+                &newState);
+        mState.store(newState, std::memory_order_release);
+        return newState & 1;
+    }
+
+  private:
+    static constexpr uint64_t UNKNOWN_STATE = UINT64_MAX;
+
+    const char* const mName;
+    std::atomic<const prop_info*> mPropInfo = nullptr;
+    std::atomic_uint64_t mAreaSerial = UINT64_MAX;
+    std::atomic_uint64_t mState = UNKNOWN_STATE;  // (serial << 1) | value
+};
+
+CachedBooleanProperty redirectSocketCallsHooked(PROPERTY_REDIRECT_SOCKET_CALLS_HOOKED);
+
 int checkSocket(int socketFd) {
     if (socketFd < 0) {
         return -EBADF;
@@ -112,6 +173,143 @@ bool shouldMarkSocket(int socketFd, const sockaddr* dst) {
     return dst && FwmarkClient::shouldSetFwmark(dst->sa_family) && (checkSocket(socketFd) == 0);
 }
 
+// Marks that ON_CONNECT has set on sockets of this process, each tagged with the generation of the
+// fwmark server's network state at the time. ON_CONNECT only depends on the socket's mark, the
+// network state and the caller's UID, and leaves a mark it has set unchanged when called again. So
+// a socket that carries a mark in this cache, under the current generation, does not need to be
+// sent to the server again. The server still sets every mark; this only skips round trips that
+// would not change it.
+//
+// Each entry is (generation << 32 | mark). Entries are only valid for |connectMarkCacheEuid|.
+constexpr size_t CONNECT_MARK_CACHE_SIZE = 16;
+std::atomic_uint64_t connectMarkCache[CONNECT_MARK_CACHE_SIZE];
+std::atomic<uid_t> connectMarkCacheEuid(0);
+
+size_t connectMarkCacheSlot(uint32_t mark) {
+    // The low bits are the netId; mix in the permission bits.
+    return (mark ^ (mark >> 16)) % CONNECT_MARK_CACHE_SIZE;
+}
+
+bool isConnectMarkCached(uint32_t mark, uint32_t generation, uid_t euid) {
+    if (connectMarkCacheEuid.load(std::memory_order_relaxed) != euid) {
+        return false;
+    }
+    const uint64_t entry = (static_cast<uint64_t>(generation) << 32) | mark;
+    return connectMarkCache[connectMarkCacheSlot(mark)].load(std::memory_order_relaxed) == entry;
+}
+
+void cacheConnectMark(uint32_t mark, uint32_t generation, uid_t euid) {
+    if (connectMarkCacheEuid.exchange(euid, std::memory_order_relaxed) != euid) {
+        for (std::atomic_uint64_t& entry : connectMarkCache) {
+            entry.store(0, std::memory_order_relaxed);
+        }
+    }
+    const uint64_t entry = (static_cast<uint64_t>(generation) << 32) | mark;
+    connectMarkCache[connectMarkCacheSlot(mark)].store(entry, std::memory_order_relaxed);
+}
+
+bool getSocketMark(int socketFd, uint32_t* mark) {
+    socklen_t markLen = sizeof(*mark);
+    return getsockopt(socketFd, SOL_SOCKET, SO_MARK, mark, &markLen) == 0;
+}
+
+// Connections to IPv6 link-local addresses are marked with the network of the scope's interface,
+// which is not covered by the generation.
+bool canCacheConnectMark(const sockaddr* dst) {
+    if (dst->sa_family != AF_INET6) {
+        return true;
+    }
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(dst);
+    return !(sin6->sin6_scope_id && IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr));
+}
+
+// Sends ON_CONNECT for |sockfd| unless the socket already carries the mark it would set.
+int markSocketForConnect(int sockfd, const sockaddr* addr) {
+    uint32_t generation = 0;
+    uint32_t mark;
+    const bool cacheable = canCacheConnectMark(addr) &&
+                           FwmarkClient::getStateGeneration(&generation);
+    const uid_t euid = cacheable ? geteuid() : 0;
+    if (cacheable && getSocketMark(sockfd, &mark) && isConnectMarkCached(mark, generation, euid)) {
+        return 0;
+    }
+
+    FwmarkCommand command = {FwmarkCommand::ON_CONNECT, 0, 0, 0};
+    FwmarkConnectInfo connectInfo(0, 0, addr);
+    if (int error = FwmarkClient().send(&command, sockfd, &connectInfo)) {
+        return error;
+    }
+
+    if (cacheable && getSocketMark(sockfd, &mark)) {
+        cacheConnectMark(mark, generation, euid);
+    }
+    return 0;
+}
+
+// The mark that SELECT_NETWORK set on a fresh socket for the network this process is bound to.
+// Fresh sockets all start unmarked, so under the same generation and UID the server would set the
+// same mark on every new socket. Processes that may set SO_MARK themselves (CAP_NET_ADMIN) apply it
+// directly instead of sending each new socket to the server.
+struct ProcessMark {
+    uint32_t generation;
+    uint32_t mark;
+    uid_t euid;
+};
+// Held while the cached mark is checked and applied, so that it is never applied with the UID or
+// generation of another thread's entry.
+std::mutex processMarkLock;
+ProcessMark processMark = {0, 0, 0};
+// Cleared the first time the kernel refuses to let this process set a mark.
+std::atomic_bool canSetOwnMark(true);
+
+void cacheProcessMark(int socketFd, uint32_t generation) {
+    uint32_t mark;
+    if (!getSocketMark(socketFd, &mark)) {
+        return;
+    }
+    std::lock_guard guard(processMarkLock);
+    processMark = {generation, mark, geteuid()};
+}
+
+// Returns whether |socketFd| now carries the cached mark for |netId|.
+bool applyProcessMark(unsigned netId, uint32_t generation, int socketFd) {
+    std::lock_guard guard(processMarkLock);
+    Fwmark fwmark;
+    fwmark.intValue = processMark.mark;
+    if (processMark.generation != generation || fwmark.netId != netId ||
+        processMark.euid != geteuid()) {
+        return false;
+    }
+    if (setsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, sizeof(fwmark.intValue))) {
+        if (errno == EPERM) {
+            canSetOwnMark.store(false, std::memory_order_relaxed);
+        }
+        return false;
+    }
+    // The network state may have changed between checking the generation and setting the mark.
+    // If it did, let the server set the mark again under its own lock.
+    uint32_t current;
+    return FwmarkClient::getStateGeneration(&current) && current == generation;
+}
+
+// Marks a new socket for the network this process is bound to, without a round trip to the server
+// when the process can do it itself.
+int selectProcessNetworkForSocket(unsigned netId, int socketFd) {
+    uint32_t generation = 0;
+    const bool cacheable = canSetOwnMark.load(std::memory_order_relaxed) &&
+                           FwmarkClient::getStateGeneration(&generation);
+    if (cacheable && applyProcessMark(netId, generation, socketFd)) {
+        return 0;
+    }
+    if (int error = setNetworkForSocket(netId, socketFd)) {
+        return error;
+    }
+    if (cacheable) {
+        cacheProcessMark(socketFd, generation);
+    }
+    return 0;
+}
+
 int closeFdAndSetErrno(int fd, int error) {
     close(fd);
     errno = -error;
@@ -144,9 +342,7 @@ int netdClientAccept4(int sockfd, sockaddr* addr, socklen_t* addrlen, int flags)
 int netdClientConnect(int sockfd, const sockaddr* addr, socklen_t addrlen) {
     const bool shouldSetFwmark = shouldMarkSocket(sockfd, addr);
     if (shouldSetFwmark) {
-        FwmarkCommand command = {FwmarkCommand::ON_CONNECT, 0, 0, 0};
-        FwmarkConnectInfo connectInfo(0, 0, addr);
-        int error = FwmarkClient().send(&command, sockfd, &connectInfo);
+        int error = markSocketForConnect(sockfd, addr);
 
         if (error) {
             errno = -error;
@@ -184,22 +380,47 @@ int netdClientSocket(int domain, int type, int protocol) {
     }
     unsigned netId = netIdForProcess & ~NETID_USE_LOCAL_NAMESERVERS;
     if (netId != NETID_UNSET && FwmarkClient::shouldSetFwmark(domain)) {
-        if (int error = setNetworkForSocket(netId, socketFd)) {
+        if (int error = selectProcessNetworkForSocket(netId, socketFd)) {
             return closeFdAndSetErrno(socketFd, error);
         }
     }
     return socketFd;
 }
 
+// The inode of the socket last reported by reportFirstSend() for each fd number. Sockets are
+// identified by inode, not just fd, so that a socket whose fd number reuses that of a closed socket
+// is still reported. A dup()ed socket is reported once more under its new fd number. Sockets with
+// higher fd numbers are reported on every send.
+constexpr int MAX_TRACKED_SEND_FD = 1024;
+std::atomic_uint64_t reportedSendSockets[MAX_TRACKED_SEND_FD];
+
+// Sends |cmdId| for |sockfd| unless a send command was already sent for this socket.
+void reportFirstSend(int sockfd, FwmarkCommand::CmdId cmdId, const sockaddr* addr) {
+    uint64_t inode = 0;
+    if (sockfd < MAX_TRACKED_SEND_FD) {
+        struct stat st;
+        if (fstat(sockfd, &st) == 0) {
+            inode = st.st_ino;
+        }
+        if (inode != 0 && reportedSendSockets[sockfd].load(std::memory_order_relaxed) == inode) {
+            return;
+        }
+    }
+    FwmarkConnectInfo sendInfo(0, 0, addr);
+    FwmarkCommand command = {cmdId, 0, 0, 0};
+    FwmarkClient().send(&command, sockfd, &sendInfo);
+    if (inode != 0) {
+        reportedSendSockets[sockfd].store(inode, std::memory_order_relaxed);
+    }
+}
+
 int netdClientSendmmsg(int sockfd, const mmsghdr* msgs, unsigned int msgcount, int flags) {
-    if (propertyValueIsTrue(PROPERTY_REDIRECT_SOCKET_CALLS_HOOKED) && !checkSocket(sockfd)) {
+    if (redirectSocketCallsHooked.isTrue() && !checkSocket(sockfd)) {
         const sockaddr* addr = nullptr;
         if ((msgcount > 0) && (msgs != nullptr) && (msgs[0].msg_hdr.msg_name != nullptr)) {
             addr = reinterpret_cast<const sockaddr*>(msgs[0].msg_hdr.msg_name);
             if ((addr != nullptr) && (FwmarkCommand::isSupportedFamily(addr->sa_family))) {
-                FwmarkConnectInfo sendmmsgInfo(0, 0, addr);
-                FwmarkCommand command = {FwmarkCommand::ON_SENDMMSG, 0, 0, 0};
-                FwmarkClient().send(&command, sockfd, &sendmmsgInfo);
+                reportFirstSend(sockfd, FwmarkCommand::ON_SENDMMSG, addr);
             }
         }
     }
@@ -207,14 +428,12 @@ int netdClientSendmmsg(int sockfd, const mmsghdr* msgs, unsigned int msgcount, i
 }
 
 ssize_t netdClientSendmsg(int sockfd, const msghdr* msg, unsigned int flags) {
-    if (propertyValueIsTrue(PROPERTY_REDIRECT_SOCKET_CALLS_HOOKED) && !checkSocket(sockfd)) {
+    if (redirectSocketCallsHooked.isTrue() && !checkSocket(sockfd)) {
         const sockaddr* addr = nullptr;
         if ((msg != nullptr) && (msg->msg_name != nullptr)) {
             addr = reinterpret_cast<const sockaddr*>(msg->msg_name);
             if ((addr != nullptr) && (FwmarkCommand::isSupportedFamily(addr->sa_family))) {
-                FwmarkConnectInfo sendmsgInfo(0, 0, addr);
-                FwmarkCommand command = {FwmarkCommand::ON_SENDMSG, 0, 0, 0};
-                FwmarkClient().send(&command, sockfd, &sendmsgInfo);
+                reportFirstSend(sockfd, FwmarkCommand::ON_SENDMSG, addr);
             }
         }
     }
@@ -223,11 +442,9 @@ ssize_t netdClientSendmsg(int sockfd, const msghdr* msg, unsigned int flags) {
 
 int netdClientSendto(int sockfd, const void* buf, size_t bufsize, int flags, const sockaddr* addr,
                      socklen_t addrlen) {
-    if (propertyValueIsTrue(PROPERTY_REDIRECT_SOCKET_CALLS_HOOKED) && !checkSocket(sockfd)) {
+    if (redirectSocketCallsHooked.isTrue() && !checkSocket(sockfd)) {
         if ((addr != nullptr) && (FwmarkCommand::isSupportedFamily(addr->sa_family))) {
-            FwmarkConnectInfo sendtoInfo(0, 0, addr);
-            FwmarkCommand command = {FwmarkCommand::ON_SENDTO, 0, 0, 0};
-            FwmarkClient().send(&command, sockfd, &sendtoInfo);
+            reportFirstSend(sockfd, FwmarkCommand::ON_SENDTO, addr);
         }
     }
     return libcSendto(sockfd, buf, bufsize, flags, addr, addrlen);
@@ -265,20 +482,27 @@ int setNetworkForTarget(unsigned netId, std::atomic_uint* target) {
     if (socketFd < 0) {
         return -errno;
     }
+    uint32_t generation = 0;
+    const bool cacheable =
+            target == &netIdForProcess && FwmarkClient::getStateGeneration(&generation);
     int error = setNetworkForSocket(netId, socketFd);
     if (!error) {
         *target = requestedNetId;
+        if (cacheable) {
+            cacheProcessMark(socketFd, generation);
+        }
     }
     close(socketFd);
     return error;
 }
 
-int dns_open_proxy() {
+// Returns false and sets errno if this process must not use dnsproxyd.
+bool canUseDnsProxy() {
     const char* cache_mode = getenv("ANDROID_DNS_MODE");
     const bool use_proxy = (cache_mode == NULL || strcmp(cache_mode, "local") != 0);
     if (!use_proxy) {
         errno = ENOSYS;
-        return -1;
+        return false;
     }
 
     // If networking is not allowed, dns_open_proxy should just fail here.
@@ -286,15 +510,23 @@ int dns_open_proxy() {
     // EPERM while creating socket.
     if (!allowNetworkingForProcess.load()) {
         errno = EPERM;
+        return false;
+    }
+    return true;
+}
+
+int dns_open_proxy() {
+    if (!canUseDnsProxy()) {
         return -1;
     }
+    // Each lookup needs a connection of its own: the caller owns the returned fd and closes it
+    // once it has read the answer, and dnsproxyd answers requests on a connection without saying
+    // which request each answer is for, so concurrent lookups could not share one.
     const auto socketFunc = libcSocket ? libcSocket : socket;
     int s = socketFunc(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (s == -1) {
         return -1;
     }
-    const int one = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     static const struct sockaddr_un proxy_addr = {
             .sun_family = AF_UNIX,
@@ -506,6 +738,71 @@ extern "C" int untagSocket(int socketFd) {
     return FwmarkClient().send(&command, socketFd, nullptr);
 }
 
+extern "C" int tagSocketsBatch(const int* fds, const uint32_t* tags, size_t numFds, uid_t uid) {
+    if (numFds == 0) {
+        return 0;
+    }
+    if (!fds || !tags) {
+        return -EFAULT;
+    }
+    for (size_t i = 0; i < numFds; ++i) {
+        if (fds[i] < 0) return -EBADF;
+    }
+    FwmarkCommand command = {FwmarkCommand::TAG_SOCKET_BATCH, 0, uid, 0};
+    int error = 0;
+    for (size_t i = 0; i < numFds; i += FwmarkCommand::MAX_BATCH_FDS) {
+        const size_t n = std::min(numFds - i, FwmarkCommand::MAX_BATCH_FDS);
+        const int ret = FwmarkClient().send(&command, fds + i, n, tags + i, sizeof(*tags) * n);
+        if (ret && !error) error = ret;
+    }
+    return error;
+}
+
+extern "C" int untagSocketsBatch(const int* fds, size_t numFds) {
+    if (numFds == 0) {
+        return 0;
+    }
+    if (!fds) {
+        return -EFAULT;
+    }
+    for (size_t i = 0; i < numFds; ++i) {
+        if (fds[i] < 0) return -EBADF;
+    }
+    FwmarkCommand command = {FwmarkCommand::UNTAG_SOCKET_BATCH, 0, 0, 0};
+    int error = 0;
+    for (size_t i = 0; i < numFds; i += FwmarkCommand::MAX_BATCH_FDS) {
+        const size_t n = std::min(numFds - i, FwmarkCommand::MAX_BATCH_FDS);
+        const int ret = FwmarkClient().send(&command, fds + i, n, nullptr);
+        if (ret && !error) error = ret;
+    }
+    return error;
+}
+
+extern "C" int netdClientPrepareSocketsBatch(const int* fds, size_t numFds) {
+    if (numFds == 0) {
+        return 0;
+    }
+    if (!fds) {
+        return -EFAULT;
+    }
+    for (size_t i = 0; i < numFds; ++i) {
+        if (fds[i] < 0) return -EBADF;
+    }
+    // The server skips sockets that are not inet sockets, so this only checks whether marking is
+    // disabled for this process.
+    if (!FwmarkClient::shouldSetFwmark(AF_INET)) {
+        return 0;
+    }
+    FwmarkCommand command = {FwmarkCommand::PREPARE_FOR_CONNECT_BATCH, 0, 0, 0};
+    int error = 0;
+    for (size_t i = 0; i < numFds; i += FwmarkCommand::MAX_BATCH_FDS) {
+        const size_t n = std::min(numFds - i, FwmarkCommand::MAX_BATCH_FDS);
+        const int ret = FwmarkClient().send(&command, fds + i, n, nullptr);
+        if (ret && !error) error = ret;
+    }
+    return error;
+}
+
 extern "C" int setCounterSet(uint32_t, uid_t) {
     return -ENOTSUP;
 }
@@ -524,26 +821,26 @@ extern "C" int resNetworkQuery(unsigned netId, const char* dname, int ns_class,
 }
 
 extern "C" int resNetworkSend(unsigned netId, const uint8_t* msg, size_t msglen, uint32_t flags) {
-    // Encode
+    netId = getNetworkForResolv(netId);
     // Base 64 encodes every 3 bytes into 4 characters, but then adds padding to the next
-    // multiple of 4 and a \0
+    // multiple of 4 and a \0. The query is encoded in place after the command prefix, so the
+    // whole command is built in a single allocation, and oversized queries are rejected before
+    // any encoding is done.
+    std::string cmd = "resnsend " + std::to_string(netId) + " " + std::to_string(flags) + " ";
+    const size_t prefixLen = cmd.size();
     const size_t encodedLen = divCeil(msglen, 3) * 4 + 1;
-    std::string encodedQuery(encodedLen - 1, 0);
-    int enLen = b64_ntop(msg, msglen, encodedQuery.data(), encodedLen);
-
+    if (prefixLen + encodedLen > MAX_CMD_SIZE) {
+        // Cmd size must less than buffer size of FrameworkListener
+        return -EMSGSIZE;
+    }
+    cmd.resize(prefixLen + encodedLen);
+    int enLen = b64_ntop(msg, msglen, cmd.data() + prefixLen, encodedLen);
     if (enLen < 0) {
         // Unexpected behavior, encode failed
         // b64_ntop only fails when size is too long.
         return -EMSGSIZE;
     }
     // Send
-    netId = getNetworkForResolv(netId);
-    const std::string cmd = "resnsend " + std::to_string(netId) + " " + std::to_string(flags) +
-                            " " + encodedQuery + '\0';
-    if (cmd.size() > MAX_CMD_SIZE) {
-        // Cmd size must less than buffer size of FrameworkListener
-        return -EMSGSIZE;
-    }
     int fd = dns_open_proxy();
     if (fd == -1) {
         return -errno;
@@ -594,12 +891,128 @@ extern "C" void resNetworkCancel(int fd) {
     close(fd);
 }
 
+extern "C" int resNetworkChannelCreate() {
+    int channel = epoll_create1(EPOLL_CLOEXEC);
+    if (channel == -1) {
+        return -errno;
+    }
+    std::lock_guard guard(channelsLock);
+    channels[channel];
+    return channel;
+}
+
+int resNetworkChannelAdd(int channel, uint32_t tag, int queryFd) {
+    unique_fd ufd(queryFd);
+    std::lock_guard guard(channelsLock);
+    auto it = channels.find(channel);
+    if (it == channels.end()) {
+        return -EBADF;
+    }
+    if (it->second.count(tag)) {
+        return -EEXIST;
+    }
+    // The tag travels with the event, so reading a result needs no lookup to find the query fd.
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t{tag} << 32) | static_cast<uint32_t>(queryFd);
+    if (epoll_ctl(channel, EPOLL_CTL_ADD, queryFd, &event) == -1) {
+        return -errno;
+    }
+    it->second[tag] = ufd.release();
+    return 0;
+}
+
+extern "C" int resNetworkChannelSend(int channel, uint32_t tag, unsigned netId, const uint8_t* msg,
+                                     size_t msglen, uint32_t flags) {
+    int fd = resNetworkSend(netId, msg, msglen, flags);
+    if (fd < 0) {
+        return fd;
+    }
+    return resNetworkChannelAdd(channel, tag, fd);
+}
+
+extern "C" int resNetworkChannelQuery(int channel, uint32_t tag, unsigned netId, const char* dname,
+                                      int ns_class, int ns_type, uint32_t flags) {
+    std::vector<uint8_t> buf(MAX_CMD_SIZE, 0);
+    int len = res_mkquery(ns_o_query, dname, ns_class, ns_type, nullptr, 0, nullptr, buf.data(),
+                          MAX_CMD_SIZE);
+
+    return resNetworkChannelSend(channel, tag, netId, buf.data(), len, flags);
+}
+
+extern "C" int resNetworkChannelResult(int channel, uint32_t* tag, int* rcode, uint8_t* answer,
+                                       size_t anslen) {
+    epoll_event event;
+    int n = TEMP_FAILURE_RETRY(epoll_wait(channel, &event, 1, 0));
+    if (n == -1) {
+        return -errno;
+    }
+    if (n == 0) {
+        return -EAGAIN;
+    }
+    *tag = static_cast<uint32_t>(event.data.u64 >> 32);
+    const int fd = static_cast<int>(event.data.u64 & 0xffffffff);
+    {
+        std::lock_guard guard(channelsLock);
+        auto it = channels.find(channel);
+        if (it == channels.end()) {
+            return -EBADF;
+        }
+        auto query = it->second.find(*tag);
+        if (query == it->second.end() || query->second != fd) {
+            // Cancelled after epoll_wait() returned it.
+            return -ECANCELED;
+        }
+        it->second.erase(query);
+    }
+    // Closing the query fd also removes it from the channel.
+    return resNetworkResult(fd, rcode, answer, anslen);
+}
+
+extern "C" void resNetworkChannelCancel(int channel, uint32_t tag) {
+    std::lock_guard guard(channelsLock);
+    auto it = channels.find(channel);
+    if (it == channels.end()) {
+        return;
+    }
+    auto query = it->second.find(tag);
+    if (query == it->second.end()) {
+        return;
+    }
+    close(query->second);
+    it->second.erase(query);
+}
+
+extern "C" void resNetworkChannelClose(int channel) {
+    std::lock_guard guard(channelsLock);
+    auto it = channels.find(channel);
+    if (it == channels.end()) {
+        return;
+    }
+    for (const auto& [tag, fd] : it->second) {
+        close(fd);
+    }
+    channels.erase(it);
+    close(channel);
+}
+
 extern "C" void setAllowNetworkingForProcess(bool allowNetworking) {
     allowNetworkingForProcess.store(allowNetworking);
 }
 
 extern "C" int getNetworkForDns(unsigned* dnsNetId) {
     if (dnsNetId == nullptr) return -EFAULT;
+    if (!canUseDnsProxy()) {
+        return -errno;
+    }
+    // Unless the process selected a network, or some network applies to only some UIDs, the
+    // resolver answers with the default network, which netd publishes to every client.
+    FwmarkClient::NetworkState state;
+    if (getNetworkForResolv(NETID_UNSET) == NETID_UNSET && FwmarkClient::getNetworkState(&state) &&
+        !state.hasUidRanges && state.defaultNetId != NETID_UNSET) {
+        *dnsNetId = state.defaultNetId;
+        return 0;
+    }
     int fd = dns_open_proxy();
     if (fd == -1) {
         return -errno;
@@ -14,10 +14,13 @@
  * limitations under the License.
  */
 
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <poll.h> /* poll */
 #include <sys/socket.h>
 
 #include <thread>
+#include <vector>
 
 #include <android-base/parseint.h>
 #include <android-base/unique_fd.h>
@@ -114,6 +117,46 @@ TEST(NetdClientTest, getNetworkForDns) {
     EXPECT_EQ(-EFAULT, getNetworkForDns(testNull));
 }
 
+TEST(NetdClientTest, resNetworkChannel) {
+    EXPECT_EQ(-EBADF, resNetworkChannelAdd(-1, 1, -1));
+
+    const int channel = resNetworkChannelCreate();
+    ASSERT_LE(0, channel);
+    uint32_t tag = 0;
+    int rcode = -1;
+    uint8_t answer[16] = {};
+    EXPECT_EQ(-EAGAIN, resNetworkChannelResult(channel, &tag, &rcode, answer, sizeof(answer)));
+
+    // Two queries answered in the reverse order from the one they were sent in.
+    android::base::unique_fd client1, server1, client2, server2;
+    ASSERT_TRUE(android::base::Socketpair(AF_UNIX, &client1, &server1));
+    ASSERT_TRUE(android::base::Socketpair(AF_UNIX, &client2, &server2));
+    const int fd1 = client1.release();
+    ASSERT_EQ(0, resNetworkChannelAdd(channel, 1, fd1));
+    ASSERT_EQ(0, resNetworkChannelAdd(channel, 2, client2.release()));
+    android::base::unique_fd duplicate, unused;
+    ASSERT_TRUE(android::base::Socketpair(AF_UNIX, &duplicate, &unused));
+    EXPECT_EQ(-EEXIST, resNetworkChannelAdd(channel, 2, duplicate.release()));
+
+    const uint32_t response[] = {htonl(0) /* rcode */, htonl(4) /* size */, 0x12345678};
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(response)),
+              write(server2.get(), response, sizeof(response)));
+    pollfd pfd = {.fd = channel, .events = POLLIN};
+    ASSERT_EQ(1, poll(&pfd, 1, 1000));
+    EXPECT_EQ(4, resNetworkChannelResult(channel, &tag, &rcode, answer, sizeof(answer)));
+    EXPECT_EQ(2U, tag);
+    EXPECT_EQ(0, rcode);
+    EXPECT_EQ(-EAGAIN, resNetworkChannelResult(channel, &tag, &rcode, answer, sizeof(answer)));
+
+    resNetworkChannelCancel(channel, 1);
+    // Cancelling closed the query fd, so the server sees the client go away.
+    EXPECT_EQ(0, read(server1.get(), answer, sizeof(answer)));
+    EXPECT_EQ(-1, fcntl(fd1, F_GETFD));
+
+    resNetworkChannelClose(channel);
+    EXPECT_EQ(-1, fcntl(channel, F_GETFD));
+}
+
 TEST(NetdClientTest, protectFromVpnBadFd) {
     EXPECT_EQ(-EBADF, protectFromVpn(-1));
 }
@@ -132,6 +175,50 @@ TEST(NetdClientTest, protectFromVpnTcp6) {
     close(s);
 }
 
+TEST(NetdClientTest, prepareSocketsBatchBadFd) {
+    const int fds[] = {-1};
+    EXPECT_EQ(-EBADF, netdClientPrepareSocketsBatch(fds, std::size(fds)));
+    EXPECT_EQ(0, netdClientPrepareSocketsBatch(nullptr, 0));
+}
+
+TEST(NetdClientTest, prepareSocketsBatch) {
+    // More sockets than fit in one command, including some that are not inet sockets.
+    std::vector<android::base::unique_fd> sockets;
+    std::vector<int> fds;
+    for (int i = 0; i < 100; ++i) {
+        const int family = (i % 10 == 0) ? AF_UNIX : (i % 2) ? AF_INET : AF_INET6;
+        sockets.emplace_back(socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_GE(sockets.back().get(), 3);
+        fds.push_back(sockets.back().get());
+    }
+    EXPECT_EQ(0, netdClientPrepareSocketsBatch(fds.data(), fds.size()));
+}
+
+TEST(NetdClientTest, tagSocketsBatchBadFd) {
+    const int fds[] = {-1};
+    const uint32_t tags[] = {1};
+    EXPECT_EQ(-EBADF, tagSocketsBatch(fds, tags, std::size(fds), -1));
+    EXPECT_EQ(-EFAULT, tagSocketsBatch(fds, nullptr, std::size(fds), -1));
+    EXPECT_EQ(-EBADF, untagSocketsBatch(fds, std::size(fds)));
+    EXPECT_EQ(0, tagSocketsBatch(nullptr, nullptr, 0, -1));
+    EXPECT_EQ(0, untagSocketsBatch(nullptr, 0));
+}
+
+TEST(NetdClientTest, tagSocketsBatch) {
+    // More sockets than fit in one command.
+    std::vector<android::base::unique_fd> sockets;
+    std::vector<int> fds;
+    std::vector<uint32_t> tags;
+    for (int i = 0; i < 100; ++i) {
+        sockets.emplace_back(socket((i % 2) ? AF_INET : AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_GE(sockets.back().get(), 3);
+        fds.push_back(sockets.back().get());
+        tags.push_back(0x1000 + i);
+    }
+    EXPECT_EQ(0, tagSocketsBatch(fds.data(), tags.data(), fds.size(), -1));
+    EXPECT_EQ(0, untagSocketsBatch(fds.data(), fds.size()));
+}
+
 TEST(NetdClientTest, setAllowNetworkingForProcess) {
     netdClientInitDnsOpenProxy(&openDnsProxyFuncPtr);
     netdClientInitSocket(&socketFuncPtr);
@@ -17,7 +17,11 @@
 #ifndef NETD_CLIENT_NETD_CLIENT_PRIV_H
 #define NETD_CLIENT_NETD_CLIENT_PRIV_H
 
+#include <stdint.h>
+
 int getNetworkForDnsInternal(int fd, unsigned* dnsNetId);
+// Takes ownership of |queryFd| and adds it to |channel| as the query with the given tag.
+int resNetworkChannelAdd(int channel, uint32_t tag, int queryFd);
 
 extern "C" {
 void netdClientInitDnsOpenProxy(int (**DnsOpenProxyType)());
@@ -21,6 +21,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <atomic>
+
 // Additional information sent with ON_CONNECT_COMPLETE command
 struct FwmarkConnectInfo {
     int error;
@@ -69,17 +71,55 @@ struct FwmarkCommand {
         ON_SENDMMSG,
         ON_SENDMSG,
         ON_SENDTO,
+        // Asks the server to keep the connection open after replying, so that the client can send
+        // further commands on it. Carries no fd.
+        ENABLE_PERSISTENT_CONNECTION,
+        // Asks the server for a file descriptor, sent with the reply, that can be mapped read-only
+        // to access a FwmarkSharedState. Carries no fd.
+        GET_SHARED_STATE,
+        // Marks each of the up to MAX_BATCH_FDS sockets sent with the command as ON_CONNECT would
+        // for a connect() to a destination that is not a scoped link-local address.
+        PREPARE_FOR_CONNECT_BATCH,
+        // Tags each of the up to MAX_BATCH_FDS sockets sent with the command as TAG_SOCKET would,
+        // with the tag at the same index in the array of uint32_t that follows the command.
+        TAG_SOCKET_BATCH,
+        // Untags each of the up to MAX_BATCH_FDS sockets sent with the command.
+        UNTAG_SOCKET_BATCH,
     } cmdId;
     unsigned netId;  // used only in the SELECT_NETWORK command; ignored otherwise.
     uid_t uid;       // used in the SELECT_FOR_USER, QUERY_USER_ACCESS, TAG_SOCKET,
-                     // SET_COUNTERSET, and DELETE_TAGDATA command; ignored otherwise.
+                     // TAG_SOCKET_BATCH, SET_COUNTERSET, and DELETE_TAGDATA command; ignored
+                     // otherwise.
     uint32_t trafficCtrlInfo;  // used in TAG_SOCKET, SET_COUNTERSET and SET_PACIFIER command;
                                // ignored otherwise. Depend on the case, it can be a tag, a
                                // counterSet or a pacifier signal.
 
+    // The maximum number of fds sent with a PREPARE_FOR_CONNECT_BATCH, TAG_SOCKET_BATCH or
+    // UNTAG_SOCKET_BATCH command.
+    static constexpr size_t MAX_BATCH_FDS = 64;
+
     static bool isSupportedFamily(int socketFamily) {
         return socketFamily == AF_INET || socketFamily == AF_INET6;
     }
 };
 
+// State published by the fwmark server to all clients through shared memory.
+struct FwmarkSharedState {
+    // Incremented every time the network state changes in a way that may change the fwmark that
+    // ON_CONNECT sets on a socket. Never 0.
+    std::atomic_uint32_t generation;
+
+    // A sequence lock over the fields below: odd while the server is updating them, and 0 until
+    // it first has. A reader's copy is consistent if it saw the same even, nonzero value before and
+    // after reading them.
+    std::atomic_uint32_t sequence;
+    // The default network, or NETID_UNSET.
+    std::atomic_uint32_t defaultNetId;
+    // Nonzero if any network applies to only some UIDs, such as a VPN or a per-app default
+    // network. If zero, every UID that did not select a network uses the default network.
+    std::atomic_uint32_t hasUidRanges;
+};
+
+static_assert(std::atomic_uint32_t::is_always_lock_free);
+
 #endif  // NETD_INCLUDE_FWMARK_COMMAND_H
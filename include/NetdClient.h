@@ -46,6 +46,20 @@ int tagSocket(int socketFd, uint32_t tag, uid_t uid);
 
 int untagSocket(int socketFd);
 
+// Like tagSocket() and untagSocket() for each of the |numFds| sockets in |fds|, but sends the
+// sockets to netd in batches rather than one at a time. tagSocketsBatch() tags fds[i] with tags[i].
+// Returns the first error if tagging or untagging any of the sockets failed.
+int tagSocketsBatch(const int* fds, const uint32_t* tags, size_t numFds, uid_t uid);
+
+int untagSocketsBatch(const int* fds, size_t numFds);
+
+// Sets on each of the |numFds| sockets in |fds| the mark that connect() would set, so that they can
+// be connected by code that does not go through the libc entry points, such as io_uring. Sockets
+// that are not inet sockets are skipped. The mark reflects the network state at the time of the
+// call, and sockets that will connect to a scoped IPv6 link-local address must use connect().
+// Returns the first error if marking any of the sockets failed.
+int netdClientPrepareSocketsBatch(const int* fds, size_t numFds);
+
 int resNetworkQuery(unsigned netId, const char* dname, int ns_class, int ns_type, uint32_t flags);
 
 int resNetworkResult(int query_fd, int* rcode, uint8_t* answer, size_t anslen);
@@ -54,6 +68,27 @@ int resNetworkSend(unsigned netId, const uint8_t* msg, size_t msglen, uint32_t f
 
 void resNetworkCancel(int nsend_fd);
 
+// A channel multiplexes many asynchronous DNS queries onto a single fd. The fd returned by
+// resNetworkChannelCreate() becomes readable whenever any query sent on it has an answer, and can
+// be polled or added to an epoll set. Each query is identified by a |tag| that is unique among the
+// channel's outstanding queries. resNetworkChannelResult() returns -EAGAIN if no answer is ready,
+// and otherwise behaves like resNetworkResult() for the query whose tag it stores in |tag|.
+int resNetworkChannelCreate(void);
+
+int resNetworkChannelQuery(int channel, uint32_t tag, unsigned netId, const char* dname,
+                           int ns_class, int ns_type, uint32_t flags);
+
+int resNetworkChannelSend(int channel, uint32_t tag, unsigned netId, const uint8_t* msg,
+                          size_t msglen, uint32_t flags);
+
+int resNetworkChannelResult(int channel, uint32_t* tag, int* rcode, uint8_t* answer,
+                            size_t anslen);
+
+void resNetworkChannelCancel(int channel, uint32_t tag);
+
+// Cancels all outstanding queries and closes the channel.
+void resNetworkChannelClose(int channel);
+
 int getNetworkForDns(unsigned* dnsNetId);
 __END_DECLS
 
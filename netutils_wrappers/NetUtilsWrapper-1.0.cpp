@@ -15,14 +15,20 @@
  */
 
 #include <regex>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <android-base/file.h>
 #include <android-base/strings.h>
 
 #define LOG_TAG "NetUtilsWrapper"
@@ -37,6 +43,9 @@
 #define CCMNI_IFACE "cc(3)?mni[0-9]+"
 #define VENDOR_IFACE "(" OEM_IFACE "|" RMNET_IFACE "|" CCMNI_IFACE ")"
 #define VENDOR_CHAIN "(oem_.*|nm_.*|qcom_.*)"
+#define VENDOR_CHAIN_NAME "^(oem_|nm_|qcom_)[^ ]*$"
+
+#define BATCH_OPTION "--batch"
 
 // List of net utils wrapped by this program
 // The list MUST be in descending order of string length
@@ -100,6 +109,110 @@ bool checkExpectedCommand(int argc, char **argv) {
     return false;
 }
 
+bool toRestoreInput(const std::vector<std::string>& lines, std::string* input) {
+    static const std::regex vendorChain(VENDOR_CHAIN_NAME, std::regex_constants::extended);
+    input->clear();
+    std::string table;
+    for (const std::string& line : lines) {
+        if (line.find_first_of("\"'\\") != std::string::npos) {
+            ALOGI("Quoting not supported in batch: %s", line.c_str());
+            return false;
+        }
+        std::istringstream stream(line);
+        std::vector<std::string> tokens;
+        for (std::string token; stream >> token;) tokens.push_back(token);
+
+        std::vector<std::string> args;
+        std::string lineTable;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const std::string& arg = tokens[i];
+            if (arg == "-w" || arg == "--wait") {
+                // iptables-restore waits for the lock once for the whole batch. Skip the optional
+                // number of seconds.
+                if (i + 1 < tokens.size() && isdigit(tokens[i + 1][0])) i++;
+            } else if (arg == "-W" || arg == "--wait-interval") {
+                i++;
+            } else if (arg == "-t" || arg == "--table") {
+                if (!lineTable.empty() || ++i == tokens.size()) return false;
+                lineTable = tokens[i];
+            } else {
+                args.push_back(arg);
+            }
+        }
+        if (args.empty()) continue;
+        if (lineTable.empty()) lineTable = "filter";
+
+        // Only commands on vendor chains.
+        static const char* const kCommands[] = {"-A", "-D", "-F", "-I", "-N", "-X"};
+        bool allowed = false;
+        for (const char* command : kCommands) allowed |= args[0] == command;
+        if (!allowed || args.size() < 2 || !std::regex_search(args[1], vendorChain)) {
+            ALOGI("Unexpected command in batch: %s", line.c_str());
+            fprintf(stderr, LOG_TAG ": Unexpected command in batch: %s\n", line.c_str());
+            return false;
+        }
+
+        if (lineTable != table) {
+            if (!table.empty()) *input += "COMMIT\n";
+            table = lineTable;
+            *input += "*" + table + "\n";
+        }
+        *input += android::base::Join(args, ' ') + "\n";
+    }
+    if (!table.empty()) *input += "COMMIT\n";
+    return true;
+}
+
+namespace {
+
+// Reads one set of iptables arguments per line from stdin, and applies them all with a single
+// iptables-restore. This saves starting iptables, and reading the whole table, for every rule.
+// Nothing is applied unless every line is a command on a vendor chain.
+int runBatch(const char* basename) {
+    std::vector<std::string> lines;
+    char* line = nullptr;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, stdin)) != -1) {
+        lines.emplace_back(line, length);
+        if (!lines.back().empty() && lines.back().back() == '\n') lines.back().pop_back();
+    }
+    free(line);
+
+    std::string input;
+    if (!toRestoreInput(lines, &input)) return EXIT_FAILURE;
+    if (input.empty()) return EXIT_SUCCESS;
+
+    const std::string restoreCmd = std::string(SYSTEM_DIRNAME) + basename + "-restore";
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return EXIT_FAILURE;
+    }
+    const pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        if (dup2(fds[0], STDIN_FILENO) == -1) _exit(EXIT_FAILURE);
+        const char* const argv[] = {restoreCmd.c_str(), "--noflush", "-w", nullptr};
+        execv(argv[0], const_cast<char**>(argv));
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[0]);
+    bool written = android::base::WriteFully(fds[1], input.data(), input.size());
+    close(fds[1]);
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    return (written && WIFEXITED(status)) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+}  // namespace
 
 // This is the only gateway for vendor programs to reach net utils.
 int doMain(int argc, char **argv) {
@@ -115,6 +228,11 @@ int doMain(int argc, char **argv) {
             // truncate to match netcmds[i]
             basename[len] = '\0';
 
+            if (argc == 2 && !strcmp(argv[1], BATCH_OPTION) &&
+                (!strcmp(basename, "iptables") || !strcmp(basename, "ip6tables"))) {
+                exit(runBatch(basename));
+            }
+
             // hardcode the path to /system so it cannot be overwritten
             char *cmd;
             if (asprintf(&cmd, "%s%s", SYSTEM_DIRNAME, basename) == -1) {
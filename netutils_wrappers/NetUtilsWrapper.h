@@ -14,7 +14,14 @@
  * limitations under the License.
  */
 
+#include <string>
+#include <vector>
+
 #define ARRAY_SIZE(x) (sizeof((x)) / (sizeof(((x)[0]))))
 
 int doMain(int argc, char *argv[]);
 bool checkExpectedCommand(int argc, char **argv);
+
+// Converts the lines of an iptables batch, each a set of iptables arguments, into
+// iptables-restore input. Returns false if any line is not a command on a vendor chain.
+bool toRestoreInput(const std::vector<std::string>& lines, std::string* input);
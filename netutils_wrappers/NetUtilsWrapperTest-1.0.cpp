@@ -70,3 +70,34 @@ TEST(NetUtilsWrapperTest10, TestCommands) {
             (cmd.valid ? "invalid" : "valid") << ": '" << cmd.cmdString << "'";
     }
 }
+
+TEST(NetUtilsWrapperTest10, TestRestoreInput) {
+    std::string input;
+    EXPECT_TRUE(toRestoreInput({"-w -t mangle -N oem_out",
+                                "-w 5 -t mangle -A oem_out -o rmnet_data0 -j MARK --set-mark 1",
+                                "",
+                                "-A qcom_in -i rmnet_data0 -j ACCEPT",
+                                "-W 100 -w -F nm_fwd"},
+                               &input));
+    EXPECT_EQ("*mangle\n"
+              "-N oem_out\n"
+              "-A oem_out -o rmnet_data0 -j MARK --set-mark 1\n"
+              "COMMIT\n"
+              "*filter\n"
+              "-A qcom_in -i rmnet_data0 -j ACCEPT\n"
+              "-F nm_fwd\n"
+              "COMMIT\n",
+              input);
+
+    EXPECT_TRUE(toRestoreInput({}, &input));
+    EXPECT_EQ("", input);
+
+    // Only commands on vendor chains, and nothing that iptables-restore would parse differently.
+    EXPECT_FALSE(toRestoreInput({"-w -A oem_out -j ACCEPT", "-w -A INPUT -j oem_in"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-w -F"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-w -t nat -t mangle -A oem_out -j ACCEPT"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-w -t"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-w -P oem_out DROP"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-A oem_out -m comment --comment \"a b\" -j ACCEPT"}, &input));
+    EXPECT_FALSE(toRestoreInput({"-A oem_out -j ACCEPT", "COMMIT"}, &input));
+}
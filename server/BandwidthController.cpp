@@ -54,8 +54,11 @@
 #include "Controllers.h"
 #include "FirewallController.h" /* For makeCriticalCommands */
 #include "Fwmark.h"
+#include "IptablesScript.h"
+#include "IptablesTokenizer.h"
 #include "NetdConstants.h"
 #include "android/net/INetd.h"
+#include "netd_dump.pb.h"
 
 /* Alphabetical */
 #define ALERT_IPT_TEMPLATE "%s %s -m quota2 ! --quota %" PRId64" --name %s\n"
@@ -69,12 +72,14 @@ const char BandwidthController::LOCAL_GLOBAL_ALERT[] = "bw_global_alert";
 auto BandwidthController::iptablesRestoreFunction = execIptablesRestoreWithOutput;
 
 using android::base::Join;
-using android::base::StartsWith;
 using android::base::StringAppendF;
 using android::base::StringPrintf;
 using android::net::FirewallController;
+using android::net::IptablesScript;
 using android::net::INetd::CLAT_MARK;
+using android::netdutils::makeSlice;
 using android::netdutils::StatusOr;
+using android::netdutils::UniqueFd;
 using android::netdutils::UniqueFile;
 
 namespace {
@@ -202,33 +207,33 @@ static const uint32_t uidBillingMask = Fwmark::getUidBillingMask();
  * See go/ipsec-data-accounting for more information.
  */
 
-std::vector<std::string> getBasicAccountingCommands() {
-    // clang-format off
-    std::vector<std::string> ipt_basic_accounting_commands = {
-            "*filter",
-
-            "-A bw_INPUT -j bw_global_alert",
+std::string getBasicAccountingCommands() {
+    IptablesScript script(2048);
+    script.table("filter")
+            .appendf("-A bw_INPUT -j bw_global_alert")
             // Prevents IPSec double counting (ESP and UDP-encap-ESP respectively)
-            "-A bw_INPUT -p esp -j RETURN",
-            StringPrintf("-A bw_INPUT -m mark --mark 0x%x/0x%x -j RETURN", uidBillingMask,
-                         uidBillingMask),
-            StringPrintf("-A bw_INPUT -j MARK --or-mark 0x%x", uidBillingMask),
-            "-A bw_OUTPUT -j bw_global_alert",
-            "-A bw_costly_shared -j bw_penalty_box",
-            ("-I bw_penalty_box -m bpf --object-pinned " XT_BPF_DENYLIST_PROG_PATH " -j REJECT"),
-            "-A bw_penalty_box -j bw_happy_box",
-            "-A bw_happy_box -j bw_data_saver",
-            "-A bw_data_saver -j RETURN",
-            ("-I bw_happy_box -m bpf --object-pinned " XT_BPF_ALLOWLIST_PROG_PATH " -j RETURN"),
-            "COMMIT",
-
-            "*raw",
+            .appendf("-A bw_INPUT -p esp -j RETURN")
+            .appendf("-A bw_INPUT -m mark --mark 0x%x/0x%x -j RETURN", uidBillingMask,
+                     uidBillingMask)
+            .appendf("-A bw_INPUT -j MARK --or-mark 0x%x", uidBillingMask)
+            .appendf("-A bw_OUTPUT -j bw_global_alert")
+            .appendf("-A bw_costly_shared -j bw_penalty_box")
+            .appendf("-I bw_penalty_box -m bpf --object-pinned %s -j REJECT",
+                     XT_BPF_DENYLIST_PROG_PATH)
+            .appendf("-A bw_penalty_box -j bw_happy_box")
+            .appendf("-A bw_happy_box -j bw_data_saver")
+            .appendf("-A bw_data_saver -j RETURN")
+            .appendf("-I bw_happy_box -m bpf --object-pinned %s -j RETURN",
+                     XT_BPF_ALLOWLIST_PROG_PATH)
+            .commit();
+
+    script.table("raw")
             // Drop duplicate ingress clat packets
-            StringPrintf("-A bw_raw_PREROUTING -m mark --mark 0x%x -j DROP", CLAT_MARK),
+            .appendf("-A bw_raw_PREROUTING -m mark --mark 0x%x -j DROP", CLAT_MARK)
             // Prevents IPSec double counting (Tunnel mode and Transport mode,
             // respectively)
-            ("-A bw_raw_PREROUTING -i " IPSEC_IFACE_PREFIX "+ -j RETURN"),
-            "-A bw_raw_PREROUTING -m policy --pol ipsec --dir in -j RETURN",
+            .appendf("-A bw_raw_PREROUTING -i %s+ -j RETURN", IPSEC_IFACE_PREFIX)
+            .appendf("-A bw_raw_PREROUTING -m policy --pol ipsec --dir in -j RETURN")
             // This is ingress interface accounting. There is no need to do anything specific
             // for 464xlat here, because we only ever account 464xlat traffic on the clat
             // interface and later correct for overhead (+20 bytes/packet).
@@ -238,23 +243,22 @@ std::vector<std::string> getBasicAccountingCommands() {
             //
             // Hence we will never double count and additional corrections are not needed.
             // We can simply take the sum of base and stacked (+20B/pkt) interface counts.
-            ("-A bw_raw_PREROUTING -m bpf --object-pinned " XT_BPF_INGRESS_PROG_PATH),
-            "COMMIT",
+            .appendf("-A bw_raw_PREROUTING -m bpf --object-pinned %s", XT_BPF_INGRESS_PROG_PATH)
+            .commit();
 
-            "*mangle",
+    script.table("mangle")
             // Prevents IPSec double counting (Tunnel mode and Transport mode,
             // respectively)
-            ("-A bw_mangle_POSTROUTING -o " IPSEC_IFACE_PREFIX "+ -j RETURN"),
-            "-A bw_mangle_POSTROUTING -m policy --pol ipsec --dir out -j RETURN",
+            .appendf("-A bw_mangle_POSTROUTING -o %s+ -j RETURN", IPSEC_IFACE_PREFIX)
+            .appendf("-A bw_mangle_POSTROUTING -m policy --pol ipsec --dir out -j RETURN")
             // Clear the uid billing done (egress) mark before sending this packet
-            StringPrintf("-A bw_mangle_POSTROUTING -j MARK --set-mark 0x0/0x%x", uidBillingMask),
+            .appendf("-A bw_mangle_POSTROUTING -j MARK --set-mark 0x0/0x%x", uidBillingMask)
             // This is egress interface accounting: we account 464xlat traffic only on
             // the clat interface (as offloaded packets never hit base interface's ip6tables)
             // and later sum base and stacked with overhead (+20B/pkt) in higher layers
-            ("-A bw_mangle_POSTROUTING -m bpf --object-pinned " XT_BPF_EGRESS_PROG_PATH),
-            COMMIT_AND_CLOSE};
-    // clang-format on
-    return ipt_basic_accounting_commands;
+            .appendf("-A bw_mangle_POSTROUTING -m bpf --object-pinned %s", XT_BPF_EGRESS_PROG_PATH)
+            .commit();
+    return script.str();
 }
 
 }  // namespace
@@ -264,10 +268,23 @@ BandwidthController::BandwidthController() {
 
 void BandwidthController::flushCleanTables(bool doClean) {
     /* Flush and remove the bw_costly_<iface> tables */
-    flushExistingCostlyTables(doClean);
+    if (mCostlyChainsReconciled) {
+        // Only the chains netd has created since it reconciled with the kernel can exist.
+        std::set<std::string> chains = mLeftoverCostlyChains;
+        for (const auto& [iface, quota] : mQuotaIfaces) {
+            chains.insert("bw_costly_" + iface);
+        }
+        flushCostlyTables({chains.begin(), chains.end()}, doClean);
+        // Chains that are only flushed still exist, even once their interface is forgotten.
+        mLeftoverCostlyChains = doClean ? std::set<std::string>() : std::move(chains);
+    } else {
+        // The first time, find the chains that a previous netd instance may have left behind.
+        mCostlyChainsReconciled = (flushExistingCostlyTables(doClean) == 0);
+    }
 
     std::string commands = Join(IPT_FLUSH_COMMANDS, '\n');
     iptablesRestoreFunction(V4V6, commands, nullptr);
+    mQuotaFiles.clear();
 }
 
 int BandwidthController::setupIptablesHooks() {
@@ -277,16 +294,16 @@ int BandwidthController::setupIptablesHooks() {
 }
 
 int BandwidthController::enableBandwidthControl() {
+    // Flush before forgetting the interfaces, since they name the costly chains to flush.
+    flushCleanTables(false);
+
     /* Let's pretend we started from scratch ... */
     mSharedQuotaIfaces.clear();
     mQuotaIfaces.clear();
     mGlobalAlertBytes = 0;
     mSharedQuotaBytes = mSharedAlertBytes = 0;
 
-    flushCleanTables(false);
-
-    std::string commands = Join(getBasicAccountingCommands(), '\n');
-    return iptablesRestoreFunction(V4V6, commands, nullptr);
+    return iptablesRestoreFunction(V4V6, getBasicAccountingCommands(), nullptr);
 }
 
 int BandwidthController::disableBandwidthControl() {
@@ -409,6 +426,7 @@ int BandwidthController::removeInterfaceSharedQuota(const std::string& iface) {
     int res = 0;
     mSharedQuotaIfaces.erase(it);
     if (mSharedQuotaIfaces.empty()) {
+        forgetQuotaFile(cost);
         mSharedQuotaBytes = 0;
         if (mSharedAlertBytes) {
             res = removeSharedAlert();
@@ -497,6 +515,31 @@ int BandwidthController::getInterfaceQuota(const std::string& iface, int64_t* by
     return rv.value() == 1 ? 0 : -1;
 }
 
+int BandwidthController::setInterfaceQuotas(
+        const std::vector<std::pair<std::string, int64_t>>& quotas) {
+    // Rearm the quotas that already have a rule together, and set up the others one by one.
+    std::vector<std::pair<std::string, int64_t>> rearms;
+    int res = 0;
+    for (const auto& [iface, bytes] : quotas) {
+        if (bytes > 0 && mQuotaIfaces.count(iface)) {
+            rearms.emplace_back(iface, bytes);
+        } else if (int ret = setInterfaceQuota(iface, bytes); ret && !res) {
+            res = ret;
+        }
+    }
+
+    if (rearms.empty()) return res;
+    if (updateQuotas(rearms) == 0) {
+        for (const auto& [iface, bytes] : rearms) mQuotaIfaces[iface].quota = bytes;
+        return res;
+    }
+    // Find out which quota failed, and remove it as setInterfaceQuota() does.
+    for (const auto& [iface, bytes] : rearms) {
+        if (int ret = setInterfaceQuota(iface, bytes); ret && !res) res = ret;
+    }
+    return res;
+}
+
 int BandwidthController::removeInterfaceQuota(const std::string& iface) {
     if (!isIfaceName(iface)) return -EINVAL;
 
@@ -522,30 +565,56 @@ int BandwidthController::removeInterfaceQuota(const std::string& iface) {
     const int res = iptablesRestoreFunction(V4V6, Join(cmds, "\n"), nullptr);
 
     if (res == 0) {
+        forgetQuotaFile(iface);
+        forgetQuotaFile(iface + "Alert");
         mQuotaIfaces.erase(it);
+        mLeftoverCostlyChains.erase(chain);
     }
 
     return res ? -EREMOTEIO : 0;
 }
 
 int BandwidthController::updateQuota(const std::string& quotaName, int64_t bytes) {
+    return updateQuotas({{quotaName, bytes}});
+}
+
+int BandwidthController::updateQuotas(
+        const std::vector<std::pair<std::string, int64_t>>& quotas) {
     const auto& sys = android::netdutils::sSyscalls.get();
-    const std::string fname = "/proc/net/xt_quota/" + quotaName;
+    int res = 0;
 
-    if (!isIfaceName(quotaName)) {
-        ALOGE("updateQuota: Invalid quotaName \"%s\"", quotaName.c_str());
-        return -EINVAL;
-    }
+    for (const auto& [quotaName, bytes] : quotas) {
+        if (!isIfaceName(quotaName)) {
+            ALOGE("updateQuota: Invalid quotaName \"%s\"", quotaName.c_str());
+            if (!res) res = -EINVAL;
+            continue;
+        }
+        const std::string value = StringPrintf("%" PRId64 "\n", bytes);
+
+        // The cached file stops working if the quota went away behind our back, e.g., because
+        // someone else flushed its rule. Reopen it then.
+        auto it = mQuotaFiles.find(quotaName);
+        if (it != mQuotaFiles.end()) {
+            if (isOk(sys.write(it->second, makeSlice(value)))) continue;
+            mQuotaFiles.erase(it);
+        }
 
-    StatusOr<UniqueFile> file = sys.fopen(fname, "we");
-    if (!isOk(file)) {
-        int res = errno;
-        ALOGE("Updating quota %s failed (%s)", quotaName.c_str(), toString(file).c_str());
-        return -res;
+        const std::string fname = "/proc/net/xt_quota/" + quotaName;
+        StatusOr<UniqueFd> fd = sys.open(fname, O_WRONLY | O_CLOEXEC);
+        if (!isOk(fd)) {
+            ALOGE("Updating quota %s failed (%s)", quotaName.c_str(), toString(fd).c_str());
+            if (!res) res = -fd.status().code();
+            continue;
+        }
+        const auto written = sys.write(fd.value(), makeSlice(value));
+        if (!isOk(written)) {
+            ALOGE("Updating quota %s failed (%s)", quotaName.c_str(), toString(written).c_str());
+            if (!res) res = -written.status().code();
+            continue;
+        }
+        mQuotaFiles.emplace(quotaName, std::move(fd.value()));
     }
-    // TODO: should we propagate this error?
-    sys.fprintf(file.value().get(), "%" PRId64 "\n", bytes).ignoreError();
-    return 0;
+    return res;
 }
 
 int BandwidthController::runIptablesAlertCmd(IptOp op, const std::string& alertName,
@@ -600,6 +669,7 @@ int BandwidthController::removeGlobalAlert() {
 
     int res = 0;
     res = runIptablesAlertCmd(IptOpDelete, alertName, mGlobalAlertBytes);
+    forgetQuotaFile(alertName);
     mGlobalAlertBytes = 0;
     return res;
 }
@@ -715,42 +785,56 @@ int BandwidthController::removeCostlyAlert(const std::string& costName, int64_t*
         return -EREMOTEIO;
     }
 
+    forgetQuotaFile(alertName);
     *alertBytes = 0;
     return 0;
 }
 
-void BandwidthController::flushExistingCostlyTables(bool doClean) {
+int BandwidthController::flushExistingCostlyTables(bool doClean) {
     std::string fullCmd = "*filter\n-S\nCOMMIT\n";
     std::string ruleList;
 
     /* Only lookup ip4 table names as ip6 will have the same tables ... */
     if (int ret = iptablesRestoreFunction(V4, fullCmd, &ruleList)) {
         ALOGE("Failed to list existing costly tables ret=%d", ret);
-        return;
+        return ret;
     }
     /* ... then flush/clean both ip4 and ip6 iptables. */
-    parseAndFlushCostlyTables(ruleList, doClean);
+    const std::vector<std::string> chains = parseAndFlushCostlyTables(ruleList, doClean);
+    if (!doClean) mLeftoverCostlyChains.insert(chains.begin(), chains.end());
+    return 0;
 }
 
-void BandwidthController::parseAndFlushCostlyTables(const std::string& ruleList, bool doRemove) {
-    std::stringstream stream(ruleList);
-    std::string rule;
-    std::vector<std::string> clearCommands = { "*filter" };
-    std::string chainName;
+std::vector<std::string> BandwidthController::parseAndFlushCostlyTables(
+        const std::string& ruleList, bool doRemove) {
+    std::vector<std::string> chains;
 
     // Find and flush all rules starting with "-N bw_costly_<iface>" except "-N bw_costly_shared".
-    while (std::getline(stream, rule, '\n')) {
-        if (!StartsWith(rule, NEW_CHAIN_COMMAND)) continue;
-        chainName = rule.substr(NEW_CHAIN_COMMAND.size());
-        ALOGV("parse chainName=<%s> orig line=<%s>", chainName.c_str(), rule.c_str());
-
-        if (!StartsWith(chainName, "bw_costly_") || chainName == std::string("bw_costly_shared")) {
+    LineTokenizer lines(ruleList);
+    std::string_view rule;
+    while (lines.next(&rule)) {
+        if (!rule.starts_with(NEW_CHAIN_COMMAND)) continue;
+        const std::string_view chainName = rule.substr(NEW_CHAIN_COMMAND.size());
+        ALOGV("parse chainName=<%.*s>", static_cast<int>(chainName.size()), chainName.data());
+
+        if (!chainName.starts_with("bw_costly_") || chainName == "bw_costly_shared") {
             continue;
         }
 
-        clearCommands.push_back(StringPrintf(":%s -", chainName.c_str()));
+        chains.emplace_back(chainName);
+    }
+
+    flushCostlyTables(chains, doRemove);
+    return chains;
+}
+
+void BandwidthController::flushCostlyTables(const std::vector<std::string>& chains,
+                                            bool doRemove) {
+    std::vector<std::string> clearCommands = { "*filter" };
+    for (const std::string& chain : chains) {
+        clearCommands.push_back(StringPrintf(":%s -", chain.c_str()));
         if (doRemove) {
-            clearCommands.push_back(StringPrintf("-X %s", chainName.c_str()));
+            clearCommands.push_back(StringPrintf("-X %s", chain.c_str()));
         }
     }
 
@@ -785,3 +869,16 @@ inline const char *BandwidthController::jumpToString(IptJumpOp jumpHandling) {
         return " -j RETURN";
     }
 }
+
+void BandwidthController::dumpProto(android::net::netd::BandwidthControllerProto* proto) const {
+    for (const auto& [iface, quotaInfo] : mQuotaIfaces) {
+        auto* quota = proto->add_interface_quotas();
+        quota->set_interface(iface);
+        quota->set_quota_bytes(quotaInfo.quota);
+        quota->set_alert_bytes(quotaInfo.alert);
+    }
+    for (const auto& iface : mSharedQuotaIfaces) proto->add_shared_quota_interfaces(iface);
+    proto->set_shared_quota_bytes(mSharedQuotaBytes);
+    proto->set_shared_alert_bytes(mSharedAlertBytes);
+    proto->set_global_alert_bytes(mGlobalAlertBytes);
+}
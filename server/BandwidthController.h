@@ -23,8 +23,14 @@
 #include <vector>
 #include <mutex>
 
+#include <netdutils/UniqueFd.h>
+
 #include "NetdConstants.h"
 
+namespace android::net::netd {
+class BandwidthControllerProto;
+}
+
 class BandwidthController {
 public:
     std::mutex lock;
@@ -44,11 +50,9 @@ public:
     int setInterfaceQuota(const std::string& iface, int64_t bytes);
     int getInterfaceQuota(const std::string& iface, int64_t* bytes);
     int removeInterfaceQuota(const std::string& iface);
-
-    int addNaughtyApps(const std::vector<uint32_t>& appUids);
-    int removeNaughtyApps(const std::vector<uint32_t>& appUids);
-    int addNiceApps(const std::vector<uint32_t>& appUids);
-    int removeNiceApps(const std::vector<uint32_t>& appUids);
+    // Calls setInterfaceQuota() for each quota, but rearms the quotas that are already set with
+    // one updateQuotas() call. Returns the first error, after trying all of them.
+    int setInterfaceQuotas(const std::vector<std::pair<std::string, int64_t>>& quotas);
 
     int setGlobalAlert(int64_t bytes);
     int removeGlobalAlert();
@@ -61,6 +65,9 @@ public:
     int setInterfaceAlert(const std::string& iface, int64_t bytes);
     int removeInterfaceAlert(const std::string& iface);
 
+    // The caller must hold |lock|.
+    void dumpProto(android::net::netd::BandwidthControllerProto* proto) const;
+
     static const char LOCAL_INPUT[];
     static const char LOCAL_FORWARD[];
     static const char LOCAL_OUTPUT[];
@@ -93,6 +100,11 @@ public:
     int runIptablesAlertFwdCmd(IptOp op, const std::string& alertName, int64_t bytes);
 
     int updateQuota(const std::string& alertName, int64_t bytes);
+    // Rearms several quotas at once, writing each through its cached /proc/net/xt_quota file.
+    // Returns the first error, after trying all of them.
+    int updateQuotas(const std::vector<std::pair<std::string, int64_t>>& quotas);
+    // Closes the cached file of a quota whose rule is being removed.
+    void forgetQuotaFile(const std::string& quotaName) { mQuotaFiles.erase(quotaName); }
 
     int setCostlyAlert(const std::string& costName, int64_t bytes, int64_t* alertBytes);
     int removeCostlyAlert(const std::string& costName, int64_t* alertBytes);
@@ -103,8 +115,12 @@ public:
      * If doClean then remove the tables also.
      * Deals with both ip4 and ip6 tables.
      */
-    void flushExistingCostlyTables(bool doClean);
-    static void parseAndFlushCostlyTables(const std::string& ruleList, bool doRemove);
+    int flushExistingCostlyTables(bool doClean);
+    // Returns the chains that were flushed.
+    static std::vector<std::string> parseAndFlushCostlyTables(const std::string& ruleList,
+                                                              bool doRemove);
+    // Flushes, and if doRemove also deletes, the given bw_costly_<iface> chains.
+    static void flushCostlyTables(const std::vector<std::string>& chains, bool doRemove);
 
     /*
      * Attempt to flush our tables.
@@ -128,6 +144,17 @@ public:
 
     std::map<std::string, QuotaInfo> mQuotaIfaces;
     std::set<std::string> mSharedQuotaIfaces;
+    // Open /proc/net/xt_quota/<name> files by quota name, so that rearming a quota or alert is a
+    // single write. xt_quota2 ignores the file offset, so the files never need to be rewound.
+    std::map<std::string, android::netdutils::UniqueFd> mQuotaFiles;
+    // True once the bw_costly_<iface> chains left by a previous netd instance have been found and
+    // flushed. From then on, every such chain is either named by mQuotaIfaces or in
+    // mLeftoverCostlyChains, and flushing them does not need to list the filter table.
+    bool mCostlyChainsReconciled = false;
+    // bw_costly_<iface> chains that were flushed but not deleted, e.g., by
+    // enableBandwidthControl(), which then forgets their interfaces. Deleted by the next
+    // flushCleanTables(true), or by removeInterfaceQuota().
+    std::set<std::string> mLeftoverCostlyChains;
 };
 
 #endif
@@ -46,9 +46,43 @@ using ::testing::StrictMock;
 using android::base::Join;
 using android::base::StringPrintf;
 using android::net::TunInterface;
-using android::netdutils::UniqueFile;
+using android::netdutils::Fd;
+using android::netdutils::Slice;
+using android::netdutils::statusFromErrno;
+using android::netdutils::StatusOr;
+using android::netdutils::UniqueFd;
 using android::netdutils::status::ok;
 
+// What enableBandwidthControl() sets up after flushing the chains.
+// clang-format off
+const std::string kBasicAccountingCommands =
+        "*filter\n"
+        "-A bw_INPUT -j bw_global_alert\n"
+        "-A bw_INPUT -p esp -j RETURN\n"
+        "-A bw_INPUT -m mark --mark 0x100000/0x100000 -j RETURN\n"
+        "-A bw_INPUT -j MARK --or-mark 0x100000\n"
+        "-A bw_OUTPUT -j bw_global_alert\n"
+        "-A bw_costly_shared -j bw_penalty_box\n"
+        "-I bw_penalty_box -m bpf --object-pinned " XT_BPF_DENYLIST_PROG_PATH " -j REJECT\n"
+        "-A bw_penalty_box -j bw_happy_box\n"
+        "-A bw_happy_box -j bw_data_saver\n"
+        "-A bw_data_saver -j RETURN\n"
+        "-I bw_happy_box -m bpf --object-pinned " XT_BPF_ALLOWLIST_PROG_PATH " -j RETURN\n"
+        "COMMIT\n"
+        "*raw\n"
+        "-A bw_raw_PREROUTING -m mark --mark 0xdeadc1a7 -j DROP\n"
+        "-A bw_raw_PREROUTING -i ipsec+ -j RETURN\n"
+        "-A bw_raw_PREROUTING -m policy --pol ipsec --dir in -j RETURN\n"
+        "-A bw_raw_PREROUTING -m bpf --object-pinned " XT_BPF_INGRESS_PROG_PATH "\n"
+        "COMMIT\n"
+        "*mangle\n"
+        "-A bw_mangle_POSTROUTING -o ipsec+ -j RETURN\n"
+        "-A bw_mangle_POSTROUTING -m policy --pol ipsec --dir out -j RETURN\n"
+        "-A bw_mangle_POSTROUTING -j MARK --set-mark 0x0/0x100000\n"
+        "-A bw_mangle_POSTROUTING -m bpf --object-pinned " XT_BPF_EGRESS_PROG_PATH "\n"
+        "COMMIT\n";
+// clang-format on
+
 class BandwidthControllerTest : public IptablesBaseTest {
 protected:
     BandwidthControllerTest() {
@@ -66,7 +100,7 @@ protected:
     }
 
     void expectSetupCommands(const std::string& expectedClean,
-                             const std::string& expectedAccounting) {
+                             const std::string& expectedAccounting, bool expectListing = true) {
         std::string expectedList =
             "*filter\n"
             "-S\n"
@@ -90,7 +124,10 @@ protected:
                 ":bw_mangle_POSTROUTING -\n"
                 "COMMIT\n";
 
-        ExpectedIptablesCommands expected = {{ V4, expectedList }};
+        ExpectedIptablesCommands expected;
+        if (expectListing) {
+            expected.push_back({ V4, expectedList });
+        }
         if (expectedClean.size()) {
             expected.push_back({ V4V6, expectedClean });
         }
@@ -114,19 +151,34 @@ protected:
 
     int removeCostlyAlert(const std::string& a, int64_t* b) { return mBw.removeCostlyAlert(a, b); }
 
-    void expectUpdateQuota(uint64_t quota) {
-        uintptr_t dummy;
-        FILE* dummyFile = reinterpret_cast<FILE*>(&dummy);
-
-        EXPECT_CALL(mSyscalls, fopen(_, _)).WillOnce(Return(ByMove(UniqueFile(dummyFile))));
-        EXPECT_CALL(mSyscalls, vfprintf(dummyFile, _, _))
-            .WillOnce(Invoke([quota](FILE*, const std::string&, va_list ap) {
-                EXPECT_EQ(quota, va_arg(ap, uint64_t));
-                return 0;
-            }));
-        EXPECT_CALL(mSyscalls, fclose(dummyFile)).WillOnce(Return(ok));
+    int updateQuotas(const std::vector<std::pair<std::string, int64_t>>& quotas) {
+        return mBw.updateQuotas(quotas);
+    }
+
+    void forgetQuotaFile(const std::string& quotaName) { mBw.forgetQuotaFile(quotaName); }
+
+    // Expects the quota file to be opened, and closed again when its rule is removed.
+    void expectOpenQuota(const std::string& quotaName, Fd fd) {
+        EXPECT_CALL(mSyscalls, open("/proc/net/xt_quota/" + quotaName, _, _))
+                .WillOnce(Return(ByMove(UniqueFd(fd))));
+        EXPECT_CALL(mSyscalls, close(fd)).WillOnce(Return(ok));
     }
 
+    void expectWriteQuota(Fd fd, uint64_t quota) {
+        EXPECT_CALL(mSyscalls, write(fd, _))
+                .WillOnce(Invoke([quota](Fd, const Slice buf) -> StatusOr<size_t> {
+                    EXPECT_EQ(StringPrintf("%" PRIu64 "\n", quota), toString(buf));
+                    return buf.size();
+                }));
+    }
+
+    void expectUpdateQuota(const std::string& quotaName, uint64_t quota) {
+        expectOpenQuota(quotaName, kQuotaFd);
+        expectWriteQuota(kQuotaFd, quota);
+    }
+
+    static constexpr int kQuotaFd = 1001;
+
     StrictMock<android::netdutils::ScopedMockSyscalls> mSyscalls;
 };
 
@@ -170,38 +222,10 @@ TEST_F(BandwidthControllerTest, TestEnableBandwidthControl) {
             "-N unrelated\n");
 
     // ... so none are flushed or deleted.
-    // clang-format off
     static const std::string expectedClean = "";
-    static const std::string expectedAccounting =
-            "*filter\n"
-            "-A bw_INPUT -j bw_global_alert\n"
-            "-A bw_INPUT -p esp -j RETURN\n"
-            "-A bw_INPUT -m mark --mark 0x100000/0x100000 -j RETURN\n"
-            "-A bw_INPUT -j MARK --or-mark 0x100000\n"
-            "-A bw_OUTPUT -j bw_global_alert\n"
-            "-A bw_costly_shared -j bw_penalty_box\n"
-            "-I bw_penalty_box -m bpf --object-pinned " XT_BPF_DENYLIST_PROG_PATH " -j REJECT\n"
-            "-A bw_penalty_box -j bw_happy_box\n"
-            "-A bw_happy_box -j bw_data_saver\n"
-            "-A bw_data_saver -j RETURN\n"
-            "-I bw_happy_box -m bpf --object-pinned " XT_BPF_ALLOWLIST_PROG_PATH " -j RETURN\n"
-            "COMMIT\n"
-            "*raw\n"
-            "-A bw_raw_PREROUTING -m mark --mark 0xdeadc1a7 -j DROP\n"
-            "-A bw_raw_PREROUTING -i ipsec+ -j RETURN\n"
-            "-A bw_raw_PREROUTING -m policy --pol ipsec --dir in -j RETURN\n"
-            "-A bw_raw_PREROUTING -m bpf --object-pinned " XT_BPF_INGRESS_PROG_PATH "\n"
-            "COMMIT\n"
-            "*mangle\n"
-            "-A bw_mangle_POSTROUTING -o ipsec+ -j RETURN\n"
-            "-A bw_mangle_POSTROUTING -m policy --pol ipsec --dir out -j RETURN\n"
-            "-A bw_mangle_POSTROUTING -j MARK --set-mark 0x0/0x100000\n"
-            "-A bw_mangle_POSTROUTING -m bpf --object-pinned " XT_BPF_EGRESS_PROG_PATH "\n"
-            "COMMIT\n";
-    // clang-format on
 
     mBw.enableBandwidthControl();
-    expectSetupCommands(expectedClean, expectedAccounting);
+    expectSetupCommands(expectedClean, kBasicAccountingCommands);
 }
 
 TEST_F(BandwidthControllerTest, TestDisableBandwidthControl) {
@@ -306,7 +330,7 @@ TEST_F(BandwidthControllerTest, TestSetInterfaceQuota) {
 
     constexpr uint64_t kNewQuota = kOldQuota + 1;
     expected = {};
-    expectUpdateQuota(kNewQuota);
+    expectUpdateQuota(iface, kNewQuota);
     EXPECT_EQ(0, mBw.setInterfaceQuota(iface, kNewQuota));
     expectIptablesRestoreCommands(expected);
 
@@ -315,6 +339,84 @@ TEST_F(BandwidthControllerTest, TestSetInterfaceQuota) {
     expectIptablesRestoreCommands(expected);
 }
 
+TEST_F(BandwidthControllerTest, TestSetInterfaceQuotas) {
+    constexpr uint64_t kOldQuota = 123456;
+    const std::string iface = mTun.name();
+    EXPECT_EQ(0, mBw.setInterfaceQuota(iface, kOldQuota));
+    expectIptablesRestoreCommands(makeInterfaceQuotaCommands(iface, 1, kOldQuota));
+
+    // The new quota gets its rules, and the existing one is only rearmed.
+    const std::string newIface = "wlan5";
+    constexpr uint64_t kNewQuota = kOldQuota + 1;
+    expectUpdateQuota(iface, kNewQuota);
+    EXPECT_EQ(0, mBw.setInterfaceQuotas({{iface, kNewQuota}, {newIface, kOldQuota}}));
+    expectIptablesRestoreCommands(makeInterfaceQuotaCommands(newIface, 1, kOldQuota));
+
+    std::vector<std::string> expected = removeInterfaceQuotaCommands(iface);
+    EXPECT_EQ(0, mBw.removeInterfaceQuota(iface));
+    expectIptablesRestoreCommands(expected);
+    expected = removeInterfaceQuotaCommands(newIface);
+    EXPECT_EQ(0, mBw.removeInterfaceQuota(newIface));
+    expectIptablesRestoreCommands(expected);
+}
+
+TEST_F(BandwidthControllerTest, TestDisableBandwidthControlAfterSetup) {
+    addIptablesRestoreOutput(
+        "-P OUTPUT ACCEPT\n"
+        "-N bw_costly_rmnet_data0\n");
+    std::string expectedCleanCmds =
+        "*filter\n"
+        ":bw_costly_rmnet_data0 -\n"
+        "-X bw_costly_rmnet_data0\n"
+        "COMMIT\n";
+    mBw.setupIptablesHooks();
+    expectSetupCommands(expectedCleanCmds, "");
+
+    const std::string iface = mTun.name();
+    EXPECT_EQ(0, mBw.setInterfaceQuota(iface, 123456));
+    expectIptablesRestoreCommands(makeInterfaceQuotaCommands(iface, 1, 123456));
+
+    // Once the leftover chains are gone, only the chains netd created need flushing, and the
+    // filter table is not listed again.
+    expectedCleanCmds = StringPrintf(
+        "*filter\n"
+        ":bw_costly_%s -\n"
+        "COMMIT\n", iface.c_str());
+    mBw.disableBandwidthControl();
+    expectSetupCommands(expectedCleanCmds, "", false);
+}
+
+TEST_F(BandwidthControllerTest, TestEnableBandwidthControlKeepsTrackOfFlushedChains) {
+    addIptablesRestoreOutput("-P OUTPUT ACCEPT\n");
+    mBw.setupIptablesHooks();
+    expectSetupCommands("", "");
+
+    const std::string iface = mTun.name();
+    EXPECT_EQ(0, mBw.setInterfaceQuota(iface, 123456));
+    expectIptablesRestoreCommands(makeInterfaceQuotaCommands(iface, 1, 123456));
+
+    // Enabling flushes the chain of the interface and forgets its quota...
+    const std::string flushCmds = StringPrintf(
+        "*filter\n"
+        ":bw_costly_%s -\n"
+        "COMMIT\n", iface.c_str());
+    mBw.enableBandwidthControl();
+    expectSetupCommands(flushCmds, kBasicAccountingCommands, false);
+
+    // ... but the chain still exists, so it is flushed again, and deleted when cleaning.
+    mBw.disableBandwidthControl();
+    expectSetupCommands(flushCmds, "", false);
+    const std::string cleanCmds = StringPrintf(
+        "*filter\n"
+        ":bw_costly_%s -\n"
+        "-X bw_costly_%s\n"
+        "COMMIT\n", iface.c_str(), iface.c_str());
+    mBw.setupIptablesHooks();
+    expectSetupCommands(cleanCmds, "", false);
+    mBw.disableBandwidthControl();
+    expectSetupCommands("", "", false);
+}
+
 const std::vector<std::string> makeInterfaceSharedQuotaCommands(const std::string& iface,
                                                                 int ruleIndex, int64_t quota,
                                                                 bool insertQuota) {
@@ -381,7 +483,7 @@ TEST_F(BandwidthControllerTest, TestSetInterfaceSharedQuotaUpdate) {
 
     constexpr uint64_t kNewQuota = kOldQuota + 1;
     expected = {};
-    expectUpdateQuota(kNewQuota);
+    expectUpdateQuota("shared", kNewQuota);
     EXPECT_EQ(0, mBw.setInterfaceSharedQuota(iface, kNewQuota));
     expectIptablesRestoreCommands(expected);
 
@@ -446,7 +548,7 @@ TEST_F(BandwidthControllerTest, CostlyAlert) {
     expectIptablesRestoreCommands(expected);
 
     expected = {};
-    expectUpdateQuota(kQuota);
+    expectUpdateQuota("sharedAlert", kQuota);
     EXPECT_EQ(0, setCostlyAlert("shared", kQuota + 1, &alertBytes));
     EXPECT_EQ(kQuota + 1, alertBytes);
     expectIptablesRestoreCommands(expected);
@@ -461,3 +563,59 @@ TEST_F(BandwidthControllerTest, CostlyAlert) {
     expectIptablesRestoreCommands(expected);
 }
 
+TEST_F(BandwidthControllerTest, GlobalAlertRearmReusesQuotaFile) {
+    constexpr int64_t kAlert = 123456;
+    std::vector<std::string> expected = {
+            "*filter\n"
+            "-I bw_global_alert -m quota2 ! --quota 123456 --name globalAlert\n"
+            "COMMIT\n"};
+    EXPECT_EQ(0, mBw.setGlobalAlert(kAlert));
+    expectIptablesRestoreCommands(expected);
+
+    // The first rearm opens the quota file, and later ones only write to it.
+    expected = {};
+    expectUpdateQuota("globalAlert", kAlert + 1);
+    EXPECT_EQ(0, mBw.setGlobalAlert(kAlert + 1));
+    expectWriteQuota(kQuotaFd, kAlert + 2);
+    EXPECT_EQ(0, mBw.setGlobalAlert(kAlert + 2));
+    expectIptablesRestoreCommands(expected);
+
+    expected = {
+            "*filter\n"
+            "-D bw_global_alert -m quota2 ! --quota 123458 --name globalAlert\n"
+            "COMMIT\n"};
+    EXPECT_EQ(0, mBw.removeGlobalAlert());
+    expectIptablesRestoreCommands(expected);
+}
+
+TEST_F(BandwidthControllerTest, UpdateQuotas) {
+    constexpr int kAlertFd = 1002;
+    expectUpdateQuota("shared", 1000);
+    expectOpenQuota("sharedAlert", kAlertFd);
+    expectWriteQuota(kAlertFd, 500);
+    EXPECT_EQ(0, updateQuotas({{"shared", 1000}, {"sharedAlert", 500}}));
+
+    // A cached file that stopped working is reopened.
+    constexpr int kNewAlertFd = 1003;
+    expectWriteQuota(kQuotaFd, 2000);
+    EXPECT_CALL(mSyscalls, write(kAlertFd, _))
+            .WillOnce(Return(ByMove(statusFromErrno(EIO, "write() failed"))));
+    expectOpenQuota("sharedAlert", kNewAlertFd);
+    expectWriteQuota(kNewAlertFd, 1500);
+    EXPECT_EQ(0, updateQuotas({{"shared", 2000}, {"sharedAlert", 1500}}));
+
+    // Invalid names fail without stopping the others.
+    expectWriteQuota(kQuotaFd, 3000);
+    EXPECT_EQ(-EINVAL, updateQuotas({{"bad/name", 1}, {"shared", 3000}}));
+
+    // So do quotas whose file cannot be written even once reopened.
+    constexpr int kGlobalAlertFd = 1004;
+    expectOpenQuota("globalAlert", kGlobalAlertFd);
+    EXPECT_CALL(mSyscalls, write(kGlobalAlertFd, _))
+            .WillOnce(Return(ByMove(statusFromErrno(ENOENT, "write() failed"))));
+    expectWriteQuota(kQuotaFd, 4000);
+    EXPECT_EQ(-ENOENT, updateQuotas({{"globalAlert", 1}, {"shared", 4000}}));
+
+    forgetQuotaFile("shared");
+    forgetQuotaFile("sharedAlert");
+}
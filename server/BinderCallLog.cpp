@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BinderCallLog.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+uint32_t BinderCallLog::methodId(std::string_view name) {
+    const uint64_t h = hash(name) | 1;  // Never 0, which marks a free entry.
+    for (size_t probe = 0; probe < kMaxMethods; probe++) {
+        const uint32_t id = (h + probe) % kMaxMethods;
+        Method& method = mMethods[id];
+        uint64_t current = method.hash.load(std::memory_order_acquire);
+        if (current == 0 &&
+            method.hash.compare_exchange_strong(current, h, std::memory_order_acq_rel)) {
+            const size_t len = std::min(name.size(), sizeof(method.name) - 1);
+            memcpy(method.name, name.data(), len);
+            method.name[len] = '\0';
+            method.ready.store(true, std::memory_order_release);
+            return id;
+        }
+        // If the exchange failed, |current| is the hash that another caller stored.
+        if (current == h) return id;
+    }
+    return kUnknownMethod;
+}
+
+std::string BinderCallLog::methodName(uint32_t id) const {
+    if (id >= kMaxMethods || !mMethods[id].ready.load(std::memory_order_acquire)) return "?";
+    return mMethods[id].name;
+}
+
+void BinderCallLog::record(std::string_view method, uint64_t argsHash,
+                           std::chrono::microseconds duration, int32_t exceptionCode,
+                           int32_t errorCode) {
+    const uint32_t id = methodId(method);
+    const int64_t timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::system_clock::now().time_since_epoch())
+                                   .count();
+
+    const uint64_t index = mNext.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = mSlots[index % kCapacity];
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timeNs.store(timeNs, std::memory_order_relaxed);
+    slot.argsHash.store(argsHash, std::memory_order_relaxed);
+    slot.durationUs.store(duration.count(), std::memory_order_relaxed);
+    slot.methodId.store(id, std::memory_order_relaxed);
+    slot.exceptionCode.store(exceptionCode, std::memory_order_relaxed);
+    slot.errorCode.store(errorCode, std::memory_order_relaxed);
+    slot.seq.store(2 * index + 2, std::memory_order_release);
+}
+
+std::vector<BinderCallLog::Entry> BinderCallLog::getEntries() const {
+    std::vector<std::pair<uint64_t, Entry>> entries;
+    entries.reserve(kCapacity);
+    for (const Slot& slot : mSlots) {
+        const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq == 0 || (seq & 1)) continue;
+        const int64_t timeNs = slot.timeNs.load(std::memory_order_relaxed);
+        const uint64_t argsHash = slot.argsHash.load(std::memory_order_relaxed);
+        const int64_t durationUs = slot.durationUs.load(std::memory_order_relaxed);
+        const uint32_t id = slot.methodId.load(std::memory_order_relaxed);
+        const int32_t exceptionCode = slot.exceptionCode.load(std::memory_order_relaxed);
+        const int32_t errorCode = slot.errorCode.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+
+        Entry entry = {
+                .time = std::chrono::system_clock::time_point(
+                        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                                std::chrono::nanoseconds(timeNs))),
+                .method = methodName(id),
+                .argsHash = argsHash,
+                .duration = std::chrono::microseconds(durationUs),
+                .exceptionCode = exceptionCode,
+                .errorCode = errorCode,
+        };
+        entries.emplace_back(seq, std::move(entry));
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<Entry> result;
+    result.reserve(entries.size());
+    for (auto& [seq, entry] : entries) result.push_back(std::move(entry));
+    return result;
+}
+
+void BinderCallLog::dump(DumpWriter& dw) const {
+    for (const auto& entry : getEntries()) {
+        using std::chrono::duration_cast;
+        const auto sinceEpoch = entry.time.time_since_epoch();
+        const time_t seconds = duration_cast<std::chrono::seconds>(sinceEpoch).count();
+        const int millis = duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000;
+        tm local;
+        char timestamp[32] = "";
+        if (localtime_r(&seconds, &local)) strftime(timestamp, sizeof(timestamp), "%T", &local);
+
+        std::string status = "ok";
+        if (entry.exceptionCode != 0) {
+            status = "exception " + std::to_string(entry.exceptionCode);
+            if (entry.errorCode != 0) status += " error " + std::to_string(entry.errorCode);
+        }
+        dw.println("%s.%03d %s(args %016" PRIx64 ") -> %s <%.2fms>", timestamp, millis,
+                   entry.method.c_str(), entry.argsHash, status.c_str(),
+                   entry.duration.count() / 1000.0);
+    }
+}
+
+}  // namespace android::net
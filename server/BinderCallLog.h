@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// The most recent binder calls, as fixed-size binary records in a lock-free ring buffer. Recording
+// a call neither allocates nor takes a lock; records are only formatted by dump(). Arguments are
+// kept as a hash, so that repeated calls with the same arguments can be told apart from others.
+//
+// Each slot is a seqlock: readers skip slots that are being written. A record can be lost if
+// kCapacity other calls are recorded while it is being written.
+class BinderCallLog {
+  public:
+    static constexpr size_t kCapacity = 1024;
+    // Calls to methods beyond this many distinct ones are logged with an unknown method name.
+    static constexpr size_t kMaxMethods = 256;
+
+    struct Entry {
+        std::chrono::system_clock::time_point time;
+        std::string method;
+        uint64_t argsHash;
+        std::chrono::microseconds duration;
+        int32_t exceptionCode;
+        int32_t errorCode;  // For service-specific exceptions.
+    };
+
+    void record(std::string_view method, uint64_t argsHash, std::chrono::microseconds duration,
+                int32_t exceptionCode, int32_t errorCode);
+
+    // The recorded calls, oldest first.
+    std::vector<Entry> getEntries() const;
+
+    void dump(netdutils::DumpWriter& dw) const;
+
+    // 64-bit FNV-1a. Hash several strings by passing the previous result as |seed|.
+    static constexpr uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+    static constexpr uint64_t hash(std::string_view data, uint64_t seed = kHashSeed) {
+        for (const unsigned char c : data) {
+            seed ^= c;
+            seed *= 0x100000001b3ULL;
+        }
+        return seed;
+    }
+
+  private:
+    static constexpr uint32_t kUnknownMethod = kMaxMethods;
+
+    struct Slot {
+        // 2 * (index + 1) once call number |index| is written, odd while it is being written.
+        std::atomic_uint64_t seq{0};
+        std::atomic_int64_t timeNs{0};
+        std::atomic_uint64_t argsHash{0};
+        std::atomic_int64_t durationUs{0};
+        std::atomic_uint32_t methodId{0};
+        std::atomic_int32_t exceptionCode{0};
+        std::atomic_int32_t errorCode{0};
+    };
+
+    // An open-addressing table of method names, which are never removed.
+    struct Method {
+        std::atomic_uint64_t hash{0};  // 0 if free.
+        std::atomic_bool ready{false};  // |name| may only be read once this is set.
+        char name[64];
+    };
+
+    uint32_t methodId(std::string_view name);
+    std::string methodName(uint32_t id) const;
+
+    std::atomic_uint64_t mNext{0};
+    Slot mSlots[kCapacity];
+    Method mMethods[kMaxMethods];
+};
+
+}  // namespace android::net
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "BinderCallLog.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+TEST(BinderCallLogTest, RecordsCallsInOrder) {
+    auto log = std::make_unique<BinderCallLog>();
+    const uint64_t argsHash = BinderCallLog::hash("wlan0");
+    log->record("interfaceGetCfg", argsHash, 1500us, 0, 0);
+    log->record("firewallSetFirewallType", 7, 20us, -8 /* EX_SERVICE_SPECIFIC */, 22);
+
+    const auto entries = log->getEntries();
+    ASSERT_EQ(2U, entries.size());
+    EXPECT_EQ("interfaceGetCfg", entries[0].method);
+    EXPECT_EQ(argsHash, entries[0].argsHash);
+    EXPECT_EQ(1500us, entries[0].duration);
+    EXPECT_EQ(0, entries[0].exceptionCode);
+    EXPECT_EQ("firewallSetFirewallType", entries[1].method);
+    EXPECT_EQ(-8, entries[1].exceptionCode);
+    EXPECT_EQ(22, entries[1].errorCode);
+    EXPECT_LE(entries[0].time, entries[1].time);
+}
+
+TEST(BinderCallLogTest, KeepsMostRecentCalls) {
+    auto log = std::make_unique<BinderCallLog>();
+    for (size_t i = 0; i < BinderCallLog::kCapacity + 10; i++) {
+        log->record("isAlive", i, 1us, 0, 0);
+    }
+    const auto entries = log->getEntries();
+    ASSERT_EQ(BinderCallLog::kCapacity, entries.size());
+    EXPECT_EQ(10U, entries.front().argsHash);
+    EXPECT_EQ(BinderCallLog::kCapacity + 9, entries.back().argsHash);
+}
+
+TEST(BinderCallLogTest, TooManyMethodsAreUnknown) {
+    auto log = std::make_unique<BinderCallLog>();
+    for (size_t i = 0; i < BinderCallLog::kMaxMethods + 1; i++) {
+        log->record("method" + std::to_string(i), i, 1us, 0, 0);
+    }
+    const auto entries = log->getEntries();
+    ASSERT_EQ(BinderCallLog::kMaxMethods + 1, entries.size());
+    EXPECT_EQ("method0", entries.front().method);
+    EXPECT_EQ("?", entries.back().method);
+
+    // Methods already in the table are still named.
+    log->record("method0", 0, 1us, 0, 0);
+    EXPECT_EQ("method0", log->getEntries().back().method);
+}
+
+TEST(BinderCallLogTest, ConcurrentCallers) {
+    auto log = std::make_unique<BinderCallLog>();
+    constexpr int kThreads = 4;
+    constexpr int kCallsPerThread = 100;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&log, t] {
+            const std::string method = "method" + std::to_string(t);
+            for (int i = 0; i < kCallsPerThread; i++) log->record(method, t, 1us, 0, 0);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    const auto entries = log->getEntries();
+    ASSERT_EQ(static_cast<size_t>(kThreads * kCallsPerThread), entries.size());
+    for (const auto& entry : entries) {
+        EXPECT_EQ("method" + std::to_string(entry.argsHash), entry.method);
+    }
+}
+
+}  // namespace android::net
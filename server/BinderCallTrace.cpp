@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "BinderCallTrace.h"
+
+#include <android-base/parseint.h>
+
+namespace android::net {
+
+namespace {
+
+constexpr char kSeparator = '\t';
+
+// The arguments of INetd methods that hold keys. Names are unique enough across INetd that the
+// method does not need to be checked.
+constexpr std::string_view kSecretArgs[] = {"authKey", "cryptKey", "aeadKey"};
+
+bool isSecret(std::string_view name) {
+    for (const auto secret : kSecretArgs) {
+        if (name == secret) return true;
+    }
+    return false;
+}
+
+void appendEscaped(std::string* out, std::string_view value) {
+    for (const char c : value) {
+        switch (c) {
+            case '\\':
+                out->append("\\\\");
+                break;
+            case '\t':
+                out->append("\\t");
+                break;
+            case '\n':
+                out->append("\\n");
+                break;
+            default:
+                out->push_back(c);
+        }
+    }
+}
+
+std::string unescape(std::string_view value) {
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] != '\\' || i + 1 == value.size()) {
+            out.push_back(value[i]);
+            continue;
+        }
+        switch (value[++i]) {
+            case 't':
+                out.push_back('\t');
+                break;
+            case 'n':
+                out.push_back('\n');
+                break;
+            default:
+                out.push_back(value[i]);
+        }
+    }
+    return out;
+}
+
+std::vector<std::string_view> splitFields(std::string_view line) {
+    std::vector<std::string_view> fields;
+    while (true) {
+        const size_t end = line.find(kSeparator);
+        fields.push_back(line.substr(0, end));
+        if (end == std::string_view::npos) return fields;
+        line.remove_prefix(end + 1);
+    }
+}
+
+}  // namespace
+
+void BinderCallTrace::record(std::string_view method, const Args& args,
+                             std::chrono::steady_clock::time_point now) {
+    if (!mEnabled) return;
+    std::lock_guard guard(mLock);
+    if (!mFirstCall) mFirstCall = now;
+    Call call = {
+            .offset = std::chrono::duration_cast<std::chrono::microseconds>(now - *mFirstCall),
+            .method = std::string(method),
+            .args = args,
+    };
+    for (auto& [name, value] : call.args) {
+        if (isSecret(name)) value = kRedacted;
+    }
+    if (mLines.size() == kMaxCalls) mLines.pop_front();
+    mLines.push_back(formatCall(call));
+}
+
+std::string BinderCallTrace::getTrace() const {
+    std::lock_guard guard(mLock);
+    std::string trace;
+    for (const std::string& line : mLines) {
+        trace.append(line).push_back('\n');
+    }
+    return trace;
+}
+
+std::string BinderCallTrace::formatCall(const Call& call) {
+    std::string line = std::to_string(call.offset.count());
+    line.push_back(kSeparator);
+    appendEscaped(&line, call.method);
+    for (const auto& [name, value] : call.args) {
+        line.push_back(kSeparator);
+        appendEscaped(&line, name);
+        line.push_back('=');
+        appendEscaped(&line, value);
+    }
+    return line;
+}
+
+std::optional<BinderCallTrace::Call> BinderCallTrace::parseCall(std::string_view line) {
+    if (line.empty() || line[0] == '#') return std::nullopt;
+    const std::vector<std::string_view> fields = splitFields(line);
+    int64_t offsetUs;
+    if (fields.size() < 2 || !base::ParseInt(std::string(fields[0]), &offsetUs, int64_t{0}) ||
+        fields[1].empty()) {
+        return std::nullopt;
+    }
+
+    Call call = {
+            .offset = std::chrono::microseconds(offsetUs),
+            .method = unescape(fields[1]),
+    };
+    for (size_t i = 2; i < fields.size(); i++) {
+        // Names never contain '=', so the first one ends the name.
+        const size_t equals = fields[i].find('=');
+        if (equals == std::string_view::npos) return std::nullopt;
+        call.args.emplace_back(unescape(fields[i].substr(0, equals)),
+                               unescape(fields[i].substr(equals + 1)));
+    }
+    return call;
+}
+
+}  // namespace android::net
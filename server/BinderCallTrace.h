@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Binder calls with all their arguments, as text that tests/benchmarks/binder_replay_benchmark.cpp
+// can replay. Unlike BinderCallLog this formats and allocates on every call, so it is off unless
+// persist.netd.binder_call_trace is set when netd starts. "dumpsys netd --binder-trace" writes
+// the calls recorded so far, one per line:
+//
+//   <microseconds since the first call>\t<method>\t<arg>=<value>\t...
+//
+// Values are as BnNetd::logFunc formats them, with backslashes, tabs and newlines escaped.
+// Arguments that hold secrets, such as IPsec keys, are replaced by kRedacted, so the trace can be
+// shared; replaying a call that needs one of them fails.
+class BinderCallTrace {
+  public:
+    static constexpr size_t kMaxCalls = 4096;
+    static constexpr char kRedacted[] = "<redacted>";
+
+    using Args = std::vector<std::pair<std::string, std::string>>;
+
+    struct Call {
+        std::chrono::microseconds offset;
+        std::string method;
+        Args args;
+    };
+
+    explicit BinderCallTrace(bool enabled) : mEnabled(enabled) {}
+
+    bool enabled() const { return mEnabled; }
+
+    // Does nothing unless enabled. Once kMaxCalls calls are recorded, the oldest are dropped.
+    // Secret arguments are redacted before they are stored.
+    void record(std::string_view method, const Args& args,
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // The recorded calls, one line each, oldest first.
+    std::string getTrace() const;
+
+    static std::string formatCall(const Call& call);
+    // Returns nullopt for lines that are not calls, such as blank lines and # comments.
+    static std::optional<Call> parseCall(std::string_view line);
+
+  private:
+    const bool mEnabled;
+
+    mutable std::mutex mLock;
+    std::optional<std::chrono::steady_clock::time_point> mFirstCall GUARDED_BY(mLock);
+    std::deque<std::string> mLines GUARDED_BY(mLock);
+};
+
+}  // namespace android::net
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "BinderCallTrace.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+TEST(BinderCallTraceTest, DisabledRecordsNothing) {
+    BinderCallTrace trace(false);
+    trace.record("networkSetDefault", {{"netId", "100"}});
+    EXPECT_EQ("", trace.getTrace());
+}
+
+TEST(BinderCallTraceTest, RecordsOffsetsFromFirstCall) {
+    BinderCallTrace trace(true);
+    const auto start = std::chrono::steady_clock::now();
+    trace.record("networkCreate", {{"config", "NativeNetworkConfig{netId: 100}"}}, start);
+    trace.record("networkAddInterface", {{"netId", "100"}, {"iface", "wlan0"}}, start + 1500us);
+    trace.record("networkClearDefault", {}, start + 2ms);
+    EXPECT_EQ("0\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 100}\n"
+              "1500\tnetworkAddInterface\tnetId=100\tiface=wlan0\n"
+              "2000\tnetworkClearDefault\n",
+              trace.getTrace());
+}
+
+TEST(BinderCallTraceTest, RedactsKeys) {
+    BinderCallTrace trace(true);
+    trace.record("ipSecAddSecurityAssociation",
+                 {{"spi", "1234"},
+                  {"authKey", "[1, 2, 3]"},
+                  {"cryptKey", "[4, 5, 6]"},
+                  {"aeadKey", "[7, 8, 9]"}});
+    EXPECT_EQ("0\tipSecAddSecurityAssociation\tspi=1234\tauthKey=<redacted>\t"
+              "cryptKey=<redacted>\taeadKey=<redacted>\n",
+              trace.getTrace());
+}
+
+TEST(BinderCallTraceTest, KeepsMostRecentCalls) {
+    BinderCallTrace trace(true);
+    for (size_t i = 0; i < BinderCallTrace::kMaxCalls + 1; i++) {
+        trace.record("method" + std::to_string(i), {});
+    }
+    const std::string text = trace.getTrace();
+    EXPECT_EQ(std::string::npos, text.find("\tmethod0\n"));
+    EXPECT_NE(std::string::npos, text.find("\tmethod1\n"));
+}
+
+TEST(BinderCallTraceTest, ParsesWhatItFormats) {
+    const BinderCallTrace::Call call = {
+            .offset = 42us,
+            .method = "setProcSysNet",
+            .args = {{"ifname", "a\tb\\c\nd"}, {"value", "x=y"}, {"empty", ""}},
+    };
+    const auto parsed = BinderCallTrace::parseCall(BinderCallTrace::formatCall(call));
+    ASSERT_TRUE(parsed.has_value());
+    EXPECT_EQ(call.offset, parsed->offset);
+    EXPECT_EQ(call.method, parsed->method);
+    EXPECT_EQ(call.args, parsed->args);
+}
+
+TEST(BinderCallTraceTest, SkipsNonCalls) {
+    EXPECT_FALSE(BinderCallTrace::parseCall(""));
+    EXPECT_FALSE(BinderCallTrace::parseCall("# Wi-Fi to cellular handover"));
+    EXPECT_FALSE(BinderCallTrace::parseCall("abc\tnetworkClearDefault"));
+    EXPECT_FALSE(BinderCallTrace::parseCall("10"));
+    EXPECT_FALSE(BinderCallTrace::parseCall("10\tnetworkSetDefault\t100"));
+}
+
+}  // namespace android::net
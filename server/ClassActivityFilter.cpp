@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ClassActivityFilter.h"
+
+#include <string>
+#include <vector>
+
+#include <android-base/properties.h>
+
+using android::base::GetUintProperty;
+
+namespace android::net {
+
+namespace {
+
+constexpr char DWELL_PROPERTY[] = "persist.netd.idletimer_dwell_ms";
+constexpr unsigned MAX_DWELL_MS = 60 * 1000;
+
+}  // namespace
+
+ClassActivityFilter::ClassActivityFilter(Report report, DwellLookup dwell, Clock clock,
+                                         bool threaded)
+    : mReport(std::move(report)),
+      mDwell(std::move(dwell)),
+      mClock(std::move(clock)),
+      mThreaded(threaded) {}
+
+ClassActivityFilter::~ClassActivityFilter() {
+    std::thread thread;
+    {
+        std::lock_guard lock(mMutex);
+        mStopping = true;
+        thread = std::move(mThread);
+    }
+    mCv.notify_one();
+    if (thread.joinable()) thread.join();
+}
+
+std::chrono::milliseconds ClassActivityFilter::readDwellProperty(int label) {
+    const unsigned dflt = GetUintProperty<unsigned>(DWELL_PROPERTY, 0, MAX_DWELL_MS);
+    return std::chrono::milliseconds(GetUintProperty<unsigned>(
+            std::string(DWELL_PROPERTY) + "." + std::to_string(label), dflt, MAX_DWELL_MS));
+}
+
+void ClassActivityFilter::onChange(int label, bool isActive, int64_t timestampNs, int uid) {
+    {
+        std::lock_guard lock(mMutex);
+        auto [it, inserted] = mLabels.try_emplace(label);
+        LabelState& state = it->second;
+        if (inserted) state.dwell = mDwell(label);
+
+        if (state.reported == isActive) {
+            // Back to the reported state: whatever was held is undone.
+            state.held.reset();
+            return;
+        }
+        const auto now = mClock();
+        if (!state.reported.has_value() || now - state.reportedAt >= state.dwell) {
+            state.reported = isActive;
+            state.reportedAt = now;
+        } else {
+            const bool wasHeld = state.held.has_value();
+            state.held = Change{isActive, timestampNs, uid};
+            if (!wasHeld && mThreaded) {
+                if (!mThread.joinable()) mThread = std::thread(&ClassActivityFilter::run, this);
+                mHeldChanged = true;
+                mCv.notify_one();
+            }
+            return;
+        }
+    }
+    mReport(label, isActive, timestampNs, uid);
+}
+
+std::optional<std::chrono::steady_clock::time_point> ClassActivityFilter::flush() {
+    std::vector<std::pair<int, Change>> due;
+    std::optional<std::chrono::steady_clock::time_point> next;
+    {
+        std::lock_guard lock(mMutex);
+        const auto now = mClock();
+        for (auto& [label, state] : mLabels) {
+            if (!state.held.has_value()) continue;
+            const auto deadline = state.reportedAt + state.dwell;
+            if (deadline <= now) {
+                due.emplace_back(label, *state.held);
+                state.reported = state.held->isActive;
+                state.reportedAt = now;
+                state.held.reset();
+            } else {
+                next = std::min(next.value_or(deadline), deadline);
+            }
+        }
+    }
+    for (const auto& [label, change] : due) {
+        mReport(label, change.isActive, change.timestampNs, change.uid);
+    }
+    return next;
+}
+
+void ClassActivityFilter::run() {
+    std::unique_lock lock(mMutex);
+    while (!mStopping) {
+        mHeldChanged = false;
+        lock.unlock();
+        const auto next = flush();
+        lock.lock();
+
+        const auto woken = [this]() REQUIRES(mMutex) { return mStopping || mHeldChanged; };
+        if (next.has_value()) {
+            mCv.wait_until(lock, *next, woken);
+        } else {
+            mCv.wait(lock, woken);
+        }
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Applies hysteresis to interface class activity changes before they are reported. Once a label
+// has reported a change, further changes are held until the label's minimum dwell time has
+// passed, and a change that is undone while held is never reported. A change to the state that
+// was last reported is always dropped. With a dwell time of 0, the default, every change to a new
+// state is reported at once.
+//
+// Dwell times are read from persist.netd.idletimer_dwell_ms.<label>, or if that is not set, from
+// persist.netd.idletimer_dwell_ms, the first time a label is seen.
+class ClassActivityFilter {
+  public:
+    using Report = std::function<void(int label, bool isActive, int64_t timestampNs, int uid)>;
+    using DwellLookup = std::function<std::chrono::milliseconds(int label)>;
+    using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+    // If |threaded| is false, held changes are only reported by calling flush().
+    explicit ClassActivityFilter(Report report, DwellLookup dwell = readDwellProperty,
+                                 Clock clock = std::chrono::steady_clock::now,
+                                 bool threaded = true);
+    ~ClassActivityFilter();
+
+    // Takes a change as reported by the idle timer. |report| is called immediately, later from
+    // another thread, or not at all.
+    void onChange(int label, bool isActive, int64_t timestampNs, int uid);
+
+    // Reports the held changes whose dwell time has passed. Returns when the next held change is
+    // due, or std::nullopt if there are none. The thread calls this; it is public for testing.
+    std::optional<std::chrono::steady_clock::time_point> flush();
+
+    static std::chrono::milliseconds readDwellProperty(int label);
+
+  private:
+    struct Change {
+        bool isActive;
+        int64_t timestampNs;
+        int uid;
+    };
+
+    struct LabelState {
+        std::chrono::milliseconds dwell;
+        std::optional<bool> reported;
+        std::chrono::steady_clock::time_point reportedAt;
+        std::optional<Change> held;
+    };
+
+    void run();
+
+    const Report mReport;
+    const DwellLookup mDwell;
+    const Clock mClock;
+    const bool mThreaded;
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::map<int, LabelState> mLabels GUARDED_BY(mMutex);
+    // Set when a change is held, so that the thread recomputes when to wake up.
+    bool mHeldChanged GUARDED_BY(mMutex) = false;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    // Only started once a change is first held, so that it does not exist with no dwell times.
+    std::thread mThread GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
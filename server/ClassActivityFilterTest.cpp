@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ClassActivityFilter.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class ClassActivityFilterTest : public ::testing::Test {
+  protected:
+    using Report = std::tuple<int, bool, int64_t>;  // label, isActive, timestampNs
+
+    ClassActivityFilterTest()
+        : mFilter(
+                  [this](int label, bool isActive, int64_t timestampNs, int) {
+                      mReports.emplace_back(label, isActive, timestampNs);
+                  },
+                  [](int label) { return label == 0 ? 100ms : 0ms; }, [this] { return mNow; },
+                  false) {}
+
+    std::vector<Report> takeReports() { return std::move(mReports); }
+
+    std::chrono::steady_clock::time_point mNow;
+    std::vector<Report> mReports;
+    ClassActivityFilter mFilter;
+};
+
+TEST_F(ClassActivityFilterTest, RedundantChangesDropped) {
+    mFilter.onChange(1, true, 1, -1);
+    mFilter.onChange(1, true, 2, -1);
+    mFilter.onChange(1, false, 3, -1);
+    mFilter.onChange(1, false, 4, -1);
+    mFilter.onChange(1, true, 5, -1);
+    EXPECT_EQ(std::vector<Report>({{1, true, 1}, {1, false, 3}, {1, true, 5}}), takeReports());
+}
+
+TEST_F(ClassActivityFilterTest, FlapWithinDwellSuppressed) {
+    mFilter.onChange(0, true, 1, -1);
+    EXPECT_EQ(std::vector<Report>({{0, true, 1}}), takeReports());
+
+    mNow += 10ms;
+    mFilter.onChange(0, false, 2, -1);
+    mNow += 10ms;
+    mFilter.onChange(0, true, 3, -1);
+    EXPECT_FALSE(mFilter.flush().has_value());
+    mNow += 1s;
+    EXPECT_FALSE(mFilter.flush().has_value());
+    EXPECT_TRUE(takeReports().empty());
+}
+
+TEST_F(ClassActivityFilterTest, HeldChangeReportedAfterDwell) {
+    mFilter.onChange(0, true, 1, -1);
+    const auto reportedAt = mNow;
+    takeReports();
+
+    mNow += 10ms;
+    mFilter.onChange(0, false, 2, -1);
+    mNow += 10ms;
+    mFilter.onChange(0, true, 3, -1);
+    mFilter.onChange(0, false, 4, -1);
+    EXPECT_TRUE(takeReports().empty());
+    EXPECT_EQ(reportedAt + 100ms, mFilter.flush());
+
+    // The latest change is reported, with its own timestamp.
+    mNow = reportedAt + 100ms;
+    EXPECT_FALSE(mFilter.flush().has_value());
+    EXPECT_EQ(std::vector<Report>({{0, false, 4}}), takeReports());
+
+    // The dwell time starts again from the flush.
+    mFilter.onChange(0, true, 5, -1);
+    EXPECT_TRUE(takeReports().empty());
+    mNow += 100ms;
+    mFilter.flush();
+    EXPECT_EQ(std::vector<Report>({{0, true, 5}}), takeReports());
+}
+
+TEST_F(ClassActivityFilterTest, ChangeAfterDwellReportedImmediately) {
+    mFilter.onChange(0, false, 1, -1);
+    mNow += 100ms;
+    mFilter.onChange(0, true, 2, -1);
+    EXPECT_EQ(std::vector<Report>({{0, false, 1}, {0, true, 2}}), takeReports());
+}
+
+TEST(ClassActivityFilterThreadTest, ThreadReportsHeldChange) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<bool> reports;
+    ClassActivityFilter filter(
+            [&](int, bool isActive, int64_t, int) {
+                std::lock_guard lock(mutex);
+                reports.push_back(isActive);
+                cv.notify_one();
+            },
+            [](int) { return 20ms; });
+    filter.onChange(0, true, 1, -1);
+    filter.onChange(0, false, 2, -1);
+
+    std::unique_lock lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, 5s, [&] { return reports.size() == 2; }));
+    EXPECT_EQ(std::vector<bool>({true, false}), reports);
+}
+
+}  // namespace android::net
@@ -15,9 +15,11 @@
  */
 
 #include <cinttypes>
-#include <regex>
+#include <future>
 #include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -28,6 +30,7 @@
 
 #include "Controllers.h"
 #include "IdletimerController.h"
+#include "IptablesTokenizer.h"
 #include "NetworkController.h"
 #include "RouteController.h"
 #include "XfrmController.h"
@@ -102,25 +105,43 @@ static const std::vector<const char*> NAT_POSTROUTING = {
         TetherController::LOCAL_NAT_POSTROUTING,
 };
 
-// Commands to create child chains and to match created chains in iptables -S output. Keep in sync.
+// Command to create child chains. parseChildChains() matches the rules it creates in iptables -S
+// output. Keep in sync.
 static const char* CHILD_CHAIN_TEMPLATE = "-A %s -j %s\n";
-static const std::regex CHILD_CHAIN_REGEX("^-A ([^ ]+) -j ([^ ]+)$",
-                                          std::regex_constants::extended);
 
 }  // namespace
 
 /* static */
-std::set<std::string> Controllers::findExistingChildChains(const IptablesTarget target,
-                                                           const char* table,
-                                                           const char* parentChain) {
-    if (target == V4V6) {
-        ALOGE("findExistingChildChains only supports one protocol at a time");
-        abort();
+Controllers::ChildChainIndex Controllers::parseChildChains(const std::string& listing) {
+    ChildChainIndex index;
+    LineTokenizer lines(listing);
+    std::string_view line;
+    while (lines.next(&line)) {
+        // The only rules added by createChildChains are of the simple form
+        // "-A <parent> -j <child>". Anything with more or fewer tokens is someone else's.
+        FieldTokenizer fields(line);
+        if (fields.next() != "-A") continue;
+        std::string_view parent = fields.next();
+        if (parent.empty() || fields.next() != "-j") continue;
+        std::string_view child = fields.next();
+        if (child.empty() || !fields.done()) continue;
+        index[std::string(parent)].emplace(child);
     }
+    return index;
+}
+
+/* static */
+const Controllers::ChildChainIndex& Controllers::listChildChains(const IptablesTarget target,
+                                                                 const char* table,
+                                                                 ChildChainCache* cache) {
+    auto key = std::make_pair(target, std::string(table));
+    auto it = cache->find(key);
+    if (it != cache->end()) return it->second;
 
-    std::set<std::string> existing;
+    ChildChainIndex& index = (*cache)[key];
 
-    // List the current contents of parentChain.
+    // List the current contents of the whole table once, and answer all queries about its
+    // chains from that.
     //
     // TODO: there is no guarantee that nothing else modifies the chain in the few milliseconds
     // between when we list the existing rules and when we delete them. However:
@@ -128,32 +149,37 @@ std::set<std::string> Controllers::findExistingChildChains(const IptablesTarget
     // - While vendor code is known to add its own rules to chains created by netd, it should never
     //   be modifying the rules in childChains or the rules that hook said chains into their parent
     //   chains.
-    std::string command = StringPrintf("*%s\n-S %s\nCOMMIT\n", table, parentChain);
+    std::string command = StringPrintf("*%s\n-S\nCOMMIT\n", table);
     std::string output;
     if (Controllers::execIptablesRestoreWithOutput(target, command, &output) == -1) {
-        ALOGE("Error listing chain %s in table %s", parentChain, table);
-        return existing;
+        ALOGE("Error listing table %s", table);
+        return index;
     }
+    index = parseChildChains(output);
+    return index;
+}
 
-    // The only rules added by createChildChains are of the simple form "-A <parent> -j <child>".
-    // Find those rules and add each one's child chain to existing.
-    std::smatch matches;
-    std::stringstream stream(output);
-    std::string rule;
-    while (std::getline(stream, rule, '\n')) {
-        if (std::regex_search(rule, matches, CHILD_CHAIN_REGEX) && matches[1] == parentChain) {
-            existing.insert(matches[2]);
-        }
+/* static */
+std::set<std::string> Controllers::findExistingChildChains(const IptablesTarget target,
+                                                           const char* table,
+                                                           const char* parentChain,
+                                                           ChildChainCache* cache) {
+    if (target == V4V6) {
+        ALOGE("findExistingChildChains only supports one protocol at a time");
+        abort();
     }
 
-    return existing;
+    ChildChainCache localCache;
+    const ChildChainIndex& index = listChildChains(target, table, cache ? cache : &localCache);
+    auto it = index.find(parentChain);
+    return (it != index.end()) ? it->second : std::set<std::string>();
 }
 
 /* static */
 void Controllers::createChildChains(IptablesTarget target, const char* table,
                                     const char* parentChain,
                                     const std::vector<const char*>& childChains,
-                                    bool exclusive) {
+                                    bool exclusive, ChildChainCache* cache) {
     std::string command = StringPrintf("*%s\n", table);
 
     // We cannot just clear all the chains we create because vendor code modifies filter OUTPUT and
@@ -175,7 +201,7 @@ void Controllers::createChildChains(IptablesTarget target, const char* table,
         StringAppendF(&command, ":%s -\n", parentChain);
         StringAppendF(&command, "-F %s\n", parentChain);
     } else {
-        existingChildChains = findExistingChildChains(target, table, parentChain);
+        existingChildChains = findExistingChildChains(target, table, parentChain, cache);
     }
 
     for (const auto& childChain : childChains) {
@@ -198,12 +224,12 @@ Controllers::Controllers()
                       gLog.error("getNetdEventListener() returned nullptr. dropping wakeup event");
                       return;
                   }
-                  String16 prefix = String16(args.prefix.c_str());
-                  String16 srcIp = String16(args.srcIp.c_str());
-                  String16 dstIp = String16(args.dstIp.c_str());
+                  String16 prefix = String16(args.prefix);
+                  String16 srcIp = String16(args.srcIpString().c_str());
+                  String16 dstIp = String16(args.dstIpString().c_str());
                   listener->onWakeupEvent(prefix, args.uid, args.ethertype, args.ipNextHeader,
-                                          args.dstHw, srcIp, dstIp, args.srcPort, args.dstPort,
-                                          args.timestampNs);
+                                          args.dstHwVector(), srcIp, dstIp, args.srcPort,
+                                          args.dstPort, args.timestampNs);
               },
               &iptablesRestoreCtrl) {
     InterfaceController::initializeAll();
@@ -220,84 +246,232 @@ void Controllers::initChildChains() {
      * otherwise DROP/REJECT.
      */
 
+    // Each table is listed at most once per IP family. This is correct because each parent chain
+    // is only populated once below, and populating one parent chain never changes which child
+    // chains are hooked into another.
+    ChildChainCache cache;
+
     // Create chains for child modules.
-    createChildChains(V4V6, "filter", "INPUT", FILTER_INPUT, true);
-    createChildChains(V4V6, "filter", "FORWARD", FILTER_FORWARD, true);
-    createChildChains(V4V6, "raw", "PREROUTING", RAW_PREROUTING, true);
-    createChildChains(V4V6, "mangle", "FORWARD", MANGLE_FORWARD, true);
-    createChildChains(V4V6, "mangle", "INPUT", MANGLE_INPUT, true);
-    createChildChains(V4, "nat", "PREROUTING", NAT_PREROUTING, true);
-    createChildChains(V4, "nat", "POSTROUTING", NAT_POSTROUTING, true);
-
-    createChildChains(V4, "filter", "OUTPUT", FILTER_OUTPUT, false);
-    createChildChains(V6, "filter", "OUTPUT", FILTER_OUTPUT, false);
-    createChildChains(V4, "mangle", "POSTROUTING", MANGLE_POSTROUTING, false);
-    createChildChains(V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING, false);
+    createChildChains(V4V6, "filter", "INPUT", FILTER_INPUT, true, &cache);
+    createChildChains(V4V6, "filter", "FORWARD", FILTER_FORWARD, true, &cache);
+    createChildChains(V4V6, "raw", "PREROUTING", RAW_PREROUTING, true, &cache);
+    createChildChains(V4V6, "mangle", "FORWARD", MANGLE_FORWARD, true, &cache);
+    createChildChains(V4V6, "mangle", "INPUT", MANGLE_INPUT, true, &cache);
+    createChildChains(V4, "nat", "PREROUTING", NAT_PREROUTING, true, &cache);
+    createChildChains(V4, "nat", "POSTROUTING", NAT_POSTROUTING, true, &cache);
+
+    createChildChains(V4, "filter", "OUTPUT", FILTER_OUTPUT, false, &cache);
+    createChildChains(V6, "filter", "OUTPUT", FILTER_OUTPUT, false, &cache);
+    createChildChains(V4, "mangle", "POSTROUTING", MANGLE_POSTROUTING, false, &cache);
+    createChildChains(V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING, false, &cache);
 }
 
 void Controllers::initIptablesRules() {
     Stopwatch s;
-    initChildChains();
-    gLog.info("Creating child chains: %" PRId64 "us", s.getTimeAndResetUs());
+    {
+        // Most of the commands below do not need their output, so coalesce them into as few
+        // iptables-restore round trips as possible.
+        IptablesRestoreController::Batch batch(&iptablesRestoreCtrl);
+        initChildChains();
+    }
+    recordStartupPhase("Creating child chains", s.getTimeAndResetUs());
 
-    // Let each module setup their child chains
+    // Let each module setup their child chains.
+    //
+    // The OEM script runs iptables itself, so it must run after the child chains have been
+    // committed and before anything else is queued that it might race with. The batch above
+    // already cleared the oem_* chains, so the script costs no iptables-restore round trips.
     setupOemIptablesHook();
-    gLog.info("Setting up OEM hooks: %" PRId64 "us", s.getTimeAndResetUs());
-
-    /* When enabled, DROPs all packets except those matching rules. */
-    firewallCtrl.setupIptablesHooks();
-    gLog.info("Setting up FirewallController hooks: %" PRId64 "us", s.getTimeAndResetUs());
-
-    /* Does DROPs in FORWARD by default */
-    tetherCtrl.setupIptablesHooks();
-    gLog.info("Setting up TetherController hooks: %" PRId64 "us", s.getTimeAndResetUs());
-
-    /*
-     * Does REJECT in INPUT, OUTPUT. Does counting also.
-     * No DROP/REJECT allowed later in netfilter-flow hook order.
-     */
-    bandwidthCtrl.setupIptablesHooks();
-    gLog.info("Setting up BandwidthController hooks: %" PRId64 "us", s.getTimeAndResetUs());
+    recordStartupPhase("Setting up OEM hooks", s.getTimeAndResetUs());
+
+    // The controllers only modify their own child chains, whose position in the top-level chains
+    // (and thus in netfilter hook order) has been fixed by initChildChains() above. So they can
+    // set them up concurrently. Their commands are coalesced into one batch, which each of their
+    // threads joins.
+    IptablesRestoreController::Batch batch(&iptablesRestoreCtrl);
+    const auto inBatch = [&batch](std::function<void()> setup) {
+        return [&batch, setup = std::move(setup)] {
+            IptablesRestoreController::Batch::Scope scope(&batch);
+            setup();
+        };
+    };
+    runStartupSteps(&startupProfile, {
+            /* When enabled, DROPs all packets except those matching rules. */
+            {"FirewallController", {}, inBatch([this] { firewallCtrl.setupIptablesHooks(); })},
+
+            /* Does DROPs in FORWARD by default */
+            {"TetherController", {}, inBatch([this] { tetherCtrl.setupIptablesHooks(); })},
+
+            /*
+             * Does REJECT in INPUT, OUTPUT. Does counting also.
+             * No DROP/REJECT allowed later in netfilter-flow hook order.
+             */
+            {"BandwidthController", {}, inBatch([this] { bandwidthCtrl.setupIptablesHooks(); })},
+
+            /*
+             * Counts in nat: PREROUTING, POSTROUTING.
+             * No DROP/REJECT allowed later in netfilter-flow hook order.
+             */
+            {"IdletimerController", {}, inBatch([this] { idletimerCtrl.setupIptablesHooks(); })},
+
+            /*
+             * Add rules for detecting IPv6/IPv4 TCP/UDP connections with TLS/DTLS header
+             */
+            {"StrictController", {}, inBatch([this] {
+                 std::lock_guard lock(strictCtrl.lock);
+                 strictCtrl.setupIptablesHooks();
+             })},
+    });
+    recordStartupPhase("Setting up controller hooks", s.getTimeAndResetUs());
+
+    if (batch.commit() != 0) {
+        gLog.error("Some iptables hook setup commands failed");
+    }
+    recordStartupPhase("Committing iptables hook setup", s.getTimeAndResetUs());
+}
 
-    /*
-     * Counts in nat: PREROUTING, POSTROUTING.
-     * No DROP/REJECT allowed later in netfilter-flow hook order.
-     */
-    idletimerCtrl.setupIptablesHooks();
-    gLog.info("Setting up IdletimerController hooks: %" PRId64 "us", s.getTimeAndResetUs());
+/* static */
+void Controllers::runStartupSteps(StartupProfile* profile,
+                                  const std::vector<StartupStep>& steps) {
+    std::vector<std::promise<void>> finished(steps.size());
+    std::map<std::string, std::shared_future<void>> finishedByName;
+    for (size_t i = 0; i < steps.size(); i++) {
+        for (const auto& dependency : steps[i].after) {
+            // Only allow dependencies on earlier steps. This rules out cycles.
+            if (finishedByName.find(dependency) == finishedByName.end()) {
+                ALOGE("Startup step %s depends on unknown or later step %s",
+                      steps[i].name, dependency);
+                abort();
+            }
+        }
+        finishedByName[steps[i].name] = finished[i].get_future().share();
+    }
 
-    /*
-     * Add rules for detecting IPv6/IPv4 TCP/UDP connections with TLS/DTLS header
-     */
-    strictCtrl.setupIptablesHooks();
-    gLog.info("Setting up StrictController hooks: %" PRId64 "us", s.getTimeAndResetUs());
+    std::vector<std::thread> threads;
+    threads.reserve(steps.size());
+    for (size_t i = 0; i < steps.size(); i++) {
+        threads.emplace_back([profile, &steps, &finished, &finishedByName, i] {
+            const StartupStep& step = steps[i];
+            for (const auto& dependency : step.after) {
+                finishedByName.at(dependency).wait();
+            }
+            Stopwatch s;
+            step.run();
+            const int64_t durationUs = s.timeTakenUs();
+            gLog.info("Startup step %s: %" PRId64 "us", step.name, durationUs);
+            if (profile) profile->record(step.name, durationUs);
+            finished[i].set_value();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
 }
 
 void Controllers::init() {
-    initIptablesRules();
+    initControllers();
+    markAllReady();
+}
+
+void Controllers::initControllers() {
+    // RouteController only talks to the kernel over netlink, and never touches iptables, so it is
+    // initialized while the iptables rules are set up. XfrmController is left to initXfrm().
     Stopwatch s;
+    runStartupSteps(&startupProfile, {
+            {"iptables",
+             {},
+             [this] {
+                 initIptablesRules();
+                 setReady(Readiness::IPTABLES);
+             }},
+            {"BandwidthControl",
+             {"iptables"},
+             [this] {
+                 if (int ret = bandwidthCtrl.enableBandwidthControl()) {
+                     gLog.error("Failed to initialize BandwidthController (%s)", strerror(-ret));
+                     // A failure to init almost definitely means that iptables failed to load
+                     // our static ruleset, which then basically means network accounting will
+                     // not work. As such simply exit netd.  This may crash loop the system, but
+                     // by failing to bootup we will trigger rollback and thus this offers us
+                     // protection against a mainline update breaking things.
+                     // exit(1);
+                 }
+                 setReady(Readiness::BANDWIDTH);
+             }},
+            {"RouteController",
+             {},
+             [this] {
+                 if (int ret = RouteController::Init(NetworkController::LOCAL_NET_ID)) {
+                     gLog.error("Failed to initialize RouteController (%s)", strerror(-ret));
+                 }
+                 setReady(Readiness::ROUTE);
+             }},
+    });
+    recordStartupPhase("Initializing controllers", s.timeTakenUs());
+
+    // Flush the IPsec state left by a previous netd now rather than on the first IPsec RPC, but
+    // without holding up boot.
+    std::thread([this] { waitUntilReady(Readiness::XFRM); }).detach();
+}
 
-    if (int ret = bandwidthCtrl.enableBandwidthControl()) {
-        gLog.error("Failed to initialize BandwidthController (%s)", strerror(-ret));
-        // A failure to init almost definitely means that iptables failed to load
-        // our static ruleset, which then basically means network accounting will not work.
-        // As such simply exit netd.  This may crash loop the system, but by failing
-        // to bootup we will trigger rollback and thus this offers us protection against
-        // a mainline update breaking things.
-        // exit(1);
-    }
-    gLog.info("Enabling bandwidth control: %" PRId64 "us", s.getTimeAndResetUs());
+void Controllers::recordStartupPhase(const char* name, int64_t durationUs) {
+    gLog.info("%s: %" PRId64 "us", name, durationUs);
+    startupProfile.record(name, durationUs);
+}
 
-    if (int ret = RouteController::Init(NetworkController::LOCAL_NET_ID)) {
-        gLog.error("Failed to initialize RouteController (%s)", strerror(-ret));
+void Controllers::setReady(Readiness what) {
+    {
+        std::lock_guard guard(mReadyMutex);
+        mReady.set(static_cast<size_t>(what));
     }
-    gLog.info("Initializing RouteController: %" PRId64 "us", s.getTimeAndResetUs());
+    mReadyCv.notify_all();
+}
 
+void Controllers::markAllReady() {
+    setReady(Readiness::ALL);
+}
+
+void Controllers::initXfrm() {
+    Stopwatch s;
     netdutils::Status xStatus = XfrmController::Init();
     if (!isOk(xStatus)) {
-        gLog.error("Failed to initialize XfrmController (%s)", netdutils::toString(xStatus).c_str());
-    };
-    gLog.info("Initializing XfrmController: %" PRId64 "us", s.getTimeAndResetUs());
+        gLog.error("Failed to initialize XfrmController (%s)",
+                   netdutils::toString(xStatus).c_str());
+    }
+
+    auto listener = makeXfrmEventListener();
+    if (!isOk(listener)) {
+        // We can still continue without IPsec SA expiry events.
+        gLog.error("Unable to create XfrmEventListener: %s",
+                   netdutils::toString(listener).c_str());
+    } else {
+        mXfrmListener = std::move(listener.value());
+        mXfrmListener->setExpireHandler([](const XfrmSaState& sa, bool hard) {
+            ALOGI("%s expiry of SA reqid=%d spi=0x%08x after %" PRIu64 " bytes",
+                  hard ? "Hard" : "Soft", sa.transformId, sa.spi,
+                  static_cast<uint64_t>(sa.lifetime.bytes));
+        });
+    }
+    gLog.info("Initialized XfrmController: %" PRId64 "us", s.timeTakenUs());
+    setReady(Readiness::XFRM);
+}
+
+PppController& Controllers::pppCtrl() {
+    std::call_once(mPppInitOnce, [this] { mPppCtrl = std::make_unique<PppController>(); });
+    return *mPppCtrl;
+}
+
+void Controllers::waitUntilReady(Readiness what) {
+    if (what == Readiness::NONE) return;
+    if (what == Readiness::XFRM) {
+        // Concurrent callers block in call_once until the first one has finished.
+        std::call_once(mXfrmInitOnce, [this] { initXfrm(); });
+        return;
+    }
+    std::unique_lock guard(mReadyMutex);
+    mReadyCv.wait(guard, [this, what]() REQUIRES(mReadyMutex) {
+        return mReady.test(static_cast<size_t>(what));
+    });
 }
 
 Controllers* gCtls = nullptr;
@@ -17,19 +17,35 @@
 #ifndef _CONTROLLERS_H__
 #define _CONTROLLERS_H__
 
+#include <bitset>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
 #include "BandwidthController.h"
 #include "EventReporter.h"
 #include "FirewallController.h"
+#include "FwmarkServerStats.h"
 #include "IdletimerController.h"
 #include "InterfaceController.h"
 #include "IptablesRestoreController.h"
 #include "NetworkController.h"
 #include "PppController.h"
+#include "StartupProfile.h"
 #include "StrictController.h"
 #include "TcpSocketMonitor.h"
 #include "TetherController.h"
 #include "WakeupController.h"
 #include "XfrmController.h"
+#include "XfrmEventListener.h"
 #include "netdutils/Log.h"
 
 namespace android {
@@ -41,7 +57,6 @@ class Controllers {
 
     NetworkController netCtrl;
     TetherController tetherCtrl;
-    PppController pppCtrl;
     BandwidthController bandwidthCtrl;
     IdletimerController idletimerCtrl;
     FirewallController firewallCtrl;
@@ -51,18 +66,90 @@ class Controllers {
     WakeupController wakeupCtrl;
     XfrmController xfrmCtrl;
     TcpSocketMonitor tcpSocketMonitor;
+    FwmarkServerStats fwmarkServerStats;
+    StartupProfile startupProfile;
 
+    // Sets up the controllers, then marks ALL ready. For callers, such as fuzzers and tests, that
+    // do not start anything else that RPCs depend on.
     void init();
+    // Like init(), but leaves ALL unmarked. Only for main(), which must call markAllReady() once
+    // it has also started the services that RPCs waiting for ALL depend on.
+    void initControllers();
+    // Marks ALL ready. This is the only way to reach ALL.
+    void markAllReady();
+
+    // Constructed on first use, since most devices never use PPP.
+    PppController& pppCtrl();
+
+    // Logs how long the startup phase |name| took and adds it to |startupProfile|.
+    void recordStartupPhase(const char* name, int64_t durationUs);
+
+    // The parts of startup that binder RPCs can wait for. netd publishes its binder service
+    // before calling initControllers(), so that RPCs which only need controllers that are already
+    // set up do not wait for the rest.
+    enum class Readiness {
+        NONE,       // Nothing beyond the constructor.
+        IPTABLES,   // initIptablesRules().
+        BANDWIDTH,  // BandwidthController::enableBandwidthControl().
+        ROUTE,      // RouteController::Init().
+        XFRM,       // XfrmController::Init(). See initXfrm().
+        ALL,        // Everything main() sets up before netd used to publish its binder service.
+                    // See markAllReady().
+    };
+
+    // Blocks until |what| is ready. Waiting for XFRM initializes XfrmController if it has not
+    // started yet.
+    void waitUntilReady(Readiness what);
 
   private:
     friend class ControllersTest;
+    // Marks |what| as ready, waking up its waiters. initControllers() marks all but XFRM and ALL.
+    void setReady(Readiness what);
+
     void initIptablesRules();
+
+    // Flushes the IPsec state left by a previous netd and starts listening for SA expiry events.
+    // initControllers() starts this on a thread of its own, so that boot does not wait for it, and
+    // the first RPC that needs IPsec waits for it to finish. Runs once, under mXfrmInitOnce.
+    void initXfrm();
+
+    // One unit of work in initControllers() or initIptablesRules(). Steps run concurrently, each
+    // on its own thread, except that a step does not start until the steps named in |after| have
+    // finished. Steps may only depend on steps earlier in the list. Each step's duration is added
+    // to |profile|, if any.
+    struct StartupStep {
+        const char* name;
+        std::vector<const char*> after;
+        std::function<void()> run;
+    };
+    static void runStartupSteps(StartupProfile* profile, const std::vector<StartupStep>& steps);
+
+    std::mutex mReadyMutex;
+    std::condition_variable mReadyCv;
+    std::bitset<static_cast<size_t>(Readiness::ALL) + 1> mReady GUARDED_BY(mReadyMutex);
+
+    std::once_flag mXfrmInitOnce;
+    std::unique_ptr<XfrmEventListener> mXfrmListener;
+    std::once_flag mPppInitOnce;
+    std::unique_ptr<PppController> mPppCtrl;
+
     static void initChildChains();
+
+    // Parent chain -> child chains hooked into it with "-A <parent> -j <child>".
+    using ChildChainIndex = std::map<std::string, std::set<std::string>>;
+    // Indexes of the tables listed so far during one initChildChains() run, by IP family and table.
+    using ChildChainCache = std::map<std::pair<IptablesTarget, std::string>, ChildChainIndex>;
+
+    static ChildChainIndex parseChildChains(const std::string& listing);
+    static const ChildChainIndex& listChildChains(const IptablesTarget target, const char* table,
+                                                  ChildChainCache* cache);
     static std::set<std::string> findExistingChildChains(const IptablesTarget target,
                                                          const char* table,
-                                                         const char* parentChain);
+                                                         const char* parentChain,
+                                                         ChildChainCache* cache = nullptr);
     static void createChildChains(IptablesTarget target, const char* table, const char* parentChain,
-                                  const std::vector<const char*>& childChains, bool exclusive);
+                                  const std::vector<const char*>& childChains, bool exclusive,
+                                  ChildChainCache* cache);
     static int (*execIptablesRestore)(IptablesTarget, const std::string&);
     static int (*execIptablesRestoreWithOutput)(IptablesTarget, const std::string&, std::string *);
 };
@@ -16,6 +16,8 @@
  * ControllersTest.cpp - unit tests for Controllers.cpp
  */
 
+#include <algorithm>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
@@ -45,15 +47,55 @@ class ControllersTest : public IptablesBaseTest {
     std::set<std::string> findExistingChildChains(IptablesTarget a, const char* b, const char*c) {
         return Controllers::findExistingChildChains(a, b, c);
     }
+    using StartupStep = Controllers::StartupStep;
+    void runStartupSteps(StartupProfile* profile, const std::vector<StartupStep>& steps) {
+        Controllers::runStartupSteps(profile, steps);
+    }
 };
 
+TEST_F(ControllersTest, TestRunStartupSteps) {
+    std::mutex lock;
+    std::vector<std::string> order;
+    auto record = [&lock, &order](const char* name) {
+        return [&lock, &order, name] {
+            std::lock_guard guard(lock);
+            order.push_back(name);
+        };
+    };
+
+    StartupProfile profile;
+    runStartupSteps(&profile, {
+            {"first", {}, record("first")},
+            {"independent", {}, record("independent")},
+            {"second", {"first"}, record("second")},
+            {"third", {"first", "second"}, record("third")},
+    });
+
+    ASSERT_EQ(4U, order.size());
+    auto position = [&order](const std::string& name) {
+        return std::find(order.begin(), order.end(), name) - order.begin();
+    };
+    EXPECT_LT(position("first"), position("second"));
+    EXPECT_LT(position("second"), position("third"));
+    EXPECT_NE(order.end(), std::find(order.begin(), order.end(), "independent"));
+
+    // Each step is profiled once it has finished.
+    std::vector<std::string> profiled;
+    for (const auto& phase : profile.getPhases()) profiled.push_back(phase.name);
+    EXPECT_THAT(profiled, testing::UnorderedElementsAre("first", "independent", "second", "third"));
+}
+
 TEST_F(ControllersTest, TestFindExistingChildChains) {
     ExpectedIptablesCommands expectedCmds = {
-        { V6, "*raw\n-S PREROUTING\nCOMMIT\n" },
+        { V6, "*raw\n-S\nCOMMIT\n" },
     };
     sIptablesRestoreOutput.push_back(
         "-P PREROUTING ACCEPT\n"
+        "-P OUTPUT ACCEPT\n"
         "-A PREROUTING -j bw_raw_PREROUTING\n"
+        "-A OUTPUT -j bw_raw_OUTPUT\n"
+        "-A PREROUTING -m mark --mark 0x1 -j RETURN\n"
+        "-A PREROUTING -j  \n"
         "-A PREROUTING -j idletimer_raw_PREROUTING\n"
         "-A PREROUTING -j tetherctrl_raw_PREROUTING\n"
     );
@@ -135,7 +177,7 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
              "COMMIT\n"},
             {V4,
              "*filter\n"
-             "-S OUTPUT\n"
+             "-S\n"
              "COMMIT\n"},
             {V4,
              "*filter\n"
@@ -150,7 +192,7 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
              "COMMIT\n"},
             {V6,
              "*filter\n"
-             "-S OUTPUT\n"
+             "-S\n"
              "COMMIT\n"},
             {V6,
              "*filter\n"
@@ -165,7 +207,7 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
              "COMMIT\n"},
             {V4,
              "*mangle\n"
-             "-S POSTROUTING\n"
+             "-S\n"
              "COMMIT\n"},
             {V4,
              "*mangle\n"
@@ -178,7 +220,7 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
              "COMMIT\n"},
             {V6,
              "*mangle\n"
-             "-S POSTROUTING\n"
+             "-S\n"
              "COMMIT\n"},
             {V6,
              "*mangle\n"
@@ -219,17 +261,18 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
 
     // 1. Test that if we find rules that we don't create ourselves, we ignore them.
     // First check that command #7 is where we list the OUTPUT chain in the (IPv4) filter table:
-    ASSERT_NE(std::string::npos, expected[7].second.find("*filter\n-S OUTPUT\n"));
+    ASSERT_NE(std::string::npos, expected[7].second.find("*filter\n-S\n"));
     // ... and pretend that when we run that command, we find the following rules. Because we don't
     // create any of these rules ourselves, our behaviour is unchanged.
     sIptablesRestoreOutput[7] =
         "-P OUTPUT ACCEPT\n"
-        "-A OUTPUT -o r_rmnet_data8 -p udp -m udp --dport 1900 -j DROP\n";
+        "-A OUTPUT -o r_rmnet_data8 -p udp -m udp --dport 1900 -j DROP\n"
+        "-A fw_OUTPUT -j st_OUTPUT\n";
 
     // 2. Test that rules that we create ourselves are not added if they already exist.
     // Pretend that when we list the OUTPUT chain in the (IPv6) filter table, we find the oem_out
     // and st_OUTPUT chains:
-    ASSERT_NE(std::string::npos, expected[9].second.find("*filter\n-S OUTPUT\n"));
+    ASSERT_NE(std::string::npos, expected[9].second.find("*filter\n-S\n"));
     sIptablesRestoreOutput[9] =
         "-A OUTPUT -j oem_out\n"
         "-A OUTPUT -j st_OUTPUT\n";
@@ -239,7 +282,7 @@ TEST_F(ControllersTest, TestInitIptablesRules) {
 
     // 3. Now test that when we list the POSTROUTING chain in the mangle table, we find a mixture of
     // netd-created rules and vendor rules:
-    ASSERT_NE(std::string::npos, expected[13].second.find("*mangle\n-S POSTROUTING\n"));
+    ASSERT_NE(std::string::npos, expected[13].second.find("*mangle\n-S\n"));
     sIptablesRestoreOutput[13] =
         "-P POSTROUTING ACCEPT\n"
         "-A POSTROUTING -j oem_mangle_post\n"
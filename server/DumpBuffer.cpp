@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Netd"
+
+#include "DumpBuffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+#include <android-base/file.h>
+#include <log/log.h>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+DumpBuffer::Pipe DumpBuffer::makePipe() {
+    base::unique_fd readFd, writeFd;
+    if (!base::Pipe(&readFd, &writeFd, O_CLOEXEC)) {
+        ALOGE("Cannot create dump buffer: %s", strerror(errno));
+    }
+    return {std::move(readFd), std::move(writeFd)};
+}
+
+// DumpWriter can only write to a file descriptor, so the buffer is a pipe that a thread drains
+// into memory. Unlike an in-memory file, a pipe needs no SELinux permission beyond what netd
+// already has, and dumps are rare enough that the thread does not matter.
+DumpBuffer::DumpBuffer() : DumpBuffer(makePipe()) {}
+
+DumpBuffer::DumpBuffer(Pipe pipe) : mWriteFd(std::move(pipe.second)), mWriter(mWriteFd.get()) {
+    if (pipe.first == -1) return;
+    mReader = std::thread([this, readFd = std::move(pipe.first)] {
+        if (!base::ReadFdToString(readFd.get(), &mContents)) {
+            ALOGE("Cannot read dump buffer: %s", strerror(errno));
+            mContents.clear();
+        }
+    });
+}
+
+DumpBuffer::~DumpBuffer() {
+    finish();
+}
+
+bool DumpBuffer::finish() {
+    mWriteFd.reset();
+    if (!mReader.joinable()) return false;
+    mReader.join();
+    return true;
+}
+
+void DumpBuffer::flushTo(DumpWriter& dw) {
+    if (!finish()) {
+        dw.println("<dump unavailable>");
+        return;
+    }
+
+    // Each line goes through |dw| so that it gets its indentation.
+    std::string_view remaining = mContents;
+    while (!remaining.empty()) {
+        const size_t end = remaining.find('\n');
+        dw.println(std::string(remaining.substr(0, end)));
+        if (end == std::string_view::npos) break;
+        remaining.remove_prefix(end + 1);
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <android-base/unique_fd.h>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Dump output held in memory. A dump() method that needs a lock formats its state into a
+// DumpBuffer while holding the lock, and writes it to the dump fd once the lock is released. The
+// dump fd is usually a pipe to dumpsys, which can be slow to drain on a loaded device; writing to
+// it directly would keep binder calls waiting for the lock until it did.
+class DumpBuffer {
+  public:
+    DumpBuffer();
+    ~DumpBuffer();
+
+    // Writes to the buffer. Indentation is relative to that of the writer passed to flushTo().
+    netdutils::DumpWriter& writer() { return mWriter; }
+
+    // Writes everything written to the buffer to |dw|. Call it once, without holding the lock,
+    // and do not use writer() afterwards.
+    void flushTo(netdutils::DumpWriter& dw);
+
+  private:
+    using Pipe = std::pair<base::unique_fd, base::unique_fd>;
+
+    static Pipe makePipe();
+    explicit DumpBuffer(Pipe pipe);
+
+    // Closes the write end of the pipe, and waits for the reader to see the end of it.
+    bool finish();
+
+    base::unique_fd mWriteFd;
+    netdutils::DumpWriter mWriter;
+    // Only accessed by mReader, until it is joined.
+    std::string mContents;
+    std::thread mReader;
+};
+
+}  // namespace android::net
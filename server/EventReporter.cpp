@@ -14,38 +14,273 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "Netd"
+
 #include "EventReporter.h"
 
+#include <netdb.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <utility>
+
+#include <android-base/properties.h>
+#include <log/log.h>
+#include <utils/String16.h>
+#include <utils/String8.h>
+
 using android::interface_cast;
 using android::net::INetdUnsolicitedEventListener;
 using android::net::metrics::INetdEventListener;
 
-android::sp<INetdEventListener> EventReporter::getNetdEventListener() {
+namespace {
+
+const android::String16 NETD_EVENT_LISTENER_SERVICE("netd_listener");
+
+}  // namespace
+
+// Tracks the netd events listener service: publishes it when it is registered, and clears it when
+// it dies. The EventReporter outlives it, since it is never destroyed.
+class EventReporter::ListenerWatcher : public android::IServiceManager::LocalRegistrationCallback,
+                                       public android::IBinder::DeathRecipient {
+  public:
+    explicit ListenerWatcher(EventReporter* eventReporter) : mEventReporter(eventReporter) {}
+
+    void onServiceRegistration(const android::String16& /*instance*/,
+                               const android::sp<android::IBinder>& binder) override {
+        mEventReporter->setNetdEventListener(binder);
+    }
+
+    void binderDied(const android::wp<android::IBinder>& who) override {
+        mEventReporter->onNetdEventListenerDied(who);
+    }
+
+  private:
+    EventReporter* const mEventReporter;
+};
+
+void EventReporter::watchNetdEventListener() {
+    const auto watcher = android::sp<ListenerWatcher>::make(this);
+    {
+        std::lock_guard lock(mEventMutex);
+        mListenerWatcher = watcher;
+    }
+    // The callback is called right away if the service is already registered.
+    const android::status_t status = android::defaultServiceManager()->registerForNotifications(
+            NETD_EVENT_LISTENER_SERVICE, watcher);
+    if (status != android::OK) {
+        ALOGE("Unable to register for %s notifications (%d), polling instead",
+              android::String8(NETD_EVENT_LISTENER_SERVICE).c_str(), status);
+        return;
+    }
+    mListenerNotifications = true;
+}
+
+void EventReporter::setNetdEventListener(const android::sp<android::IBinder>& binder) {
+    std::lock_guard lock(mEventMutex);
+    // If the netd listener service dies before linkToDeath, calls to it just return an error,
+    // which only means that netd events are not logged until it is registered again.
+    if (binder != nullptr) binder->linkToDeath(mListenerWatcher);
+    std::atomic_store(&mNetdEventListener, std::make_shared<const NetdEventListenerRef>(
+                                                   interface_cast<INetdEventListener>(binder)));
+}
+
+void EventReporter::onNetdEventListenerDied(const android::wp<android::IBinder>& who) {
     std::lock_guard lock(mEventMutex);
-    if (mNetdEventListener == nullptr) {
+    // A new instance may have been registered in the meantime.
+    const auto& current = *std::atomic_load(&mNetdEventListener);
+    if (current == nullptr || android::IInterface::asBinder(current) != who.unsafe_get()) return;
+    std::atomic_store(&mNetdEventListener, std::make_shared<const NetdEventListenerRef>());
+}
+
+android::sp<INetdEventListener> EventReporter::getNetdEventListener() {
+    std::call_once(mWatchListenerOnce, &EventReporter::watchNetdEventListener, this);
+    std::shared_ptr<const NetdEventListenerRef> listener = std::atomic_load(&mNetdEventListener);
+    if (*listener == nullptr && !mListenerNotifications) {
         // Use checkService instead of getService because getService waits for 5 seconds for the
         // service to become available. The DNS resolver inside netd is started much earlier in the
         // boot sequence than the framework DNS listener, and we don't want to delay all DNS lookups
         // for 5 seconds until the DNS listener starts up.
-        android::sp<android::IBinder> b = android::defaultServiceManager()->checkService(
-                android::String16("netd_listener"));
-        mNetdEventListener = interface_cast<INetdEventListener>(b);
+        setNetdEventListener(
+                android::defaultServiceManager()->checkService(NETD_EVENT_LISTENER_SERVICE));
+        listener = std::atomic_load(&mNetdEventListener);
     }
-    // If the netd listener service is dead, the binder call will just return an error, which should
-    // be fine because the only impact is that we can't log netd events. In any case, this should
-    // only happen if the system server is going down, which means it will shortly be taking us down
-    // with it.
-    return mNetdEventListener;
+    return *listener;
 }
 
-EventReporter::UnsolListenerMap EventReporter::getNetdUnsolicitedEventListenerMap() const {
-    std::lock_guard lock(mUnsolicitedMutex);
-    return mUnsolListenerMap;
+namespace {
+
+// Bounds the memory used by connect events while the listener is slow or absent.
+constexpr size_t MAX_QUEUED_CONNECT_EVENTS = 1024;
+
+// Bounds the memory used by unsolicited events while one listener is slow.
+constexpr size_t MAX_QUEUED_UNSOL_EVENTS = 1024;
+
+// How long the reporter waits after reporting a batch of events, so that the events that arrive
+// in the meantime are reported together. 0 reports events as soon as possible.
+constexpr const char* CONNECT_EVENT_INTERVAL_PROPERTY = "persist.netd.connect_event_interval_ms";
+
+// As above, for unsolicited events. The first event of a burst is reported right away, and the
+// rest of the burst is reported at most this long after it, with the events that share a coalesce
+// key merged. 0 reports events as soon as possible.
+constexpr const char* UNSOL_EVENT_INTERVAL_PROPERTY = "persist.netd.unsol_event_interval_ms";
+constexpr unsigned DEFAULT_UNSOL_EVENT_INTERVAL_MS = 10;
+
+}  // namespace
+
+void EventReporter::reportConnectEvent(const ConnectEvent& event) {
+    std::lock_guard lock(mConnectEventMutex);
+    if (!mConnectEventReporterStarted) {
+        mConnectEventReporterStarted = true;
+        std::thread(&EventReporter::runConnectEventReporter, this).detach();
+    }
+    if (mQueuedConnectEvents.size() >= MAX_QUEUED_CONNECT_EVENTS) {
+        mDroppedConnectEvents++;
+        return;
+    }
+    mQueuedConnectEvents.push_back(event);
+    if (mQueuedConnectEvents.size() == 1) {
+        mConnectEventCv.notify_one();
+    }
+}
+
+void EventReporter::runConnectEventReporter() {
+    const std::chrono::milliseconds interval(
+            android::base::GetUintProperty<unsigned>(CONNECT_EVENT_INTERVAL_PROPERTY, 0, 10000));
+    std::vector<ConnectEvent> events;
+    while (true) {
+        size_t dropped;
+        {
+            std::unique_lock lock(mConnectEventMutex);
+            mConnectEventCv.wait(lock, [this]() REQUIRES(mConnectEventMutex) {
+                return !mQueuedConnectEvents.empty();
+            });
+            events.swap(mQueuedConnectEvents);
+            dropped = std::exchange(mDroppedConnectEvents, 0);
+        }
+        if (dropped) {
+            ALOGW("Dropped %zu connect events", dropped);
+        }
+
+        android::sp<INetdEventListener> listener = getNetdEventListener();
+        for (const ConnectEvent& event : events) {
+            if (listener == nullptr) break;
+            const socklen_t addrlen = (event.addr.ss_family == AF_INET6) ? sizeof(sockaddr_in6)
+                                                                           : sizeof(sockaddr_in);
+            char addrstr[INET6_ADDRSTRLEN];
+            char portstr[sizeof("65536")];
+            const int ret = getnameinfo(reinterpret_cast<const sockaddr*>(&event.addr), addrlen,
+                                        addrstr, sizeof(addrstr), portstr, sizeof(portstr),
+                                        NI_NUMERICHOST | NI_NUMERICSERV);
+            listener->onConnectEvent(
+                    event.netId, event.error, event.latencyMs,
+                    (ret == 0) ? android::String16(addrstr) : android::String16(""),
+                    (ret == 0) ? strtoul(portstr, nullptr, 10) : 0, event.uid);
+        }
+        events.clear();
+
+        if (interval.count()) {
+            std::this_thread::sleep_for(interval);
+        }
+    }
+}
+
+// The calls queued for one unsolicited event listener, and the thread that makes them.
+class EventReporter::UnsolEventQueue {
+  public:
+    UnsolEventQueue(android::sp<INetdUnsolicitedEventListener> listener,
+                    android::sp<android::IBinder::DeathRecipient> deathRecipient)
+        : mListener(std::move(listener)), mDeathRecipient(std::move(deathRecipient)) {}
+
+    void push(const std::string& coalesceKey, const UnsolEventFn& fn) EXCLUDES(mMutex) {
+        std::lock_guard lock(mMutex);
+        if (!coalesceKey.empty()) {
+            // The new call supersedes the queued one, and is made when the queued one would have
+            // been, so that it is not delayed behind the events that followed it.
+            const auto it = std::find_if(mCalls.begin(), mCalls.end(), [&](const Call& call) {
+                return call.coalesceKey == coalesceKey;
+            });
+            if (it != mCalls.end()) {
+                it->fn = fn;
+                return;
+            }
+        }
+        if (mCalls.size() >= MAX_QUEUED_UNSOL_EVENTS) {
+            mDropped++;
+            return;
+        }
+        mCalls.push_back({coalesceKey, fn});
+        if (mCalls.size() == 1) {
+            mCv.notify_one();
+        }
+    }
+
+    // Makes the queued calls until stop() is called.
+    void run() EXCLUDES(mMutex) {
+        const std::chrono::milliseconds interval(android::base::GetUintProperty<unsigned>(
+                UNSOL_EVENT_INTERVAL_PROPERTY, DEFAULT_UNSOL_EVENT_INTERVAL_MS, 10000));
+        std::deque<Call> calls;
+        while (true) {
+            size_t dropped;
+            {
+                std::unique_lock lock(mMutex);
+                mCv.wait(lock, [this]() REQUIRES(mMutex) { return mStopped || !mCalls.empty(); });
+                if (mStopped) return;
+                calls.swap(mCalls);
+                dropped = std::exchange(mDropped, 0);
+            }
+            if (dropped) {
+                ALOGW("Dropped %zu unsolicited events", dropped);
+            }
+            for (const Call& call : calls) {
+                call.fn(mListener);
+            }
+            calls.clear();
+
+            if (interval.count()) {
+                std::unique_lock lock(mMutex);
+                mCv.wait_for(lock, interval, [this]() REQUIRES(mMutex) { return mStopped; });
+            }
+        }
+    }
+
+    // Drops the queued calls and makes run() return.
+    void stop() EXCLUDES(mMutex) {
+        std::lock_guard lock(mMutex);
+        mStopped = true;
+        mCalls.clear();
+        mCv.notify_one();
+    }
+
+  private:
+    struct Call {
+        std::string coalesceKey;
+        UnsolEventFn fn;
+    };
+
+    const android::sp<INetdUnsolicitedEventListener> mListener;
+    // Only held so that it lives as long as the registration.
+    const android::sp<android::IBinder::DeathRecipient> mDeathRecipient;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::deque<Call> mCalls GUARDED_BY(mMutex);
+    size_t mDropped GUARDED_BY(mMutex) = 0;
+    bool mStopped GUARDED_BY(mMutex) = false;
+};
+
+void EventReporter::reportUnsolEvent(const std::string& coalesceKey, const UnsolEventFn& fn) {
+    const auto listeners = std::atomic_load(&mUnsolListenerMap);
+    for (const auto& [listener, queue] : *listeners) {
+        queue->push(coalesceKey, fn);
+    }
 }
 
 void EventReporter::registerUnsolEventListener(
         const android::sp<INetdUnsolicitedEventListener>& listener) {
     std::lock_guard lock(mUnsolicitedMutex);
+    if (mUnsolListenerMap->count(listener)) return;
 
     // Create the death listener.
     class DeathRecipient : public android::IBinder::DeathRecipient {
@@ -67,12 +302,24 @@ void EventReporter::registerUnsolEventListener(
 
     android::IInterface::asBinder(listener)->linkToDeath(deathRecipient);
 
+    // The thread holds a reference to the queue, which it releases once the listener is
+    // unregistered and stop() makes it return.
+    auto queue = std::make_shared<UnsolEventQueue>(listener, deathRecipient);
+    std::thread(&UnsolEventQueue::run, queue).detach();
+
     // TODO: Consider to use remote binder address as registering key
-    mUnsolListenerMap.insert({listener, deathRecipient});
+    auto next = std::make_shared<UnsolListenerMap>(*mUnsolListenerMap);
+    next->insert({listener, std::move(queue)});
+    std::atomic_store(&mUnsolListenerMap, std::shared_ptr<const UnsolListenerMap>(std::move(next)));
 }
 
 void EventReporter::unregisterUnsolEventListener(
         const android::sp<INetdUnsolicitedEventListener>& listener) {
     std::lock_guard lock(mUnsolicitedMutex);
-    mUnsolListenerMap.erase(listener);
+    const auto it = mUnsolListenerMap->find(listener);
+    if (it == mUnsolListenerMap->end()) return;
+    it->second->stop();
+    auto next = std::make_shared<UnsolListenerMap>(*mUnsolListenerMap);
+    next->erase(listener);
+    std::atomic_store(&mUnsolListenerMap, std::shared_ptr<const UnsolListenerMap>(std::move(next)));
 }
@@ -17,8 +17,16 @@
 #ifndef NETD_SERVER_EVENT_REPORTER_H
 #define NETD_SERVER_EVENT_REPORTER_H
 
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 #include <binder/IServiceManager.h>
@@ -31,16 +39,34 @@
  */
 class EventReporter {
   public:
-    using UnsolListenerMap =
-            std::map<const android::sp<android::net::INetdUnsolicitedEventListener>,
-                     const android::sp<android::IBinder::DeathRecipient>>;
+    using UnsolEventFn = std::function<void(
+            const android::sp<android::net::INetdUnsolicitedEventListener>& listener)>;
 
-    // Returns the binder reference to the netd events listener service, attempting to fetch it if
-    // we do not have it already. This method is threadsafe.
+    // Returns the binder reference to the netd events listener service, or nullptr if it is not
+    // registered. The service manager notifies netd when it is registered, so this does not make a
+    // binder call unless those notifications are unavailable. This method is threadsafe.
     android::sp<android::net::metrics::INetdEventListener> getNetdEventListener();
 
-    // Returns a copy of the registered listeners.
-    UnsolListenerMap getNetdUnsolicitedEventListenerMap() const EXCLUDES(mUnsolicitedMutex);
+    struct ConnectEvent {
+        unsigned netId;
+        int error;
+        unsigned latencyMs;
+        sockaddr_storage addr;  // AF_UNSPEC if unknown.
+        uid_t uid;
+    };
+
+    // Queues |event| to be reported to the netd events listener by a background thread, so that
+    // the caller does not wait for the binder call. Queued events are reported in order. If the
+    // queue is full, |event| is dropped. This method is threadsafe.
+    void reportConnectEvent(const ConnectEvent& event) EXCLUDES(mConnectEventMutex);
+
+    // Queues |fn| to be called with each registered unsolicited event listener. Every listener has
+    // its own queue and thread, so a slow listener delays neither the caller nor the other
+    // listeners. Calls are made in order, in batches at most one event interval apart, see
+    // persist.netd.unsol_event_interval_ms. If |coalesceKey| is not empty, a call with the same key
+    // that is still queued for a listener is replaced by |fn|, which keeps its place in the queue.
+    // If a listener's queue is full, |fn| is dropped for that listener. This method is threadsafe.
+    void reportUnsolEvent(const std::string& coalesceKey, const UnsolEventFn& fn);
 
     void registerUnsolEventListener(
             const android::sp<android::net::INetdUnsolicitedEventListener>& listener)
@@ -50,11 +76,42 @@ class EventReporter {
             EXCLUDES(mUnsolicitedMutex);
 
   private:
+    class ListenerWatcher;
+    class UnsolEventQueue;
+    using NetdEventListenerRef = android::sp<android::net::metrics::INetdEventListener>;
+    using UnsolListenerMap =
+            std::map<const android::sp<android::net::INetdUnsolicitedEventListener>,
+                     const std::shared_ptr<UnsolEventQueue>>;
+
+    // Reports queued connect events until the process exits.
+    void runConnectEventReporter() EXCLUDES(mConnectEventMutex);
+
+    void watchNetdEventListener() EXCLUDES(mEventMutex);
+    void setNetdEventListener(const android::sp<android::IBinder>& binder) EXCLUDES(mEventMutex);
+    void onNetdEventListenerDied(const android::wp<android::IBinder>& who) EXCLUDES(mEventMutex);
+
+    std::once_flag mWatchListenerOnce;
+    // Whether the service manager notifies mListenerWatcher of registrations.
+    std::atomic<bool> mListenerNotifications = false;
+    // Serializes updates of mNetdEventListener.
     std::mutex mEventMutex;
-    mutable std::mutex mUnsolicitedMutex;
-    android::sp<android::net::metrics::INetdEventListener> mNetdEventListener
-            GUARDED_BY(mEventMutex);
-    UnsolListenerMap mUnsolListenerMap GUARDED_BY(mUnsolicitedMutex);
+    // Serializes registerUnsolEventListener() and unregisterUnsolEventListener().
+    std::mutex mUnsolicitedMutex;
+    android::sp<ListenerWatcher> mListenerWatcher GUARDED_BY(mEventMutex);
+    // Replaced, never modified, while holding mEventMutex. Read with std::atomic_load, so that
+    // reporting an event does not wait for the listener to be looked up.
+    std::shared_ptr<const NetdEventListenerRef> mNetdEventListener =
+            std::make_shared<const NetdEventListenerRef>();
+    // Replaced, never modified, while holding mUnsolicitedMutex. Read with std::atomic_load, so
+    // that reporting an event neither copies the listeners nor waits for a registration.
+    std::shared_ptr<const UnsolListenerMap> mUnsolListenerMap =
+            std::make_shared<const UnsolListenerMap>();
+
+    std::mutex mConnectEventMutex;
+    std::condition_variable mConnectEventCv;
+    std::vector<ConnectEvent> mQueuedConnectEvents GUARDED_BY(mConnectEventMutex);
+    size_t mDroppedConnectEvents GUARDED_BY(mConnectEventMutex) = 0;
+    bool mConnectEventReporterStarted GUARDED_BY(mConnectEventMutex) = false;
 };
 
 #endif  // NETD_SERVER_EVENT_REPORTER_H
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * EventReporterTest.cpp - unit tests for EventReporter.cpp
+ */
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "EventReporter.h"
+#include "android/net/BnNetdUnsolicitedEventListener.h"
+
+namespace android::net {
+
+namespace {
+
+using binder::Status;
+
+constexpr auto kTimeout = std::chrono::seconds(5);
+
+// The events are reported by calling the functions passed to reportUnsolEvent(), so the listener
+// itself is never called.
+class FakeUnsolListener : public BnNetdUnsolicitedEventListener {
+  public:
+    Status onInterfaceClassActivityChanged(bool, int, int64_t, int) override { return ok(); }
+    Status onQuotaLimitReached(const std::string&, const std::string&) override { return ok(); }
+    Status onInterfaceDnsServerInfo(const std::string&, int64_t,
+                                    const std::vector<std::string>&) override {
+        return ok();
+    }
+    Status onInterfaceAddressUpdated(const std::string&, const std::string&, int, int) override {
+        return ok();
+    }
+    Status onInterfaceAddressRemoved(const std::string&, const std::string&, int, int) override {
+        return ok();
+    }
+    Status onInterfaceAdded(const std::string&) override { return ok(); }
+    Status onInterfaceRemoved(const std::string&) override { return ok(); }
+    Status onInterfaceChanged(const std::string&, bool) override { return ok(); }
+    Status onInterfaceLinkStateChanged(const std::string&, bool) override { return ok(); }
+    Status onRouteChanged(bool, const std::string&, const std::string&,
+                          const std::string&) override {
+        return ok();
+    }
+    Status onStrictCleartextDetected(int, const std::string&) override { return ok(); }
+
+  private:
+    static Status ok() { return Status::ok(); }
+};
+
+}  // namespace
+
+class EventReporterTest : public ::testing::Test {
+  protected:
+    void SetUp() override { mReporter.registerUnsolEventListener(mListener); }
+
+    void TearDown() override { mReporter.unregisterUnsolEventListener(mListener); }
+
+    // Holds up the listener's thread until release() is called, so that the events reported in
+    // the meantime are queued.
+    void block() {
+        mReporter.reportUnsolEvent("", [this](const auto&) { mRelease.get_future().wait(); });
+    }
+
+    void release() { mRelease.set_value(); }
+
+    void report(const std::string& coalesceKey, const std::string& event) {
+        mReporter.reportUnsolEvent(coalesceKey, [this, event](const auto&) {
+            std::lock_guard lock(mMutex);
+            mEvents.push_back(event);
+        });
+    }
+
+    // Returns the events reported so far, once the listener's queue is empty.
+    std::vector<std::string> waitForEvents() {
+        std::promise<void> done;
+        mReporter.reportUnsolEvent("", [&done](const auto&) { done.set_value(); });
+        EXPECT_EQ(std::future_status::ready, done.get_future().wait_for(kTimeout));
+        std::lock_guard lock(mMutex);
+        return mEvents;
+    }
+
+    EventReporter mReporter;
+    const sp<FakeUnsolListener> mListener = sp<FakeUnsolListener>::make();
+    std::promise<void> mRelease;
+    std::mutex mMutex;
+    std::vector<std::string> mEvents;
+};
+
+TEST_F(EventReporterTest, ReportsEventsInOrder) {
+    block();
+    report("", "a");
+    report("", "b");
+    report("", "a");
+    release();
+    EXPECT_EQ((std::vector<std::string>{"a", "b", "a"}), waitForEvents());
+}
+
+TEST_F(EventReporterTest, CoalescedEventKeepsItsPlace) {
+    block();
+    report("wlan0", "wlan0 down");
+    report("", "route added");
+    report("rmnet0", "rmnet0 up");
+    report("wlan0", "wlan0 up");
+    release();
+    EXPECT_EQ((std::vector<std::string>{"wlan0 up", "route added", "rmnet0 up"}),
+              waitForEvents());
+}
+
+TEST_F(EventReporterTest, OnlyQueuedEventsAreCoalesced) {
+    report("wlan0", "wlan0 down");
+    EXPECT_EQ((std::vector<std::string>{"wlan0 down"}), waitForEvents());
+
+    report("wlan0", "wlan0 up");
+    EXPECT_EQ((std::vector<std::string>{"wlan0 down", "wlan0 up"}), waitForEvents());
+}
+
+}  // namespace android::net
@@ -119,37 +119,53 @@ int FirewallController::isFirewallEnabled(void) {
 }
 
 int FirewallController::setInterfaceRule(const char* iface, FirewallRule rule) {
+    return setInterfaceRules({{iface, rule}});
+}
+
+int FirewallController::setInterfaceRules(
+        const std::vector<std::pair<std::string, FirewallRule>>& rules) {
     if (mFirewallType == DENYLIST) {
         // Unsupported in DENYLIST mode
         return -EINVAL;
     }
 
-    if (!isIfaceName(iface)) {
-        errno = ENOENT;
-        return -ENOENT;
+    for (const auto& [iface, _] : rules) {
+        if (!isIfaceName(iface)) {
+            errno = ENOENT;
+            return -ENOENT;
+        }
+    }
+
+    // Later rules for the same interface override earlier ones.
+    std::set<std::string> ifaceRules = mIfaceRules;
+    for (const auto& [iface, rule] : rules) {
+        if (rule == ALLOW) {
+            ifaceRules.insert(iface);
+        } else {
+            ifaceRules.erase(iface);
+        }
     }
 
     // Only delete rules if we actually added them, because otherwise our iptables-restore
     // processes will terminate with "no such rule" errors and cause latency penalties while we
     // spin up new ones.
-    const char* op;
-    if (rule == ALLOW && mIfaceRules.find(iface) == mIfaceRules.end()) {
-        op = "-I";
-        mIfaceRules.insert(iface);
-    } else if (rule == DENY && mIfaceRules.find(iface) != mIfaceRules.end()) {
-        op = "-D";
-        mIfaceRules.erase(iface);
-    } else {
-        return 0;
+    std::vector<std::string> commands = {"*filter"};
+    const auto appendCommands = [&commands](const char* op, const std::string& iface) {
+        commands.push_back(StringPrintf("%s fw_INPUT -i %s -j RETURN", op, iface.c_str()));
+        commands.push_back(StringPrintf("%s fw_OUTPUT -o %s -j RETURN", op, iface.c_str()));
+    };
+    for (const auto& iface : mIfaceRules) {
+        if (!ifaceRules.contains(iface)) appendCommands("-D", iface);
+    }
+    for (const auto& iface : ifaceRules) {
+        if (!mIfaceRules.contains(iface)) appendCommands("-I", iface);
     }
+    if (commands.size() == 1) return 0;
+    commands.push_back("COMMIT\n");
 
-    std::string command = Join(std::vector<std::string> {
-        "*filter",
-        StringPrintf("%s fw_INPUT -i %s -j RETURN", op, iface),
-        StringPrintf("%s fw_OUTPUT -o %s -j RETURN", op, iface),
-        "COMMIT\n"
-    }, "\n");
-    return (execIptablesRestore(V4V6, command) == 0) ? 0 : -EREMOTEIO;
+    if (execIptablesRestore(V4V6, Join(commands, "\n")) != 0) return -EREMOTEIO;
+    mIfaceRules = std::move(ifaceRules);
+    return 0;
 }
 
 /* static */
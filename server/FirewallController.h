@@ -21,6 +21,7 @@
 #include <mutex>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "NetdConstants.h"
@@ -48,6 +49,9 @@ public:
 
   /* Match traffic going in/out over the given iface. */
   int setInterfaceRule(const char*, FirewallRule);
+  /* As setInterfaceRule, for several interfaces in one iptables-restore transaction. If any
+   * name is invalid, or the transaction fails, no rule is changed. */
+  int setInterfaceRules(const std::vector<std::pair<std::string, FirewallRule>>& rules);
   /* Match traffic owned by given UID. This is specific to a particular chain. */
   int setUidRule(ChildChain, int, FirewallRule);
 
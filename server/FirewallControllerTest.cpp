@@ -109,5 +109,42 @@ TEST_F(FirewallControllerTest, TestFirewall) {
     expectIptablesRestoreCommands(noCommands);
 }
 
+TEST_F(FirewallControllerTest, TestSetInterfaceRules) {
+    std::vector<std::string> noCommands = {};
+    EXPECT_EQ(-EINVAL, mFw.setInterfaceRules({{"wlan0", ALLOW}}));
+    expectIptablesRestoreCommands(noCommands);
+
+    EXPECT_EQ(0, mFw.setFirewallType(ALLOWLIST));
+    sRestoreCmds.clear();
+
+    // Rules for several interfaces go into one transaction.
+    EXPECT_EQ(0, mFw.setInterfaceRules({{"wlan0", ALLOW}, {"rmnet_data0", ALLOW}}));
+    expectIptablesRestoreCommands({
+            "*filter\n"
+            "-I fw_INPUT -i rmnet_data0 -j RETURN\n"
+            "-I fw_OUTPUT -o rmnet_data0 -j RETURN\n"
+            "-I fw_INPUT -i wlan0 -j RETURN\n"
+            "-I fw_OUTPUT -o wlan0 -j RETURN\n"
+            "COMMIT\n"});
+
+    // Only the net change is applied: later entries for an interface override earlier ones.
+    EXPECT_EQ(0, mFw.setInterfaceRules({{"wlan0", ALLOW},
+                                        {"rmnet_data0", DENY},
+                                        {"eth0", ALLOW},
+                                        {"eth0", DENY}}));
+    expectIptablesRestoreCommands({
+            "*filter\n"
+            "-D fw_INPUT -i rmnet_data0 -j RETURN\n"
+            "-D fw_OUTPUT -o rmnet_data0 -j RETURN\n"
+            "COMMIT\n"});
+
+    EXPECT_EQ(0, mFw.setInterfaceRules({{"wlan0", ALLOW}, {"rmnet_data0", DENY}}));
+    expectIptablesRestoreCommands(noCommands);
+
+    // An invalid name rejects the whole batch.
+    EXPECT_EQ(-ENOENT, mFw.setInterfaceRules({{"rmnet_data0", ALLOW}, {"bad/name", ALLOW}}));
+    expectIptablesRestoreCommands(noCommands);
+}
+
 }  // namespace net
 }  // namespace android
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "FlightRecorder.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <android-base/stringprintf.h>
+
+using android::base::StringPrintf;
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+std::string formatTime(system_clock::time_point time) {
+    const auto sinceEpoch = time.time_since_epoch();
+    const time_t seconds = duration_cast<std::chrono::seconds>(sinceEpoch).count();
+    const int millis = duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000;
+    tm local;
+    char timestamp[32] = "";
+    if (localtime_r(&seconds, &local)) strftime(timestamp, sizeof(timestamp), "%T", &local);
+    return StringPrintf("%s.%03d", timestamp, millis);
+}
+
+std::string describe(const FlightRecorder::Entry& entry) {
+    using Event = FlightRecorder::Event;
+    switch (entry.event) {
+        case Event::NETLINK_REQUEST:
+            return StringPrintf("netlink type=%u flags=0x%x", entry.arg0, entry.arg1);
+        case Event::NETLINK_BATCH:
+            return StringPrintf("netlink batch requests=%u", entry.arg0);
+        case Event::IPTABLES_RESTORE:
+            return StringPrintf("iptables-restore lines=%u shard=%u", entry.arg0, entry.arg1);
+        case Event::SOCK_DIAG_DESTROY:
+            return StringPrintf("sock_diag destroy proto=%u destroyed=%u", entry.arg0, entry.arg1);
+        case Event::FWMARK_COMMAND:
+            return StringPrintf("fwmark cmd=%u netId=%u", entry.arg0, entry.arg1);
+    }
+    return StringPrintf("unknown event %d", static_cast<int>(entry.event));
+}
+
+}  // namespace
+
+FlightRecorder::Scope::Scope(Event event, uint32_t arg0, uint32_t arg1, FlightRecorder* recorder)
+    : mRecorder(recorder), mEvent(event), mStart(steady_clock::now()), mArg0(arg0), mArg1(arg1) {}
+
+FlightRecorder::Scope::~Scope() {
+    mRecorder->record({
+            .time = system_clock::now(),
+            .latency = duration_cast<microseconds>(steady_clock::now() - mStart),
+            .event = mEvent,
+            .result = mResult,
+            .arg0 = mArg0,
+            .arg1 = mArg1,
+    });
+}
+
+FlightRecorder::FlightRecorder(size_t capacity)
+    : mCapacity(capacity), mSlots(std::make_unique<Slot[]>(capacity)) {}
+
+FlightRecorder& FlightRecorder::global() {
+    static FlightRecorder* const sRecorder = new FlightRecorder();
+    return *sRecorder;
+}
+
+void FlightRecorder::record(const Entry& entry) {
+    const uint64_t index = mNext.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = mSlots[index % mCapacity];
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timeNs.store(duration_cast<nanoseconds>(entry.time.time_since_epoch()).count(),
+                      std::memory_order_relaxed);
+    slot.latencyUs.store(entry.latency.count(), std::memory_order_relaxed);
+    slot.eventAndResult.store(
+            static_cast<uint64_t>(entry.event) << 32 | static_cast<uint32_t>(entry.result),
+            std::memory_order_relaxed);
+    slot.args.store(static_cast<uint64_t>(entry.arg0) << 32 | entry.arg1,
+                    std::memory_order_relaxed);
+    slot.seq.store(2 * index + 2, std::memory_order_release);
+}
+
+std::vector<FlightRecorder::Entry> FlightRecorder::getEntries() const {
+    const uint64_t end = mNext.load(std::memory_order_acquire);
+    const uint64_t begin = end > mCapacity ? end - mCapacity : 0;
+    std::vector<Entry> entries;
+    entries.reserve(end - begin);
+    for (uint64_t index = begin; index < end; index++) {
+        const Slot& slot = mSlots[index % mCapacity];
+        const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * index + 2) continue;  // Still being written, or already overwritten.
+        const int64_t timeNs = slot.timeNs.load(std::memory_order_relaxed);
+        const int64_t latencyUs = slot.latencyUs.load(std::memory_order_relaxed);
+        const uint64_t eventAndResult = slot.eventAndResult.load(std::memory_order_relaxed);
+        const uint64_t args = slot.args.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+        entries.push_back({
+                .time = system_clock::time_point(
+                        duration_cast<system_clock::duration>(nanoseconds(timeNs))),
+                .latency = microseconds(latencyUs),
+                .event = static_cast<Event>(eventAndResult >> 32),
+                .result = static_cast<int32_t>(eventAndResult & 0xffffffff),
+                .arg0 = static_cast<uint32_t>(args >> 32),
+                .arg1 = static_cast<uint32_t>(args & 0xffffffff),
+        });
+    }
+    return entries;
+}
+
+bool FlightRecorder::freeze(const char* reason) {
+    const auto now = steady_clock::now();
+    std::lock_guard guard(mFrozenLock);
+    if (mFrozen.reason != nullptr && now - mFrozen.when < kMinFreezeInterval) return false;
+    mFrozen = {
+            .reason = reason,
+            .when = now,
+            .time = system_clock::now(),
+            .entries = getEntries(),
+    };
+    return true;
+}
+
+void FlightRecorder::dumpEntries(DumpWriter& dw, const std::vector<Entry>& entries) {
+    for (const Entry& entry : entries) {
+        dw.println("%s %s: %" PRId64 "us, result %d", formatTime(entry.time).c_str(),
+                   describe(entry).c_str(), static_cast<int64_t>(entry.latency.count()),
+                   entry.result);
+    }
+}
+
+void FlightRecorder::dump(DumpWriter& dw) const {
+    dw.println("Recent operations (oldest first):");
+    dw.incIndent();
+    dumpEntries(dw, getEntries());
+    dw.decIndent();
+
+    std::lock_guard guard(mFrozenLock);
+    if (mFrozen.reason == nullptr) return;
+    dw.println("Operations before the last stall (%s at %s):", mFrozen.reason,
+               formatTime(mFrozen.time).c_str());
+    dw.incIndent();
+    dumpEntries(dw, mFrozen.entries);
+    dw.decIndent();
+}
+
+}  // namespace android::net
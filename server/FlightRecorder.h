@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// A fixed-size ring of the most recent low-level operations netd performed: netlink requests,
+// iptables-restore commands, sock_diag destroys and fwmark commands, each with when it finished,
+// how long it took and its result. Recording never takes a lock or allocates, so it is always on.
+//
+// When an RPC stalls, the ring is copied aside so that the operations leading up to the stall are
+// still in dumpsys after the ring has moved on.
+class FlightRecorder {
+  public:
+    static constexpr size_t kDefaultCapacity = 4096;
+    // RPCs that take at least this long freeze a copy of the ring.
+    static constexpr std::chrono::seconds kStallThreshold{1};
+    // At most one copy is made in this interval, so that a burst of stalls keeps the first one.
+    static constexpr std::chrono::minutes kMinFreezeInterval{1};
+
+    // The meaning of arg0 and arg1 depends on the event.
+    enum class Event : uint8_t {
+        NETLINK_REQUEST,    // message type, flags
+        NETLINK_BATCH,      // requests, 0
+        IPTABLES_RESTORE,   // lines, shard
+        SOCK_DIAG_DESTROY,  // protocol, sockets destroyed
+        FWMARK_COMMAND,     // command, netId
+    };
+
+    struct Entry {
+        std::chrono::system_clock::time_point time;  // When the operation finished.
+        std::chrono::microseconds latency;
+        Event event;
+        int32_t result;
+        uint32_t arg0;
+        uint32_t arg1;
+    };
+
+    // Records an operation that lasts until it goes out of scope.
+    class Scope {
+      public:
+        explicit Scope(Event event, uint32_t arg0 = 0, uint32_t arg1 = 0,
+                       FlightRecorder* recorder = &global());
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        void setArgs(uint32_t arg0, uint32_t arg1) {
+            mArg0 = arg0;
+            mArg1 = arg1;
+        }
+        void setResult(int32_t result) { mResult = result; }
+
+      private:
+        FlightRecorder* const mRecorder;
+        const Event mEvent;
+        const std::chrono::steady_clock::time_point mStart;
+        uint32_t mArg0;
+        uint32_t mArg1;
+        int32_t mResult = 0;
+    };
+
+    explicit FlightRecorder(size_t capacity = kDefaultCapacity);
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    static FlightRecorder& global();
+
+    void record(const Entry& entry);
+
+    // The entries still in the ring, oldest first. Entries being overwritten are left out.
+    std::vector<Entry> getEntries() const;
+
+    // Copies the ring aside, unless a copy was made less than kMinFreezeInterval ago. |reason|
+    // must outlive the process, e.g. __func__. Returns whether a copy was made.
+    bool freeze(const char* reason);
+
+    void dump(netdutils::DumpWriter& dw) const;
+
+  private:
+    // A seqlock per slot: |seq| is odd while the slot is being written, so readers can tell a
+    // torn entry from a whole one without blocking the writer.
+    struct Slot {
+        std::atomic_uint64_t seq{0};
+        std::atomic_int64_t timeNs{0};
+        std::atomic_int64_t latencyUs{0};
+        std::atomic_uint64_t eventAndResult{0};
+        std::atomic_uint64_t args{0};
+    };
+
+    struct Frozen {
+        const char* reason = nullptr;
+        std::chrono::steady_clock::time_point when;
+        std::chrono::system_clock::time_point time;
+        std::vector<Entry> entries;
+    };
+
+    static void dumpEntries(netdutils::DumpWriter& dw, const std::vector<Entry>& entries);
+
+    const size_t mCapacity;
+    const std::unique_ptr<Slot[]> mSlots;
+    std::atomic_uint64_t mNext{0};
+
+    mutable std::mutex mFrozenLock;
+    Frozen mFrozen GUARDED_BY(mFrozenLock);
+};
+
+}  // namespace android::net
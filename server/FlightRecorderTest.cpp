@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FlightRecorder.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+using Event = FlightRecorder::Event;
+
+TEST(FlightRecorderTest, RecordsScopes) {
+    FlightRecorder recorder(8);
+    {
+        FlightRecorder::Scope scope(Event::IPTABLES_RESTORE, 12, 1, &recorder);
+        std::this_thread::sleep_for(1ms);
+        scope.setResult(-1);
+    }
+    {
+        FlightRecorder::Scope scope(Event::FWMARK_COMMAND, 0, 0, &recorder);
+        scope.setArgs(3, 100);
+    }
+
+    const auto entries = recorder.getEntries();
+    ASSERT_EQ(2U, entries.size());
+    EXPECT_EQ(Event::IPTABLES_RESTORE, entries[0].event);
+    EXPECT_EQ(12U, entries[0].arg0);
+    EXPECT_EQ(1U, entries[0].arg1);
+    EXPECT_EQ(-1, entries[0].result);
+    EXPECT_GE(entries[0].latency, 1ms);
+    EXPECT_EQ(Event::FWMARK_COMMAND, entries[1].event);
+    EXPECT_EQ(3U, entries[1].arg0);
+    EXPECT_EQ(100U, entries[1].arg1);
+    EXPECT_EQ(0, entries[1].result);
+    EXPECT_LE(entries[0].time, entries[1].time);
+}
+
+TEST(FlightRecorderTest, KeepsMostRecent) {
+    FlightRecorder recorder(4);
+    for (uint32_t i = 0; i < 10; i++) {
+        recorder.record({.event = Event::NETLINK_BATCH, .arg0 = i});
+    }
+    const auto entries = recorder.getEntries();
+    ASSERT_EQ(4U, entries.size());
+    for (uint32_t i = 0; i < 4; i++) EXPECT_EQ(6 + i, entries[i].arg0);
+}
+
+TEST(FlightRecorderTest, ConcurrentWriters) {
+    FlightRecorder recorder(64);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+        threads.emplace_back([&recorder, t] {
+            for (uint32_t i = 0; i < 10000; i++) {
+                recorder.record({.event = Event::NETLINK_REQUEST, .arg0 = t, .arg1 = i});
+            }
+        });
+    }
+    // Reading while the ring is written must only ever return whole entries.
+    for (int i = 0; i < 100; i++) {
+        for (const auto& entry : recorder.getEntries()) {
+            EXPECT_EQ(Event::NETLINK_REQUEST, entry.event);
+            EXPECT_LT(entry.arg0, 4U);
+        }
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(64U, recorder.getEntries().size());
+}
+
+TEST(FlightRecorderTest, FreezeIsRateLimited) {
+    FlightRecorder recorder(4);
+    recorder.record({.event = Event::SOCK_DIAG_DESTROY});
+    EXPECT_TRUE(recorder.freeze("first"));
+    EXPECT_FALSE(recorder.freeze("second"));
+}
+
+}  // namespace android::net
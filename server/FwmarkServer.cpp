@@ -16,14 +16,21 @@
 
 #include "FwmarkServer.h"
 
+#include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <selinux/selinux.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <utils/String16.h>
 
-#include <android-base/cmsg.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <binder/IServiceManager.h>
@@ -32,19 +39,37 @@
 #include "Fwmark.h"
 #include "FwmarkCommand.h"
 #include "NetdConstants.h"
+#include "NetdMetrics.h"
 #include "NetworkController.h"
+#include "ScopedTrace.h"
+#include "ThreadScheduling.h"
 
 #include "NetdUpdatablePublic.h"
 
-using android::base::ReceiveFileDescriptorVector;
 using android::base::unique_fd;
-using android::net::metrics::INetdEventListener;
 
 namespace android {
 namespace net {
 
 constexpr const char *SYSTEM_SERVER_CONTEXT = "u:r:system_server:s0";
 
+// Every persistent connection is a file descriptor in netd that is polled for commands.
+// Beyond this many, clients are refused and fall back to one connection per command.
+constexpr size_t MAX_PERSISTENT_CLIENTS = 512;
+
+// Number of threads that process commands. 0, the default, means one per CPU. 1 means commands are
+// processed on the listener thread, one at a time.
+constexpr const char* FWMARK_SERVER_THREADS_PROPERTY = "persist.netd.fwmark_server_threads";
+
+unsigned getNumWorkers() {
+    unsigned threads =
+            android::base::GetUintProperty<unsigned>(FWMARK_SERVER_THREADS_PROPERTY, 0, 64);
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    return (threads > 1) ? threads : 0;
+}
+
 bool isSystemServer(SocketClient* client) {
     if (client->getUid() != AID_SYSTEM) {
         return false;
@@ -63,23 +88,128 @@ bool isSystemServer(SocketClient* client) {
     return ret;
 }
 
-FwmarkServer::FwmarkServer(NetworkController* networkController, EventReporter* eventReporter)
+FwmarkServer::FwmarkServer(NetworkController* networkController, EventReporter* eventReporter,
+                           FwmarkServerStats* stats)
     : SocketListener(SOCKET_NAME, true),
       mNetworkController(networkController),
       mEventReporter(eventReporter),
+      mStats(stats),
       mRedirectSocketCalls(
-              android::base::GetBoolProperty("ro.vendor.redirect_socket_calls", false)) {}
+              android::base::GetBoolProperty("ro.vendor.redirect_socket_calls", false)),
+      mNumWorkers(getNumWorkers()) {
+    initSharedState();
+}
+
+void FwmarkServer::initSharedState() {
+    unique_fd fd(memfd_create("fwmark_shared_state", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd == -1 || ftruncate(fd, sizeof(FwmarkSharedState)) == -1) {
+        PLOG(ERROR) << "FwmarkServer: failed to create shared state";
+        return;
+    }
+    void* addr = mmap(nullptr, sizeof(FwmarkSharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                      0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "FwmarkServer: failed to map shared state";
+        return;
+    }
+    // Clients get the same file, so it must be impossible to write to it once we have mapped it.
+    // Otherwise, one app could stop the others from noticing network changes.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) ==
+        -1) {
+        PLOG(WARNING) << "FwmarkServer: cannot seal shared state, not sharing it";
+        munmap(addr, sizeof(FwmarkSharedState));
+        return;
+    }
+    mSharedStateFd = std::move(fd);
+    mSharedState = static_cast<FwmarkSharedState*>(addr);
+    mSharedState->generation = 1;
+
+    FwmarkSharedState* const state = mSharedState;
+    mNetworkController->setStateChangedCallback(
+            [state](const NetworkController::StateSummary& summary) {
+                // There is only one writer, since the callback runs under the write lock.
+                uint32_t sequence = state->sequence.load(std::memory_order_relaxed);
+                state->sequence.store(++sequence, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                state->defaultNetId.store(summary.defaultNetId, std::memory_order_relaxed);
+                state->hasUidRanges.store(summary.hasUidRanges, std::memory_order_relaxed);
+                // Skip 0, which clients treat as "never published".
+                if (++sequence == 0) sequence = 2;
+                state->sequence.store(sequence, std::memory_order_release);
+
+                // Skip 0, which clients treat as "unknown".
+                if (state->generation.fetch_add(1, std::memory_order_release) == UINT32_MAX) {
+                    state->generation.fetch_add(1, std::memory_order_release);
+                }
+            });
+}
+
+FwmarkServer::~FwmarkServer() {
+    // Stop handing connections to the workers before stopping them.
+    if (mStarted) stopListener();
+    if (mWorkers.empty()) return;
+    eventfd_write(mStopFd, 1);
+    for (std::thread& worker : mWorkers) {
+        worker.join();
+    }
+}
+
+int FwmarkServer::start() {
+    if (mNumWorkers > 0) {
+        mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+        mStopFd.reset(eventfd(0, EFD_CLOEXEC));
+        epoll_event event = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+        if (mEpollFd == -1 || mStopFd == -1 ||
+            epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mStopFd, &event) == -1) {
+            PLOG(ERROR) << "FwmarkServer: cannot set up the workers, using the listener thread";
+            mEpollFd.reset();
+        } else {
+            for (unsigned i = 0; i < mNumWorkers; ++i) {
+                mWorkers.emplace_back(&FwmarkServer::runWorker, this);
+            }
+            LOG(INFO) << "FwmarkServer: processing commands on " << mNumWorkers << " threads";
+        }
+    }
+    const int ret = SocketListener::startListener();
+    mStarted = (ret == 0);
+    return ret;
+}
 
 bool FwmarkServer::onDataAvailable(SocketClient* client) {
+    ThreadScheduling::applyToCurrentThread(ThreadRole::FWMARK);
+    // The listener's copy of the connection is closed either way: from now on, the workers own it.
+    if (mEpollFd != -1 && dispatchToWorkers(client)) {
+        return false;
+    }
+
     int socketFd = -1;
-    int error = processClient(client, &socketFd);
+    int replyFd = -1;
+    bool persistent = mPersistentClients.count(client);
+    FlightRecorder::Scope record(FlightRecorder::Event::FWMARK_COMMAND);
+    int error = processClient(client->getSocket(), client->getUid(), &persistent, &socketFd,
+                              &replyFd, &record);
+    record.setResult(error);
     if (socketFd >= 0) {
         close(socketFd);
     }
 
+    if (persistent) {
+        if (replyToPersistentClient(client->getSocket(), error, replyFd)) {
+            mPersistentClients.insert(client);
+            return true;
+        }
+        mPersistentClients.erase(client);
+        mPersistentCount--;
+        return false;
+    }
+
     // Always send a response even if there were connection errors or read errors, so that we don't
     // inadvertently cause the client to hang (which always waits for a response).
-    client->sendData(&error, sizeof(error));
+    if (replyFd != -1) {
+        sendReply(client->getSocket(), error, replyFd, MSG_NOSIGNAL);
+    } else {
+        client->sendData(&error, sizeof(error));
+    }
 
     // Always close the client connection (by returning false). This prevents a DoS attack where
     // the client issues multiple commands on the same connection, never reading the responses,
@@ -87,6 +217,207 @@ bool FwmarkServer::onDataAvailable(SocketClient* client) {
     return false;
 }
 
+bool FwmarkServer::sendReply(int clientFd, int error, int replyFd, int flags) {
+    iovec iov = {&error, sizeof(error)};
+    msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(replyFd))];
+    } cmsgu;
+
+    if (replyFd != -1) {
+        memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+        message.msg_control = cmsgu.cmsg;
+        message.msg_controllen = sizeof(cmsgu.cmsg);
+
+        cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+        cmsgh->cmsg_len = CMSG_LEN(sizeof(replyFd));
+        cmsgh->cmsg_level = SOL_SOCKET;
+        cmsgh->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsgh), &replyFd, sizeof(replyFd));
+    }
+
+    return TEMP_FAILURE_RETRY(sendmsg(clientFd, &message, flags)) == sizeof(error);
+}
+
+bool FwmarkServer::replyToPersistentClient(int clientFd, int error, int replyFd) {
+    // Persistent clients wait for each reply before sending the next command. Never block on a
+    // client that doesn't: if its receive buffer is full, drop the connection, to prevent a DoS
+    // attack where the client issues commands without ever reading the responses.
+    const bool sent = sendReply(clientFd, error, replyFd, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return sent && error != -ESHUTDOWN;
+}
+
+int FwmarkServer::enablePersistentConnection(bool* persistent) {
+    if (*persistent) {
+        return 0;
+    }
+    if (mPersistentCount++ >= MAX_PERSISTENT_CLIENTS) {
+        mPersistentCount--;
+        return -EBUSY;
+    }
+    *persistent = true;
+    return 0;
+}
+
+bool FwmarkServer::dispatchToWorkers(SocketClient* client) {
+    auto connection = std::make_unique<Connection>();
+    connection->fd.reset(fcntl(client->getSocket(), F_DUPFD_CLOEXEC, 0));
+    if (connection->fd == -1) {
+        PLOG(ERROR) << "FwmarkServer: failed to dup client socket";
+        return false;
+    }
+    connection->uid = client->getUid();
+
+    // The command is already readable, so a worker picks it up immediately.
+    epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data = {.ptr = connection.get()}};
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, connection->fd, &event) == -1) {
+        PLOG(ERROR) << "FwmarkServer: failed to hand off client";
+        return false;
+    }
+    connection.release();
+    return true;
+}
+
+void FwmarkServer::runWorker() {
+    ThreadScheduling::applyToCurrentThread(ThreadRole::FWMARK);
+    while (true) {
+        epoll_event event;
+        const int n = epoll_wait(mEpollFd, &event, 1, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                PLOG(ERROR) << "FwmarkServer: epoll_wait failed";
+            }
+            continue;
+        }
+        if (n == 1) {
+            // Only mStopFd has no connection.
+            if (event.data.ptr == nullptr) return;
+            serve(static_cast<Connection*>(event.data.ptr));
+        }
+    }
+}
+
+void FwmarkServer::serve(Connection* connection) {
+    int socketFd = -1;
+    int replyFd = -1;
+    FlightRecorder::Scope record(FlightRecorder::Event::FWMARK_COMMAND);
+    int error = processClient(connection->fd, connection->uid, &connection->persistent,
+                              &socketFd, &replyFd, &record);
+    record.setResult(error);
+    if (socketFd >= 0) {
+        close(socketFd);
+    }
+
+    if (connection->persistent) {
+        if (replyToPersistentClient(connection->fd, error, replyFd)) {
+            epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data = {.ptr = connection}};
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, connection->fd, &event) == 0) {
+                return;
+            }
+            PLOG(ERROR) << "FwmarkServer: failed to re-arm persistent client";
+        }
+        mPersistentCount--;
+    } else {
+        // As in onDataAvailable(), always reply, and never keep the connection open.
+        sendReply(connection->fd, error, replyFd, MSG_NOSIGNAL);
+    }
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+    delete connection;
+}
+
+// A command as it is laid out on the wire. Commands are received straight into it.
+struct FwmarkMessage {
+    FwmarkCommand command;
+    union {
+        FwmarkConnectInfo connectInfo;
+        uint32_t tags[FwmarkCommand::MAX_BATCH_FDS];  // TAG_SOCKET_BATCH only.
+    };
+
+    FwmarkMessage() : connectInfo() {}
+};
+
+static_assert(offsetof(FwmarkMessage, connectInfo) == sizeof(FwmarkCommand));
+static_assert(offsetof(FwmarkMessage, tags) == sizeof(FwmarkCommand));
+
+// The file descriptors received with a command. Those that are not released are closed.
+struct ReceivedFds {
+    std::array<unique_fd, FwmarkCommand::MAX_BATCH_FDS> fds;
+    size_t count = 0;
+};
+
+// Receives one command from |clientFd| into |message|, and the file descriptors sent with it into
+// |fds|, without allocating. Returns the length of the command, or a negative errno value.
+static ssize_t receiveMessage(int clientFd, FwmarkMessage* message, ReceivedFds* fds) {
+    iovec iov = {message, sizeof(*message)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(int) * FwmarkCommand::MAX_BATCH_FDS)];
+    } cmsgu;
+    msg.msg_control = cmsgu.cmsg;
+    msg.msg_controllen = sizeof(cmsgu.cmsg);
+
+    const ssize_t len = TEMP_FAILURE_RETRY(recvmsg(clientFd, &msg, MSG_CMSG_CLOEXEC));
+    if (len == -1) {
+        return -errno;
+    }
+
+    for (cmsghdr* cmsgh = CMSG_FIRSTHDR(&msg); cmsgh; cmsgh = CMSG_NXTHDR(&msg, cmsgh)) {
+        if (cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t numFds = (cmsgh->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < numFds; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsgh) + i * sizeof(fd), sizeof(fd));
+            if (fds->count < fds->fds.size()) {
+                fds->fds[fds->count++].reset(fd);
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    // The client sent more file descriptors than any command carries.
+    if (msg.msg_flags & MSG_CTRUNC) {
+        return -EMSGSIZE;
+    }
+    return len;
+}
+
+static NetdMetrics::Counter sCommands("fwmark.commands");
+
+// Records how long one command, and each step of it, takes.
+class CommandTimer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit CommandTimer(FwmarkServerStats* stats) : mStats(stats), mStart(Clock::now()) {}
+    ~CommandTimer() { record(FwmarkServerStats::TOTAL, mStart); }
+
+    // Nothing is recorded until the command is known.
+    void setCommand(int cmdId) { mCmdId = cmdId; }
+
+    // Records the time elapsed since |start| as the latency of |step|.
+    void record(FwmarkServerStats::Step step, Clock::time_point start) {
+        if (mCmdId >= 0) mStats->record(mCmdId, step, Clock::now() - start);
+    }
+
+    CommandTimer(const CommandTimer&) = delete;
+    CommandTimer& operator=(const CommandTimer&) = delete;
+
+  private:
+    FwmarkServerStats* const mStats;
+    const Clock::time_point mStart;
+    int mCmdId = -1;
+};
+
 static bool hasDestinationAddress(FwmarkCommand::CmdId cmdId, bool redirectSocketCalls) {
     if (redirectSocketCalls) {
         return (cmdId == FwmarkCommand::ON_SENDTO || cmdId == FwmarkCommand::ON_CONNECT ||
@@ -97,34 +428,43 @@ static bool hasDestinationAddress(FwmarkCommand::CmdId cmdId, bool redirectSocke
     }
 }
 
-int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
-    FwmarkCommand command;
-    FwmarkConnectInfo connectInfo;
-
-    char buf[sizeof(command) + sizeof(connectInfo)];
-    std::vector<unique_fd> received_fds;
-    ssize_t messageLength =
-            ReceiveFileDescriptorVector(client->getSocket(), buf, sizeof(buf), 1, &received_fds);
+int FwmarkServer::processClient(int clientFd, uid_t uid, bool* persistent, int* socketFd,
+                                int* replyFd, FlightRecorder::Scope* record) {
+    CommandTimer timer(mStats);
+    const auto receiveStart = CommandTimer::Clock::now();
+    FwmarkMessage message;
+    ReceivedFds received_fds;
+    ssize_t messageLength = receiveMessage(clientFd, &message, &received_fds);
 
     if (messageLength < 0) {
-        return -errno;
+        return static_cast<int>(messageLength);
     } else if (messageLength == 0) {
         return -ESHUTDOWN;
     }
 
-    memcpy(&command, buf, sizeof(command));
-    memcpy(&connectInfo, buf + sizeof(command), sizeof(connectInfo));
+    FwmarkCommand& command = message.command;
+    const FwmarkConnectInfo& connectInfo = message.connectInfo;
+    timer.setCommand(command.cmdId);
+    timer.record(FwmarkServerStats::RECEIVE, receiveStart);
+    sCommands.inc();
+    record->setArgs(command.cmdId, command.netId);
+    ScopedTrace trace("fwmark cmd=%d netId=%u uid=%u fds=%zu", static_cast<int>(command.cmdId),
+                      command.netId, uid, received_fds.count);
 
     size_t expectedLen = sizeof(command);
     if (hasDestinationAddress(command.cmdId, mRedirectSocketCalls)) {
         expectedLen += sizeof(connectInfo);
+    } else if (command.cmdId == FwmarkCommand::TAG_SOCKET_BATCH) {
+        expectedLen += sizeof(message.tags[0]) * received_fds.count;
     }
 
     if (messageLength != static_cast<ssize_t>(expectedLen)) {
         return -EBADMSG;
     }
 
-    Permission permission = mNetworkController->getPermissionForUser(client->getUid());
+    const auto permissionStart = CommandTimer::Clock::now();
+    Permission permission = mNetworkController->getPermissionForUser(uid);
+    timer.record(FwmarkServerStats::PERMISSION_LOOKUP, permissionStart);
 
     if (command.cmdId == FwmarkCommand::QUERY_USER_ACCESS) {
         if ((permission & PERMISSION_SYSTEM) != PERMISSION_SYSTEM) {
@@ -133,15 +473,39 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         return mNetworkController->checkUserNetworkAccess(command.uid, command.netId);
     }
 
-    if (received_fds.size() != 1) {
-        LOG(ERROR) << "FwmarkServer received " << received_fds.size() << " fds from client?";
-        return -EBADF;
-    } else if (received_fds[0] < 0) {
-        LOG(ERROR) << "FwmarkServer received fd -1 from ReceiveFileDescriptorVector?";
+    if (command.cmdId == FwmarkCommand::ENABLE_PERSISTENT_CONNECTION) {
+        return enablePersistentConnection(persistent);
+    }
+
+    if (command.cmdId == FwmarkCommand::GET_SHARED_STATE) {
+        if (mSharedStateFd == -1) {
+            return -EOPNOTSUPP;
+        }
+        *replyFd = mSharedStateFd.get();
+        return 0;
+    }
+
+    if (command.cmdId == FwmarkCommand::PREPARE_FOR_CONNECT_BATCH) {
+        return prepareForConnect(received_fds.fds.data(), received_fds.count, uid, permission);
+    }
+
+    if (command.cmdId == FwmarkCommand::TAG_SOCKET_BATCH ||
+        command.cmdId == FwmarkCommand::UNTAG_SOCKET_BATCH) {
+        // As for TAG_SOCKET, -1 means the caller's UID.
+        if (static_cast<int>(command.uid) == -1) {
+            command.uid = uid;
+        }
+        const uint32_t* tags =
+                (command.cmdId == FwmarkCommand::TAG_SOCKET_BATCH) ? message.tags : nullptr;
+        return tagSockets(received_fds.fds.data(), tags, received_fds.count, command.uid, uid);
+    }
+
+    if (received_fds.count != 1) {
+        LOG(ERROR) << "FwmarkServer received " << received_fds.count << " fds from client?";
         return -EBADF;
     }
 
-    *socketFd = received_fds[0].release();
+    *socketFd = received_fds.fds[0].release();
 
     int family;
     socklen_t familyLen = sizeof(family);
@@ -158,6 +522,7 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         return -errno;
     }
 
+    const auto resolveStart = CommandTimer::Clock::now();
     switch (command.cmdId) {
         case FwmarkCommand::ON_ACCEPT: {
             // Called after a socket accept(). The kernel would've marked the NetId and necessary
@@ -200,16 +565,13 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
             //
             // So, overall (when the explicit bit is not set but the protect bit is set), if the
             // existing NetId is a VPN, don't reset it. Else, set the default network's NetId.
-            if (!fwmark.explicitlySelected) {
-                if (family == AF_INET6 && connectInfo.addr.sin6.sin6_scope_id &&
-                    IN6_IS_ADDR_LINKLOCAL(&connectInfo.addr.sin6.sin6_addr)) {
-                    fwmark.netId = mNetworkController->getNetworkForInterface(
-                            connectInfo.addr.sin6.sin6_scope_id);
-                } else if (!fwmark.protectedFromVpn) {
-                    fwmark.netId = mNetworkController->getNetworkForConnect(client->getUid());
-                } else if (!mNetworkController->isVirtualNetwork(fwmark.netId)) {
-                    fwmark.netId = mNetworkController->getDefaultNetwork();
-                }
+            if (!fwmark.explicitlySelected && family == AF_INET6 &&
+                connectInfo.addr.sin6.sin6_scope_id &&
+                IN6_IS_ADDR_LINKLOCAL(&connectInfo.addr.sin6.sin6_addr)) {
+                fwmark.netId = mNetworkController->getNetworkForInterface(
+                        connectInfo.addr.sin6.sin6_scope_id);
+            } else {
+                selectNetworkForConnect(uid, &fwmark);
             }
             break;
         }
@@ -227,21 +589,18 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
                 break;
             }
 
-            android::sp<android::net::metrics::INetdEventListener> netdEventListener =
-                    mEventReporter->getNetdEventListener();
-
-            if (netdEventListener != nullptr) {
-                char addrstr[INET6_ADDRSTRLEN];
-                char portstr[sizeof("65536")];
-                const int ret = getnameinfo((sockaddr*) &connectInfo.addr, sizeof(connectInfo.addr),
-                        addrstr, sizeof(addrstr), portstr, sizeof(portstr),
-                        NI_NUMERICHOST | NI_NUMERICSERV);
-
-                netdEventListener->onConnectEvent(fwmark.netId, connectInfo.error,
-                        connectInfo.latencyMs,
-                        (ret == 0) ? String16(addrstr) : String16(""),
-                        (ret == 0) ? strtoul(portstr, nullptr, 10) : 0, client->getUid());
-            }
+            // Don't make the client wait for the binder call.
+            EventReporter::ConnectEvent event = {
+                    .netId = fwmark.netId,
+                    .error = connectInfo.error,
+                    .latencyMs = connectInfo.latencyMs,
+                    .addr = {},
+                    .uid = uid,
+            };
+            memcpy(&event.addr, &connectInfo.addr, sizeof(connectInfo.addr));
+            const auto reportStart = CommandTimer::Clock::now();
+            mEventReporter->reportConnectEvent(event);
+            timer.record(FwmarkServerStats::REPORT_EVENT, reportStart);
             break;
         }
 
@@ -258,18 +617,17 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
                 fwmark.protectedFromVpn = false;
                 permission = PERMISSION_NONE;
             } else {
-                if (int ret = mNetworkController->checkUserNetworkAccess(client->getUid(),
-                                                                         command.netId)) {
+                if (int ret = mNetworkController->checkUserNetworkAccess(uid, command.netId)) {
                     return ret;
                 }
                 fwmark.explicitlySelected = true;
-                fwmark.protectedFromVpn = mNetworkController->canProtect(client->getUid());
+                fwmark.protectedFromVpn = mNetworkController->canProtect(uid);
             }
             break;
         }
 
         case FwmarkCommand::PROTECT_FROM_VPN: {
-            if (!mNetworkController->canProtect(client->getUid())) {
+            if (!mNetworkController->canProtect(uid)) {
                 return -EPERM;
             }
             // If a bypassable VPN's provider app calls connect() and then protect(), it will end up
@@ -302,10 +660,10 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
             //  - xt_qtaguid will see -1 on the command line, fail to parse it as a uint32_t, and
             //    fall back to current_fsuid().
             if (static_cast<int>(command.uid) == -1) {
-                command.uid = client->getUid();
+                command.uid = uid;
             }
             return libnetd_updatable_tagSocket(*socketFd, command.trafficCtrlInfo, command.uid,
-                                               client->getUid());
+                                               uid);
         }
 
         case FwmarkCommand::UNTAG_SOCKET: {
@@ -320,14 +678,82 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
     }
 
     fwmark.permission = permission;
+    timer.record(FwmarkServerStats::RESOLVE_NETWORK, resolveStart);
 
+    const auto setMarkStart = CommandTimer::Clock::now();
     if (setsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
                    sizeof(fwmark.intValue)) == -1) {
         return -errno;
     }
+    timer.record(FwmarkServerStats::SET_MARK, setMarkStart);
 
     return 0;
 }
 
+void FwmarkServer::selectNetworkForConnect(uid_t uid, Fwmark* fwmark) const {
+    if (fwmark->explicitlySelected) {
+        return;
+    }
+    if (!fwmark->protectedFromVpn) {
+        fwmark->netId = mNetworkController->getNetworkForConnect(uid);
+    } else if (!mNetworkController->isVirtualNetwork(fwmark->netId)) {
+        fwmark->netId = mNetworkController->getDefaultNetwork();
+    }
+}
+
+int FwmarkServer::prepareForConnect(const unique_fd* socketFds, size_t numFds, uid_t uid,
+                                    Permission permission) const {
+    if (numFds == 0) {
+        LOG(ERROR) << "FwmarkServer received no fds from client?";
+        return -EBADF;
+    }
+
+    int error = 0;
+    for (size_t i = 0; i < numFds; ++i) {
+        const int socketFd = socketFds[i].get();
+        int family;
+        socklen_t familyLen = sizeof(family);
+        if (getsockopt(socketFd, SOL_SOCKET, SO_DOMAIN, &family, &familyLen) == -1) {
+            if (!error) error = -errno;
+            continue;
+        }
+        // As with connect(), sockets that are not inet sockets are not marked.
+        if (!FwmarkCommand::isSupportedFamily(family)) {
+            continue;
+        }
+
+        Fwmark fwmark;
+        socklen_t fwmarkLen = sizeof(fwmark.intValue);
+        if (getsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1) {
+            if (!error) error = -errno;
+            continue;
+        }
+        selectNetworkForConnect(uid, &fwmark);
+        fwmark.permission = permission;
+        if (setsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
+                       sizeof(fwmark.intValue)) == -1) {
+            if (!error) error = -errno;
+        }
+    }
+    return error;
+}
+
+int FwmarkServer::tagSockets(const unique_fd* socketFds, const uint32_t* tags, size_t numFds,
+                             uid_t tagUid, uid_t callingUid) {
+    if (numFds == 0) {
+        LOG(ERROR) << "FwmarkServer received no fds from client?";
+        return -EBADF;
+    }
+
+    int error = 0;
+    for (size_t i = 0; i < numFds; ++i) {
+        const int socketFd = socketFds[i].get();
+        const int ret = tags ? libnetd_updatable_tagSocket(socketFd, tags[i], tagUid, callingUid)
+                             : libnetd_updatable_untagSocket(socketFd);
+        if (ret && !error) error = ret;
+    }
+    return error;
+}
+
 }  // namespace net
 }  // namespace android
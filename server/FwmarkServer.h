@@ -17,7 +17,19 @@
 #ifndef NETD_SERVER_FWMARK_SERVER_H
 #define NETD_SERVER_FWMARK_SERVER_H
 
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
 #include "EventReporter.h"
+#include "FlightRecorder.h"
+#include "Fwmark.h"
+#include "FwmarkCommand.h"
+#include "FwmarkServerStats.h"
+#include "Permission.h"
 #include "sysutils/SocketListener.h"
 
 namespace android {
@@ -27,20 +39,95 @@ class NetworkController;
 
 class FwmarkServer : public SocketListener {
 public:
-  explicit FwmarkServer(NetworkController* networkController, EventReporter* eventReporter);
+  FwmarkServer(NetworkController* networkController, EventReporter* eventReporter,
+               FwmarkServerStats* stats);
+  // Stops the listener and then the worker threads.
+  ~FwmarkServer();
 
   static constexpr const char* SOCKET_NAME = "fwmarkd";
 
+  // Starts the worker threads, if any, and then the listener. Returns 0 on success. Call it
+  // instead of SocketListener::startListener(), which does not start the workers.
+  int start();
+
 private:
+    // A connection handed off by the listener thread to the workers.
+    struct Connection {
+        android::base::unique_fd fd;
+        uid_t uid;
+        bool persistent = false;
+    };
+
     // Overridden from SocketListener:
     bool onDataAvailable(SocketClient* client);
 
+    // Reads one command from |clientFd|, sent by |uid|, and executes it. Sets |*persistent| if
+    // the command asked to keep the connection open and that was granted. Sets |*replyFd| to a
+    // file descriptor to send with the reply, if any; it is not owned by the caller. Sets the
+    // command and netId in |record|.
     // Returns 0 on success or a negative errno value on failure.
-    int processClient(SocketClient* client, int* socketFd);
+    int processClient(int clientFd, uid_t uid, bool* persistent, int* socketFd, int* replyFd,
+                      FlightRecorder::Scope* record);
+
+    // Sets the NetId that ON_CONNECT chooses for a socket that is not connecting to a scoped
+    // link-local address.
+    void selectNetworkForConnect(uid_t uid, Fwmark* fwmark) const;
+
+    // Handles PREPARE_FOR_CONNECT_BATCH: marks each of |socketFds| as ON_CONNECT would. Sockets
+    // that cannot be marked do not stop the others from being marked; the first error is returned.
+    int prepareForConnect(const android::base::unique_fd* socketFds, size_t numFds, uid_t uid,
+                          Permission permission) const;
+
+    // Handles TAG_SOCKET_BATCH, if |tags| is not null, and UNTAG_SOCKET_BATCH. Sockets that cannot
+    // be tagged or untagged do not stop the others; the first error is returned.
+    static int tagSockets(const android::base::unique_fd* socketFds, const uint32_t* tags,
+                          size_t numFds, uid_t tagUid, uid_t callingUid);
+
+    // Sends |error|, and |replyFd| if it is not -1, to the client. Returns whether it was sent.
+    static bool sendReply(int clientFd, int error, int replyFd, int flags);
+
+    // Creates the FwmarkSharedState mapping and keeps its generation current.
+    void initSharedState();
+
+    // Returns 0 and sets |*persistent|, or -EBUSY if there are too many persistent connections.
+    int enablePersistentConnection(bool* persistent);
+
+    // Sends |error| to a persistent client without blocking. Returns whether the connection can
+    // be kept open.
+    static bool replyToPersistentClient(int clientFd, int error, int replyFd);
+
+    // Hands |client| to the workers. Returns false if that failed and the command must be
+    // processed on the listener thread.
+    bool dispatchToWorkers(SocketClient* client);
+
+    void runWorker();
+    void serve(Connection* connection);
 
     NetworkController* const mNetworkController;
     EventReporter* mEventReporter;
+    FwmarkServerStats* const mStats;
     bool mRedirectSocketCalls;
+
+    // Number of workers, or 0 to process every command on the listener thread.
+    const unsigned mNumWorkers;
+    // Connections being served by the workers, registered with EPOLLONESHOT so that each ready
+    // connection wakes exactly one worker.
+    android::base::unique_fd mEpollFd;
+    // An eventfd in mEpollFd, level-triggered so that it wakes every worker, written to make the
+    // workers return.
+    android::base::unique_fd mStopFd;
+    std::vector<std::thread> mWorkers;
+    bool mStarted = false;
+
+    // A sealed memfd that clients can only map read-only, and our writable mapping of it. -1 and
+    // null if the kernel does not support sealing it.
+    android::base::unique_fd mSharedStateFd;
+    FwmarkSharedState* mSharedState = nullptr;
+
+    std::atomic<size_t> mPersistentCount = 0;
+    // Clients that asked to keep their connection open, when commands are processed on the
+    // listener thread. Only accessed on the listener thread.
+    std::unordered_set<SocketClient*> mPersistentClients;
 };
 
 }  // namespace net
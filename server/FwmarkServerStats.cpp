@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FwmarkServerStats.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <bit>
+#include <string>
+#include <thread>
+
+#include <android-base/stringprintf.h>
+
+using android::base::StringAppendF;
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+// Beyond this many, CPUs share counters. Each shard is about 26 KiB.
+constexpr size_t MAX_SHARDS = 8;
+
+size_t getNumShards() {
+    return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_SHARDS);
+}
+
+}  // namespace
+
+FwmarkServerStats::FwmarkServerStats()
+    : mNumShards(getNumShards()), mShards(new Shard[mNumShards]) {
+    for (size_t shard = 0; shard < mNumShards; ++shard) {
+        for (auto& steps : mShards[shard].counts) {
+            for (auto& buckets : steps) {
+                for (auto& count : buckets) count.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+size_t FwmarkServerStats::bucketFor(std::chrono::nanoseconds latency) {
+    if (latency.count() <= 1) return 0;
+    const size_t bucket = std::bit_width(static_cast<uint64_t>(latency.count())) - 1;
+    return std::min(bucket, NUM_BUCKETS - 1);
+}
+
+void FwmarkServerStats::record(int cmdId, Step step, std::chrono::nanoseconds latency) {
+    if (cmdId < 0 || static_cast<size_t>(cmdId) >= NUM_COMMANDS || step < 0 || step >= NUM_STEPS) {
+        return;
+    }
+    // A thread that migrates between sched_getcpu() and the increment only costs a shared cache
+    // line, never a lost count.
+    const int cpu = sched_getcpu();
+    Shard& shard = mShards[(cpu < 0) ? 0 : static_cast<size_t>(cpu) % mNumShards];
+    shard.counts[cmdId][step][bucketFor(latency)].fetch_add(1, std::memory_order_relaxed);
+}
+
+FwmarkServerStats::Histogram FwmarkServerStats::getHistogram(int cmdId, Step step) const {
+    Histogram histogram = {};
+    if (cmdId < 0 || static_cast<size_t>(cmdId) >= NUM_COMMANDS || step < 0 || step >= NUM_STEPS) {
+        return histogram;
+    }
+    for (size_t shard = 0; shard < mNumShards; ++shard) {
+        for (size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+            histogram[bucket] +=
+                    mShards[shard].counts[cmdId][step][bucket].load(std::memory_order_relaxed);
+        }
+    }
+    return histogram;
+}
+
+const char* FwmarkServerStats::stepName(Step step) {
+    switch (step) {
+        case RECEIVE:
+            return "receive";
+        case PERMISSION_LOOKUP:
+            return "permission_lookup";
+        case RESOLVE_NETWORK:
+            return "resolve_network";
+        case SET_MARK:
+            return "set_mark";
+        case REPORT_EVENT:
+            return "report_event";
+        case TOTAL:
+            return "total";
+        default:
+            return "unknown";
+    }
+}
+
+const char* FwmarkServerStats::commandName(int cmdId) {
+    switch (cmdId) {
+        case FwmarkCommand::ON_ACCEPT:
+            return "ON_ACCEPT";
+        case FwmarkCommand::ON_CONNECT:
+            return "ON_CONNECT";
+        case FwmarkCommand::SELECT_NETWORK:
+            return "SELECT_NETWORK";
+        case FwmarkCommand::PROTECT_FROM_VPN:
+            return "PROTECT_FROM_VPN";
+        case FwmarkCommand::SELECT_FOR_USER:
+            return "SELECT_FOR_USER";
+        case FwmarkCommand::QUERY_USER_ACCESS:
+            return "QUERY_USER_ACCESS";
+        case FwmarkCommand::ON_CONNECT_COMPLETE:
+            return "ON_CONNECT_COMPLETE";
+        case FwmarkCommand::TAG_SOCKET:
+            return "TAG_SOCKET";
+        case FwmarkCommand::UNTAG_SOCKET:
+            return "UNTAG_SOCKET";
+        case FwmarkCommand::ON_SENDMMSG:
+            return "ON_SENDMMSG";
+        case FwmarkCommand::ON_SENDMSG:
+            return "ON_SENDMSG";
+        case FwmarkCommand::ON_SENDTO:
+            return "ON_SENDTO";
+        case FwmarkCommand::ENABLE_PERSISTENT_CONNECTION:
+            return "ENABLE_PERSISTENT_CONNECTION";
+        case FwmarkCommand::GET_SHARED_STATE:
+            return "GET_SHARED_STATE";
+        case FwmarkCommand::PREPARE_FOR_CONNECT_BATCH:
+            return "PREPARE_FOR_CONNECT_BATCH";
+        case FwmarkCommand::TAG_SOCKET_BATCH:
+            return "TAG_SOCKET_BATCH";
+        case FwmarkCommand::UNTAG_SOCKET_BATCH:
+            return "UNTAG_SOCKET_BATCH";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+void FwmarkServerStats::dump(DumpWriter& dw) const {
+    dw.incIndent();
+    dw.println("FwmarkServer latency (bucket lower bound in ns: count)");
+    dw.incIndent();
+    for (size_t cmdId = 0; cmdId < NUM_COMMANDS; ++cmdId) {
+        for (int step = 0; step < NUM_STEPS; ++step) {
+            const Histogram histogram = getHistogram(cmdId, static_cast<Step>(step));
+            std::string buckets;
+            for (size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+                if (histogram[bucket] == 0) continue;
+                StringAppendF(&buckets, " %llu:%llu", bucket ? 1ULL << bucket : 0ULL,
+                              static_cast<unsigned long long>(histogram[bucket]));
+            }
+            if (buckets.empty()) continue;
+            dw.println("%s %s:%s", commandName(cmdId), stepName(static_cast<Step>(step)),
+                       buckets.c_str());
+        }
+    }
+    dw.decIndent();
+    dw.decIndent();
+}
+
+}  // namespace android::net
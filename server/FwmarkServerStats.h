@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "FwmarkCommand.h"
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Latency histograms of the commands processed by FwmarkServer, per command and per step. Each
+// histogram has log2 buckets: bucket i counts latencies in [2^i, 2^(i+1)) ns, except that bucket
+// 0 also counts shorter ones and the last bucket also counts longer ones. Recording is lock-free
+// and wait-free: each CPU updates its own copy of the counters, and readers sum the copies.
+class FwmarkServerStats {
+  public:
+    enum Step {
+        // Reading the command and its file descriptors from the client.
+        RECEIVE,
+        // Looking up the permissions of the calling UID.
+        PERMISSION_LOOKUP,
+        // Working out the new fwmark, including any NetworkController queries.
+        RESOLVE_NETWORK,
+        // Writing SO_MARK on the socket.
+        SET_MARK,
+        // Queueing the connect event for the event listeners.
+        REPORT_EVENT,
+        // The whole command, from receive to reply.
+        TOTAL,
+        NUM_STEPS,
+    };
+
+    static constexpr size_t NUM_COMMANDS = FwmarkCommand::UNTAG_SOCKET_BATCH + 1;
+    static constexpr size_t NUM_BUCKETS = 32;
+
+    using Histogram = std::array<uint64_t, NUM_BUCKETS>;
+
+    FwmarkServerStats();
+
+    // Adds |latency| to the histogram of |step| of |cmdId|. Unknown commands are ignored.
+    void record(int cmdId, Step step, std::chrono::nanoseconds latency);
+
+    // Returns the histogram of |step| of |cmdId|, or an empty histogram if either is unknown.
+    Histogram getHistogram(int cmdId, Step step) const;
+
+    static size_t bucketFor(std::chrono::nanoseconds latency);
+    static const char* stepName(Step step);
+    static const char* commandName(int cmdId);
+
+    void dump(netdutils::DumpWriter& dw) const;
+
+  private:
+    // One CPU's counters, on cache lines of their own.
+    struct alignas(64) Shard {
+        std::atomic_uint64_t counts[NUM_COMMANDS][NUM_STEPS][NUM_BUCKETS];
+    };
+
+    const size_t mNumShards;
+    const std::unique_ptr<Shard[]> mShards;
+};
+
+}  // namespace android::net
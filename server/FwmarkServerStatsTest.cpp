@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FwmarkServerStats.h"
+
+namespace android::net {
+
+using std::chrono::nanoseconds;
+
+TEST(FwmarkServerStatsTest, BucketFor) {
+    EXPECT_EQ(0U, FwmarkServerStats::bucketFor(nanoseconds(-5)));
+    EXPECT_EQ(0U, FwmarkServerStats::bucketFor(nanoseconds(0)));
+    EXPECT_EQ(0U, FwmarkServerStats::bucketFor(nanoseconds(1)));
+    EXPECT_EQ(1U, FwmarkServerStats::bucketFor(nanoseconds(2)));
+    EXPECT_EQ(1U, FwmarkServerStats::bucketFor(nanoseconds(3)));
+    EXPECT_EQ(10U, FwmarkServerStats::bucketFor(nanoseconds(1024)));
+    EXPECT_EQ(10U, FwmarkServerStats::bucketFor(nanoseconds(2047)));
+    EXPECT_EQ(FwmarkServerStats::NUM_BUCKETS - 1,
+              FwmarkServerStats::bucketFor(std::chrono::hours(1)));
+}
+
+TEST(FwmarkServerStatsTest, RecordAndGet) {
+    FwmarkServerStats stats;
+    stats.record(FwmarkCommand::ON_CONNECT, FwmarkServerStats::TOTAL, nanoseconds(5000));
+    stats.record(FwmarkCommand::ON_CONNECT, FwmarkServerStats::TOTAL, nanoseconds(6000));
+    stats.record(FwmarkCommand::ON_CONNECT, FwmarkServerStats::SET_MARK, nanoseconds(100));
+    // Out of range: ignored.
+    stats.record(-1, FwmarkServerStats::TOTAL, nanoseconds(5000));
+    stats.record(FwmarkServerStats::NUM_COMMANDS, FwmarkServerStats::TOTAL, nanoseconds(5000));
+
+    FwmarkServerStats::Histogram histogram =
+            stats.getHistogram(FwmarkCommand::ON_CONNECT, FwmarkServerStats::TOTAL);
+    EXPECT_EQ(2U, histogram[12]);
+    EXPECT_EQ(2U, std::accumulate(histogram.begin(), histogram.end(), uint64_t{0}));
+
+    histogram = stats.getHistogram(FwmarkCommand::ON_CONNECT, FwmarkServerStats::SET_MARK);
+    EXPECT_EQ(1U, histogram[6]);
+
+    histogram = stats.getHistogram(FwmarkCommand::ON_ACCEPT, FwmarkServerStats::TOTAL);
+    EXPECT_EQ(0U, std::accumulate(histogram.begin(), histogram.end(), uint64_t{0}));
+}
+
+TEST(FwmarkServerStatsTest, ConcurrentRecord) {
+    constexpr int kThreads = 8;
+    constexpr int kIterations = 10000;
+    FwmarkServerStats stats;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+        threads.emplace_back([&stats] {
+            for (int j = 0; j < kIterations; ++j) {
+                stats.record(FwmarkCommand::ON_CONNECT, FwmarkServerStats::TOTAL, nanoseconds(j));
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    const FwmarkServerStats::Histogram histogram =
+            stats.getHistogram(FwmarkCommand::ON_CONNECT, FwmarkServerStats::TOTAL);
+    EXPECT_EQ(static_cast<uint64_t>(kThreads * kIterations),
+              std::accumulate(histogram.begin(), histogram.end(), uint64_t{0}));
+}
+
+}  // namespace android::net
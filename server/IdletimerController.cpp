@@ -110,17 +110,21 @@
 #include <string.h>
 #include <cutils/properties.h>
 
-#include <android-base/strings.h>
-#include <android-base/stringprintf.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
 
 #define LOG_TAG "IdletimerController"
 #include <log/log.h>
 
 #include "IdletimerController.h"
+#include "InterfaceActivityMonitor.h"
+#include "IptablesScript.h"
 #include "NetdConstants.h"
 
-using android::base::Join;
-using android::base::StringPrintf;
+using android::base::GetProperty;
+using android::base::ParseInt;
+using android::net::InterfaceActivityMonitor;
+using android::net::IptablesScript;
 
 const char* IdletimerController::LOCAL_RAW_PREROUTING = "idletimer_raw_PREROUTING";
 const char* IdletimerController::LOCAL_MANGLE_POSTROUTING = "idletimer_mangle_POSTROUTING";
@@ -128,15 +132,42 @@ const char* IdletimerController::LOCAL_MANGLE_POSTROUTING = "idletimer_mangle_PO
 auto IdletimerController::execIptablesRestore = ::execIptablesRestore;
 
 IdletimerController::IdletimerController() {
+    if (GetProperty("persist.netd.idletimer_backend", "") == "counters") {
+        enableActivityMonitor();
+    }
 }
 
 IdletimerController::~IdletimerController() {
+    // Stop the monitor thread before the listener it calls is destroyed.
+    mActivityMonitor.reset();
 }
 
 bool IdletimerController::setupIptablesHooks() {
     return true;
 }
 
+void IdletimerController::enableActivityMonitor() {
+    ALOGI("Polling interface packet counters instead of using xt_IDLETIMER");
+    mActivityMonitor = std::make_unique<InterfaceActivityMonitor>(
+            [this](const std::string& label, bool isActive, int64_t timestampNs) {
+                onActivityChanged(label, isActive, timestampNs);
+            });
+    mActivityMonitor->start();
+}
+
+void IdletimerController::setActivityListener(ActivityListener listener) {
+    std::lock_guard guard(mListenerMutex);
+    mActivityListener = std::move(listener);
+}
+
+void IdletimerController::onActivityChanged(const std::string& label, bool isActive,
+                                            int64_t timestampNs) {
+    int intLabel;
+    if (!ParseInt(label, &intLabel)) return;
+    std::lock_guard guard(mListenerMutex);
+    if (mActivityListener) mActivityListener(intLabel, isActive, timestampNs);
+}
+
 int IdletimerController::modifyInterfaceIdletimer(IptOp op, const char *iface,
                                                   uint32_t timeout,
                                                   const char *classLabel) {
@@ -145,19 +176,23 @@ int IdletimerController::modifyInterfaceIdletimer(IptOp op, const char *iface,
         return -1;
     }
 
+    if (mActivityMonitor) {
+        return (op == IptOpAdd) ? mActivityMonitor->addTimer(iface, timeout, classLabel)
+                                : mActivityMonitor->removeTimer(iface, timeout, classLabel);
+    }
+
     const char *addRemove = (op == IptOpAdd) ? "-A" : "-D";
-    std::vector<std::string> cmds = {
-            "*raw",
-            StringPrintf("%s %s -i %s -j IDLETIMER --timeout %u --label %s --send_nl_msg",
-                         addRemove, LOCAL_RAW_PREROUTING, iface, timeout, classLabel),
-            "COMMIT",
-            "*mangle",
-            StringPrintf("%s %s -o %s -j IDLETIMER --timeout %u --label %s --send_nl_msg",
-                         addRemove, LOCAL_MANGLE_POSTROUTING, iface, timeout, classLabel),
-            "COMMIT\n",
-    };
-
-    return (execIptablesRestore(V4V6, Join(cmds, '\n')) == 0) ? 0 : -EREMOTEIO;
+    IptablesScript script;
+    script.table("raw")
+            .appendf("%s %s -i %s -j IDLETIMER --timeout %u --label %s --send_nl_msg", addRemove,
+                     LOCAL_RAW_PREROUTING, iface, timeout, classLabel)
+            .commit();
+    script.table("mangle")
+            .appendf("%s %s -o %s -j IDLETIMER --timeout %u --label %s --send_nl_msg", addRemove,
+                     LOCAL_MANGLE_POSTROUTING, iface, timeout, classLabel)
+            .commit();
+
+    return (execIptablesRestore(V4V6, script.str()) == 0) ? 0 : -EREMOTEIO;
 }
 
 int IdletimerController::addInterfaceIdletimer(const char *iface,
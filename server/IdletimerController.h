@@ -18,8 +18,18 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
 #include "NetdConstants.h"
 
+namespace android::net {
+class InterfaceActivityMonitor;
+}
+
 class IdletimerController {
 public:
 
@@ -32,6 +42,12 @@ public:
                                  const char *classLabel);
     bool setupIptablesHooks();
 
+    // Receives the changes noticed by the counter-polling backend, which is used instead of
+    // xt_IDLETIMER if persist.netd.idletimer_backend is "counters". As with the netlink events
+    // that xt_IDLETIMER sends, only timers with integer labels are reported.
+    using ActivityListener = std::function<void(int label, bool isActive, int64_t timestampNs)>;
+    void setActivityListener(ActivityListener listener);
+
     static const char* LOCAL_RAW_PREROUTING;
     static const char* LOCAL_MANGLE_POSTROUTING;
     std::mutex lock;
@@ -41,6 +57,12 @@ public:
     int runIpxtablesCmd(int argc, const char **cmd);
     int modifyInterfaceIdletimer(IptOp op, const char *iface, uint32_t timeout,
                                  const char *classLabel);
+    void enableActivityMonitor();
+    void onActivityChanged(const std::string& label, bool isActive, int64_t timestampNs);
+
+    std::unique_ptr<android::net::InterfaceActivityMonitor> mActivityMonitor;
+    std::mutex mListenerMutex;
+    ActivityListener mActivityListener GUARDED_BY(mListenerMutex);
 
     friend class IdletimerControllerTest;
     static int (*execIptablesRestore)(IptablesTarget, const std::string&);
@@ -72,3 +72,12 @@ TEST_F(IdletimerControllerTest, TestAddRemove) {
     mIt.removeInterfaceIdletimer("wlan0", 12345, "hello");
     expectIptablesRestoreCommands(expected);
 }
+
+TEST_F(IdletimerControllerTest, TestActivityMonitorReplacesIptables) {
+    mIt.enableActivityMonitor();
+    EXPECT_EQ(0, mIt.addInterfaceIdletimer("wlan0", 12345, "hello"));
+    EXPECT_EQ(0, mIt.removeInterfaceIdletimer("wlan0", 12345, "hello"));
+    EXPECT_EQ(-ENOENT, mIt.removeInterfaceIdletimer("wlan0", 12345, "hello"));
+    EXPECT_EQ(-1, mIt.addInterfaceIdletimer("bad/name", 12345, "hello"));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+}
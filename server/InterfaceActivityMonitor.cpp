@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "IdletimerController"
+
+#include "InterfaceActivityMonitor.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <log/log.h>
+
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Trim;
+using android::netdutils::statusFromErrno;
+using android::netdutils::StatusOr;
+
+namespace android::net {
+
+InterfaceActivityMonitor::InterfaceActivityMonitor(Listener listener, CounterReader reader,
+                                                   Clock clock,
+                                                   std::chrono::nanoseconds pollInterval)
+    : mListener(std::move(listener)),
+      mReader(std::move(reader)),
+      mClock(std::move(clock)),
+      mPollIntervalNs(pollInterval.count()) {}
+
+InterfaceActivityMonitor::~InterfaceActivityMonitor() {
+    {
+        std::lock_guard lock(mMutex);
+        mStopping = true;
+    }
+    mCv.notify_one();
+    if (mThread.joinable()) mThread.join();
+}
+
+void InterfaceActivityMonitor::start() {
+    mThread = std::thread(&InterfaceActivityMonitor::run, this);
+}
+
+int InterfaceActivityMonitor::addTimer(const std::string& ifName, uint32_t timeoutSec,
+                                       const std::string& label) {
+    {
+        std::lock_guard lock(mMutex);
+        Timer& timer = mTimers[{ifName, timeoutSec, label}];
+        if (timer.refCount++ == 0) {
+            // As with xt_IDLETIMER, a new timer starts out active without reporting it.
+            const int64_t now = mClock();
+            const StatusOr<uint64_t> packets = mReader(ifName);
+            timer.timeoutNs = std::chrono::nanoseconds(std::chrono::seconds(timeoutSec)).count();
+            timer.packets = isOk(packets) ? packets.value() : 0;
+            timer.lastActivityNs = now;
+            timer.nextCheckNs = now + std::min(mPollIntervalNs, timer.timeoutNs);
+        }
+        mTimersChanged = true;
+    }
+    mCv.notify_one();
+    return 0;
+}
+
+int InterfaceActivityMonitor::removeTimer(const std::string& ifName, uint32_t timeoutSec,
+                                          const std::string& label) {
+    std::lock_guard lock(mMutex);
+    const auto it = mTimers.find({ifName, timeoutSec, label});
+    if (it == mTimers.end()) return -ENOENT;
+    if (--it->second.refCount == 0) mTimers.erase(it);
+    return 0;
+}
+
+void InterfaceActivityMonitor::checkLocked(const Key& key, Timer* timer, int64_t nowNs,
+                                           std::vector<Change>* changes) {
+    const auto& [ifName, _, label] = key;
+    // An interface that cannot be read, for example because it is gone, has no activity.
+    const StatusOr<uint64_t> packets = mReader(ifName);
+    if (isOk(packets) && packets.value() != timer->packets) {
+        timer->packets = packets.value();
+        timer->lastActivityNs = nowNs;
+        if (!timer->active) {
+            timer->active = true;
+            changes->push_back({label, true, nowNs});
+        }
+    } else if (timer->active && nowNs - timer->lastActivityNs >= timer->timeoutNs) {
+        timer->active = false;
+        changes->push_back({label, false, nowNs});
+    }
+
+    timer->nextCheckNs = nowNs + mPollIntervalNs;
+    if (timer->active) {
+        timer->nextCheckNs =
+                std::min(timer->nextCheckNs, timer->lastActivityNs + timer->timeoutNs);
+    }
+}
+
+std::optional<int64_t> InterfaceActivityMonitor::poll() {
+    std::vector<Change> changes;
+    std::optional<int64_t> next;
+    {
+        std::lock_guard lock(mMutex);
+        const int64_t now = mClock();
+        for (auto& [key, timer] : mTimers) {
+            if (timer.nextCheckNs <= now) checkLocked(key, &timer, now, &changes);
+            next = std::min(next.value_or(timer.nextCheckNs), timer.nextCheckNs);
+        }
+    }
+    for (const Change& change : changes) {
+        mListener(change.label, change.isActive, change.timestampNs);
+    }
+    return next;
+}
+
+void InterfaceActivityMonitor::run() {
+    std::unique_lock lock(mMutex);
+    while (!mStopping) {
+        mTimersChanged = false;
+        lock.unlock();
+        const std::optional<int64_t> next = poll();
+        lock.lock();
+
+        const auto woken = [this]() REQUIRES(mMutex) { return mStopping || mTimersChanged; };
+        if (!next.has_value()) {
+            mCv.wait(lock, woken);
+        } else {
+            mCv.wait_for(lock, std::chrono::nanoseconds(std::max<int64_t>(*next - mClock(), 0)),
+                         woken);
+        }
+    }
+}
+
+StatusOr<uint64_t> InterfaceActivityMonitor::readPacketCount(const std::string& ifName) {
+    uint64_t total = 0;
+    for (const char* counter : {"rx_packets", "tx_packets"}) {
+        const std::string path = "/sys/class/net/" + ifName + "/statistics/" + counter;
+        std::string contents;
+        uint64_t value;
+        if (!ReadFileToString(path, &contents)) {
+            return statusFromErrno(errno, "Cannot read " + path);
+        }
+        if (!ParseUint(Trim(contents), &value)) return statusFromErrno(EINVAL, "Bad " + path);
+        total += value;
+    }
+    return total;
+}
+
+int64_t InterfaceActivityMonitor::bootTimeNs() {
+    timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+}  // namespace android::net
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/StatusOr.h>
+
+namespace android::net {
+
+// Idle timers on interfaces, as set up by IdletimerController, implemented by sampling the
+// interfaces' packet counters instead of running the xt_IDLETIMER target on every packet.
+//
+// A timer becomes idle once its interface's counters have not changed for its timeout, and active
+// again as soon as they change. Both are noticed within one poll interval. While no timer exists,
+// the monitor thread sleeps. Unlike xt_IDLETIMER, the UID that caused activity is not known.
+class InterfaceActivityMonitor {
+  public:
+    // Called without any lock held, with the timer's label, whether it became active, and the
+    // CLOCK_BOOTTIME time at which the change was noticed.
+    using Listener =
+            std::function<void(const std::string& label, bool isActive, int64_t timestampNs)>;
+    // Returns the total number of packets received and sent on an interface.
+    using CounterReader = std::function<netdutils::StatusOr<uint64_t>(const std::string& ifName)>;
+    // Returns the current time in nanoseconds. The default is CLOCK_BOOTTIME.
+    using Clock = std::function<int64_t()>;
+
+    static constexpr std::chrono::nanoseconds kDefaultPollInterval = std::chrono::seconds(1);
+
+    explicit InterfaceActivityMonitor(Listener listener, CounterReader reader = readPacketCount,
+                                      Clock clock = bootTimeNs,
+                                      std::chrono::nanoseconds pollInterval = kDefaultPollInterval);
+    ~InterfaceActivityMonitor();
+
+    // Starts the thread that calls poll() when a timer is due.
+    void start();
+
+    // As with the iptables rules they replace, the same timer may be added more than once and
+    // must then be removed as many times. removeTimer() returns -ENOENT for an unknown timer.
+    int addTimer(const std::string& ifName, uint32_t timeoutSec, const std::string& label);
+    int removeTimer(const std::string& ifName, uint32_t timeoutSec, const std::string& label);
+
+    // Checks every timer that is due and reports the ones that changed. Returns the time at which
+    // the next timer is due, or std::nullopt if there are none.
+    std::optional<int64_t> poll();
+
+    // Reads /sys/class/net/<ifName>/statistics.
+    static netdutils::StatusOr<uint64_t> readPacketCount(const std::string& ifName);
+    static int64_t bootTimeNs();
+
+  private:
+    using Key = std::tuple<std::string, uint32_t, std::string>;  // interface, timeout, label
+
+    struct Timer {
+        int refCount = 0;
+        int64_t timeoutNs = 0;
+        bool active = true;
+        uint64_t packets = 0;
+        int64_t lastActivityNs = 0;
+        int64_t nextCheckNs = 0;
+    };
+
+    struct Change {
+        std::string label;
+        bool isActive;
+        int64_t timestampNs;
+    };
+
+    void checkLocked(const Key& key, Timer* timer, int64_t nowNs, std::vector<Change>* changes)
+            REQUIRES(mMutex);
+    void run();
+
+    const Listener mListener;
+    const CounterReader mReader;
+    const Clock mClock;
+    const int64_t mPollIntervalNs;
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::map<Key, Timer> mTimers GUARDED_BY(mMutex);
+    // Set when a timer is added, so that the thread recomputes when to wake up.
+    bool mTimersChanged GUARDED_BY(mMutex) = false;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+};
+
+}  // namespace android::net
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "InterfaceActivityMonitor.h"
+
+namespace android::net {
+
+using netdutils::statusFromErrno;
+using netdutils::StatusOr;
+
+namespace {
+
+constexpr int64_t kSecNs = 1000000000LL;
+
+}  // namespace
+
+class InterfaceActivityMonitorTest : public ::testing::Test {
+  protected:
+    using Change = std::tuple<std::string, bool, int64_t>;
+
+    InterfaceActivityMonitorTest()
+        : mMonitor(
+                  [this](const std::string& label, bool isActive, int64_t timestampNs) {
+                      mChanges.emplace_back(label, isActive, timestampNs);
+                  },
+                  [this](const std::string& ifName) -> StatusOr<uint64_t> {
+                      const auto it = mPackets.find(ifName);
+                      if (it == mPackets.end()) return statusFromErrno(ENODEV, ifName);
+                      return it->second;
+                  },
+                  [this]() { return mNowNs; }) {}
+
+    std::vector<Change> takeChanges() { return std::move(mChanges); }
+
+    int64_t mNowNs = 100 * kSecNs;
+    std::map<std::string, uint64_t> mPackets = {{"wlan0", 0}};
+    std::vector<Change> mChanges;
+    InterfaceActivityMonitor mMonitor;
+
+    std::mutex mThreadMutex;
+    std::condition_variable mThreadCv;
+    std::vector<Change> mThreadChanges;
+};
+
+TEST_F(InterfaceActivityMonitorTest, IdleAfterTimeout) {
+    EXPECT_FALSE(mMonitor.poll().has_value());
+    ASSERT_EQ(0, mMonitor.addTimer("wlan0", 5, "1"));
+    EXPECT_EQ(mNowNs + kSecNs, mMonitor.poll());
+
+    // Traffic keeps the timer active, and moves its deadline.
+    mNowNs += kSecNs;
+    mPackets["wlan0"] = 10;
+    EXPECT_EQ(mNowNs + kSecNs, mMonitor.poll());
+    const int64_t lastActivity = mNowNs;
+    for (int i = 0; i < 4; ++i) {
+        mNowNs += kSecNs;
+        mMonitor.poll();
+    }
+    EXPECT_TRUE(takeChanges().empty());
+
+    mNowNs = lastActivity + 5 * kSecNs;
+    mMonitor.poll();
+    EXPECT_EQ(std::vector<Change>({{"1", false, mNowNs}}), takeChanges());
+
+    // Reported once, then polled for activity.
+    mNowNs += kSecNs;
+    EXPECT_EQ(mNowNs + kSecNs, mMonitor.poll());
+    EXPECT_TRUE(takeChanges().empty());
+
+    mPackets["wlan0"] = 11;
+    mNowNs += kSecNs;
+    mMonitor.poll();
+    EXPECT_EQ(std::vector<Change>({{"1", true, mNowNs}}), takeChanges());
+}
+
+TEST_F(InterfaceActivityMonitorTest, ShortTimeoutIsCheckedOnTime) {
+    ASSERT_EQ(0, mMonitor.addTimer("wlan0", 0, "2"));
+    mMonitor.poll();
+    EXPECT_EQ(std::vector<Change>({{"2", false, mNowNs}}), takeChanges());
+}
+
+TEST_F(InterfaceActivityMonitorTest, MissingInterfaceIsIdle) {
+    ASSERT_EQ(0, mMonitor.addTimer("rmnet0", 2, "3"));
+    mNowNs += 2 * kSecNs;
+    mMonitor.poll();
+    EXPECT_EQ(std::vector<Change>({{"3", false, mNowNs}}), takeChanges());
+
+    // The interface comes up with traffic already counted.
+    mPackets["rmnet0"] = 5;
+    mNowNs += kSecNs;
+    mMonitor.poll();
+    EXPECT_EQ(std::vector<Change>({{"3", true, mNowNs}}), takeChanges());
+}
+
+TEST_F(InterfaceActivityMonitorTest, AddAndRemoveAreCounted) {
+    EXPECT_EQ(-ENOENT, mMonitor.removeTimer("wlan0", 5, "1"));
+    ASSERT_EQ(0, mMonitor.addTimer("wlan0", 5, "1"));
+    ASSERT_EQ(0, mMonitor.addTimer("wlan0", 5, "1"));
+
+    // The timeout is part of the timer's identity, as it is part of the iptables rule.
+    EXPECT_EQ(-ENOENT, mMonitor.removeTimer("wlan0", 6, "1"));
+    EXPECT_EQ(0, mMonitor.removeTimer("wlan0", 5, "1"));
+    EXPECT_TRUE(mMonitor.poll().has_value());
+    EXPECT_EQ(0, mMonitor.removeTimer("wlan0", 5, "1"));
+    EXPECT_FALSE(mMonitor.poll().has_value());
+}
+
+TEST_F(InterfaceActivityMonitorTest, ThreadReportsChanges) {
+    InterfaceActivityMonitor monitor(
+            [this](const std::string& label, bool isActive, int64_t) {
+                std::lock_guard lock(mThreadMutex);
+                mThreadChanges.emplace_back(label, isActive, 0);
+                mThreadCv.notify_one();
+            },
+            [](const std::string&) -> StatusOr<uint64_t> { return 0; },
+            InterfaceActivityMonitor::bootTimeNs, std::chrono::milliseconds(10));
+    monitor.start();
+    ASSERT_EQ(0, monitor.addTimer("wlan0", 0, "4"));
+
+    std::unique_lock lock(mThreadMutex);
+    ASSERT_TRUE(mThreadCv.wait_for(lock, std::chrono::seconds(5),
+                                   [this] { return !mThreadChanges.empty(); }));
+    EXPECT_EQ(Change("4", false, 0), mThreadChanges[0]);
+}
+
+}  // namespace android::net
@@ -22,13 +22,18 @@
 #include <sys/socket.h>
 
 #include <functional>
+#include <optional>
+#include <span>
 
 #define LOG_TAG "InterfaceController"
 #include <android-base/file.h>
 #include <android-base/properties.h>
+#include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <linux/if_ether.h>
+#include <linux/rtnetlink.h>
 #include <log/log.h>
 #include <netutils/ifc.h>
 
@@ -36,14 +41,17 @@
 #include <netdutils/Misc.h>
 #include <netdutils/Slice.h>
 #include <netdutils/Syscalls.h>
+#include <netdutils/Utils.h>
 
 #include "InterfaceController.h"
+#include "InterfaceStateCache.h"
+#include "NetlinkCommands.h"
+#include "ParameterCache.h"
 #include "RouteController.h"
 
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
 using android::base::Trim;
-using android::base::WriteStringToFile;
 using android::netdutils::isOk;
 using android::netdutils::makeSlice;
 using android::netdutils::sSyscalls;
@@ -64,6 +72,9 @@ const char ipv6_neigh_conf_dir[] = "/proc/sys/net/ipv6/neigh";
 const char proc_net_path[] = "/proc/sys/net";
 const char sys_net_path[] = "/sys/class/net";
 
+// An RTM_NEWLINK request carries only IFLA_IFNAME.
+constexpr size_t LINK_REQUEST_CAPACITY = NLMSG_ALIGN(sizeof(ifinfomsg)) + RTA_SPACE(IFNAMSIZ);
+
 constexpr int kRouteInfoMinPrefixLen = 48;
 
 // RFC 7421 prefix length.
@@ -103,21 +114,52 @@ inline bool isInterfaceName(const char *name) {
 int writeValueToPath(
         const char* dirname, const char* subdirname, const char* basename,
         const char* value) {
-    std::string path(StringPrintf("%s/%s/%s", dirname, subdirname, basename));
-    return WriteStringToFile(value, path) ? 0 : -EREMOTEIO;
+    return ParameterCache::write(dirname, subdirname, basename, value) == 0 ? 0 : -EREMOTEIO;
+}
+
+// A value to write to a file in every interface's directory under a conf directory.
+struct ConfSetting {
+    const char* basename;
+    const char* value;
+    // Skip this setting on an interface where the previous one could not be written.
+    bool requiresPrevious = false;
+};
+
+// Writes |value| to the file |basename| in the directory |dirFd|. The file is opened relative to
+// the directory, so no path is formatted and only the last component is looked up.
+int writeValueAt(int dirFd, const char* basename, const char* value) {
+    android::base::unique_fd fd(openat(dirFd, basename, O_WRONLY | O_CLOEXEC));
+    if (fd == -1) {
+        return -EREMOTEIO;
+    }
+    return android::base::WriteStringToFd(value, fd) ? 0 : -EREMOTEIO;
+}
+
+void applySettingsAt(int confFd, const char* iface, std::span<const ConfSetting> settings) {
+    android::base::unique_fd ifaceFd(openat(confFd, iface, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (ifaceFd == -1) {
+        return;
+    }
+    bool previousWritten = true;
+    for (const ConfSetting& setting : settings) {
+        if (setting.requiresPrevious && !previousWritten) {
+            continue;
+        }
+        previousWritten = writeValueAt(ifaceFd.get(), setting.basename, setting.value) == 0;
+    }
 }
 
-// Run @fn on each interface as well as 'default' in the path @dirname.
-void forEachInterface(
-        const std::string& dirname,
-        const std::function<void(const std::string& path, const std::string& iface)>& fn) {
-    // Run on default, which controls the behavior of any interfaces that are created in the future.
-    fn(dirname, "default");
-    DIR* dir = opendir(dirname.c_str());
+// Writes |settings| in order for 'default', which controls the behavior of any interfaces that are
+// created in the future, and for each interface in the path @dirname. The directory is listed
+// once, however many settings there are.
+void setOnAllInterfaces(const char* dirname, std::span<const ConfSetting> settings) {
+    DIR* dir = opendir(dirname);
     if (!dir) {
-        ALOGE("Can't list %s: %s", dirname.c_str(), strerror(errno));
+        ALOGE("Can't list %s: %s", dirname, strerror(errno));
         return;
     }
+    const int confFd = dirfd(dir);
+    applySettingsAt(confFd, "default", settings);
     while (true) {
         const dirent *ent = readdir(dir);
         if (!ent) {
@@ -126,20 +168,14 @@ void forEachInterface(
         if ((ent->d_type != DT_DIR) || !isInterfaceName(ent->d_name)) {
             continue;
         }
-        fn(dirname, ent->d_name);
+        applySettingsAt(confFd, ent->d_name, settings);
     }
     closedir(dir);
 }
 
 void setOnAllInterfaces(const char* dirname, const char* basename, const char* value) {
-    auto fn = [basename, value](const std::string& path, const std::string& iface) {
-        writeValueToPath(path.c_str(), iface.c_str(), basename, value);
-    };
-    forEachInterface(dirname, fn);
-}
-
-void setIPv6UseOutgoingInterfaceAddrsOnly(const char *value) {
-    setOnAllInterfaces(ipv6_proc_path, "use_oif_addrs_only", value);
+    const ConfSetting setting = {.basename = basename, .value = value};
+    setOnAllInterfaces(dirname, std::span(&setting, 1));
 }
 
 std::string getParameterPathname(
@@ -157,21 +193,6 @@ std::string getParameterPathname(
     return StringPrintf("%s/%s/%s/%s/%s", proc_net_path, family, which, interface, parameter);
 }
 
-void setAcceptIPv6RIO(int min, int max) {
-    auto fn = [min, max](const std::string& prefix, const std::string& iface) {
-        int rv = writeValueToPath(prefix.c_str(), iface.c_str(), "accept_ra_rt_info_min_plen",
-                                  std::to_string(min).c_str());
-        if (rv != 0) {
-            // Only update max_plen if the write to min_plen succeeded. This ordering will prevent
-            // RIOs from being accepted unless both min and max are written successfully.
-            return;
-        }
-        writeValueToPath(prefix.c_str(), iface.c_str(), "accept_ra_rt_info_max_plen",
-                         std::to_string(max).c_str());
-    };
-    forEachInterface(ipv6_proc_path, fn);
-}
-
 // Ideally this function would return StatusOr<std::string>, however
 // there is no safe value for dflt that will always differ from the
 // stored property. Bugs code could conceivably end up persisting the
@@ -234,30 +255,46 @@ android::netdutils::Status InterfaceController::enableStablePrivacyAddresses(
 }
 
 void InterfaceController::initializeAll() {
-    // Initial IPv6 settings.
-    // By default, accept_ra is set to 1 (accept RAs unless forwarding is on) on all interfaces.
-    // This causes RAs to work or not work based on whether forwarding is on, and causes routes
-    // learned from RAs to go away when forwarding is turned on. Make this behaviour predictable
-    // by always setting accept_ra to 2.
-    setAcceptRA("2");
-
-    // Accept RIOs with prefix length in the closed interval [48, 64].
-    setAcceptIPv6RIO(kRouteInfoMinPrefixLen, kRouteInfoMaxPrefixLen);
-
-    setAcceptRARouteTable(-RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX);
+    const std::string rioMinPrefixLen = std::to_string(kRouteInfoMinPrefixLen);
+    const std::string rioMaxPrefixLen = std::to_string(kRouteInfoMaxPrefixLen);
+    const std::string raRouteTable =
+            std::to_string(-RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX);
+
+    // Initial IPv6 settings, all written to each interface in a single pass.
+    const ConfSetting ipv6Settings[] = {
+            // By default, accept_ra is set to 1 (accept RAs unless forwarding is on) on all
+            // interfaces. This causes RAs to work or not work based on whether forwarding is on,
+            // and causes routes learned from RAs to go away when forwarding is turned on. Make this
+            // behaviour predictable by always setting accept_ra to 2.
+            {.basename = "accept_ra", .value = "2"},
+            // Accept RIOs with prefix length in the closed interval [48, 64]. Only update max_plen
+            // if the write to min_plen succeeded. This ordering will prevent RIOs from being
+            // accepted unless both min and max are written successfully.
+            {.basename = "accept_ra_rt_info_min_plen", .value = rioMinPrefixLen.c_str()},
+            {.basename = "accept_ra_rt_info_max_plen",
+             .value = rioMaxPrefixLen.c_str(),
+             .requiresPrevious = true},
+            // A negative accept_ra_rt_table is an offset: routes learned from RAs on the
+            // interface with ID 5 go into table 5 + ROUTE_TABLE_OFFSET_FROM_INDEX, etc.
+            {.basename = "accept_ra_rt_table", .value = raRouteTable.c_str()},
+            // Enable optimistic DAD for IPv6 addresses on all interfaces.
+            {.basename = "optimistic_dad", .value = "1"},
+            {.basename = "use_optimistic", .value = "1"},
+            // When sending traffic via a given interface use only addresses configured
+            // on that interface as possible source addresses.
+            {.basename = "use_oif_addrs_only", .value = "1"},
+            // Ensure that ICMP redirects are rejected on all interfaces, as in
+            // disableIcmpRedirects().
+            {.basename = "accept_redirects", .value = "0"},
+    };
+    setOnAllInterfaces(ipv6_proc_path, ipv6Settings);
 
-    // Enable optimistic DAD for IPv6 addresses on all interfaces.
-    setIPv6OptimisticMode("1");
+    writeValueToPath(ipv4_proc_path, "all", "accept_redirects", "0");
+    writeValueToPath(ipv6_proc_path, "all", "accept_redirects", "0");
+    setOnAllInterfaces(ipv4_proc_path, "accept_redirects", "0");
 
     // Reduce the ARP/ND base reachable time from the default (30sec) to 15sec.
     setBaseReachableTimeMs(15 * 1000);
-
-    // When sending traffic via a given interface use only addresses configured
-    // on that interface as possible source addresses.
-    setIPv6UseOutgoingInterfaceAddrsOnly("1");
-
-    // Ensure that ICMP redirects are rejected globally on all interfaces.
-    disableIcmpRedirects();
 }
 
 int InterfaceController::setEnableIPv6(const char *interface, const int on) {
@@ -334,40 +371,31 @@ int InterfaceController::setIPv6PrivacyExtensions(const char *interface, const i
     return writeValueToPath(ipv6_proc_path, interface, "use_tempaddr", on ? "2" : "0");
 }
 
-void InterfaceController::setAcceptRA(const char *value) {
-    setOnAllInterfaces(ipv6_proc_path, "accept_ra", value);
-}
-
-// |tableOrOffset| is interpreted as:
-//     If == 0: default. Routes go into RT6_TABLE_MAIN.
-//     If > 0: user set. Routes go into the specified table.
-//     If < 0: automatic. The absolute value is intepreted as an offset and added to the interface
-//             ID to get the table. If it's set to -1000, routes from interface ID 5 will go into
-//             table 1005, etc.
-void InterfaceController::setAcceptRARouteTable(int tableOrOffset) {
-    std::string value(StringPrintf("%d", tableOrOffset));
-    setOnAllInterfaces(ipv6_proc_path, "accept_ra_rt_table", value.c_str());
-}
-
 int InterfaceController::setMtu(const char *interface, const char *mtu)
 {
     if (!isIfaceName(interface)) {
         errno = ENOENT;
         return -errno;
     }
-    return writeValueToPath(sys_net_path, interface, "mtu", mtu);
+    const int ret = writeValueToPath(sys_net_path, interface, "mtu", mtu);
+    if (ret == 0) stateCache().invalidate(interface);
+    return ret;
 }
 
 // Returns zero on success and negative errno on failure.
 int InterfaceController::addAddress(const char *interface,
         const char *addrString, int prefixLength) {
-    return ifc_add_address(interface, addrString, prefixLength);
+    const int ret = ifc_add_address(interface, addrString, prefixLength);
+    if (ret == 0) stateCache().invalidate(interface);
+    return ret;
 }
 
 // Returns zero on success and negative errno on failure.
 int InterfaceController::delAddress(const char *interface,
         const char *addrString, int prefixLength) {
-    return ifc_del_address(interface, addrString, prefixLength);
+    const int ret = ifc_del_address(interface, addrString, prefixLength);
+    if (ret == 0) stateCache().invalidate(interface);
+    return ret;
 }
 
 int InterfaceController::disableIcmpRedirects() {
@@ -400,7 +428,7 @@ int InterfaceController::setParameter(
     if (path.empty()) {
         return -errno;
     }
-    return WriteStringToFile(value, path) ? 0 : -errno;
+    return ParameterCache::write(path, value);
 }
 
 void InterfaceController::setBaseReachableTimeMs(unsigned int millis) {
@@ -409,28 +437,13 @@ void InterfaceController::setBaseReachableTimeMs(unsigned int millis) {
     setOnAllInterfaces(ipv6_neigh_conf_dir, "base_reachable_time_ms", value.c_str());
 }
 
-void InterfaceController::setIPv6OptimisticMode(const char *value) {
-    setOnAllInterfaces(ipv6_proc_path, "optimistic_dad", value);
-    setOnAllInterfaces(ipv6_proc_path, "use_optimistic", value);
-}
-
 namespace {
 
-std::string hwAddrToStr(unsigned char* hwaddr) {
+std::string hwAddrToStr(const unsigned char* hwaddr) {
     return StringPrintf("%02x:%02x:%02x:%02x:%02x:%02x", hwaddr[0], hwaddr[1], hwaddr[2], hwaddr[3],
                         hwaddr[4], hwaddr[5]);
 }
 
-int ipv4NetmaskToPrefixLength(in_addr_t mask) {
-    int prefixLength = 0;
-    uint32_t m = ntohl(mask);
-    while (m & (1 << 31)) {
-        prefixLength++;
-        m = m << 1;
-    }
-    return prefixLength;
-}
-
 std::string toStdString(const String16& s) {
     return std::string(String8(s.string()));
 }
@@ -445,24 +458,38 @@ Status InterfaceController::setCfg(const InterfaceConfigurationParcel& cfg) {
     };
     strlcpy(ifr.ifr_name, cfg.ifName.c_str(), IFNAMSIZ);
 
-    // Make sure that clear IPv4 address before set flag
-    // SIOCGIFFLAGS might override ifr and caused clear IPv4 addr ioctl error
+    // Clear the IPv4 address before setting the flags. SIOCSIFADDR with 0.0.0.0 is kept, since
+    // there is no single rtnetlink request with the same effect.
     RETURN_IF_NOT_OK(sys.ioctl(fd, SIOCSIFADDR, &ifr));
-
-    if (!cfg.flags.empty()) {
-        RETURN_IF_NOT_OK(sys.ioctl(fd, SIOCGIFFLAGS, &ifr));
-        uint16_t flags = ifr.ifr_flags;
-
-        for (const auto& flag : cfg.flags) {
-            if (flag == toStdString(INetd::IF_STATE_UP())) {
-                ifr.ifr_flags = ifr.ifr_flags | IFF_UP;
-            } else if (flag == toStdString(INetd::IF_STATE_DOWN())) {
-                ifr.ifr_flags = (ifr.ifr_flags & (~IFF_UP));
-            }
+    // Until NetlinkHandler applies the messages about the changes, the cache still has the old
+    // configuration. Even if a later step fails, the address is already cleared.
+    const android::base::ScopeGuard invalidateGuard = [&] { stateCache().invalidate(cfg.ifName); };
+
+    // Only IFF_UP is changed, which takes a single request instead of reading and writing all
+    // the flags.
+    std::optional<bool> up;
+    for (const auto& flag : cfg.flags) {
+        if (flag == toStdString(INetd::IF_STATE_UP())) {
+            up = true;
+        } else if (flag == toStdString(INetd::IF_STATE_DOWN())) {
+            up = false;
         }
-
-        if (ifr.ifr_flags != flags) {
-            RETURN_IF_NOT_OK(sys.ioctl(fd, SIOCSIFFLAGS, &ifr));
+    }
+    if (up.has_value()) {
+        NetlinkRequestBuffer<ifinfomsg, LINK_REQUEST_CAPACITY> request({
+                .ifi_family = AF_UNSPEC,
+                .ifi_flags = *up ? IFF_UP : 0u,
+                .ifi_change = IFF_UP,
+        });
+        // With no index, the kernel looks the interface up by name.
+        request.addAttribute(IFLA_IFNAME, cfg.ifName.c_str(), cfg.ifName.size() + 1);
+        iovec iov[] = {{nullptr, 0}, request.iov()};
+        if (request.overflowed()) {
+            return statusFromErrno(EINVAL, "Interface name too long");
+        }
+        if (int ret = sendNetlinkRequest(RTM_NEWLINK, NETLINK_REQUEST_FLAGS, iov, std::size(iov),
+                                         nullptr)) {
+            return statusFromErrno(-ret, "Failed to set interface flags");
         }
     }
 
@@ -473,44 +500,16 @@ Status InterfaceController::setCfg(const InterfaceConfigurationParcel& cfg) {
     return ok;
 }
 
-StatusOr<InterfaceConfigurationParcel> InterfaceController::getCfg(const std::string& ifName) {
-    struct in_addr addr = {};
-    int prefixLength = 0;
-    unsigned char hwaddr[ETH_ALEN] = {};
-    unsigned flags = 0;
-    InterfaceConfigurationParcel cfgResult;
-
-    const auto& sys = sSyscalls.get();
-    ASSIGN_OR_RETURN(auto fd, sys.socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
-
-    struct ifreq ifr = {};
-    strlcpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ);
-
-    if (isOk(sys.ioctl(fd, SIOCGIFADDR, &ifr))) {
-        addr.s_addr = ((struct sockaddr_in*) &ifr.ifr_addr)->sin_addr.s_addr;
-    }
-
-    if (isOk(sys.ioctl(fd, SIOCGIFNETMASK, &ifr))) {
-        prefixLength =
-                ipv4NetmaskToPrefixLength(((struct sockaddr_in*) &ifr.ifr_addr)->sin_addr.s_addr);
-    }
-
-    if (isOk(sys.ioctl(fd, SIOCGIFFLAGS, &ifr))) {
-        flags = ifr.ifr_flags;
-    }
+namespace {
 
-    // ETH_ALEN is for ARPHRD_ETHER, it is better to check the sa_family.
-    // However, we keep old design for the consistency.
-    if (isOk(sys.ioctl(fd, SIOCGIFHWADDR, &ifr))) {
-        memcpy((void*) hwaddr, &ifr.ifr_hwaddr.sa_data, ETH_ALEN);
-    } else {
-        ALOGW("Failed to retrieve HW addr for %s (%s)", ifName.c_str(), strerror(errno));
-    }
+InterfaceConfigurationParcel toCfg(const InterfaceStateCache::LinkState& link) {
+    InterfaceConfigurationParcel cfgResult;
+    cfgResult.ifName = link.ifName;
+    cfgResult.hwAddr = hwAddrToStr(link.hwaddr);
+    cfgResult.ipv4Addr = std::string(inet_ntoa(link.addr));
+    cfgResult.prefixLength = link.prefixLength;
 
-    cfgResult.ifName = ifName;
-    cfgResult.hwAddr = hwAddrToStr(hwaddr);
-    cfgResult.ipv4Addr = std::string(inet_ntoa(addr));
-    cfgResult.prefixLength = prefixLength;
+    const unsigned flags = link.flags;
     cfgResult.flags.push_back(flags & IFF_UP ? toStdString(INetd::IF_STATE_UP())
                                              : toStdString(INetd::IF_STATE_DOWN()));
 
@@ -524,8 +523,51 @@ StatusOr<InterfaceConfigurationParcel> InterfaceController::getCfg(const std::st
     return cfgResult;
 }
 
+}  // namespace
+
+InterfaceStateCache& InterfaceController::stateCache() {
+    static InterfaceStateCache cache;
+    return cache;
+}
+
+StatusOr<InterfaceConfigurationParcel> InterfaceController::getCfg(const std::string& ifName) {
+    if (ifName.empty()) {
+        return statusFromErrno(EINVAL, "Empty interface name");
+    }
+    ASSIGN_OR_RETURN(auto link, stateCache().get(ifName));
+    if (!link.has_value()) {
+        // As with the ioctls this replaces, an unknown interface has an empty configuration.
+        ALOGW("Failed to retrieve configuration for %s", ifName.c_str());
+        return toCfg({.ifName = ifName});
+    }
+    return toCfg(*link);
+}
+
+StatusOr<std::vector<InterfaceConfigurationParcel>> InterfaceController::getCfgAll() {
+    ASSIGN_OR_RETURN(auto links, stateCache().getAll());
+    std::vector<InterfaceConfigurationParcel> cfgs;
+    cfgs.reserve(links.size());
+    for (const auto& [_, link] : links) {
+        cfgs.push_back(toCfg(link));
+    }
+    return cfgs;
+}
+
+StatusOr<std::vector<std::string>> InterfaceController::getIfaceNames() {
+    if (!stateCache().isEnabled()) return netdutils::getIfaceNames();
+    ASSIGN_OR_RETURN(auto links, stateCache().getAll());
+    std::vector<std::string> names;
+    names.reserve(links.size());
+    for (auto& [_, link] : links) {
+        names.push_back(std::move(link.ifName));
+    }
+    return names;
+}
+
 int InterfaceController::clearAddrs(const std::string& ifName) {
-    return ifc_clear_addresses(ifName.c_str());
+    const int ret = ifc_clear_addresses(ifName.c_str());
+    if (ret == 0) stateCache().invalidate(ifName);
+    return ret;
 }
 
 }  // namespace net
@@ -20,6 +20,7 @@
 #include <functional>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <android/net/InterfaceConfigurationParcel.h>
 #include <netdutils/Status.h>
@@ -28,6 +29,7 @@
 namespace android {
 namespace net {
 
+class InterfaceStateCache;
 class StablePrivacyTest;
 
 class InterfaceController {
@@ -45,9 +47,17 @@ public:
     static int delAddress(const char* ifName, const char* addrString, int prefixLength);
     static int disableIcmpRedirects();
     static android::netdutils::Status setCfg(const InterfaceConfigurationParcel& cfg);
+    // Returns the configuration of |ifName|, or of every interface, from stateCache().
     static android::netdutils::StatusOr<InterfaceConfigurationParcel> getCfg(
             const std::string& ifName);
+    static android::netdutils::StatusOr<std::vector<InterfaceConfigurationParcel>> getCfgAll();
     static int clearAddrs(const std::string& ifName);
+    // Returns the names of all interfaces, from stateCache() if it is enabled.
+    static android::netdutils::StatusOr<std::vector<std::string>> getIfaceNames();
+
+    // Tracks link and IPv4 address state for the getters above. NetlinkManager enables it once its
+    // rtnetlink socket is listening.
+    static InterfaceStateCache& stateCache();
 
     // Read and write values in files of the form:
     //     /proc/sys/net/<family>/<which>/<ifName>/<parameter>
@@ -74,10 +84,7 @@ public:
             const std::string& ifName, const GetPropertyFn& getProperty,
             const SetPropertyFn& setProperty);
 
-    static void setAcceptRA(const char* value);
-    static void setAcceptRARouteTable(int tableOrOffset);
     static void setBaseReachableTimeMs(unsigned int millis);
-    static void setIPv6OptimisticMode(const char* value);
 
     InterfaceController() = delete;
     ~InterfaceController() = delete;
@@ -209,5 +209,40 @@ TEST_F(GetIfaceListTest, IfaceExist) {
     freeifaddrs(ifaddr);
 }
 
+class GetCfgTest : public NetNativeTestBase {};
+
+TEST_F(GetCfgTest, Loopback) {
+    const auto cfg = InterfaceController::getCfg("lo");
+    ASSERT_EQ(ok, cfg.status());
+    EXPECT_EQ("lo", cfg.value().ifName);
+    EXPECT_EQ("127.0.0.1", cfg.value().ipv4Addr);
+    EXPECT_EQ(8, cfg.value().prefixLength);
+    EXPECT_EQ("00:00:00:00:00:00", cfg.value().hwAddr);
+    EXPECT_THAT(cfg.value().flags, testing::Contains("up"));
+    EXPECT_THAT(cfg.value().flags, testing::Contains("loopback"));
+}
+
+TEST_F(GetCfgTest, UnknownInterface) {
+    const auto cfg = InterfaceController::getCfg("nosuchiface0");
+    ASSERT_EQ(ok, cfg.status());
+    EXPECT_EQ("0.0.0.0", cfg.value().ipv4Addr);
+    EXPECT_EQ(0, cfg.value().prefixLength);
+    EXPECT_THAT(cfg.value().flags, testing::ElementsAre("down"));
+}
+
+TEST_F(GetCfgTest, AllMatchesSingle) {
+    const auto all = InterfaceController::getCfgAll();
+    ASSERT_EQ(ok, all.status());
+    EXPECT_THAT(all.value(), testing::Contains(testing::Field(
+                                     &InterfaceConfigurationParcel::ifName, testing::Eq("lo"))));
+    for (const auto& cfg : all.value()) {
+        const auto single = InterfaceController::getCfg(cfg.ifName);
+        ASSERT_EQ(ok, single.status());
+        EXPECT_EQ(single.value().ipv4Addr, cfg.ipv4Addr) << cfg.ifName;
+        EXPECT_EQ(single.value().prefixLength, cfg.prefixLength) << cfg.ifName;
+        EXPECT_EQ(single.value().hwAddr, cfg.hwAddr) << cfg.ifName;
+    }
+}
+
 }  // namespace net
 }  // namespace android
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "InterfaceRegistry"
+
+#include "InterfaceRegistry.h"
+
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <log/log.h>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+struct Entry {
+    std::string name;
+    int ifindex = 0;
+    // References taken by intern(), plus one while the name has an ifindex.
+    uint32_t refs = 0;
+};
+
+// Guards everything below.
+std::shared_mutex sLock;
+std::map<std::string, InterfaceId, std::less<>> sIds;
+// By ID. The first entry stands for INVALID_INTERFACE_ID. Entries of dropped names are empty.
+std::vector<Entry> sEntries(1);
+std::unordered_map<int, InterfaceId> sByIfindex;
+// IDs of dropped names, for reuse.
+std::vector<InterfaceId> sFreeIds;
+
+// The callers of these functions must hold sLock, and the ones that change anything must hold it
+// exclusively.
+
+InterfaceId findLocked(std::string_view name) {
+    const auto it = sIds.find(name);
+    return it == sIds.end() ? INVALID_INTERFACE_ID : it->second;
+}
+
+// Returns the ID of |name|, without taking a reference. A new name must be referenced before
+// sLock is released.
+InterfaceId internLocked(std::string_view name) {
+    if (InterfaceId id = findLocked(name)) return id;
+    InterfaceId id;
+    if (sFreeIds.empty()) {
+        id = sEntries.size();
+        sEntries.emplace_back();
+    } else {
+        id = sFreeIds.back();
+        sFreeIds.pop_back();
+    }
+    sEntries[id].name = name;
+    sIds.emplace(name, id);
+    return id;
+}
+
+void releaseLocked(InterfaceId id) {
+    Entry& entry = sEntries[id];
+    if (--entry.refs != 0) return;
+    sIds.erase(entry.name);
+    entry = Entry();
+    sFreeIds.push_back(id);
+}
+
+void clearIfindexLocked(int ifindex) {
+    const auto it = sByIfindex.find(ifindex);
+    if (it == sByIfindex.end()) return;
+    const InterfaceId id = it->second;
+    sByIfindex.erase(it);
+    sEntries[id].ifindex = 0;
+    releaseLocked(id);
+}
+
+// Returns the interface index and name from an RTM_NEWLINK or RTM_DELLINK message, or 0 if it has
+// none.
+int parseLink(const nlmsghdr* nlh, std::string_view* name) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) return 0;
+    const auto* ifi = reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nlh));
+    int len = IFLA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type != IFLA_IFNAME) continue;
+        const char* data = static_cast<const char*>(RTA_DATA(rta));
+        *name = std::string_view(data, strnlen(data, std::min<size_t>(RTA_PAYLOAD(rta),
+                                                                      IFNAMSIZ - 1)));
+        break;
+    }
+    return ifi->ifi_index;
+}
+
+}  // namespace
+
+InterfaceId InterfaceRegistry::intern(std::string_view name) {
+    if (name.empty()) return INVALID_INTERFACE_ID;
+    std::lock_guard lock(sLock);
+    const InterfaceId id = internLocked(name);
+    sEntries[id].refs++;
+    return id;
+}
+
+void InterfaceRegistry::release(InterfaceId id) {
+    std::lock_guard lock(sLock);
+    if (id == INVALID_INTERFACE_ID || id >= sEntries.size() || sEntries[id].refs == 0) {
+        ALOGE("Releasing interface ID %u, which is not interned", id);
+        return;
+    }
+    releaseLocked(id);
+}
+
+InterfaceId InterfaceRegistry::find(std::string_view name) {
+    std::shared_lock lock(sLock);
+    return findLocked(name);
+}
+
+std::string InterfaceRegistry::name(InterfaceId id) {
+    std::shared_lock lock(sLock);
+    return id < sEntries.size() ? sEntries[id].name : "";
+}
+
+int InterfaceRegistry::ifindex(InterfaceId id) {
+    std::shared_lock lock(sLock);
+    return id < sEntries.size() ? sEntries[id].ifindex : 0;
+}
+
+bool InterfaceRegistry::nameForIfindex(int ifindex, char* name) {
+    std::shared_lock lock(sLock);
+    const auto it = sByIfindex.find(ifindex);
+    if (it == sByIfindex.end()) return false;
+    strlcpy(name, sEntries[it->second].name.c_str(), IFNAMSIZ);
+    return true;
+}
+
+void InterfaceRegistry::onNetlinkMessage(const nlmsghdr* nlh) {
+    if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK) return;
+    std::string_view name;
+    const int index = parseLink(nlh, &name);
+    if (index <= 0) return;
+    const bool removed = nlh->nlmsg_type == RTM_DELLINK;
+    if (!removed && name.empty()) return;
+
+    // Most link messages are about flags, and change nothing here.
+    const auto unchanged = [&] {
+        const auto it = sByIfindex.find(index);
+        if (removed) return it == sByIfindex.end();
+        return it != sByIfindex.end() && sEntries[it->second].name == name;
+    };
+    {
+        std::shared_lock lock(sLock);
+        if (unchanged()) return;
+    }
+
+    std::lock_guard lock(sLock);
+    if (unchanged()) return;
+    if (removed) {
+        clearIfindexLocked(index);
+        return;
+    }
+    // Take the reference for the new index first, so that a rename back to a name that only this
+    // index held does not drop that name in between.
+    const InterfaceId id = internLocked(name);
+    sEntries[id].refs++;
+    // A new name for a known index is a rename, which leaves the old name without an index.
+    clearIfindexLocked(index);
+    // Only one interface can have a name at a time, so whichever had it before is gone.
+    if (sEntries[id].ifindex != 0) clearIfindexLocked(sEntries[id].ifindex);
+    sEntries[id].ifindex = index;
+    sByIfindex[index] = id;
+}
+
+void InterfaceRegistry::forgetIfindices() {
+    std::lock_guard lock(sLock);
+    std::vector<int> indices;
+    indices.reserve(sByIfindex.size());
+    for (const auto& [index, id] : sByIfindex) indices.push_back(index);
+    for (const int index : indices) clearIfindexLocked(index);
+}
+
+void InterfaceRegistry::dump(DumpWriter& dw) {
+    std::shared_lock lock(sLock);
+    dw.println("Interface registry: %zu names, %zu with an ifindex", sIds.size(),
+               sByIfindex.size());
+    dw.incIndent();
+    for (const auto& [name, id] : sIds) {
+        const Entry& entry = sEntries[id];
+        if (entry.ifindex) {
+            dw.println("%u %s ifindex %d refs %u", id, name.c_str(), entry.ifindex, entry.refs);
+        } else {
+            dw.println("%u %s refs %u", id, name.c_str(), entry.refs);
+        }
+    }
+    dw.decIndent();
+}
+
+}  // namespace android::net
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Stands for an interface name while anything refers to it. IDs are small and start at 1, so tables
+// can be vectors indexed by ID instead of maps keyed by name. The ID of a name that nothing refers
+// to any more is reused for the next new name.
+using InterfaceId = uint32_t;
+constexpr InterfaceId INVALID_INTERFACE_ID = 0;
+
+// Interns interface names, and tracks which name each interface index has, from the rtnetlink
+// link messages that NetlinkHandler receives. A renamed interface moves to the ID of its new name,
+// and the old name no longer has an interface index.
+//
+// Names are reference counted. A name is kept while it has an interface index, or while a caller
+// of intern() has not released it, and is dropped with its ID after that. Reads take a shared
+// lock, and every change updates the tables in place.
+class InterfaceRegistry {
+  public:
+    // Returns the ID of |name|, interning it if needed, and takes a reference to it that the
+    // caller must drop with release(). Returns INVALID_INTERFACE_ID for an empty name.
+    static InterfaceId intern(std::string_view name);
+    // Drops a reference taken by intern().
+    static void release(InterfaceId id);
+    // Returns the ID of |name|, or INVALID_INTERFACE_ID if it is not interned. Takes no reference,
+    // so the ID only stays valid while something else holds one.
+    static InterfaceId find(std::string_view name);
+    // Returns the name of |id|, or "" if there is no such ID.
+    static std::string name(InterfaceId id);
+
+    // Returns the interface index of |id|, or 0 if no interface has that name as far as the
+    // link messages tell.
+    static int ifindex(InterfaceId id);
+    // Copies the name of the interface with index |ifindex| into |name|, which must hold IFNAMSIZ
+    // bytes. Returns false if the interface is not known.
+    static bool nameForIfindex(int ifindex, char* name);
+
+    // Applies a message received on a socket subscribed to RTMGRP_LINK. Other messages are
+    // ignored.
+    static void onNetlinkMessage(const nlmsghdr* nlh);
+    // Forgets every interface index, e.g. because messages were lost. Names that callers of
+    // intern() still hold keep their IDs.
+    static void forgetIfindices();
+
+    static void dump(netdutils::DumpWriter& dw);
+};
+
+}  // namespace android::net
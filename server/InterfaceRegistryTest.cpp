@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "InterfaceRegistry.h"
+
+namespace android::net {
+
+namespace {
+
+// Indices that no real interface has.
+constexpr int kFakeIndex = 0x7fffffe0;
+constexpr int kOtherFakeIndex = 0x7fffffe1;
+
+std::vector<uint8_t> linkMessage(uint16_t type, int index, const std::string& name) {
+    std::vector<uint8_t> buf(NLMSG_SPACE(sizeof(ifinfomsg)) + RTA_SPACE(name.size() + 1));
+    auto* nlh = reinterpret_cast<nlmsghdr*>(buf.data());
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_len = buf.size();
+    reinterpret_cast<ifinfomsg*>(NLMSG_DATA(nlh))->ifi_index = index;
+    auto* rta = reinterpret_cast<rtattr*>(buf.data() + NLMSG_SPACE(sizeof(ifinfomsg)));
+    rta->rta_type = IFLA_IFNAME;
+    rta->rta_len = RTA_LENGTH(name.size() + 1);
+    memcpy(RTA_DATA(rta), name.c_str(), name.size() + 1);
+    return buf;
+}
+
+void sendLink(uint16_t type, int index, const std::string& name) {
+    const std::vector<uint8_t> msg = linkMessage(type, index, name);
+    InterfaceRegistry::onNetlinkMessage(reinterpret_cast<const nlmsghdr*>(msg.data()));
+}
+
+std::string nameForIfindex(int index) {
+    char name[IFNAMSIZ];
+    return InterfaceRegistry::nameForIfindex(index, name) ? name : "";
+}
+
+}  // namespace
+
+TEST(InterfaceRegistryTest, InternsNames) {
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find("regtest_intern0"));
+    const InterfaceId id = InterfaceRegistry::intern("regtest_intern0");
+    EXPECT_NE(INVALID_INTERFACE_ID, id);
+    EXPECT_EQ(id, InterfaceRegistry::intern("regtest_intern0"));
+    EXPECT_EQ(id, InterfaceRegistry::find("regtest_intern0"));
+    EXPECT_EQ("regtest_intern0", InterfaceRegistry::name(id));
+
+    const InterfaceId other = InterfaceRegistry::intern("regtest_intern1");
+    EXPECT_NE(id, other);
+    EXPECT_EQ("regtest_intern1", InterfaceRegistry::name(other));
+
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::intern(""));
+    EXPECT_EQ("", InterfaceRegistry::name(INVALID_INTERFACE_ID));
+
+    InterfaceRegistry::release(id);
+    InterfaceRegistry::release(id);
+    InterfaceRegistry::release(other);
+}
+
+TEST(InterfaceRegistryTest, DropsReleasedNames) {
+    const InterfaceId id = InterfaceRegistry::intern("regtest_release0");
+    EXPECT_EQ(id, InterfaceRegistry::intern("regtest_release0"));
+
+    // The name stays until every reference is dropped.
+    InterfaceRegistry::release(id);
+    EXPECT_EQ(id, InterfaceRegistry::find("regtest_release0"));
+    InterfaceRegistry::release(id);
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find("regtest_release0"));
+    EXPECT_EQ("", InterfaceRegistry::name(id));
+
+    // Its ID goes to the next new name.
+    const InterfaceId reused = InterfaceRegistry::intern("regtest_release1");
+    EXPECT_EQ(id, reused);
+    EXPECT_EQ("regtest_release1", InterfaceRegistry::name(reused));
+    InterfaceRegistry::release(reused);
+}
+
+TEST(InterfaceRegistryTest, TracksIfindexThroughRenames) {
+    sendLink(RTM_NEWLINK, kFakeIndex, "regtest_link0");
+    const InterfaceId id = InterfaceRegistry::find("regtest_link0");
+    ASSERT_NE(INVALID_INTERFACE_ID, id);
+    EXPECT_EQ(kFakeIndex, InterfaceRegistry::ifindex(id));
+    EXPECT_EQ("regtest_link0", nameForIfindex(kFakeIndex));
+
+    // The old name loses the index, and the new name gets its own ID. Nothing else refers to
+    // the old name, so it is dropped.
+    sendLink(RTM_NEWLINK, kFakeIndex, "regtest_link1");
+    const InterfaceId renamed = InterfaceRegistry::find("regtest_link1");
+    EXPECT_NE(INVALID_INTERFACE_ID, renamed);
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find("regtest_link0"));
+    EXPECT_EQ(kFakeIndex, InterfaceRegistry::ifindex(renamed));
+    EXPECT_EQ("regtest_link1", nameForIfindex(kFakeIndex));
+
+    // Another interface taking the name means the first one is gone.
+    sendLink(RTM_NEWLINK, kOtherFakeIndex, "regtest_link1");
+    EXPECT_EQ(kOtherFakeIndex, InterfaceRegistry::ifindex(renamed));
+    EXPECT_EQ("", nameForIfindex(kFakeIndex));
+
+    // A name that a caller of intern() holds outlives its interface.
+    EXPECT_EQ(renamed, InterfaceRegistry::intern("regtest_link1"));
+    sendLink(RTM_DELLINK, kOtherFakeIndex, "regtest_link1");
+    EXPECT_EQ(0, InterfaceRegistry::ifindex(renamed));
+    EXPECT_EQ("", nameForIfindex(kOtherFakeIndex));
+    EXPECT_EQ(renamed, InterfaceRegistry::find("regtest_link1"));
+
+    InterfaceRegistry::release(renamed);
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find("regtest_link1"));
+}
+
+TEST(InterfaceRegistryTest, ForgetsIfindices) {
+    const InterfaceId id = InterfaceRegistry::intern("regtest_forget0");
+    sendLink(RTM_NEWLINK, kFakeIndex, "regtest_forget0");
+    sendLink(RTM_NEWLINK, kOtherFakeIndex, "regtest_forget1");
+    EXPECT_EQ(kFakeIndex, InterfaceRegistry::ifindex(id));
+
+    InterfaceRegistry::forgetIfindices();
+    EXPECT_EQ(0, InterfaceRegistry::ifindex(id));
+    EXPECT_EQ("", nameForIfindex(kFakeIndex));
+    EXPECT_EQ(id, InterfaceRegistry::find("regtest_forget0"));
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find("regtest_forget1"));
+    InterfaceRegistry::release(id);
+}
+
+}  // namespace android::net
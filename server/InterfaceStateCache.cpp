@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "InterfaceController"
+
+#include "InterfaceStateCache.h"
+
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "NetlinkCommands.h"
+
+using android::netdutils::Status;
+using android::netdutils::statusFromErrno;
+using android::netdutils::StatusOr;
+using android::netdutils::status::ok;
+
+namespace android::net {
+
+namespace {
+
+using LinkState = InterfaceStateCache::LinkState;
+using LinkStates = InterfaceStateCache::LinkStates;
+
+// Decodes the link part of |link| from an RTM_NEWLINK message. Returns the interface index, or 0
+// if |nlh| is not a usable link message.
+int parseLink(const nlmsghdr* nlh, LinkState* link) {
+    if (nlh->nlmsg_type != RTM_NEWLINK || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+        return 0;
+    }
+    const auto* ifi = reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nlh));
+    link->flags = ifi->ifi_flags;
+    int len = IFLA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            link->ifName.assign(static_cast<const char*>(RTA_DATA(rta)),
+                                strnlen(static_cast<const char*>(RTA_DATA(rta)), RTA_PAYLOAD(rta)));
+        } else if (rta->rta_type == IFLA_ADDRESS) {
+            // ETH_ALEN is for ARPHRD_ETHER, it is better to check ifi_type.
+            // However, we keep old design for the consistency.
+            memcpy(link->hwaddr, RTA_DATA(rta), std::min<size_t>(RTA_PAYLOAD(rta), ETH_ALEN));
+        } else if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+            memcpy(&link->mtu, RTA_DATA(rta), sizeof(uint32_t));
+        }
+    }
+    return link->ifName.empty() ? 0 : ifi->ifi_index;
+}
+
+void parseIPv4Address(const nlmsghdr* nlh, LinkStates* links) {
+    if (nlh->nlmsg_type != RTM_NEWADDR || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) return;
+    const auto* ifa = reinterpret_cast<const ifaddrmsg*>(NLMSG_DATA(nlh));
+    if (ifa->ifa_family != AF_INET || (ifa->ifa_flags & IFA_F_SECONDARY)) return;
+    const auto it = links->find(ifa->ifa_index);
+    if (it == links->end() || it->second.hasAddr) return;
+    LinkState& link = it->second;
+
+    const rtattr* local = nullptr;
+    const rtattr* address = nullptr;
+    bool labelMatches = false;
+    int len = IFA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFA_LOCAL) {
+            local = rta;
+        } else if (rta->rta_type == IFA_ADDRESS) {
+            address = rta;
+        } else if (rta->rta_type == IFA_LABEL) {
+            labelMatches = strncmp(static_cast<const char*>(RTA_DATA(rta)), link.ifName.c_str(),
+                                   RTA_PAYLOAD(rta)) == 0;
+        }
+    }
+    // As with SIOCGIFADDR, an alias such as "eth0:1" is not the interface's address.
+    const rtattr* rta = local ? local : address;
+    if (!labelMatches || rta == nullptr || RTA_PAYLOAD(rta) < sizeof(in_addr)) return;
+    memcpy(&link.addr, RTA_DATA(rta), sizeof(in_addr));
+    link.prefixLength = ifa->ifa_prefixlen;
+    link.hasAddr = true;
+}
+
+}  // namespace
+
+Status InterfaceStateCache::dump(const std::string& ifName, LinkStates* links) {
+    const NetlinkDumpCallback linkCallback = [&ifName, links](nlmsghdr* nlh) {
+        LinkState link;
+        const int index = parseLink(nlh, &link);
+        if (index == 0 || (!ifName.empty() && link.ifName != ifName)) return;
+        (*links)[index] = std::move(link);
+    };
+    ifinfomsg ifi = {};
+    iovec linkIov[] = {{nullptr, 0}, {&ifi, sizeof(ifi)}};
+    if (int ret = sendNetlinkRequest(RTM_GETLINK, NETLINK_DUMP_FLAGS, linkIov,
+                                     std::size(linkIov), &linkCallback)) {
+        return statusFromErrno(-ret, "Failed to dump links");
+    }
+    if (links->empty()) return ok;
+
+    const NetlinkDumpCallback addrCallback = [links](nlmsghdr* nlh) {
+        parseIPv4Address(nlh, links);
+    };
+    ifaddrmsg ifa = {.ifa_family = AF_INET};
+    iovec addrIov[] = {{nullptr, 0}, {&ifa, sizeof(ifa)}};
+    if (int ret = sendNetlinkRequest(RTM_GETADDR, NETLINK_DUMP_FLAGS, addrIov,
+                                     std::size(addrIov), &addrCallback)) {
+        return statusFromErrno(-ret, "Failed to dump addresses");
+    }
+    return ok;
+}
+
+void InterfaceStateCache::setEnabled(bool enabled) {
+    std::lock_guard lock(mMutex);
+    mEnabled = enabled;
+    mValid = false;
+    mLinks.clear();
+    mStale.clear();
+}
+
+bool InterfaceStateCache::isEnabled() const {
+    std::lock_guard lock(mMutex);
+    return mEnabled;
+}
+
+void InterfaceStateCache::onNetlinkMessage(const nlmsghdr* nlh) {
+    std::lock_guard lock(mMutex);
+    if (!mValid) return;
+    switch (nlh->nlmsg_type) {
+        case RTM_NEWLINK: {
+            LinkState link;
+            const int index = parseLink(nlh, &link);
+            if (index == 0) return;
+            const auto it = mLinks.find(index);
+            if (it == mLinks.end()) {
+                mLinks.emplace(index, std::move(link));
+            } else if (it->second.ifName != link.ifName) {
+                // The address is found by its label, which follows the name.
+                mValid = false;
+            } else {
+                link.hasAddr = it->second.hasAddr;
+                link.addr = it->second.addr;
+                link.prefixLength = it->second.prefixLength;
+                it->second = std::move(link);
+            }
+            break;
+        }
+        case RTM_DELLINK:
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) return;
+            mLinks.erase(reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nlh))->ifi_index);
+            break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) return;
+            if (reinterpret_cast<const ifaddrmsg*>(NLMSG_DATA(nlh))->ifa_family == AF_INET) {
+                mValid = false;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void InterfaceStateCache::invalidate() {
+    std::lock_guard lock(mMutex);
+    mValid = false;
+    mStale.clear();
+}
+
+void InterfaceStateCache::invalidate(const std::string& ifName) {
+    std::lock_guard lock(mMutex);
+    if (mValid) mStale.insert(ifName);
+}
+
+Status InterfaceStateCache::refreshLocked() {
+    // The dump is done under the lock, which holds back NetlinkHandler for its duration. Messages
+    // queued meanwhile are applied after it. Some may predate the dump, but the last one for each
+    // link does not, so the cache still ends up with the kernel's state.
+    if (!mValid) {
+        LinkStates links;
+        RETURN_IF_NOT_OK(dump("", &links));
+        mLinks = std::move(links);
+        mStale.clear();
+        mValid = true;
+        return ok;
+    }
+    while (!mStale.empty()) {
+        const std::string& ifName = *mStale.begin();
+        LinkStates links;
+        RETURN_IF_NOT_OK(dump(ifName, &links));
+        std::erase_if(mLinks,
+                      [&ifName](const auto& entry) { return entry.second.ifName == ifName; });
+        mLinks.merge(links);
+        mStale.erase(mStale.begin());
+    }
+    return ok;
+}
+
+StatusOr<std::optional<LinkState>> InterfaceStateCache::get(const std::string& ifName) {
+    std::lock_guard lock(mMutex);
+    if (!mEnabled) {
+        LinkStates links;
+        RETURN_IF_NOT_OK(dump(ifName, &links));
+        if (links.empty()) return std::optional<LinkState>();
+        return std::optional<LinkState>(std::move(links.begin()->second));
+    }
+    RETURN_IF_NOT_OK(refreshLocked());
+    for (const auto& [_, link] : mLinks) {
+        if (link.ifName == ifName) return std::optional<LinkState>(link);
+    }
+    return std::optional<LinkState>();
+}
+
+StatusOr<LinkStates> InterfaceStateCache::getAll() {
+    std::lock_guard lock(mMutex);
+    if (!mEnabled) {
+        LinkStates links;
+        RETURN_IF_NOT_OK(dump("", &links));
+        return links;
+    }
+    RETURN_IF_NOT_OK(refreshLocked());
+    return mLinks;
+}
+
+}  // namespace android::net
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/Status.h>
+#include <netdutils/StatusOr.h>
+
+namespace android::net {
+
+// The link and IPv4 address state of every interface, kept up to date from the rtnetlink
+// multicasts that NetlinkHandler receives, so that reading an interface's configuration does not
+// take a kernel round trip each time.
+//
+// Link messages are applied as they arrive. An IPv4 address message only marks the cache stale,
+// because which address SIOCGIFADDR would return depends on all of the interface's addresses;
+// the next lookup then dumps everything again. Until it is enabled, and after events were lost,
+// every lookup dumps as well.
+class InterfaceStateCache {
+  public:
+    struct LinkState {
+        std::string ifName;
+        unsigned flags = 0;  // IFF_*
+        unsigned mtu = 0;
+        unsigned char hwaddr[ETH_ALEN] = {};
+        // The primary address whose label is the interface name, which SIOCGIFADDR would return.
+        bool hasAddr = false;
+        in_addr addr = {};
+        int prefixLength = 0;
+    };
+    // Keyed by interface index.
+    using LinkStates = std::map<int, LinkState>;
+
+    // Fills |links| from one link dump and one IPv4 address dump, without using any cache. If
+    // |ifName| is not empty, only that interface is kept.
+    static netdutils::Status dump(const std::string& ifName, LinkStates* links);
+
+    // Only enable the cache while every rtnetlink link and IPv4 address multicast is passed to
+    // onNetlinkMessage(), or it will go stale.
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+    // Applies a message received on a socket subscribed to RTMGRP_LINK and RTMGRP_IPV4_IFADDR.
+    // Other messages are ignored.
+    void onNetlinkMessage(const nlmsghdr* nlh);
+
+    // Drops everything, e.g. because messages were lost.
+    void invalidate();
+    // Drops the state of |ifName|, e.g. because netd just changed it, and the message about the
+    // change may not have been applied yet. Only that interface is dumped again.
+    void invalidate(const std::string& ifName);
+
+    // Returns the state of |ifName|, or std::nullopt if there is no such interface.
+    netdutils::StatusOr<std::optional<LinkState>> get(const std::string& ifName);
+    netdutils::StatusOr<LinkStates> getAll();
+
+  private:
+    // Dumps into the cache if it is not valid.
+    netdutils::Status refreshLocked() REQUIRES(mMutex);
+
+    mutable std::mutex mMutex;
+    bool mEnabled GUARDED_BY(mMutex) = false;
+    // Whether mLinks holds the current state of every interface.
+    bool mValid GUARDED_BY(mMutex) = false;
+    LinkStates mLinks GUARDED_BY(mMutex);
+    // Interfaces whose state in mLinks is not current, while mValid is set.
+    std::set<std::string> mStale GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
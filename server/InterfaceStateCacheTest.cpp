@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "InterfaceStateCache.h"
+
+namespace android::net {
+
+namespace {
+
+// An index that no real interface has.
+constexpr int kFakeIndex = 0x7ffffff0;
+constexpr char kFakeName[] = "fake0";
+
+// Builds a netlink message of |type| with a fixed header |T| and any number of attributes.
+template <typename T>
+class MessageBuilder {
+  public:
+    explicit MessageBuilder(uint16_t type) : mBuf(NLMSG_SPACE(sizeof(T))) {
+        header()->nlmsg_type = type;
+        sync();
+    }
+
+    T* body() { return reinterpret_cast<T*>(NLMSG_DATA(header())); }
+
+    MessageBuilder& attr(uint16_t type, const void* data, size_t len) {
+        const size_t offset = mBuf.size();
+        mBuf.resize(offset + RTA_SPACE(len));
+        auto* rta = reinterpret_cast<rtattr*>(mBuf.data() + offset);
+        rta->rta_type = type;
+        rta->rta_len = RTA_LENGTH(len);
+        memcpy(RTA_DATA(rta), data, len);
+        sync();
+        return *this;
+    }
+
+    const nlmsghdr* get() { return header(); }
+
+  private:
+    nlmsghdr* header() { return reinterpret_cast<nlmsghdr*>(mBuf.data()); }
+    void sync() { header()->nlmsg_len = mBuf.size(); }
+
+    std::vector<uint8_t> mBuf;
+};
+
+MessageBuilder<ifinfomsg> fakeLink(uint16_t type, unsigned flags, uint32_t mtu) {
+    MessageBuilder<ifinfomsg> msg(type);
+    msg.body()->ifi_index = kFakeIndex;
+    msg.body()->ifi_flags = flags;
+    const unsigned char hwaddr[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+    msg.attr(IFLA_IFNAME, kFakeName, sizeof(kFakeName))
+            .attr(IFLA_MTU, &mtu, sizeof(mtu))
+            .attr(IFLA_ADDRESS, hwaddr, sizeof(hwaddr));
+    return msg;
+}
+
+MessageBuilder<ifaddrmsg> fakeAddress(int family) {
+    MessageBuilder<ifaddrmsg> msg(RTM_NEWADDR);
+    msg.body()->ifa_family = family;
+    msg.body()->ifa_index = kFakeIndex;
+    return msg;
+}
+
+bool hasFakeLink(InterfaceStateCache& cache) {
+    const auto link = cache.get(kFakeName);
+    EXPECT_TRUE(isOk(link));
+    return isOk(link) && link.value().has_value();
+}
+
+}  // namespace
+
+TEST(InterfaceStateCacheTest, DisabledDumpsEveryTime) {
+    InterfaceStateCache cache;
+    EXPECT_FALSE(cache.isEnabled());
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, IFF_UP, 1500).get());
+    EXPECT_FALSE(hasFakeLink(cache));
+
+    const auto lo = cache.get("lo");
+    ASSERT_TRUE(isOk(lo));
+    ASSERT_TRUE(lo.value().has_value());
+    EXPECT_TRUE(lo.value()->flags & IFF_LOOPBACK);
+    EXPECT_NE(0U, lo.value()->mtu);
+}
+
+TEST(InterfaceStateCacheTest, LinkMessagesUpdateCache) {
+    InterfaceStateCache cache;
+    cache.setEnabled(true);
+    ASSERT_TRUE(isOk(cache.getAll()));
+
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, IFF_UP | IFF_RUNNING, 1280).get());
+    auto link = cache.get(kFakeName);
+    ASSERT_TRUE(isOk(link));
+    ASSERT_TRUE(link.value().has_value());
+    EXPECT_EQ(unsigned{IFF_UP | IFF_RUNNING}, link.value()->flags);
+    EXPECT_EQ(1280U, link.value()->mtu);
+    EXPECT_EQ(0x01, link.value()->hwaddr[ETH_ALEN - 1]);
+
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, 0, 1280).get());
+    link = cache.get(kFakeName);
+    ASSERT_TRUE(isOk(link));
+    ASSERT_TRUE(link.value().has_value());
+    EXPECT_EQ(0U, link.value()->flags);
+
+    cache.onNetlinkMessage(fakeLink(RTM_DELLINK, 0, 1280).get());
+    EXPECT_FALSE(hasFakeLink(cache));
+}
+
+TEST(InterfaceStateCacheTest, IPv4AddressMessageInvalidates) {
+    InterfaceStateCache cache;
+    cache.setEnabled(true);
+    ASSERT_TRUE(isOk(cache.getAll()));
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, IFF_UP, 1500).get());
+
+    // IPv6 addresses are not part of the cached state.
+    cache.onNetlinkMessage(fakeAddress(AF_INET6).get());
+    EXPECT_TRUE(hasFakeLink(cache));
+
+    // The fake link does not survive the dump that follows.
+    cache.onNetlinkMessage(fakeAddress(AF_INET).get());
+    EXPECT_FALSE(hasFakeLink(cache));
+}
+
+TEST(InterfaceStateCacheTest, Invalidate) {
+    InterfaceStateCache cache;
+    cache.setEnabled(true);
+    ASSERT_TRUE(isOk(cache.getAll()));
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, IFF_UP, 1500).get());
+    EXPECT_TRUE(hasFakeLink(cache));
+
+    cache.invalidate();
+    EXPECT_FALSE(hasFakeLink(cache));
+}
+
+TEST(InterfaceStateCacheTest, InvalidateInterface) {
+    InterfaceStateCache cache;
+    cache.setEnabled(true);
+    ASSERT_TRUE(isOk(cache.getAll()));
+    cache.onNetlinkMessage(fakeLink(RTM_NEWLINK, IFF_UP, 1500).get());
+
+    // Other interfaces are not dumped again.
+    cache.invalidate("lo");
+    EXPECT_TRUE(hasFakeLink(cache));
+    const auto lo = cache.get("lo");
+    ASSERT_TRUE(isOk(lo));
+    EXPECT_TRUE(lo.value().has_value());
+
+    cache.invalidate(kFakeName);
+    EXPECT_FALSE(hasFakeLink(cache));
+    const auto all = cache.getAll();
+    ASSERT_TRUE(isOk(all));
+    EXPECT_TRUE(std::any_of(all.value().begin(), all.value().end(),
+                            [](const auto& entry) { return entry.second.ifName == "lo"; }));
+}
+
+}  // namespace android::net
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Netd"
+
+#include "IptablesCounters.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+
+#include <android-base/unique_fd.h>
+#include <log/log.h>
+
+namespace android::net {
+
+namespace {
+
+// The table size can change between IPT_SO_GET_INFO and IPT_SO_GET_ENTRIES, in which case the
+// kernel fails the latter with EAGAIN.
+constexpr int kMaxAttempts = 3;
+
+struct Ipv4Tables {
+    using Info = ipt_getinfo;
+    using Entries = ipt_get_entries;
+    using Entry = ipt_entry;
+    static constexpr int kFamily = AF_INET;
+    static constexpr int kLevel = IPPROTO_IP;
+    static constexpr int kGetInfo = IPT_SO_GET_INFO;
+    static constexpr int kGetEntries = IPT_SO_GET_ENTRIES;
+    static const ipt_ip& match(const Entry& entry) { return entry.ip; }
+};
+
+struct Ipv6Tables {
+    using Info = ip6t_getinfo;
+    using Entries = ip6t_get_entries;
+    using Entry = ip6t_entry;
+    static constexpr int kFamily = AF_INET6;
+    static constexpr int kLevel = IPPROTO_IPV6;
+    static constexpr int kGetInfo = IP6T_SO_GET_INFO;
+    static constexpr int kGetEntries = IP6T_SO_GET_ENTRIES;
+    static const ip6t_ip6& match(const Entry& entry) { return entry.ipv6; }
+};
+
+std::string ifaceName(const char (&name)[IFNAMSIZ]) {
+    return std::string(name, strnlen(name, IFNAMSIZ));
+}
+
+template <typename Tables>
+int readEntries(int fd, const char* table, std::vector<uint8_t>* buffer) {
+    for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+        typename Tables::Info info = {};
+        strlcpy(info.name, table, sizeof(info.name));
+        socklen_t len = sizeof(info);
+        if (getsockopt(fd, Tables::kLevel, Tables::kGetInfo, &info, &len) == -1) {
+            return -errno;
+        }
+
+        buffer->assign(sizeof(typename Tables::Entries) + info.size, 0);
+        auto* entries = reinterpret_cast<typename Tables::Entries*>(buffer->data());
+        strlcpy(entries->name, table, sizeof(entries->name));
+        entries->size = info.size;
+        len = buffer->size();
+        if (getsockopt(fd, Tables::kLevel, Tables::kGetEntries, entries, &len) == 0) {
+            return 0;
+        }
+        if (errno != EAGAIN) {
+            return -errno;
+        }
+    }
+    return -EAGAIN;
+}
+
+// A user-defined chain is laid out as an ERROR entry naming the chain, then its rules, then an
+// unconditional RETURN entry that holds the chain's policy. The next chain's ERROR entry, or the
+// ERROR entry that ends the table, follows.
+template <typename Tables>
+int parseChainCounters(const uint8_t* entries, size_t size, const char* chain,
+                       std::vector<IptablesRuleCounters>* rules) {
+    bool inChain = false;
+    rules->clear();
+    for (size_t offset = 0; offset + sizeof(typename Tables::Entry) <= size;) {
+        const auto* entry = reinterpret_cast<const typename Tables::Entry*>(entries + offset);
+        if (entry->next_offset < sizeof(typename Tables::Entry) ||
+            entry->target_offset + sizeof(xt_entry_target) > entry->next_offset ||
+            offset + entry->next_offset > size) {
+            ALOGE("Malformed iptables entry at offset %zu", offset);
+            return -EBADMSG;
+        }
+        const auto* target = reinterpret_cast<const xt_entry_target*>(
+                reinterpret_cast<const uint8_t*>(entry) + entry->target_offset);
+        if (!strcmp(target->u.user.name, XT_ERROR_TARGET)) {
+            if (inChain) {
+                // Drop the policy entry.
+                if (!rules->empty()) rules->pop_back();
+                return 0;
+            }
+            const auto* error = reinterpret_cast<const xt_error_target*>(target);
+            inChain = !strncmp(error->errorname, chain, sizeof(error->errorname));
+        } else if (inChain) {
+            const auto& match = Tables::match(*entry);
+            rules->push_back({
+                    .inIface = ifaceName(match.iniface),
+                    .outIface = ifaceName(match.outiface),
+                    .packets = entry->counters.pcnt,
+                    .bytes = entry->counters.bcnt,
+            });
+        }
+        offset += entry->next_offset;
+    }
+    rules->clear();
+    return -ENOENT;
+}
+
+template <typename Tables>
+int getChainCounters(const char* table, const char* chain,
+                     std::vector<IptablesRuleCounters>* rules) {
+    base::unique_fd fd(socket(Tables::kFamily, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW));
+    if (fd == -1) {
+        return -errno;
+    }
+
+    std::vector<uint8_t> buffer;
+    if (int ret = readEntries<Tables>(fd, table, &buffer)) {
+        return ret;
+    }
+    const auto* entries = reinterpret_cast<const typename Tables::Entries*>(buffer.data());
+    return parseChainCounters<Tables>(reinterpret_cast<const uint8_t*>(entries->entrytable),
+                                      entries->size, chain, rules);
+}
+
+}  // namespace
+
+int getIptablesChainCounters(IptablesTarget target, const char* table, const char* chain,
+                             std::vector<IptablesRuleCounters>* rules) {
+    switch (target) {
+        case V4:
+            return getChainCounters<Ipv4Tables>(table, chain, rules);
+        case V6:
+            return getChainCounters<Ipv6Tables>(table, chain, rules);
+        default:
+            return -EINVAL;
+    }
+}
+
+int parseIptablesChainCounters(IptablesTarget target, const uint8_t* entries, size_t size,
+                               const char* chain, std::vector<IptablesRuleCounters>* rules) {
+    switch (target) {
+        case V4:
+            return parseChainCounters<Ipv4Tables>(entries, size, chain, rules);
+        case V6:
+            return parseChainCounters<Ipv6Tables>(entries, size, chain, rules);
+        default:
+            return -EINVAL;
+    }
+}
+
+}  // namespace android::net
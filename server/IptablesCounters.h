@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+namespace android::net {
+
+// The counters of one rule, as kept by the kernel.
+struct IptablesRuleCounters {
+    // The -i and -o interfaces of the rule, or empty if the rule does not match on them.
+    std::string inIface;
+    std::string outIface;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+// Reads the counters of the rules of the user-defined |chain| of |table| straight from the
+// kernel, with the IPT_SO_GET_ENTRIES or IP6T_SO_GET_ENTRIES socket option, instead of running
+// iptables and parsing its output. |target| must be V4 or V6. Returns 0 on success, -ENOENT if
+// the chain does not exist, or another negative errno if the kernel could not be read, e.g. if
+// its iptables are backed by nftables.
+int getIptablesChainCounters(IptablesTarget target, const char* table, const char* chain,
+                             std::vector<IptablesRuleCounters>* rules);
+
+// Parses the counters of the rules of |chain| out of |size| bytes of entries returned by
+// IPT_SO_GET_ENTRIES or IP6T_SO_GET_ENTRIES. Exposed for testing.
+int parseIptablesChainCounters(IptablesTarget target, const uint8_t* entries, size_t size,
+                               const char* chain, std::vector<IptablesRuleCounters>* rules);
+
+}  // namespace android::net
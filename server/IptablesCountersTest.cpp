@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+
+#include <gtest/gtest.h>
+
+#include "IptablesCounters.h"
+
+namespace android::net {
+
+namespace {
+
+ipt_ip& matchOf(ipt_entry& entry) {
+    return entry.ip;
+}
+
+ip6t_ip6& matchOf(ip6t_entry& entry) {
+    return entry.ipv6;
+}
+
+// Lays out entries the way IPT_SO_GET_ENTRIES returns them.
+template <typename Entry>
+class EntriesBuilder {
+  public:
+    void addChain(const char* name) {
+        xt_error_target target = {};
+        target.target.u.user.target_size = XT_ALIGN(sizeof(target));
+        strncpy(target.target.u.user.name, XT_ERROR_TARGET, sizeof(target.target.u.user.name));
+        strncpy(target.errorname, name, sizeof(target.errorname) - 1);
+        add(Entry{}, &target, sizeof(target));
+    }
+
+    void addReturnRule(const char* in, const char* out, uint64_t packets, uint64_t bytes) {
+        Entry entry = {};
+        strncpy(matchOf(entry).iniface, in, IFNAMSIZ - 1);
+        strncpy(matchOf(entry).outiface, out, IFNAMSIZ - 1);
+        entry.counters.pcnt = packets;
+        entry.counters.bcnt = bytes;
+        xt_standard_target target = {};
+        target.target.u.user.target_size = XT_ALIGN(sizeof(target));
+        target.verdict = XT_RETURN;
+        add(entry, &target, sizeof(target));
+    }
+
+    std::vector<uint8_t> data;
+
+  private:
+    void add(Entry entry, const void* target, size_t targetSize) {
+        entry.target_offset = sizeof(Entry);
+        entry.next_offset = sizeof(Entry) + XT_ALIGN(targetSize);
+        const size_t offset = data.size();
+        data.resize(offset + entry.next_offset, 0);
+        memcpy(data.data() + offset, &entry, sizeof(entry));
+        memcpy(data.data() + offset + sizeof(Entry), target, targetSize);
+    }
+};
+
+template <typename Entry>
+std::vector<uint8_t> makeTable() {
+    EntriesBuilder<Entry> builder;
+    builder.addChain("other_chain");
+    builder.addReturnRule("eth0", "eth1", 1, 100);
+    builder.addReturnRule("", "", 0, 0);
+    builder.addChain("tetherctrl_counters");
+    builder.addReturnRule("wlan0", "rmnet0", 26, 2373);
+    builder.addReturnRule("rmnet0", "wlan0", 27, 2002);
+    builder.addReturnRule("", "", 0, 0);
+    builder.addChain("empty_chain");
+    builder.addReturnRule("", "", 0, 0);
+    builder.addChain(XT_ERROR_TARGET);
+    return builder.data;
+}
+
+}  // namespace
+
+template <typename Entry>
+void checkParseTable(IptablesTarget target) {
+    const std::vector<uint8_t> table = makeTable<Entry>();
+    std::vector<IptablesRuleCounters> rules;
+
+    ASSERT_EQ(0, parseIptablesChainCounters(target, table.data(), table.size(),
+                                            "tetherctrl_counters", &rules));
+    ASSERT_EQ(2U, rules.size());
+    EXPECT_EQ("wlan0", rules[0].inIface);
+    EXPECT_EQ("rmnet0", rules[0].outIface);
+    EXPECT_EQ(26U, rules[0].packets);
+    EXPECT_EQ(2373U, rules[0].bytes);
+    EXPECT_EQ("rmnet0", rules[1].inIface);
+    EXPECT_EQ("wlan0", rules[1].outIface);
+    EXPECT_EQ(27U, rules[1].packets);
+    EXPECT_EQ(2002U, rules[1].bytes);
+
+    ASSERT_EQ(0, parseIptablesChainCounters(target, table.data(), table.size(), "empty_chain",
+                                            &rules));
+    EXPECT_EQ(0U, rules.size());
+
+    EXPECT_EQ(-ENOENT, parseIptablesChainCounters(target, table.data(), table.size(),
+                                                  "missing_chain", &rules));
+    EXPECT_EQ(0U, rules.size());
+
+    // A prefix of a chain name does not match it.
+    EXPECT_EQ(-ENOENT, parseIptablesChainCounters(target, table.data(), table.size(),
+                                                  "tetherctrl", &rules));
+}
+
+TEST(IptablesCountersTest, ParseIpv4Table) {
+    checkParseTable<ipt_entry>(V4);
+}
+
+TEST(IptablesCountersTest, ParseIpv6Table) {
+    checkParseTable<ip6t_entry>(V6);
+}
+
+TEST(IptablesCountersTest, ParseMalformedTable) {
+    std::vector<uint8_t> table = makeTable<ipt_entry>();
+    std::vector<IptablesRuleCounters> rules;
+
+    // Truncated in the middle of the chain.
+    EXPECT_EQ(-EBADMSG, parseIptablesChainCounters(V4, table.data(), table.size() - 8,
+                                                   "empty_chain", &rules));
+
+    // An entry that does not advance.
+    reinterpret_cast<ipt_entry*>(table.data())->next_offset = 0;
+    EXPECT_EQ(-EBADMSG, parseIptablesChainCounters(V4, table.data(), table.size(),
+                                                   "tetherctrl_counters", &rules));
+
+    EXPECT_EQ(-EINVAL, parseIptablesChainCounters(V4V6, table.data(), table.size(),
+                                                  "tetherctrl_counters", &rules));
+}
+
+}  // namespace android::net
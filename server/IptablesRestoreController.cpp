@@ -22,13 +22,25 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+
 #include <android-base/logging.h>
 #include <android-base/file.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <netdutils/Syscalls.h>
 
 #include "Controllers.h"
+#include "FlightRecorder.h"
 #include "NetdConstants.h"
+#include "NetdMetrics.h"
+#include "RpcStats.h"
+#include "ScopedTrace.h"
 
+using android::base::Split;
+using android::net::FlightRecorder;
+using android::net::NetdMetrics;
 using android::netdutils::StatusOr;
 using android::netdutils::sSyscalls;
 
@@ -39,6 +51,17 @@ constexpr char PING[] = "#PING\n";
 
 constexpr size_t PING_SIZE = sizeof(PING) - 1;
 
+constexpr char SHARDING_PROPERTY[] = "persist.netd.iptables_restore_sharding";
+
+namespace {
+
+NetdMetrics::Counter sCommands("iptables_restore.commands");
+NetdMetrics::Counter sFailures("iptables_restore.failures");
+NetdMetrics::Counter sProcessStarts("iptables_restore.process_starts");
+NetdMetrics::Histogram sCommandTimeUs("iptables_restore.command_us");
+
+}  // namespace
+
 // Not compile-time constants because they are changed by the unit tests.
 int IptablesRestoreController::MAX_RETRIES = 50;
 int IptablesRestoreController::POLL_TIMEOUT_MS = 100;
@@ -98,7 +121,68 @@ public:
     static constexpr size_t STDERR_IDX = 1;
 };
 
-IptablesRestoreController::IptablesRestoreController() {
+// Collects the stdout of one iptables[6]-restore process until the ping that marks the end of the
+// response is seen. Only the newly read bytes, plus enough of the already buffered ones to catch a
+// ping split across reads, are searched, so large outputs are scanned in linear time.
+struct IptablesRestoreController::ResponseReader {
+    static constexpr char PING_LINE[] = "#PING";
+
+    // Exactly one of these is set. |output| accumulates all output. |callback| is invoked with
+    // each complete line, and only the current partial line is buffered.
+    std::string* output = nullptr;
+    const OutputLineCallback* callback = nullptr;
+
+    std::string buffer;
+
+    // Appends |size| bytes of stdout. Returns true once the ping has been received.
+    bool append(const char* data, size_t size) {
+        return (callback != nullptr) ? appendLines(data, size) : appendOutput(data, size);
+    }
+
+  private:
+    bool appendOutput(const char* data, size_t size) {
+        const size_t searchStart = (output->size() >= PING_SIZE - 1)
+                                           ? output->size() - (PING_SIZE - 1) : 0;
+        output->append(data, size);
+        size_t pos = output->find(PING, searchStart);
+        if (pos == std::string::npos) return false;
+
+        if (output->size() > pos + PING_SIZE) {
+            size_t extra = output->size() - (pos + PING_SIZE);
+            ALOGW("%zd extra characters after iptables response: '%s...'",
+                  extra, output->substr(pos + PING_SIZE, 128).c_str());
+        }
+        output->resize(pos);
+        return true;
+    }
+
+    bool appendLines(const char* data, size_t size) {
+        // |buffer| never contains a newline between calls, so only search the new bytes.
+        size_t searchStart = buffer.size();
+        buffer.append(data, size);
+
+        size_t lineStart = 0;
+        size_t newline;
+        while ((newline = buffer.find('\n', searchStart)) != std::string::npos) {
+            std::string_view line(buffer.data() + lineStart, newline - lineStart);
+            lineStart = searchStart = newline + 1;
+            if (line == PING_LINE) {
+                if (buffer.size() > lineStart) {
+                    ALOGW("%zd extra characters after iptables response",
+                          buffer.size() - lineStart);
+                }
+                buffer.clear();
+                return true;
+            }
+            (*callback)(line);
+        }
+        buffer.erase(0, lineStart);
+        return false;
+    }
+};
+
+IptablesRestoreController::IptablesRestoreController()
+    : mSharded(android::base::GetBoolProperty(SHARDING_PROPERTY, false)) {
     Init();
 }
 
@@ -110,12 +194,18 @@ void IptablesRestoreController::Init() {
     // use by the other child process. see https://android-review.googlesource.com/469559 for what
     // breaks. This does not cause a latency hit, because the parent only has to wait for
     // forkAndExec, which is sub-millisecond, and the child processes then call exec() in parallel.
-    mIpRestore.reset(forkAndExec(IPTABLES_PROCESS));
-    mIp6Restore.reset(forkAndExec(IP6TABLES_PROCESS));
+    process(IPTABLES_PROCESS, PRIMARY_SHARD).reset(forkAndExec(IPTABLES_PROCESS));
+    process(IP6TABLES_PROCESS, PRIMARY_SHARD).reset(forkAndExec(IP6TABLES_PROCESS));
 }
 
 /* static */
 IptablesProcess* IptablesRestoreController::forkAndExec(const IptablesProcessType type) {
+    // Now that each process has its own lock, IPv4 and IPv6 callers can get here at the same time.
+    // Serialize the forks for the same reason as in Init().
+    static std::mutex sForkLock;
+    std::lock_guard lock(sForkLock);
+    sProcessStarts.inc();
+
     const char* const cmd = (type == IPTABLES_PROCESS) ?
         IPTABLES_RESTORE_PATH : IP6TABLES_RESTORE_PATH;
 
@@ -183,15 +273,45 @@ IptablesProcess* IptablesRestoreController::forkAndExec(const IptablesProcessTyp
             child_pid.value(), stdin_pipe[1], stdout_pipe[0], stderr_pipe[0]);
 }
 
+std::mutex& IptablesRestoreController::processLock(const IptablesProcessType type,
+                                                   const Shard shard) {
+    return mProcessLocks[type][shard];
+}
+
+std::unique_ptr<IptablesProcess>& IptablesRestoreController::process(
+        const IptablesProcessType type, const Shard shard) {
+    return mProcesses[type][shard];
+}
+
+std::unique_ptr<IptablesProcess>& IptablesRestoreController::spareProcess(
+        const IptablesProcessType type, const Shard shard) {
+    return mSpares[type][shard];
+}
+
+IptablesRestoreController::Shard IptablesRestoreController::shardOf(
+        const std::string& command) const {
+    if (!mSharded) return PRIMARY_SHARD;
+
+    bool hasTable = false;
+    for (size_t lineStart = 0; lineStart < command.size();) {
+        size_t lineEnd = command.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = command.size();
+        if (command[lineStart] == '*') {
+            const std::string_view table(command.data() + lineStart + 1, lineEnd - lineStart - 1);
+            if (table != "nat" && table != "mangle" && table != "raw") return PRIMARY_SHARD;
+            hasTable = true;
+        }
+        lineStart = lineEnd + 1;
+    }
+    return hasTable ? SECONDARY_SHARD : PRIMARY_SHARD;
+}
+
 // TODO: Return -errno on failure instead of -1.
 // TODO: Maybe we should keep a rotating buffer of the last N commands
 // so that they can be dumped on dumpsys.
-int IptablesRestoreController::sendCommand(const IptablesProcessType type,
-                                           const std::string& command,
-                                           std::string *output) {
-   std::unique_ptr<IptablesProcess> *process =
-           (type == IPTABLES_PROCESS) ? &mIpRestore : &mIp6Restore;
-
+bool IptablesRestoreController::writeCommand(const IptablesProcessType type, const Shard shard,
+                                             const std::string& command) {
+    std::unique_ptr<IptablesProcess>& process = this->process(type, shard);
 
     // We might need to fork a new process if we haven't forked one yet, or
     // if the forked process terminated.
@@ -200,42 +320,150 @@ int IptablesRestoreController::sendCommand(const IptablesProcessType type,
     // recover from a child death. If the child dies at some later point during
     // the execution of this method, we will receive an EPIPE and return an
     // error. The command will then need to be retried at a higher level.
-    IptablesProcess *existingProcess = process->get();
-    if (existingProcess != nullptr && !existingProcess->outputReady()) {
+    IptablesProcess *existingProcess = process.get();
+    if (existingProcess != nullptr &&
+        (existingProcess->processTerminated || !existingProcess->outputReady())) {
         existingProcess->stop();
         existingProcess = nullptr;
     }
 
     if (existingProcess == nullptr) {
-        // Fork a new iptables[6]-restore process.
-        IptablesProcess *newProcess = IptablesRestoreController::forkAndExec(type);
-        if (newProcess == nullptr) {
-            LOG(ERROR) << "Unable to fork ip[6]tables-restore, type: " << type;
-            return -1;
-        }
+        // Use the warm spare if there is one, so that the command doesn't have to wait for a
+        // freshly forked process to start up.
+        std::unique_ptr<IptablesProcess>& spare = spareProcess(type, shard);
+        if (spare != nullptr && !spare->processTerminated && spare->outputReady()) {
+            process = std::move(spare);
+        } else {
+            if (spare != nullptr) spare->stop();
+            spare.reset();
+
+            // Fork a new iptables[6]-restore process.
+            IptablesProcess *newProcess = IptablesRestoreController::forkAndExec(type);
+            if (newProcess == nullptr) {
+                LOG(ERROR) << "Unable to fork ip[6]tables-restore, type: " << type;
+                return false;
+            }
 
-        process->reset(newProcess);
+            process.reset(newProcess);
+        }
     }
 
-    if (!android::base::WriteFully((*process)->stdIn, command.data(), command.length())) {
+    if (!android::base::WriteFully(process->stdIn, command.data(), command.length())) {
         ALOGE("Unable to send command: %s", strerror(errno));
-        return -1;
+        maybeStartSpare(type, shard);
+        return false;
     }
 
-    if (!android::base::WriteFully((*process)->stdIn, PING, PING_SIZE)) {
+    if (!android::base::WriteFully(process->stdIn, PING, PING_SIZE)) {
         ALOGE("Unable to send ping command: %s", strerror(errno));
-        return -1;
+        maybeStartSpare(type, shard);
+        return false;
+    }
+
+    return true;
+}
+
+void IptablesRestoreController::maybeStartSpare(const IptablesProcessType type,
+                                                const Shard shard) {
+    std::unique_ptr<IptablesProcess>& spare = spareProcess(type, shard);
+    if (spare != nullptr && !spare->processTerminated) return;
+
+    // forkAndExec itself takes well under a millisecond. The expensive part is the child's exec()
+    // and iptables initialization, which proceeds in parallel with the caller, so by the time the
+    // next command arrives the spare is ready to accept it.
+    spare.reset(forkAndExec(type));
+    if (spare == nullptr) {
+        ALOGW("Unable to start spare ip[6]tables-restore process, type: %d", type);
+    }
+}
+
+int IptablesRestoreController::sendCommandLocked(const std::vector<IptablesProcessType>& types,
+                                                 const Shard shard,
+                                                 const std::string& command,
+                                                 std::string *output,
+                                                 const OutputLineCallback* callback) {
+    RpcStats::ScopedOp op(RpcStats::Op::IPTABLES_RESTORE);
+    const auto lines = std::count(command.begin(), command.end(), '\n');
+    ScopedTrace trace("iptables-restore processes=%zu shard=%d lines=%td", types.size(), shard,
+                      lines);
+    FlightRecorder::Scope record(FlightRecorder::Event::IPTABLES_RESTORE, lines, shard);
+    const auto start = std::chrono::steady_clock::now();
+
+    // Write the command to every process before waiting for any of them, so that the child
+    // processes work on it in parallel.
+    int res = 0;
+    std::vector<IptablesProcess*> processes;
+    for (const auto type : types) {
+        if (writeCommand(type, shard, command)) {
+            processes.push_back(process(type, shard).get());
+        } else {
+            res = -1;
+        }
+    }
+
+    std::vector<std::string> outputs(processes.size());
+    std::vector<ResponseReader> readers(processes.size());
+    for (size_t i = 0; i < processes.size(); i++) {
+        if (callback != nullptr) {
+            readers[i].callback = callback;
+        } else {
+            readers[i].output = &outputs[i];
+        }
+    }
+    if (!processes.empty() && !drainAndWaitForAcks(processes, command, &readers)) {
+        // drainAndWaitForAcks has already logged an error.
+        res = -1;
+    }
+
+    // If a process died or was killed because it timed out, get a replacement going now rather
+    // than when the next command arrives.
+    for (const auto type : types) {
+        const std::unique_ptr<IptablesProcess>& p = process(type, shard);
+        if (p == nullptr || p->processTerminated) {
+            maybeStartSpare(type, shard);
+        }
     }
 
-    if (!drainAndWaitForAck(*process, command, output)) {
-        // drainAndWaitForAck has already logged an error.
-        return -1;
+    if (output != nullptr) {
+        for (const auto& processOutput : outputs) {
+            output->append(processOutput);
+        }
     }
 
-    return 0;
+    record.setResult(res);
+    sCommands.inc();
+    if (res) sFailures.inc();
+    sCommandTimeUs.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count());
+    return res;
 }
 
-void IptablesRestoreController::maybeLogStderr(const std::unique_ptr<IptablesProcess> &process,
+int IptablesRestoreController::sendCommand(const IptablesTarget target,
+                                           const std::string& command,
+                                           std::string *output,
+                                           const OutputLineCallback* callback) {
+    if (target == V4V6 && callback != nullptr) {
+        // Lines are delivered as they are read, so talk to one process at a time to avoid
+        // interleaving the IPv4 and IPv6 output.
+        return sendCommand(V4, command, output, callback) |
+               sendCommand(V6, command, output, callback);
+    }
+
+    const Shard shard = shardOf(command);
+    if (target == V4V6) {
+        std::scoped_lock lock(processLock(IPTABLES_PROCESS, shard),
+                              processLock(IP6TABLES_PROCESS, shard));
+        return sendCommandLocked({IPTABLES_PROCESS, IP6TABLES_PROCESS}, shard, command, output,
+                                 callback);
+    }
+
+    const IptablesProcessType type = (target == V4) ? IPTABLES_PROCESS : IP6TABLES_PROCESS;
+    std::lock_guard lock(processLock(type, shard));
+    return sendCommandLocked({type}, shard, command, output, callback);
+}
+
+void IptablesRestoreController::maybeLogStderr(IptablesProcess* process,
                                                const std::string& command) {
     if (process->errBuf.empty()) {
         return;
@@ -251,14 +479,33 @@ void IptablesRestoreController::maybeLogStderr(const std::unique_ptr<IptablesPro
 }
 
 /* static */
-bool IptablesRestoreController::drainAndWaitForAck(const std::unique_ptr<IptablesProcess> &process,
-                                                   const std::string& command,
-                                                   std::string *output) {
-    bool receivedAck = false;
+bool IptablesRestoreController::drainAndWaitForAcks(const std::vector<IptablesProcess*>& processes,
+                                                    const std::string& command,
+                                                    std::vector<ResponseReader>* readers) {
+    const size_t numProcesses = processes.size();
+    std::vector<bool> receivedAck(numProcesses, false);
+
+    // Returns true if we are still waiting for the process at index p to respond.
+    auto waitingFor = [&](size_t p) {
+        return !receivedAck[p] && !processes[p]->processTerminated;
+    };
+
+    std::vector<struct pollfd> pollFds;
+    std::vector<size_t> pollOwners;
     int timeout = 0;
-    while (!receivedAck && (timeout++ < MAX_RETRIES)) {
-        int numEvents = TEMP_FAILURE_RETRY(
-            poll(process->pollFds, ARRAY_SIZE(process->pollFds), POLL_TIMEOUT_MS));
+    while (timeout++ < MAX_RETRIES) {
+        pollFds.clear();
+        pollOwners.clear();
+        for (size_t p = 0; p < numProcesses; p++) {
+            if (!waitingFor(p)) continue;
+            for (const auto& pollFd : processes[p]->pollFds) {
+                pollFds.push_back(pollFd);
+                pollOwners.push_back(p);
+            }
+        }
+        if (pollFds.empty()) break;
+
+        int numEvents = TEMP_FAILURE_RETRY(poll(pollFds.data(), pollFds.size(), POLL_TIMEOUT_MS));
         if (numEvents == -1) {
             ALOGE("Poll failed: %s", strerror(errno));
             return false;
@@ -272,8 +519,14 @@ bool IptablesRestoreController::drainAndWaitForAck(const std::unique_ptr<Iptable
         }
 
         char buffer[PIPE_BUF];
-        for (size_t i = 0; i < ARRAY_SIZE(process->pollFds); ++i) {
-            const struct pollfd &pollfd = process->pollFds[i];
+        for (size_t i = 0; i < pollFds.size(); ++i) {
+            const size_t p = pollOwners[i];
+            IptablesProcess* const process = processes[p];
+            ResponseReader* const reader = &(*readers)[p];
+            if (process->processTerminated) continue;
+
+            const struct pollfd &pollfd = pollFds[i];
+            const bool isStdout = (pollfd.fd == process->pollFds[IptablesProcess::STDOUT_IDX].fd);
             if (pollfd.revents & POLLIN) {
                 ssize_t size;
                 do {
@@ -286,22 +539,13 @@ bool IptablesRestoreController::drainAndWaitForAck(const std::unique_ptr<Iptable
                         break;
                     }
 
-                    if (i == IptablesProcess::STDOUT_IDX) {
-                        // i == STDOUT_IDX: accumulate stdout into *output, and look
-                        // for the ping response.
-                        output->append(buffer, size);
-                        size_t pos = output->find(PING);
-                        if (pos != std::string::npos) {
-                            if (output->size() > pos + PING_SIZE) {
-                                size_t extra = output->size() - (pos + PING_SIZE);
-                                ALOGW("%zd extra characters after iptables response: '%s...'",
-                                      extra, output->substr(pos + PING_SIZE, 128).c_str());
-                            }
-                            output->resize(pos);
-                            receivedAck = true;
+                    if (isStdout) {
+                        // Hand stdout to the reader, which looks for the ping response.
+                        if (reader->append(buffer, size)) {
+                            receivedAck[p] = true;
                         }
                     } else {
-                        // i == STDERR_IDX: accumulate stderr into errBuf.
+                        // Accumulate stderr into errBuf.
                         process->errBuf.append(buffer, size);
                     }
                 } while (size > 0);
@@ -310,26 +554,51 @@ bool IptablesRestoreController::drainAndWaitForAck(const std::unique_ptr<Iptable
                 // The pipe was closed. This likely means the subprocess is exiting, since
                 // iptables-restore only closes stdin on error.
                 process->stop();
-                break;
             }
         }
     }
 
-    if (!receivedAck && !process->processTerminated) {
-        ALOGE("Timed out waiting for response from iptables process %d", process->pid);
-        // Kill the process so that if it eventually recovers, we don't misinterpret the ping
-        // response (or any output) of the command we just sent as coming from future commands.
-        process->stop();
+    bool allAcked = true;
+    for (size_t p = 0; p < numProcesses; p++) {
+        IptablesProcess* const process = processes[p];
+        if (!receivedAck[p]) {
+            allAcked = false;
+            if (!process->processTerminated) {
+                ALOGE("Timed out waiting for response from iptables process %d", process->pid);
+                // Kill the process so that if it eventually recovers, we don't misinterpret the
+                // ping response (or any output) of the command we just sent as coming from future
+                // commands.
+                process->stop();
+            }
+        }
+        maybeLogStderr(process, command);
     }
 
-    maybeLogStderr(process, command);
-
-    return receivedAck;
+    return allAcked;
 }
 
 int IptablesRestoreController::execute(const IptablesTarget target, const std::string& command,
                                        std::string *output) {
-    std::lock_guard lock(mLock);
+    std::unique_lock<std::mutex> batchLock;
+    if (Batch* batch = Batch::current(this)) {
+        batchLock = std::unique_lock(batch->mLock);
+        if (output == nullptr) {
+            PendingBatch v4 = batch->mPendingIpRestore;
+            PendingBatch v6 = batch->mPendingIp6Restore;
+            bool queued = true;
+            if (target == V4 || target == V4V6) queued &= appendToBatch(command, &v4);
+            if (target == V6 || target == V4V6) queued &= appendToBatch(command, &v6);
+            if (queued) {
+                batch->mPendingIpRestore = std::move(v4);
+                batch->mPendingIp6Restore = std::move(v6);
+                return 0;
+            }
+        }
+        // This command can't be queued. Send everything queued so far first, so that it sees
+        // the effects of the commands that were issued before it. Keep holding the batch lock
+        // until the command has been sent so that nothing is queued ahead of it.
+        batch->mResult |= flushAllBatchesLocked(batch);
+    }
 
     std::string buffer;
     if (output == nullptr) {
@@ -338,16 +607,145 @@ int IptablesRestoreController::execute(const IptablesTarget target, const std::s
         output->clear();
     }
 
-    int res = 0;
-    if (target == V4 || target == V4V6) {
-        res |= sendCommand(IPTABLES_PROCESS, command, output);
+    return sendCommand(target, command, output, nullptr);
+}
+
+int IptablesRestoreController::execute(const IptablesTarget target, const std::string& command,
+                                       const OutputLineCallback& callback) {
+    std::unique_lock<std::mutex> batchLock;
+    if (Batch* batch = Batch::current(this)) {
+        batchLock = std::unique_lock(batch->mLock);
+        batch->mResult |= flushAllBatchesLocked(batch);
+    }
+
+    return sendCommand(target, command, nullptr, &callback);
+}
+
+thread_local IptablesRestoreController::Batch* IptablesRestoreController::Batch::sCurrent =
+        nullptr;
+
+IptablesRestoreController::Batch::Batch(IptablesRestoreController* controller)
+    : mController(controller), mPrevious(sCurrent), mJoined(current(controller) != nullptr) {
+    if (!mJoined) sCurrent = this;
+}
+
+IptablesRestoreController::Batch::~Batch() {
+    if (!mCommitted) commit();
+}
+
+int IptablesRestoreController::Batch::commit() {
+    mCommitted = true;
+    if (mJoined) return 0;
+    sCurrent = mPrevious;
+    std::lock_guard lock(mLock);
+    return mResult | mController->flushAllBatchesLocked(this);
+}
+
+/* static */
+IptablesRestoreController::Batch* IptablesRestoreController::Batch::current(
+        const IptablesRestoreController* controller) {
+    return (sCurrent && sCurrent->mController == controller) ? sCurrent : nullptr;
+}
+
+/* static */
+bool IptablesRestoreController::appendToBatch(const std::string& command, PendingBatch* batch) {
+    std::vector<std::pair<std::string, std::string>> blocks;
+    bool inTable = false;
+    for (const auto& line : Split(command, "\n")) {
+        if (line.empty() || line[0] == '#') continue;
+        if (line[0] == '*') {
+            if (inTable) return false;
+            blocks.push_back({line.substr(1), ""});
+            inTable = true;
+        } else if (line == "COMMIT") {
+            if (!inTable) return false;
+            inTable = false;
+        } else {
+            // Anything outside a table block (e.g., a listing command with no table) cannot be
+            // merged with other commands.
+            if (!inTable) return false;
+            blocks.back().second.append(line).append("\n");
+        }
+    }
+    if (inTable || blocks.empty()) return false;
+
+    for (const auto& [table, rules] : blocks) {
+        auto it = batch->rules.find(table);
+        if (it == batch->rules.end()) {
+            batch->tables.push_back(table);
+            batch->rules[table] = {rules};
+        } else {
+            it->second.push_back(rules);
+        }
+    }
+    batch->commands.push_back(command);
+    return true;
+}
+
+static std::string tableBlock(const std::string& table, const std::string& rules) {
+    return "*" + table + "\n" + rules + "COMMIT\n";
+}
+
+std::string IptablesRestoreController::PendingBatch::coalesce(const std::string& table) const {
+    std::string coalesced;
+    for (const auto& commandRules : rules.at(table)) {
+        coalesced.append(commandRules);
     }
-    if (target == V6 || target == V4V6) {
-        res |= sendCommand(IP6TABLES_PROCESS, command, output);
+    return tableBlock(table, coalesced);
+}
+
+int IptablesRestoreController::flushBatchLocked(Batch* batch, const IptablesProcessType type) {
+    PendingBatch* pending =
+            (type == IPTABLES_PROCESS) ? &batch->mPendingIpRestore : &batch->mPendingIp6Restore;
+    if (pending->empty()) return 0;
+
+    PendingBatch queued = std::move(*pending);
+    *pending = PendingBatch();
+
+    const IptablesTarget target = (type == IPTABLES_PROCESS) ? V4 : V6;
+    std::string output;
+    if (queued.commands.size() == 1) {
+        return sendCommand(target, queued.commands.front(), &output, nullptr);
+    }
+
+    // Each table is sent as its own input. iptables-restore commits the tables of one input as it
+    // reads them, so if a multi-table input failed there would be no telling which of its tables
+    // had already been committed and must not be replayed.
+    int res = 0;
+    for (const auto& table : queued.tables) {
+        output.clear();
+        const int ret = sendCommand(target, queued.coalesce(table), &output, nullptr);
+        if (ret == 0) continue;
+
+        const auto& tableRules = queued.rules.at(table);
+        if (tableRules.size() == 1) {
+            res |= ret;
+            continue;
+        }
+        ALOGW("Coalesced iptables-restore of %zu commands on table %s failed, retrying "
+              "individually",
+              tableRules.size(), table.c_str());
+        for (const auto& commandRules : tableRules) {
+            output.clear();
+            res |= sendCommand(target, tableBlock(table, commandRules), &output, nullptr);
+        }
     }
     return res;
 }
 
-int IptablesRestoreController::getIpRestorePid(const IptablesProcessType type) {
-    return type == IPTABLES_PROCESS ? mIpRestore->pid : mIp6Restore->pid;
+int IptablesRestoreController::flushAllBatchesLocked(Batch* batch) {
+    return flushBatchLocked(batch, IPTABLES_PROCESS) | flushBatchLocked(batch, IP6TABLES_PROCESS);
+}
+
+pid_t IptablesRestoreController::getIpRestorePid(const IptablesProcessType type,
+                                                 const Shard shard) {
+    std::lock_guard lock(processLock(type, shard));
+    const std::unique_ptr<IptablesProcess>& p = process(type, shard);
+    return (p != nullptr) ? p->pid : 0;
+}
+
+pid_t IptablesRestoreController::getSpareIpRestorePid(const IptablesProcessType type) {
+    std::lock_guard lock(processLock(type, PRIMARY_SHARD));
+    const std::unique_ptr<IptablesProcess>& spare = spareProcess(type, PRIMARY_SHARD);
+    return (spare != nullptr) ? spare->pid : 0;
 }
@@ -17,8 +17,13 @@
 #ifndef NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
 #define NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 #include <sys/types.h>
 
 #include "NetdConstants.h"
@@ -45,19 +50,130 @@ class IptablesRestoreController final : public IptablesRestoreInterface {
     int execute(const IptablesTarget target, const std::string& commands,
                 std::string* output) override;
 
+    // Called with each line of output, without the trailing newline, as soon as it is read.
+    using OutputLineCallback = std::function<void(std::string_view line)>;
+
+    // Like execute(), but streams stdout to |callback| line by line instead of accumulating it,
+    // so that large listings can be parsed without holding them in memory. For V4V6, all IPv4
+    // lines are delivered before any IPv6 line. |callback| is called with internal locks held
+    // and must not call back into this class.
+    int execute(const IptablesTarget target, const std::string& commands,
+                const OutputLineCallback& callback);
+
+  private:
+    // Commands queued for one iptables[6]-restore process while a batch is open.
+    struct PendingBatch {
+        // Tables in order of first appearance, and the rule lines that each queued command adds
+        // to them, used to replay that table's commands individually if its block fails.
+        std::vector<std::string> tables;
+        std::map<std::string, std::vector<std::string>> rules;
+        // The original commands. A batch of a single command is sent unchanged.
+        std::vector<std::string> commands;
+
+        bool empty() const { return commands.empty(); }
+        // Returns one *table ... COMMIT block holding every rule queued for |table|.
+        std::string coalesce(const std::string& table) const;
+    };
+
+  public:
+    // Coalesces the commands executed on the thread that created it. Until commit(), every
+    // execute() call made on that thread that does not request output is queued instead of being
+    // sent, and returns 0. Commands that request output, or that cannot be split into
+    // "*table ... COMMIT" blocks, flush the queue first so that ordering is preserved. Commands
+    // executed on other threads are sent as usual, unless the thread joins the batch with a
+    // Batch::Scope.
+    //
+    // A batch created while another batch of the same controller is current on the thread joins
+    // it: its commands are only sent when the outer batch is committed. A batch that goes out of
+    // scope without commit() is committed then.
+    class Batch {
+      public:
+        explicit Batch(IptablesRestoreController* controller);
+        ~Batch();
+
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        // Sends all queued commands to each iptables[6]-restore process as a single input
+        // containing one COMMIT block per table, and waits for a single ack per process. If the
+        // coalesced input fails, the queued commands are replayed one by one so that a single bad
+        // command does not cause the others to be lost. Returns 0 if all queued commands
+        // succeeded, -1 otherwise. A joined batch sends nothing, and returns 0. Must be called on
+        // the thread that created the batch.
+        int commit();
+
+        // Makes |batch| current on the calling thread while in scope, so that threads started by
+        // the owner of a batch can add their commands to it. |batch| must not be committed while
+        // a Scope for it exists.
+        class Scope {
+          public:
+            explicit Scope(Batch* batch) : mPrevious(sCurrent) { sCurrent = batch; }
+            ~Scope() { sCurrent = mPrevious; }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+          private:
+            Batch* const mPrevious;
+        };
+
+      private:
+        friend class IptablesRestoreController;
+
+        // The batch of |controller| that is current on this thread, if any.
+        static Batch* current(const IptablesRestoreController* controller);
+
+        static thread_local Batch* sCurrent;
+
+        IptablesRestoreController* const mController;
+        Batch* const mPrevious;
+        const bool mJoined;
+        bool mCommitted = false;
+
+        // Guards the state below. Held for the whole of execute() by the threads using the batch,
+        // so that commands are sent in the order they were issued. Always acquired before the
+        // process locks.
+        std::mutex mLock;
+        int mResult = 0;
+        PendingBatch mPendingIpRestore;
+        PendingBatch mPendingIp6Restore;
+    };
+
     enum IptablesProcessType {
         IPTABLES_PROCESS,
         IP6TABLES_PROCESS,
         INVALID_PROCESS = -1,
     };
 
+    // Each process type has one process per shard. Unless sharding is enabled with
+    // persist.netd.iptables_restore_sharding, only PRIMARY_SHARD is used. Otherwise, commands
+    // that only touch the nat, mangle and raw tables go to SECONDARY_SHARD, so that they are not
+    // held up by a slow filter table update. Commands touching tables of both shards go to
+    // PRIMARY_SHARD. iptables-restore holds the xtables lock while it commits each table, so two
+    // processes updating the same table do not lose each other's changes.
+    enum Shard {
+        PRIMARY_SHARD,
+        SECONDARY_SHARD,
+        NUM_SHARDS,
+    };
+
     // Called by the SIGCHLD signal handler when it detects that one
     // of the forked iptables[6]-restore process has died.
     IptablesProcessType notifyChildTermination(pid_t pid);
 
 protected:
     friend class IptablesRestoreControllerTest;
-    pid_t getIpRestorePid(const IptablesProcessType type);
+    friend class IptablesRestoreBenchmark;
+    // Returns 0 if there is no process.
+    pid_t getIpRestorePid(const IptablesProcessType type, const Shard shard = PRIMARY_SHARD);
+    // Returns 0 if there is no spare process.
+    pid_t getSpareIpRestorePid(const IptablesProcessType type);
+
+    // Returns the shard that serves |command|.
+    Shard shardOf(const std::string& command) const;
+
+    // Read from persist.netd.iptables_restore_sharding on construction. Only changed by tests.
+    bool mSharded;
 
     // The maximum number of times we poll(2) for a response on our set of polled
     // fds. Chosen so that the overall timeout is 5s. The timeout is so high because
@@ -73,21 +189,60 @@ protected:
 private:
     static IptablesProcess* forkAndExec(const IptablesProcessType type);
 
-    int sendCommand(const IptablesProcessType type, const std::string& command,
-                    std::string *output);
+    std::mutex& processLock(const IptablesProcessType type, const Shard shard);
+    std::unique_ptr<IptablesProcess>& process(const IptablesProcessType type, const Shard shard);
+    std::unique_ptr<IptablesProcess>& spareProcess(const IptablesProcessType type,
+                                                   const Shard shard);
+
+    // Forks a spare process for |type| and |shard| if there is none. Called after a process has
+    // died or been killed, so that the next command can start immediately. Must be called with
+    // processLock(type, shard) held.
+    void maybeStartSpare(const IptablesProcessType type, const Shard shard);
+
+    // Forks the process for |type| and |shard| if necessary, and writes |command| followed by a
+    // ping to it. Must be called with processLock(type, shard) held.
+    bool writeCommand(const IptablesProcessType type, const Shard shard,
+                      const std::string& command);
+
+    // Sends |command| to the |shard| process of every type in |types| and then waits for all of
+    // them to respond. Must be called with the processLock() of every such process held.
+    // Output is appended to |output| if |callback| is null, and streamed to |callback| otherwise.
+    int sendCommandLocked(const std::vector<IptablesProcessType>& types, const Shard shard,
+                          const std::string& command, std::string* output,
+                          const OutputLineCallback* callback);
+
+    // Takes the locks for the process(es) that serve |target| and sends |command| to them.
+    int sendCommand(const IptablesTarget target, const std::string& command,
+                    std::string *output, const OutputLineCallback* callback);
+
+    struct ResponseReader;
+
+    // Waits until every process in |processes| has acked |command|, passing the stdout of
+    // processes[i] to (*readers)[i]. Polls all processes in a single loop.
+    static bool drainAndWaitForAcks(const std::vector<IptablesProcess*>& processes,
+                                    const std::string& command,
+                                    std::vector<ResponseReader>* readers);
+
+    static void maybeLogStderr(IptablesProcess* process, const std::string& command);
+
+    // Splits |command| into per-table rule lines and appends them to |batch|. Returns false, and
+    // leaves |batch| unchanged, if the command is not a sequence of "*table ... COMMIT" blocks.
+    static bool appendToBatch(const std::string& command, PendingBatch* batch);
 
-    static bool drainAndWaitForAck(const std::unique_ptr<IptablesProcess> &process,
-                                   const std::string& command,
-                                   std::string *output);
+    // Sends the commands queued in |batch| for |type|. Must be called with batch->mLock held.
+    int flushBatchLocked(Batch* batch, const IptablesProcessType type);
+    int flushAllBatchesLocked(Batch* batch);
 
-    static void maybeLogStderr(const std::unique_ptr<IptablesProcess> &process,
-                               const std::string& command);
+    // Guard access to each iptables[6]-restore process and its spare, indexed by process type
+    // and shard. V4V6 commands take the locks of both types.
+    std::mutex mProcessLocks[2][NUM_SHARDS];
 
-    // Guards calls to execute().
-    std::mutex mLock;
+    // Secondary shard processes are only forked when they are first needed.
+    std::unique_ptr<IptablesProcess> mProcesses[2][NUM_SHARDS];
 
-    std::unique_ptr<IptablesProcess> mIpRestore;
-    std::unique_ptr<IptablesProcess> mIp6Restore;
+    // Warm standby processes, swapped in when the current process has died. Guarded by the
+    // corresponding process lock.
+    std::unique_ptr<IptablesProcess> mSpares[2][NUM_SHARDS];
 };
 
 #endif  // NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
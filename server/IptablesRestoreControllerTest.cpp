@@ -27,6 +27,7 @@
 #include <cinttypes>
 #include <iostream>
 #include <string>
+#include <thread>
 
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -79,8 +80,20 @@ public:
     con.Init();
   }
 
-  pid_t getIpRestorePid(const IptablesRestoreController::IptablesProcessType type) {
-      return con.getIpRestorePid(type);
+  pid_t getIpRestorePid(const IptablesRestoreController::IptablesProcessType type,
+                        const IptablesRestoreController::Shard shard =
+                                IptablesRestoreController::PRIMARY_SHARD) {
+      return con.getIpRestorePid(type, shard);
+  };
+
+  void setSharded(bool sharded) { con.mSharded = sharded; }
+
+  IptablesRestoreController::Shard shardOf(const std::string& command) {
+      return con.shardOf(command);
+  }
+
+  pid_t getSpareIpRestorePid(const IptablesRestoreController::IptablesProcessType type) {
+      return con.getSpareIpRestorePid(type);
   };
 
   const std::string getProcStatPath(pid_t pid) { return StringPrintf("/proc/%d/stat", pid); }
@@ -381,3 +394,249 @@ TEST_F(IptablesRestoreControllerTest, TestMemoryLeak) {
     EXPECT_GE(25, getRssPages(pid4) - pages4) << "iptables-restore leaked too many pages";
     EXPECT_GE(25, getRssPages(pid6) - pages6) << "ip6tables-restore leaked too many pages";
 }
+
+TEST_F(IptablesRestoreControllerTest, TestBatch) {
+    const std::string rule1 = StringPrintf("-A %s -p udp --sport 1111 -j DROP", mChainName.c_str());
+    const std::string rule2 = StringPrintf("-A %s -p udp --sport 2222 -j DROP", mChainName.c_str());
+    std::vector<std::string> listCommands = {
+        "*filter",
+        StringPrintf("-S %s", mChainName.c_str()),
+        "COMMIT",
+        ""
+    };
+    const std::string listCommand = Join(listCommands, "\n");
+
+    pid_t pid4 = getIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS);
+    pid_t pid6 = getIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS);
+
+    {
+        IptablesRestoreController::Batch batch(&con);
+        EXPECT_EQ(0, con.execute(V4V6, "*filter\n" + rule1 + "\nCOMMIT\n", nullptr));
+        // Nested batches are only sent when the outermost one is committed.
+        {
+            IptablesRestoreController::Batch nested(&con);
+            EXPECT_EQ(0, con.execute(V4, "*filter\n" + rule2 + "\nCOMMIT\n", nullptr));
+            EXPECT_EQ(0, nested.commit());
+        }
+
+        EXPECT_EQ(0, con.execute(V6, "*filter\n" + rule2 + "\nCOMMIT\n", nullptr));
+        EXPECT_EQ(0, batch.commit());
+    }
+
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+    EXPECT_NE(std::string::npos, output.find(rule1)) << output;
+    EXPECT_NE(std::string::npos, output.find(rule2)) << output;
+    EXPECT_EQ(0, con.execute(V6, listCommand, &output));
+    EXPECT_NE(std::string::npos, output.find(rule1)) << output;
+    EXPECT_NE(std::string::npos, output.find(rule2)) << output;
+
+    // Coalescing must not restart the child processes.
+    EXPECT_EQ(pid4, getIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS));
+    EXPECT_EQ(pid6, getIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestBatchFlushesBeforeOutput) {
+    const std::string rule = StringPrintf("-A %s -p tcp --dport 3333 -j DROP", mChainName.c_str());
+    const std::string listCommand =
+            StringPrintf("*filter\n-S %s\nCOMMIT\n", mChainName.c_str());
+
+    IptablesRestoreController::Batch batch(&con);
+    EXPECT_EQ(0, con.execute(V4, "*filter\n" + rule + "\nCOMMIT\n", nullptr));
+
+    // A command that wants output sees the effects of the commands queued before it.
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+    EXPECT_NE(std::string::npos, output.find(rule)) << output;
+    EXPECT_EQ(0, batch.commit());
+}
+
+TEST_F(IptablesRestoreControllerTest, TestBatchFailureReplaysCommands) {
+    const std::string rule = StringPrintf("-A %s -p udp --sport 4444 -j DROP", mChainName.c_str());
+    const std::string listCommand =
+            StringPrintf("*filter\n-S %s\nCOMMIT\n", mChainName.c_str());
+
+    IptablesRestoreController::Batch batch(&con);
+    EXPECT_EQ(0, con.execute(V4V6, "*filter\n" + rule + "\nCOMMIT\n", nullptr));
+    EXPECT_EQ(0, con.execute(V4V6, "*filter\n-A nonexistent_chain -j DROP\nCOMMIT\n", nullptr));
+    EXPECT_EQ(-1, batch.commit());
+
+    // The valid command was still applied.
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4V6, listCommand, &output));
+    EXPECT_NE(std::string::npos, output.find(rule)) << output;
+}
+
+TEST_F(IptablesRestoreControllerTest, TestBatchFailureDoesNotReplayCommittedTables) {
+    const std::string rule = StringPrintf("-A %s -p udp --sport 5555 -j DROP", mChainName.c_str());
+    const std::string listCommand =
+            StringPrintf("*filter\n-S %s\nCOMMIT\n", mChainName.c_str());
+
+    IptablesRestoreController::Batch batch(&con);
+    EXPECT_EQ(0, con.execute(V4, "*filter\n" + rule + "\nCOMMIT\n", nullptr));
+    EXPECT_EQ(0, con.execute(V4, "*mangle\n-A nonexistent_chain -j DROP\nCOMMIT\n", nullptr));
+    EXPECT_EQ(0, con.execute(V4, "*mangle\n-A nonexistent_chain2 -j DROP\nCOMMIT\n", nullptr));
+    EXPECT_EQ(-1, batch.commit());
+
+    // The filter table was committed once, and was not replayed when the mangle table failed.
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+    const size_t first = output.find(rule);
+    EXPECT_NE(std::string::npos, first) << output;
+    EXPECT_EQ(std::string::npos, output.find(rule, first + rule.size())) << output;
+}
+
+TEST_F(IptablesRestoreControllerTest, TestBatchIsPerThread) {
+    const std::string queuedRule =
+            StringPrintf("-A %s -p udp --sport 5555 -j DROP", mChainName.c_str());
+    const std::string joinedRule =
+            StringPrintf("-A %s -p udp --sport 6666 -j DROP", mChainName.c_str());
+    const std::string otherRule =
+            StringPrintf("-A %s -p udp --sport 7777 -j DROP", mChainName.c_str());
+    const std::string listCommand =
+            StringPrintf("*filter\n-S %s\nCOMMIT\n", mChainName.c_str());
+
+    IptablesRestoreController::Batch batch(&con);
+    EXPECT_EQ(0, con.execute(V4, "*filter\n" + queuedRule + "\nCOMMIT\n", nullptr));
+
+    std::thread([&] {
+        // Other threads are not affected by the batch: their commands are sent, and their errors
+        // are reported, immediately.
+        EXPECT_NE(0, con.execute(V4, "*filter\n-A nonexistent_chain -j DROP\nCOMMIT\n",
+                                 nullptr));
+        EXPECT_EQ(0, con.execute(V4, "*filter\n" + otherRule + "\nCOMMIT\n", nullptr));
+        std::string output;
+        EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+        EXPECT_NE(std::string::npos, output.find(otherRule)) << output;
+        EXPECT_EQ(std::string::npos, output.find(queuedRule)) << output;
+    }).join();
+
+    std::thread([&] {
+        IptablesRestoreController::Batch::Scope scope(&batch);
+        EXPECT_EQ(0, con.execute(V4, "*filter\n" + joinedRule + "\nCOMMIT\n", nullptr));
+    }).join();
+
+    EXPECT_EQ(0, batch.commit());
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+    EXPECT_NE(std::string::npos, output.find(queuedRule)) << output;
+    EXPECT_NE(std::string::npos, output.find(joinedRule)) << output;
+}
+
+TEST_F(IptablesRestoreControllerTest, TestConcurrentCallers) {
+    constexpr int NUM_ITERATIONS = 50;
+    pid_t pid4 = getIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS);
+    pid_t pid6 = getIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS);
+
+    // V4, V6 and V4V6 callers on different threads each take only the locks they need, and must
+    // never see each other's output.
+    auto run = [this](IptablesTarget target, const std::string& expected) {
+        std::string output;
+        for (int i = 0; i < NUM_ITERATIONS; i++) {
+            EXPECT_EQ(0, con.execute(target, "#Test\n", &output));
+            EXPECT_EQ(expected, output);
+        }
+    };
+    std::thread v4(run, V4, "#Test\n");
+    std::thread v6(run, V6, "#Test\n");
+    std::thread v4v6(run, V4V6, "#Test\n#Test\n");
+    v4.join();
+    v6.join();
+    v4v6.join();
+
+    EXPECT_EQ(pid4, getIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS));
+    EXPECT_EQ(pid6, getIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestOutputLineCallback) {
+    std::vector<std::string> listCommands = {
+        "*filter",
+        StringPrintf("-S %s", mChainName.c_str()),
+        "COMMIT",
+        ""
+    };
+    const std::string listCommand = Join(listCommands, "\n");
+
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4V6, listCommand, &output));
+
+    // The callback sees the same lines as the buffered output, in the same order.
+    std::vector<std::string> lines;
+    EXPECT_EQ(0, con.execute(V4V6, listCommand,
+                             [&lines](std::string_view line) { lines.emplace_back(line); }));
+    EXPECT_EQ(output, Join(lines, "\n") + "\n");
+    EXPECT_EQ(std::string::npos, output.find("#PING"));
+
+    // Large outputs that span many reads are handled too.
+    std::string cmd = "*filter\n";
+    for (int i = 0; i < 500; i++) {
+        StringAppendF(&cmd, "-A %s -p udp --sport %d -j DROP\n", mChainName.c_str(), 1000 + i);
+    }
+    StringAppendF(&cmd, "COMMIT\n");
+    ASSERT_EQ(0, con.execute(V4, cmd, nullptr));
+
+    EXPECT_EQ(0, con.execute(V4, listCommand, &output));
+    lines.clear();
+    EXPECT_EQ(0, con.execute(V4, listCommand,
+                             [&lines](std::string_view line) { lines.emplace_back(line); }));
+    EXPECT_EQ(output, Join(lines, "\n") + "\n");
+    EXPECT_LT(500U, lines.size());
+}
+
+TEST_F(IptablesRestoreControllerTest, TestSpareProcessAfterFailure) {
+    EXPECT_EQ(0, con.execute(V4V6, "#Test\n", nullptr));
+    EXPECT_EQ(0, getSpareIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS));
+    EXPECT_EQ(0, getSpareIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS));
+
+    // A malformed command makes the processes exit. Replacements are started straight away.
+    EXPECT_EQ(-1, con.execute(V4V6, "malformed command\n", nullptr));
+    pid_t spare4 = getSpareIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS);
+    pid_t spare6 = getSpareIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS);
+    EXPECT_NE(0, spare4);
+    EXPECT_NE(0, spare6);
+
+    // The next command uses the spares instead of forking again.
+    EXPECT_EQ(0, con.execute(V4V6, "#Test\n", nullptr));
+    EXPECT_EQ(spare4, getIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS));
+    EXPECT_EQ(spare6, getIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS));
+    EXPECT_EQ(0, getSpareIpRestorePid(IptablesRestoreController::IPTABLES_PROCESS));
+    EXPECT_EQ(0, getSpareIpRestorePid(IptablesRestoreController::IP6TABLES_PROCESS));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestShardOf) {
+    using Shard = IptablesRestoreController::Shard;
+    const std::string nat = "*nat\n-S\nCOMMIT\n";
+    const std::string natAndRaw = "*nat\n-S\nCOMMIT\n*raw\n-S\nCOMMIT\n";
+    const std::string natAndFilter = "*nat\n-S\nCOMMIT\n*filter\n-S\nCOMMIT\n";
+
+    EXPECT_EQ(Shard::PRIMARY_SHARD, shardOf(nat));
+
+    setSharded(true);
+    EXPECT_EQ(Shard::SECONDARY_SHARD, shardOf(nat));
+    EXPECT_EQ(Shard::SECONDARY_SHARD, shardOf(natAndRaw));
+    EXPECT_EQ(Shard::PRIMARY_SHARD, shardOf(natAndFilter));
+    EXPECT_EQ(Shard::PRIMARY_SHARD, shardOf("*filter\n-S\nCOMMIT\n"));
+    EXPECT_EQ(Shard::PRIMARY_SHARD, shardOf("#Test\n"));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestShardedCommands) {
+    constexpr auto IPTABLES_PROCESS = IptablesRestoreController::IPTABLES_PROCESS;
+    constexpr auto SECONDARY_SHARD = IptablesRestoreController::SECONDARY_SHARD;
+    setSharded(true);
+
+    const pid_t primary = getIpRestorePid(IPTABLES_PROCESS);
+    EXPECT_EQ(0, getIpRestorePid(IPTABLES_PROCESS, SECONDARY_SHARD));
+
+    // The secondary process is forked for the first command that only touches its tables.
+    std::string output;
+    EXPECT_EQ(0, con.execute(V4, "*mangle\n-S PREROUTING\nCOMMIT\n", &output));
+    EXPECT_NE(std::string::npos, output.find("-P PREROUTING"));
+    const pid_t secondary = getIpRestorePid(IPTABLES_PROCESS, SECONDARY_SHARD);
+    EXPECT_NE(0, secondary);
+    EXPECT_NE(primary, secondary);
+
+    EXPECT_EQ(0, con.execute(V4, StringPrintf("*filter\n-S %s\nCOMMIT\n", mChainName.c_str()),
+                             &output));
+    EXPECT_EQ(primary, getIpRestorePid(IPTABLES_PROCESS));
+    EXPECT_EQ(secondary, getIpRestorePid(IPTABLES_PROCESS, SECONDARY_SHARD));
+}
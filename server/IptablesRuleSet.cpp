@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "IptablesRuleSet"
+
+#include "IptablesRuleSet.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <set>
+
+#include <android-base/stringprintf.h>
+#include <log/log.h>
+
+namespace android {
+namespace net {
+
+using android::base::StringAppendF;
+
+auto IptablesRuleCompiler::execIptablesRestore = ::execIptablesRestore;
+
+void IptablesRuleSet::setChain(const std::string& table, const std::string& chain, Rules rules) {
+    mTables[table][chain] = std::move(rules);
+}
+
+void IptablesRuleSet::removeChain(const std::string& table, const std::string& chain) {
+    auto it = mTables.find(table);
+    if (it == mTables.end()) return;
+    it->second.erase(chain);
+    if (it->second.empty()) mTables.erase(it);
+}
+
+void IptablesRuleSet::appendRule(const std::string& table, const std::string& chain,
+                                 const std::string& rule) {
+    mTables[table][chain].push_back(rule);
+}
+
+bool IptablesRuleSet::deleteRule(const std::string& table, const std::string& chain,
+                                 const std::string& rule) {
+    auto tableIt = mTables.find(table);
+    if (tableIt == mTables.end()) return false;
+    auto chainIt = tableIt->second.find(chain);
+    if (chainIt == tableIt->second.end()) return false;
+
+    Rules& rules = chainIt->second;
+    auto it = std::find(rules.begin(), rules.end(), rule);
+    if (it == rules.end()) return false;
+    rules.erase(it);
+    return true;
+}
+
+bool IptablesRuleSet::hasRule(const std::string& table, const std::string& chain,
+                              const std::string& rule) const {
+    const Rules* rules = getChain(table, chain);
+    return rules != nullptr && std::find(rules->begin(), rules->end(), rule) != rules->end();
+}
+
+const IptablesRuleSet::Rules* IptablesRuleSet::getChain(const std::string& table,
+                                                        const std::string& chain) const {
+    auto tableIt = mTables.find(table);
+    if (tableIt == mTables.end()) return nullptr;
+    auto chainIt = tableIt->second.find(chain);
+    if (chainIt == tableIt->second.end()) return nullptr;
+    return &chainIt->second;
+}
+
+/* static */
+void IptablesRuleSet::diffChain(const std::string& chain, const Rules& from, const Rules& to,
+                                std::string* out) {
+    // Rules are almost always added or removed at a couple of places only, so strip the common
+    // prefix and suffix before running the quadratic part.
+    size_t prefix = 0;
+    while (prefix < from.size() && prefix < to.size() && from[prefix] == to[prefix]) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < from.size() - prefix && suffix < to.size() - prefix &&
+           from[from.size() - 1 - suffix] == to[to.size() - 1 - suffix]) {
+        suffix++;
+    }
+    const size_t n = from.size() - prefix - suffix;
+    const size_t m = to.size() - prefix - suffix;
+    if (n == 0 && m == 0) return;
+
+    // lcs[i][j] is the length of the longest common subsequence of from[prefix + i...] and
+    // to[prefix + j...], restricted to the middle section.
+    std::vector<std::vector<uint32_t>> lcs(n + 1, std::vector<uint32_t>(m + 1, 0));
+    for (size_t i = n; i-- > 0;) {
+        for (size_t j = m; j-- > 0;) {
+            lcs[i][j] = (from[prefix + i] == to[prefix + j])
+                                ? lcs[i + 1][j + 1] + 1
+                                : std::max(lcs[i + 1][j], lcs[i][j + 1]);
+        }
+    }
+
+    std::vector<bool> keepFrom(n, false);
+    std::vector<bool> keepTo(m, false);
+    for (size_t i = 0, j = 0; i < n && j < m;) {
+        if (from[prefix + i] == to[prefix + j]) {
+            keepFrom[i++] = true;
+            keepTo[j++] = true;
+        } else if (lcs[i + 1][j] >= lcs[i][j + 1]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    // Delete from the end so that the positions of the rules still to be deleted don't move.
+    // After this, the chain contains exactly the common subsequence, in order. Then insert the
+    // new rules in ascending order of their final position. iptables positions are 1-based.
+    for (size_t i = n; i-- > 0;) {
+        if (!keepFrom[i]) StringAppendF(out, "-D %s %zu\n", chain.c_str(), prefix + i + 1);
+    }
+    for (size_t j = 0; j < m; j++) {
+        if (!keepTo[j]) {
+            StringAppendF(out, "-I %s %zu %s\n", chain.c_str(), prefix + j + 1,
+                          to[prefix + j].c_str());
+        }
+    }
+}
+
+/* static */
+std::string IptablesRuleSet::diff(const IptablesRuleSet& from, const IptablesRuleSet& to) {
+    static const std::map<std::string, Rules> kNoChains;
+    std::string out;
+
+    std::set<std::string> tables;
+    for (const auto& [table, chains] : from.mTables) tables.insert(table);
+    for (const auto& [table, chains] : to.mTables) tables.insert(table);
+
+    for (const auto& table : tables) {
+        auto fromIt = from.mTables.find(table);
+        auto toIt = to.mTables.find(table);
+        const auto& fromChains = (fromIt != from.mTables.end()) ? fromIt->second : kNoChains;
+        const auto& toChains = (toIt != to.mTables.end()) ? toIt->second : kNoChains;
+
+        std::string block;
+        // Create new chains first, so that rules in other chains, new ones included, can jump to
+        // them.
+        for (const auto& [chain, rules] : toChains) {
+            if (!fromChains.count(chain)) StringAppendF(&block, ":%s -\n", chain.c_str());
+        }
+        for (const auto& [chain, rules] : toChains) {
+            if (fromChains.count(chain)) continue;
+            for (const auto& rule : rules) {
+                StringAppendF(&block, "-A %s %s\n", chain.c_str(), rule.c_str());
+            }
+        }
+        for (const auto& [chain, rules] : toChains) {
+            auto it = fromChains.find(chain);
+            if (it != fromChains.end()) diffChain(chain, it->second, rules, &block);
+        }
+        // Delete removed chains last, once nothing that changed above jumps to them any more.
+        for (const auto& [chain, rules] : fromChains) {
+            if (toChains.count(chain)) continue;
+            StringAppendF(&block, ":%s -\n-X %s\n", chain.c_str(), chain.c_str());
+        }
+
+        if (!block.empty()) {
+            StringAppendF(&out, "*%s\n%sCOMMIT\n", table.c_str(), block.c_str());
+        }
+    }
+    return out;
+}
+
+IptablesRuleCompiler::IptablesRuleCompiler()
+    : IptablesRuleCompiler([](IptablesTarget target, const std::string& commands) {
+          return execIptablesRestore(target, commands);
+      }) {}
+
+IptablesRuleCompiler::IptablesRuleCompiler(ExecFunction exec) : mExec(std::move(exec)) {}
+
+IptablesRuleSet& IptablesRuleCompiler::desired(IptablesTarget target) {
+    if (target == V4V6) {
+        ALOGE("IptablesRuleCompiler::desired only supports one protocol at a time");
+        abort();
+    }
+    return mDesired[target];
+}
+
+void IptablesRuleCompiler::setChain(IptablesTarget target, const std::string& table,
+                                    const std::string& chain,
+                                    const IptablesRuleSet::Rules& rules) {
+    if (target == V4 || target == V4V6) mDesired[V4].setChain(table, chain, rules);
+    if (target == V6 || target == V4V6) mDesired[V6].setChain(table, chain, rules);
+}
+
+void IptablesRuleCompiler::appendRule(IptablesTarget target, const std::string& table,
+                                      const std::string& chain, const std::string& rule) {
+    if (target == V4 || target == V4V6) mDesired[V4].appendRule(table, chain, rule);
+    if (target == V6 || target == V4V6) mDesired[V6].appendRule(table, chain, rule);
+}
+
+void IptablesRuleCompiler::deleteRule(IptablesTarget target, const std::string& table,
+                                      const std::string& chain, const std::string& rule) {
+    if (target == V4 || target == V4V6) mDesired[V4].deleteRule(table, chain, rule);
+    if (target == V6 || target == V4V6) mDesired[V6].deleteRule(table, chain, rule);
+}
+
+int IptablesRuleCompiler::commit() {
+    const std::string v4 = IptablesRuleSet::diff(mCommitted[V4], mDesired[V4]);
+    const std::string v6 = IptablesRuleSet::diff(mCommitted[V6], mDesired[V6]);
+
+    int res = 0;
+    if (!v4.empty() && v4 == v6) {
+        // Most changes are identical for both families. Send them in one call.
+        if (mExec(V4V6, v4) == 0) {
+            mCommitted[V4] = mDesired[V4];
+            mCommitted[V6] = mDesired[V6];
+        } else {
+            invalidate();
+            res = -EREMOTEIO;
+        }
+        return res;
+    }
+
+    for (const IptablesTarget target : {V4, V6}) {
+        const std::string& delta = (target == V4) ? v4 : v6;
+        if (delta.empty()) continue;
+        if (mExec(target, delta) == 0) {
+            mCommitted[target] = mDesired[target];
+        } else {
+            mCommitted[target] = IptablesRuleSet();
+            res = -EREMOTEIO;
+        }
+    }
+    return res;
+}
+
+void IptablesRuleCompiler::invalidate() {
+    mCommitted[V4] = IptablesRuleSet();
+    mCommitted[V6] = IptablesRuleSet();
+}
+
+}  // namespace net
+}  // namespace android
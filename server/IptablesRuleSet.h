@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_IPTABLES_RULE_SET_H
+#define NETD_SERVER_IPTABLES_RULE_SET_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+namespace android {
+namespace net {
+
+/*
+ * In-memory model of the contents of a set of iptables chains, for one IP family. Rules are stored
+ * as the rule specification without the "-A <chain>" prefix, e.g., "-m owner --uid-owner 1000 -j
+ * RETURN", in the order they appear in the chain.
+ *
+ * Only chains that have been added to the model are managed by it. Chains that are not in the
+ * model are never touched by diff().
+ */
+class IptablesRuleSet {
+  public:
+    using Rules = std::vector<std::string>;
+
+    // Creates |chain| in |table| if it is not in the model yet, and replaces its rules.
+    void setChain(const std::string& table, const std::string& chain, Rules rules);
+
+    // Removes |chain| from the model. diff() will flush and delete it.
+    void removeChain(const std::string& table, const std::string& chain);
+
+    // Appends |rule| to |chain|, creating the chain if necessary.
+    void appendRule(const std::string& table, const std::string& chain, const std::string& rule);
+
+    // Deletes the first occurrence of |rule| from |chain|. Returns false if there was none.
+    bool deleteRule(const std::string& table, const std::string& chain, const std::string& rule);
+
+    bool hasRule(const std::string& table, const std::string& chain,
+                 const std::string& rule) const;
+
+    // Returns the rules of |chain|, or nullptr if it is not in the model.
+    const Rules* getChain(const std::string& table, const std::string& chain) const;
+
+    bool operator==(const IptablesRuleSet& other) const { return mTables == other.mTables; }
+
+    // Returns iptables-restore --noflush input that turns the kernel state described by |from|
+    // into the one described by |to|, with one COMMIT block per table that has changes. Returns
+    // an empty string if there are no changes.
+    //
+    // Chains that only exist in |to| are created, or flushed if they already exist in the kernel,
+    // and populated. Chains that only exist in |from| are flushed and deleted. For chains in both,
+    // only the rules that changed are deleted and inserted, by position, keeping the longest
+    // common subsequence of rules in place.
+    static std::string diff(const IptablesRuleSet& from, const IptablesRuleSet& to);
+
+  private:
+    // Table name -> chain name -> rules.
+    std::map<std::string, std::map<std::string, Rules>> mTables;
+
+    static void diffChain(const std::string& chain, const Rules& from, const Rules& to,
+                          std::string* out);
+};
+
+/*
+ * Tracks the desired and last committed state of a set of chains for both IPv4 and IPv6, and
+ * applies only the differences between the two when commit() is called. Controllers can build up
+ * the state they want with any number of edits and then pay for a single iptables-restore round
+ * trip per family that contains only the changed lines.
+ */
+class IptablesRuleCompiler {
+  public:
+    using ExecFunction = std::function<int(IptablesTarget target, const std::string& commands)>;
+
+    // Sends commits with execIptablesRestore().
+    IptablesRuleCompiler();
+    // Sends commits with |exec|, so that a controller can route them through its own test hook.
+    explicit IptablesRuleCompiler(ExecFunction exec);
+
+    // Returns the desired state for |target|, which must be V4 or V6. Not thread-safe; the
+    // owning controller must serialize edits and commits with its own lock.
+    IptablesRuleSet& desired(IptablesTarget target);
+
+    // Convenience wrappers that apply the same edit to the families in |target|.
+    void setChain(IptablesTarget target, const std::string& table, const std::string& chain,
+                  const IptablesRuleSet::Rules& rules);
+    void appendRule(IptablesTarget target, const std::string& table, const std::string& chain,
+                    const std::string& rule);
+    void deleteRule(IptablesTarget target, const std::string& table, const std::string& chain,
+                    const std::string& rule);
+
+    // Applies the difference between the desired and committed state. On success, the desired
+    // state becomes the committed state. On failure, returns -EREMOTEIO and forgets the committed
+    // state for the failed family, so that the next commit rewrites all of its managed chains.
+    int commit();
+
+    // Discards the committed state, so that the next commit() rewrites every managed chain. Used
+    // when the kernel state is not known, e.g., after the chains were flushed by someone else.
+    void invalidate();
+
+  protected:
+    // For testing.
+    friend class IptablesRuleSetTest;
+    static int (*execIptablesRestore)(IptablesTarget target, const std::string& commands);
+
+  private:
+    const ExecFunction mExec;
+    IptablesRuleSet mDesired[2];
+    IptablesRuleSet mCommitted[2];
+};
+
+}  // namespace net
+}  // namespace android
+
+#endif  // NETD_SERVER_IPTABLES_RULE_SET_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * IptablesRuleSetTest.cpp - unit tests for IptablesRuleSet.cpp
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "IptablesBaseTest.h"
+#include "IptablesRuleSet.h"
+
+namespace android {
+namespace net {
+
+class IptablesRuleSetTest : public IptablesBaseTest {
+  public:
+    IptablesRuleSetTest() {
+        IptablesRuleCompiler::execIptablesRestore = fakeExecIptablesRestore;
+    }
+
+    void TearDown() override { IptablesRuleCompiler::execIptablesRestore = mSavedExec; }
+
+  protected:
+    decltype(IptablesRuleCompiler::execIptablesRestore) const mSavedExec =
+            IptablesRuleCompiler::execIptablesRestore;
+    IptablesRuleCompiler mCompiler;
+};
+
+TEST_F(IptablesRuleSetTest, TestDiffNewAndRemovedChains) {
+    IptablesRuleSet from;
+    IptablesRuleSet to;
+    EXPECT_EQ("", IptablesRuleSet::diff(from, to));
+
+    to.setChain("filter", "fw_test", {"-j RETURN"});
+    to.appendRule("mangle", "bw_test", "-j MARK --set-mark 0x1");
+    EXPECT_EQ("*filter\n"
+              ":fw_test -\n"
+              "-A fw_test -j RETURN\n"
+              "COMMIT\n"
+              "*mangle\n"
+              ":bw_test -\n"
+              "-A bw_test -j MARK --set-mark 0x1\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(from, to));
+
+    EXPECT_EQ("*filter\n"
+              ":fw_test -\n"
+              "-X fw_test\n"
+              "COMMIT\n"
+              "*mangle\n"
+              ":bw_test -\n"
+              "-X bw_test\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(to, from));
+    EXPECT_EQ("", IptablesRuleSet::diff(to, to));
+
+    // New chains are all created before any rules are added, so rules can jump to new chains that
+    // come after their own.
+    IptablesRuleSet jumps;
+    jumps.setChain("filter", "st_a", {"-j st_b"});
+    jumps.setChain("filter", "st_b", {"-j RETURN"});
+    EXPECT_EQ("*filter\n"
+              ":st_a -\n"
+              ":st_b -\n"
+              "-A st_a -j st_b\n"
+              "-A st_b -j RETURN\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(from, jumps));
+}
+
+TEST_F(IptablesRuleSetTest, TestDiffChangedChain) {
+    IptablesRuleSet from;
+    from.setChain("filter", "bw_penalty_box", {"A", "B", "C", "D", "E"});
+
+    // Insert in the middle, delete at both ends.
+    IptablesRuleSet to;
+    to.setChain("filter", "bw_penalty_box", {"B", "C", "X", "D"});
+    EXPECT_EQ("*filter\n"
+              "-D bw_penalty_box 5\n"
+              "-D bw_penalty_box 1\n"
+              "-I bw_penalty_box 3 X\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(from, to));
+
+    // Append only.
+    to.setChain("filter", "bw_penalty_box", {"A", "B", "C", "D", "E", "F"});
+    EXPECT_EQ("*filter\n"
+              "-I bw_penalty_box 6 F\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(from, to));
+
+    // Replace everything.
+    to.setChain("filter", "bw_penalty_box", {"Y", "Z"});
+    EXPECT_EQ("*filter\n"
+              "-D bw_penalty_box 5\n"
+              "-D bw_penalty_box 4\n"
+              "-D bw_penalty_box 3\n"
+              "-D bw_penalty_box 2\n"
+              "-D bw_penalty_box 1\n"
+              "-I bw_penalty_box 1 Y\n"
+              "-I bw_penalty_box 2 Z\n"
+              "COMMIT\n",
+              IptablesRuleSet::diff(from, to));
+}
+
+TEST_F(IptablesRuleSetTest, TestDeleteRule) {
+    IptablesRuleSet rules;
+    rules.setChain("filter", "st_test", {"A", "B", "A"});
+    EXPECT_TRUE(rules.deleteRule("filter", "st_test", "A"));
+    EXPECT_EQ((IptablesRuleSet::Rules{"B", "A"}), *rules.getChain("filter", "st_test"));
+    EXPECT_FALSE(rules.deleteRule("filter", "st_test", "C"));
+    EXPECT_FALSE(rules.deleteRule("filter", "nonexistent", "A"));
+    EXPECT_TRUE(rules.hasRule("filter", "st_test", "B"));
+    EXPECT_EQ(nullptr, rules.getChain("nat", "st_test"));
+}
+
+TEST_F(IptablesRuleSetTest, TestCommit) {
+    // Nothing to do.
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // Identical changes for both families are sent in one call.
+    mCompiler.setChain(V4V6, "filter", "fw_test", {"-j RETURN"});
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands({
+            {V4V6, "*filter\n:fw_test -\n-A fw_test -j RETURN\nCOMMIT\n"},
+    });
+
+    // Only the change is sent, and only to the family that changed.
+    mCompiler.appendRule(V6, "filter", "fw_test", "-p icmpv6 -j RETURN");
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands({
+            {V6, "*filter\n-I fw_test 2 -p icmpv6 -j RETURN\nCOMMIT\n"},
+    });
+
+    // Committing again is a no-op.
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // Identical deltas are combined even if the chains differ.
+    mCompiler.deleteRule(V4V6, "filter", "fw_test", "-j RETURN");
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands({
+            {V4V6, "*filter\n-D fw_test 1\nCOMMIT\n"},
+    });
+
+    // After invalidate(), the next commit rewrites every managed chain.
+    mCompiler.invalidate();
+    EXPECT_EQ(0, mCompiler.commit());
+    expectIptablesRestoreCommands({
+            {V4, "*filter\n:fw_test -\nCOMMIT\n"},
+            {V6, "*filter\n:fw_test -\n-A fw_test -p icmpv6 -j RETURN\nCOMMIT\n"},
+    });
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "IptablesScript.h"
+
+#include <stdarg.h>
+
+#include <android-base/stringprintf.h>
+
+using android::base::StringAppendV;
+
+namespace android::net {
+
+IptablesScript& IptablesScript::table(std::string_view name) {
+    mScript.append("*").append(name).append("\n");
+    return *this;
+}
+
+IptablesScript& IptablesScript::appendf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    StringAppendV(&mScript, fmt, ap);
+    va_end(ap);
+    mScript.push_back('\n');
+    return *this;
+}
+
+IptablesScript& IptablesScript::append(std::string_view lines) {
+    mScript.append(lines);
+    return *this;
+}
+
+IptablesScript& IptablesScript::commit() {
+    mScript.append("COMMIT\n");
+    return *this;
+}
+
+}  // namespace android::net
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace android::net {
+
+/*
+ * Builds iptables-restore input in a single buffer, e.g.:
+ *
+ *     IptablesScript script;
+ *     script.table("filter").appendf("-A %s -j DROP", chain).commit();
+ *     execIptablesRestore(V4V6, script.str());
+ *
+ * Every line is formatted straight into the buffer, instead of into a string of its own that is
+ * then joined with the others. clear() keeps the buffer's capacity, so a script that is reused
+ * for each call does not allocate once it has grown to the size of the largest command.
+ */
+class IptablesScript {
+  public:
+    IptablesScript() = default;
+    explicit IptablesScript(size_t capacity) { mScript.reserve(capacity); }
+
+    // Starts a "*<name>" table block.
+    IptablesScript& table(std::string_view name);
+
+    // Appends one line, formatted as by printf(). The newline is added.
+    IptablesScript& appendf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    // Appends |lines| as they are. Each of them must end in a newline.
+    IptablesScript& append(std::string_view lines);
+
+    // Ends the current table block.
+    IptablesScript& commit();
+
+    const std::string& str() const { return mScript; }
+    bool empty() const { return mScript.empty(); }
+    void clear() { mScript.clear(); }
+
+  private:
+    std::string mScript;
+};
+
+}  // namespace android::net
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "IptablesScript.h"
+
+namespace android::net {
+
+TEST(IptablesScriptTest, BuildsTableBlocks) {
+    IptablesScript script;
+    EXPECT_TRUE(script.empty());
+
+    script.table("filter").appendf("-A %s -m owner --uid-owner %d -j DROP", "st_OUTPUT", 10000);
+    script.append("-A st_OUTPUT -j RETURN\n").commit();
+    script.table("raw").commit();
+    EXPECT_EQ("*filter\n"
+              "-A st_OUTPUT -m owner --uid-owner 10000 -j DROP\n"
+              "-A st_OUTPUT -j RETURN\n"
+              "COMMIT\n"
+              "*raw\n"
+              "COMMIT\n",
+              script.str());
+}
+
+TEST(IptablesScriptTest, ClearKeepsCapacity) {
+    IptablesScript script(4096);
+    const size_t capacity = script.str().capacity();
+    EXPECT_LE(4096U, capacity);
+
+    script.table("filter").appendf("%s", std::string(1000, 'x').c_str()).commit();
+    script.clear();
+    EXPECT_TRUE(script.empty());
+    EXPECT_EQ(capacity, script.str().capacity());
+}
+
+TEST(IptablesScriptTest, LongLines) {
+    const std::string chain(5000, 'c');
+    IptablesScript script;
+    script.appendf("-A %s", chain.c_str());
+    EXPECT_EQ("-A " + chain + "\n", script.str());
+}
+
+}  // namespace android::net
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+
+namespace android::net {
+
+// Zero-copy tokenizers for the listings printed by iptables and iptables-restore. The views they
+// return point into the text being tokenized, which must outlive them.
+
+// Returns the lines of a listing one by one, without their newline.
+class LineTokenizer {
+  public:
+    explicit LineTokenizer(std::string_view text) : mRemaining(text) {}
+
+    // Sets |*line| to the next line and returns true, or returns false if there are no more lines.
+    // A newline at the end of the text does not start an empty last line.
+    bool next(std::string_view* line) {
+        if (mRemaining.empty()) return false;
+        const size_t newline = mRemaining.find('\n');
+        *line = mRemaining.substr(0, newline);
+        mRemaining.remove_prefix((newline == std::string_view::npos) ? mRemaining.size()
+                                                                     : newline + 1);
+        return true;
+    }
+
+  private:
+    std::string_view mRemaining;
+};
+
+// Returns the fields of a line one by one. Fields are separated by runs of spaces and tabs.
+class FieldTokenizer {
+  public:
+    explicit FieldTokenizer(std::string_view line) : mRemaining(line) {}
+
+    // Returns the next field, or an empty view if there are no more fields.
+    std::string_view next() {
+        skipSeparators();
+        const size_t end = std::min(mRemaining.find_first_of(kSeparators), mRemaining.size());
+        const std::string_view field = mRemaining.substr(0, end);
+        mRemaining.remove_prefix(end);
+        return field;
+    }
+
+    // Parses the next field as an unsigned decimal number. Returns false if there is no next
+    // field or if it is not entirely a number.
+    bool nextUint64(uint64_t* value) {
+        const std::string_view field = next();
+        if (field.empty()) return false;
+        const char* end = field.data() + field.size();
+        const auto [ptr, ec] = std::from_chars(field.data(), end, *value);
+        return ec == std::errc() && ptr == end;
+    }
+
+    // Returns the rest of the line, starting at the next field.
+    std::string_view rest() {
+        skipSeparators();
+        return mRemaining;
+    }
+
+    // Returns true if there are no more fields.
+    bool done() { return rest().empty(); }
+
+  private:
+    static constexpr std::string_view kSeparators = " \t";
+
+    void skipSeparators() {
+        mRemaining.remove_prefix(
+                std::min(mRemaining.find_first_not_of(kSeparators), mRemaining.size()));
+    }
+
+    std::string_view mRemaining;
+};
+
+}  // namespace android::net
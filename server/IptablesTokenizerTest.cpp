@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "IptablesTokenizer.h"
+
+namespace android::net {
+
+namespace {
+
+std::vector<std::string> allLines(std::string_view text) {
+    std::vector<std::string> lines;
+    LineTokenizer tokenizer(text);
+    std::string_view line;
+    while (tokenizer.next(&line)) lines.emplace_back(line);
+    return lines;
+}
+
+std::vector<std::string> allFields(std::string_view line) {
+    std::vector<std::string> fields;
+    FieldTokenizer tokenizer(line);
+    for (std::string_view field = tokenizer.next(); !field.empty(); field = tokenizer.next()) {
+        fields.emplace_back(field);
+    }
+    return fields;
+}
+
+}  // namespace
+
+TEST(IptablesTokenizerTest, Lines) {
+    EXPECT_EQ(std::vector<std::string>{}, allLines(""));
+    EXPECT_EQ(std::vector<std::string>{"a"}, allLines("a"));
+    EXPECT_EQ(std::vector<std::string>{"a"}, allLines("a\n"));
+    EXPECT_EQ((std::vector<std::string>{"a", "", "b c"}), allLines("a\n\nb c\n"));
+    EXPECT_EQ((std::vector<std::string>{"", ""}), allLines("\n\n"));
+}
+
+TEST(IptablesTokenizerTest, Fields) {
+    EXPECT_EQ(std::vector<std::string>{}, allFields(""));
+    EXPECT_EQ(std::vector<std::string>{}, allFields(" \t "));
+    EXPECT_EQ((std::vector<std::string>{"-A", "OUTPUT", "-j", "bw_OUTPUT"}),
+              allFields("-A OUTPUT -j bw_OUTPUT"));
+    EXPECT_EQ((std::vector<std::string>{"26", "2373", "RETURN", "all", "--", "wlan0"}),
+              allFields("      26     2373 RETURN\tall  --  wlan0  "));
+
+    FieldTokenizer tokenizer("-A OUTPUT -m owner --uid-owner 0 ");
+    EXPECT_EQ("-A", tokenizer.next());
+    EXPECT_EQ("OUTPUT", tokenizer.next());
+    EXPECT_EQ("-m owner --uid-owner 0 ", tokenizer.rest());
+    EXPECT_FALSE(tokenizer.done());
+    tokenizer.next();
+    tokenizer.next();
+    tokenizer.next();
+    tokenizer.next();
+    EXPECT_TRUE(tokenizer.done());
+    EXPECT_EQ("", tokenizer.next());
+}
+
+TEST(IptablesTokenizerTest, Numbers) {
+    FieldTokenizer tokenizer(" 0 18446744073709551615 18446744073709551616 12ab -1 ");
+    uint64_t value = 1;
+    ASSERT_TRUE(tokenizer.nextUint64(&value));
+    EXPECT_EQ(0U, value);
+    ASSERT_TRUE(tokenizer.nextUint64(&value));
+    EXPECT_EQ(UINT64_MAX, value);
+    EXPECT_FALSE(tokenizer.nextUint64(&value));
+    EXPECT_FALSE(tokenizer.nextUint64(&value));
+    EXPECT_FALSE(tokenizer.nextUint64(&value));
+    EXPECT_FALSE(tokenizer.nextUint64(&value));
+    EXPECT_TRUE(tokenizer.done());
+}
+
+}  // namespace android::net
@@ -18,10 +18,43 @@
 
 #include "MDnsEventReporter.h"
 
+#include <algorithm>
+#include <thread>
+
+#include <android-base/properties.h>
+#include <log/log.h>
+
 using android::IInterface;
 using android::sp;
+using android::net::mdns::aidl::DiscoveryInfo;
 using android::net::mdns::aidl::IMDnsEventListener;
 
+namespace {
+
+// How long discovery results are held so that they are reported together, in milliseconds. 0
+// reports every result as soon as it arrives.
+constexpr const char* DISCOVERY_BATCH_PROPERTY = "persist.netd.mdns_discovery_batch_ms";
+
+// Bounds the memory used by batched results. Results that do not fit are reported right away.
+constexpr size_t MAX_BATCHED_DISCOVERIES = 1024;
+
+bool isFoundOrLost(const DiscoveryInfo& info) {
+    return info.result == IMDnsEventListener::SERVICE_FOUND ||
+           info.result == IMDnsEventListener::SERVICE_LOST;
+}
+
+// Whether |a| and |b| are a found and a lost result for the same service of the same request.
+bool cancelsOut(const DiscoveryInfo& a, const DiscoveryInfo& b) {
+    return isFoundOrLost(a) && isFoundOrLost(b) && a.result != b.result && a.id == b.id &&
+           a.interfaceIdx == b.interfaceIdx && a.serviceName == b.serviceName &&
+           a.registrationType == b.registrationType;
+}
+
+}  // namespace
+
+MDnsEventReporter::MDnsEventReporter()
+    : mBatchWindow(android::base::GetUintProperty<unsigned>(DISCOVERY_BATCH_PROPERTY, 0, 1000)) {}
+
 MDnsEventReporter& MDnsEventReporter::getInstance() {
     // It should be initialized only once.
     static MDnsEventReporter instance;
@@ -83,4 +116,93 @@ int MDnsEventReporter::removeEventListenerImpl(const sp<IMDnsEventListener>& lis
     }
     ALOGE("The event listener does not exist");
     return -ENOENT;
-}
\ No newline at end of file
+}
+
+void MDnsEventReporter::sendServiceDiscoveryStatus(const DiscoveryInfo& info) {
+    if (mEventListeners.empty()) {
+        ALOGI("Discover callback not sent since no IMDnsEventListener receiver is available.");
+        return;
+    }
+    for (const auto& it : mEventListeners) {
+        it->getListener()->onServiceDiscoveryStatus(info);
+    }
+}
+
+void MDnsEventReporter::reportServiceDiscoveryStatus(const DiscoveryInfo& info) {
+    if (mBatchWindow.count() != 0) {
+        std::lock_guard lock(mBatchMutex);
+        if (!mBatcherStarted) {
+            mBatcherStarted = true;
+            std::thread(&MDnsEventReporter::runDiscoveryBatcher, this).detach();
+        }
+        // The most recent result for the service is the one that can cancel out.
+        const auto rit = std::find_if(
+                mBatchedDiscoveries.rbegin(), mBatchedDiscoveries.rend(),
+                [&info](const DiscoveryInfo& queued) {
+                    return queued.id == info.id && queued.serviceName == info.serviceName &&
+                           queued.registrationType == info.registrationType &&
+                           queued.interfaceIdx == info.interfaceIdx;
+                });
+        if (rit != mBatchedDiscoveries.rend() && cancelsOut(*rit, info)) {
+            mBatchedDiscoveries.erase(std::next(rit).base());
+            return;
+        }
+        if (mBatchedDiscoveries.size() < MAX_BATCHED_DISCOVERIES) {
+            if (mBatchedDiscoveries.empty()) {
+                mBatchDeadline = std::chrono::steady_clock::now() + mBatchWindow;
+                mBatchCv.notify_one();
+            }
+            mBatchedDiscoveries.push_back(info);
+            return;
+        }
+        // Reporting this result now puts it ahead of the batch. Anything else would mean
+        // blocking the caller, which is the mDNS monitor thread.
+    }
+    std::lock_guard lock(mMutex);
+    sendServiceDiscoveryStatus(info);
+}
+
+void MDnsEventReporter::cancelServiceDiscovery(int id) {
+    {
+        std::lock_guard lock(mBatchMutex);
+        std::erase_if(mBatchedDiscoveries,
+                      [id](const DiscoveryInfo& info) { return info.id == id; });
+        if (!mReportingBatch) return;
+        mCancelledIds.insert(id);
+    }
+    // The batcher checks for cancellation before reporting each result, while holding mMutex. Once
+    // mMutex is free, it is not reporting a result of |id|, and will not report any.
+    std::lock_guard lock(mMutex);
+}
+
+void MDnsEventReporter::runDiscoveryBatcher() {
+    std::vector<DiscoveryInfo> batch;
+    while (true) {
+        {
+            std::unique_lock lock(mBatchMutex);
+            mBatchCv.wait(lock, [this]() REQUIRES(mBatchMutex) {
+                return !mBatchedDiscoveries.empty();
+            });
+            // Results that cancel out may empty the batch while waiting, and a new batch then has
+            // a new deadline.
+            while (!mBatchedDiscoveries.empty() &&
+                   std::chrono::steady_clock::now() < mBatchDeadline) {
+                mBatchCv.wait_until(lock, mBatchDeadline);
+            }
+            batch.swap(mBatchedDiscoveries);
+            mReportingBatch = true;
+        }
+        for (const DiscoveryInfo& info : batch) {
+            std::lock_guard lock(mMutex);
+            {
+                std::lock_guard batchLock(mBatchMutex);
+                if (mCancelledIds.count(info.id)) continue;
+            }
+            sendServiceDiscoveryStatus(info);
+        }
+        batch.clear();
+        std::lock_guard lock(mBatchMutex);
+        mReportingBatch = false;
+        mCancelledIds.clear();
+    }
+}
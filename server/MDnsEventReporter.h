@@ -19,7 +19,11 @@
 #include <android-base/thread_annotations.h>
 #include <android/net/mdns/aidl/IMDnsEventListener.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <set>
+#include <vector>
 
 class MDnsEventReporter final {
   public:
@@ -60,14 +64,45 @@ class MDnsEventReporter final {
     int removeEventListener(
             const android::sp<android::net::mdns::aidl::IMDnsEventListener>& listener);
 
+    // Report a discovery result to the registered binder services. If discovery batching is
+    // enabled, found and lost results are held for the batching window and then reported together
+    // from a background thread, and a found and a lost result for the same service within the
+    // window cancel out. Other results are queued behind them to keep the order. This method is
+    // threadsafe.
+    void reportServiceDiscoveryStatus(const android::net::mdns::aidl::DiscoveryInfo& info)
+            EXCLUDES(mMutex, mBatchMutex);
+
+    // Drop the discovery results of request |id| that have not been reported yet, so that none
+    // are reported after the request is stopped. If a result of |id| is being reported, waits for
+    // it. This method is threadsafe.
+    void cancelServiceDiscovery(int id) EXCLUDES(mMutex, mBatchMutex);
+
     mutable std::mutex mMutex;
 
   private:
-    MDnsEventReporter() = default;
+    MDnsEventReporter();
     ~MDnsEventReporter() = default;
 
     EventListenerSet mEventListeners GUARDED_BY(mMutex);
 
+    void sendServiceDiscoveryStatus(const android::net::mdns::aidl::DiscoveryInfo& info)
+            REQUIRES(mMutex);
+    // Reports batched discovery results until the process exits.
+    void runDiscoveryBatcher() EXCLUDES(mMutex, mBatchMutex);
+
+    // How long discovery results are held for batching. 0 disables batching.
+    const std::chrono::milliseconds mBatchWindow;
+    std::mutex mBatchMutex;
+    std::condition_variable mBatchCv;
+    std::vector<android::net::mdns::aidl::DiscoveryInfo> mBatchedDiscoveries
+            GUARDED_BY(mBatchMutex);
+    std::chrono::steady_clock::time_point mBatchDeadline GUARDED_BY(mBatchMutex);
+    // Whether the batcher is reporting a batch it took from mBatchedDiscoveries, and the requests
+    // cancelled since it took it, whose results it must skip.
+    bool mReportingBatch GUARDED_BY(mBatchMutex) = false;
+    std::set<int> mCancelledIds GUARDED_BY(mBatchMutex);
+    bool mBatcherStarted GUARDED_BY(mBatchMutex) = false;
+
     int addEventListenerImpl(
             const android::sp<android::net::mdns::aidl::IMDnsEventListener>& listener)
             EXCLUDES(mMutex);
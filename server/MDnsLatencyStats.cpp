@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MDnsLatencyStats.h"
+
+#include <algorithm>
+
+using android::netdutils::DumpWriter;
+using std::chrono::microseconds;
+
+namespace android::net {
+
+namespace {
+
+constexpr MDnsLatencyStats::Operation kOperations[] = {
+        MDnsLatencyStats::Operation::REGISTER,
+        MDnsLatencyStats::Operation::DISCOVER,
+        MDnsLatencyStats::Operation::RESOLVE,
+        MDnsLatencyStats::Operation::GET_ADDR_INFO,
+};
+static_assert(std::size(kOperations) == MDnsLatencyStats::kNumOperations);
+
+}  // namespace
+
+const char* MDnsLatencyStats::toString(Operation operation) {
+    switch (operation) {
+        case Operation::REGISTER:
+            return "register";
+        case Operation::DISCOVER:
+            return "discover";
+        case Operation::RESOLVE:
+            return "resolve";
+        case Operation::GET_ADDR_INFO:
+            return "getaddrinfo";
+    }
+    return "unknown";
+}
+
+void MDnsLatencyStats::record(Operation operation, microseconds latency) {
+    const uint64_t us = std::max<int64_t>(latency.count(), 0);
+    std::lock_guard lock(mMutex);
+    Latencies& latencies = mLatencies[static_cast<size_t>(operation)];
+    latencies.sketch.add(us);
+    latencies.totalUs += us;
+    latencies.maxUs = std::max(latencies.maxUs, us);
+}
+
+MDnsLatencyStats::Summary MDnsLatencyStats::getSummary(Operation operation) const {
+    std::lock_guard lock(mMutex);
+    const Latencies& latencies = mLatencies[static_cast<size_t>(operation)];
+    const uint64_t count = latencies.sketch.count();
+    const auto quantile = [&latencies](double q) {
+        return microseconds(static_cast<int64_t>(latencies.sketch.quantile(q)));
+    };
+    return {.count = count,
+            .mean = microseconds(count ? latencies.totalUs / count : 0),
+            .p50 = quantile(0.5),
+            .p90 = quantile(0.9),
+            .p99 = quantile(0.99),
+            .max = microseconds(latencies.maxUs)};
+}
+
+void MDnsLatencyStats::dump(DumpWriter& dw) const {
+    dw.println("Operation latencies (count mean p50 p90 p99 max, in us)");
+    dw.incIndent();
+    for (const Operation operation : kOperations) {
+        const Summary s = getSummary(operation);
+        dw.println("%s: %llu %lld %lld %lld %lld %lld", toString(operation),
+                   static_cast<unsigned long long>(s.count), static_cast<long long>(s.mean.count()),
+                   static_cast<long long>(s.p50.count()), static_cast<long long>(s.p90.count()),
+                   static_cast<long long>(s.p99.count()), static_cast<long long>(s.max.count()));
+    }
+    dw.decIndent();
+}
+
+}  // namespace android::net
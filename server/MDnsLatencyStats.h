@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
+#include "QuantileSketch.h"
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// How long mDNS operations take inside netd, from the binder call that starts one to its first
+// result. That covers the call to mdnsd, adding the request to the Monitor, and waiting for the
+// daemon's reply. Durations are kept in a QuantileSketch per operation.
+class MDnsLatencyStats {
+  public:
+    enum class Operation {
+        REGISTER,
+        DISCOVER,  // until the first service is found
+        RESOLVE,
+        GET_ADDR_INFO,
+    };
+    static constexpr size_t kNumOperations = 4;
+
+    struct Summary {
+        uint64_t count;
+        std::chrono::microseconds mean;
+        std::chrono::microseconds p50;
+        std::chrono::microseconds p90;
+        std::chrono::microseconds p99;
+        std::chrono::microseconds max;
+    };
+
+    void record(Operation operation, std::chrono::microseconds latency) EXCLUDES(mMutex);
+    Summary getSummary(Operation operation) const EXCLUDES(mMutex);
+    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
+
+    static const char* toString(Operation operation);
+
+  private:
+    struct Latencies {
+        QuantileSketch sketch;
+        uint64_t totalUs = 0;
+        uint64_t maxUs = 0;
+    };
+
+    mutable std::mutex mMutex;
+    std::array<Latencies, kNumOperations> mLatencies GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "MDnsLatencyStats.h"
+
+namespace android::net {
+
+using std::chrono::microseconds;
+using Operation = MDnsLatencyStats::Operation;
+
+TEST(MDnsLatencyStatsTest, Empty) {
+    MDnsLatencyStats stats;
+    const auto summary = stats.getSummary(Operation::RESOLVE);
+    EXPECT_EQ(0U, summary.count);
+    EXPECT_EQ(microseconds(0), summary.mean);
+    EXPECT_EQ(microseconds(0), summary.max);
+}
+
+TEST(MDnsLatencyStatsTest, SummaryPerOperation) {
+    MDnsLatencyStats stats;
+    for (int i = 1; i <= 100; ++i) stats.record(Operation::DISCOVER, microseconds(i * 1000));
+    stats.record(Operation::REGISTER, microseconds(-5));
+
+    const auto discover = stats.getSummary(Operation::DISCOVER);
+    EXPECT_EQ(100U, discover.count);
+    EXPECT_EQ(microseconds(50500), discover.mean);
+    EXPECT_NEAR(50000, discover.p50.count(), 50000 * 0.02);
+    EXPECT_NEAR(90000, discover.p90.count(), 90000 * 0.02);
+    EXPECT_EQ(microseconds(100000), discover.max);
+
+    // Negative durations, e.g. from a clock that went backwards, count as zero.
+    const auto reg = stats.getSummary(Operation::REGISTER);
+    EXPECT_EQ(1U, reg.count);
+    EXPECT_EQ(microseconds(0), reg.max);
+
+    EXPECT_EQ(0U, stats.getSummary(Operation::GET_ADDR_INFO).count);
+}
+
+}  // namespace android::net
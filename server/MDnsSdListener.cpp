@@ -28,15 +28,19 @@
 #include <resolv.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <chrono>
+#include <climits>
 #include <thread>
 
 #define LOG_TAG "MDnsDS"
 #define DBG 1
 #define VDBG 1
 
+#include <android-base/properties.h>
 #include <cutils/properties.h>
 #include <log/log.h>
 #include <netdutils/ThreadUtil.h>
@@ -47,14 +51,13 @@
 #include "netid_client.h"
 
 using android::net::gCtls;
+using android::net::MDnsLatencyStats;
 
 #define MDNS_SERVICE_NAME "mdnsd"
 #define MDNS_SERVICE_STATUS "init.svc.mdnsd"
 
 #define CEIL(x, y) (((x) + (y) - 1) / (y))
 
-constexpr char RESCAN[] = "1";
-
 using android::net::mdns::aidl::DiscoveryInfo;
 using android::net::mdns::aidl::GetAddressInfo;
 using android::net::mdns::aidl::IMDnsEventListener;
@@ -80,40 +83,119 @@ int MDnsSdListener::discover(uint32_t ifIndex, const char* regType, const char*
         ALOGD("discover(%d, %s, %s, %d, %d)", ifIndex, regType, domain ? domain : "null", requestId,
               requestFlags);
     }
-    Context* context = new Context(requestId);
-    DNSServiceRef* ref = mMonitor.allocateServiceRef(requestId, context);
-    if (ref == nullptr) {
+    if (mMonitor.lookupServiceRef(requestId) != nullptr) {
         ALOGE("requestId %d already in use during discover call", requestId);
         return -EBUSY;
     }
-    if (VDBG) ALOGD("using ref %p", ref);
+    const BrowseKey key(ifIndex, regType ? regType : "", domain ? domain : "", requestFlags);
+    std::lock_guard discoverLock(mDiscoverMutex);
+    {
+        std::lock_guard lock(mBrowseMutex);
+        if (mBrowseOfRequest.count(requestId) != 0) {
+            ALOGE("requestId %d already in use during discover call", requestId);
+            return -EBUSY;
+        }
+        if (const auto it = mBrowseIds.find(key); it != mBrowseIds.end()) {
+            SharedBrowse& browse = mBrowses.at(it->second);
+            browse.requestIds.push_back(requestId);
+            mBrowseOfRequest[requestId] = it->second;
+            // mdnsd would report these to a browse of its own.
+            for (const auto& [_, found] : browse.found) {
+                DiscoveryInfo info = found;
+                info.id = requestId;
+                MDnsEventReporter::getInstance().reportServiceDiscoveryStatus(info);
+            }
+            if (VDBG) ALOGD("discover %d joined browse %d", requestId, it->second);
+            return 0;
+        }
+    }
+
+    DNSServiceRef* ref = nullptr;
+    int browseId;
+    Context* context;
+    while (ref == nullptr) {
+        if (mLastBrowseId == INT_MIN) mLastBrowseId = 0;
+        browseId = --mLastBrowseId;
+        context = new Context(browseId, MDnsLatencyStats::Operation::DISCOVER, this);
+        ref = mMonitor.allocateServiceRef(browseId, context);
+    }
+    if (VDBG) ALOGD("using ref %p for browse %d", ref, browseId);
 
     DNSServiceErrorType result = DNSServiceBrowse(ref, requestFlags, ifIndex, regType, domain,
                                                   &MDnsSdListenerDiscoverCallback, context);
     if (result != kDNSServiceErr_NoError) {
         ALOGE("Discover request %d got an error from DNSServiceBrowse %d", requestId, result);
-        mMonitor.freeServiceRef(requestId);
+        mMonitor.freeServiceRef(browseId);
         // Return kDNSServiceErr_* directly instead of transferring to an UNIX error.
         // This can help caller to know what going wrong from mdnsresponder side.
         return -result;
     }
-    mMonitor.startMonitoring(requestId);
+    {
+        std::lock_guard lock(mBrowseMutex);
+        mBrowses[browseId] = {.key = key, .requestIds = {requestId}, .found = {}};
+        mBrowseIds[key] = browseId;
+        mBrowseOfRequest[requestId] = browseId;
+    }
+    mMonitor.startMonitoring(browseId);
     if (VDBG) ALOGD("discover successful");
     return 0;
 }
 
+void MDnsSdListener::onSharedBrowseResult(int browseId, const DiscoveryInfo& info) {
+    std::lock_guard lock(mBrowseMutex);
+    const auto it = mBrowses.find(browseId);
+    if (it == mBrowses.end()) return;
+    SharedBrowse& browse = it->second;
+    const FoundKey found(info.serviceName, info.registrationType, info.interfaceIdx);
+    if (info.result == IMDnsEventListener::SERVICE_FOUND) {
+        browse.found[found] = info;
+    } else if (info.result == IMDnsEventListener::SERVICE_LOST) {
+        browse.found.erase(found);
+    }
+    // Reported while holding mBrowseMutex, so that a request that joins does not see a result
+    // before the found services that precede it.
+    for (const int requestId : browse.requestIds) {
+        DiscoveryInfo copy = info;
+        copy.id = requestId;
+        MDnsEventReporter::getInstance().reportServiceDiscoveryStatus(copy);
+    }
+}
+
+bool MDnsSdListener::stopDiscover(int requestId) {
+    std::lock_guard discoverLock(mDiscoverMutex);
+    int browseId;
+    bool lastRequest = false;
+    {
+        std::lock_guard lock(mBrowseMutex);
+        const auto it = mBrowseOfRequest.find(requestId);
+        if (it == mBrowseOfRequest.end()) return false;
+        browseId = it->second;
+        mBrowseOfRequest.erase(it);
+        SharedBrowse& browse = mBrowses.at(browseId);
+        std::erase(browse.requestIds, requestId);
+        if (browse.requestIds.empty()) {
+            mBrowseIds.erase(browse.key);
+            mBrowses.erase(browseId);
+            lastRequest = true;
+        }
+    }
+    MDnsEventReporter::getInstance().cancelServiceDiscovery(requestId);
+    if (lastRequest) {
+        if (VDBG) ALOGD("Stopping browse %d", browseId);
+        if (DNSServiceRef* ref = mMonitor.lookupServiceRef(browseId)) {
+            mMonitor.deallocateServiceRef(ref);
+            mMonitor.freeServiceRef(browseId);
+        }
+    }
+    return true;
+}
+
 void MDnsSdListenerDiscoverCallback(DNSServiceRef /* sdRef */, DNSServiceFlags flags,
                                     uint32_t ifIndex, DNSServiceErrorType errorCode,
                                     const char* serviceName, const char* regType,
                                     const char* replyDomain, void* inContext) {
     MDnsSdListener::Context *context = reinterpret_cast<MDnsSdListener::Context *>(inContext);
     int refNumber = context->mRefNumber;
-    const std::lock_guard lock(MDnsEventReporter::getInstance().mMutex);
-    const auto& listeners = MDnsEventReporter::getInstance().getEventListeners();
-    if (listeners.empty()) {
-        ALOGI("Discover callback not sent since no IMDnsEventListener receiver is available.");
-        return;
-    }
 
     DiscoveryInfo info;
     info.id = refNumber;
@@ -130,6 +212,7 @@ void MDnsSdListenerDiscoverCallback(DNSServiceRef /* sdRef */, DNSServiceFlags f
                       serviceName, regType, replyDomain, refNumber);
             }
             info.result = IMDnsEventListener::SERVICE_FOUND;
+            context->recordLatency();
         } else {
             if (VDBG) {
                 ALOGD("Discover lost serviceName %s, regType %s and domain %s for %d", serviceName,
@@ -142,12 +225,15 @@ void MDnsSdListenerDiscoverCallback(DNSServiceRef /* sdRef */, DNSServiceFlags f
         info.result = IMDnsEventListener::SERVICE_DISCOVERY_FAILED;
     }
 
-    for (const auto& it : listeners) {
-        it->getListener()->onServiceDiscoveryStatus(info);
+    if (context->mListener != nullptr) {
+        context->mListener->onSharedBrowseResult(refNumber, info);
+        return;
     }
+    MDnsEventReporter::getInstance().reportServiceDiscoveryStatus(info);
 }
 
 int MDnsSdListener::stop(int requestId) {
+    if (stopDiscover(requestId)) return 0;
     DNSServiceRef* ref = mMonitor.lookupServiceRef(requestId);
     if (ref == nullptr) {
         if (DBG) ALOGE("Stop used unknown requestId %d", requestId);
@@ -156,6 +242,7 @@ int MDnsSdListener::stop(int requestId) {
     if (VDBG) ALOGD("Stopping operation with ref %p", ref);
     mMonitor.deallocateServiceRef(ref);
     mMonitor.freeServiceRef(requestId);
+    MDnsEventReporter::getInstance().cancelServiceDiscovery(requestId);
     return 0;
 }
 
@@ -166,7 +253,7 @@ int MDnsSdListener::serviceRegister(int requestId, const char* serviceName, cons
         ALOGD("serviceRegister(%d, %d, %s, %s, %s, %s, %d, <binary>)", requestId, ifIndex,
               serviceName, serviceType, domain ? domain : "null", host ? host : "null", port);
     }
-    Context* context = new Context(requestId);
+    Context* context = new Context(requestId, MDnsLatencyStats::Operation::REGISTER);
     DNSServiceRef* ref = mMonitor.allocateServiceRef(requestId, context);
     if (ref == nullptr) {
         ALOGE("requestId %d already in use during register call", requestId);
@@ -196,6 +283,7 @@ void MDnsSdListenerRegisterCallback(DNSServiceRef /* sdRef */, DNSServiceFlags /
                                     void* inContext) {
     MDnsSdListener::Context* context = reinterpret_cast<MDnsSdListener::Context*>(inContext);
     int refNumber = context->mRefNumber;
+    context->recordLatency();
     const std::lock_guard lock(MDnsEventReporter::getInstance().mMutex);
     const auto& listeners = MDnsEventReporter::getInstance().getEventListeners();
     if (listeners.empty()) {
@@ -226,7 +314,7 @@ int MDnsSdListener::resolveService(int requestId, uint32_t ifIndex, const char*
         ALOGD("resolveService(%d, %d, %s, %s, %s)", requestId, ifIndex, serviceName, regType,
               domain);
     }
-    Context* context = new Context(requestId);
+    Context* context = new Context(requestId, MDnsLatencyStats::Operation::RESOLVE);
     DNSServiceRef* ref = mMonitor.allocateServiceRef(requestId, context);
     if (ref == nullptr) {
         ALOGE("request Id %d already in use during resolve call", requestId);
@@ -255,6 +343,7 @@ void MDnsSdListenerResolveCallback(DNSServiceRef /* sdRef */, DNSServiceFlags /*
                                    void* inContext) {
     MDnsSdListener::Context* context = reinterpret_cast<MDnsSdListener::Context*>(inContext);
     int refNumber = context->mRefNumber;
+    context->recordLatency();
     const std::lock_guard lock(MDnsEventReporter::getInstance().mMutex);
     const auto& listeners = MDnsEventReporter::getInstance().getEventListeners();
     if (listeners.empty()) {
@@ -289,7 +378,7 @@ void MDnsSdListenerResolveCallback(DNSServiceRef /* sdRef */, DNSServiceFlags /*
 int MDnsSdListener::getAddrInfo(int requestId, uint32_t ifIndex, uint32_t protocol,
                                 const char* hostname) {
     if (VDBG) ALOGD("getAddrInfo(%d, %u %d, %s)", requestId, ifIndex, protocol, hostname);
-    Context* context = new Context(requestId);
+    Context* context = new Context(requestId, MDnsLatencyStats::Operation::GET_ADDR_INFO);
     DNSServiceRef* ref = mMonitor.allocateServiceRef(requestId, context);
     if (ref == nullptr) {
         ALOGE("request ID %d already in use during getAddrInfo call", requestId);
@@ -318,6 +407,7 @@ void MDnsSdListenerGetAddrInfoCallback(DNSServiceRef /* sdRef */, DNSServiceFlag
                                        uint32_t /* ttl */, void* inContext) {
     MDnsSdListener::Context *context = reinterpret_cast<MDnsSdListener::Context *>(inContext);
     int refNumber = context->mRefNumber;
+    context->recordLatency();
     const std::lock_guard lock(MDnsEventReporter::getInstance().mMutex);
     const auto& listeners = MDnsEventReporter::getInstance().getEventListeners();
     if (listeners.empty()) {
@@ -369,46 +459,31 @@ int MDnsSdListener::stopDaemon() {
     return 0;
 }
 
-MDnsSdListener::Monitor::Monitor() {
-    mHead = nullptr;
-    mLiveCount = 0;
-    mPollFds = nullptr;
-    mPollRefs = nullptr;
-    mPollSize = 10;
-    socketpair(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, mCtrlSocketPair);
+namespace {
+
+// epollKey() of no element, since generations start at 1.
+constexpr uint64_t EXIT_EVENT_KEY = 0;
+constexpr int MAX_EPOLL_EVENTS = 32;
+constexpr std::chrono::seconds MDNS_SERVICE_STATUS_TIMEOUT(5);
+
+}  // namespace
 
-    mRescanThread = new std::thread(&Monitor::run, this);
-    if (!mRescanThread->joinable()) ALOGE("Unable to launch thread.");
+MDnsSdListener::Monitor::Monitor()
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC)), mExitEventFd(eventfd(0, EFD_CLOEXEC)) {
+    epoll_event event = {.events = EPOLLIN, .data = {.u64 = EXIT_EVENT_KEY}};
+    if (mEpollFd == -1 || mExitEventFd == -1 ||
+        epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mExitEventFd.get(), &event) == -1) {
+        ALOGE("Unable to set up epoll: %s", strerror(errno));
+    }
 }
 
 MDnsSdListener::Monitor::~Monitor() {
     if (VDBG) ALOGD("Monitor recycling");
-    close(mCtrlSocketPair[1]);  // interrupt poll in MDnsSdListener::Monitor::run() and revent will
-                                // be 17 = POLLIN | POLLHUP
-    mRescanThread->join();
-    delete mRescanThread;
+    const uint64_t exit = 1;
+    write(mExitEventFd.get(), &exit, sizeof(exit));
+    if (mMonitorThread.joinable()) mMonitorThread.join();
     if (VDBG) ALOGD("Monitor recycled");
 }
-#define NAP_TIME 200  // 200 ms between polls
-static int wait_for_property(const char *name, const char *desired_value, int maxwait)
-{
-    char value[PROPERTY_VALUE_MAX] = {'\0'};
-    int maxnaps = (maxwait * 1000) / NAP_TIME;
-
-    if (maxnaps < 1) {
-        maxnaps = 1;
-    }
-
-    while (maxnaps-- > 0) {
-        usleep(NAP_TIME * 1000);
-        if (property_get(name, value, nullptr)) {
-            if (desired_value == nullptr || strcmp(value, desired_value) == 0) {
-                return 0;
-            }
-        }
-    }
-    return -1; /* failure */
-}
 
 int MDnsSdListener::Monitor::startService() {
     char property_value[PROPERTY_VALUE_MAX];
@@ -417,7 +492,8 @@ int MDnsSdListener::Monitor::startService() {
     if (strcmp("running", property_value) != 0) {
         ALOGD("Starting MDNSD");
         property_set("ctl.start", MDNS_SERVICE_NAME);
-        wait_for_property(MDNS_SERVICE_STATUS, "running", 5);
+        android::base::WaitForProperty(MDNS_SERVICE_STATUS, "running",
+                                       MDNS_SERVICE_STATUS_TIMEOUT);
         return -1;
     }
     return 0;
@@ -425,193 +501,118 @@ int MDnsSdListener::Monitor::startService() {
 
 int MDnsSdListener::Monitor::stopService() {
     std::lock_guard guard(mMutex);
-    if (mHead == nullptr) {
+    if (mElements.empty()) {
         ALOGD("Stopping MDNSD");
         property_set("ctl.stop", MDNS_SERVICE_NAME);
-        wait_for_property(MDNS_SERVICE_STATUS, "stopped", 5);
+        android::base::WaitForProperty(MDNS_SERVICE_STATUS, "stopped",
+                                       MDNS_SERVICE_STATUS_TIMEOUT);
         return -1;
     }
     return 0;
 }
 
 void MDnsSdListener::Monitor::run() {
-    int pollCount = 1;
-
-    mPollFds = (struct pollfd *)calloc(sizeof(struct pollfd), mPollSize);
-    mPollRefs = (DNSServiceRef **)calloc(sizeof(DNSServiceRef *), mPollSize);
-    LOG_ALWAYS_FATAL_IF((mPollFds == nullptr), "initial calloc failed on mPollFds with a size of %d",
-            ((int)sizeof(struct pollfd)) * mPollSize);
-    LOG_ALWAYS_FATAL_IF((mPollRefs == nullptr), "initial calloc failed on mPollRefs with a size of %d",
-            ((int)sizeof(DNSServiceRef *)) * mPollSize);
-
-    mPollFds[0].fd = mCtrlSocketPair[0];
-    mPollFds[0].events = POLLIN;
+    epoll_event events[MAX_EPOLL_EVENTS];
 
     if (VDBG) ALOGD("MDnsSdListener starting to monitor");
     while (1) {
-        if (VDBG) ALOGD("Going to poll with pollCount %d", pollCount);
-        int pollResults = poll(mPollFds, pollCount, 10000000);
-        if (VDBG) ALOGD("pollResults=%d", pollResults);
-        if (pollResults < 0) {
-            ALOGE("Error in poll - got %d", errno);
-        } else if (pollResults > 0) {
-            if (VDBG) ALOGD("Monitor poll got data pollCount = %d, %d", pollCount, pollResults);
-            for(int i = 1; i < pollCount; i++) {
-                if (mPollFds[i].revents != 0) {
-                    if (VDBG) {
-                        ALOGD("Monitor found [%d].revents = %d - calling ProcessResults",
-                                i, mPollFds[i].revents);
-                    }
-                    std::lock_guard guard(mMutex);
-                    DNSServiceProcessResult(*(mPollRefs[i]));
-                    mPollFds[i].revents = 0;
-                }
-            }
-            if (VDBG) ALOGD("controlSocket shows revent= %d", mPollFds[0].revents);
-            if (mPollFds[0].revents & POLLHUP) {
-                free(mPollFds);
-                free(mPollRefs);
+        const int count =
+                TEMP_FAILURE_RETRY(epoll_wait(mEpollFd.get(), events, MAX_EPOLL_EVENTS, -1));
+        if (count < 0) {
+            ALOGE("Error in epoll_wait - got %d", errno);
+            return;
+        }
+        if (VDBG) ALOGD("Monitor epoll got %d events", count);
+        for (int i = 0; i < count; i++) {
+            const uint64_t key = events[i].data.u64;
+            if (key == EXIT_EVENT_KEY) {
                 if (VDBG) ALOGD("Monitor thread leaving.");
                 return;
             }
-            if (mPollFds[0].revents == POLLIN) {
-                char readBuf[2];
-                read(mCtrlSocketPair[0], &readBuf, 1);
-                if (DBG) ALOGD("MDnsSdListener::Monitor got %c", readBuf[0]);
-                if (memcmp(RESCAN, readBuf, 1) == 0) {
-                    pollCount = rescan();
-                }
+            std::lock_guard guard(mMutex);
+            const auto it = mElements.find(static_cast<int>(key >> 32));
+            if (it == mElements.end() || epollKey(*it->second) != key ||
+                it->second->mRef == nullptr) {
+                continue;
             }
-            mPollFds[0].revents = 0;
-        } else {
-            if (VDBG) ALOGD("MDnsSdListener::Monitor poll timed out");
+            if (VDBG) ALOGD("Monitor found events %d for %d", events[i].events, it->first);
+            DNSServiceProcessResult(it->second->mRef);
         }
     }
-    free(mPollFds);
-    free(mPollRefs);
 }
 
-#define DBG_RESCAN 0
-
-int MDnsSdListener::Monitor::rescan() {
-// rescan the list from mHead and make new pollfds and serviceRefs
-    if (VDBG) {
-        ALOGD("MDnsSdListener::Monitor poll rescanning - size=%d, live=%d", mPollSize, mLiveCount);
-    }
-    std::lock_guard guard(mMutex);
-    Element **prevPtr = &mHead;
-    int i = 1;
-    if (mPollSize <= mLiveCount) {
-        mPollSize = mLiveCount + 5;
-        free(mPollFds);
-        free(mPollRefs);
-        mPollFds = (struct pollfd *)calloc(sizeof(struct pollfd), mPollSize);
-        mPollRefs = (DNSServiceRef **)calloc(sizeof(DNSServiceRef *), mPollSize);
-        LOG_ALWAYS_FATAL_IF((mPollFds == nullptr), "calloc failed on mPollFds with a size of %d",
-                ((int)sizeof(struct pollfd)) * mPollSize);
-        LOG_ALWAYS_FATAL_IF((mPollRefs == nullptr), "calloc failed on mPollRefs with a size of %d",
-                ((int)sizeof(DNSServiceRef *)) * mPollSize);
-    } else {
-        memset(mPollFds, 0, sizeof(struct pollfd) * mPollSize);
-        memset(mPollRefs, 0, sizeof(DNSServiceRef *) * mPollSize);
-    }
-    mPollFds[0].fd = mCtrlSocketPair[0];
-    mPollFds[0].events = POLLIN;
-    if (DBG_RESCAN) ALOGD("mHead = %p", mHead);
-    while (*prevPtr != nullptr) {
-        if (DBG_RESCAN) ALOGD("checking %p, mReady = %d", *prevPtr, (*prevPtr)->mReady);
-        if ((*prevPtr)->mReady == 1) {
-            int fd = DNSServiceRefSockFD((*prevPtr)->mRef);
-            if (fd != -1) {
-                if (DBG_RESCAN) ALOGD("  adding FD %d", fd);
-                mPollFds[i].fd = fd;
-                mPollFds[i].events = POLLIN;
-                mPollRefs[i] = &((*prevPtr)->mRef);
-                i++;
-            } else {
-                ALOGE("Error retreving socket FD for live ServiceRef");
-            }
-            prevPtr = &((*prevPtr)->mNext); // advance to the next element
-        } else if ((*prevPtr)->mReady == -1) {
-            if (DBG_RESCAN) ALOGD("  removing %p from  play", *prevPtr);
-            Element *cur = *prevPtr;
-            *prevPtr = (cur)->mNext; // change our notion of this element and don't advance
-            delete cur;
-        } else if ((*prevPtr)->mReady == 0) {
-            // Not ready so just skip this node and continue on
-            if (DBG_RESCAN) ALOGD("%p not ready.  Continuing.", *prevPtr);
-            prevPtr = &((*prevPtr)->mNext);
-        }
+void MDnsSdListener::Monitor::unmonitorLocked(Element* e) {
+    if (!e->mMonitored) return;
+    e->mMonitored = false;
+    // A deallocated ref has closed its socket, which removed it from the epoll set.
+    if (e->mRef == nullptr) return;
+    const int fd = DNSServiceRefSockFD(e->mRef);
+    if (fd != -1 && epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, nullptr) == -1) {
+        ALOGE("Unable to stop monitoring %d: %s", e->mId, strerror(errno));
     }
-
-    return i;
 }
 
 DNSServiceRef *MDnsSdListener::Monitor::allocateServiceRef(int id, Context *context) {
-    if (lookupServiceRef(id) != nullptr) {
+    std::lock_guard guard(mMutex);
+    // A single hash lookup both checks that the id is free and claims it.
+    const auto [it, inserted] = mElements.try_emplace(id);
+    if (!inserted) {
         delete(context);
         return nullptr;
     }
-    Element *e = new Element(id, context);
-    std::lock_guard guard(mMutex);
-    e->mNext = mHead;
-    mHead = e;
-    return &(e->mRef);
+    if (++mLastGeneration == 0) ++mLastGeneration;
+    it->second = std::make_unique<Element>(id, mLastGeneration, context);
+    return &(it->second->mRef);
 }
 
 DNSServiceRef *MDnsSdListener::Monitor::lookupServiceRef(int id) {
     std::lock_guard guard(mMutex);
-    Element *cur = mHead;
-    while (cur != nullptr) {
-        if (cur->mId == id) {
-            DNSServiceRef *result = &(cur->mRef);
-            return result;
-        }
-        cur = cur->mNext;
-    }
-    return nullptr;
+    const auto it = mElements.find(id);
+    return (it != mElements.end()) ? &(it->second->mRef) : nullptr;
 }
 
 void MDnsSdListener::Monitor::startMonitoring(int id) {
     if (VDBG) ALOGD("startMonitoring %d", id);
+    // Events that arrive before the thread runs wait in the epoll set.
+    std::call_once(mMonitorThreadStarted,
+                   [this] { mMonitorThread = std::thread(&Monitor::run, this); });
     std::lock_guard guard(mMutex);
-    for (Element* cur = mHead; cur != nullptr; cur = cur->mNext) {
-        if (cur->mId == id) {
-            if (DBG_RESCAN) ALOGD("marking %p as ready to be added", cur);
-            mLiveCount++;
-            cur->mReady = 1;
-            write(mCtrlSocketPair[1], RESCAN, 1);  // trigger a rescan for a fresh poll
-            if (VDBG) ALOGD("triggering rescan");
-            return;
-        }
+    const auto it = mElements.find(id);
+    if (it == mElements.end()) return;
+    Element& e = *it->second;
+    const int fd = DNSServiceRefSockFD(e.mRef);
+    if (fd == -1) {
+        ALOGE("Error retrieving socket FD for live ServiceRef");
+        return;
     }
+    epoll_event event = {.events = EPOLLIN, .data = {.u64 = epollKey(e)}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+        ALOGE("Unable to monitor %d: %s", id, strerror(errno));
+        return;
+    }
+    e.mMonitored = true;
 }
 
 void MDnsSdListener::Monitor::freeServiceRef(int id) {
     if (VDBG) ALOGD("freeServiceRef %d", id);
     std::lock_guard guard(mMutex);
-    Element* cur;
-    for (Element** prevPtr = &mHead; *prevPtr != nullptr; prevPtr = &(cur->mNext)) {
-        cur = *prevPtr;
-        if (cur->mId == id) {
-            if (DBG_RESCAN) ALOGD("marking %p as ready to be removed", cur);
-            mLiveCount--;
-            if (cur->mReady == 1) {
-                cur->mReady = -1; // tell poll thread to delete
-                cur->mRef = nullptr; // do not process further results
-                write(mCtrlSocketPair[1], RESCAN, 1); // trigger a rescan for a fresh poll
-                if (VDBG) ALOGD("triggering rescan");
-            } else {
-                *prevPtr = cur->mNext;
-                delete cur;
-            }
-            return;
-        }
-    }
+    const auto it = mElements.find(id);
+    if (it == mElements.end()) return;
+    // run() processes results while holding mMutex, so the element can go right away.
+    unmonitorLocked(it->second.get());
+    mElements.erase(it);
 }
 
 void MDnsSdListener::Monitor::deallocateServiceRef(DNSServiceRef* ref) {
     std::lock_guard guard(mMutex);
+    // Stop monitoring the socket before it is closed and its number possibly reused.
+    const int fd = DNSServiceRefSockFD(*ref);
+    if (fd != -1) epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
     DNSServiceRefDeallocate(*ref);
     *ref = nullptr;
 }
+
+MDnsLatencyStats& MDnsSdListener::getLatencyStats() {
+    static MDnsLatencyStats stats;
+    return stats;
+}
@@ -18,12 +18,21 @@
 #define _MDNSSDLISTENER_H__
 
 #include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <android/net/mdns/aidl/IMDnsEventListener.h>
 #include <dns_sd.h>
 #include <sysutils/FrameworkListener.h>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
+#include "MDnsLatencyStats.h"
 #include "NetdCommand.h"
 
 // callbacks
@@ -55,13 +64,38 @@ class MDnsSdListener {
     class Context {
       public:
         int mRefNumber;
+        // Set for a browse shared by several discover requests, whose results are fanned out by
+        // onSharedBrowseResult().
+        MDnsSdListener* mListener;
+
+        Context(int refNumber, android::net::MDnsLatencyStats::Operation operation,
+                MDnsSdListener* listener = nullptr)
+            : mOperation(operation), mStartTime(std::chrono::steady_clock::now()) {
+            mRefNumber = refNumber;
+            mListener = listener;
+        }
 
-        Context(int refNumber) { mRefNumber = refNumber; }
+        // Records the time since the operation started, the first time it is called.
+        void recordLatency() {
+            if (mLatencyRecorded) return;
+            mLatencyRecorded = true;
+            getLatencyStats().record(mOperation,
+                                     std::chrono::duration_cast<std::chrono::microseconds>(
+                                             std::chrono::steady_clock::now() - mStartTime));
+        }
 
         ~Context() {
         }
+
+      private:
+        const android::net::MDnsLatencyStats::Operation mOperation;
+        const std::chrono::steady_clock::time_point mStartTime;
+        bool mLatencyRecorded = false;
     };
 
+    // The latencies of the operations of every MDnsSdListener.
+    static android::net::MDnsLatencyStats& getLatencyStats();
+
     int stop(int requestId);
 
     int discover(uint32_t ifIndex, const char* regType, const char* domain, const int requestId,
@@ -80,7 +114,37 @@ class MDnsSdListener {
 
     int stopDaemon();
 
+    // Reports a discovery result of the browse that the Monitor knows as |browseId| to every
+    // discover request that shares it.
+    void onSharedBrowseResult(int browseId, const android::net::mdns::aidl::DiscoveryInfo& info)
+            EXCLUDES(mBrowseMutex);
+
   private:
+    // Discover requests with the same interface, type, domain and flags share one
+    // DNSServiceBrowse, so mdnsd only browses once for all of them.
+    using BrowseKey = std::tuple<uint32_t, std::string, std::string, int>;
+    using FoundKey = std::tuple<std::string, std::string, int>;
+    struct SharedBrowse {
+        BrowseKey key;
+        std::vector<int> requestIds;
+        // The services found and not lost yet, which are reported to requests that join later.
+        std::map<FoundKey, android::net::mdns::aidl::DiscoveryInfo> found;
+    };
+
+    // Returns false if |requestId| is not a discover request.
+    bool stopDiscover(int requestId) EXCLUDES(mDiscoverMutex, mBrowseMutex);
+
+    // Serializes starting and stopping discover requests. Taken before the Monitor's lock, while
+    // mBrowseMutex is taken after it, by the callbacks, so the Monitor is never called with
+    // mBrowseMutex held.
+    std::mutex mDiscoverMutex;
+    // Shared browses are known to the Monitor by negative ids, which no request uses.
+    int mLastBrowseId GUARDED_BY(mDiscoverMutex) = 0;
+    std::mutex mBrowseMutex;
+    std::map<int, SharedBrowse> mBrowses GUARDED_BY(mBrowseMutex);
+    std::map<BrowseKey, int> mBrowseIds GUARDED_BY(mBrowseMutex);
+    std::unordered_map<int, int> mBrowseOfRequest GUARDED_BY(mBrowseMutex);
+
     class Monitor {
     public:
         Monitor();
@@ -96,26 +160,38 @@ class MDnsSdListener {
         std::string threadName() { return std::string("MDnsSdMonitor"); }
 
       private:
-        int rescan(); // returns the number of elements in the poll
-
         struct Element {
-            Element(int id, Context* context) : mId(id), mContext(context) {}
+            Element(int id, uint32_t generation, Context* context)
+                : mId(id), mGeneration(generation), mContext(context) {}
             ~Element() { delete mContext; }
 
             int mId;
-            Element* mNext = nullptr;
+            // Tells this element apart from a freed one with the same id.
+            uint32_t mGeneration;
             DNSServiceRef mRef = nullptr;
             Context *mContext;
-            int mReady = 0;
+            // Whether the socket of mRef is registered with mEpollFd.
+            bool mMonitored = false;
         };
-        Element* mHead GUARDED_BY(mMutex);
-        int mLiveCount;
-        struct pollfd *mPollFds;
-        DNSServiceRef **mPollRefs;
-        int mPollSize;
-        int mCtrlSocketPair[2];
+
+        // The epoll data of a monitored socket. Events read from epoll in the same batch as the
+        // socket is removed are ignored, because no element matches the key any more.
+        static uint64_t epollKey(const Element& e) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(e.mId)) << 32) | e.mGeneration;
+        }
+        void unmonitorLocked(Element* e) REQUIRES(mMutex);
+
+        std::unordered_map<int, std::unique_ptr<Element>> mElements GUARDED_BY(mMutex);
+        uint32_t mLastGeneration GUARDED_BY(mMutex) = 0;
+        // Sockets are added to and removed from the set directly by the threads that start and
+        // stop requests, while run() waits on it.
+        android::base::unique_fd mEpollFd;
+        // Written by the destructor to make run() return.
+        android::base::unique_fd mExitEventFd;
         std::mutex mMutex;
-        std::thread* mRescanThread;
+        // Started by the first startMonitoring(), since many devices never use NSD.
+        std::once_flag mMonitorThreadStarted;
+        std::thread mMonitorThread;
     };
     Monitor mMonitor;
 };
@@ -18,11 +18,13 @@
 
 #include "MDnsService.h"
 
+#include "Controllers.h"
 #include "binder_utils/BinderUtil.h"
 #include "binder_utils/NetdPermissions.h"
 
 #include <android-base/strings.h>
 #include <binder/Status.h>
+#include <netdutils/DumpWriter.h>
 
 #include <string>
 #include <vector>
@@ -32,6 +34,7 @@ using android::net::mdns::aidl::GetAddressInfo;
 using android::net::mdns::aidl::IMDnsEventListener;
 using android::net::mdns::aidl::RegistrationInfo;
 using android::net::mdns::aidl::ResolutionInfo;
+using android::netdutils::DumpWriter;
 
 namespace android::net {
 
@@ -59,48 +62,62 @@ status_t MDnsService::start() {
 
 binder::Status MDnsService::startDaemon() {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__);
     int res = mListener.startDaemon();
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::stopDaemon() {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__);
     int res = mListener.stopDaemon();
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::registerService(const RegistrationInfo& info) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(info.id);
     int res = mListener.serviceRegister(
             info.id, info.serviceName.c_str(), info.registrationType.c_str(), nullptr /* domain */,
             nullptr /* host */, info.port, info.txtRecord, info.interfaceIdx);
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::discover(const DiscoveryInfo& info) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(info.id);
     int res = mListener.discover(info.interfaceIdx, info.registrationType.c_str(),
                                  nullptr /* domain */, info.id, 0 /* requestFlags */);
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::resolve(const ResolutionInfo& info) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(info.id);
     int res = mListener.resolveService(info.id, info.interfaceIdx, info.serviceName.c_str(),
                                        info.registrationType.c_str(), info.domain.c_str());
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::getServiceAddress(const GetAddressInfo& info) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(info.id);
     int res = mListener.getAddrInfo(info.id, info.interfaceIdx, 0 /* protocol */,
                                     info.hostname.c_str());
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
 binder::Status MDnsService::stopOperation(int32_t id) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
+    auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(id);
     int res = mListener.stop(id);
+    gLog.log(entry.returns(res).withAutomaticDuration());
     return statusFromErrcode(res);
 }
 
@@ -117,4 +134,20 @@ binder::Status MDnsService::unregisterEventListener(
     return statusFromErrcode(res);
 }
 
+status_t MDnsService::dump(int fd, const Vector<String16>& /* args */) {
+    const binder::Status dump_permission = checkAnyPermission({PERM_DUMP});
+    if (!dump_permission.isOk()) {
+        const String8 msg(dump_permission.toString8());
+        write(fd, msg.string(), msg.size());
+        return PERMISSION_DENIED;
+    }
+
+    DumpWriter dw(fd);
+    dw.println("MDnsService");
+    dw.incIndent();
+    MDnsSdListener::getLatencyStats().dump(dw);
+    dw.decIndent();
+    return NO_ERROR;
+}
+
 }  // namespace android::net
@@ -29,6 +29,8 @@ class MDnsService : public BinderService<MDnsService>, public android::net::mdns
     static status_t start();
     static char const* getServiceName() { return "mdns"; }
 
+    status_t dump(int fd, const Vector<String16>& args) override;
+
     binder::Status startDaemon() override;
     binder::Status stopDaemon() override;
     binder::Status registerService(
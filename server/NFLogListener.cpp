@@ -28,6 +28,7 @@
 #include <netdutils/Syscalls.h>
 
 #include "NFLogListener.h"
+#include "ThreadScheduling.h"
 
 namespace android {
 namespace net {
@@ -141,16 +142,40 @@ Status cfgCmdUnbind(const SendFn& send, uint16_t nfLogGroup) {
     return send(makeSlice(msg));
 }
 
+// Set a 32-bit configuration attribute, e.g. NFULA_CFG_QTHRESH, for nfLogGroup.
+Status cfgU32(const SendFn& send, uint16_t nfLogGroup, uint16_t type, uint32_t value) {
+    struct {
+        nlmsghdr nlhdr;
+        nfgenmsg nfhdr;
+        nfattr attr;
+        uint32_t value;
+    } __attribute__((packed)) msg = {};
+
+    msg.nlhdr.nlmsg_len = sizeof(msg);
+    msg.nlhdr.nlmsg_type = kNFLogConfigMsgType;
+    msg.nlhdr.nlmsg_flags = NLM_F_REQUEST;
+    msg.nfhdr.nfgen_family = AF_UNSPEC;
+    msg.nfhdr.res_id = htons(nfLogGroup);
+    msg.attr.nfa_len = sizeof(msg.attr) + sizeof(msg.value);
+    msg.attr.nfa_type = type;
+    msg.value = htonl(value);
+    return send(makeSlice(msg));
+}
+
 }  // namespace
 
-NFLogListener::NFLogListener(std::shared_ptr<NetlinkListenerInterface> listener)
-    : mListener(std::move(listener)) {
+NFLogListener::NFLogListener(std::shared_ptr<NetlinkListenerInterface> listener, int sockFd)
+    : mListener(std::move(listener)),
+      mSockFd(sockFd),
+      mDispatchMap(std::make_shared<const DispatchMap>()) {
     // Rx handler extracts nfgenmsg looks up and invokes registered dispatch function.
     const auto rxHandler = [this](const nlmsghdr& nlmsg, const Slice msg) {
+        ThreadScheduling::applyToCurrentThread(ThreadRole::NFLOG);
         nfgenmsg nfmsg = {};
         extract(msg, nfmsg);
-        std::lock_guard guard(mMutex);
-        const auto& fn = findWithDefault(mDispatchMap, ntohs(nfmsg.res_id), kDefaultDispatchFn);
+        // The snapshot keeps fn alive even if it is unsubscribed while it runs.
+        const auto dispatchMap = std::atomic_load(&mDispatchMap);
+        const auto& fn = findWithDefault(*dispatchMap, ntohs(nfmsg.res_id), kDefaultDispatchFn);
         fn(nlmsg, nfmsg, drop(msg, sizeof(nfmsg)));
     };
     expectOk(mListener->subscribe(kNFLogPacketMsgType, rxHandler));
@@ -169,7 +194,7 @@ NFLogListener::~NFLogListener() {
     expectOk(mListener->unsubscribe(kNFLogPacketMsgType));
     expectOk(mListener->unsubscribe(kNetlinkDoneMsgType));
     const auto sendFn = [this](const Slice msg) { return mListener->send(msg); };
-    for (const auto& [key, value] : mDispatchMap) {
+    for (const auto& [key, value] : *mDispatchMap) {
         expectOk(cfgCmdUnbind(sendFn, key));
     }
 }
@@ -180,17 +205,50 @@ Status NFLogListener::subscribe(uint16_t nfLogGroup, const DispatchFn& fn) {
 
 Status NFLogListener::subscribe(
         uint16_t nfLogGroup, uint32_t copyRange, const DispatchFn& fn) {
+    return subscribe(nfLogGroup, SubscribeOptions{.copyRange = copyRange}, fn);
+}
+
+Status NFLogListener::growRcvBufLocked(int size) {
+    if (size <= mRcvBufSize) return ok;
+    if (mSockFd < 0) return netdutils::statusFromErrno(EBADF, "No socket to set SO_RCVBUF on");
+    const auto& sys = sSyscalls.get();
+    const netdutils::Fd sock(mSockFd);
+    // SO_RCVBUFFORCE fails without CAP_NET_ADMIN, e.g. in a user namespace.
+    if (!isOk(sys.setsockopt<int32_t>(sock, SOL_SOCKET, SO_RCVBUFFORCE, size))) {
+        RETURN_IF_NOT_OK(sys.setsockopt<int32_t>(sock, SOL_SOCKET, SO_RCVBUF, size));
+    }
+    mRcvBufSize = size;
+    return ok;
+}
+
+Status NFLogListener::subscribe(uint16_t nfLogGroup, const SubscribeOptions& options,
+                                const DispatchFn& fn) {
     const auto sendFn = [this](const Slice msg) { return mListener->send(msg); };
     // Install fn into the dispatch map BEFORE requesting delivery of messages
     {
         std::lock_guard guard(mMutex);
-        mDispatchMap[nfLogGroup] = fn;
+        if (options.rcvBufSize > 0) {
+            RETURN_IF_NOT_OK(growRcvBufLocked(options.rcvBufSize));
+        }
+        auto next = std::make_shared<DispatchMap>(*mDispatchMap);
+        (*next)[nfLogGroup] = fn;
+        std::atomic_store(&mDispatchMap, std::shared_ptr<const DispatchMap>(std::move(next)));
     }
     RETURN_IF_NOT_OK(cfgCmdBind(sendFn, nfLogGroup));
 
     // Mode must be set for every nfLogGroup
-    const uint8_t copyMode = copyRange > 0 ? NFULNL_COPY_PACKET : NFULNL_COPY_NONE;
-    return cfgMode(sendFn, nfLogGroup, copyRange, copyMode);
+    const uint8_t copyMode = options.copyRange > 0 ? NFULNL_COPY_PACKET : NFULNL_COPY_NONE;
+    RETURN_IF_NOT_OK(cfgMode(sendFn, nfLogGroup, options.copyRange, copyMode));
+
+    if (options.queueThreshold > 0) {
+        RETURN_IF_NOT_OK(cfgU32(sendFn, nfLogGroup, NFULA_CFG_QTHRESH, options.queueThreshold));
+    }
+    if (options.flushTimeout.count() > 0) {
+        // Round up, so that a timeout below 10ms does not become 0.
+        const uint32_t timeoutCs = (options.flushTimeout.count() + 9) / 10;
+        RETURN_IF_NOT_OK(cfgU32(sendFn, nfLogGroup, NFULA_CFG_TIMEOUT, timeoutCs));
+    }
+    return ok;
 }
 
 Status NFLogListener::unsubscribe(uint16_t nfLogGroup) {
@@ -199,7 +257,9 @@ Status NFLogListener::unsubscribe(uint16_t nfLogGroup) {
     // Remove from the dispatch map AFTER stopping message delivery.
     {
         std::lock_guard guard(mMutex);
-        mDispatchMap.erase(nfLogGroup);
+        auto next = std::make_shared<DispatchMap>(*mDispatchMap);
+        next->erase(nfLogGroup);
+        std::atomic_store(&mDispatchMap, std::shared_ptr<const DispatchMap>(std::move(next)));
     }
     return ok;
 }
@@ -215,11 +275,12 @@ StatusOr<std::unique_ptr<NFLogListener>> makeNFLogListener() {
     // Timestamps are disabled by default. Request RX timestamping
     RETURN_IF_NOT_OK(sys.setsockopt<int32_t>(sock, SOL_SOCKET, SO_TIMESTAMP, 1));
 
+    const int sockFd = sock.get().get();
     std::shared_ptr<NetlinkListenerInterface> listener =
             std::make_unique<NetlinkListener>(std::move(event), std::move(sock), "NFLogListener");
     const auto sendFn = [&listener](const Slice msg) { return listener->send(msg); };
     RETURN_IF_NOT_OK(cfgCmdPfUnbind(sendFn));
-    return std::unique_ptr<NFLogListener>(new NFLogListener(std::move(listener)));
+    return std::unique_ptr<NFLogListener>(new NFLogListener(std::move(listener), sockFd));
 }
 
 }  // namespace net
@@ -17,6 +17,11 @@
 #ifndef NFLOG_LISTENER_H
 #define NFLOG_LISTENER_H
 
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+
 #include <netdutils/Netfilter.h>
 
 #include "netdutils/NetlinkListener.h"
@@ -31,6 +36,19 @@ class NFLogListenerInterface {
         std::function<void(const nlmsghdr& nlmsg, const nfgenmsg& nfmsg,
                            const netdutils::Slice msg)>;
 
+    struct SubscribeOptions {
+        // Maximum bytes of each packet to deliver. 0 delivers no payload.
+        uint32_t copyRange = 0;
+        // Number of packets the kernel may queue before sending them together (NFULA_CFG_QTHRESH).
+        // 0 keeps the kernel default.
+        uint32_t queueThreshold = 0;
+        // Longest a queued packet may wait to be sent (NFULA_CFG_TIMEOUT). The kernel counts in
+        // hundredths of a second. 0 keeps the kernel default.
+        std::chrono::milliseconds flushTimeout{0};
+        // Minimum receive buffer of the shared socket, in bytes. 0 leaves it unchanged.
+        int rcvBufSize = 0;
+    };
+
     virtual ~NFLogListenerInterface() = default;
 
     // Similar to NetlinkListener::subscribe() but performs an additional
@@ -46,6 +64,11 @@ class NFLogListenerInterface {
     virtual netdutils::Status subscribe(
             uint16_t nfLogGroup, uint32_t copyRange, const DispatchFn& fn) = 0;
 
+    // Overloaded version of subscribe which also lets the kernel batch packets, trading some
+    // delivery latency for fewer wakeups of the service thread under bursts of packets.
+    virtual netdutils::Status subscribe(uint16_t nfLogGroup, const SubscribeOptions& options,
+                                        const DispatchFn& fn) = 0;
+
     // Halt delivery of messages from a nfLogGroup previously subscribed to above.
     //
     // Threadsafe.
@@ -63,8 +86,9 @@ class NFLogListener : public NFLogListenerInterface {
     using DispatchFn = NFLogListenerInterface::DispatchFn;
 
     // Do not invoke this constructor directly outside of tests. Use
-    // makeNFLogListener() instead.
-    NFLogListener(std::shared_ptr<netdutils::NetlinkListenerInterface> listener);
+    // makeNFLogListener() instead. |sockFd| is the listener's socket, which it owns, or -1 if
+    // SubscribeOptions::rcvBufSize cannot be applied.
+    NFLogListener(std::shared_ptr<netdutils::NetlinkListenerInterface> listener, int sockFd = -1);
 
     ~NFLogListener() override;
 
@@ -73,12 +97,25 @@ class NFLogListener : public NFLogListenerInterface {
     netdutils::Status subscribe(
             uint16_t nfLogGroup, uint32_t copyRange, const DispatchFn& fn) override;
 
+    netdutils::Status subscribe(uint16_t nfLogGroup, const SubscribeOptions& options,
+                                const DispatchFn& fn) override;
+
     netdutils::Status unsubscribe(uint16_t nfLogGroup) override;
 
   private:
+    using DispatchMap = std::map<uint16_t, DispatchFn>;
+
+    netdutils::Status growRcvBufLocked(int size);
+
     std::shared_ptr<netdutils::NetlinkListenerInterface> mListener;
+    const int mSockFd;
+    // Serializes subscribe() and unsubscribe().
     std::mutex mMutex;
-    std::map<uint16_t, DispatchFn> mDispatchMap;  // guarded by mMutex
+    int mRcvBufSize = 0;  // guarded by mMutex
+    // Replaced, never modified, while holding mMutex. Read with std::atomic_load, so that the
+    // receive path never waits for subscribe() or unsubscribe(), and they never wait for a
+    // dispatch function to return.
+    std::shared_ptr<const DispatchMap> mDispatchMap;
 };
 
 // Allocate and return a new NFLogListener. On success, the returned
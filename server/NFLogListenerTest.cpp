@@ -18,6 +18,7 @@
 #include <deque>
 #include <iostream>
 #include <mutex>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <gmock/gmock.h>
@@ -138,5 +139,79 @@ TEST_F(NFLogListenerTest, dispatchUnknownType) {
     sendEmptyMsg(kBadType);
 }
 
+TEST_F(NFLogListenerTest, unsubscribeStopsDispatch) {
+    int invocations = 0;
+    constexpr uint16_t kType = 38;
+    const auto dispatchFn = [&invocations](const nlmsghdr&, const nfgenmsg&, const Slice) {
+        ++invocations;
+    };
+    // Two sends for cfgCmdBind() & cfgMode(), one for cfgCmdUnbind().
+    EXPECT_CALL(*mNLListener, send(_)).Times(Exactly(3)).WillRepeatedly(Invoke(sendOk));
+    EXPECT_OK(mListener->subscribe(kType, dispatchFn));
+    sendEmptyMsg(kType);
+    EXPECT_OK(mListener->unsubscribe(kType));
+    sendEmptyMsg(kType);
+    EXPECT_EQ(1, invocations);
+}
+
+TEST_F(NFLogListenerTest, unsubscribeFromDispatchFn) {
+    int invocations = 0;
+    constexpr uint16_t kType = 38;
+    // The dispatch function stays alive while it runs, even once it has been unsubscribed.
+    const auto dispatchFn = [this, &invocations, kType](const nlmsghdr&, const nfgenmsg&,
+                                                        const Slice) {
+        ++invocations;
+        EXPECT_OK(mListener->unsubscribe(kType));
+    };
+    EXPECT_CALL(*mNLListener, send(_)).Times(Exactly(3)).WillRepeatedly(Invoke(sendOk));
+    EXPECT_OK(mListener->subscribe(kType, dispatchFn));
+    sendEmptyMsg(kType);
+    sendEmptyMsg(kType);
+    EXPECT_EQ(1, invocations);
+}
+
+TEST_F(NFLogListenerTest, subscribeWithBatching) {
+    constexpr uint16_t kType = 38;
+    struct CfgU32 {
+        nlmsghdr nlhdr;
+        nfgenmsg nfhdr;
+        nfattr attr;
+        uint32_t value;
+    } __attribute__((packed));
+    std::vector<CfgU32> sent;
+    const auto saveSend = [&sent](const Slice buf) -> StatusOr<size_t> {
+        CfgU32 msg = {};
+        if (buf.size() == sizeof(msg)) {
+            extract(buf, msg);
+            sent.push_back(msg);
+        }
+        return buf.size();
+    };
+    // cfgCmdBind(), cfgMode(), the two batching attributes, and cfgCmdUnbind() at destruction.
+    EXPECT_CALL(*mNLListener, send(_)).Times(Exactly(5)).WillRepeatedly(Invoke(saveSend));
+
+    const NFLogListener::SubscribeOptions options = {
+            .copyRange = 128,
+            .queueThreshold = 32,
+            .flushTimeout = std::chrono::milliseconds(25),
+    };
+    EXPECT_OK(mListener->subscribe(kType, options, [](const nlmsghdr&, const nfgenmsg&,
+                                                      const Slice) {}));
+
+    ASSERT_EQ(2U, sent.size());
+    EXPECT_EQ(NFULA_CFG_QTHRESH, sent[0].attr.nfa_type);
+    EXPECT_EQ(32U, ntohl(sent[0].value));
+    EXPECT_EQ(kType, ntohs(sent[0].nfhdr.res_id));
+    EXPECT_EQ(NFULA_CFG_TIMEOUT, sent[1].attr.nfa_type);
+    EXPECT_EQ(3U, ntohl(sent[1].value));  // Rounded up to hundredths of a second.
+}
+
+TEST_F(NFLogListenerTest, subscribeRcvBufWithoutSocket) {
+    constexpr uint16_t kType = 38;
+    const NFLogListener::SubscribeOptions options = {.rcvBufSize = 1 << 20};
+    EXPECT_FALSE(isOk(mListener->subscribe(kType, options, [](const nlmsghdr&, const nfgenmsg&,
+                                                              const Slice) {})));
+}
+
 }  // namespace net
 }  // namespace android
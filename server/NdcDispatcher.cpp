@@ -27,6 +27,7 @@
 #include <sys/types.h>
 
 #include <cinttypes>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -138,6 +139,11 @@ NdcDispatcher::NdcDispatcher() {
     registerCmd(new FirewallCmd());
     registerCmd(new NetworkCommand());
     registerCmd(new StrictCmd());
+
+    sp<IBinder> binderOemNetd;
+    if (mNetd->getOemNetd(&binderOemNetd).isOk() && binderOemNetd != nullptr) {
+        mOemNetd = interface_cast<com::android::internal::net::IOemNetd>(binderOemNetd);
+    }
 }
 
 void NdcDispatcher::registerCmd(NdcNetdCommand* cmd) {
@@ -161,6 +167,121 @@ int NdcDispatcher::dispatchCommand(int argc, char** argv) {
     return 0;
 }
 
+int NdcDispatcher::dispatchArgs(std::vector<std::string> args) {
+    std::vector<char*> argv;
+    for (auto& arg : args) argv.push_back(arg.data());
+    return dispatchCommand(argv.size(), argv.data());
+}
+
+int NdcDispatcher::dispatchBatch(FILE* in) {
+    PendingBatch batch;
+    char* line = nullptr;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        std::istringstream stream(line);
+        std::vector<std::string> args;
+        for (std::string arg; stream >> arg;) args.push_back(arg);
+        if (args.empty() || args[0][0] == '#') continue;
+
+        NetworkTopologyOperation op;
+        if (mOemNetd == nullptr || !toTopologyOperation(args, &op)) {
+            flushBatch(&batch);
+            dispatchArgs(std::move(args));
+            continue;
+        }
+        batch.commands.push_back(std::move(args));
+        batch.operations.push_back(std::move(op));
+        if (batch.operations.size() == MAX_BATCH_SIZE) flushBatch(&batch);
+    }
+    free(line);
+    flushBatch(&batch);
+    return 0;
+}
+
+void NdcDispatcher::flushBatch(PendingBatch* batch) {
+    if (batch->operations.empty()) return;
+
+    NetworkTopologyResult result;
+    const Status status = mOemNetd->applyNetworkTopology(batch->operations, &result);
+    if (!status.isOk()) {
+        // Rejected as a whole, so none of the commands took effect. Run them alone, so that each
+        // gets the same response as without batching.
+        for (auto& command : batch->commands) {
+            dispatchArgs(std::move(command));
+        }
+    } else if (result.error != 0 &&
+               static_cast<size_t>(result.failedIndex) >= batch->commands.size()) {
+        // Which commands took effect is unknown. Some of the commands after the failed one may
+        // already be applied, so running them again could fail although they took effect.
+        for (size_t i = 0; i < batch->commands.size(); i++) {
+            errno = result.error;
+            mNdc.sendMsg(ResponseCode::OperationFailed, "applyNetworkTopology() failed", true);
+        }
+    } else {
+        // The transaction stops at the first operation that fails. Operations before it are
+        // applied, and operations after it are not.
+        const size_t failed = result.error ? result.failedIndex : batch->commands.size();
+        for (size_t i = 0; i < failed; i++) {
+            mNdc.sendMsg(ResponseCode::CommandOkay, "success", false);
+        }
+        // Run the rest alone, starting with the one that failed so that it gets the same error
+        // as without batching.
+        for (size_t i = failed; i < batch->commands.size(); i++) {
+            dispatchArgs(std::move(batch->commands[i]));
+        }
+    }
+    batch->commands.clear();
+    batch->operations.clear();
+}
+
+bool NdcDispatcher::toTopologyOperation(const std::vector<std::string>& args,
+                                        NetworkTopologyOperation* op) {
+    if (args.size() < 5 || args[0] != "network") return false;
+    const bool add = args[2] == "add";
+    if (!add && args[2] != "remove") return false;
+    op->netId = stringToNetId(args[3].c_str());
+
+    //    0      1      2       3         4            5           6
+    // network route  add    <netId> <interface> <destination> [nexthop]
+    if (args[1] == "route") {
+        if (args.size() < 6 || args.size() > 7) return false;
+        op->type = add ? NetworkTopologyOperation::ADD_ROUTE
+                       : NetworkTopologyOperation::REMOVE_ROUTE;
+        op->ifName = args[4];
+        op->destination = args[5];
+        op->nextHop = args.size() == 7 ? args[6] : "";
+        return true;
+    }
+
+    //    0        1       2       3         4
+    // network interface  add   <netId> <interface>
+    if (args[1] == "interface") {
+        if (args.size() != 5) return false;
+        op->type = add ? NetworkTopologyOperation::ADD_INTERFACE
+                       : NetworkTopologyOperation::REMOVE_INTERFACE;
+        op->ifName = args[4];
+        return true;
+    }
+
+    //    0      1     2       3           4
+    // network users  add   <netId> [<uid>[-<uid>]] ...
+    if (args[1] == "users") {
+        std::vector<std::string> uidArgs(args.begin() + 4, args.end());
+        std::vector<char*> argv;
+        for (auto& arg : uidArgs) argv.push_back(arg.data());
+        UidRanges uidRanges;
+        if (!uidRanges.parseFrom(argv.size(), argv.data())) return false;
+        op->type = add ? NetworkTopologyOperation::ADD_UID_RANGES
+                       : NetworkTopologyOperation::REMOVE_UID_RANGES;
+        for (const auto& range : uidRanges.getRanges()) {
+            op->uidRanges.push_back(range.start);
+            op->uidRanges.push_back(range.stop);
+        }
+        return true;
+    }
+    return false;
+}
+
 NdcDispatcher::InterfaceCmd::InterfaceCmd() : NdcNetdCommand("interface") {}
 
 int NdcDispatcher::InterfaceCmd::runCommand(NdcClient* cli, int argc, char** argv) const {
@@ -17,12 +17,16 @@
 #ifndef _NDC_DISPATCHER_H__
 #define _NDC_DISPATCHER_H__
 
+#include <stdio.h>
+
 #include <string>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android/net/IDnsResolver.h>
 #include <android/net/INetd.h>
 #include "binder/IServiceManager.h"
+#include "com/android/internal/net/IOemNetd.h"
 
 #include "NetdConstants.h"
 
@@ -74,8 +78,30 @@ class NdcDispatcher {
     int dispatchCommand(int argc, char** argv);
     void registerCmd(NdcNetdCommand* cmd);
 
+    // Runs the commands in |in|, one per line, with the same output as running them one by one.
+    // Blank lines and lines starting with '#' are skipped. Consecutive commands that change
+    // network routes, interfaces or UID ranges are sent to netd as one topology transaction.
+    int dispatchBatch(FILE* in);
+
   private:
+    using NetworkTopologyOperation = com::android::internal::net::NetworkTopologyOperation;
+    using NetworkTopologyResult = com::android::internal::net::NetworkTopologyResult;
+
+    // Commands that are only run when the next command cannot join them, or at the end of input.
+    struct PendingBatch {
+        std::vector<std::vector<std::string>> commands;
+        std::vector<NetworkTopologyOperation> operations;
+    };
+    static constexpr size_t MAX_BATCH_SIZE = 256;
+
+    int dispatchArgs(std::vector<std::string> args);
+    void flushBatch(PendingBatch* batch);
+    static bool toTopologyOperation(const std::vector<std::string>& args,
+                                    NetworkTopologyOperation* op);
+
     std::vector<NdcNetdCommand*> mCommands;
+    // Null if netd does not implement IOemNetd, in which case batches are run one by one.
+    sp<com::android::internal::net::IOemNetd> mOemNetd;
 
     class InterfaceCmd : public NdcNetdCommand {
       public:
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "NetdMetrics.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+struct Entry {
+    const char* name;
+    NetdMetrics::Type type;
+    const void* metric;
+};
+
+struct Registry {
+    std::mutex lock;
+    std::vector<Entry> entries GUARDED_BY(lock);
+};
+
+// Metrics are static objects in many translation units, so the registry must exist before the
+// first of them is constructed, whichever that is.
+Registry& registry() {
+    static Registry* const sRegistry = new Registry();
+    return *sRegistry;
+}
+
+void registerMetric(const char* name, NetdMetrics::Type type, const void* metric) {
+    Registry& r = registry();
+    std::lock_guard guard(r.lock);
+    r.entries.push_back({name, type, metric});
+}
+
+std::atomic_size_t sNextShard{0};
+
+}  // namespace
+
+NetdMetrics::Counter::Counter(const char* name) {
+    registerMetric(name, Type::COUNTER, this);
+}
+
+size_t NetdMetrics::Counter::shardIndex() {
+    // Threads are given shards in turn, which spreads netd's handful of busy threads (binder,
+    // FwmarkServer, netlink) over separate cache lines without a getcpu() call per increment.
+    thread_local const size_t shard =
+            sNextShard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+    return shard;
+}
+
+uint64_t NetdMetrics::Counter::value() const {
+    uint64_t total = 0;
+    for (const Shard& shard : mShards) total += shard.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+NetdMetrics::Gauge::Gauge(const char* name) {
+    registerMetric(name, Type::GAUGE, this);
+}
+
+NetdMetrics::Histogram::Histogram(const char* name) {
+    registerMetric(name, Type::HISTOGRAM, this);
+}
+
+void NetdMetrics::Histogram::record(uint64_t value) {
+    mCounts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = mMax.load(std::memory_order_relaxed);
+    while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+size_t NetdMetrics::Histogram::bucketOf(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    // Values in [2^e, 2^(e+1)) for e >= 2 go to 4 buckets, by the two bits below the top one.
+    const int e = std::bit_width(value) - 1;
+    return kSubBuckets * (e - 1) + ((value >> (e - 2)) & (kSubBuckets - 1));
+}
+
+uint64_t NetdMetrics::Histogram::lowerBound(size_t bucket) {
+    if (bucket < kSubBuckets) return bucket;
+    const int e = bucket / kSubBuckets + 1;
+    return (kSubBuckets + bucket % kSubBuckets) << (e - 2);
+}
+
+uint64_t NetdMetrics::Histogram::quantile(const Counts& counts, double fraction) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) total += count;
+    if (total == 0) return 0;
+
+    const uint64_t rank =
+            std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) return lowerBound(i);
+    }
+    return lowerBound(kNumBuckets - 1);
+}
+
+std::vector<NetdMetrics::Snapshot> NetdMetrics::getSnapshots() {
+    std::vector<Snapshot> snapshots;
+    {
+        Registry& r = registry();
+        std::lock_guard guard(r.lock);
+        snapshots.reserve(r.entries.size());
+        for (const Entry& entry : r.entries) {
+            Snapshot& s = snapshots.emplace_back();
+            s.name = entry.name;
+            s.type = entry.type;
+            s.sum = 0;
+            s.max = 0;
+            s.counts = {};
+            switch (entry.type) {
+                case Type::COUNTER:
+                    s.value = static_cast<const Counter*>(entry.metric)->value();
+                    break;
+                case Type::GAUGE:
+                    s.value = static_cast<const Gauge*>(entry.metric)->value();
+                    break;
+                case Type::HISTOGRAM: {
+                    const auto* h = static_cast<const Histogram*>(entry.metric);
+                    uint64_t count = 0;
+                    for (size_t i = 0; i < Histogram::kNumBuckets; i++) {
+                        s.counts[i] = h->mCounts[i].load(std::memory_order_relaxed);
+                        count += s.counts[i];
+                    }
+                    s.value = count;
+                    s.sum = h->mSum.load(std::memory_order_relaxed);
+                    s.max = h->mMax.load(std::memory_order_relaxed);
+                    break;
+                }
+            }
+        }
+    }
+    std::sort(snapshots.begin(), snapshots.end(),
+              [](const Snapshot& a, const Snapshot& b) { return a.name < b.name; });
+    return snapshots;
+}
+
+void NetdMetrics::dump(DumpWriter& dw) {
+    dw.incIndent();
+    dw.println("Metrics (histograms: count, mean, p50/p99/max):");
+    dw.incIndent();
+    for (const auto& metric : getSnapshots()) {
+        if (metric.type != Type::HISTOGRAM) {
+            dw.println("%s: %" PRId64, metric.name.c_str(), metric.value);
+            continue;
+        }
+        const uint64_t mean = metric.value > 0 ? metric.sum / metric.value : 0;
+        dw.println("%s: %" PRId64 ", %" PRIu64 ", %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                   metric.name.c_str(), metric.value, mean,
+                   Histogram::quantile(metric.counts, 0.5),
+                   Histogram::quantile(metric.counts, 0.99), metric.max);
+    }
+    dw.decIndent();
+    dw.decIndent();
+}
+
+}  // namespace android::net
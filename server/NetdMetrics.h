@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Process-wide counters, gauges and histograms, registered by name and shown in dumpsys, both as
+// text and in the proto dump, and returned by IOemNetd#getNetdMetrics. Each metric is a static
+// object in the code that updates it, so updating one is a relaxed atomic add and never takes a
+// lock. Names are dot-separated, starting with the component, e.g. "iptables_restore.commands".
+//
+// New distributions should use Histogram. A few older ones keep their own layouts:
+// - RpcStats and FwmarkServerStats have power-of-two buckets, which IOemNetd and the proto dump
+//   return as they are.
+// - QuantileSketch, used by MDnsLatencyStats and TcpSocketMonitor, keeps percentiles within 1%
+//   rather than a fixed set of buckets, and can be cleared between polls.
+class NetdMetrics {
+  public:
+    enum class Type { COUNTER, GAUGE, HISTOGRAM };
+
+    // A monotonically increasing count. Increments from different threads go to different cache
+    // lines, so that a counter updated on every packet-path call does not bounce between CPUs.
+    class Counter {
+      public:
+        static constexpr size_t kNumShards = 8;
+
+        // |name| must outlive the process, e.g. a string literal.
+        explicit Counter(const char* name);
+        Counter(const Counter&) = delete;
+        Counter& operator=(const Counter&) = delete;
+
+        void inc(uint64_t n = 1) {
+            mShards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+        uint64_t value() const;
+
+      private:
+        struct alignas(64) Shard {
+            std::atomic_uint64_t value{0};
+        };
+
+        static size_t shardIndex();
+
+        std::array<Shard, kNumShards> mShards;
+    };
+
+    // A value that goes up and down, e.g. the number of live processes.
+    class Gauge {
+      public:
+        explicit Gauge(const char* name);
+        Gauge(const Gauge&) = delete;
+        Gauge& operator=(const Gauge&) = delete;
+
+        void set(int64_t value) { mValue.store(value, std::memory_order_relaxed); }
+        void add(int64_t delta) { mValue.fetch_add(delta, std::memory_order_relaxed); }
+        int64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+      private:
+        std::atomic_int64_t mValue{0};
+    };
+
+    // A distribution of non-negative values in log-linear buckets: values under 4 have a bucket
+    // each, and every power of two above that is split into 4 equal buckets, so that a bucket is
+    // never more than 25% wider than its lower bound.
+    class Histogram {
+      public:
+        static constexpr size_t kSubBuckets = 4;
+        static constexpr size_t kNumBuckets = kSubBuckets * 63;
+        using Counts = std::array<uint64_t, kNumBuckets>;
+
+        explicit Histogram(const char* name);
+        Histogram(const Histogram&) = delete;
+        Histogram& operator=(const Histogram&) = delete;
+
+        void record(uint64_t value);
+
+        static size_t bucketOf(uint64_t value);
+        static uint64_t lowerBound(size_t bucket);
+        // The lower bound of the bucket holding the |fraction| quantile of |counts|, or 0.
+        static uint64_t quantile(const Counts& counts, double fraction);
+
+      private:
+        friend class NetdMetrics;
+
+        std::array<std::atomic_uint64_t, kNumBuckets> mCounts{};
+        std::atomic_uint64_t mSum{0};
+        std::atomic_uint64_t mMax{0};
+    };
+
+    struct Snapshot {
+        std::string name;
+        Type type;
+        // The count for a counter, the value for a gauge, or the number of values recorded.
+        int64_t value;
+        // Only for histograms.
+        uint64_t sum;
+        uint64_t max;
+        Histogram::Counts counts;
+    };
+
+    // All metrics, in order of name.
+    static std::vector<Snapshot> getSnapshots();
+
+    static void dump(netdutils::DumpWriter& dw);
+};
+
+}  // namespace android::net
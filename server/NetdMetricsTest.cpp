@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "NetdMetrics.h"
+
+namespace android::net {
+
+namespace {
+
+using Histogram = NetdMetrics::Histogram;
+
+NetdMetrics::Snapshot find(const std::string& name) {
+    const auto snapshots = NetdMetrics::getSnapshots();
+    const auto it = std::find_if(snapshots.begin(), snapshots.end(),
+                                 [&name](const auto& s) { return s.name == name; });
+    return it != snapshots.end() ? *it : NetdMetrics::Snapshot{};
+}
+
+}  // namespace
+
+TEST(NetdMetricsTest, CounterSumsShards) {
+    static NetdMetrics::Counter counter("test.counter");
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < NetdMetrics::Counter::kNumShards * 2; i++) {
+        threads.emplace_back([] {
+            for (int j = 0; j < 1000; j++) counter.inc();
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    counter.inc(5);
+
+    EXPECT_EQ(NetdMetrics::Counter::kNumShards * 2000 + 5, counter.value());
+    const auto snapshot = find("test.counter");
+    EXPECT_EQ(NetdMetrics::Type::COUNTER, snapshot.type);
+    EXPECT_EQ(static_cast<int64_t>(counter.value()), snapshot.value);
+}
+
+TEST(NetdMetricsTest, Gauge) {
+    static NetdMetrics::Gauge gauge("test.gauge");
+    gauge.set(10);
+    gauge.add(-3);
+    EXPECT_EQ(7, gauge.value());
+    EXPECT_EQ(7, find("test.gauge").value);
+}
+
+TEST(NetdMetricsTest, HistogramBuckets) {
+    EXPECT_EQ(0U, Histogram::bucketOf(0));
+    EXPECT_EQ(3U, Histogram::bucketOf(3));
+    EXPECT_EQ(4U, Histogram::bucketOf(4));
+    EXPECT_EQ(7U, Histogram::bucketOf(7));
+    EXPECT_EQ(8U, Histogram::bucketOf(8));
+    EXPECT_EQ(8U, Histogram::bucketOf(9));
+    EXPECT_EQ(9U, Histogram::bucketOf(10));
+    EXPECT_EQ(Histogram::kNumBuckets - 1, Histogram::bucketOf(UINT64_MAX));
+
+    // Every bucket starts where the one before it ends.
+    for (size_t i = 0; i < Histogram::kNumBuckets; i++) {
+        EXPECT_EQ(i, Histogram::bucketOf(Histogram::lowerBound(i))) << i;
+        if (i > 0) {
+            EXPECT_EQ(i - 1, Histogram::bucketOf(Histogram::lowerBound(i) - 1)) << i;
+        }
+    }
+}
+
+TEST(NetdMetricsTest, HistogramSnapshot) {
+    static Histogram histogram("test.histogram");
+    for (uint64_t i = 1; i <= 100; i++) histogram.record(i);
+
+    const auto snapshot = find("test.histogram");
+    EXPECT_EQ(NetdMetrics::Type::HISTOGRAM, snapshot.type);
+    EXPECT_EQ(100, snapshot.value);
+    EXPECT_EQ(5050U, snapshot.sum);
+    EXPECT_EQ(100U, snapshot.max);
+    EXPECT_EQ(48U, Histogram::quantile(snapshot.counts, 0.5));
+    EXPECT_EQ(96U, Histogram::quantile(snapshot.counts, 0.99));
+    EXPECT_EQ(0U, Histogram::quantile(Histogram::Counts{}, 0.5));
+}
+
+}  // namespace android::net
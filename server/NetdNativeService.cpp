@@ -16,7 +16,11 @@
 
 #define LOG_TAG "Netd"
 
+#include <sched.h>
+
+#include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <numeric>
 #include <set>
 #include <string>
@@ -24,6 +28,7 @@
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <binder/IPCThreadState.h>
@@ -36,28 +41,39 @@
 #include <utils/Errors.h>
 #include <utils/String16.h>
 
+#include "BinderCallLog.h"
+#include "BinderCallTrace.h"
 #include "Controllers.h"
+#include "FlightRecorder.h"
 #include "Fwmark.h"
 #include "InterfaceController.h"
+#include "InterfaceRegistry.h"
+#include "NetdMetrics.h"
 #include "NetdNativeService.h"
+#include "NetlinkHandler.h"
 #include "OemNetdListener.h"
+#include "ParameterCache.h"
 #include "Permission.h"
 #include "Process.h"
 #include "RouteController.h"
+#include "RpcStats.h"
+#include "ScopedTrace.h"
 #include "SockDiag.h"
+#include "ThreadScheduling.h"
 #include "UidRanges.h"
 #include "android/net/BnNetd.h"
 #include "binder_utils/BinderUtil.h"
 #include "binder_utils/NetdPermissions.h"
+#include "netd_dump.pb.h"
 #include "netid_client.h"  // NETID_UNSET
 
 using android::base::StringPrintf;
+using android::base::WriteStringToFd;
 using android::base::WriteStringToFile;
 using android::net::TetherStatsParcel;
 using android::net::UidRangeParcel;
 using android::net::netd::aidl::NativeUidRangeConfig;
 using android::netdutils::DumpWriter;
-using android::netdutils::getIfaceNames;
 using android::netdutils::ScopedIndent;
 using android::os::ParcelFileDescriptor;
 
@@ -66,6 +82,14 @@ namespace net {
 
 namespace {
 const char OPT_SHORT[] = "--short";
+const char OPT_PROTO[] = "--proto";
+const char OPT_BINDER_TRACE[] = "--binder-trace";
+
+// Maximum number of binder threads. libbinder's default of 15 lets a handful of slow,
+// iptables-heavy RPCs hold up every short call queued behind them. Threads are only started
+// when all the existing ones are busy, so a high limit costs nothing while netd is idle.
+constexpr const char BINDER_THREADS_PROPERTY[] = "persist.netd.binder_threads";
+constexpr size_t DEFAULT_BINDER_THREADS = 32;
 
 #define ENFORCE_ANY_PERMISSION(...)                                \
     do {                                                           \
@@ -75,11 +99,25 @@ const char OPT_SHORT[] = "--short";
         }                                                          \
     } while (0)
 
-#define NETD_LOCKING_RPC(lock, ... /* permissions */) \
-    ENFORCE_ANY_PERMISSION(__VA_ARGS__);              \
-    std::lock_guard _lock(lock);
+// netd publishes this service before Controllers::init() runs. Each RPC waits for the part of
+// startup that it depends on; RPCs that do not name one wait for all of it. Every RPC goes through
+// here, so this is also where binder threads pick up the parts of their scheduling policy that
+// outlast a transaction.
+#define WAIT_UNTIL_READY(ready)                                     \
+    do {                                                            \
+        ThreadScheduling::applyToCurrentThread(ThreadRole::BINDER); \
+        gCtls->waitUntilReady(Controllers::Readiness::ready);       \
+    } while (0)
 
-#define NETD_BIG_LOCK_RPC(... /* permissions */) NETD_LOCKING_RPC(gBigNetdLock, __VA_ARGS__)
+// Each RPC takes at most one controller lock, so there is no lock order to get wrong. The time
+// spent waiting for it and the time the RPC then takes are reported in dumpsys, and the whole call
+// is a section in system traces.
+#define NETD_LOCKING_RPC_AFTER(lock, ready, ... /* permissions */) \
+    ENFORCE_ANY_PERMISSION(__VA_ARGS__);                           \
+    WAIT_UNTIL_READY(ready);                                       \
+    const ScopedTrace _trace("%s", __func__);                      \
+    static RpcStats::Rpc _rpcStats(__func__);                      \
+    const auto _call = _rpcStats.lock(lock);
 
 #define RETURN_BINDER_STATUS_IF_NOT_OK(logEntry, res) \
     do {                                              \
@@ -89,8 +127,62 @@ const char OPT_SHORT[] = "--short";
         }                                             \
     } while (0)
 
-#define ENFORCE_NETWORK_STACK_PERMISSIONS() \
-    ENFORCE_ANY_PERMISSION(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK)
+#define ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(ready)                      \
+    ENFORCE_ANY_PERMISSION(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK); \
+    WAIT_UNTIL_READY(ready);                                                 \
+    const ScopedTrace _trace("%s", __func__)
+
+#define ENFORCE_NETWORK_STACK_PERMISSIONS() ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(ALL)
+
+// Writes the state also shown by the text dump, as a NetdDumpProto. Each controller fills in its
+// part while holding its lock; the proto is written to |fd| once all locks are released.
+status_t dumpProto(int fd) {
+    netd::NetdDumpProto proto;
+    gCtls->netCtrl.dumpProto(proto.mutable_network_controller());
+    {
+        std::lock_guard guard(gCtls->bandwidthCtrl.lock);
+        gCtls->bandwidthCtrl.dumpProto(proto.mutable_bandwidth_controller());
+    }
+    gCtls->tetherCtrl.dumpProto(proto.mutable_tether_controller());
+    gCtls->tcpSocketMonitor.dumpProto(proto.mutable_tcp_socket_monitor());
+    gCtls->wakeupCtrl.dumpProto(proto.mutable_wakeup_controller());
+
+    const auto toUs = [](std::chrono::nanoseconds duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    };
+    for (const auto& snapshot : RpcStats::getSnapshots()) {
+        netd::RpcStatsProto* rpc = proto.add_rpc_stats();
+        rpc->set_name(snapshot.name);
+        rpc->set_calls(snapshot.calls);
+        rpc->set_contended(snapshot.contended);
+        rpc->set_total_wait_us(toUs(snapshot.totalWait));
+        rpc->set_max_wait_us(toUs(snapshot.maxWait));
+        rpc->set_max_exec_us(toUs(snapshot.maxExec));
+        rpc->mutable_wait_histogram()->Add(snapshot.wait.begin(), snapshot.wait.end());
+        rpc->mutable_exec_histogram()->Add(snapshot.exec.begin(), snapshot.exec.end());
+    }
+    for (const auto& snapshot : NetdMetrics::getSnapshots()) {
+        netd::MetricProto* metric = proto.add_metrics();
+        metric->set_name(snapshot.name);
+        metric->set_type(static_cast<netd::MetricProto::Type>(snapshot.type));
+        metric->set_value(snapshot.value);
+        if (snapshot.type != NetdMetrics::Type::HISTOGRAM) continue;
+        metric->set_sum(snapshot.sum);
+        metric->set_max(snapshot.max);
+        for (size_t i = 0; i < snapshot.counts.size(); i++) {
+            if (snapshot.counts[i] == 0) continue;
+            netd::MetricProto::Bucket* bucket = metric->add_buckets();
+            bucket->set_lower_bound(NetdMetrics::Histogram::lowerBound(i));
+            bucket->set_count(snapshot.counts[i]);
+        }
+    }
+
+    if (!proto.SerializeToFileDescriptor(fd)) {
+        ALOGE("Failed to write proto dump");
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
 
 void logErrorStatus(netdutils::LogEntry& logEntry, const netdutils::Status& status) {
     gLog.log(logEntry.returns(status.code()).withAutomaticDuration());
@@ -111,6 +203,13 @@ binder::Status asBinderStatus(const base::Result<T> result) {
                                                     result.error().message().c_str());
 }
 
+// Every binder call, recorded by BnNetd::logFunc.
+BinderCallLog sBinderCallLog;
+
+// Binder calls with their arguments, for replaying them; see BinderCallTrace.h.
+constexpr const char BINDER_CALL_TRACE_PROPERTY[] = "persist.netd.binder_call_trace";
+BinderCallTrace sBinderCallTrace(base::GetBoolProperty(BINDER_CALL_TRACE_PROPERTY, false));
+
 bool contains(const Vector<String16>& words, const String16& word) {
     for (const auto& w : words) {
         if (w == word) return true;
@@ -124,17 +223,39 @@ bool contains(const Vector<String16>& words, const String16& word) {
 NetdNativeService::NetdNativeService() {
     // register log callback to BnNetd::logFunc
     BnNetd::logFunc = [](const auto& log) {
-        binderCallLogFn(log, [](const std::string& msg) { gLog.info("%s", msg.c_str()); });
+        uint64_t argsHash = BinderCallLog::kHashSeed;
+        for (const auto& [name, value] : log.input_args) {
+            argsHash = BinderCallLog::hash(value, argsHash);
+        }
+        const auto duration = std::chrono::microseconds(std::llround(log.duration_ms * 1000));
+        sBinderCallLog.record(log.method_name, argsHash, duration, log.exception_code,
+                              log.service_specific_error_code);
+        if (sBinderCallTrace.enabled()) sBinderCallTrace.record(log.method_name, log.input_args);
     };
 }
 
 status_t NetdNativeService::start() {
     IPCThreadState::self()->disableBackgroundScheduling(true);
-    const status_t ret = BinderService<NetdNativeService>::publish();
+    // The binder driver runs each transaction at no less than this priority. Setting it from the
+    // binder thread would not last, because the driver restores the thread's priority when it
+    // replies. This is why the service is published here instead of by BinderService::publish().
+    const sp<NetdNativeService> service = sp<NetdNativeService>::make();
+    const SchedPolicy policy = ThreadScheduling::getPolicy(ThreadRole::BINDER);
+    if (policy.fifoPriority) {
+        service->setMinSchedulerPolicy(SCHED_FIFO, *policy.fifoPriority);
+    } else if (policy.nice) {
+        service->setMinSchedulerPolicy(SCHED_NORMAL, *policy.nice);
+    }
+    const status_t ret = defaultServiceManager()->addService(String16(getServiceName()), service);
     if (ret != android::OK) {
         return ret;
     }
     sp<ProcessState> ps(ProcessState::self());
+    const size_t threads = base::GetUintProperty<size_t>(BINDER_THREADS_PROPERTY,
+                                                         DEFAULT_BINDER_THREADS, 256);
+    if (const status_t err = ps->setThreadPoolMaxThreadCount(threads); err != android::OK) {
+        ALOGW("Unable to set binder thread pool size to %zu: %d", threads, err);
+    }
     ps->startThreadPool();
     ps->giveThreadPoolName();
 
@@ -148,9 +269,11 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> &args) {
         write(fd, msg.string(), msg.size());
         return PERMISSION_DENIED;
     }
+    WAIT_UNTIL_READY(ALL);
 
     // This method does not grab any locks. If individual classes need locking
-    // their dump() methods MUST handle locking appropriately.
+    // their dump() methods MUST handle locking appropriately, and should not
+    // write to |fd| while holding a lock (see DumpBuffer).
 
     DumpWriter dw(fd);
 
@@ -160,18 +283,68 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> &args) {
       dw.blankline();
       return NO_ERROR;
     }
+    if (!args.isEmpty() && args[0] == String16(OPT_PROTO)) {
+        return dumpProto(fd);
+    }
+    if (!args.isEmpty() && args[0] == String16(OPT_BINDER_TRACE)) {
+        if (!sBinderCallTrace.enabled()) {
+            dw.println("Binder call tracing is off. Set %s to 1 and restart netd.",
+                       BINDER_CALL_TRACE_PROPERTY);
+            return NO_ERROR;
+        }
+        return WriteStringToFd(sBinderCallTrace.getTrace(), fd) ? NO_ERROR : UNKNOWN_ERROR;
+    }
 
     process::dump(dw);
     dw.blankline();
     gCtls->netCtrl.dump(dw);
     dw.blankline();
 
+    gCtls->fwmarkServerStats.dump(dw);
+    dw.blankline();
+
     gCtls->xfrmCtrl.dump(dw);
     dw.blankline();
 
     gCtls->tetherCtrl.dump(dw);
     dw.blankline();
 
+    gCtls->strictCtrl.dump(dw);
+    dw.blankline();
+
+    gCtls->wakeupCtrl.dump(dw);
+    dw.blankline();
+
+    gCtls->startupProfile.dump(dw);
+    dw.blankline();
+
+    InterfaceRegistry::dump(dw);
+    dw.blankline();
+
+    ParameterCache::dump(dw);
+    dw.blankline();
+
+    ThreadScheduling::dump(dw);
+    dw.blankline();
+
+    RpcStats::dump(dw);
+    dw.blankline();
+
+    NetdMetrics::dump(dw);
+    dw.blankline();
+
+    {
+        ScopedIndent indentRecorder(dw);
+        if (contains(args, String16(OPT_SHORT))) {
+            dw.println("FlightRecorder: <omitted>");
+        } else {
+            dw.println("FlightRecorder:");
+            ScopedIndent indentRecorderEntries(dw);
+            FlightRecorder::global().dump(dw);
+        }
+        dw.blankline();
+    }
+
     {
         ScopedIndent indentLog(dw);
         if (contains(args, String16(OPT_SHORT))) {
@@ -184,6 +357,18 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> &args) {
         dw.blankline();
     }
 
+    {
+        ScopedIndent indentLog(dw);
+        if (contains(args, String16(OPT_SHORT))) {
+            dw.println("BinderCallLog: <omitted>");
+        } else {
+            dw.println("BinderCallLog:");
+            ScopedIndent indentLogEntries(dw);
+            sBinderCallLog.dump(dw);
+        }
+        dw.blankline();
+    }
+
     {
         ScopedIndent indentLog(dw);
         if (contains(args, String16(OPT_SHORT))) {
@@ -201,7 +386,7 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> &args) {
 }
 
 binder::Status NetdNativeService::isAlive(bool *alive) {
-    NETD_BIG_LOCK_RPC(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
 
     *alive = true;
 
@@ -214,7 +399,8 @@ binder::Status NetdNativeService::firewallReplaceUidChain(const std::string&, bo
 }
 
 binder::Status NetdNativeService::bandwidthEnableDataSaver(bool enable, bool *ret) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int err = gCtls->bandwidthCtrl.enableDataSaver(enable);
     *ret = (err == 0);
     return binder::Status::ok();
@@ -222,32 +408,37 @@ binder::Status NetdNativeService::bandwidthEnableDataSaver(bool enable, bool *re
 
 binder::Status NetdNativeService::bandwidthSetInterfaceQuota(const std::string& ifName,
                                                              int64_t bytes) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->bandwidthCtrl.setInterfaceQuota(ifName, bytes);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::bandwidthRemoveInterfaceQuota(const std::string& ifName) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->bandwidthCtrl.removeInterfaceQuota(ifName);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::bandwidthSetInterfaceAlert(const std::string& ifName,
                                                              int64_t bytes) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->bandwidthCtrl.setInterfaceAlert(ifName, bytes);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::bandwidthRemoveInterfaceAlert(const std::string& ifName) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->bandwidthCtrl.removeInterfaceAlert(ifName);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::bandwidthSetGlobalAlert(int64_t bytes) {
-    NETD_LOCKING_RPC(gCtls->bandwidthCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->bandwidthCtrl.lock, BANDWIDTH, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->bandwidthCtrl.setGlobalAlert(bytes);
     return statusFromErrcode(res);
 }
@@ -358,12 +549,8 @@ binder::Status NetdNativeService::networkRemoveUidRangesParcel(const NativeUidRa
 
 binder::Status NetdNativeService::networkRejectNonSecureVpn(
         bool add, const std::vector<UidRangeParcel>& uidRangeArray) {
-    // TODO: elsewhere RouteController is only used from the tethering and network controllers, so
-    // it should be possible to use the same lock as NetworkController. However, every call through
-    // the CommandListener "network" command will need to hold this lock too, not just the ones that
-    // read/modify network internal state (that is sufficient for ::dump() because it doesn't
-    // look at routes, but it's not enough here).
-    NETD_BIG_LOCK_RPC(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    // RouteController serializes changes to this rule itself.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
     UidRanges uidRanges(uidRangeArray);
 
     int err;
@@ -377,7 +564,7 @@ binder::Status NetdNativeService::networkRejectNonSecureVpn(
 
 binder::Status NetdNativeService::socketDestroy(const std::vector<UidRangeParcel>& uids,
                                                 const std::vector<int32_t>& skipUids) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
 
     SockDiag sd;
     if (!sd.open()) {
@@ -396,7 +583,8 @@ binder::Status NetdNativeService::socketDestroy(const std::vector<UidRangeParcel
 }
 
 binder::Status NetdNativeService::tetherApplyDnsInterfaces(bool *ret) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     *ret = gCtls->tetherCtrl.applyDnsInterfaces();
     return binder::Status::ok();
 }
@@ -457,7 +645,8 @@ std::vector<std::string> tetherStatsParcelVecToStringVec(std::vector<TetherStats
 
 binder::Status NetdNativeService::tetherGetStats(
         std::vector<TetherStatsParcel>* tetherStatsParcelVec) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     const auto& statsList = gCtls->tetherCtrl.getTetherStats();
     if (!isOk(statsList)) {
         return asBinderStatus(statsList);
@@ -469,7 +658,7 @@ binder::Status NetdNativeService::tetherGetStats(
 
 binder::Status NetdNativeService::interfaceAddAddress(const std::string &ifName,
         const std::string &addrString, int prefixLength) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     const int err = InterfaceController::addAddress(
             ifName.c_str(), addrString.c_str(), prefixLength);
     if (err != 0) {
@@ -481,7 +670,7 @@ binder::Status NetdNativeService::interfaceAddAddress(const std::string &ifName,
 
 binder::Status NetdNativeService::interfaceDelAddress(const std::string &ifName,
         const std::string &addrString, int prefixLength) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     const int err = InterfaceController::delAddress(
             ifName.c_str(), addrString.c_str(), prefixLength);
     if (err != 0) {
@@ -529,7 +718,7 @@ std::tuple<binder::Status, const char*, const char*> getPathComponents(int32_t i
 binder::Status NetdNativeService::getProcSysNet(int32_t ipversion, int32_t which,
                                                 const std::string& ifname,
                                                 const std::string& parameter, std::string* value) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     const auto pathParts = getPathComponents(ipversion, which);
     const auto& pathStatus = std::get<0>(pathParts);
     if (!pathStatus.isOk()) {
@@ -546,7 +735,7 @@ binder::Status NetdNativeService::setProcSysNet(int32_t ipversion, int32_t which
                                                 const std::string& ifname,
                                                 const std::string& parameter,
                                                 const std::string& value) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     const auto pathParts = getPathComponents(ipversion, which);
     const auto& pathStatus = std::get<0>(pathParts);
     if (!pathStatus.isOk()) {
@@ -561,7 +750,7 @@ binder::Status NetdNativeService::setProcSysNet(int32_t ipversion, int32_t which
 
 binder::Status NetdNativeService::ipSecSetEncapSocketOwner(const ParcelFileDescriptor& socket,
                                                            int newUid) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
 
     uid_t callerUid = IPCThreadState::self()->getCallingUid();
     return asBinderStatus(
@@ -575,7 +764,7 @@ binder::Status NetdNativeService::ipSecAllocateSpi(
         int32_t inSpi,
         int32_t* outSpi) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecAllocateSpi(
                     transformId,
                     sourceAddress,
@@ -593,7 +782,7 @@ binder::Status NetdNativeService::ipSecAddSecurityAssociation(
         const std::vector<uint8_t>& aeadKey, int32_t aeadIcvBits, int32_t encapType,
         int32_t encapLocalPort, int32_t encapRemotePort, int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecAddSecurityAssociation(
             transformId, mode, sourceAddress, destinationAddress, underlyingNetId, spi, markValue,
             markMask, authAlgo, authKey, authTruncBits, cryptAlgo, cryptKey, cryptTruncBits,
@@ -606,7 +795,7 @@ binder::Status NetdNativeService::ipSecDeleteSecurityAssociation(
         const std::string& destinationAddress, int32_t spi, int32_t markValue, int32_t markMask,
         int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecDeleteSecurityAssociation(
             transformId, sourceAddress, destinationAddress, spi, markValue, markMask, interfaceId));
 }
@@ -615,7 +804,7 @@ binder::Status NetdNativeService::ipSecApplyTransportModeTransform(
         const ParcelFileDescriptor& socket, int32_t transformId, int32_t direction,
         const std::string& sourceAddress, const std::string& destinationAddress, int32_t spi) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecApplyTransportModeTransform(
             socket.get(), transformId, direction, sourceAddress, destinationAddress, spi));
 }
@@ -623,7 +812,7 @@ binder::Status NetdNativeService::ipSecApplyTransportModeTransform(
 binder::Status NetdNativeService::ipSecRemoveTransportModeTransform(
         const ParcelFileDescriptor& socket) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecRemoveTransportModeTransform(socket.get()));
 }
 
@@ -634,7 +823,7 @@ binder::Status NetdNativeService::ipSecAddSecurityPolicy(int32_t transformId, in
                                                          int32_t spi, int32_t markValue,
                                                          int32_t markMask, int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecAddSecurityPolicy(
             transformId, selAddrFamily, direction, tmplSrcAddress, tmplDstAddress, spi, markValue,
             markMask, interfaceId));
@@ -645,7 +834,7 @@ binder::Status NetdNativeService::ipSecUpdateSecurityPolicy(
         const std::string& tmplSrcAddress, const std::string& tmplDstAddress, int32_t spi,
         int32_t markValue, int32_t markMask, int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecUpdateSecurityPolicy(
             transformId, selAddrFamily, direction, tmplSrcAddress, tmplDstAddress, spi, markValue,
             markMask, interfaceId));
@@ -656,7 +845,7 @@ binder::Status NetdNativeService::ipSecDeleteSecurityPolicy(int32_t transformId,
                                                             int32_t direction, int32_t markValue,
                                                             int32_t markMask, int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecDeleteSecurityPolicy(
             transformId, selAddrFamily, direction, markValue, markMask, interfaceId));
 }
@@ -667,7 +856,7 @@ binder::Status NetdNativeService::ipSecAddTunnelInterface(const std::string& dev
                                                           int32_t iKey, int32_t oKey,
                                                           int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecAddTunnelInterface(
             deviceName, localAddress, remoteAddress, iKey, oKey, interfaceId, false));
 }
@@ -678,20 +867,20 @@ binder::Status NetdNativeService::ipSecUpdateTunnelInterface(const std::string&
                                                              int32_t iKey, int32_t oKey,
                                                              int32_t interfaceId) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecAddTunnelInterface(
             deviceName, localAddress, remoteAddress, iKey, oKey, interfaceId, true));
 }
 
 binder::Status NetdNativeService::ipSecRemoveTunnelInterface(const std::string& deviceName) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecRemoveTunnelInterface(deviceName));
 }
 
 binder::Status NetdNativeService::ipSecMigrate(const IpSecMigrateInfoParcel& migrateInfo) {
     // Necessary locking done in IpSecService and kernel
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(XFRM);
     return asBinderStatus(gCtls->xfrmCtrl.ipSecMigrate(
             migrateInfo.requestId, migrateInfo.selAddrFamily, migrateInfo.direction,
             migrateInfo.oldSourceAddress, migrateInfo.oldDestinationAddress,
@@ -701,7 +890,7 @@ binder::Status NetdNativeService::ipSecMigrate(const IpSecMigrateInfoParcel& mig
 
 binder::Status NetdNativeService::setIPv6AddrGenMode(const std::string& ifName,
                                                      int32_t mode) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     return asBinderStatus(InterfaceController::setIPv6AddrGenMode(ifName, mode));
 }
 
@@ -725,7 +914,8 @@ binder::Status NetdNativeService::trafficSwapActiveStatsMap() {
 
 binder::Status NetdNativeService::idletimerAddInterface(const std::string& ifName, int32_t timeout,
                                                         const std::string& classLabel) {
-    NETD_LOCKING_RPC(gCtls->idletimerCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->idletimerCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res =
             gCtls->idletimerCtrl.addInterfaceIdletimer(ifName.c_str(), timeout, classLabel.c_str());
     return statusFromErrcode(res);
@@ -734,14 +924,16 @@ binder::Status NetdNativeService::idletimerAddInterface(const std::string& ifNam
 binder::Status NetdNativeService::idletimerRemoveInterface(const std::string& ifName,
                                                            int32_t timeout,
                                                            const std::string& classLabel) {
-    NETD_LOCKING_RPC(gCtls->idletimerCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->idletimerCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->idletimerCtrl.removeInterfaceIdletimer(ifName.c_str(), timeout,
                                                             classLabel.c_str());
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::strictUidCleartextPenalty(int32_t uid, int32_t policyPenalty) {
-    NETD_LOCKING_RPC(gCtls->strictCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->strictCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     StrictPenalty penalty;
     switch (policyPenalty) {
         case INetd::PENALTY_POLICY_REJECT:
@@ -757,6 +949,8 @@ binder::Status NetdNativeService::strictUidCleartextPenalty(int32_t uid, int32_t
             return statusFromErrcode(-EINVAL);
             break;
     }
+    // The analysis cannot see that NETD_LOCKING_RPC_AFTER took the lock.
+    android::base::ScopedLockAssertion assumeLocked(gCtls->strictCtrl.lock);
     int res = gCtls->strictCtrl.setUidCleartextPenalty((uid_t) uid, penalty);
     return statusFromErrcode(res);
 }
@@ -778,13 +972,15 @@ binder::Status NetdNativeService::clatdStop(const std::string& /* ifName */) {
 }
 
 binder::Status NetdNativeService::ipfwdEnabled(bool* status) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     *status = (gCtls->tetherCtrl.getIpfwdRequesterList().size() > 0) ? true : false;
     return binder::Status::ok();
 }
 
 binder::Status NetdNativeService::ipfwdGetRequesterList(std::vector<std::string>* requesterList) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     for (const auto& requester : gCtls->tetherCtrl.getIpfwdRequesterList()) {
         requesterList->push_back(requester);
     }
@@ -792,13 +988,15 @@ binder::Status NetdNativeService::ipfwdGetRequesterList(std::vector<std::string>
 }
 
 binder::Status NetdNativeService::ipfwdEnableForwarding(const std::string& requester) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = (gCtls->tetherCtrl.enableForwarding(requester.c_str())) ? 0 : -EREMOTEIO;
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::ipfwdDisableForwarding(const std::string& requester) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = (gCtls->tetherCtrl.disableForwarding(requester.c_str())) ? 0 : -EREMOTEIO;
     return statusFromErrcode(res);
 }
@@ -825,9 +1023,14 @@ std::string addCurlyBrackets(const std::string& s) {
 
 }  // namespace
 
+// Only reads the interface state cache, which has its own lock, so that it never waits behind a
+// slow interfaceSetCfg.
 binder::Status NetdNativeService::interfaceGetList(std::vector<std::string>* interfaceListResult) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
-    const auto& ifaceList = getIfaceNames();
+    ENFORCE_ANY_PERMISSION(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    const auto& ifaceList = InterfaceController::getIfaceNames();
+    if (!isOk(ifaceList)) {
+        return asBinderStatus(ifaceList.status());
+    }
 
     interfaceListResult->clear();
     interfaceListResult->reserve(ifaceList.value().size());
@@ -846,7 +1049,8 @@ std::string interfaceConfigurationParcelToString(const InterfaceConfigurationPar
 
 binder::Status NetdNativeService::interfaceGetCfg(
         const std::string& ifName, InterfaceConfigurationParcel* interfaceGetCfgResult) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    // Like interfaceGetList, does not take InterfaceController::mutex.
+    ENFORCE_ANY_PERMISSION(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
     auto entry = gLog.newEntry().prettyFunction(__PRETTY_FUNCTION__).arg(ifName);
 
     const auto& cfgRes = InterfaceController::getCfg(ifName);
@@ -859,7 +1063,8 @@ binder::Status NetdNativeService::interfaceGetCfg(
 }
 
 binder::Status NetdNativeService::interfaceSetCfg(const InterfaceConfigurationParcel& cfg) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(InterfaceController::mutex, NONE, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     auto entry = gLog.newEntry()
                          .prettyFunction(__PRETTY_FUNCTION__)
                          .arg(interfaceConfigurationParcelToString(cfg));
@@ -873,25 +1078,29 @@ binder::Status NetdNativeService::interfaceSetCfg(const InterfaceConfigurationPa
 
 binder::Status NetdNativeService::interfaceSetIPv6PrivacyExtensions(const std::string& ifName,
                                                                     bool enable) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(InterfaceController::mutex, NONE, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = InterfaceController::setIPv6PrivacyExtensions(ifName.c_str(), enable);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::interfaceClearAddrs(const std::string& ifName) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(InterfaceController::mutex, NONE, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = InterfaceController::clearAddrs(ifName.c_str());
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::interfaceSetEnableIPv6(const std::string& ifName, bool enable) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(InterfaceController::mutex, NONE, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = InterfaceController::setEnableIPv6(ifName.c_str(), enable);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::interfaceSetMtu(const std::string& ifName, int32_t mtuValue) {
-    NETD_LOCKING_RPC(InterfaceController::mutex, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(InterfaceController::mutex, NONE, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     std::string mtu = std::to_string(mtuValue);
     int res = InterfaceController::setMtu(ifName.c_str(), mtu.c_str());
     return statusFromErrcode(res);
@@ -905,7 +1114,8 @@ binder::Status NetdNativeService::tetherStart(const std::vector<std::string>& dh
 }
 
 binder::Status NetdNativeService::tetherStartWithConfiguration(const TetherConfigParcel& config) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     if (config.dhcpRanges.size() % 2 == 1) {
         return statusFromErrcode(-EINVAL);
     }
@@ -915,31 +1125,36 @@ binder::Status NetdNativeService::tetherStartWithConfiguration(const TetherConfi
 }
 
 binder::Status NetdNativeService::tetherStop() {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->tetherCtrl.stopTethering();
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::tetherIsEnabled(bool* enabled) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     *enabled = gCtls->tetherCtrl.isTetheringStarted();
     return binder::Status::ok();
 }
 
 binder::Status NetdNativeService::tetherInterfaceAdd(const std::string& ifName) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->tetherCtrl.tetherInterface(ifName.c_str());
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::tetherInterfaceRemove(const std::string& ifName) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->tetherCtrl.untetherInterface(ifName.c_str());
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::tetherInterfaceList(std::vector<std::string>* ifList) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     for (const auto& ifname : gCtls->tetherCtrl.getTetheredInterfaceList()) {
         ifList->push_back(ifname);
     }
@@ -948,13 +1163,15 @@ binder::Status NetdNativeService::tetherInterfaceList(std::vector<std::string>*
 
 binder::Status NetdNativeService::tetherDnsSet(int32_t netId,
                                                const std::vector<std::string>& dnsAddrs) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->tetherCtrl.setDnsForwarders(netId, dnsAddrs);
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::tetherDnsList(std::vector<std::string>* dnsList) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     for (const auto& fwdr : gCtls->tetherCtrl.getDnsForwarders()) {
         dnsList->push_back(fwdr);
     }
@@ -1121,7 +1338,8 @@ binder::Status NetdNativeService::trafficSetNetPermForUids(int32_t, const std::v
 }
 
 binder::Status NetdNativeService::firewallSetFirewallType(int32_t firewallType) {
-    NETD_LOCKING_RPC(gCtls->firewallCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->firewallCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     auto type = static_cast<FirewallType>(firewallType);
 
     int res = gCtls->firewallCtrl.setFirewallType(type);
@@ -1130,7 +1348,8 @@ binder::Status NetdNativeService::firewallSetFirewallType(int32_t firewallType)
 
 binder::Status NetdNativeService::firewallSetInterfaceRule(const std::string& ifName,
                                                            int32_t firewallRule) {
-    NETD_LOCKING_RPC(gCtls->firewallCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->firewallCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     auto rule = static_cast<FirewallRule>(firewallRule);
 
     int res = gCtls->firewallCtrl.setInterfaceRule(ifName.c_str(), rule);
@@ -1156,7 +1375,8 @@ binder::Status NetdNativeService::firewallRemoveUidInterfaceRules(const std::vec
 
 binder::Status NetdNativeService::tetherAddForward(const std::string& intIface,
                                                    const std::string& extIface) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
 
     int res = gCtls->tetherCtrl.enableNat(intIface.c_str(), extIface.c_str());
     return statusFromErrcode(res);
@@ -1164,14 +1384,15 @@ binder::Status NetdNativeService::tetherAddForward(const std::string& intIface,
 
 binder::Status NetdNativeService::tetherRemoveForward(const std::string& intIface,
                                                       const std::string& extIface) {
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     int res = gCtls->tetherCtrl.disableNat(intIface.c_str(), extIface.c_str());
     return statusFromErrcode(res);
 }
 
 binder::Status NetdNativeService::setTcpRWmemorySize(const std::string& rmemValues,
                                                      const std::string& wmemValues) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
     if (!WriteStringToFile(rmemValues, TCP_RMEM_PROC_FILE)) {
         int ret = -errno;
         return statusFromErrcode(ret);
@@ -1188,18 +1409,21 @@ binder::Status NetdNativeService::registerUnsolicitedEventListener(
         const android::sp<android::net::INetdUnsolicitedEventListener>& listener) {
     ENFORCE_NETWORK_STACK_PERMISSIONS();
     gCtls->eventReporter.registerUnsolEventListener(listener);
+    NetlinkHandler::onUnsolEventListenerRegistered();
     return binder::Status::ok();
 }
 
 binder::Status NetdNativeService::getOemNetd(android::sp<android::IBinder>* listener) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    // IOemNetd is only reachable through here, and its methods do not wait for anything
+    // themselves, e.g. a topology transaction would race with RouteController::Init().
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(ALL);
     *listener = com::android::internal::net::OemNetdListener::getListener();
 
     return binder::Status::ok();
 }
 
 binder::Status NetdNativeService::getFwmarkForNetwork(int32_t netId, MarkMaskParcel* markMask) {
-    ENFORCE_NETWORK_STACK_PERMISSIONS();
+    ENFORCE_NETWORK_STACK_PERMISSIONS_AFTER(NONE);
 
     Fwmark fwmark;
     fwmark.netId = netId;
@@ -1227,7 +1451,8 @@ binder::Status NetdNativeService::tetherOffloadRuleRemove(
 binder::Status NetdNativeService::tetherOffloadGetStats(
         std::vector<TetherStatsParcel>* /* tetherStatsParcelVec */) {
     // deprecated
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     return binder::Status::fromExceptionCode(binder::Status::EX_UNSUPPORTED_OPERATION);
 }
 
@@ -1235,7 +1460,8 @@ binder::Status NetdNativeService::tetherOffloadGetStats(
 binder::Status NetdNativeService::tetherOffloadSetInterfaceQuota(int /* ifIndex */,
                                                                  int64_t /* quotaBytes */) {
     // deprecated
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     return binder::Status::fromExceptionCode(binder::Status::EX_UNSUPPORTED_OPERATION);
 }
 
@@ -1243,7 +1469,8 @@ binder::Status NetdNativeService::tetherOffloadSetInterfaceQuota(int /* ifIndex
 binder::Status NetdNativeService::tetherOffloadGetAndClearStats(
         int /* ifIndex */, android::net::TetherStatsParcel* /* tetherStats */) {
     // deprecated
-    NETD_LOCKING_RPC(gCtls->tetherCtrl.lock, PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK);
+    NETD_LOCKING_RPC_AFTER(gCtls->tetherCtrl.lock, IPTABLES, PERM_NETWORK_STACK,
+                           PERM_MAINLINE_NETWORK_STACK);
     return binder::Status::fromExceptionCode(binder::Status::EX_UNSUPPORTED_OPERATION);
 }
 
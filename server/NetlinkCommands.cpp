@@ -17,16 +17,25 @@
 #include <errno.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <mutex>
+
 #define LOG_TAG "Netd"
 #include <log/log.h>
 
+#include "FlightRecorder.h"
 #include "NetdConstants.h"
 #include "NetlinkCommands.h"
+#include "RpcStats.h"
+#include "ScopedTrace.h"
 
 namespace android {
 namespace net {
@@ -38,11 +47,64 @@ int openNetlinkSocket(int protocol) {
     }
     if (connect(sock, reinterpret_cast<const sockaddr*>(&KERNEL_NLADDR),
                 sizeof(KERNEL_NLADDR)) == -1) {
-        return -errno;
+        int ret = -errno;
+        close(sock);
+        return ret;
     }
     return sock;
 }
 
+NetlinkSocketPool::~NetlinkSocketPool() {
+    for (const auto& idle : mIdle) {
+        close(idle.fd);
+    }
+}
+
+NetlinkSocketPool::Lease NetlinkSocketPool::acquire() {
+    {
+        std::lock_guard lock(mLock);
+        if (!mIdle.empty()) {
+            IdleSocket idle = mIdle.back();
+            mIdle.pop_back();
+            return Lease(this, idle.fd, idle.seq);
+        }
+    }
+    return Lease(this, openNetlinkSocket(mProtocol), 0);
+}
+
+void NetlinkSocketPool::release(int fd, uint32_t seq) {
+    {
+        std::lock_guard lock(mLock);
+        if (mIdle.size() < mMaxIdle) {
+            mIdle.push_back({fd, seq});
+            return;
+        }
+    }
+    close(fd);
+}
+
+/* static */
+NetlinkSocketPool& NetlinkSocketPool::route() {
+    // Enough for the binder threads and the netlink handler to send requests concurrently
+    // without having to open extra sockets. Never destroyed, so that it can be used at exit.
+    static NetlinkSocketPool* sPool = new NetlinkSocketPool(NETLINK_ROUTE, 4);
+    return *sPool;
+}
+
+NetlinkSocketPool::Lease::Lease(Lease&& other) noexcept
+    : mPool(other.mPool), mFd(other.mFd), mSeq(other.mSeq), mReusable(other.mReusable) {
+    other.mFd = -1;
+}
+
+NetlinkSocketPool::Lease::~Lease() {
+    if (mFd < 0) return;
+    if (mReusable) {
+        mPool->release(mFd, mSeq);
+    } else {
+        close(mFd);
+    }
+}
+
 int recvNetlinkAck(int sock) {
     struct {
         nlmsghdr msg;
@@ -65,6 +127,38 @@ int recvNetlinkAck(int sock) {
     return response.err.error;  // Netlink errors are negative errno.
 }
 
+int recvNetlinkAck(int sock, uint32_t seq, bool* received) {
+    struct {
+        nlmsghdr msg;
+        nlmsgerr err;
+    } response;
+
+    if (received != nullptr) *received = false;
+
+    while (true) {
+        int ret = recv(sock, &response, sizeof(response), 0);
+
+        if (ret == -1) {
+            ret = -errno;
+            ALOGE("netlink recv failed (%s)", strerror(-ret));
+            return ret;
+        }
+
+        if (ret != sizeof(response)) {
+            ALOGE("bad netlink response message size (%d != %zu)", ret, sizeof(response));
+            return -EBADMSG;
+        }
+
+        if (response.msg.nlmsg_seq == seq) {
+            if (received != nullptr) *received = true;
+            return response.err.error;  // Netlink errors are negative errno.
+        }
+
+        ALOGW("Ignoring netlink response with sequence number %u, expected %u",
+              response.msg.nlmsg_seq, seq);
+    }
+}
+
 // Disable optimizations in ASan build.
 // ASan reports an out-of-bounds 32-bit(!) access in the first loop of the function (over iov[]).
 // TODO: verify if this bug is still present.
@@ -84,14 +178,19 @@ int recvNetlinkAck(int sock) {
 // Returns -errno if there was an error or if the kernel reported an error.
 OPTNONE int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen,
                                const NetlinkDumpCallback* callback) {
-    int sock = openNetlinkSocket(NETLINK_ROUTE);
-    if (sock < 0) {
-        return sock;
+    RpcStats::ScopedOp op(RpcStats::Op::NETLINK);
+    ScopedTrace trace("netlink request type=%u flags=0x%x", action, flags);
+    FlightRecorder::Scope record(FlightRecorder::Event::NETLINK_REQUEST, action, flags);
+    NetlinkSocketPool::Lease sock = NetlinkSocketPool::route().acquire();
+    if (sock.fd() < 0) {
+        record.setResult(sock.fd());
+        return sock.fd();
     }
 
     nlmsghdr nlmsg = {
         .nlmsg_type = action,
         .nlmsg_flags = flags,
+        .nlmsg_seq = sock.nextSeq(),
     };
     iov[0].iov_base = &nlmsg;
     iov[0].iov_len = sizeof(nlmsg);
@@ -99,25 +198,29 @@ OPTNONE int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int
         nlmsg.nlmsg_len += iov[i].iov_len;
     }
 
-    ssize_t writevRet = writev(sock, iov, iovlen);
+    ssize_t writevRet = writev(sock.fd(), iov, iovlen);
     // Don't let pointers to the stack escape.
     iov[0] = {nullptr, 0};
     int ret = 0;
     if (writevRet == -1) {
         ret = -errno;
         ALOGE("netlink socket connect/writev failed (%s)", strerror(-ret));
-        close(sock);
+        record.setResult(ret);
         return ret;
     }
 
     if (flags & NLM_F_ACK) {
-        ret = recvNetlinkAck(sock);
+        bool received;
+        ret = recvNetlinkAck(sock.fd(), nlmsg.nlmsg_seq, &received);
+        // If the ack was received, nothing else is queued on the socket.
+        if (received) sock.setReusable();
     } else if ((flags & NLM_F_DUMP) && callback != nullptr) {
-        ret = processNetlinkDump(sock, *callback);
+        ret = processNetlinkDump(sock.fd(), *callback);
+        if (ret == 0) sock.setReusable();
     }
+    // Otherwise, the kernel may still send an error that nobody reads. Don't reuse the socket.
 
-    close(sock);
-
+    record.setResult(ret);
     return ret;
 }
 
@@ -125,6 +228,278 @@ int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen)
     return sendNetlinkRequest(action, flags, iov, iovlen, nullptr);
 }
 
+size_t NetlinkBatch::addRequest(uint16_t action, uint16_t flags, const iovec* iov, int iovlen) {
+    if (mOffsets.empty()) mResults.clear();
+
+    size_t len = sizeof(nlmsghdr);
+    for (int i = 1; i < iovlen; ++i) {
+        len += iov[i].iov_len;
+    }
+
+    const size_t offset = mBuffer.size();
+    mBuffer.resize(offset + NLMSG_ALIGN(len));
+    nlmsghdr nlmsg = {
+        .nlmsg_len = static_cast<uint32_t>(len),
+        .nlmsg_type = action,
+        .nlmsg_flags = static_cast<uint16_t>(flags | NLM_F_ACK),
+    };
+    uint8_t* p = mBuffer.data() + offset;
+    memcpy(p, &nlmsg, sizeof(nlmsg));
+    p += sizeof(nlmsg);
+    for (int i = 1; i < iovlen; ++i) {
+        if (iov[i].iov_len == 0) continue;
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    mOffsets.push_back(offset);
+    return mOffsets.size() - 1;
+}
+
+int NetlinkBatch::send() {
+    mResults.assign(mOffsets.size(), 0);
+    if (mOffsets.empty()) {
+        return 0;
+    }
+
+    RpcStats::ScopedOp op(RpcStats::Op::NETLINK);
+    ScopedTrace trace("netlink batch requests=%zu", mOffsets.size());
+    FlightRecorder::Scope record(FlightRecorder::Event::NETLINK_BATCH, mOffsets.size());
+    NetlinkSocketPool::Lease sock = mPool->acquire();
+    if (sock.fd() < 0) {
+        std::fill(mResults.begin(), mResults.end(), sock.fd());
+    } else {
+        bool clean = true;
+        for (size_t begin = 0; begin < mOffsets.size(); begin += kMaxRequestsPerSend) {
+            const size_t end = std::min(begin + kMaxRequestsPerSend, mOffsets.size());
+            clean = sendChunk(&sock, begin, end) && clean;
+        }
+        if (clean) sock.setReusable();
+    }
+
+    clear();
+
+    for (int ret : mResults) {
+        if (ret) {
+            record.setResult(ret);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+bool NetlinkBatch::sendChunk(NetlinkSocketPool::Lease* sock, size_t begin, size_t end) {
+    const size_t count = end - begin;
+    uint32_t firstSeq = 0;
+    for (size_t i = begin; i < end; ++i) {
+        nlmsghdr* nlh = reinterpret_cast<nlmsghdr*>(mBuffer.data() + mOffsets[i]);
+        nlh->nlmsg_seq = sock->nextSeq();
+        if (i == begin) firstSeq = nlh->nlmsg_seq;
+    }
+
+    const size_t startOffset = mOffsets[begin];
+    const size_t endOffset = (end < mOffsets.size()) ? mOffsets[end] : mBuffer.size();
+    if (::send(sock->fd(), mBuffer.data() + startOffset, endOffset - startOffset, 0) == -1) {
+        const int ret = -errno;
+        ALOGE("netlink batch send failed (%s)", strerror(-ret));
+        std::fill(mResults.begin() + begin, mResults.begin() + end, ret);
+        // Nothing was sent, so no ACKs are pending.
+        return true;
+    }
+
+    std::vector<bool> acked(count, false);
+    size_t pending = count;
+    char buf[kNetlinkDumpBufferSize];
+    while (pending > 0) {
+        ssize_t bytesread = recv(sock->fd(), buf, sizeof(buf), 0);
+        if (bytesread <= 0) {
+            const int ret = (bytesread == 0) ? -EBADMSG : -errno;
+            ALOGE("netlink batch recv failed (%s)", strerror(-ret));
+            for (size_t i = 0; i < count; ++i) {
+                if (!acked[i]) mResults[begin + i] = ret;
+            }
+            return false;
+        }
+
+        uint32_t len = bytesread;
+        for (nlmsghdr* nlh = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            // Unsigned arithmetic, so this also works if the sequence numbers wrap.
+            const size_t i = nlh->nlmsg_seq - firstSeq;
+            if (nlh->nlmsg_type != NLMSG_ERROR || i >= count || acked[i] ||
+                nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+                ALOGW("Ignoring netlink response type %u with sequence number %u",
+                      nlh->nlmsg_type, nlh->nlmsg_seq);
+                continue;
+            }
+            mResults[begin + i] = reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nlh))->error;
+            acked[i] = true;
+            --pending;
+        }
+    }
+
+    return true;
+}
+
+NetlinkAckCollector::NetlinkAckCollector(int protocol)
+    : mSock(openNetlinkSocket(protocol)), mStopFd(eventfd(0, EFD_CLOEXEC)) {
+    if (mSock < 0 || mStopFd == -1) {
+        ALOGE("Cannot start netlink ACK collector (%s)",
+              strerror(mSock < 0 ? -mSock : errno));
+        return;
+    }
+    mThread = std::thread(&NetlinkAckCollector::run, this);
+}
+
+NetlinkAckCollector::~NetlinkAckCollector() {
+    if (mThread.joinable()) {
+        const uint64_t stop = 1;
+        if (write(mStopFd, &stop, sizeof(stop)) != sizeof(stop)) {
+            ALOGE("Cannot stop netlink ACK collector (%s)", strerror(errno));
+        }
+        mThread.join();
+    }
+    failAllPending(-ECANCELED);
+    if (mSock >= 0) close(mSock);
+    if (mStopFd != -1) close(mStopFd);
+}
+
+int NetlinkAckCollector::send(uint16_t action, uint16_t flags, iovec* iov, int iovlen,
+                              Callback callback) {
+    if (!mThread.joinable()) {
+        return (mSock < 0) ? mSock : -EBADF;
+    }
+
+    nlmsghdr nlmsg = {
+        .nlmsg_type = action,
+        .nlmsg_flags = static_cast<uint16_t>(flags | NLM_F_ACK),
+    };
+    {
+        // Register the callback first, because the ACK may be read before writev() returns.
+        std::lock_guard lock(mLock);
+        nlmsg.nlmsg_seq = ++mSeq;
+        mPending.emplace(nlmsg.nlmsg_seq, std::move(callback));
+    }
+
+    iov[0].iov_base = &nlmsg;
+    iov[0].iov_len = sizeof(nlmsg);
+    for (int i = 0; i < iovlen; ++i) {
+        nlmsg.nlmsg_len += iov[i].iov_len;
+    }
+    ssize_t writevRet = writev(mSock, iov, iovlen);
+    // Don't let pointers to the stack escape.
+    iov[0] = {nullptr, 0};
+
+    if (writevRet == -1) {
+        const int ret = -errno;
+        ALOGE("netlink writev failed (%s)", strerror(-ret));
+        std::lock_guard lock(mLock);
+        mPending.erase(nlmsg.nlmsg_seq);
+        mCv.notify_all();
+        return ret;
+    }
+    return 0;
+}
+
+std::future<int> NetlinkAckCollector::send(uint16_t action, uint16_t flags, iovec* iov,
+                                           int iovlen) {
+    auto promise = std::make_shared<std::promise<int>>();
+    std::future<int> future = promise->get_future();
+    if (int ret = send(action, flags, iov, iovlen,
+                       [promise](int error) { promise->set_value(error); })) {
+        promise->set_value(ret);
+    }
+    return future;
+}
+
+void NetlinkAckCollector::waitForPending() {
+    std::unique_lock lock(mLock);
+    // Sequence numbers are only ever added in increasing order, so wait for those up to the
+    // current one to be gone.
+    const uint32_t last = mSeq;
+    mCv.wait(lock, [this, last] {
+        return mRunning == 0 &&
+               (mPending.empty() || mPending.begin()->first > last);
+    });
+}
+
+void NetlinkAckCollector::failAllPending(int error) {
+    std::map<uint32_t, Callback> pending;
+    {
+        std::lock_guard lock(mLock);
+        pending.swap(mPending);
+        mRunning++;
+    }
+    for (auto& [seq, callback] : pending) {
+        callback(error);
+    }
+    std::lock_guard lock(mLock);
+    mRunning--;
+    mCv.notify_all();
+}
+
+void NetlinkAckCollector::run() {
+    char buf[kNetlinkDumpBufferSize];
+    pollfd fds[] = {
+            {.fd = mSock, .events = POLLIN},
+            {.fd = mStopFd, .events = POLLIN},
+    };
+
+    while (true) {
+        if (poll(fds, ARRAY_SIZE(fds), -1) == -1) {
+            if (errno == EINTR) continue;
+            ALOGE("netlink ACK collector poll failed (%s)", strerror(errno));
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+
+        ssize_t bytesread = recv(mSock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (bytesread == -1) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            // ENOBUFS means that ACKs were dropped because the receive buffer overflowed. We don't
+            // know which ones, so don't leave anyone waiting.
+            const int ret = -errno;
+            ALOGE("netlink ACK collector recv failed (%s)", strerror(-ret));
+            failAllPending(ret);
+            continue;
+        }
+
+        uint32_t len = bytesread;
+        for (nlmsghdr* nlh = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR ||
+                nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+                continue;
+            }
+            Callback callback;
+            {
+                std::lock_guard lock(mLock);
+                auto iter = mPending.find(nlh->nlmsg_seq);
+                if (iter == mPending.end()) {
+                    ALOGW("Ignoring netlink ACK with unknown sequence number %u",
+                          nlh->nlmsg_seq);
+                    continue;
+                }
+                callback = std::move(iter->second);
+                mPending.erase(iter);
+                mRunning++;
+            }
+            callback(reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nlh))->error);
+            std::lock_guard lock(mLock);
+            mRunning--;
+            mCv.notify_all();
+        }
+    }
+}
+
+/* static */
+NetlinkAckCollector& NetlinkAckCollector::route() {
+    static NetlinkAckCollector* sCollector = new NetlinkAckCollector(NETLINK_ROUTE);
+    return *sCollector;
+}
+
 int processNetlinkDump(int sock, const NetlinkDumpCallback& callback) {
     char buf[kNetlinkDumpBufferSize];
 
@@ -156,6 +531,43 @@ int processNetlinkDump(int sock, const NetlinkDumpCallback& callback) {
     return 0;
 }
 
+ssize_t recvNetlinkDatagram(int sock, std::vector<uint8_t>* buffer) {
+    // Find out how large the next datagram is without copying it.
+    const ssize_t size = TEMP_FAILURE_RETRY(recv(sock, nullptr, 0, MSG_PEEK | MSG_TRUNC));
+    if (size <= 0) {
+        return size < 0 ? -errno : 0;
+    }
+    if (buffer->size() < static_cast<size_t>(size)) {
+        buffer->resize(size);
+    }
+
+    const ssize_t bytesread = TEMP_FAILURE_RETRY(recv(sock, buffer->data(), buffer->size(), 0));
+    return bytesread < 0 ? -errno : bytesread;
+}
+
+int processNetlinkDump(int sock, const NetlinkDumpCallback& callback,
+                       std::vector<uint8_t>* buffer) {
+    while (true) {
+        const ssize_t bytesread = recvNetlinkDatagram(sock, buffer);
+        if (bytesread <= 0) {
+            return bytesread;
+        }
+
+        uint32_t len = bytesread;
+        for (nlmsghdr* nlh = reinterpret_cast<nlmsghdr*>(buffer->data()); NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            switch (nlh->nlmsg_type) {
+                case NLMSG_DONE:
+                    return 0;
+                case NLMSG_ERROR:
+                    return reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nlh))->error;
+                default:
+                    callback(nlh);
+            }
+        }
+    }
+}
+
 int rtNetlinkFlush(uint16_t getAction, uint16_t deleteAction, const char* what,
                    const NetlinkDumpFilter& shouldDelete) {
     // RTM_GETxxx is always RTM_DELxxx + 1, see <linux/rtnetlink.h>.
@@ -164,22 +576,29 @@ int rtNetlinkFlush(uint16_t getAction, uint16_t deleteAction, const char* what,
         return -EINVAL;
     }
 
-    int writeSock = openNetlinkSocket(NETLINK_ROUTE);
+    NetlinkSocketPool::Lease writeLease = NetlinkSocketPool::route().acquire();
+    const int writeSock = writeLease.fd();
     if (writeSock < 0) {
         return writeSock;
     }
+    bool writeSockClean = true;
 
-    NetlinkDumpCallback callback = [writeSock, deleteAction, shouldDelete, what] (nlmsghdr *nlh) {
+    NetlinkDumpCallback callback = [&writeLease, &writeSockClean, writeSock, deleteAction,
+                                    shouldDelete, what] (nlmsghdr *nlh) {
         if (!shouldDelete(nlh)) return;
 
         nlh->nlmsg_type = deleteAction;
         nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        nlh->nlmsg_seq = writeLease.nextSeq();
         if (write(writeSock, nlh, nlh->nlmsg_len) == -1) {
             ALOGE("Error writing flush request: %s", strerror(errno));
             return;
         }
 
-        int ret = recvNetlinkAck(writeSock);
+        bool received;
+        int ret = recvNetlinkAck(writeSock, nlh->nlmsg_seq, &received);
+        // If we failed to read the ack, it might still arrive later.
+        if (!received) writeSockClean = false;
         // A flush works by dumping routes and deleting each route as it's returned, and it can
         // fail if something else deletes the route between the dump and the delete. This can
         // happen, for example, if an interface goes down while we're trying to flush its routes.
@@ -206,7 +625,7 @@ int rtNetlinkFlush(uint16_t getAction, uint16_t deleteAction, const char* what,
         }
     }
 
-    close(writeSock);
+    if (writeSockClean) writeLease.setReusable();
 
     return ret;
 }
@@ -16,9 +16,17 @@
 
 #pragma once
 
+#include <condition_variable>
 #include <functional>
+#include <future>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
 
 #include "NetdConstants.h"
 
@@ -49,15 +57,231 @@ typedef std::function<bool(nlmsghdr *)> NetlinkDumpFilter;
 // failed or receiving the ACK failed.
 [[nodiscard]] int recvNetlinkAck(int sock);
 
+// Like recvNetlinkAck, but skips any responses whose sequence number is not |seq|. If |received|
+// is not null, it is set to whether the ACK was read, which distinguishes errors reported by the
+// kernel from errors receiving the ACK.
+[[nodiscard]] int recvNetlinkAck(int sock, uint32_t seq, bool* received);
+
+// A pool of netlink sockets connected to the kernel, so that sending a request does not need to
+// create, connect and close a socket every time. Thread-safe.
+class NetlinkSocketPool {
+  public:
+    NetlinkSocketPool(int protocol, size_t maxIdle) : mProtocol(protocol), mMaxIdle(maxIdle) {}
+    ~NetlinkSocketPool();
+
+    NetlinkSocketPool(const NetlinkSocketPool&) = delete;
+    NetlinkSocketPool& operator=(const NetlinkSocketPool&) = delete;
+
+    // Exclusive use of one socket. On destruction, the socket is returned to the pool if it was
+    // marked reusable, and closed otherwise.
+    class Lease {
+      public:
+        Lease(Lease&& other) noexcept;
+        ~Lease();
+
+        // The socket, or -errno if it could not be opened.
+        int fd() const { return mFd; }
+
+        // Returns the sequence number to use for the next request on this socket.
+        uint32_t nextSeq() { return ++mSeq; }
+
+        // Call once every response to the requests sent on this socket has been read. Sockets
+        // that might still have responses queued are never reused, so that those responses are
+        // not mistaken for the responses of later requests.
+        void setReusable(bool reusable = true) { mReusable = reusable; }
+
+      private:
+        friend class NetlinkSocketPool;
+        Lease(NetlinkSocketPool* pool, int fd, uint32_t seq) : mPool(pool), mFd(fd), mSeq(seq) {}
+
+        NetlinkSocketPool* mPool;
+        int mFd;
+        uint32_t mSeq;
+        bool mReusable = false;
+    };
+
+    Lease acquire();
+
+    // The pool of NETLINK_ROUTE sockets used by sendNetlinkRequest().
+    static NetlinkSocketPool& route();
+
+  private:
+    struct IdleSocket {
+        int fd;
+        uint32_t seq;
+    };
+
+    void release(int fd, uint32_t seq);
+
+    const int mProtocol;
+    const size_t mMaxIdle;
+    std::mutex mLock;
+    std::vector<IdleSocket> mIdle;  // Guarded by mLock.
+};
+
 // Sends a netlink request and possibly expects an ACK. The first element of iov should be null and
 // will be set to the netlink message headerheader. The subsequent elements are the contents of the
 // request.
 [[nodiscard]] int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen,
                                      const NetlinkDumpCallback* callback);
 
+// The payload of a netlink request, i.e., a fixed |Header| such as rtmsg or fib_rule_hdr followed
+// by attributes, encoded in place in a buffer on the stack. Building a request this way needs no
+// allocation, and the whole payload can be passed to sendNetlinkRequest() or a NetlinkBatch as a
+// single iovec. Padding is zeroed, as older kernels require. |kCapacity| should be the size of the
+// largest request the caller may build; an attribute that does not fit marks the buffer as
+// overflowed instead of being appended.
+template <typename Header, size_t kCapacity>
+class NetlinkRequestBuffer {
+  public:
+    explicit NetlinkRequestBuffer(const Header& header) : mLen(NLMSG_ALIGN(sizeof(Header))) {
+        static_assert(NLMSG_ALIGN(sizeof(Header)) <= kCapacity, "Capacity too small");
+        memcpy(mBuf, &header, sizeof(header));
+    }
+
+    Header* header() { return reinterpret_cast<Header*>(mBuf); }
+
+    // Returns a pointer to the attribute's data, so that it can be patched later, or null if the
+    // attribute did not fit.
+    void* addAttribute(uint16_t type, const void* data, size_t len) {
+        if (RTA_SPACE(len) > kCapacity - mLen) {
+            mOverflowed = true;
+            return nullptr;
+        }
+        rtattr* rta = reinterpret_cast<rtattr*>(mBuf + mLen);
+        rta->rta_len = RTA_LENGTH(len);
+        rta->rta_type = type;
+        memcpy(RTA_DATA(rta), data, len);
+        mLen += RTA_SPACE(len);
+        return RTA_DATA(rta);
+    }
+
+    template <typename T>
+    void* addAttribute(uint16_t type, const T& value) {
+        return addAttribute(type, &value, sizeof(value));
+    }
+
+    bool overflowed() const { return mOverflowed; }
+    iovec iov() { return {mBuf, mLen}; }
+
+  private:
+    alignas(nlmsghdr) uint8_t mBuf[kCapacity] = {};
+    size_t mLen;
+    bool mOverflowed = false;
+};
+
+// Packs many netlink requests into as few sendmsg() calls as possible and collects all their ACKs
+// at once, instead of doing one round trip per request. The kernel processes the requests in
+// order, and keeps processing after a request fails, so every request gets its own result.
+// Not thread-safe.
+class NetlinkBatch {
+  public:
+    // Requests sent per sendmsg() call. Bounded so that the ACKs for one send always fit in the
+    // socket's receive buffer; if they did not, the kernel would drop them.
+    static constexpr size_t kMaxRequestsPerSend = 64;
+
+    explicit NetlinkBatch(NetlinkSocketPool* pool = &NetlinkSocketPool::route()) : mPool(pool) {}
+
+    // Appends a request. As in sendNetlinkRequest, the first element of |iov| is reserved for the
+    // netlink header and is ignored. The contents are copied, so |iov| may point to the stack.
+    // NLM_F_ACK is always set. Returns the index of the request.
+    size_t addRequest(uint16_t action, uint16_t flags, const iovec* iov, int iovlen);
+
+    size_t size() const { return mOffsets.size(); }
+    bool empty() const { return mOffsets.empty(); }
+
+    // Request |i|, including its netlink header. Invalidated by addRequest().
+    const nlmsghdr* request(size_t i) const {
+        return reinterpret_cast<const nlmsghdr*>(mBuffer.data() + mOffsets[i]);
+    }
+
+    // Discards all queued requests without sending them.
+    void clear() {
+        mBuffer.clear();
+        mOffsets.clear();
+    }
+
+    // Sends all queued requests and waits for their ACKs. Returns 0 if every request succeeded,
+    // or the error of the first request that failed. The queue is cleared; per-request results
+    // are available from result() until the next call to addRequest().
+    [[nodiscard]] int send();
+
+    // The result of request |i| in the last send(): 0 or negative errno.
+    int result(size_t i) const { return mResults[i]; }
+
+  private:
+    // Sends requests [begin, end) in one sendmsg() call and collects their ACKs. Returns false if
+    // some ACKs could not be read, in which case the socket must not be reused.
+    bool sendChunk(NetlinkSocketPool::Lease* sock, size_t begin, size_t end);
+
+    NetlinkSocketPool* const mPool;
+    std::vector<uint8_t> mBuffer;
+    std::vector<size_t> mOffsets;  // Offset of each request in mBuffer.
+    std::vector<int> mResults;
+};
+
+// Sends netlink requests without waiting for their ACKs. The ACKs are read on a dedicated thread
+// and passed to completion callbacks. The kernel processes rtnetlink requests synchronously while
+// they are being sent, so by the time send() returns the request has already been applied or
+// rejected; only the result is delivered later. Use it for requests whose failure the caller could
+// only log anyway. Thread-safe.
+class NetlinkAckCollector {
+  public:
+    // Called on the collector thread with 0 or the negative errno reported by the kernel. Must not
+    // block, since it delays the delivery of other ACKs.
+    using Callback = std::function<void(int error)>;
+
+    explicit NetlinkAckCollector(int protocol);
+    ~NetlinkAckCollector();
+
+    NetlinkAckCollector(const NetlinkAckCollector&) = delete;
+    NetlinkAckCollector& operator=(const NetlinkAckCollector&) = delete;
+
+    // Sends a request, as sendNetlinkRequest would. NLM_F_ACK is always set. Returns 0 if the
+    // request was sent, in which case |callback| will be called exactly once; or negative errno if
+    // it could not be sent, in which case |callback| is never called.
+    [[nodiscard]] int send(uint16_t action, uint16_t flags, iovec* iov, int iovlen,
+                           Callback callback);
+
+    // Like the above, but makes the result available through a future. Errors sending the request
+    // are reported through the future too.
+    std::future<int> send(uint16_t action, uint16_t flags, iovec* iov, int iovlen);
+
+    // Blocks until the callbacks of all requests sent so far have returned.
+    void waitForPending();
+
+    // The collector used for NETLINK_ROUTE requests. Never destroyed.
+    static NetlinkAckCollector& route();
+
+  private:
+    void run();
+    // Fails all pending requests with |error|, e.g. because their ACKs were dropped.
+    void failAllPending(int error);
+
+    const int mSock;
+    const int mStopFd;  // An eventfd that tells the collector thread to exit.
+    std::mutex mLock;
+    std::condition_variable mCv;
+    uint32_t mSeq = 0;                         // Guarded by mLock.
+    std::map<uint32_t, Callback> mPending;     // Guarded by mLock.
+    size_t mRunning = 0;                       // Callbacks being run. Guarded by mLock.
+    std::thread mThread;
+};
+
 // Processes a netlink dump, passing every message to the specified |callback|.
 [[nodiscard]] int processNetlinkDump(int sock, const NetlinkDumpCallback& callback);
 
+// Like the above, but reads into |buffer|, which can be reused across dumps. Datagrams larger than
+// the buffer are sized with MSG_PEEK | MSG_TRUNC, and the buffer grows to hold them. The kernel
+// sizes dump datagrams by the largest read seen on the socket, so a large buffer means fewer,
+// larger reads.
+[[nodiscard]] int processNetlinkDump(int sock, const NetlinkDumpCallback& callback,
+                                     std::vector<uint8_t>* buffer);
+
+// Reads one datagram from |sock| into |buffer|, growing it if the datagram does not fit. Returns
+// the number of bytes read, 0 at EOF, or -errno.
+[[nodiscard]] ssize_t recvNetlinkDatagram(int sock, std::vector<uint8_t>* buffer);
+
 // Flushes netlink objects that take an rtmsg structure (FIB rules, routes...). |getAction| and
 // |deleteAction| specify the netlink message types, e.g., RTM_GETRULE and RTM_DELRULE.
 // |shouldDelete| specifies whether a given object should be deleted or not. |what| is a
@@ -22,18 +22,33 @@
 
 #define LOG_TAG "Netd"
 
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
 #include <log/log.h>
 
 #include <android-base/parseint.h>
-#include <android-base/strings.h>
+#include <cutils/uevent.h>
 #include <netutils/ifc.h>
 #include <sysutils/NetlinkEvent.h>
+#include <sysutils/SocketClient.h>
+#include "ClassActivityFilter.h"
 #include "Controllers.h"
+#include "InterfaceRegistry.h"
+#include "InterfaceStateCache.h"
+#include "NetlinkCommands.h"
 #include "NetlinkHandler.h"
 #include "NetlinkManager.h"
+#include "ParameterCache.h"
+#include "RdnssFilter.h"
+#include "ScopedTrace.h"
 #include "SockDiag.h"
+#include "ThreadScheduling.h"
 
+#include <algorithm>
 #include <charconv>
+#include <iterator>
 
 #define BINDER_RETRY(exp)                                                       \
     ({                                                                          \
@@ -51,16 +66,15 @@
         res;                                                                    \
     })
 
-#define LOG_EVENT_FUNC(retry, func, ...)                                                    \
-    do {                                                                                    \
-        const auto listenerMap = gCtls->eventReporter.getNetdUnsolicitedEventListenerMap(); \
-        for (auto& listener : listenerMap) {                                                \
-            auto entry = gUnsolicitedLog.newEntry().function(#func).args(__VA_ARGS__);      \
-            if (retry(listener.first->func(__VA_ARGS__))) {                                 \
-                gUnsolicitedLog.log(entry.withAutomaticDuration());                         \
-            }                                                                               \
-        }                                                                                   \
-    } while (0)
+// Queues a call of |func| to each unsolicited event listener. Calls with the same non-empty
+// |key| describe the same state, so a newer one replaces one that is still queued.
+#define LOG_EVENT_FUNC(retry, key, func, ...)                                                \
+    gCtls->eventReporter.reportUnsolEvent(key, [=](const auto& listener) {                   \
+        auto entry = gUnsolicitedLog.newEntry().function(#func).args(__VA_ARGS__);           \
+        if (retry(listener->func(__VA_ARGS__))) {                                            \
+            gUnsolicitedLog.log(entry.withAutomaticDuration());                              \
+        }                                                                                    \
+    })
 
 namespace android {
 namespace net {
@@ -68,41 +82,204 @@ namespace net {
 constexpr int RETRY_ATTEMPTS = 2;
 constexpr int RETRY_INTERVAL_MICRO_S = 100000;
 
-NetlinkHandler::NetlinkHandler(NetlinkManager *nm, int listenerSocket,
-                               int format) :
-                        NetlinkListener(listenerSocket, format) {
+// The same size as the buffer in sysutils' NetlinkListener.
+constexpr size_t RTNETLINK_BUFFER_SIZE = 64 * 1024;
+
+// Shared by every handler, since RDNSS options and interface removals arrive on different sockets.
+RdnssFilter sRdnssFilter;
+
+NetlinkHandler::NetlinkHandler(NetlinkManager* nm, int listenerSocket, int format, bool rtNetlink,
+                               int rcvBufSize)
+    : NetlinkListener(listenerSocket, format),
+      mRtNetlink(rtNetlink),
+      mRtNetlinkBuffer(rtNetlink ? new char[RTNETLINK_BUFFER_SIZE] : nullptr),
+      mRcvBufSize(rcvBufSize),
+      mClient(listenerSocket, false /* owned */, false /* useCmdNum */) {
     mNm = nm;
 }
 
 NetlinkHandler::~NetlinkHandler() {
 }
 
-int NetlinkHandler::start() {
-    return this->startListener();
+bool NetlinkHandler::onReadable() {
+    return onDataAvailable(&mClient);
 }
 
-int NetlinkHandler::stop() {
-    return this->stopListener();
+bool NetlinkHandler::onDataAvailable(SocketClient* cli) {
+    if (!mRtNetlink) {
+        return NetlinkListener::onDataAvailable(cli);
+    }
+
+    // As in NetlinkListener, but every message in the buffer is decoded, without going through
+    // NetlinkEvent's key=value strings. uevent_kernel_recv() drops messages not sent by the kernel.
+    uid_t uid = -1;
+    ssize_t count = TEMP_FAILURE_RETRY(uevent_kernel_recv(
+            cli->getSocket(), mRtNetlinkBuffer.get(), RTNETLINK_BUFFER_SIZE, true, &uid));
+    if (count < 0) {
+        if (errno == ENOBUFS) {
+            // The socket is still usable. Only the messages that did not fit were dropped.
+            onRtNetlinkOverrun(cli->getSocket());
+            return true;
+        }
+        ALOGE("recvmsg failed (%s)", strerror(errno));
+        return false;
+    }
+
+    ScopedTrace trace("rtnetlink batch bytes=%zd", count);
+    RtNetlinkEvent event;
+    for (auto nh = reinterpret_cast<const nlmsghdr*>(mRtNetlinkBuffer.get()); NLMSG_OK(nh, count);
+         nh = NLMSG_NEXT(nh, count)) {
+        InterfaceController::stateCache().onNetlinkMessage(nh);
+        ParameterCache::onNetlinkMessage(nh);
+        // Before parsing, which looks up interface names in the registry.
+        InterfaceRegistry::onNetlinkMessage(nh);
+        if (parseRtNetlinkEvent(nh, &event)) {
+            onRtNetlinkEvent(event);
+        }
+    }
+    return true;
 }
 
-static long parseIfIndex(const char* ifIndex) {
-    if (ifIndex == nullptr) {
-        return 0;
+void NetlinkHandler::onRtNetlinkOverrun(int sock) {
+    // Grow the buffer so that a burst of the same size fits next time, without making every
+    // socket as large as the worst burst up front.
+    const int newSize = std::min(mRcvBufSize * 2, NetlinkManager::MAX_RCVBUF_SIZE);
+    if (newSize > mRcvBufSize) {
+        if (int ret = NetlinkManager::setRcvBufSize(sock, newSize); ret < 0) {
+            ALOGE("Unable to grow rtnetlink receive buffer to %d: %s", newSize, strerror(-ret));
+        } else {
+            mRcvBufSize = newSize;
+        }
     }
-    long ifaceIndex = strtol(ifIndex, nullptr, 10);
-    // strtol returns 0 on error, which is fine because 0 is not a valid ifindex.
-    if (errno == ERANGE && (ifaceIndex == LONG_MAX || ifaceIndex == LONG_MIN)) {
-        return 0;
+    ALOGW("rtnetlink events lost, resynchronizing links and addresses (rcvbuf %d)", mRcvBufSize);
+    InterfaceController::stateCache().invalidate();
+    InterfaceRegistry::forgetIfindices();
+    ParameterCache::clear();
+
+    // Replay the current state of links and addresses as if each had just changed. The listeners
+    // and NetworkController treat a repeated update as a no-op. Removals that were lost cannot be
+    // recovered from a dump, and neither can RDNSS options. Routes are not dumped: the kernel
+    // would return every route in every table, almost all of which netd installed itself.
+    RtNetlinkEvent event;
+    const NetlinkDumpCallback callback = [this, &event](nlmsghdr* nlh) {
+        InterfaceRegistry::onNetlinkMessage(nlh);
+        if (parseRtNetlinkEvent(nlh, &event)) onRtNetlinkEvent(event);
+    };
+    const auto dump = [&callback](uint16_t type, void* header, size_t len) {
+        iovec iov[] = {{nullptr, 0}, {header, len}};
+        if (int ret = sendNetlinkRequest(type, NETLINK_DUMP_FLAGS, iov, std::size(iov),
+                                         &callback)) {
+            ALOGE("rtnetlink dump of type %d failed: %s", type, strerror(-ret));
+        }
+    };
+    // Zeroed headers ask for every interface of every family.
+    ifinfomsg link = {};
+    dump(RTM_GETLINK, &link, sizeof(link));
+    ifaddrmsg addr = {};
+    dump(RTM_GETADDR, &addr, sizeof(addr));
+}
+
+void NetlinkHandler::onRtNetlinkEvent(const RtNetlinkEvent& event) {
+    ScopedTrace trace("rtnetlink event type=%d iface=%s", static_cast<int>(event.type),
+                      event.ifName);
+    switch (event.type) {
+        case RtNetlinkEvent::Type::LINK_UP:
+        case RtNetlinkEvent::Type::LINK_DOWN:
+            notifyInterfaceLinkChanged(event.ifName, event.type == RtNetlinkEvent::Type::LINK_UP);
+            break;
+        case RtNetlinkEvent::Type::ADDRESS_UPDATED:
+        case RtNetlinkEvent::Type::ADDRESS_REMOVED:
+            onAddressEvent(event);
+            break;
+        case RtNetlinkEvent::Type::RDNSS: {
+            std::vector<std::string> servers;
+            servers.reserve(event.numServers);
+            for (size_t i = 0; i < event.numServers; ++i) {
+                char buf[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &event.servers[i], buf, sizeof(buf));
+                servers.push_back(buf);
+                if (IN6_IS_ADDR_LINKLOCAL(&event.servers[i])) {
+                    servers.back().append("%").append(event.ifName);
+                }
+            }
+            notifyInterfaceDnsServers(event.ifName, event.lifetime, servers);
+            break;
+        }
+        case RtNetlinkEvent::Type::ROUTE_UPDATED:
+        case RtNetlinkEvent::Type::ROUTE_REMOVED: {
+            char dst[INET6_ADDRSTRLEN];
+            inet_ntop(event.family, event.addr, dst, sizeof(dst));
+            char gateway[INET6_ADDRSTRLEN] = "";
+            if (event.hasGateway) {
+                inet_ntop(event.family, event.gateway, gateway, sizeof(gateway));
+            }
+            notifyRouteChange(event.type == RtNetlinkEvent::Type::ROUTE_UPDATED,
+                              std::string(dst) + "/" + std::to_string(event.prefixLength), gateway,
+                              event.ifName);
+            break;
+        }
+    }
+}
+
+void NetlinkHandler::onAddressEvent(const RtNetlinkEvent& event) {
+    const char* iface = event.ifName;
+    const int ifaceIndex = event.ifIndex;
+    if (!ifaceIndex) {
+        ALOGE("invalid interface index: %s(%d)", iface, ifaceIndex);
+    }
+
+    // NetworkController takes IPv4 addresses as IPv4-mapped IPv6 addresses.
+    in6_addr address = {};
+    if (event.family == AF_INET) {
+        address.s6_addr[10] = address.s6_addr[11] = 0xff;
+        memcpy(&address.s6_addr[12], event.addr, sizeof(in_addr));
+    } else {
+        memcpy(&address, event.addr, sizeof(address));
+    }
+    char addrstr[INET6_ADDRSTRLEN];
+    inet_ntop(event.family, event.addr, addrstr, sizeof(addrstr));
+
+    const bool addrUpdated = (event.type == RtNetlinkEvent::Type::ADDRESS_UPDATED);
+    if (addrUpdated) {
+        gCtls->netCtrl.addInterfaceAddress(ifaceIndex, address);
+    } else {  // event.type == RtNetlinkEvent::Type::ADDRESS_REMOVED
+        bool shouldDestroy = gCtls->netCtrl.removeInterfaceAddress(ifaceIndex, address);
+        if (shouldDestroy) {
+            SockDiag sd;
+            if (sd.open()) {
+                sd.setParallel(true);
+                // Pass the interface index iff. destroying sockets on a link-local address.
+                // This cannot use an interface name as the interface might no longer exist.
+                int destroyIfaceIndex =
+                        std::string_view(addrstr).starts_with("fe80:") ? ifaceIndex : 0;
+                int ret = sd.destroySockets(addrstr, destroyIfaceIndex);
+                if (ret < 0) {
+                    ALOGE("Error destroying sockets: %s", strerror(-ret));
+                }
+            } else {
+                ALOGE("Error opening NETLINK_SOCK_DIAG socket: %s", strerror(errno));
+            }
+        }
+    }
+    // Note: if this interface was deleted, iface is "" and we don't notify.
+    if (iface[0]) {
+        const std::string prefix = std::string(addrstr) + "/" + std::to_string(event.prefixLength);
+        if (addrUpdated) {
+            notifyAddressUpdated(prefix, iface, event.addrFlags, event.scope);
+        } else {
+            notifyAddressRemoved(prefix, iface, event.addrFlags, event.scope);
+        }
     }
-    return ifaceIndex;
 }
 
 void NetlinkHandler::onEvent(NetlinkEvent *evt) {
+    ThreadScheduling::applyToCurrentThread(ThreadRole::NETLINK);
     const char *subsys = evt->getSubsystem();
     if (!subsys) {
         ALOGW("No subsystem found in netlink event");
         return;
     }
+    ScopedTrace trace("uevent subsystem=%s action=%d", subsys, static_cast<int>(evt->getAction()));
 
     if (!strcmp(subsys, "net")) {
         NetlinkEvent::Action action = evt->getAction();
@@ -114,79 +291,16 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
         } else if (action == NetlinkEvent::Action::kChange) {
             evt->dump();
             notifyInterfaceChanged("nana", true);
-        } else if (action == NetlinkEvent::Action::kLinkUp) {
-            notifyInterfaceLinkChanged(iface, true);
-        } else if (action == NetlinkEvent::Action::kLinkDown) {
-            notifyInterfaceLinkChanged(iface, false);
-        } else if (action == NetlinkEvent::Action::kAddressUpdated ||
-                   action == NetlinkEvent::Action::kAddressRemoved) {
-            const char *address = evt->findParam("ADDRESS");
-            const char *flags = evt->findParam("FLAGS");
-            const char *scope = evt->findParam("SCOPE");
-            const char *ifIndex = evt->findParam("IFINDEX");
-            char addrstr[INET6_ADDRSTRLEN + strlen("/128")];
-            strlcpy(addrstr, address, sizeof(addrstr));
-            char *slash = strchr(addrstr, '/');
-            if (slash) {
-                *slash = '\0';
-            }
-
-            long ifaceIndex = parseIfIndex(ifIndex);
-            if (!ifaceIndex) {
-                ALOGE("invalid interface index: %s(%s)", iface, ifIndex);
-            }
-            const bool addrUpdated = (action == NetlinkEvent::Action::kAddressUpdated);
-            if (addrUpdated) {
-                gCtls->netCtrl.addInterfaceAddress(ifaceIndex, address);
-            } else {  // action == NetlinkEvent::Action::kAddressRemoved
-                bool shouldDestroy = gCtls->netCtrl.removeInterfaceAddress(ifaceIndex, address);
-                if (shouldDestroy) {
-                    SockDiag sd;
-                    if (sd.open()) {
-                        // Pass the interface index iff. destroying sockets on a link-local address.
-                        // This cannot use an interface name as the interface might no longer exist.
-                        int destroyIfaceIndex =
-                                std::string_view(addrstr).starts_with("fe80:") ? ifaceIndex : 0;
-                        int ret = sd.destroySockets(addrstr, destroyIfaceIndex);
-                        if (ret < 0) {
-                            ALOGE("Error destroying sockets: %s", strerror(-ret));
-                        }
-                    } else {
-                        ALOGE("Error opening NETLINK_SOCK_DIAG socket: %s", strerror(errno));
-                    }
-                }
-            }
-            // Note: if this interface was deleted, iface is "" and we don't notify.
-            if (iface && iface[0] && address && flags && scope) {
-                if (addrUpdated) {
-                    notifyAddressUpdated(address, iface, std::stoi(flags), std::stoi(scope));
-                } else {
-                    notifyAddressRemoved(address, iface, std::stoi(flags), std::stoi(scope));
-                }
-            }
-        } else if (action == NetlinkEvent::Action::kRdnss) {
-            const char *lifetime = evt->findParam("LIFETIME");
-            const char *servers = evt->findParam("SERVERS");
-            if (lifetime && servers) {
-                notifyInterfaceDnsServers(iface, strtol(lifetime, nullptr, 10),
-                                          android::base::Split(servers, ","));
-            }
-        } else if (action == NetlinkEvent::Action::kRouteUpdated ||
-                   action == NetlinkEvent::Action::kRouteRemoved) {
-            const char *route = evt->findParam("ROUTE");
-            const char *gateway = evt->findParam("GATEWAY");
-            const char *iface = evt->findParam("INTERFACE");
-            if (route && (gateway || iface)) {
-                notifyRouteChange((action == NetlinkEvent::Action::kRouteUpdated) ? true : false,
-                                  route, (gateway == nullptr) ? "" : gateway,
-                                  (iface == nullptr) ? "" : iface);
-            }
         }
+        // Link state, address, route and RDNSS changes come from the NETLINK_ROUTE handler,
+        // which decodes them in onRtNetlinkEvent().
 
     } else if (!strcmp(subsys, "qlog") || !strcmp(subsys, "xt_quota2")) {
         const char *alertName = evt->findParam("ALERT_NAME");
         const char *iface = evt->findParam("INTERFACE");
         if (alertName && iface) {
+            // Hitting a quota means heavy traffic: report TCP stats without waiting.
+            gCtls->tcpSocketMonitor.requestPoll();
             notifyQuotaLimitReached(alertName, iface);
         }
 
@@ -194,7 +308,11 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
         const char *uid = evt->findParam("UID");
         const char *hex = evt->findParam("HEX");
         if (uid && hex) {
-            notifyStrictCleartext(strtol(uid, nullptr, 10), hex);
+            const uid_t appUid = strtol(uid, nullptr, 10);
+            // Rate limited per UID, so that a flood of cleartext packets is not a flood of events.
+            if (gCtls->strictCtrl.cleartextFilter.shouldReport(appUid)) {
+                notifyStrictCleartext(appUid, hex);
+            }
         }
 
     } else if (!strcmp(subsys, "xt_idletimer")) {
@@ -224,54 +342,71 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
     }
 }
 
+void NetlinkHandler::onUnsolEventListenerRegistered() {
+    sRdnssFilter.clearAll();
+}
+
 void NetlinkHandler::notifyInterfaceAdded(const std::string& ifName) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceAdded, ifName);
+    LOG_EVENT_FUNC(BINDER_RETRY, "", onInterfaceAdded, ifName);
 }
 
 void NetlinkHandler::notifyInterfaceRemoved(const std::string& ifName) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceRemoved, ifName);
+    sRdnssFilter.clear(ifName);
+    LOG_EVENT_FUNC(BINDER_RETRY, "", onInterfaceRemoved, ifName);
 }
 
 void NetlinkHandler::notifyInterfaceChanged(const std::string& ifName, bool up) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceChanged, ifName, up);
+    LOG_EVENT_FUNC(BINDER_RETRY, "changed/" + ifName, onInterfaceChanged, ifName, up);
 }
 
 void NetlinkHandler::notifyInterfaceLinkChanged(const std::string& ifName, bool up) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceLinkStateChanged, ifName, up);
+    LOG_EVENT_FUNC(BINDER_RETRY, "link/" + ifName, onInterfaceLinkStateChanged, ifName, up);
 }
 
 void NetlinkHandler::notifyQuotaLimitReached(const std::string& labelName,
                                              const std::string& ifName) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onQuotaLimitReached, labelName, ifName);
+    LOG_EVENT_FUNC(BINDER_RETRY, "", onQuotaLimitReached, labelName, ifName);
 }
 
 void NetlinkHandler::notifyInterfaceClassActivityChanged(int label, bool isActive,
                                                          int64_t timestamp, int uid) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceClassActivityChanged, isActive, label, timestamp, uid);
+    // Shared by every handler, since both idle timer backends report through whichever one is
+    // listening for uevents.
+    static ClassActivityFilter filter([](int label, bool isActive, int64_t timestamp, int uid) {
+        LOG_EVENT_FUNC(BINDER_RETRY, "", onInterfaceClassActivityChanged, isActive, label,
+                       timestamp, uid);
+    });
+    filter.onChange(label, isActive, timestamp, uid);
 }
 
 void NetlinkHandler::notifyAddressUpdated(const std::string& addr, const std::string& ifName,
                                           int flags, int scope) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceAddressUpdated, addr, ifName, flags, scope);
+    LOG_EVENT_FUNC(BINDER_RETRY, "address/" + addr + "/" + ifName, onInterfaceAddressUpdated, addr,
+                   ifName, flags, scope);
 }
 
 void NetlinkHandler::notifyAddressRemoved(const std::string& addr, const std::string& ifName,
                                           int flags, int scope) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceAddressRemoved, addr, ifName, flags, scope);
+    LOG_EVENT_FUNC(BINDER_RETRY, "address/" + addr + "/" + ifName, onInterfaceAddressRemoved, addr,
+                   ifName, flags, scope);
 }
 
 void NetlinkHandler::notifyInterfaceDnsServers(const std::string& ifName, int64_t lifetime,
                                                const std::vector<std::string>& servers) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onInterfaceDnsServerInfo, ifName, lifetime, servers);
+    if (!sRdnssFilter.shouldReport(ifName, lifetime, servers)) return;
+    LOG_EVENT_FUNC(BINDER_RETRY, "", onInterfaceDnsServerInfo, ifName, lifetime, servers);
 }
 
 void NetlinkHandler::notifyRouteChange(bool updated, const std::string& route,
                                        const std::string& gateway, const std::string& ifName) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onRouteChanged, updated, route, gateway, ifName);
+    // A route that flaps during a burst, e.g. while an RA is processed, is only reported in the
+    // state it ends up in.
+    LOG_EVENT_FUNC(BINDER_RETRY, "route/" + route + "/" + gateway + "/" + ifName, onRouteChanged,
+                   updated, route, gateway, ifName);
 }
 
 void NetlinkHandler::notifyStrictCleartext(uid_t uid, const std::string& hex) {
-    LOG_EVENT_FUNC(BINDER_RETRY, onStrictCleartextDetected, uid, hex);
+    LOG_EVENT_FUNC(BINDER_RETRY, "", onStrictCleartextDetected, uid, hex);
 }
 
 }  // namespace net
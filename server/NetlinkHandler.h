@@ -17,13 +17,16 @@
 #ifndef _NETLINKHANDLER_H
 #define _NETLINKHANDLER_H
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <sysutils/NetlinkEvent.h>
 // TODO: stop depending on sysutils/NetlinkListener.h
 #include <sysutils/NetlinkListener.h>
+#include <sysutils/SocketClient.h>
 #include "NetlinkManager.h"
+#include "RtNetlinkEvent.h"
 
 namespace android {
 namespace net {
@@ -31,22 +34,48 @@ namespace net {
 class NetlinkHandler : public ::NetlinkListener {
     NetlinkManager *mNm;
 
+    // Whether this handler decodes rtnetlink messages itself instead of through NetlinkEvent.
+    const bool mRtNetlink;
+    std::unique_ptr<char[]> mRtNetlinkBuffer;
+    // The receive buffer size of the listener socket, which is doubled on every overrun.
+    int mRcvBufSize;
+    // Wraps the listener socket, which it does not own, for NetlinkListener::onDataAvailable().
+    SocketClient mClient;
+
 public:
-    NetlinkHandler(NetlinkManager *nm, int listenerSocket, int format);
+    // If |rtNetlink| is true, |listenerSocket| must be a NETLINK_ROUTE socket, whose messages are
+    // decoded into RtNetlinkEvents directly from their attributes. |rcvBufSize| is the receive
+    // buffer size that the socket was given.
+    NetlinkHandler(NetlinkManager* nm, int listenerSocket, int format, bool rtNetlink = false,
+                   int rcvBufSize = 0);
     virtual ~NetlinkHandler();
 
-    int start();
-    int stop();
+    // Reads and handles the messages queued on the listener socket. NetlinkManager calls this
+    // from its event loop whenever the socket is readable, instead of the handler starting a
+    // SocketListener thread of its own. Returns false if the socket failed.
+    bool onReadable();
+    int getSocket() { return mClient.getSocket(); }
+
+    // Makes the next RDNSS update of every interface be reported, so that an unsolicited event
+    // listener registered since the last one learns the servers without waiting for them to
+    // change or get close to expiring. Call after registering the listener.
+    static void onUnsolEventListenerRegistered();
+
+    // Also called for the idle timers that IdletimerController implements by polling.
+    void notifyInterfaceClassActivityChanged(int label, bool isActive, int64_t timestamp, int uid);
 
   protected:
     virtual void onEvent(NetlinkEvent *evt);
+    bool onDataAvailable(SocketClient* cli) override;
+    void onRtNetlinkEvent(const RtNetlinkEvent& event);
+    void onAddressEvent(const RtNetlinkEvent& event);
+    void onRtNetlinkOverrun(int sock);
 
     void notifyInterfaceAdded(const std::string& ifName);
     void notifyInterfaceRemoved(const std::string& ifName);
     void notifyInterfaceChanged(const std::string& ifName, bool isUp);
     void notifyInterfaceLinkChanged(const std::string& ifName, bool isUp);
     void notifyQuotaLimitReached(const std::string& labelName, const std::string& ifName);
-    void notifyInterfaceClassActivityChanged(int label, bool isActive, int64_t timestamp, int uid);
     void notifyAddressUpdated(const std::string& addr, const std::string& ifName, int flags,
                               int scope);
     void notifyAddressRemoved(const std::string& addr, const std::string& ifName, int flags,
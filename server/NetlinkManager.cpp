@@ -19,6 +19,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -29,6 +31,7 @@
 
 #define LOG_TAG "Netd"
 
+#include <android-base/properties.h>
 #include <log/log.h>
 
 #include <linux/netfilter/nfnetlink.h>
@@ -37,6 +40,11 @@
 
 #include <arpa/inet.h>
 
+#include <iterator>
+
+#include "Controllers.h"
+#include "InterfaceController.h"
+#include "InterfaceStateCache.h"
 #include "NetlinkManager.h"
 #include "NetlinkHandler.h"
 
@@ -48,6 +56,32 @@ namespace net {
 const int NetlinkManager::NFLOG_QUOTA_GROUP = 1;
 const int NetlinkManager::NETFILTER_STRICT_GROUP = 2;
 const int NetlinkManager::NFLOG_WAKEUP_GROUP = 3;
+const int NetlinkManager::MAX_RCVBUF_SIZE = 8 * 1024 * 1024;
+
+namespace {
+
+// The initial receive buffer size of each netlink socket, in bytes. The route socket's buffer
+// grows on overruns, so this only needs to be raised if the other sockets lose events.
+constexpr const char NETLINK_RCVBUF_PROPERTY[] = "persist.netd.netlink_rcvbuf_bytes";
+constexpr int DEFAULT_RCVBUF_SIZE = 64 * 1024;
+
+}  // namespace
+
+int NetlinkManager::getRcvBufSize() {
+    return android::base::GetIntProperty(NETLINK_RCVBUF_PROPERTY, DEFAULT_RCVBUF_SIZE, 4096,
+                                         MAX_RCVBUF_SIZE);
+}
+
+int NetlinkManager::setRcvBufSize(int sock, int size) {
+    // When running in a net/user namespace, SO_RCVBUFFORCE will fail because
+    // it will check for the CAP_NET_ADMIN capability in the root namespace.
+    // Try using SO_RCVBUF if that fails.
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
 
 NetlinkManager *NetlinkManager::sInstance = nullptr;
 
@@ -68,7 +102,7 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
     int groups, int format, bool configNflog) {
 
     struct sockaddr_nl nladdr;
-    int sz = 64 * 1024;
+    const int sz = getRcvBufSize();
     int on = 1;
 
     memset(&nladdr, 0, sizeof(nladdr));
@@ -82,12 +116,8 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
         return nullptr;
     }
 
-    // When running in a net/user namespace, SO_RCVBUFFORCE will fail because
-    // it will check for the CAP_NET_ADMIN capability in the root namespace.
-    // Try using SO_RCVBUF if that fails.
-    if (setsockopt(*sock, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) < 0 &&
-        setsockopt(*sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) < 0) {
-        ALOGE("Unable to set uevent socket SO_RCVBUF option: %s", strerror(errno));
+    if (int ret = setRcvBufSize(*sock, sz); ret < 0) {
+        ALOGE("Unable to set uevent socket SO_RCVBUF option: %s", strerror(-ret));
         close(*sock);
         return nullptr;
     }
@@ -119,9 +149,14 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
         }
     }
 
-    NetlinkHandler *handler = new NetlinkHandler(this, *sock, format);
-    if (handler->start()) {
+    NetlinkHandler* handler =
+            new NetlinkHandler(this, *sock, format, netlinkFamily == NETLINK_ROUTE, sz);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = handler;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, *sock, &event) < 0) {
         ALOGE("Unable to start NetlinkHandler: %s", strerror(errno));
+        delete handler;
         close(*sock);
         return nullptr;
     }
@@ -129,11 +164,47 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
     return handler;
 }
 
+void NetlinkManager::runEventLoop() {
+    epoll_event events[8];
+    while (true) {
+        const int n = TEMP_FAILURE_RETRY(epoll_wait(mEpollFd, events, std::size(events), -1));
+        if (n < 0) {
+            ALOGE("epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            // The stop eventfd is the only file registered without a handler.
+            if (events[i].data.ptr == nullptr) return;
+            NetlinkHandler* handler = static_cast<NetlinkHandler*>(events[i].data.ptr);
+            if (!handler->onReadable()) {
+                // Stop watching the socket rather than spinning on an error it keeps returning.
+                epoll_ctl(mEpollFd, EPOLL_CTL_DEL, handler->getSocket(), nullptr);
+            }
+        }
+    }
+}
+
 int NetlinkManager::start() {
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    mStopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    epoll_event stopEvent = {};
+    stopEvent.events = EPOLLIN;
+    stopEvent.data.ptr = nullptr;
+    if (mEpollFd < 0 || mStopFd < 0 ||
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mStopFd, &stopEvent) < 0) {
+        ALOGE("Unable to create netlink event loop: %s", strerror(errno));
+        return -1;
+    }
+
     if ((mUeventHandler = setupSocket(&mUeventSock, NETLINK_KOBJECT_UEVENT,
          0xffffffff, NetlinkListener::NETLINK_FORMAT_ASCII, false)) == nullptr) {
         return -1;
     }
+    // xt_IDLETIMER reports through uevents, so its replacement reports through the same handler.
+    gCtls->idletimerCtrl.setActivityListener(
+            [handler = mUeventHandler](int label, bool isActive, int64_t timestampNs) {
+                handler->notifyInterfaceClassActivityChanged(label, isActive, timestampNs, -1);
+            });
 
     if ((mRouteHandler = setupSocket(&mRouteSock, NETLINK_ROUTE,
                                      RTMGRP_LINK |
@@ -144,6 +215,8 @@ int NetlinkManager::start() {
          NetlinkListener::NETLINK_FORMAT_BINARY, false)) == nullptr) {
         return -1;
     }
+    // Every link and IPv4 address change now reaches the route handler.
+    InterfaceController::stateCache().setEnabled(true);
 
     if ((mQuotaHandler = setupSocket(&mQuotaSock, NETLINK_NFLOG,
             NFLOG_QUOTA_GROUP, NetlinkListener::NETLINK_FORMAT_BINARY, false)) == nullptr) {
@@ -157,28 +230,32 @@ int NetlinkManager::start() {
         // TODO: return -1 once the emulator gets a new kernel.
     }
 
+    mEventThread = std::thread(&NetlinkManager::runEventLoop, this);
     return 0;
 }
 
 int NetlinkManager::stop() {
-    int status = 0;
-
-    if (mUeventHandler->stop()) {
-        ALOGE("Unable to stop uevent NetlinkHandler: %s", strerror(errno));
-        status = -1;
+    // Stop the handlers before any of them is deleted. Once the thread has returned, no handler
+    // runs, except for idle timer changes reported by IdletimerController.
+    const uint64_t one = 1;
+    if (write(mStopFd, &one, sizeof(one)) < 0) {
+        ALOGE("Unable to stop netlink event loop: %s", strerror(errno));
+        return -1;
     }
+    if (mEventThread.joinable()) mEventThread.join();
+    close(mEpollFd);
+    mEpollFd = -1;
+    close(mStopFd);
+    mStopFd = -1;
 
+    gCtls->idletimerCtrl.setActivityListener(nullptr);
     delete mUeventHandler;
     mUeventHandler = nullptr;
 
     close(mUeventSock);
     mUeventSock = -1;
 
-    if (mRouteHandler->stop()) {
-        ALOGE("Unable to stop route NetlinkHandler: %s", strerror(errno));
-        status = -1;
-    }
-
+    InterfaceController::stateCache().setEnabled(false);
     delete mRouteHandler;
     mRouteHandler = nullptr;
 
@@ -186,11 +263,6 @@ int NetlinkManager::stop() {
     mRouteSock = -1;
 
     if (mQuotaHandler) {
-        if (mQuotaHandler->stop()) {
-            ALOGE("Unable to stop quota NetlinkHandler: %s", strerror(errno));
-            status = -1;
-        }
-
         delete mQuotaHandler;
         mQuotaHandler = nullptr;
 
@@ -199,11 +271,6 @@ int NetlinkManager::stop() {
     }
 
     if (mStrictHandler) {
-        if (mStrictHandler->stop()) {
-            ALOGE("Unable to stop strict NetlinkHandler: %s", strerror(errno));
-            status = -1;
-        }
-
         delete mStrictHandler;
         mStrictHandler = nullptr;
 
@@ -211,7 +278,7 @@ int NetlinkManager::stop() {
         mStrictSock = -1;
     }
 
-    return status;
+    return 0;
 }
 
 }  // namespace net
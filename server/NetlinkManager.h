@@ -17,6 +17,8 @@
 #ifndef _NETLINKMANAGER_H
 #define _NETLINKMANAGER_H
 
+#include <thread>
+
 #include <sysutils/SocketListener.h>
 #include <sysutils/NetlinkListener.h>
 
@@ -39,6 +41,12 @@ private:
     int                  mRouteSock;
     int                  mQuotaSock;
     int                  mStrictSock;
+    // All handlers are run by mEventThread, which waits for their sockets on mEpollFd, so that
+    // netlink events are handled in one place and in the order they are read. Writing to mStopFd
+    // makes the thread return.
+    int                  mEpollFd = -1;
+    int                  mStopFd = -1;
+    std::thread          mEventThread;
 
 public:
     virtual ~NetlinkManager();
@@ -58,10 +66,19 @@ public:
     /* Group used by WakeupController rules */
     static const int NFLOG_WAKEUP_GROUP;
 
+    /* Largest receive buffer that a netlink socket is given, in bytes */
+    static const int MAX_RCVBUF_SIZE;
+
+    /* Initial receive buffer size of the netlink sockets, from a system property */
+    static int getRcvBufSize();
+    /* Sets the receive buffer size of |sock|. Returns 0 on success or a negative errno. */
+    static int setRcvBufSize(int sock, int size);
+
 private:
     NetlinkManager();
     NetlinkHandler* setupSocket(int *sock, int netlinkFamily, int groups,
         int format, bool configNflog);
+    void runEventLoop();
 };
 
 }  // namespace net
@@ -23,6 +23,8 @@
 
 #include <android-base/strings.h>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 namespace android {
 namespace net {
@@ -103,6 +105,48 @@ bool Network::appliesToUser(uid_t uid, int32_t* subPriority) const {
     return false;
 }
 
+UidRangeMap Network::getRuleUidRangeMap() const {
+    UidRangeMap rules;
+    for (const auto& [subPriority, uidRanges] : mUidRangeMap) {
+        rules[subPriority] = uidRanges.coalesced();
+    }
+    return rules;
+}
+
+void Network::getRuleChanges(const UidRanges& uidRanges, int32_t subPriority, bool add,
+                             UidRangeMap* rulesToAdd, UidRangeMap* rulesToRemove) const {
+    UidRanges current;
+    if (auto iter = mUidRangeMap.find(subPriority); iter != mUidRangeMap.end()) {
+        current = iter->second;
+    }
+    const UidRanges before = current.coalesced();
+    if (add) {
+        current.add(uidRanges);
+    } else {
+        current.remove(uidRanges);
+    }
+    const UidRanges after = current.coalesced();
+
+    // Both are sorted and disjoint, so the ranges that are in only one of them are found in a
+    // single pass.
+    const auto key = [](const UidRangeParcel& range) { return std::pair(range.start, range.stop); };
+    std::vector<UidRangeParcel> added, removed;
+    auto b = before.getRanges().begin(), bEnd = before.getRanges().end();
+    auto a = after.getRanges().begin(), aEnd = after.getRanges().end();
+    while (b != bEnd || a != aEnd) {
+        if (a == aEnd || (b != bEnd && key(*b) < key(*a))) {
+            removed.push_back(*b++);
+        } else if (b == bEnd || key(*a) < key(*b)) {
+            added.push_back(*a++);
+        } else {
+            ++a;
+            ++b;
+        }
+    }
+    if (!added.empty()) (*rulesToAdd)[subPriority] = UidRanges(added);
+    if (!removed.empty()) (*rulesToRemove)[subPriority] = UidRanges(removed);
+}
+
 void Network::addToUidRangeMap(const UidRanges& uidRanges, int32_t subPriority) {
     auto iter = mUidRangeMap.find(subPriority);
     if (iter != mUidRangeMap.end()) {
@@ -129,7 +173,24 @@ void Network::clearAllowedUids() {
 }
 
 void Network::setAllowedUids(const UidRanges& uidRanges) {
-    mAllowedUids = uidRanges;
+    // Only used for lookups, so there is no need to keep the ranges as given. hasUid() also needs
+    // them disjoint to be correct.
+    mAllowedUids = uidRanges.coalesced();
+}
+
+bool Network::addAllowedUids(const UidRanges& uidRanges) {
+    UidRanges merged = mAllowedUids ? mAllowedUids->merge(uidRanges) : uidRanges.coalesced();
+    if (mAllowedUids && merged.getRanges() == mAllowedUids->getRanges()) return false;
+    mAllowedUids = std::move(merged);
+    return true;
+}
+
+bool Network::removeAllowedUids(const UidRanges& uidRanges) {
+    if (!mAllowedUids) return false;
+    UidRanges remaining = mAllowedUids->subtract(uidRanges);
+    if (remaining.getRanges() == mAllowedUids->getRanges()) return false;
+    mAllowedUids = std::move(remaining);
+    return true;
 }
 
 bool Network::isUidAllowed(uid_t uid) {
@@ -50,6 +50,10 @@ public:
     std::string uidRangesToString() const;
     std::string allowedUidsToString() const;
     bool appliesToUser(uid_t uid, int32_t* subPriority) const;
+    const UidRangeMap& getUidRangeMap() const { return mUidRangeMap; }
+    // The UID ranges that routing rules are installed for: those of each subsidiary priority,
+    // coalesced, so that adjacent and overlapping ranges share one rule.
+    UidRangeMap getRuleUidRangeMap() const;
     virtual Permission getPermission() const = 0;
     [[nodiscard]] virtual int addUsers(const UidRanges&, int32_t /*subPriority*/) {
         return -EINVAL;
@@ -67,11 +71,21 @@ public:
     virtual void removeFromUidRangeMap(const UidRanges& uidRanges, int32_t subPriority);
     void clearAllowedUids();
     void setAllowedUids(const UidRanges& uidRanges);
+    // Add to or remove from the UIDs that can explicitly select this network. Adding to a network
+    // without an allowlist creates one that holds only |uidRanges|; removing from one does
+    // nothing. Both return whether the allowlist changed.
+    bool addAllowedUids(const UidRanges& uidRanges);
+    bool removeAllowedUids(const UidRanges& uidRanges);
     bool isUidAllowed(uid_t uid);
+    const std::optional<UidRanges>& getAllowedUids() const { return mAllowedUids; }
 
   protected:
     explicit Network(unsigned netId, bool secure = false);
     bool canAddUidRanges(const UidRanges& uidRanges) const;
+    // Computes the rule ranges, as returned by getRuleUidRangeMap(), that adding |uidRanges| to
+    // or removing them from |subPriority| creates and deletes. Does not change the map.
+    void getRuleChanges(const UidRanges& uidRanges, int32_t subPriority, bool add,
+                        UidRangeMap* rulesToAdd, UidRangeMap* rulesToRemove) const;
 
     const unsigned mNetId;
     std::set<std::string> mInterfaces;
@@ -22,12 +22,25 @@
 // Public functions accessible by external callers should be thread-safe and are responsible for
 // acquiring the lock. Private functions in this file should call xxxLocked() methods and access
 // internal state directly.
+//
+// Functions that only pick networks and marks for a UID, such as getNetworkForConnect() and
+// getNetworkContext(), are called for every connect() and DNS query. They don't take the lock, but
+// read an immutable Snapshot of the state, which every change publishes before releasing the lock.
 
 #define LOG_TAG "Netd"
 
 #include "NetworkController.h"
 
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+#include <arpa/inet.h>
+
 #include <android-base/strings.h>
+#include <android-base/thread_annotations.h>
 #include <cutils/misc.h>  // FIRST_APPLICATION_UID
 #include <netd_resolv/resolv.h>
 #include <net/if.h>
@@ -35,13 +48,16 @@
 
 #include "Controllers.h"
 #include "DummyNetwork.h"
+#include "DumpBuffer.h"
 #include "Fwmark.h"
 #include "LocalNetwork.h"
 #include "PhysicalNetwork.h"
 #include "RouteController.h"
+#include "SockDiag.h"
 #include "TcUtils.h"
 #include "UnreachableNetwork.h"
 #include "VirtualNetwork.h"
+#include "netd_dump.pb.h"
 #include "netdutils/DumpWriter.h"
 #include "netdutils/Utils.h"
 #include "netid_client.h"
@@ -59,8 +75,21 @@ namespace {
 const unsigned MIN_NET_ID = 100;
 const unsigned MAX_NET_ID = 65535;
 
+// Bounds the memory used by the per-UID network cache. When full, it is emptied and refilled.
+const size_t MAX_CACHED_USERS = 4096;
+
+int destroySockets(const UidRanges& uidRanges, const std::set<uid_t>& skipUids) {
+    SockDiag sd;
+    if (!sd.open()) return -EIO;
+    sd.setParallel(true);
+    return sd.destroySockets(uidRanges, skipUids, true /* excludeLoopback */);
+}
+
 }  // namespace
 
+int (*NetworkController::destroySocketsFunction)(const UidRanges&, const std::set<uid_t>&) =
+        destroySockets;
+
 // All calls to methods here are made while holding a write lock on mRWLock.
 // They are mostly not called directly from this class, but from methods in PhysicalNetwork.cpp.
 // However, we're the only user of that class, so all calls to those methods come from here and are
@@ -141,6 +170,277 @@ int NetworkController::DelegateImpl::modifyFallthrough(const std::string& physic
     return 0;
 }
 
+namespace {
+
+// Rough per-element overhead of node-based containers, for dump(). A red-black tree node holds
+// three pointers and a color; a hash table node holds a next pointer and a cached hash, and the
+// table holds one pointer per bucket.
+constexpr size_t kTreeNodeOverhead = 4 * sizeof(void*);
+constexpr size_t kHashNodeOverhead = 2 * sizeof(void*);
+
+template <typename Tree>
+size_t treeMemoryUsage(const Tree& tree) {
+    return tree.size() * (sizeof(typename Tree::value_type) + kTreeNodeOverhead);
+}
+
+template <typename HashTable>
+size_t hashTableMemoryUsage(const HashTable& table) {
+    return table.size() * (sizeof(typename HashTable::value_type) + kHashNodeOverhead) +
+           table.bucket_count() * sizeof(void*);
+}
+
+// An immutable map stored as a sorted array. Compared to std::map, it needs one allocation instead
+// of one per entry, and lookups are a binary search over contiguous memory.
+template <typename K, typename V>
+class FlatMap {
+  public:
+    FlatMap() = default;
+    explicit FlatMap(const std::map<K, V>& map) : mEntries(map.begin(), map.end()) {}
+
+    const V* find(const K& key) const {
+        auto iter = std::lower_bound(
+                mEntries.begin(), mEntries.end(), key,
+                [](const std::pair<K, V>& entry, const K& value) { return entry.first < value; });
+        return (iter != mEntries.end() && iter->first == key) ? &iter->second : nullptr;
+    }
+
+    size_t size() const { return mEntries.size(); }
+    size_t memoryUsage() const { return mEntries.capacity() * sizeof(std::pair<K, V>); }
+
+  private:
+    std::vector<std::pair<K, V>> mEntries;
+};
+
+// An immutable set stored as a sorted array. See FlatMap.
+template <typename K>
+class FlatSet {
+  public:
+    FlatSet() = default;
+    explicit FlatSet(const std::set<K>& set) : mKeys(set.begin(), set.end()) {}
+
+    bool contains(const K& key) const {
+        return std::binary_search(mKeys.begin(), mKeys.end(), key);
+    }
+
+    size_t size() const { return mKeys.size(); }
+    size_t memoryUsage() const { return mKeys.capacity() * sizeof(K); }
+
+  private:
+    std::vector<K> mKeys;
+};
+
+// The UIDs allowed to use a network, compiled for lookup. The ranges are merged into disjoint runs
+// and their bounds stored in two parallel arrays, so a lookup is a binary search over the starts
+// alone, which for typical allowlists fits in a cache line or two.
+class UidAllowlist {
+  public:
+    explicit UidAllowlist(const UidRanges& uidRanges) {
+        const UidRanges coalesced = uidRanges.coalesced();
+        mStarts.reserve(coalesced.getRanges().size());
+        mStops.reserve(coalesced.getRanges().size());
+        for (const auto& range : coalesced.getRanges()) {
+            mStarts.push_back(range.start);
+            mStops.push_back(range.stop);
+        }
+    }
+
+    bool contains(uid_t uid) const {
+        if (uid > static_cast<uid_t>(INT32_MAX)) return false;
+        // The last run starting at or before |uid|.
+        auto iter = std::upper_bound(mStarts.begin(), mStarts.end(), static_cast<int32_t>(uid));
+        if (iter == mStarts.begin()) return false;
+        return static_cast<int32_t>(uid) <= mStops[iter - mStarts.begin() - 1];
+    }
+
+    size_t memoryUsage() const {
+        return (mStarts.capacity() + mStops.capacity()) * sizeof(int32_t);
+    }
+
+  private:
+    std::vector<int32_t> mStarts;
+    std::vector<int32_t> mStops;
+};
+
+// The parts of a Network that are needed to pick networks and marks for a UID.
+struct NetworkInfo {
+    unsigned netId;
+    bool isPhysical;
+    bool isVirtual;
+    bool isUnreachable;
+    bool isSecure;
+    Permission permission;
+    // UIDs that can explicitly select this network, or no value if all UIDs can.
+    std::optional<UidAllowlist> allowedUids;
+
+    bool isUidAllowed(uid_t uid) const { return !allowedUids || allowedUids->contains(uid); }
+};
+
+// All networks, and the UIDs they apply to. A new Topology is built for every change, so the
+// networks that apply to a UID can be cached for as long as it lives.
+class Topology {
+  public:
+    Topology(const std::map<unsigned, NetworkInfo>& networks, const UidRangeIndex& uidRangeIndex)
+        : mNetworks(networks), mUidRangeIndex(uidRangeIndex) {
+        for (const auto& [_, network] : networks) {
+            if (network.allowedUids) mAllowlistMemoryUsage += network.allowedUids->memoryUsage();
+        }
+    }
+
+    const NetworkInfo* getNetwork(unsigned netId) const { return mNetworks.find(netId); }
+
+    // Whether |network| has a UID range, at any subsidiary priority, that includes |uid|.
+    bool appliesToUser(const NetworkInfo& network, uid_t uid) const {
+        for (const auto& [netId, _] : mUidRangeIndex.lookup(uid)) {
+            if (netId == network.netId) return true;
+        }
+        return false;
+    }
+
+    struct UserNetworks {
+        const NetworkInfo* virtualNetwork;
+        const NetworkInfo* physicalOrUnreachableNetwork;
+    };
+
+    UserNetworks getUserNetworks(uid_t uid) const {
+        {
+            std::lock_guard lock(mCacheLock);
+            auto iter = mCache.find(uid);
+            if (iter != mCache.end()) return iter->second;
+        }
+        const UserNetworks userNetworks = {
+                .virtualNetwork = findVirtualNetworkForUser(uid),
+                .physicalOrUnreachableNetwork = findPhysicalOrUnreachableNetworkForUser(uid),
+        };
+        std::lock_guard lock(mCacheLock);
+        if (mCache.size() >= MAX_CACHED_USERS) {
+            mCache.clear();
+        }
+        mCache[uid] = userNetworks;
+        return userNetworks;
+    }
+
+    size_t networkCount() const { return mNetworks.size(); }
+    size_t memoryUsage() const {
+        std::lock_guard lock(mCacheLock);
+        return mNetworks.memoryUsage() + mAllowlistMemoryUsage + mUidRangeIndex.memoryUsage() +
+               hashTableMemoryUsage(mCache);
+    }
+    size_t cachedUserCount() const {
+        std::lock_guard lock(mCacheLock);
+        return mCache.size();
+    }
+
+  private:
+    const NetworkInfo* findVirtualNetworkForUser(uid_t uid) const;
+    const NetworkInfo* findPhysicalOrUnreachableNetworkForUser(uid_t uid) const;
+
+    const FlatMap<unsigned, NetworkInfo> mNetworks;  // Map keys are NetIds.
+    const UidRangeIndex mUidRangeIndex;
+    size_t mAllowlistMemoryUsage = 0;
+    // Filled in by concurrent readers.
+    mutable std::mutex mCacheLock;
+    mutable std::unordered_map<uid_t, UserNetworks> mCache GUARDED_BY(mCacheLock);
+};
+
+}  // namespace
+
+class NetworkController::Snapshot {
+  public:
+    unsigned defaultNetId;
+    std::shared_ptr<const Topology> topology;
+    std::shared_ptr<const FlatMap<uid_t, Permission>> users;
+    std::shared_ptr<const FlatSet<uid_t>> protectableUsers;
+
+    // Sets |*netId| to an appropriate NetId to use for DNS for the given user. Call with |*netId|
+    // set to a non-NETID_UNSET value if the user already has indicated a preference. Returns the
+    // fwmark value to set on the socket when performing the DNS request.
+    uint32_t getNetworkForDns(unsigned* netId, uid_t uid) const;
+    unsigned getNetworkForUser(uid_t uid) const;
+    unsigned getNetworkForConnect(uid_t uid) const;
+    Permission getPermissionForUser(uid_t uid) const;
+    bool canProtect(uid_t uid) const;
+    int checkUserNetworkAccess(uid_t uid, unsigned netId) const;
+    bool isUidAllowed(unsigned netId, uid_t uid) const;
+
+    // Returns the context for |netId| and |uid|. The app netId and mark are computed on first use
+    // and cached: they only depend on the contents of the snapshot, so the cache is dropped with
+    // the snapshot. The DNS netId and mark also depend on whether the resolver has servers for a
+    // VPN, which can change without a new snapshot, so they are computed on every call.
+    android_net_context getNetworkContext(unsigned netId, uid_t uid) const;
+    size_t cachedContextCount() const;
+    size_t contextCacheMemoryUsage() const;
+
+  private:
+    struct AppContext {
+        unsigned netId;
+        uint32_t mark;
+    };
+
+    AppContext computeAppContext(unsigned netId, uid_t uid) const;
+
+    static uint64_t contextKey(unsigned netId, uid_t uid) {
+        return (static_cast<uint64_t>(netId) << 32) | uid;
+    }
+
+    // Filled in by concurrent readers.
+    mutable std::mutex mContextCacheLock;
+    mutable std::unordered_map<uint64_t, AppContext> mContextCache GUARDED_BY(mContextCacheLock);
+};
+
+std::shared_ptr<const NetworkController::Snapshot> NetworkController::snapshot() const {
+    return std::atomic_load(&mSnapshot);
+}
+
+void NetworkController::publishSnapshotLocked(int parts) {
+    if (mInTransaction) {
+        mPendingSnapshotParts |= parts;
+        return;
+    }
+    std::shared_ptr<const Snapshot> previous = snapshot();
+    auto next = std::make_shared<Snapshot>();
+    next->defaultNetId = mDefaultNetId;
+
+    if ((parts & SNAPSHOT_TOPOLOGY) || !previous) {
+        std::map<unsigned, NetworkInfo> networks;
+        for (const auto& [netId, network] : mNetworks) {
+            std::optional<UidAllowlist> allowedUids;
+            if (const auto& uidRanges = network->getAllowedUids()) allowedUids.emplace(*uidRanges);
+            networks[netId] = {
+                    .netId = netId,
+                    .isPhysical = network->isPhysical(),
+                    .isVirtual = network->isVirtual(),
+                    .isUnreachable = network->isUnreachable(),
+                    .isSecure = network->isSecure(),
+                    .permission = network->getPermission(),
+                    .allowedUids = std::move(allowedUids),
+            };
+        }
+        next->topology = std::make_shared<const Topology>(networks, mUidRangeIndex);
+    } else {
+        next->topology = previous->topology;
+    }
+    next->users = ((parts & SNAPSHOT_USERS) || !previous)
+                          ? std::make_shared<const FlatMap<uid_t, Permission>>(mUsers)
+                          : previous->users;
+    next->protectableUsers = ((parts & SNAPSHOT_PROTECTABLE_USERS) || !previous)
+                                     ? std::make_shared<const FlatSet<uid_t>>(mProtectableUsers)
+                                     : previous->protectableUsers;
+
+    std::atomic_store(&mSnapshot, std::shared_ptr<const Snapshot>(std::move(next)));
+    if (mStateChangedCallback) {
+        mStateChangedCallback({
+                .defaultNetId = mDefaultNetId,
+                .hasUidRanges = mUidRangeIndex.segmentCount() > 0,
+        });
+    }
+}
+
+void NetworkController::setStateChangedCallback(
+        std::function<void(const StateSummary&)> callback) {
+    ScopedWLock lock(mRWLock);
+    mStateChangedCallback = std::move(callback);
+}
+
 NetworkController::NetworkController() :
         mDelegateImpl(new NetworkController::DelegateImpl(this)), mDefaultNetId(NETID_UNSET),
         mProtectableUsers({AID_VPN}) {
@@ -148,6 +448,7 @@ NetworkController::NetworkController() :
     mNetworks[LOCAL_NET_ID] = new LocalNetwork(LOCAL_NET_ID);
     mNetworks[DUMMY_NET_ID] = new DummyNetwork(DUMMY_NET_ID);
     mNetworks[UNREACHABLE_NET_ID] = new UnreachableNetwork(UNREACHABLE_NET_ID);
+    publishSnapshotLocked(SNAPSHOT_ALL);
 
     // Clear all clsact stubs on all interfaces.
     // TODO: perhaps only remove the clsact on the interface which is added by
@@ -166,17 +467,27 @@ NetworkController::NetworkController() :
 }
 
 unsigned NetworkController::getDefaultNetwork() const {
-    ScopedRLock lock(mRWLock);
-    return mDefaultNetId;
+    return snapshot()->defaultNetId;
 }
 
 int NetworkController::setDefaultNetwork(unsigned netId) {
     ScopedWLock lock(mRWLock);
+    // Send the rules of each network in one netlink batch, as applyTopologyTransaction() does.
+    RouteController::beginRuleTransaction();
+    int ret = setDefaultNetworkLocked(netId);
+    if (int err = RouteController::commitRuleTransaction(); err && !ret) {
+        ALOGE("Failed to commit routing rules for default network %u: %s", netId, strerror(-err));
+        ret = err;
+    }
+    return ret;
+}
 
+int NetworkController::setDefaultNetworkLocked(unsigned netId) {
     if (netId == mDefaultNetId) {
         return 0;
     }
 
+    PhysicalNetwork* newDefault = nullptr;
     if (netId != NETID_UNSET) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -187,47 +498,71 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
             ALOGE("cannot set default to non-physical network with netId %u", netId);
             return -EINVAL;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->addAsDefault()) {
-            return ret;
-        }
+        newDefault = static_cast<PhysicalNetwork*>(network);
     }
-
+    PhysicalNetwork* oldDefault = nullptr;
     if (mDefaultNetId != NETID_UNSET) {
         Network* network = getNetworkLocked(mDefaultNetId);
         if (!network || !network->isPhysical()) {
             ALOGE("cannot find previously set default network with netId %u", mDefaultNetId);
             return -ESRCH;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->removeAsDefault()) {
+        oldDefault = static_cast<PhysicalNetwork*>(network);
+    }
+
+    // Make before break: the new network's default rules are added before the old network's are
+    // removed. Both have the same priority, and the kernel evaluates rules of equal priority in
+    // the order they were added, so traffic keeps using the old network until its rules are gone,
+    // and there is never a moment without a default network. The new rules are sent, and checked,
+    // before the old ones are removed; if any of them fails, the ones that were added are removed
+    // again and nothing else changes.
+    if (newDefault) {
+        int ret = newDefault->addAsDefault();
+        if (int err = RouteController::flushRuleTransaction(); err && !ret) ret = err;
+        if (ret) {
+            ALOGE("Failed to add default rules of netId %u: %s", netId, strerror(-ret));
+            // Rules that were not added fail with ENOENT, so errors are expected here.
+            (void)newDefault->removeAsDefault();
+            (void)RouteController::flushRuleTransaction();
             return ret;
         }
     }
 
+    // The new network is the default as soon as its rules are in place, even if removing the old
+    // network's rules fails below.
+    int ret = oldDefault ? oldDefault->removeAsDefault() : 0;
+    if (int err = RouteController::flushRuleTransaction(); err && !ret) ret = err;
+    if (ret) {
+        ALOGE("Failed to remove default rules of netId %u: %s", mDefaultNetId, strerror(-ret));
+    }
+
     mDefaultNetId = netId;
-    return 0;
+    publishSnapshotLocked(0);
+    return ret;
 }
 
-uint32_t NetworkController::getNetworkForDnsLocked(unsigned* netId, uid_t uid) const {
+uint32_t NetworkController::Snapshot::getNetworkForDns(unsigned* netId, uid_t uid) const {
     Fwmark fwmark;
     fwmark.protectedFromVpn = true;
     fwmark.permission = PERMISSION_SYSTEM;
 
-    Network* appDefaultNetwork = getPhysicalOrUnreachableNetworkForUserLocked(uid);
-    unsigned defaultNetId = appDefaultNetwork ? appDefaultNetwork->getNetId() : mDefaultNetId;
+    const Topology::UserNetworks userNetworks = topology->getUserNetworks(uid);
+    const NetworkInfo* appDefaultNetwork = userNetworks.physicalOrUnreachableNetwork;
+    unsigned userDefaultNetId = appDefaultNetwork ? appDefaultNetwork->netId : defaultNetId;
 
     // Common case: there is no VPN that applies to the user, and the query did not specify a netId.
     // Therefore, it is safe to set the explicit bit on this query and skip all the complex logic
     // below. While this looks like a special case, it is actually the one that handles the vast
     // majority of DNS queries.
     // TODO: untangle this code.
-    if (*netId == NETID_UNSET && getVirtualNetworkForUserLocked(uid) == nullptr) {
-        *netId = defaultNetId;
+    if (*netId == NETID_UNSET && userNetworks.virtualNetwork == nullptr) {
+        *netId = userDefaultNetId;
         fwmark.netId = *netId;
         fwmark.explicitlySelected = true;
         return fwmark.intValue;
     }
 
-    if (checkUserNetworkAccessLocked(uid, *netId) == 0) {
+    if (checkUserNetworkAccess(uid, *netId) == 0) {
         // If a non-zero NetId was explicitly specified, and the user has permission for that
         // network, use that network's DNS servers. (possibly falling through the to the default
         // network if the VPN doesn't provide a route to them).
@@ -236,22 +571,22 @@ uint32_t NetworkController::getNetworkForDnsLocked(unsigned* netId, uid_t uid) c
         // If the network is a VPN and it doesn't have DNS servers, use the default network's DNS
         // servers (through the default network). Otherwise, the query is guaranteed to fail.
         // http://b/29498052
-        Network *network = getNetworkLocked(*netId);
-        if (network && network->isVirtual() && !resolv_has_nameservers(*netId)) {
-            *netId = defaultNetId;
+        const NetworkInfo* network = topology->getNetwork(*netId);
+        if (network && network->isVirtual && !resolv_has_nameservers(*netId)) {
+            *netId = userDefaultNetId;
         }
     } else {
         // If the user is subject to a VPN and the VPN provides DNS servers, use those servers
         // (possibly falling through to the default network if the VPN doesn't provide a route to
         // them). Otherwise, use the default network's DNS servers.
         // TODO: Consider if we should set the explicit bit here.
-        VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-        if (virtualNetwork && resolv_has_nameservers(virtualNetwork->getNetId())) {
-            *netId = virtualNetwork->getNetId();
+        const NetworkInfo* virtualNetwork = userNetworks.virtualNetwork;
+        if (virtualNetwork && resolv_has_nameservers(virtualNetwork->netId)) {
+            *netId = virtualNetwork->netId;
         } else {
             // TODO: return an error instead of silently doing the DNS lookup on the wrong network.
             // http://b/27560555
-            *netId = defaultNetId;
+            *netId = userDefaultNetId;
         }
     }
     fwmark.netId = *netId;
@@ -261,15 +596,19 @@ uint32_t NetworkController::getNetworkForDnsLocked(unsigned* netId, uid_t uid) c
 // Returns the NetId that a given UID would use if no network is explicitly selected. Specifically,
 // the VPN that applies to the UID if any; Otherwise, the default network for UID; Otherwise the
 // unreachable network that applies to the UID; lastly, the default network.
-unsigned NetworkController::getNetworkForUser(uid_t uid) const {
-    ScopedRLock lock(mRWLock);
-    if (VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid)) {
-        return virtualNetwork->getNetId();
+unsigned NetworkController::Snapshot::getNetworkForUser(uid_t uid) const {
+    const Topology::UserNetworks userNetworks = topology->getUserNetworks(uid);
+    if (const NetworkInfo* virtualNetwork = userNetworks.virtualNetwork) {
+        return virtualNetwork->netId;
     }
-    if (Network* network = getPhysicalOrUnreachableNetworkForUserLocked(uid)) {
-        return network->getNetId();
+    if (const NetworkInfo* network = userNetworks.physicalOrUnreachableNetwork) {
+        return network->netId;
     }
-    return mDefaultNetId;
+    return defaultNetId;
+}
+
+unsigned NetworkController::getNetworkForUser(uid_t uid) const {
+    return snapshot()->getNetworkForUser(uid);
 }
 
 // Returns the NetId that will be set when a socket connect()s. This is the bypassable VPN that
@@ -294,33 +633,78 @@ unsigned NetworkController::getNetworkForUser(uid_t uid) const {
 // routed to that network, assuming the network's UID ranges still apply to the UID. While this
 // means that fallthrough to the default network does not work, physical networks not expected
 // ever to be split tunnels.
-unsigned NetworkController::getNetworkForConnectLocked(uid_t uid) const {
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && !virtualNetwork->isSecure()) {
-        return virtualNetwork->getNetId();
+unsigned NetworkController::Snapshot::getNetworkForConnect(uid_t uid) const {
+    const Topology::UserNetworks userNetworks = topology->getUserNetworks(uid);
+    const NetworkInfo* virtualNetwork = userNetworks.virtualNetwork;
+    if (virtualNetwork && !virtualNetwork->isSecure) {
+        return virtualNetwork->netId;
     }
-    if (Network* network = getPhysicalOrUnreachableNetworkForUserLocked(uid)) {
-        return network->getNetId();
+    if (const NetworkInfo* network = userNetworks.physicalOrUnreachableNetwork) {
+        return network->netId;
     }
-    return mDefaultNetId;
+    return defaultNetId;
 }
 
 unsigned NetworkController::getNetworkForConnect(uid_t uid) const {
-    ScopedRLock lock(mRWLock);
-    return getNetworkForConnectLocked(uid);
+    return snapshot()->getNetworkForConnect(uid);
 }
 
 void NetworkController::getNetworkContext(
         unsigned netId, uid_t uid, struct android_net_context* netcontext) const {
-    ScopedRLock lock(mRWLock);
+    const android_net_context nc = snapshot()->getNetworkContext(netId, uid);
+
+    if (DBG) {
+        ALOGD("app_netid:0x%x app_mark:0x%x dns_netid:0x%x dns_mark:0x%x uid:%d",
+              nc.app_netid, nc.app_mark, nc.dns_netid, nc.dns_mark, uid);
+    }
+
+    if (netcontext) {
+        *netcontext = nc;
+    }
+}
+
+android_net_context NetworkController::Snapshot::getNetworkContext(unsigned netId,
+                                                                    uid_t uid) const {
+    const uint64_t key = contextKey(netId, uid);
+    std::optional<AppContext> app;
+    {
+        std::lock_guard lock(mContextCacheLock);
+        auto iter = mContextCache.find(key);
+        if (iter != mContextCache.end()) app = iter->second;
+    }
+    if (!app) {
+        app = computeAppContext(netId, uid);
+        std::lock_guard lock(mContextCacheLock);
+        if (mContextCache.size() >= MAX_CACHED_USERS) {
+            mContextCache.clear();
+        }
+        mContextCache[key] = *app;
+    }
 
     struct android_net_context nc = {
-            .app_netid = netId,
-            .app_mark = MARK_UNSET,
+            .app_netid = app->netId,
+            .app_mark = app->mark,
             .dns_netid = netId,
             .dns_mark = MARK_UNSET,
             .uid = uid,
     };
+    nc.dns_mark = getNetworkForDns(&(nc.dns_netid), uid);
+    return nc;
+}
+
+size_t NetworkController::Snapshot::cachedContextCount() const {
+    std::lock_guard lock(mContextCacheLock);
+    return mContextCache.size();
+}
+
+size_t NetworkController::Snapshot::contextCacheMemoryUsage() const {
+    std::lock_guard lock(mContextCacheLock);
+    return hashTableMemoryUsage(mContextCache);
+}
+
+NetworkController::Snapshot::AppContext NetworkController::Snapshot::computeAppContext(
+        unsigned netId, uid_t uid) const {
+    AppContext app = {.netId = netId, .mark = MARK_UNSET};
 
     // |netId| comes directly (via dnsproxyd) from the value returned by netIdForResolv() in the
     // client process. This value is nonzero iff.:
@@ -335,28 +719,18 @@ void NetworkController::getNetworkContext(
     //
     // In all these cases (with the possible exception of #3), the right thing to do is to treat
     // such cases as explicitlySelected.
-    const bool explicitlySelected = (nc.app_netid != NETID_UNSET);
+    const bool explicitlySelected = (app.netId != NETID_UNSET);
     if (!explicitlySelected) {
-        nc.app_netid = getNetworkForConnectLocked(uid);
+        app.netId = getNetworkForConnect(uid);
     }
 
     Fwmark fwmark;
-    fwmark.netId = nc.app_netid;
+    fwmark.netId = app.netId;
     fwmark.explicitlySelected = explicitlySelected;
-    fwmark.protectedFromVpn = explicitlySelected && canProtectLocked(uid);
-    fwmark.permission = getPermissionForUserLocked(uid);
-    nc.app_mark = fwmark.intValue;
-
-    nc.dns_mark = getNetworkForDnsLocked(&(nc.dns_netid), uid);
-
-    if (DBG) {
-        ALOGD("app_netid:0x%x app_mark:0x%x dns_netid:0x%x dns_mark:0x%x uid:%d",
-              nc.app_netid, nc.app_mark, nc.dns_netid, nc.dns_mark, uid);
-    }
-
-    if (netcontext) {
-        *netcontext = nc;
-    }
+    fwmark.protectedFromVpn = explicitlySelected && canProtect(uid);
+    fwmark.permission = getPermissionForUser(uid);
+    app.mark = fwmark.intValue;
+    return app;
 }
 
 unsigned NetworkController::getNetworkForInterfaceLocked(const char* interface) const {
@@ -417,6 +791,7 @@ int NetworkController::createPhysicalNetworkLocked(unsigned netId, Permission pe
     }
 
     mNetworks[netId] = physicalNetwork;
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
 
     updateTcpSocketMonitorPolling();
 
@@ -457,7 +832,22 @@ int NetworkController::createPhysicalOemNetwork(Permission permission, unsigned
 int NetworkController::createVirtualNetwork(unsigned netId, bool secure, NativeVpnType vpnType,
                                             bool excludeLocalRoutes) {
     ScopedWLock lock(mRWLock);
+    // Send the fallthrough rules for all interfaces of the default network in one netlink batch.
+    RouteController::beginRuleTransaction();
+    int ret = createVirtualNetworkLocked(netId, secure, vpnType, excludeLocalRoutes);
+    if (int err = RouteController::commitRuleTransaction(); err && !ret) {
+        ALOGE("Failed to commit fallthrough rules for VPN %u: %s", netId, strerror(-err));
+        // Some of the rules may have been added. Destroying the network removes them.
+        if (int destroyErr = destroyNetworkLocked(netId)) {
+            ALOGE("Failed to destroy VPN %u: %s", netId, strerror(-destroyErr));
+        }
+        ret = err;
+    }
+    return ret;
+}
 
+int NetworkController::createVirtualNetworkLocked(unsigned netId, bool secure,
+                                                  NativeVpnType vpnType, bool excludeLocalRoutes) {
     if (!(MIN_NET_ID <= netId && netId <= MAX_NET_ID)) {
         ALOGE("invalid netId %u", netId);
         return -EINVAL;
@@ -477,12 +867,16 @@ int NetworkController::createVirtualNetwork(unsigned netId, bool secure, NativeV
         return ret;
     }
     mNetworks[netId] = new VirtualNetwork(netId, secure, excludeLocalRoutes);
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
     return 0;
 }
 
 int NetworkController::destroyNetwork(unsigned netId) {
     ScopedWLock lock(mRWLock);
+    return destroyNetworkLocked(netId);
+}
 
+int NetworkController::destroyNetworkLocked(unsigned netId) {
     if (netId == LOCAL_NET_ID || netId == UNREACHABLE_NET_ID) {
         ALOGE("cannot destroy local or unreachable network");
         return -EINVAL;
@@ -517,6 +911,8 @@ int NetworkController::destroyNetwork(unsigned netId) {
         }
     }
     mNetworks.erase(netId);
+    mUidRangeIndex.removeNetwork(netId);
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
     delete network;
 
     for (auto iter = mIfindexToLastNetId.begin(); iter != mIfindexToLastNetId.end();) {
@@ -534,7 +930,10 @@ int NetworkController::destroyNetwork(unsigned netId) {
 
 int NetworkController::addInterfaceToNetwork(unsigned netId, const char* interface) {
     ScopedWLock lock(mRWLock);
+    return addInterfaceToNetworkLocked(netId, interface);
+}
 
+int NetworkController::addInterfaceToNetworkLocked(unsigned netId, const char* interface) {
     if (!isValidNetworkLocked(netId)) {
         ALOGE("no such netId %u", netId);
         return -ENONET;
@@ -569,7 +968,10 @@ int NetworkController::addInterfaceToNetwork(unsigned netId, const char* interfa
 
 int NetworkController::removeInterfaceFromNetwork(unsigned netId, const char* interface) {
     ScopedWLock lock(mRWLock);
+    return removeInterfaceFromNetworkLocked(netId, interface);
+}
 
+int NetworkController::removeInterfaceFromNetworkLocked(unsigned netId, const char* interface) {
     if (!isValidNetworkLocked(netId)) {
         ALOGE("no such netId %u", netId);
         return -ENONET;
@@ -579,8 +981,7 @@ int NetworkController::removeInterfaceFromNetwork(unsigned netId, const char* in
 }
 
 Permission NetworkController::getPermissionForUser(uid_t uid) const {
-    ScopedRLock lock(mRWLock);
-    return getPermissionForUserLocked(uid);
+    return snapshot()->getPermissionForUser(uid);
 }
 
 void NetworkController::setPermissionForUsers(Permission permission,
@@ -589,32 +990,37 @@ void NetworkController::setPermissionForUsers(Permission permission,
     for (uid_t uid : uids) {
         mUsers[uid] = permission;
     }
+    publishSnapshotLocked(SNAPSHOT_USERS);
 }
 
 int NetworkController::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
-    ScopedRLock lock(mRWLock);
-    return checkUserNetworkAccessLocked(uid, netId);
+    return snapshot()->checkUserNetworkAccess(uid, netId);
 }
 
 int NetworkController::setPermissionForNetworks(Permission permission,
                                                 const std::vector<unsigned>& netIds) {
     ScopedWLock lock(mRWLock);
+    int ret = 0;
     for (unsigned netId : netIds) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
             ALOGE("no such netId %u", netId);
-            return -ENONET;
+            ret = -ENONET;
+            break;
         }
         if (!network->isPhysical()) {
             ALOGE("cannot set permissions on non-physical network with netId %u", netId);
-            return -EINVAL;
+            ret = -EINVAL;
+            break;
         }
 
-        if (int ret = static_cast<PhysicalNetwork*>(network)->setPermission(permission)) {
-            return ret;
+        if ((ret = static_cast<PhysicalNetwork*>(network)->setPermission(permission))) {
+            break;
         }
     }
-    return 0;
+    // The networks before the one that failed have been changed.
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
+    return ret;
 }
 
 namespace {
@@ -637,21 +1043,39 @@ int isWrongNetworkForUidRanges(unsigned netId, Network* network) {
 int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRanges,
                                          int32_t subPriority) {
     ScopedWLock lock(mRWLock);
+    return addUsersToNetworkLocked(netId, uidRanges, subPriority);
+}
+
+int NetworkController::addUsersToNetworkLocked(unsigned netId, const UidRanges& uidRanges,
+                                               int32_t subPriority) {
     Network* network = getNetworkLocked(netId);
     if (int ret = isWrongNetworkForUidRanges(netId, network)) {
         return ret;
     }
-    return network->addUsers(uidRanges, subPriority);
+    int ret = network->addUsers(uidRanges, subPriority);
+    // Resync even if the change fails, because it may have been partially applied.
+    mUidRangeIndex.setNetwork(netId, network->getUidRangeMap());
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
+    return ret;
 }
 
 int NetworkController::removeUsersFromNetwork(unsigned netId, const UidRanges& uidRanges,
                                               int32_t subPriority) {
     ScopedWLock lock(mRWLock);
+    return removeUsersFromNetworkLocked(netId, uidRanges, subPriority);
+}
+
+int NetworkController::removeUsersFromNetworkLocked(unsigned netId, const UidRanges& uidRanges,
+                                                    int32_t subPriority) {
     Network* network = getNetworkLocked(netId);
     if (int ret = isWrongNetworkForUidRanges(netId, network)) {
         return ret;
     }
-    return network->removeUsers(uidRanges, subPriority);
+    int ret = network->removeUsers(uidRanges, subPriority);
+    // Resync even if the change fails, because it may have been partially applied.
+    mUidRangeIndex.setNetwork(netId, network->getUidRangeMap());
+    publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
+    return ret;
 }
 
 int NetworkController::addRoute(unsigned netId, const char* interface, const char* destination,
@@ -669,33 +1093,260 @@ int NetworkController::removeRoute(unsigned netId, const char* interface, const
     return modifyRoute(netId, interface, destination, nexthop, ROUTE_REMOVE, legacy, uid, 0);
 }
 
-void NetworkController::addInterfaceAddress(unsigned ifIndex, const char* address) {
+int NetworkController::applyTopologyTransaction(
+        const std::vector<TopologyOperation>& operations, size_t* failedIndex) {
+    std::vector<size_t> socketOperations;
+    if (int ret = applyTopologyChanges(operations, &socketOperations, failedIndex)) {
+        return ret;
+    }
+    return destroyTopologySockets(operations, socketOperations, failedIndex);
+}
+
+int NetworkController::applyTopologyChanges(const std::vector<TopologyOperation>& operations,
+                                            std::vector<size_t>* socketOperations,
+                                            size_t* failedIndex) {
+    ScopedWLock lock(mRWLock);
+    IptablesRestoreController::Batch iptablesBatch(&gCtls->iptablesRestoreCtrl);
+    RouteController::beginRuleTransaction();
+    mInTransaction = true;
+    mPendingSnapshotParts = 0;
+
+    int ret = 0;
+    std::vector<std::pair<size_t, size_t>> routeOperations;
+    for (size_t i = 0; i < operations.size(); ++i) {
+        if (operations[i].type == TopologyOperation::DESTROY_SOCKETS) {
+            socketOperations->push_back(i);
+            continue;
+        }
+        const bool isRoute = operations[i].type == TopologyOperation::ADD_ROUTE ||
+                             operations[i].type == TopologyOperation::REMOVE_ROUTE;
+        // Anything else may depend on the routes of the run, e.g., by flushing their table.
+        if (!isRoute && !routeOperations.empty() &&
+            (ret = commitRouteOperations(&routeOperations, operations.size(), failedIndex))) {
+            break;
+        }
+        if (isRoute) {
+            if (routeOperations.empty()) RouteController::beginRouteBatch();
+            routeOperations.emplace_back(i, RouteController::routeBatchSize());
+        }
+        if ((ret = applyTopologyOperationLocked(operations[i]))) {
+            ALOGE("Topology operation %zu of %zu failed: %s", i, operations.size(),
+                  strerror(-ret));
+            *failedIndex = i;
+            // It is not part of the run unless it queued route changes before failing.
+            if (isRoute && routeOperations.back().second == RouteController::routeBatchSize()) {
+                routeOperations.pop_back();
+            }
+            break;
+        }
+    }
+    // The route changes queued before a failure were made by earlier operations, which are not
+    // rolled back, so they are sent even then. If one of them fails, it is the first failure.
+    // This also closes a batch that the failed operation opened without queuing anything.
+    if (int err = commitRouteOperations(&routeOperations, operations.size(), failedIndex)) {
+        ret = err;
+    }
+
+    // Rule and iptables errors are only known once the batches are sent, and cannot be
+    // attributed to a single operation.
+    if (int err = RouteController::commitRuleTransaction(); err && !ret) {
+        ALOGE("Failed to commit routing rules for topology transaction: %s", strerror(-err));
+        *failedIndex = operations.size();
+        ret = err;
+    }
+    if (iptablesBatch.commit() && !ret) {
+        ALOGE("Failed to commit iptables rules for topology transaction");
+        *failedIndex = operations.size();
+        ret = -EREMOTEIO;
+    }
+
+    mInTransaction = false;
+    publishSnapshotLocked(mPendingSnapshotParts);
+    return ret;
+}
+
+int NetworkController::destroyTopologySockets(const std::vector<TopologyOperation>& operations,
+                                              const std::vector<size_t>& socketOperations,
+                                              size_t* failedIndex) {
+    std::vector<int> results(socketOperations.size());
+    std::atomic<size_t> next = 0;
+    const auto worker = [&] {
+        for (size_t i = next++; i < socketOperations.size(); i = next++) {
+            const TopologyOperation& operation = operations[socketOperations[i]];
+            results[i] = destroySocketsFunction(operation.uidRanges, operation.skipUids);
+        }
+    };
+
+    // Each thread, this one included, takes the next operation until there are none left.
+    const size_t numThreads = std::min(socketOperations.size(), kMaxSocketDestroyThreads);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i]) {
+            *failedIndex = socketOperations[i];
+            ALOGE("Topology operation %zu failed to destroy sockets: %s", *failedIndex,
+                  strerror(-results[i]));
+            return results[i];
+        }
+    }
+    return 0;
+}
+
+int NetworkController::commitRouteOperations(
+        std::vector<std::pair<size_t, size_t>>* routeOperations, size_t numOperations,
+        size_t* failedIndex) {
+    const size_t numChanges = RouteController::routeBatchSize();
+    size_t failedChange = 0;
+    const int ret = RouteController::commitRouteBatch(&failedChange);
+    if (ret) {
+        // The last operation that had queued no more than |failedChange| changes before it.
+        const auto it = std::upper_bound(routeOperations->begin(), routeOperations->end(),
+                                         failedChange,
+                                         [](size_t change, const std::pair<size_t, size_t>& op) {
+                                             return change < op.second;
+                                         });
+        // The batch undoes the changes after the failed one, but an operation that queued none
+        // sent its route at once, because it uses a nexthop object, and is applied anyway.
+        bool laterApplied = failedChange >= numChanges;
+        for (auto op = it; op != routeOperations->end() && !laterApplied; ++op) {
+            const size_t end = std::next(op) == routeOperations->end() ? numChanges
+                                                                       : std::next(op)->second;
+            laterApplied = end == op->second;
+        }
+        *failedIndex = laterApplied ? numOperations : std::prev(it)->first;
+        ALOGE("Route change of topology operation %zu failed: %s", std::prev(it)->first,
+              strerror(-ret));
+    }
+    routeOperations->clear();
+    return ret;
+}
+
+int NetworkController::applyTopologyOperationLocked(const TopologyOperation& operation) {
+    const unsigned netId = operation.netId;
+    const char* interface = operation.interface.c_str();
+    const char* nexthop = operation.nexthop.empty() ? nullptr : operation.nexthop.c_str();
+    switch (operation.type) {
+        case TopologyOperation::CREATE_PHYSICAL_NETWORK:
+            return createPhysicalNetworkLocked(netId, operation.permission, false /* local */);
+        case TopologyOperation::CREATE_VIRTUAL_NETWORK:
+            return createVirtualNetworkLocked(netId, operation.secure, operation.vpnType,
+                                              operation.excludeLocalRoutes);
+        case TopologyOperation::DESTROY_NETWORK:
+            return destroyNetworkLocked(netId);
+        case TopologyOperation::ADD_INTERFACE:
+            return addInterfaceToNetworkLocked(netId, interface);
+        case TopologyOperation::REMOVE_INTERFACE:
+            return removeInterfaceFromNetworkLocked(netId, interface);
+        case TopologyOperation::ADD_ROUTE:
+            return modifyRouteLocked(netId, interface, operation.destination.c_str(), nexthop,
+                                     ROUTE_ADD, false /* legacy */, INVALID_UID, operation.mtu);
+        case TopologyOperation::REMOVE_ROUTE:
+            return modifyRouteLocked(netId, interface, operation.destination.c_str(), nexthop,
+                                     ROUTE_REMOVE, false /* legacy */, INVALID_UID, 0);
+        case TopologyOperation::ADD_USERS:
+            return addUsersToNetworkLocked(netId, operation.uidRanges, operation.subPriority);
+        case TopologyOperation::REMOVE_USERS:
+            return removeUsersFromNetworkLocked(netId, operation.uidRanges,
+                                                operation.subPriority);
+        case TopologyOperation::SET_DEFAULT:
+            return setDefaultNetworkLocked(netId);
+        case TopologyOperation::ADD_ALLOWED_USERS:
+        case TopologyOperation::REMOVE_ALLOWED_USERS:
+        case TopologyOperation::CLEAR_ALLOWED_USERS:
+            return modifyAllowedUsersLocked(operation);
+        case TopologyOperation::DESTROY_SOCKETS:
+            // Run by destroyTopologySockets() instead.
+            break;
+    }
+    return -EINVAL;
+}
+
+int NetworkController::modifyAllowedUsersLocked(const TopologyOperation& operation) {
+    Network* network = getNetworkLocked(operation.netId);
+    if (!network) return -ENONET;
+
+    bool changed = false;
+    switch (operation.type) {
+        case TopologyOperation::ADD_ALLOWED_USERS:
+            changed = network->addAllowedUids(operation.uidRanges);
+            break;
+        case TopologyOperation::REMOVE_ALLOWED_USERS:
+            changed = network->removeAllowedUids(operation.uidRanges);
+            break;
+        case TopologyOperation::CLEAR_ALLOWED_USERS:
+            changed = network->getAllowedUids().has_value();
+            network->clearAllowedUids();
+            break;
+        default:
+            return -EINVAL;
+    }
+    if (changed) publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
+    return 0;
+}
+
+NetworkController::AddressKey NetworkController::toAddressKey(const in6_addr& address) {
+    AddressKey key;
+    memcpy(key.data(), &address, sizeof(address));
+    return key;
+}
+
+std::string NetworkController::addressKeyToString(const AddressKey& key) {
+    in6_addr address;
+    memcpy(&address, key.data(), sizeof(address));
+    char buf[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&address)) {
+        inet_ntop(AF_INET, &address.s6_addr[12], buf, sizeof(buf));
+    } else {
+        inet_ntop(AF_INET6, &address, buf, sizeof(buf));
+    }
+    return buf;
+}
+
+size_t NetworkController::AddressKeyHash::operator()(const AddressKey& key) const {
+    return std::hash<std::string_view>()(
+            std::string_view(reinterpret_cast<const char*>(key.data()), key.size()));
+}
+
+void NetworkController::addInterfaceAddress(unsigned ifIndex, const in6_addr& address) {
     ScopedWLock lock(mRWLock);
+    const AddressKey key = toAddressKey(address);
     if (ifIndex == 0) {
-        ALOGE("Attempting to add address %s without ifindex", address);
+        ALOGE("Attempting to add address %s without ifindex", addressKeyToString(key).c_str());
         return;
     }
-    mAddressToIfindices[address].insert(ifIndex);
+    std::vector<unsigned>& ifindices = mAddressToIfindices[key];
+    if (std::find(ifindices.begin(), ifindices.end(), ifIndex) == ifindices.end()) {
+        ifindices.push_back(ifIndex);
+    }
 }
 
 // Returns whether we should call SOCK_DESTROY on the removed address.
-bool NetworkController::removeInterfaceAddress(unsigned ifindex, const char* address) {
+bool NetworkController::removeInterfaceAddress(unsigned ifindex, const in6_addr& address) {
     ScopedWLock lock(mRWLock);
+    const AddressKey key = toAddressKey(address);
     // First, update mAddressToIfindices map
-    auto ifindicesIter = mAddressToIfindices.find(address);
+    auto ifindicesIter = mAddressToIfindices.find(key);
     if (ifindicesIter == mAddressToIfindices.end()) {
-        ALOGE("Removing unknown address %s from ifindex %u", address, ifindex);
+        ALOGE("Removing unknown address %s from ifindex %u", addressKeyToString(key).c_str(),
+              ifindex);
         return true;
     }
-    std::unordered_set<unsigned>& ifindices = ifindicesIter->second;
-    if (ifindices.erase(ifindex) > 0) {
+    std::vector<unsigned>& ifindices = ifindicesIter->second;
+    if (std::erase(ifindices, ifindex) > 0) {
         if (ifindices.size() == 0) {
             mAddressToIfindices.erase(ifindicesIter);  // Invalidates ifindices
             // The address is no longer configured on any interface.
             return true;
         }
     } else {
-        ALOGE("No record of address %s on interface %u", address, ifindex);
+        ALOGE("No record of address %s on interface %u", addressKeyToString(key).c_str(), ifindex);
         return true;
     }
     // Then, check for VPN handover condition
@@ -717,19 +1368,19 @@ bool NetworkController::removeInterfaceAddress(unsigned ifindex, const char* add
     return true;
 }
 
-bool NetworkController::canProtectLocked(uid_t uid) const {
-    return ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
-           mProtectableUsers.find(uid) != mProtectableUsers.end();
+bool NetworkController::Snapshot::canProtect(uid_t uid) const {
+    return ((getPermissionForUser(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
+           protectableUsers->contains(uid);
 }
 
 bool NetworkController::canProtect(uid_t uid) const {
-    ScopedRLock lock(mRWLock);
-    return canProtectLocked(uid);
+    return snapshot()->canProtect(uid);
 }
 
 void NetworkController::allowProtect(const std::vector<uid_t>& uids) {
     ScopedWLock lock(mRWLock);
     mProtectableUsers.insert(uids.begin(), uids.end());
+    publishSnapshotLocked(SNAPSHOT_PROTECTABLE_USERS);
 }
 
 void NetworkController::denyProtect(const std::vector<uid_t>& uids) {
@@ -737,11 +1388,19 @@ void NetworkController::denyProtect(const std::vector<uid_t>& uids) {
     for (uid_t uid : uids) {
         mProtectableUsers.erase(uid);
     }
+    publishSnapshotLocked(SNAPSHOT_PROTECTABLE_USERS);
 }
 
 void NetworkController::dump(DumpWriter& dw) {
-    ScopedRLock lock(mRWLock);
+    DumpBuffer buffer;
+    {
+        ScopedRLock lock(mRWLock);
+        dumpLocked(buffer.writer());
+    }
+    buffer.flushTo(dw);
+}
 
+void NetworkController::dumpLocked(DumpWriter& dw) {
     dw.incIndent();
     dw.println("NetworkController");
 
@@ -751,8 +1410,16 @@ void NetworkController::dump(DumpWriter& dw) {
     dw.blankline();
     dw.println("Networks:");
     dw.incIndent();
+    size_t uidRanges = 0;
+    size_t uidRuleRanges = 0;
     for (const auto& i : mNetworks) {
         Network* network = i.second;
+        for (const auto& [_, ranges] : network->getUidRangeMap()) {
+            uidRanges += ranges.getRanges().size();
+        }
+        for (const auto& [_, ranges] : network->getRuleUidRangeMap()) {
+            uidRuleRanges += ranges.getRanges().size();
+        }
         dw.println(network->toString());
         if (network->isPhysical()) {
             dw.incIndent();
@@ -773,6 +1440,9 @@ void NetworkController::dump(DumpWriter& dw) {
         dw.blankline();
     }
     dw.decIndent();
+    // Each of these ranges has its own set of ip rules on each interface of its network.
+    dw.println("Per-app UID ranges: %zu, installed as %zu coalesced rule ranges", uidRanges,
+               uidRuleRanges);
 
     dw.blankline();
     dw.println("Interface <-> last network map:");
@@ -786,7 +1456,7 @@ void NetworkController::dump(DumpWriter& dw) {
     dw.println("Interface addresses:");
     dw.incIndent();
     for (const auto& i : mAddressToIfindices) {
-        dw.println("address: %s ifindices: [%s]", i.first.c_str(),
+        dw.println("address: %s ifindices: [%s]", addressKeyToString(i.first).c_str(),
                 android::base::Join(i.second, ", ").c_str());
     }
     dw.decIndent();
@@ -807,45 +1477,118 @@ void NetworkController::dump(DumpWriter& dw) {
     dw.println("SYSTEM: %s", android::base::Join(systemUids, ", ").c_str());
     dw.decIndent();
 
+    dw.blankline();
+    dw.println("Memory use (approximate):");
+    dw.incIndent();
+    dw.println("Networks: %zu, %zu bytes", mNetworks.size(), treeMemoryUsage(mNetworks));
+    dw.println("User permissions: %zu, %zu bytes", mUsers.size(), treeMemoryUsage(mUsers));
+    dw.println("Protectable users: %zu, %zu bytes", mProtectableUsers.size(),
+               treeMemoryUsage(mProtectableUsers));
+    std::shared_ptr<const Snapshot> snap = snapshot();
+    dw.println("Snapshot topology: %zu networks, %zu cached UIDs, %zu bytes",
+               snap->topology->networkCount(), snap->topology->cachedUserCount(),
+               snap->topology->memoryUsage());
+    dw.println("Snapshot network contexts: %zu, %zu bytes", snap->cachedContextCount(),
+               snap->contextCacheMemoryUsage());
+    dw.println("Snapshot user permissions: %zu, %zu bytes", snap->users->size(),
+               snap->users->memoryUsage());
+    dw.println("Snapshot protectable users: %zu, %zu bytes", snap->protectableUsers->size(),
+               snap->protectableUsers->memoryUsage());
+    dw.decIndent();
+
     dw.decIndent();
 
     dw.decIndent();
 }
 
-void NetworkController::clearAllowedUidsForAllNetworksLocked() {
-    for (const auto& [_, network] : mNetworks) {
-        network->clearAllowedUids();
+namespace {
+
+void addUidRangeProtos(const UidRanges& uidRanges,
+                       google::protobuf::RepeatedPtrField<netd::UidRangeProto>* protos) {
+    for (const auto& range : uidRanges.getRanges()) {
+        netd::UidRangeProto* proto = protos->Add();
+        proto->set_start(range.start);
+        proto->set_stop(range.stop);
+    }
+}
+
+}  // namespace
+
+void NetworkController::dumpProto(netd::NetworkControllerProto* proto) const {
+    ScopedRLock lock(mRWLock);
+
+    proto->set_default_net_id(mDefaultNetId);
+    for (const auto& [netId, network] : mNetworks) {
+        netd::NetworkProto* networkProto = proto->add_networks();
+        networkProto->set_net_id(netId);
+        networkProto->set_type(network->getTypeString());
+        networkProto->set_permission(network->getPermission());
+        for (const auto& interface : network->getInterfaces()) {
+            networkProto->add_interfaces(interface);
+        }
+        for (const auto& [subPriority, uidRanges] : network->getUidRangeMap()) {
+            auto* uidRangesProto = networkProto->add_uid_ranges();
+            uidRangesProto->set_sub_priority(subPriority);
+            addUidRangeProtos(uidRanges, uidRangesProto->mutable_ranges());
+        }
+        if (const auto& allowedUids = network->getAllowedUids()) {
+            networkProto->set_has_allowlist(true);
+            addUidRangeProtos(*allowedUids, networkProto->mutable_allowed_uids());
+        }
+    }
+    for (const auto& [uid, permission] : mUsers) {
+        if ((permission & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
+            proto->add_system_permission_uids(uid);
+        } else if ((permission & PERMISSION_NETWORK) == PERMISSION_NETWORK) {
+            proto->add_network_permission_uids(uid);
+        }
     }
 }
 
 int NetworkController::setNetworkAllowlist(
         const std::vector<netd::aidl::NativeUidRangeConfig>& rangeConfigs) {
-    const ScopedWLock lock(mRWLock);
-
+    // Coalesce outside the lock. If a network is listed more than once, the last entry wins.
+    std::map<unsigned, UidRanges> allowlists;
     for (const auto& config : rangeConfigs) {
-        Network* network = getNetworkLocked(config.netId);
-        if (!network) return -ENONET;
+        allowlists[config.netId] = UidRanges(config.uidRanges).coalesced();
     }
 
-    clearAllowedUidsForAllNetworksLocked();
-    for (const auto& config : rangeConfigs) {
-        Network* network = getNetworkLocked(config.netId);
-        network->setAllowedUids(UidRanges(config.uidRanges));
+    const ScopedWLock lock(mRWLock);
+    for (const auto& [netId, _] : allowlists) {
+        if (!getNetworkLocked(netId)) return -ENONET;
+    }
+
+    bool changed = false;
+    for (const auto& [netId, network] : mNetworks) {
+        const std::optional<UidRanges>& current = network->getAllowedUids();
+        auto iter = allowlists.find(netId);
+        if (iter == allowlists.end()) {
+            if (!current) continue;
+            network->clearAllowedUids();
+        } else {
+            if (current && current->getRanges() == iter->second.getRanges()) continue;
+            network->setAllowedUids(iter->second);
+        }
+        changed = true;
     }
+    if (changed) publishSnapshotLocked(SNAPSHOT_TOPOLOGY);
     return 0;
 }
 
-bool NetworkController::isUidAllowed(unsigned netId, uid_t uid) const {
-    const ScopedRLock lock(mRWLock);
-    Network* network = getNetworkLocked(netId);
+bool NetworkController::Snapshot::isUidAllowed(unsigned netId, uid_t uid) const {
+    const NetworkInfo* network = topology->getNetwork(netId);
     // Exempt when no netId is specified and there is no default network, so that apps or tests can
     // do DNS lookups for hostnames in etc/hosts.
-    if (netId == NETID_UNSET && mDefaultNetId == NETID_UNSET) {
+    if (netId == NETID_UNSET && defaultNetId == NETID_UNSET) {
         return true;
     }
     return network && network->isUidAllowed(uid);
 }
 
+bool NetworkController::isUidAllowed(unsigned netId, uid_t uid) const {
+    return snapshot()->isUidAllowed(netId, uid);
+}
+
 bool NetworkController::isValidNetworkLocked(unsigned netId) const {
     return getNetworkLocked(netId);
 }
@@ -855,54 +1598,49 @@ Network* NetworkController::getNetworkLocked(unsigned netId) const {
     return iter == mNetworks.end() ? nullptr : iter->second;
 }
 
-VirtualNetwork* NetworkController::getVirtualNetworkForUserLocked(uid_t uid) const {
-    int32_t subPriority;
-    for (const auto& [_, network] : mNetworks) {
-        if (network->isVirtual() && network->appliesToUser(uid, &subPriority)) {
-            return static_cast<VirtualNetwork*>(network);
+// Returns the VPN with the lowest netId that applies to uid.
+const NetworkInfo* Topology::findVirtualNetworkForUser(uid_t uid) const {
+    const NetworkInfo* bestNetwork = nullptr;
+    for (const auto& [netId, _] : mUidRangeIndex.lookup(uid)) {
+        if (bestNetwork && bestNetwork->netId < netId) continue;
+        const NetworkInfo* network = getNetwork(netId);
+        if (network && network->isVirtual) {
+            bestNetwork = network;
         }
     }
-    return nullptr;
+    return bestNetwork;
 }
 
 // Returns the default network with the highest subsidiary priority among physical and unreachable
 // networks that applies to uid. For a single subsidiary priority, an uid should belong to only one
 // network.  If the uid apply to different network with the same priority at the same time, the
 // behavior is undefined. That is a configuration error.
-Network* NetworkController::getPhysicalOrUnreachableNetworkForUserLocked(uid_t uid) const {
-    Network* bestNetwork = nullptr;
-
-    // In this function, appliesToUser() is used to figure out if this network is the user's default
-    // network (not just if the user has access to this network). Rules at SUB_PRIORITY_NO_DEFAULT
-    // "apply to the user" but do not include a default network rule. Since their subpriority (999)
-    // is greater than SUB_PRIORITY_LOWEST (998), these rules never trump any subpriority that
-    // includes a default network rule (appliesToUser returns the "highest" (=lowest value)
-    // subPriority that includes the uid), and they get filtered out in the if-statement below.
-    int32_t bestSubPriority = UidRanges::SUB_PRIORITY_NO_DEFAULT;
-    for (const auto& [netId, network] : mNetworks) {
-        int32_t subPriority;
-        if (!network->isPhysical() && !network->isUnreachable()) continue;
-        if (!network->appliesToUser(uid, &subPriority)) continue;
-        if (subPriority == UidRanges::SUB_PRIORITY_NO_DEFAULT) continue;
-
-        if (subPriority < bestSubPriority) {
-            bestNetwork = network;
-            bestSubPriority = subPriority;
+const NetworkInfo* Topology::findPhysicalOrUnreachableNetworkForUser(uid_t uid) const {
+    // The index returns entries in order of subsidiary priority, and then netId, so the first
+    // physical or unreachable network is the best one.
+    //
+    // Rules at SUB_PRIORITY_NO_DEFAULT "apply to the user" but do not include a default network
+    // rule, so they are skipped. Since their subpriority (999) is greater than SUB_PRIORITY_LOWEST
+    // (998), any entry that includes a default network rule comes before them.
+    for (const auto& [netId, subPriority] : mUidRangeIndex.lookup(uid)) {
+        if (subPriority == UidRanges::SUB_PRIORITY_NO_DEFAULT) break;
+        const NetworkInfo* network = getNetwork(netId);
+        if (network && (network->isPhysical || network->isUnreachable)) {
+            return network;
         }
     }
-    return bestNetwork;
+    return nullptr;
 }
 
-Permission NetworkController::getPermissionForUserLocked(uid_t uid) const {
-    auto iter = mUsers.find(uid);
-    if (iter != mUsers.end()) {
-        return iter->second;
+Permission NetworkController::Snapshot::getPermissionForUser(uid_t uid) const {
+    if (const Permission* permission = users->find(uid)) {
+        return *permission;
     }
     return uid < FIRST_APPLICATION_UID ? PERMISSION_SYSTEM : PERMISSION_NONE;
 }
 
-int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const {
-    Network* network = getNetworkLocked(netId);
+int NetworkController::Snapshot::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
+    const NetworkInfo* network = topology->getNetwork(netId);
     if (!network) {
         return -ENONET;
     }
@@ -913,30 +1651,29 @@ int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) c
         return -EREMOTEIO;
     }
     // If the UID has PERMISSION_SYSTEM, it can use whatever network it wants.
-    Permission userPermission = getPermissionForUserLocked(uid);
+    Permission userPermission = getPermissionForUser(uid);
     if ((userPermission & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
         return 0;
     }
     // If the UID wants to use a VPN, it can do so if and only if the VPN applies to the UID.
-    int32_t subPriority;
-    if (network->isVirtual()) {
-        return network->appliesToUser(uid, &subPriority) ? 0 : -EPERM;
+    if (network->isVirtual) {
+        return topology->appliesToUser(*network, uid) ? 0 : -EPERM;
     }
     // If a VPN applies to the UID, and the VPN is secure (i.e., not bypassable), then the UID can
     // only select a different network if it has the ability to protect its sockets.
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && virtualNetwork->isSecure() &&
-            mProtectableUsers.find(uid) == mProtectableUsers.end()) {
+    const NetworkInfo* virtualNetwork = topology->getUserNetworks(uid).virtualNetwork;
+    if (virtualNetwork && virtualNetwork->isSecure &&
+            !protectableUsers->contains(uid)) {
         return -EPERM;
     }
     // If the UID wants to use a physical network and it has a UID range that includes the UID, the
     // UID has permission to use it regardless of whether the permission bits match.
-    if (network->isPhysical() && network->appliesToUser(uid, &subPriority)) {
+    if (network->isPhysical && topology->appliesToUser(*network, uid)) {
         return 0;
     }
     // Only apps that are configured as "no default network" can use the unreachable network.
-    if (network->isUnreachable()) {
-        return network->appliesToUser(uid, &subPriority) ? 0 : -EPERM;
+    if (network->isUnreachable) {
+        return topology->appliesToUser(*network, uid) ? 0 : -EPERM;
     }
 
     if (!network->isUidAllowed(uid)) {
@@ -945,7 +1682,7 @@ int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) c
     // Check whether the UID's permission bits are sufficient to use the network.
     // Because the permission of the system default network is PERMISSION_NONE(0x0), apps can always
     // pass the check here when using the system default network.
-    const Permission networkPermission = network->getPermission();
+    const Permission networkPermission = network->permission;
     return ((userPermission & networkPermission) == networkPermission) ? 0 : -EACCES;
 }
 
@@ -953,7 +1690,12 @@ int NetworkController::modifyRoute(unsigned netId, const char* interface, const
                                    const char* nexthop, enum RouteOperation op, bool legacy,
                                    uid_t uid, int mtu) {
     ScopedRLock lock(mRWLock);
+    return modifyRouteLocked(netId, interface, destination, nexthop, op, legacy, uid, mtu);
+}
 
+int NetworkController::modifyRouteLocked(unsigned netId, const char* interface,
+                                         const char* destination, const char* nexthop,
+                                         enum RouteOperation op, bool legacy, uid_t uid, int mtu) {
     if (!isValidNetworkLocked(netId)) {
         ALOGE("no such netId %u", netId);
         return -ENONET;
@@ -972,7 +1714,7 @@ int NetworkController::modifyRoute(unsigned netId, const char* interface, const
     if (netId == LOCAL_NET_ID) {
         tableType = RouteController::LOCAL_NETWORK;
     } else if (legacy) {
-        if ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
+        if ((snapshot()->getPermissionForUser(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
             tableType = RouteController::LEGACY_SYSTEM;
         } else {
             tableType = RouteController::LEGACY_NETWORK;
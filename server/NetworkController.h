@@ -22,13 +22,18 @@
 #include "NetdConstants.h"
 #include "Permission.h"
 #include "PhysicalNetwork.h"
+#include "UidRangeIndex.h"
 #include "UnreachableNetwork.h"
 #include "android/net/INetd.h"
 #include "netdutils/DumpWriter.h"
 
+#include <netinet/in.h>
 #include <sys/types.h>
+#include <array>
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <shared_mutex>
 #include <unordered_map>
@@ -75,6 +80,10 @@ class Network;
 class UidRanges;
 class VirtualNetwork;
 
+namespace netd {
+class NetworkControllerProto;
+}
+
 /*
  * Keeps track of default, per-pid, and per-uid-range network selection, as
  * well as the mark associated with each network. Networks are identified
@@ -125,6 +134,58 @@ public:
     [[nodiscard]] int removeUsersFromNetwork(unsigned netId, const UidRanges& uidRanges,
                                              int32_t subPriority);
 
+    // One step of applyTopologyTransaction(). Only the fields used by |type| are read.
+    struct TopologyOperation {
+        enum Type {
+            CREATE_PHYSICAL_NETWORK,  // netId, permission.
+            CREATE_VIRTUAL_NETWORK,   // netId, secure, vpnType, excludeLocalRoutes.
+            DESTROY_NETWORK,          // netId.
+            ADD_INTERFACE,            // netId, interface.
+            REMOVE_INTERFACE,         // netId, interface.
+            ADD_ROUTE,                // netId, interface, destination, nexthop, mtu.
+            REMOVE_ROUTE,             // netId, interface, destination, nexthop.
+            ADD_USERS,                // netId, uidRanges, subPriority.
+            REMOVE_USERS,             // netId, uidRanges, subPriority.
+            SET_DEFAULT,              // netId, or NETID_UNSET to clear the default network.
+            ADD_ALLOWED_USERS,        // netId, uidRanges. See Network::addAllowedUids().
+            REMOVE_ALLOWED_USERS,     // netId, uidRanges. See Network::removeAllowedUids().
+            CLEAR_ALLOWED_USERS,      // netId. Lets all UIDs select the network.
+            DESTROY_SOCKETS,          // uidRanges, skipUids. Runs after all other operations.
+        };
+
+        Type type;
+        unsigned netId = NETID_UNSET;
+        Permission permission = PERMISSION_NONE;
+        bool secure = false;
+        NativeVpnType vpnType = NativeVpnType::LEGACY;
+        bool excludeLocalRoutes = false;
+        std::string interface;
+        std::string destination;
+        std::string nexthop;  // Empty for a directly-connected route.
+        int mtu = 0;
+        UidRanges uidRanges;
+        int32_t subPriority = UidRanges::SUB_PRIORITY_HIGHEST;
+        std::set<uid_t> skipUids;
+    };
+
+    // Applies |operations| in order while holding the write lock throughout, so that no lookup
+    // sees a partially applied transaction. Routing rule changes are sent to the kernel as one
+    // netlink batch at the end, and iptables commands as one iptables-restore input. Each run of
+    // consecutive ADD_ROUTE and REMOVE_ROUTE operations is sent as one netlink batch before the
+    // next operation. Stops at the first operation that fails, sets |*failedIndex| to its index
+    // and returns its error; the operations before it are not rolled back, and those after it
+    // are not applied: the route changes of a run made after a failing one are undone. If that
+    // is not possible, or sending the batched rule or iptables changes fails, |*failedIndex| is
+    // set to operations.size(), since which operations took effect is not known.
+    //
+    // DESTROY_SOCKETS operations are left out of the transaction. Once everything else has been
+    // applied and published, they run without the lock, up to kMaxSocketDestroyThreads at a time,
+    // so that apps that reconnect get the new configuration and lookups are not blocked
+    // meanwhile. They only run if the rest succeeded; if any fail, |*failedIndex| is the index of
+    // the first of them. Returns 0 if everything succeeded.
+    [[nodiscard]] int applyTopologyTransaction(const std::vector<TopologyOperation>& operations,
+                                               size_t* failedIndex);
+
     // |nexthop| can be NULL (to indicate a directly-connected route), "unreachable" (to indicate a
     // route that's blocked), "throw" (to indicate the lack of a match), or a regular IP address.
     //
@@ -137,17 +198,31 @@ public:
     [[nodiscard]] int removeRoute(unsigned netId, const char* interface, const char* destination,
                                   const char* nexthop, bool legacy, uid_t uid);
 
-    // Notes that the specified address has appeared on the specified interface.
-    void addInterfaceAddress(unsigned ifIndex, const char* address);
+    // Notes that the specified address has appeared on the specified interface. IPv4 addresses
+    // are given as IPv4-mapped IPv6 addresses.
+    void addInterfaceAddress(unsigned ifIndex, const in6_addr& address);
     // Notes that the specified address has been removed from the specified interface.
     // Returns true if we should destroy sockets on this address.
-    bool removeInterfaceAddress(unsigned ifIndex, const char* address);
+    bool removeInterfaceAddress(unsigned ifIndex, const in6_addr& address);
 
     bool canProtect(uid_t uid) const;
     void allowProtect(const std::vector<uid_t>& uids);
     void denyProtect(const std::vector<uid_t>& uids);
 
     void dump(netdutils::DumpWriter& dw);
+    void dumpProto(netd::NetworkControllerProto* proto) const;
+
+    // The parts of the network state that the fwmark server publishes to clients.
+    struct StateSummary {
+        unsigned defaultNetId;
+        // Whether any network has UID ranges, e.g. a VPN or a per-app default network.
+        bool hasUidRanges;
+    };
+    // Sets a function that is called, with the write lock held, every time a change to the
+    // network state becomes visible to readers. It must not call back into this class.
+    void setStateChangedCallback(std::function<void(const StateSummary&)> callback);
+    // Replaces the allowlists of all networks. Only networks whose allowlist changes are
+    // updated. For small changes, applyTopologyTransaction() can add or remove UID ranges instead.
     int setNetworkAllowlist(const std::vector<netd::aidl::NativeUidRangeConfig>& rangeConfigs);
     bool isUidAllowed(unsigned netId, uid_t uid) const;
 
@@ -155,34 +230,73 @@ public:
     bool isValidNetworkLocked(unsigned netId) const;
     Network* getNetworkLocked(unsigned netId) const;
 
-    // Sets |*netId| to an appropriate NetId to use for DNS for the given user. Call with |*netId|
-    // set to a non-NETID_UNSET value if the user already has indicated a preference. Returns the
-    // fwmark value to set on the socket when performing the DNS request.
-    uint32_t getNetworkForDnsLocked(unsigned* netId, uid_t uid) const;
-    unsigned getNetworkForConnectLocked(uid_t uid) const;
     unsigned getNetworkForInterfaceLocked(const char* interface) const;
     unsigned getNetworkForInterfaceLocked(const int ifIndex) const;
-    bool canProtectLocked(uid_t uid) const;
     bool isVirtualNetworkLocked(unsigned netId) const;
-    VirtualNetwork* getVirtualNetworkForUserLocked(uid_t uid) const;
-    Network* getPhysicalOrUnreachableNetworkForUserLocked(uid_t uid) const;
-    Permission getPermissionForUserLocked(uid_t uid) const;
-    int checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const;
+    [[nodiscard]] int setDefaultNetworkLocked(unsigned netId);
     [[nodiscard]] int createPhysicalNetworkLocked(unsigned netId, Permission permission,
                                                   bool local);
+    [[nodiscard]] int createVirtualNetworkLocked(unsigned netId, bool secure,
+                                                 NativeVpnType vpnType, bool excludeLocalRoutes);
+    [[nodiscard]] int destroyNetworkLocked(unsigned netId);
+    [[nodiscard]] int addInterfaceToNetworkLocked(unsigned netId, const char* interface);
+    [[nodiscard]] int removeInterfaceFromNetworkLocked(unsigned netId, const char* interface);
+    [[nodiscard]] int addUsersToNetworkLocked(unsigned netId, const UidRanges& uidRanges,
+                                              int32_t subPriority);
+    [[nodiscard]] int removeUsersFromNetworkLocked(unsigned netId, const UidRanges& uidRanges,
+                                                   int32_t subPriority);
+    // The part of applyTopologyTransaction() that runs under the lock. Returns the indices of the
+    // DESTROY_SOCKETS operations in |socketOperations|.
+    [[nodiscard]] int applyTopologyChanges(const std::vector<TopologyOperation>& operations,
+                                           std::vector<size_t>* socketOperations,
+                                           size_t* failedIndex);
+    [[nodiscard]] int applyTopologyOperationLocked(const TopologyOperation& operation);
+    [[nodiscard]] static int destroyTopologySockets(
+            const std::vector<TopologyOperation>& operations,
+            const std::vector<size_t>& socketOperations, size_t* failedIndex);
+    static constexpr size_t kMaxSocketDestroyThreads = 4;
+    friend class NetworkControllerTest;
+    static int (*destroySocketsFunction)(const UidRanges& uidRanges,
+                                         const std::set<uid_t>& skipUids);
+    // Sends the route changes queued for |routeOperations|, the operations of the current run by
+    // index, each with the number of route changes queued before it. On failure, sets
+    // |*failedIndex| to the operation whose change failed, or to |numOperations| if operations
+    // after it are applied too.
+    [[nodiscard]] static int commitRouteOperations(
+            std::vector<std::pair<size_t, size_t>>* routeOperations, size_t numOperations,
+            size_t* failedIndex);
+    [[nodiscard]] int modifyAllowedUsersLocked(const TopologyOperation& operation);
 
     [[nodiscard]] int modifyRoute(unsigned netId, const char* interface, const char* destination,
                                   const char* nexthop, RouteOperation op, bool legacy, uid_t uid,
                                   int mtu);
+    [[nodiscard]] int modifyRouteLocked(unsigned netId, const char* interface,
+                                        const char* destination, const char* nexthop,
+                                        RouteOperation op, bool legacy, uid_t uid, int mtu);
     [[nodiscard]] int modifyFallthroughLocked(unsigned vpnNetId, bool add);
     void updateTcpSocketMonitorPolling();
-    void clearAllowedUidsForAllNetworksLocked();
+    void dumpLocked(netdutils::DumpWriter& dw);
+
+    // An immutable copy of the state needed to pick networks and marks for a UID, so that
+    // FwmarkServer and DNS lookups never wait for the lock while binder calls change the state.
+    class Snapshot;
+    enum SnapshotPart {
+        SNAPSHOT_TOPOLOGY = 1 << 0,  // Networks, their permissions and their UID ranges.
+        SNAPSHOT_USERS = 1 << 1,     // mUsers.
+        SNAPSHOT_PROTECTABLE_USERS = 1 << 2,
+        SNAPSHOT_ALL = SNAPSHOT_TOPOLOGY | SNAPSHOT_USERS | SNAPSHOT_PROTECTABLE_USERS,
+    };
+    std::shared_ptr<const Snapshot> snapshot() const;
+    // Publishes a new snapshot in which the |parts| (a bitmask of SnapshotPart) are copied from
+    // the current state, and the others are shared with the previous snapshot. The default netId
+    // is always copied. Must be called with mRWLock held exclusively, after every change.
+    void publishSnapshotLocked(int parts);
 
     class DelegateImpl;
     DelegateImpl* const mDelegateImpl;
 
     // mRWLock guards all accesses to mDefaultNetId, mNetworks, mUsers, mProtectableUsers,
-    // mIfindexToLastNetId and mAddressToIfindices.
+    // mIfindexToLastNetId, mAddressToIfindices and mUidRangeIndex.
     mutable std::shared_mutex mRWLock;
     unsigned mDefaultNetId;
     std::map<unsigned, Network*> mNetworks;  // Map keys are NetIds.
@@ -200,8 +314,28 @@ public:
     // TODO: Does not track IP addresses present when netd is started or restarts after a crash.
     // This is not a problem for its intended use (tracking IP addresses on VPN interfaces), but
     // we should fix it.
-    std::unordered_map<std::string, std::unordered_set<unsigned>> mAddressToIfindices;
-
+    // Keyed by the bytes of the in6_addr, so that the netlink thread does not format addresses.
+    // An address is rarely on more than one interface, so the ifindices are a plain vector.
+    using AddressKey = std::array<uint8_t, sizeof(in6_addr)>;
+    struct AddressKeyHash {
+        size_t operator()(const AddressKey& key) const;
+    };
+    static AddressKey toAddressKey(const in6_addr& address);
+    static std::string addressKeyToString(const AddressKey& key);
+    std::unordered_map<AddressKey, std::vector<unsigned>, AddressKeyHash> mAddressToIfindices;
+
+    // The UID ranges of every network, indexed by UID. Kept in sync with each network's
+    // UidRangeMap by addUsersToNetwork(), removeUsersFromNetwork() and destroyNetwork().
+    UidRangeIndex mUidRangeIndex;
+
+    // Called after each snapshot is published. Guarded by mRWLock.
+    std::function<void(const StateSummary&)> mStateChangedCallback;
+    // Replaced, never modified, by publishSnapshotLocked(). Read with std::atomic_load.
+    std::shared_ptr<const Snapshot> mSnapshot;
+    // While applyTopologyTransaction() runs, publishSnapshotLocked() only records the parts to
+    // publish here, so that the whole transaction becomes visible at once. Guarded by mRWLock.
+    bool mInTransaction = false;
+    int mPendingSnapshotParts = 0;
 };
 
 }  // namespace android::net
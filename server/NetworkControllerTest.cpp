@@ -0,0 +1,503 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * NetworkControllerTest.cpp - unit tests for NetworkController.cpp
+ */
+
+#include <errno.h>
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Controllers.h"
+#include "LocalNetwork.h"
+#include "NetworkController.h"
+#include "OemNetdListener.h"
+#include "UidRanges.h"
+#include "netd_dump.pb.h"
+
+namespace android::net {
+
+namespace {
+
+using binder::Status;
+using com::android::internal::net::NetworkTopologyOperation;
+using com::android::internal::net::NetworkTopologyResult;
+using com::android::internal::net::OemNetdListener;
+using netd::aidl::NativeUidRangeConfig;
+using TopologyOperation = NetworkController::TopologyOperation;
+using Ranges = std::vector<std::pair<int32_t, int32_t>>;
+
+// Above the netIds that ConnectivityService hands out in practice, so that the networks created
+// here do not clash with those of the device.
+constexpr unsigned kVpnNetId = 65500;
+constexpr unsigned kMissingNetId = 65501;
+
+constexpr uid_t kTestUid = 10500;
+// fakeDestroySockets() fails for the ranges that contain this UID.
+constexpr uid_t kFailingUid = 10501;
+
+UidRanges makeUidRanges(const Ranges& ranges) {
+    std::vector<UidRangeParcel> parcels;
+    for (const auto& [start, stop] : ranges) {
+        UidRangeParcel parcel;
+        parcel.start = start;
+        parcel.stop = stop;
+        parcels.push_back(parcel);
+    }
+    return UidRanges(parcels);
+}
+
+Ranges toPairs(const UidRanges& uidRanges) {
+    Ranges pairs;
+    for (const auto& range : uidRanges.getRanges()) pairs.emplace_back(range.start, range.stop);
+    return pairs;
+}
+
+NativeUidRangeConfig makeAllowlist(unsigned netId, const Ranges& ranges) {
+    NativeUidRangeConfig config;
+    config.netId = netId;
+    config.uidRanges = makeUidRanges(ranges).getRanges();
+    return config;
+}
+
+TopologyOperation createVirtualNetwork(unsigned netId) {
+    return {.type = TopologyOperation::CREATE_VIRTUAL_NETWORK,
+            .netId = netId,
+            .secure = true,
+            .vpnType = NativeVpnType::SERVICE};
+}
+
+TopologyOperation addUsers(unsigned netId, const UidRanges& uidRanges) {
+    return {.type = TopologyOperation::ADD_USERS, .netId = netId, .uidRanges = uidRanges};
+}
+
+TopologyOperation removeUsers(unsigned netId, const UidRanges& uidRanges) {
+    return {.type = TopologyOperation::REMOVE_USERS, .netId = netId, .uidRanges = uidRanges};
+}
+
+TopologyOperation modifyAllowedUsers(TopologyOperation::Type type, unsigned netId,
+                                     const Ranges& ranges) {
+    return {.type = type, .netId = netId, .uidRanges = makeUidRanges(ranges)};
+}
+
+TopologyOperation destroySockets(const UidRanges& uidRanges) {
+    return {.type = TopologyOperation::DESTROY_SOCKETS, .uidRanges = uidRanges};
+}
+
+}  // namespace
+
+TEST(NetworkAllowedUidsTest, AddAllowedUids) {
+    LocalNetwork network(NetworkController::LOCAL_NET_ID);
+    EXPECT_FALSE(network.getAllowedUids().has_value());
+    EXPECT_TRUE(network.isUidAllowed(kTestUid));
+
+    // Adding to a network without an allowlist creates one.
+    EXPECT_TRUE(network.addAllowedUids(makeUidRanges({{20, 30}, {10, 15}})));
+    ASSERT_TRUE(network.getAllowedUids().has_value());
+    EXPECT_EQ((Ranges{{10, 15}, {20, 30}}), toPairs(*network.getAllowedUids()));
+    EXPECT_TRUE(network.isUidAllowed(12));
+    EXPECT_FALSE(network.isUidAllowed(17));
+
+    EXPECT_FALSE(network.addAllowedUids(makeUidRanges({{22, 28}})));
+    EXPECT_TRUE(network.addAllowedUids(makeUidRanges({{14, 25}})));
+    EXPECT_EQ((Ranges{{10, 30}}), toPairs(*network.getAllowedUids()));
+    EXPECT_TRUE(network.isUidAllowed(17));
+}
+
+TEST(NetworkAllowedUidsTest, RemoveAllowedUids) {
+    LocalNetwork network(NetworkController::LOCAL_NET_ID);
+    // There is nothing to remove from a network that every UID can use.
+    EXPECT_FALSE(network.removeAllowedUids(makeUidRanges({{10, 30}})));
+    EXPECT_FALSE(network.getAllowedUids().has_value());
+
+    network.setAllowedUids(makeUidRanges({{10, 30}}));
+    EXPECT_TRUE(network.removeAllowedUids(makeUidRanges({{15, 20}})));
+    EXPECT_EQ((Ranges{{10, 14}, {21, 30}}), toPairs(*network.getAllowedUids()));
+    EXPECT_FALSE(network.isUidAllowed(17));
+    EXPECT_FALSE(network.removeAllowedUids(makeUidRanges({{40, 50}})));
+
+    // Removing every UID leaves an empty allowlist, which no UID is on.
+    EXPECT_TRUE(network.removeAllowedUids(makeUidRanges({{0, 100}})));
+    ASSERT_TRUE(network.getAllowedUids().has_value());
+    EXPECT_TRUE(network.getAllowedUids()->empty());
+    EXPECT_FALSE(network.isUidAllowed(12));
+
+    network.clearAllowedUids();
+    EXPECT_TRUE(network.isUidAllowed(12));
+}
+
+class NetworkControllerTest : public ::testing::Test {
+  protected:
+    static constexpr size_t kMaxSocketDestroyThreads = NetworkController::kMaxSocketDestroyThreads;
+
+    // One call to fakeDestroySockets().
+    struct DestroyCall {
+        UidRanges uidRanges;
+        // The network that the first UID of the ranges used at the time of the call.
+        unsigned netId;
+        std::thread::id thread;
+    };
+
+    static void SetUpTestSuite() {
+        // applyTopologyTransaction() batches its iptables commands through gCtls.
+        if (gCtls == nullptr) gCtls = new Controllers();
+    }
+
+    void SetUp() override {
+        sController = &mController;
+        sCalls.clear();
+        NetworkController::destroySocketsFunction = fakeDestroySockets;
+    }
+
+    void TearDown() override {
+        NetworkController::destroySocketsFunction = sOriginalDestroySockets;
+        sController = nullptr;
+        // Ignore the error if the test did not create the network.
+        (void)mController.destroyNetwork(kVpnNetId);
+    }
+
+    static int fakeDestroySockets(const UidRanges& uidRanges, const std::set<uid_t>&) {
+        const uid_t uid = uidRanges.getRanges().front().start;
+        std::lock_guard guard(sLock);
+        sCalls.push_back({uidRanges, sController->getNetworkForUser(uid),
+                          std::this_thread::get_id()});
+        return uidRanges.hasUid(kFailingUid) ? -EPERM : 0;
+    }
+
+    static std::vector<DestroyCall> calls() {
+        std::lock_guard guard(sLock);
+        return sCalls;
+    }
+
+    // Counts the snapshots that mController publishes from now on.
+    void countSnapshots() {
+        mController.setStateChangedCallback(
+                [this](const NetworkController::StateSummary&) { mSnapshots++; });
+    }
+
+    // The lock that the writers of mController take exclusively.
+    std::shared_mutex& writeLock() { return mController.mRWLock; }
+
+    int applyTopology(const std::vector<TopologyOperation>& operations) {
+        size_t failedIndex = operations.size();
+        const int ret = mController.applyTopologyTransaction(operations, &failedIndex);
+        mFailedIndex = failedIndex;
+        return ret;
+    }
+
+    NetworkController mController;
+    size_t mFailedIndex = 0;
+    int mSnapshots = 0;
+
+  private:
+    static inline int (*const sOriginalDestroySockets)(const UidRanges&, const std::set<uid_t>&) =
+            NetworkController::destroySocketsFunction;
+    static inline std::mutex sLock;
+    static inline std::vector<DestroyCall> sCalls;
+    static inline NetworkController* sController = nullptr;
+};
+
+TEST_F(NetworkControllerTest, DestroySocketsRunsAfterOtherOperations) {
+    const UidRanges ranges = makeUidRanges({{kTestUid, kTestUid}});
+    // Listed first, but only runs once the VPN has taken over the UID.
+    const std::vector<TopologyOperation> operations = {
+            destroySockets(ranges),
+            createVirtualNetwork(kVpnNetId),
+            addUsers(kVpnNetId, ranges),
+    };
+    size_t failedIndex = operations.size();
+    EXPECT_EQ(0, mController.applyTopologyTransaction(operations, &failedIndex));
+
+    const std::vector<DestroyCall> destroyed = calls();
+    ASSERT_EQ(1U, destroyed.size());
+    EXPECT_EQ(ranges.getRanges(), destroyed[0].uidRanges.getRanges());
+    EXPECT_EQ(kVpnNetId, destroyed[0].netId);
+}
+
+TEST_F(NetworkControllerTest, DestroySocketsReportsFirstFailure) {
+    const std::vector<TopologyOperation> operations = {
+            destroySockets(makeUidRanges({{kTestUid, kTestUid}})),
+            createVirtualNetwork(kVpnNetId),
+            destroySockets(makeUidRanges({{kFailingUid, kFailingUid}})),
+            destroySockets(makeUidRanges({{kTestUid, kFailingUid}})),
+    };
+    size_t failedIndex = operations.size();
+    EXPECT_EQ(-EPERM, mController.applyTopologyTransaction(operations, &failedIndex));
+    EXPECT_EQ(2U, failedIndex);
+
+    // The other operations still ran, and the rest of the transaction is not rolled back.
+    EXPECT_EQ(3U, calls().size());
+    EXPECT_TRUE(mController.isVirtualNetwork(kVpnNetId));
+}
+
+TEST_F(NetworkControllerTest, DestroySocketsSkippedWhenTransactionFails) {
+    const std::vector<TopologyOperation> operations = {
+            createVirtualNetwork(kVpnNetId),
+            destroySockets(makeUidRanges({{kTestUid, kTestUid}})),
+            addUsers(kMissingNetId, makeUidRanges({{kTestUid, kTestUid}})),
+    };
+    size_t failedIndex = operations.size();
+    EXPECT_NE(0, mController.applyTopologyTransaction(operations, &failedIndex));
+    EXPECT_EQ(2U, failedIndex);
+    EXPECT_TRUE(calls().empty());
+}
+
+TEST_F(NetworkControllerTest, DestroySocketsUsesBoundedThreads) {
+    std::vector<TopologyOperation> operations;
+    for (size_t i = 0; i < 4 * kMaxSocketDestroyThreads; i++) {
+        const int32_t uid = kTestUid + 10 + i;
+        operations.push_back(destroySockets(makeUidRanges({{uid, uid}})));
+    }
+    size_t failedIndex = operations.size();
+    EXPECT_EQ(0, mController.applyTopologyTransaction(operations, &failedIndex));
+
+    const std::vector<DestroyCall> destroyed = calls();
+    EXPECT_EQ(operations.size(), destroyed.size());
+    std::set<std::thread::id> threads;
+    for (const DestroyCall& call : destroyed) threads.insert(call.thread);
+    EXPECT_LE(threads.size(), kMaxSocketDestroyThreads);
+}
+
+TEST_F(NetworkControllerTest, AllowedUsersOperations) {
+    constexpr uid_t kOtherUid = kTestUid + 1;
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId)}));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kOtherUid));
+
+    EXPECT_EQ(0, applyTopology({modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS,
+                                                   kVpnNetId, {{kTestUid, kTestUid}})}));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kOtherUid));
+
+    EXPECT_EQ(0, applyTopology({modifyAllowedUsers(TopologyOperation::REMOVE_ALLOWED_USERS,
+                                                   kVpnNetId, {{kTestUid, kTestUid}})}));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kOtherUid));
+
+    EXPECT_EQ(0, applyTopology({modifyAllowedUsers(TopologyOperation::CLEAR_ALLOWED_USERS,
+                                                   kVpnNetId, {})}));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kOtherUid));
+}
+
+TEST_F(NetworkControllerTest, AllowedUsersOperationsCheckTheNetwork) {
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId)}));
+    for (const auto type :
+         {TopologyOperation::ADD_ALLOWED_USERS, TopologyOperation::REMOVE_ALLOWED_USERS,
+          TopologyOperation::CLEAR_ALLOWED_USERS}) {
+        EXPECT_EQ(-ENONET,
+                  applyTopology({modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS,
+                                                    kVpnNetId, {{kTestUid, kTestUid}}),
+                                 modifyAllowedUsers(type, kMissingNetId, {{kTestUid, kTestUid}})}));
+        EXPECT_EQ(1U, mFailedIndex);
+    }
+    // The operations before the failed one were applied.
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+}
+
+TEST_F(NetworkControllerTest, SetNetworkAllowlistOnlyPublishesChanges) {
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId)}));
+    countSnapshots();
+
+    EXPECT_EQ(0,
+              mController.setNetworkAllowlist({makeAllowlist(kVpnNetId, {{kTestUid, kTestUid}})}));
+    EXPECT_EQ(1, mSnapshots);
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+
+    // The same ranges, in another form, are not a change.
+    EXPECT_EQ(0, mController.setNetworkAllowlist(
+                         {makeAllowlist(kVpnNetId, {{kTestUid, kTestUid}, {kTestUid, kTestUid}})}));
+    EXPECT_EQ(1, mSnapshots);
+
+    // Networks left out of the list lose their allowlist.
+    EXPECT_EQ(0, mController.setNetworkAllowlist({}));
+    EXPECT_EQ(2, mSnapshots);
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+    EXPECT_EQ(0, mController.setNetworkAllowlist({}));
+    EXPECT_EQ(2, mSnapshots);
+
+    // An unknown network fails the whole call.
+    EXPECT_EQ(-ENONET, mController.setNetworkAllowlist(
+                               {makeAllowlist(kVpnNetId, {{kTestUid, kTestUid}}),
+                                makeAllowlist(kMissingNetId, {{kTestUid, kTestUid}})}));
+    EXPECT_EQ(2, mSnapshots);
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+}
+
+TEST_F(NetworkControllerTest, TransactionAppliesAllOperations) {
+    countSnapshots();
+    const std::vector<TopologyOperation> operations = {
+            createVirtualNetwork(kVpnNetId),
+            addUsers(kVpnNetId, makeUidRanges({{kTestUid, kTestUid}})),
+            modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS, kVpnNetId,
+                               {{kTestUid, kTestUid}}),
+    };
+    EXPECT_EQ(0, applyTopology(operations));
+
+    EXPECT_TRUE(mController.isVirtualNetwork(kVpnNetId));
+    EXPECT_EQ(kVpnNetId, mController.getNetworkForUser(kTestUid));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid));
+    EXPECT_FALSE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+    // The whole transaction became visible at once.
+    EXPECT_EQ(1, mSnapshots);
+}
+
+TEST_F(NetworkControllerTest, TransactionStopsAtFailedOperation) {
+    countSnapshots();
+    const std::vector<TopologyOperation> operations = {
+            createVirtualNetwork(kVpnNetId),
+            addUsers(kVpnNetId, makeUidRanges({{kTestUid, kTestUid}})),
+            addUsers(kMissingNetId, makeUidRanges({{kTestUid + 1, kTestUid + 1}})),
+            modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS, kVpnNetId,
+                               {{kTestUid, kTestUid}}),
+    };
+    EXPECT_EQ(-ENONET, applyTopology(operations));
+    EXPECT_EQ(2U, mFailedIndex);
+
+    // The operations before the failed one stay applied, and those after it are not applied.
+    EXPECT_TRUE(mController.isVirtualNetwork(kVpnNetId));
+    EXPECT_EQ(kVpnNetId, mController.getNetworkForUser(kTestUid));
+    EXPECT_TRUE(mController.isUidAllowed(kVpnNetId, kTestUid + 1));
+    // What was applied is still published, once.
+    EXPECT_EQ(1, mSnapshots);
+}
+
+TEST_F(NetworkControllerTest, SnapshotPublishedAfterTransaction) {
+    countSnapshots();
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId)}));
+    ASSERT_EQ(1, mSnapshots);
+
+    // Outside a transaction, each change publishes a snapshot.
+    ASSERT_EQ(0, mController.addUsersToNetwork(kVpnNetId, makeUidRanges({{kTestUid, kTestUid}}),
+                                               UidRanges::SUB_PRIORITY_HIGHEST));
+    ASSERT_EQ(0, mController.removeUsersFromNetwork(kVpnNetId,
+                                                    makeUidRanges({{kTestUid, kTestUid}}),
+                                                    UidRanges::SUB_PRIORITY_HIGHEST));
+    EXPECT_EQ(3, mSnapshots);
+
+    // Inside one, the changes of all the operations are published together, before the
+    // DESTROY_SOCKETS operations run.
+    const UidRanges ranges = makeUidRanges({{kTestUid, kTestUid}});
+    EXPECT_EQ(0, applyTopology({addUsers(kVpnNetId, ranges),
+                                modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS,
+                                                   kVpnNetId, {{kTestUid, kTestUid}}),
+                                removeUsers(kVpnNetId, ranges), addUsers(kVpnNetId, ranges),
+                                destroySockets(ranges)}));
+    EXPECT_EQ(4, mSnapshots);
+    const std::vector<DestroyCall> destroyed = calls();
+    ASSERT_EQ(1U, destroyed.size());
+    EXPECT_EQ(kVpnNetId, destroyed[0].netId);
+}
+
+TEST_F(NetworkControllerTest, ConnectPathDoesNotWaitForWriters) {
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId),
+                                addUsers(kVpnNetId, makeUidRanges({{kTestUid, kTestUid}}))}));
+    mController.setPermissionForUsers(PERMISSION_NETWORK, {kTestUid});
+    mController.allowProtect({kTestUid});
+
+    // While a binder write holds the lock, the lookups are served from the published snapshot.
+    std::unique_lock writer(writeLock());
+    auto lookups = std::async(std::launch::async, [this] {
+        return std::make_tuple(mController.getNetworkForUser(kTestUid),
+                               mController.getPermissionForUser(kTestUid),
+                               mController.canProtect(kTestUid),
+                               mController.checkUserNetworkAccess(kTestUid, kVpnNetId));
+    });
+    const std::future_status status = lookups.wait_for(std::chrono::seconds(5));
+    writer.unlock();
+    ASSERT_EQ(std::future_status::ready, status);
+
+    const auto [netId, permission, canProtect, access] = lookups.get();
+    EXPECT_EQ(kVpnNetId, netId);
+    EXPECT_EQ(PERMISSION_NETWORK, permission);
+    EXPECT_TRUE(canProtect);
+    EXPECT_EQ(0, access);
+}
+
+// OemNetdListener applies the transaction to gCtls->netCtrl.
+TEST_F(NetworkControllerTest, ApplyNetworkTopology) {
+    NetworkTopologyOperation create;
+    create.type = NetworkTopologyOperation::CREATE_VIRTUAL_NETWORK;
+    create.netId = kVpnNetId;
+    create.secure = true;
+    create.vpnType = static_cast<int32_t>(NativeVpnType::SERVICE);
+    NetworkTopologyOperation addUidRanges;
+    addUidRanges.type = NetworkTopologyOperation::ADD_UID_RANGES;
+    addUidRanges.netId = kVpnNetId;
+    addUidRanges.uidRanges = {static_cast<int32_t>(kTestUid), static_cast<int32_t>(kTestUid)};
+    NetworkTopologyOperation addToMissing = addUidRanges;
+    addToMissing.netId = kMissingNetId;
+
+    OemNetdListener listener;
+    NetworkTopologyResult result;
+    Status status = listener.applyNetworkTopology({create, addUidRanges, addToMissing}, &result);
+    ASSERT_TRUE(status.isOk()) << status;
+    EXPECT_EQ(ENONET, result.error);
+    EXPECT_EQ(2, result.failedIndex);
+    EXPECT_EQ(kVpnNetId, gCtls->netCtrl.getNetworkForUser(kTestUid));
+    (void)gCtls->netCtrl.destroyNetwork(kVpnNetId);
+
+    // A malformed operation fails the call before anything is applied.
+    addUidRanges.uidRanges.push_back(kTestUid);
+    status = listener.applyNetworkTopology({create, addUidRanges}, &result);
+    EXPECT_EQ(Status::EX_ILLEGAL_ARGUMENT, status.exceptionCode());
+    EXPECT_FALSE(gCtls->netCtrl.isVirtualNetwork(kVpnNetId));
+}
+
+TEST_F(NetworkControllerTest, DumpProtoParses) {
+    ASSERT_EQ(0, applyTopology({createVirtualNetwork(kVpnNetId),
+                                addUsers(kVpnNetId, makeUidRanges({{kTestUid, kTestUid + 5}})),
+                                modifyAllowedUsers(TopologyOperation::ADD_ALLOWED_USERS,
+                                                   kVpnNetId, {{kTestUid, kTestUid}})}));
+
+    netd::NetdDumpProto dump;
+    mController.dumpProto(dump.mutable_network_controller());
+    std::string serialized;
+    ASSERT_TRUE(dump.SerializeToString(&serialized));
+
+    netd::NetdDumpProto parsed;
+    ASSERT_TRUE(parsed.ParseFromString(serialized));
+    const netd::NetworkControllerProto& controller = parsed.network_controller();
+    EXPECT_EQ(0U, controller.default_net_id());
+    const netd::NetworkProto* vpn = nullptr;
+    for (const auto& network : controller.networks()) {
+        if (network.net_id() == kVpnNetId) vpn = &network;
+    }
+    ASSERT_NE(nullptr, vpn);
+    EXPECT_EQ("VIRTUAL", vpn->type());
+    ASSERT_EQ(1, vpn->uid_ranges_size());
+    EXPECT_EQ(UidRanges::SUB_PRIORITY_HIGHEST, vpn->uid_ranges(0).sub_priority());
+    ASSERT_EQ(1, vpn->uid_ranges(0).ranges_size());
+    EXPECT_EQ(static_cast<int32_t>(kTestUid), vpn->uid_ranges(0).ranges(0).start());
+    EXPECT_EQ(static_cast<int32_t>(kTestUid + 5), vpn->uid_ranges(0).ranges(0).stop());
+    EXPECT_TRUE(vpn->has_allowlist());
+    ASSERT_EQ(1, vpn->allowed_uids_size());
+    EXPECT_EQ(static_cast<int32_t>(kTestUid), vpn->allowed_uids(0).stop());
+}
+
+}  // namespace android::net
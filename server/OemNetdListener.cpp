@@ -18,6 +18,33 @@
 
 #include "OemNetdListener.h"
 
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <log/log.h>
+
+#include "Controllers.h"
+#include "NetdMetrics.h"
+#include "RpcStats.h"
+#include "android/net/INetd.h"
+#include "binder_utils/BinderUtil.h"
+#include "binder_utils/NetdPermissions.h"
+
+using ::android::base::StringPrintf;
+using ::android::binder::Status;
+using ::android::net::FwmarkServerStats;
+using ::android::net::gCtls;
+using ::android::net::INetd;
+using ::android::net::NetdMetrics;
+using ::android::net::NativeVpnType;
+using ::android::net::RpcStats;
+using ::android::net::TcpSocketMonitor;
+using ::android::net::UidRangeParcel;
+using ::android::net::UidRanges;
+
 namespace com {
 namespace android {
 namespace internal {
@@ -42,6 +69,239 @@ namespace net {
     return ::android::binder::Status::ok();
 }
 
+namespace {
+
+using TopologyOperation = ::android::net::NetworkController::TopologyOperation;
+
+bool convertTopologyOperation(const NetworkTopologyOperation& parcel, TopologyOperation* op) {
+    switch (parcel.type) {
+        case NetworkTopologyOperation::CREATE_PHYSICAL_NETWORK:
+            op->type = TopologyOperation::CREATE_PHYSICAL_NETWORK;
+            break;
+        case NetworkTopologyOperation::CREATE_VIRTUAL_NETWORK:
+            op->type = TopologyOperation::CREATE_VIRTUAL_NETWORK;
+            break;
+        case NetworkTopologyOperation::DESTROY_NETWORK:
+            op->type = TopologyOperation::DESTROY_NETWORK;
+            break;
+        case NetworkTopologyOperation::ADD_INTERFACE:
+            op->type = TopologyOperation::ADD_INTERFACE;
+            break;
+        case NetworkTopologyOperation::REMOVE_INTERFACE:
+            op->type = TopologyOperation::REMOVE_INTERFACE;
+            break;
+        case NetworkTopologyOperation::ADD_ROUTE:
+            op->type = TopologyOperation::ADD_ROUTE;
+            break;
+        case NetworkTopologyOperation::REMOVE_ROUTE:
+            op->type = TopologyOperation::REMOVE_ROUTE;
+            break;
+        case NetworkTopologyOperation::ADD_UID_RANGES:
+            op->type = TopologyOperation::ADD_USERS;
+            break;
+        case NetworkTopologyOperation::REMOVE_UID_RANGES:
+            op->type = TopologyOperation::REMOVE_USERS;
+            break;
+        case NetworkTopologyOperation::SET_DEFAULT_NETWORK:
+            op->type = TopologyOperation::SET_DEFAULT;
+            break;
+        case NetworkTopologyOperation::ADD_ALLOWED_UID_RANGES:
+            op->type = TopologyOperation::ADD_ALLOWED_USERS;
+            break;
+        case NetworkTopologyOperation::REMOVE_ALLOWED_UID_RANGES:
+            op->type = TopologyOperation::REMOVE_ALLOWED_USERS;
+            break;
+        case NetworkTopologyOperation::CLEAR_ALLOWED_UID_RANGES:
+            op->type = TopologyOperation::CLEAR_ALLOWED_USERS;
+            break;
+        case NetworkTopologyOperation::DESTROY_SOCKETS:
+            op->type = TopologyOperation::DESTROY_SOCKETS;
+            break;
+        default:
+            return false;
+    }
+    if (parcel.uidRanges.size() % 2) return false;
+
+    op->netId = parcel.netId;
+    switch (parcel.permission) {
+        case INetd::PERMISSION_NETWORK:
+            op->permission = PERMISSION_NETWORK;
+            break;
+        case INetd::PERMISSION_SYSTEM:
+            op->permission = PERMISSION_SYSTEM;
+            break;
+        default:
+            op->permission = PERMISSION_NONE;
+            break;
+    }
+    op->secure = parcel.secure;
+    op->vpnType = static_cast<NativeVpnType>(parcel.vpnType);
+    op->excludeLocalRoutes = parcel.excludeLocalRoutes;
+    op->interface = parcel.ifName;
+    op->destination = parcel.destination;
+    op->nexthop = parcel.nextHop;
+    op->mtu = parcel.mtu;
+    std::vector<UidRangeParcel> ranges;
+    for (size_t i = 0; i < parcel.uidRanges.size(); i += 2) {
+        UidRangeParcel range;
+        range.start = parcel.uidRanges[i];
+        range.stop = parcel.uidRanges[i + 1];
+        ranges.push_back(range);
+    }
+    op->uidRanges = UidRanges(ranges);
+    op->subPriority = parcel.subPriority;
+    op->skipUids = std::set<uid_t>(parcel.skipUids.begin(), parcel.skipUids.end());
+    return true;
+}
+
+}  // namespace
+
+Status OemNetdListener::applyNetworkTopology(
+        const std::vector<NetworkTopologyOperation>& operations, NetworkTopologyResult* result) {
+    Status status = checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK});
+    if (!status.isOk()) return status;
+
+    std::vector<TopologyOperation> ops(operations.size());
+    for (size_t i = 0; i < operations.size(); ++i) {
+        if (!convertTopologyOperation(operations[i], &ops[i])) {
+            return Status::fromExceptionCode(
+                    Status::EX_ILLEGAL_ARGUMENT,
+                    StringPrintf("Invalid topology operation %zu", i).c_str());
+        }
+    }
+
+    size_t failedIndex = 0;
+    const int ret = gCtls->netCtrl.applyTopologyTransaction(ops, &failedIndex);
+    result->error = -ret;
+    result->failedIndex = ret ? failedIndex : 0;
+    return Status::ok();
+}
+
+Status OemNetdListener::bandwidthSetInterfaceQuotas(const std::vector<std::string>& ifNames,
+                                                    const std::vector<int64_t>& bytes) {
+    Status status = checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK});
+    if (!status.isOk()) return status;
+    if (ifNames.size() != bytes.size()) {
+        return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT,
+                                         "ifNames and bytes have different lengths");
+    }
+
+    std::vector<std::pair<std::string, int64_t>> quotas;
+    for (size_t i = 0; i < ifNames.size(); ++i) quotas.emplace_back(ifNames[i], bytes[i]);
+    std::lock_guard lock(gCtls->bandwidthCtrl.lock);
+    return statusFromErrcode(gCtls->bandwidthCtrl.setInterfaceQuotas(quotas));
+}
+
+Status OemNetdListener::getFwmarkServerLatencyHistogram(int32_t command, int32_t step,
+                                                        std::vector<int64_t>* histogram) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    histogram->clear();
+    if (command < 0 || static_cast<size_t>(command) >= FwmarkServerStats::NUM_COMMANDS ||
+        step < 0 || step >= FwmarkServerStats::NUM_STEPS) {
+        return Status::ok();
+    }
+    const FwmarkServerStats::Histogram counts = gCtls->fwmarkServerStats.getHistogram(
+            command, static_cast<FwmarkServerStats::Step>(step));
+    histogram->assign(counts.begin(), counts.end());
+    return Status::ok();
+}
+
+Status OemNetdListener::getTcpRttPercentileUs(int32_t netId, int32_t percentile,
+                                              int32_t* rttUs) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    if (percentile < 0 || percentile > 100) {
+        return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT,
+                                         StringPrintf("Invalid percentile %d", percentile).c_str());
+    }
+    *rttUs = gCtls->tcpSocketMonitor.getRttPercentileUs(netId, percentile);
+    return Status::ok();
+}
+
+Status OemNetdListener::getTcpLossPercentilePerMille(int32_t netId, int32_t percentile,
+                                                     int32_t* lossPerMille) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    if (percentile < 0 || percentile > 100) {
+        return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT,
+                                         StringPrintf("Invalid percentile %d", percentile).c_str());
+    }
+    *lossPerMille = gCtls->tcpSocketMonitor.getLossPercentilePerMille(netId, percentile);
+    return Status::ok();
+}
+
+Status OemNetdListener::getTcpSocketInfos(std::vector<TcpSocketInfo>* infos) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    const std::vector<TcpSocketMonitor::SocketInfo> sockets =
+            gCtls->tcpSocketMonitor.getSocketInfos();
+    infos->resize(sockets.size());
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        TcpSocketInfo& info = (*infos)[i];
+        info.cookie = static_cast<int64_t>(sockets[i].cookie);
+        info.uid = static_cast<int32_t>(sockets[i].uid);
+        info.netId = static_cast<int32_t>(sockets[i].netId);
+        info.rttUs = static_cast<int32_t>(sockets[i].rttUs);
+        info.cwnd = static_cast<int32_t>(sockets[i].cwnd);
+        info.totalRetrans = static_cast<int32_t>(sockets[i].totalRetrans);
+        info.deliveryRate = static_cast<int64_t>(sockets[i].deliveryRate);
+    }
+    return Status::ok();
+}
+
+Status OemNetdListener::getRpcLatencyHistogram(const std::string& rpc, bool execution,
+                                               std::vector<int64_t>* histogram) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    histogram->clear();
+    for (const auto& snapshot : RpcStats::getSnapshots()) {
+        if (snapshot.name != rpc) continue;
+        const RpcStats::Histogram::Counts& counts = execution ? snapshot.exec : snapshot.wait;
+        histogram->assign(counts.begin(), counts.end());
+        break;
+    }
+    return Status::ok();
+}
+
+Status OemNetdListener::getNetdMetrics(std::vector<NetdMetric>* metrics) {
+    Status status =
+            checkAnyPermission({PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK, PERM_DUMP});
+    if (!status.isOk()) return status;
+
+    static_assert(static_cast<int>(NetdMetrics::Type::COUNTER) == NetdMetric::TYPE_COUNTER);
+    static_assert(static_cast<int>(NetdMetrics::Type::GAUGE) == NetdMetric::TYPE_GAUGE);
+    static_assert(static_cast<int>(NetdMetrics::Type::HISTOGRAM) == NetdMetric::TYPE_HISTOGRAM);
+
+    metrics->clear();
+    for (const auto& snapshot : NetdMetrics::getSnapshots()) {
+        NetdMetric& metric = metrics->emplace_back();
+        metric.name = snapshot.name;
+        metric.type = static_cast<int32_t>(snapshot.type);
+        metric.value = snapshot.value;
+        if (snapshot.type != NetdMetrics::Type::HISTOGRAM) continue;
+        metric.sum = static_cast<int64_t>(snapshot.sum);
+        metric.max = static_cast<int64_t>(snapshot.max);
+        for (size_t i = 0; i < snapshot.counts.size(); i++) {
+            if (snapshot.counts[i] == 0) continue;
+            metric.bucketLowerBounds.push_back(
+                    static_cast<int64_t>(NetdMetrics::Histogram::lowerBound(i)));
+            metric.bucketCounts.push_back(static_cast<int64_t>(snapshot.counts[i]));
+        }
+    }
+    return Status::ok();
+}
+
 void OemNetdListener::registerOemUnsolicitedEventListenerInternal(
         const ::android::sp<IOemNetdUnsolicitedEventListener>& listener) {
     std::lock_guard lock(mOemUnsolicitedMutex);
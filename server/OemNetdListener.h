@@ -19,10 +19,15 @@
 
 #include <map>
 #include <mutex>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 #include "com/android/internal/net/BnOemNetd.h"
 #include "com/android/internal/net/IOemNetdUnsolicitedEventListener.h"
+#include "com/android/internal/net/NetdMetric.h"
+#include "com/android/internal/net/NetworkTopologyOperation.h"
+#include "com/android/internal/net/NetworkTopologyResult.h"
+#include "com/android/internal/net/TcpSocketInfo.h"
 
 namespace com {
 namespace android {
@@ -41,6 +46,21 @@ class OemNetdListener : public BnOemNetd {
     ::android::binder::Status isAlive(bool* alive) override;
     ::android::binder::Status registerOemUnsolicitedEventListener(
             const ::android::sp<IOemNetdUnsolicitedEventListener>& listener) override;
+    ::android::binder::Status applyNetworkTopology(
+            const std::vector<NetworkTopologyOperation>& operations,
+            NetworkTopologyResult* result) override;
+    ::android::binder::Status bandwidthSetInterfaceQuotas(
+            const std::vector<std::string>& ifNames, const std::vector<int64_t>& bytes) override;
+    ::android::binder::Status getFwmarkServerLatencyHistogram(
+            int32_t command, int32_t step, std::vector<int64_t>* histogram) override;
+    ::android::binder::Status getTcpRttPercentileUs(int32_t netId, int32_t percentile,
+                                                    int32_t* rttUs) override;
+    ::android::binder::Status getTcpLossPercentilePerMille(int32_t netId, int32_t percentile,
+                                                           int32_t* lossPerMille) override;
+    ::android::binder::Status getTcpSocketInfos(std::vector<TcpSocketInfo>* infos) override;
+    ::android::binder::Status getRpcLatencyHistogram(const std::string& rpc, bool execution,
+                                                     std::vector<int64_t>* histogram) override;
+    ::android::binder::Status getNetdMetrics(std::vector<NetdMetric>* metrics) override;
 
   private:
     std::mutex mOemUnsolicitedMutex;
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ParameterCache"
+
+#include "ParameterCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <log/log.h>
+
+#include "InterfaceRegistry.h"
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+// Parameters that only userspace writes. Anything else is written every time.
+const std::set<std::string_view> kCacheableParameters = {
+        "accept_dad",
+        "accept_ra",
+        "accept_ra_rt_info_max_plen",
+        "accept_ra_rt_info_min_plen",
+        "dad_transmits",
+        "ip_forward",
+        "mcast_resolicit",
+        "mcast_solicit",
+        "nf_conntrack_tcp_be_liberal",
+        "ucast_solicit",
+        "use_tempaddr",
+};
+
+// Link attributes in sysfs, which change with the link, and only cached until it next does.
+const std::set<std::string_view> kCacheableLinkAttributes = {"mtu"};
+
+struct Entry {
+    std::string subdir;
+    // The interface index |subdir| had when the value was written, or 0 if it is not known.
+    int ifindex;
+    bool isLinkAttribute;
+    std::string value;
+};
+
+std::mutex sLock;
+// Keyed by path.
+std::map<std::string, Entry> sEntries GUARDED_BY(sLock);
+// Keyed by directory.
+std::map<std::string, unique_fd, std::less<>> sDirFds GUARDED_BY(sLock);
+uint64_t sWritesSkipped GUARDED_BY(sLock) = 0;
+
+bool isSysfs(std::string_view dir) {
+    return dir.starts_with("/sys/");
+}
+
+// Returns an fd for |dir|, opening it the first time, or -1 if it cannot be opened.
+int dirFdLocked(const char* dir) REQUIRES(sLock) {
+    const auto it = sDirFds.find(std::string_view(dir));
+    if (it != sDirFds.end()) return it->second.get();
+    unique_fd fd(open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1) return -1;
+    return sDirFds.emplace(dir, std::move(fd)).first->second.get();
+}
+
+// Forgets the values of |subdir| for which |forget| returns true.
+template <typename Predicate>
+void forgetLocked(std::string_view subdir, Predicate forget) REQUIRES(sLock) {
+    std::erase_if(sEntries, [&](const auto& entry) {
+        return entry.second.subdir == subdir && forget(entry.second);
+    });
+}
+
+}  // namespace
+
+int ParameterCache::write(const char* dir, const char* subdir, const char* basename,
+                          std::string_view value) {
+    const std::string path = StringPrintf("%s/%s/%s", dir, subdir, basename);
+    const bool isLinkAttribute = isSysfs(dir) && kCacheableLinkAttributes.contains(basename);
+    const bool cacheable = isLinkAttribute || kCacheableParameters.contains(basename);
+
+    std::lock_guard lock(sLock);
+    if (cacheable) {
+        const auto it = sEntries.find(path);
+        if (it != sEntries.end() && it->second.value == value) {
+            sWritesSkipped++;
+            return 0;
+        }
+    }
+
+    // Whatever was there is no longer known.
+    sEntries.erase(path);
+    const int dirFd = dirFdLocked(dir);
+    const char* relativePath = path.c_str() + strlen(dir) + 1;
+    unique_fd fd(dirFd == -1 ? open(path.c_str(), O_WRONLY | O_CLOEXEC)
+                             : openat(dirFd, relativePath, O_WRONLY | O_CLOEXEC));
+    if (fd == -1 || !android::base::WriteStringToFd(value, fd)) {
+        return -errno;
+    }
+    if (cacheable) {
+        const int ifindex = InterfaceRegistry::ifindex(InterfaceRegistry::find(subdir));
+        sEntries.emplace(path, Entry{subdir, ifindex, isLinkAttribute, std::string(value)});
+    }
+    return 0;
+}
+
+int ParameterCache::write(const std::string& path, std::string_view value) {
+    const size_t basenameStart = path.rfind('/');
+    const size_t subdirStart =
+            (basenameStart == std::string::npos || basenameStart == 0)
+                    ? std::string::npos
+                    : path.rfind('/', basenameStart - 1);
+    if (subdirStart == std::string::npos || subdirStart == 0) {
+        return -EINVAL;
+    }
+    const std::string dir = path.substr(0, subdirStart);
+    const std::string subdir = path.substr(subdirStart + 1, basenameStart - subdirStart - 1);
+    return write(dir.c_str(), subdir.c_str(), path.c_str() + basenameStart + 1, value);
+}
+
+void ParameterCache::onNetlinkMessage(const nlmsghdr* nlh) {
+    if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK) return;
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) return;
+    const auto* ifi = reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nlh));
+    std::string_view name;
+    int len = IFLA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type != IFLA_IFNAME) continue;
+        const char* data = static_cast<const char*>(RTA_DATA(rta));
+        name = std::string_view(data, strnlen(data, std::min<size_t>(RTA_PAYLOAD(rta),
+                                                                     IFNAMSIZ - 1)));
+        break;
+    }
+    if (name.empty()) return;
+
+    std::lock_guard lock(sLock);
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        forgetLocked(name, [](const Entry&) { return true; });
+        return;
+    }
+    // An interface that was not known when the value was written might be another one.
+    const int ifindex = ifi->ifi_index;
+    forgetLocked(name, [ifindex](const Entry& entry) {
+        return entry.isLinkAttribute || entry.ifindex != ifindex;
+    });
+}
+
+void ParameterCache::clear() {
+    std::lock_guard lock(sLock);
+    sEntries.clear();
+}
+
+void ParameterCache::dump(DumpWriter& dw) {
+    std::lock_guard lock(sLock);
+    dw.println("Parameter cache: %zu values, %" PRIu64 " writes skipped", sEntries.size(),
+               sWritesSkipped);
+}
+
+}  // namespace android::net
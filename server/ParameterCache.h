@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+
+#include <string>
+#include <string_view>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Writes procfs and sysfs parameters, and skips writing a value that netd already wrote to the
+// same file. The framework applies the same interface configuration again on every network
+// validation, and each of those writes costs an open(), a write() and a close().
+//
+// Only parameters that nothing but userspace changes are cached: the kernel changes others on its
+// own, e.g. disable_ipv6 when DAD fails, or the IPv6 MTU, hop limit and neighbour timers
+// (retrans_time_ms and base_reachable_time_ms) when an RA arrives. Cached values of an interface
+// are forgotten when NetlinkHandler sees it go away, or its name taken by another interface, and
+// its sysfs values whenever its link changes, since an MTU change comes with a link message.
+//
+// Files are opened relative to a directory fd kept open for each parent directory, e.g.
+// /proc/sys/net/ipv6/conf, so only the interface and file names are looked up on each write.
+class ParameterCache {
+  public:
+    // Writes |value| to the file |basename| in the directory |subdir| of |dir|. |subdir| is the
+    // interface name for per-interface parameters. Returns 0 or -errno.
+    static int write(const char* dir, const char* subdir, const char* basename,
+                     std::string_view value);
+    // Like write() above, for an absolute |path| of the form |dir|/|subdir|/|basename|.
+    static int write(const std::string& path, std::string_view value);
+
+    // Forgets the values of the interface that a message received on a socket subscribed to
+    // RTMGRP_LINK is about, as described above. Other messages are ignored.
+    static void onNetlinkMessage(const nlmsghdr* nlh);
+    // Forgets every value, e.g. because netlink messages were lost.
+    static void clear();
+
+    static void dump(netdutils::DumpWriter& dw);
+};
+
+}  // namespace android::net
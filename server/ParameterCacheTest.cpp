@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "ParameterCache.h"
+
+using android::base::ReadFileToString;
+using android::base::WriteStringToFile;
+
+namespace android::net {
+
+namespace {
+
+// An index that no real interface has.
+constexpr int kFakeIndex = 0x7fffffe2;
+
+void sendLink(uint16_t type, int index, const std::string& name) {
+    std::vector<uint8_t> buf(NLMSG_SPACE(sizeof(ifinfomsg)) + RTA_SPACE(name.size() + 1));
+    auto* nlh = reinterpret_cast<nlmsghdr*>(buf.data());
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_len = buf.size();
+    reinterpret_cast<ifinfomsg*>(NLMSG_DATA(nlh))->ifi_index = index;
+    auto* rta = reinterpret_cast<rtattr*>(buf.data() + NLMSG_SPACE(sizeof(ifinfomsg)));
+    rta->rta_type = IFLA_IFNAME;
+    rta->rta_len = RTA_LENGTH(name.size() + 1);
+    memcpy(RTA_DATA(rta), name.c_str(), name.size() + 1);
+    ParameterCache::onNetlinkMessage(nlh);
+}
+
+}  // namespace
+
+class ParameterCacheTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        ParameterCache::clear();
+        ASSERT_EQ(0, mkdir((mDir.path + std::string("/pctest0")).c_str(), 0700));
+    }
+
+    std::string path(const char* basename) {
+        return std::string(mDir.path) + "/pctest0/" + basename;
+    }
+
+    std::string read(const char* basename) {
+        std::string value;
+        EXPECT_TRUE(ReadFileToString(path(basename), &value));
+        return value;
+    }
+
+    // Changes a file behind the cache's back, to tell whether the next write reaches it.
+    void overwrite(const char* basename) {
+        ASSERT_TRUE(WriteStringToFile("x", path(basename)));
+    }
+
+    int write(const char* basename, const char* value) {
+        return ParameterCache::write(mDir.path, "pctest0", basename, value);
+    }
+
+    TemporaryDir mDir;
+};
+
+TEST_F(ParameterCacheTest, SkipsRewritingTheSameValue) {
+    overwrite("accept_ra");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    EXPECT_EQ("2", read("accept_ra"));
+
+    overwrite("accept_ra");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    EXPECT_EQ("x", read("accept_ra"));
+
+    EXPECT_EQ(0, write("accept_ra", "0"));
+    EXPECT_EQ("0", read("accept_ra"));
+
+    // The path form is the same file.
+    overwrite("accept_ra");
+    EXPECT_EQ(0, ParameterCache::write(path("accept_ra"), "0"));
+    EXPECT_EQ("x", read("accept_ra"));
+}
+
+TEST_F(ParameterCacheTest, AlwaysWritesParametersTheKernelChanges) {
+    overwrite("disable_ipv6");
+    EXPECT_EQ(0, write("disable_ipv6", "0"));
+    overwrite("disable_ipv6");
+    EXPECT_EQ(0, write("disable_ipv6", "0"));
+    EXPECT_EQ("0", read("disable_ipv6"));
+
+    // An RA sets the IPv6 neighbour timers, and the IPv4 ones share the file names.
+    overwrite("retrans_time_ms");
+    EXPECT_EQ(0, write("retrans_time_ms", "1000"));
+    overwrite("retrans_time_ms");
+    EXPECT_EQ(0, write("retrans_time_ms", "1000"));
+    EXPECT_EQ("1000", read("retrans_time_ms"));
+}
+
+TEST_F(ParameterCacheTest, ForgetsRemovedInterfaces) {
+    overwrite("accept_ra");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    overwrite("accept_ra");
+    sendLink(RTM_DELLINK, kFakeIndex, "pctest0");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    EXPECT_EQ("2", read("accept_ra"));
+
+    // The cache does not know which interface had the name, so any link message for it might be
+    // about another one.
+    overwrite("accept_ra");
+    sendLink(RTM_NEWLINK, kFakeIndex, "pctest0");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    EXPECT_EQ("2", read("accept_ra"));
+
+    // Other interfaces keep their values.
+    overwrite("accept_ra");
+    sendLink(RTM_DELLINK, kFakeIndex, "pctest1");
+    EXPECT_EQ(0, write("accept_ra", "2"));
+    EXPECT_EQ("x", read("accept_ra"));
+}
+
+TEST_F(ParameterCacheTest, ReportsErrors) {
+    EXPECT_EQ(-ENOENT, write("accept_dad", "1"));
+    EXPECT_EQ(-EINVAL, ParameterCache::write("accept_dad", "1"));
+}
+
+}  // namespace android::net
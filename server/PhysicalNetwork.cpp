@@ -69,16 +69,17 @@ Permission PhysicalNetwork::getPermission() const {
     return mPermission;
 }
 
-int PhysicalNetwork::destroySocketsLackingPermission(Permission permission) {
+// |sd| is opened on first use, and can be passed again to reuse its sockets and dump buffer.
+int PhysicalNetwork::destroySocketsLackingPermission(SockDiag* sd, Permission permission) {
     if (permission == PERMISSION_NONE) return 0;
 
-    SockDiag sd;
-    if (!sd.open()) {
+    if (!sd->isOpen() && !sd->open()) {
        ALOGE("Error closing sockets for netId %d permission change", mNetId);
        return -EBADFD;
     }
-    if (int ret = sd.destroySocketsLackingPermission(mNetId, permission,
-                                                     true /* excludeLoopback */)) {
+    sd->setParallel(true);
+    if (int ret = sd->destroySocketsLackingPermission(mNetId, permission,
+                                                      true /* excludeLoopback */)) {
         ALOGE("Failed to close sockets changing netId %d to permission %d: %s",
               mNetId, permission, strerror(-ret));
         return ret;
@@ -86,22 +87,10 @@ int PhysicalNetwork::destroySocketsLackingPermission(Permission permission) {
     return 0;
 }
 
-void PhysicalNetwork::invalidateRouteCache(const std::string& interface) {
-    // This method invalidates all socket destination cache entries in the kernel by creating and
-    // removing a low-priority route.
-    // This number is an arbitrary number that need to be higher than any other route created either
-    // by netd or by an IPv6 RouterAdvertisement.
-    int priority = 100000;
-
-    for (const auto& dst : { "0.0.0.0/0", "::/0" }) {
-        // If any of these operations fail, there's no point in logging because RouteController will
-        // have already logged a message. There's also no point returning an error since there's
-        // nothing we can do.
-        (void)RouteController::addRoute(interface.c_str(), dst, "throw", RouteController::INTERFACE,
-                                        0 /* mtu */, priority);
-        (void)RouteController::removeRoute(interface.c_str(), dst, "throw",
-                                           RouteController::INTERFACE, priority);
-    }
+void PhysicalNetwork::invalidateRouteCache() {
+    // If this fails, there's no point in logging because RouteController will have already logged
+    // a message. There's also no point returning an error since there's nothing we can do.
+    (void)RouteController::invalidateRouteCache(mInterfaces);
 }
 
 int PhysicalNetwork::setPermission(Permission permission) {
@@ -113,7 +102,8 @@ int PhysicalNetwork::setPermission(Permission permission) {
         return 0;
     }
 
-    destroySocketsLackingPermission(permission);
+    SockDiag sd;
+    destroySocketsLackingPermission(&sd, permission);
     for (const std::string& interface : mInterfaces) {
         if (int ret = RouteController::modifyPhysicalNetworkPermission(
                     mNetId, interface.c_str(), mPermission, permission, mIsLocalNetwork)) {
@@ -121,8 +111,8 @@ int PhysicalNetwork::setPermission(Permission permission) {
                   interface.c_str(), mNetId, mPermission, permission);
             return ret;
         }
-        invalidateRouteCache(interface);
     }
+    invalidateRouteCache();
     if (mIsDefault) {
         for (const std::string& interface : mInterfaces) {
             if (int ret = addToDefault(mNetId, interface, permission, mDelegate)) {
@@ -136,7 +126,10 @@ int PhysicalNetwork::setPermission(Permission permission) {
     // Destroy sockets again in case any were opened after we called destroySocketsLackingPermission
     // above and before we changed the permissions. These sockets won't be able to send any RST
     // packets because they are now no longer routed, but at least the apps will get errors.
-    destroySocketsLackingPermission(permission);
+    // Socket cookies cannot tell these sockets apart from the ones seen above: the kernel hands
+    // them out in per-CPU batches, so they do not increase in creation order. And there is no
+    // notification of new TCP sockets. So this is a full dump too, but on the same sockets.
+    destroySocketsLackingPermission(&sd, permission);
     mPermission = permission;
     return 0;
 }
@@ -172,13 +165,11 @@ int PhysicalNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority) {
         return -EINVAL;
     }
 
-    for (const std::string& interface : mInterfaces) {
-        int ret = RouteController::addUsersToPhysicalNetwork(
-                mNetId, interface.c_str(), {{subPriority, uidRanges}}, mIsLocalNetwork);
-        if (ret) {
-            ALOGE("failed to add users on interface %s of netId %u", interface.c_str(), mNetId);
-            return ret;
-        }
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, true /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
+        ALOGE("failed to add users to netId %u", mNetId);
+        return ret;
     }
     addToUidRangeMap(uidRanges, subPriority);
     return 0;
@@ -187,15 +178,31 @@ int PhysicalNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority) {
 int PhysicalNetwork::removeUsers(const UidRanges& uidRanges, int32_t subPriority) {
     if (!isValidSubPriority(subPriority)) return -EINVAL;
 
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, false /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
+        ALOGE("failed to remove users from netId %u", mNetId);
+        return ret;
+    }
+    removeFromUidRangeMap(uidRanges, subPriority);
+    return 0;
+}
+
+int PhysicalNetwork::modifyUidRules(const UidRangeMap& rulesToAdd,
+                                    const UidRangeMap& rulesToRemove) {
+    // Rules are added before the ones they replace are removed, so the UIDs never lose access.
     for (const std::string& interface : mInterfaces) {
-        int ret = RouteController::removeUsersFromPhysicalNetwork(
-                mNetId, interface.c_str(), {{subPriority, uidRanges}}, mIsLocalNetwork);
-        if (ret) {
-            ALOGE("failed to remove users on interface %s of netId %u", interface.c_str(), mNetId);
+        if (int ret = RouteController::addUsersToPhysicalNetwork(mNetId, interface.c_str(),
+                                                                 rulesToAdd, mIsLocalNetwork)) {
+            ALOGE("failed to add UID rules on interface %s", interface.c_str());
+            return ret;
+        }
+        if (int ret = RouteController::removeUsersFromPhysicalNetwork(
+                    mNetId, interface.c_str(), rulesToRemove, mIsLocalNetwork)) {
+            ALOGE("failed to remove UID rules on interface %s", interface.c_str());
             return ret;
         }
     }
-    removeFromUidRangeMap(uidRanges, subPriority);
     return 0;
 }
 
@@ -204,7 +211,7 @@ int PhysicalNetwork::addInterface(const std::string& interface) {
         return 0;
     }
     if (int ret = RouteController::addInterfaceToPhysicalNetwork(
-                mNetId, interface.c_str(), mPermission, mUidRangeMap, mIsLocalNetwork)) {
+                mNetId, interface.c_str(), mPermission, getRuleUidRangeMap(), mIsLocalNetwork)) {
         ALOGE("failed to add interface %s to netId %u", interface.c_str(), mNetId);
         return ret;
     }
@@ -231,7 +238,7 @@ int PhysicalNetwork::removeInterface(const std::string& interface) {
     // to find the interface index in the cache in cases where the interface is already gone
     // (e.g. bt-pan).
     if (int ret = RouteController::removeInterfaceFromPhysicalNetwork(
-                mNetId, interface.c_str(), mPermission, mUidRangeMap, mIsLocalNetwork)) {
+                mNetId, interface.c_str(), mPermission, getRuleUidRangeMap(), mIsLocalNetwork)) {
         ALOGE("failed to remove interface %s from netId %u", interface.c_str(), mNetId);
         return ret;
     }
@@ -21,6 +21,8 @@
 
 namespace android::net {
 
+class SockDiag;
+
 class PhysicalNetwork : public Network {
   public:
     class Delegate {
@@ -51,9 +53,11 @@ class PhysicalNetwork : public Network {
     std::string getTypeString() const override { return "PHYSICAL"; };
     [[nodiscard]] int addInterface(const std::string& interface) override;
     [[nodiscard]] int removeInterface(const std::string& interface) override;
-    int destroySocketsLackingPermission(Permission permission);
-    void invalidateRouteCache(const std::string& interface);
+    int destroySocketsLackingPermission(SockDiag* sd, Permission permission);
+    void invalidateRouteCache();
     bool isValidSubPriority(int32_t priority) override;
+    [[nodiscard]] int modifyUidRules(const UidRangeMap& rulesToAdd,
+                                     const UidRangeMap& rulesToRemove);
 
     Delegate* const mDelegate;
     Permission mPermission;
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QuantileSketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace android::net {
+
+namespace {
+
+const double kGamma = (1 + QuantileSketch::kRelativeAccuracy) /
+                      (1 - QuantileSketch::kRelativeAccuracy);
+const double kLogGamma = std::log(kGamma);
+
+}  // namespace
+
+int QuantileSketch::indexFor(double value) {
+    return static_cast<int>(std::ceil(std::log(value) / kLogGamma));
+}
+
+double QuantileSketch::valueFor(int index) {
+    // The point of [gamma^(index-1), gamma^index) with the same relative error to both ends.
+    return 2 * std::pow(kGamma, index) / (kGamma + 1);
+}
+
+void QuantileSketch::add(double value) {
+    ++mCount;
+    if (!(value > 0)) {
+        ++mZeroCount;
+        return;
+    }
+
+    int index = indexFor(value);
+    if (mBuckets.empty()) {
+        mMinIndex = index;
+        mBuckets.push_back(0);
+    } else if (index < mMinIndex) {
+        const size_t grow = mMinIndex - index;
+        if (mBuckets.size() + grow > kMaxBuckets) {
+            // Too wide a range: count this value in the lowest bucket there is room for.
+            const size_t room = kMaxBuckets - mBuckets.size();
+            index = mMinIndex - static_cast<int>(room);
+            if (room == 0) {
+                ++mBuckets[0];
+                return;
+            }
+        }
+        mBuckets.insert(mBuckets.begin(), mMinIndex - index, 0);
+        mMinIndex = index;
+    } else if (static_cast<size_t>(index - mMinIndex) >= mBuckets.size()) {
+        const int newMinIndex = std::max(mMinIndex, index - static_cast<int>(kMaxBuckets) + 1);
+        if (newMinIndex > mMinIndex) {
+            // Too wide a range: merge the lowest buckets to make room at the top.
+            const size_t drop = std::min<size_t>(newMinIndex - mMinIndex, mBuckets.size());
+            const uint32_t merged =
+                    std::accumulate(mBuckets.begin(), mBuckets.begin() + drop, uint32_t{0});
+            mBuckets.erase(mBuckets.begin(), mBuckets.begin() + drop);
+            if (mBuckets.empty()) mBuckets.push_back(0);
+            mBuckets[0] += merged;
+            mMinIndex = newMinIndex;
+        }
+        mBuckets.resize(index - mMinIndex + 1, 0);
+    }
+    ++mBuckets[index - mMinIndex];
+}
+
+double QuantileSketch::quantile(double q) const {
+    if (mCount == 0) {
+        return 0;
+    }
+    const double rank = std::clamp(q, 0.0, 1.0) * (mCount - 1);
+    uint64_t seen = mZeroCount;
+    if (rank < seen) {
+        return 0;
+    }
+    for (size_t i = 0; i < mBuckets.size(); ++i) {
+        seen += mBuckets[i];
+        if (rank < seen) {
+            return valueFor(mMinIndex + static_cast<int>(i));
+        }
+    }
+    return valueFor(mMinIndex + static_cast<int>(mBuckets.size()) - 1);
+}
+
+void QuantileSketch::clear() {
+    mBuckets.clear();
+    mMinIndex = 0;
+    mZeroCount = 0;
+    mCount = 0;
+}
+
+}  // namespace android::net
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace android::net {
+
+// A streaming quantile sketch with relative-error guarantees (DDSketch). Positive values are
+// counted in logarithmic buckets [gamma^(i-1), gamma^i), with gamma chosen so that every quantile
+// is returned within kRelativeAccuracy of a value that was added. Zero and negative values are
+// counted as zero. Memory grows with the logarithm of the range of the values, and is bounded by
+// kMaxBuckets: past that, the lowest buckets are merged, which only loses accuracy at the low end.
+class QuantileSketch {
+  public:
+    static constexpr double kRelativeAccuracy = 0.01;
+    static constexpr size_t kMaxBuckets = 2048;
+
+    void add(double value);
+
+    // Returns the q-quantile of the values added, for 0 <= q <= 1, or 0 if there are none.
+    double quantile(double q) const;
+
+    uint64_t count() const { return mCount; }
+    void clear();
+
+  private:
+    static int indexFor(double value);
+    static double valueFor(int index);
+
+    // mBuckets[i] counts the values with index mMinIndex + i.
+    std::vector<uint32_t> mBuckets;
+    int mMinIndex = 0;
+    uint64_t mZeroCount = 0;
+    uint64_t mCount = 0;
+};
+
+}  // namespace android::net
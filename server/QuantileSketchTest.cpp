@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "QuantileSketch.h"
+
+namespace android::net {
+
+namespace {
+
+// Whether |actual| is within the sketch's relative accuracy of |expected|.
+bool isClose(double expected, double actual) {
+    return std::abs(actual - expected) <= expected * QuantileSketch::kRelativeAccuracy;
+}
+
+}  // namespace
+
+TEST(QuantileSketchTest, Empty) {
+    QuantileSketch sketch;
+    EXPECT_EQ(0U, sketch.count());
+    EXPECT_EQ(0, sketch.quantile(0.5));
+}
+
+TEST(QuantileSketchTest, Uniform) {
+    QuantileSketch sketch;
+    for (int i = 1; i <= 10000; ++i) sketch.add(i);
+    EXPECT_EQ(10000U, sketch.count());
+    EXPECT_TRUE(isClose(1, sketch.quantile(0)));
+    EXPECT_TRUE(isClose(5000, sketch.quantile(0.5))) << sketch.quantile(0.5);
+    EXPECT_TRUE(isClose(9500, sketch.quantile(0.95))) << sketch.quantile(0.95);
+    EXPECT_TRUE(isClose(10000, sketch.quantile(1))) << sketch.quantile(1);
+}
+
+TEST(QuantileSketchTest, Zeros) {
+    QuantileSketch sketch;
+    for (int i = 0; i < 90; ++i) sketch.add(0);
+    for (int i = 0; i < 10; ++i) sketch.add(500);
+    EXPECT_EQ(0, sketch.quantile(0.5));
+    EXPECT_TRUE(isClose(500, sketch.quantile(0.95)));
+}
+
+TEST(QuantileSketchTest, WideRangeIsBounded) {
+    QuantileSketch sketch;
+    // Far more buckets than kMaxBuckets apart. The high end stays accurate.
+    sketch.add(1e-300);
+    sketch.add(1e300);
+    sketch.add(1e-300);
+    EXPECT_TRUE(isClose(1e300, sketch.quantile(1)));
+    EXPECT_EQ(3U, sketch.count());
+
+    sketch.clear();
+    EXPECT_EQ(0U, sketch.count());
+    EXPECT_EQ(0, sketch.quantile(1));
+}
+
+}  // namespace android::net
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RdnssFilter.h"
+
+namespace android::net {
+
+RdnssFilter::RdnssFilter(Clock clock) : mClock(std::move(clock)) {}
+
+bool RdnssFilter::shouldReport(const std::string& ifName, int64_t lifetimeSec,
+                               const std::vector<std::string>& servers) {
+    std::lock_guard lock(mMutex);
+    const auto now = mClock();
+    const std::chrono::seconds lifetime(lifetimeSec);
+    auto it = mInterfaces.find(ifName);
+    if (it != mInterfaces.end() && it->second.servers == servers) {
+        const Reported& reported = it->second;
+        const auto expiry = reported.reportedAt + reported.lifetime;
+        // A lifetime of 0 withdraws the servers, which always makes them expire earlier.
+        if (now + lifetime >= expiry && (expiry - now) * 2 >= reported.lifetime) {
+            return false;
+        }
+    }
+    mInterfaces[ifName] = {servers, now, lifetime};
+    return true;
+}
+
+void RdnssFilter::clear(const std::string& ifName) {
+    std::lock_guard lock(mMutex);
+    mInterfaces.erase(ifName);
+}
+
+void RdnssFilter::clearAll() {
+    std::lock_guard lock(mMutex);
+    mInterfaces.clear();
+}
+
+}  // namespace android::net
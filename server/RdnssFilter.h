@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Drops RDNSS updates that would not tell the listeners anything new. Routers that send RAs often
+// repeat the same servers with the same lifetime every few seconds. An update is reported if its
+// servers differ from the last ones reported for the interface, if it would make them expire
+// earlier than the listeners were told, or if less than half of the lifetime last reported
+// remains, so that the listeners refresh the servers well before they expire.
+class RdnssFilter {
+  public:
+    using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+    explicit RdnssFilter(Clock clock = std::chrono::steady_clock::now);
+
+    // Returns whether the servers an RA advertised on |ifName| should be reported.
+    bool shouldReport(const std::string& ifName, int64_t lifetimeSec,
+                      const std::vector<std::string>& servers);
+
+    // Forgets what was reported for |ifName|, e.g. because the interface was removed.
+    void clear(const std::string& ifName);
+
+    // Forgets what was reported for every interface, e.g. because a new listener was registered,
+    // which has not been told about any servers yet.
+    void clearAll();
+
+  private:
+    struct Reported {
+        std::vector<std::string> servers;
+        std::chrono::steady_clock::time_point reportedAt;
+        std::chrono::seconds lifetime;
+    };
+
+    const Clock mClock;
+
+    std::mutex mMutex;
+    std::map<std::string, Reported> mInterfaces GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
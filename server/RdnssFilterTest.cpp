@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "RdnssFilter.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class RdnssFilterTest : public ::testing::Test {
+  protected:
+    RdnssFilterTest() : mFilter([this] { return mNow; }) {}
+
+    const std::vector<std::string> kServers = {"2001:db8::1", "fe80::1%wlan0"};
+    std::chrono::steady_clock::time_point mNow;
+    RdnssFilter mFilter;
+};
+
+TEST_F(RdnssFilterTest, SuppressesRepeatedServers) {
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    EXPECT_FALSE(mFilter.shouldReport("wlan0", 600, kServers));
+    // Other interfaces are not affected.
+    EXPECT_TRUE(mFilter.shouldReport("wlan1", 600, kServers));
+
+    mNow += 300s;
+    EXPECT_FALSE(mFilter.shouldReport("wlan0", 600, kServers));
+    // Less than half of the lifetime reported is left.
+    mNow += 1s;
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    EXPECT_FALSE(mFilter.shouldReport("wlan0", 600, kServers));
+}
+
+TEST_F(RdnssFilterTest, ReportsChanges) {
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, {"2001:db8::1"}));
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+
+    // A longer lifetime is reported once enough of the last one has passed, a shorter one at once.
+    mNow += 10s;
+    EXPECT_FALSE(mFilter.shouldReport("wlan0", 1200, kServers));
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 60, kServers));
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 0, kServers));
+}
+
+TEST_F(RdnssFilterTest, Clear) {
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    mFilter.clear("wlan0");
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+}
+
+TEST_F(RdnssFilterTest, ClearAll) {
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    EXPECT_TRUE(mFilter.shouldReport("wlan1", 600, kServers));
+    mFilter.clearAll();
+    EXPECT_TRUE(mFilter.shouldReport("wlan0", 600, kServers));
+    EXPECT_TRUE(mFilter.shouldReport("wlan1", 600, kServers));
+}
+
+}  // namespace android::net
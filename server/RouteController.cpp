@@ -20,26 +20,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/fib_rules.h>
+#include <linux/nexthop.h>
 #include <net/if.h>
 #include <netdutils/InternetAddresses.h>
 #include <private/android_filesystem_config.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <thread>
+#include <tuple>
 
 #include "DummyNetwork.h"
 #include "Fwmark.h"
+#include "InterfaceRegistry.h"
 #include "NetdConstants.h"
+#include "NetdMetrics.h"
 #include "NetlinkCommands.h"
 #include "TcUtils.h"
 
 #include <android-base/file.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include "log/log.h"
 #include "netid_client.h"
 #include "netutils/ifc.h"
 
+using android::base::GetBoolProperty;
 using android::base::StartsWith;
 using android::base::StringPrintf;
 using android::base::WriteStringToFile;
@@ -49,6 +59,8 @@ namespace android::net {
 
 auto RouteController::iptablesRestoreCommandFunction = execIptablesRestoreCommand;
 auto RouteController::ifNameToIndexFunction = if_nametoindex;
+static bool useNexthopObjects();
+bool (*RouteController::useNexthopObjectsFunction)() = useNexthopObjects;
 // BEGIN CONSTANTS --------------------------------------------------------------------------------
 
 const uint32_t ROUTE_TABLE_LOCAL_NETWORK  = 97;
@@ -86,33 +98,21 @@ const bool MODIFY_NON_UID_BASED_RULES = true;
 
 const mode_t RT_TABLES_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;  // mode 0644, rw-r--r--
 
-// Avoids "non-constant-expression cannot be narrowed from type 'unsigned int' to 'unsigned short'"
-// warnings when using RTA_LENGTH(x) inside static initializers (even when x is already uint16_t).
-static constexpr uint16_t U16_RTA_LENGTH(uint16_t x) {
-    return RTA_LENGTH(x);
-}
-
-// These are practically const, but can't be declared so, because they are used to initialize
-// non-const pointers ("void* iov_base") in iovec arrays.
-rtattr FRATTR_PRIORITY  = { U16_RTA_LENGTH(sizeof(uint32_t)),           FRA_PRIORITY };
-rtattr FRATTR_TABLE     = { U16_RTA_LENGTH(sizeof(uint32_t)),           FRA_TABLE };
-rtattr FRATTR_FWMARK    = { U16_RTA_LENGTH(sizeof(uint32_t)),           FRA_FWMARK };
-rtattr FRATTR_FWMASK    = { U16_RTA_LENGTH(sizeof(uint32_t)),           FRA_FWMASK };
-rtattr FRATTR_UID_RANGE = { U16_RTA_LENGTH(sizeof(fib_rule_uid_range)), FRA_UID_RANGE };
-
-rtattr RTATTR_TABLE     = { U16_RTA_LENGTH(sizeof(uint32_t)),           RTA_TABLE };
-rtattr RTATTR_OIF       = { U16_RTA_LENGTH(sizeof(uint32_t)),           RTA_OIF };
-rtattr RTATTR_PRIO      = { U16_RTA_LENGTH(sizeof(uint32_t)),           RTA_PRIORITY };
-
-// One or more nested attributes in the RTA_METRICS attribute.
-rtattr RTATTRX_MTU      = { U16_RTA_LENGTH(sizeof(uint32_t)),           RTAX_MTU};
-constexpr size_t RTATTRX_MTU_SIZE = RTA_SPACE(sizeof(uint32_t));
-
-// The RTA_METRICS attribute itself.
-constexpr size_t RTATTR_METRICS_SIZE = RTATTRX_MTU_SIZE;
-rtattr RTATTR_METRICS   = { U16_RTA_LENGTH(RTATTR_METRICS_SIZE),         RTA_METRICS };
-
-uint8_t PADDING_BUFFER[RTA_ALIGNTO] = {0, 0, 0, 0};
+// Upper bounds on the size of the requests built by modifyIpRule() and modifyIpRoute().
+constexpr size_t RULE_REQUEST_CAPACITY =
+        NLMSG_ALIGN(sizeof(fib_rule_hdr)) +
+        4 * RTA_SPACE(sizeof(uint32_t)) +            // Priority, table, fwmark, mask.
+        RTA_SPACE(sizeof(fib_rule_uid_range)) +
+        2 * RTA_SPACE(IFNAMSIZ);                     // Input and output interface names.
+constexpr size_t ROUTE_REQUEST_CAPACITY =
+        NLMSG_ALIGN(sizeof(rtmsg)) +
+        3 * RTA_SPACE(sizeof(uint32_t)) +            // Table, output interface, priority.
+        2 * RTA_SPACE(sizeof(in6_addr)) +            // Destination and gateway.
+        RTA_SPACE(RTA_SPACE(sizeof(uint32_t)));      // Metrics containing the MTU.
+constexpr size_t NEXTHOP_REQUEST_CAPACITY =
+        NLMSG_ALIGN(sizeof(nhmsg)) +
+        2 * RTA_SPACE(sizeof(uint32_t)) +            // ID, output interface.
+        RTA_SPACE(sizeof(in6_addr));                 // Gateway.
 
 constexpr bool EXPLICIT = true;
 constexpr bool IMPLICIT = false;
@@ -142,6 +142,39 @@ static uint32_t getRouteTableIndexFromGlobalRouteTableIndex(uint32_t index, bool
     return local ? index + localTableOffset : index;
 }
 
+std::shared_ptr<const RouteController::InterfaceToTableMap>
+RouteController::interfaceToTableSnapshot() {
+    return std::atomic_load(&sInterfaceToTable);
+}
+
+uint32_t RouteController::findInterfaceTable(const InterfaceToTableMap& map, InterfaceId id,
+                                             const char* interface) {
+    if (id >= map.size() || map[id].name != interface) return RT_TABLE_UNSPEC;
+    return map[id].table;
+}
+
+// Caller must hold sInterfaceToTableLock.
+void RouteController::setInterfaceTableLocked(const char* interface, uint32_t table) {
+    // The map holds a reference to the name of every interface that has a table.
+    const InterfaceId id = InterfaceRegistry::intern(interface);
+    auto map = std::make_shared<InterfaceToTableMap>(*interfaceToTableSnapshot());
+    if (map->size() <= id) map->resize(id + 1);
+    if ((*map)[id].table != RT_TABLE_UNSPEC) InterfaceRegistry::release(id);
+    (*map)[id] = {table, interface};
+    std::atomic_store(&sInterfaceToTable, std::shared_ptr<const InterfaceToTableMap>(map));
+}
+
+// Caller must hold sInterfaceToTableLock.
+void RouteController::eraseInterfaceTableLocked(const char* interface) {
+    std::shared_ptr<const InterfaceToTableMap> current = interfaceToTableSnapshot();
+    const InterfaceId id = InterfaceRegistry::find(interface);
+    if (findInterfaceTable(*current, id, interface) == RT_TABLE_UNSPEC) return;
+    auto map = std::make_shared<InterfaceToTableMap>(*current);
+    (*map)[id] = {};
+    std::atomic_store(&sInterfaceToTable, std::shared_ptr<const InterfaceToTableMap>(map));
+    InterfaceRegistry::release(id);
+}
+
 // Caller must hold sInterfaceToTableLock.
 uint32_t RouteController::getRouteTableForInterfaceLocked(const char* interface, bool local) {
     // If we already know the routing table for this interface name, use it.
@@ -156,9 +189,10 @@ uint32_t RouteController::getRouteTableForInterfaceLocked(const char* interface,
     //
     // sInterfaceToTable stores the *global* routing table for the interface, and the local table is
     // "global table - ROUTE_TABLE_OFFSET_FROM_INDEX + ROUTE_TABLE_OFFSET_FROM_INDEX_FOR_LOCAL"
-    auto iter = sInterfaceToTable.find(interface);
-    if (iter != sInterfaceToTable.end()) {
-        return getRouteTableIndexFromGlobalRouteTableIndex(iter->second, local);
+    const InterfaceId id = InterfaceRegistry::find(interface);
+    const uint32_t known = findInterfaceTable(*interfaceToTableSnapshot(), id, interface);
+    if (known != RT_TABLE_UNSPEC) {
+        return getRouteTableIndexFromGlobalRouteTableIndex(known, local);
     }
 
     uint32_t index = RouteController::ifNameToIndexFunction(interface);
@@ -167,15 +201,14 @@ uint32_t RouteController::getRouteTableForInterfaceLocked(const char* interface,
         return RT_TABLE_UNSPEC;
     }
     index += RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX;
-    sInterfaceToTable[interface] = index;
+    setInterfaceTableLocked(interface, index);
     return getRouteTableIndexFromGlobalRouteTableIndex(index, local);
 }
 
 uint32_t RouteController::getIfIndex(const char* interface) {
-    std::lock_guard lock(sInterfaceToTableLock);
-
-    auto iter = sInterfaceToTable.find(interface);
-    if (iter == sInterfaceToTable.end()) {
+    const InterfaceId id = InterfaceRegistry::find(interface);
+    const uint32_t table = findInterfaceTable(*interfaceToTableSnapshot(), id, interface);
+    if (table == RT_TABLE_UNSPEC) {
         ALOGE("getIfIndex: cannot find interface %s", interface);
         return 0;
     }
@@ -185,15 +218,21 @@ uint32_t RouteController::getIfIndex(const char* interface) {
     // way to know the interface index from this table. Return 0 here so callers of this method do
     // not get confused.
     // TODO: stop calling this method from any caller that only wants interfaces in client mode.
-    int ifindex = iter->second;
-    if (ifindex == ROUTE_TABLE_LOCAL_NETWORK) {
+    if (table == ROUTE_TABLE_LOCAL_NETWORK) {
         return 0;
     }
 
-    return ifindex - ROUTE_TABLE_OFFSET_FROM_INDEX;
+    return table - ROUTE_TABLE_OFFSET_FROM_INDEX;
 }
 
 uint32_t RouteController::getRouteTableForInterface(const char* interface, bool local) {
+    // Interfaces are only added to the map once, so lookups almost never need the lock.
+    const InterfaceId id = InterfaceRegistry::find(interface);
+    const uint32_t known = findInterfaceTable(*interfaceToTableSnapshot(), id, interface);
+    if (known != RT_TABLE_UNSPEC) {
+        return getRouteTableIndexFromGlobalRouteTableIndex(known, local);
+    }
+
     std::lock_guard lock(sInterfaceToTableLock);
     return getRouteTableForInterfaceLocked(interface, local);
 }
@@ -208,7 +247,7 @@ void addTableName(uint32_t table, const std::string& name, std::string* contents
 }
 
 // Doesn't return success/failure as the file is optional; it's okay if we fail to update it.
-void RouteController::updateTableNamesFile() {
+void RouteController::writeTableNamesFile() {
     std::string contents;
 
     addTableName(RT_TABLE_LOCAL, ROUTE_TABLE_NAME_LOCAL, &contents);
@@ -218,8 +257,9 @@ void RouteController::updateTableNamesFile() {
     addTableName(ROUTE_TABLE_LEGACY_NETWORK, ROUTE_TABLE_NAME_LEGACY_NETWORK, &contents);
     addTableName(ROUTE_TABLE_LEGACY_SYSTEM,  ROUTE_TABLE_NAME_LEGACY_SYSTEM,  &contents);
 
-    std::lock_guard lock(sInterfaceToTableLock);
-    for (const auto& [ifName, ifIndex] : sInterfaceToTable) {
+    std::shared_ptr<const InterfaceToTableMap> interfaceToTable = interfaceToTableSnapshot();
+    for (const auto& [ifIndex, ifName] : *interfaceToTable) {
+        if (ifIndex == RT_TABLE_UNSPEC) continue;
         addTableName(ifIndex, ifName, &contents);
         // Add table for the local route of the network. It's expected to be used for excluding the
         // local traffic in the VPN network.
@@ -234,22 +274,437 @@ void RouteController::updateTableNamesFile() {
     }
 }
 
-// Returns 0 on success or negative errno on failure.
-int padInterfaceName(const char* input, char* name, size_t* length, uint16_t* padding) {
+namespace {
+
+// Rule and route requests made, whether sent on their own or in a batch, counting each address
+// family of a rule separately.
+NetdMetrics::Counter sRuleChanges("route.rule_changes");
+NetdMetrics::Counter sRouteChanges("route.route_changes");
+
+// Rewrites the rt_tables file on a background thread, so that adding an interface does not wait
+// for file I/O. Requests made while a write is in progress are coalesced into a single write of the
+// latest state, which is all that matters since the file is rewritten from scratch every time.
+class TableNamesFileWriter {
+  public:
+    explicit TableNamesFileWriter(void (*write)()) : mWrite(write) {}
+
+    void requestWrite() EXCLUDES(mLock) {
+        std::lock_guard lock(mLock);
+        if (!mThreadStarted) {
+            std::thread(&TableNamesFileWriter::run, this).detach();
+            mThreadStarted = true;
+        }
+        ++mRequested;
+        mCv.notify_all();
+    }
+
+    // Waits until every write requested so far has been done.
+    void waitForWrites() EXCLUDES(mLock) {
+        std::unique_lock lock(mLock);
+        const uint64_t requested = mRequested;
+        mCv.wait(lock, [this, requested]() REQUIRES(mLock) { return mWritten >= requested; });
+    }
+
+  private:
+    // Writes the file once for all the requests made since the last write. The lock is only held
+    // to read and update the counters, never while writing.
+    void run() EXCLUDES(mLock) {
+        while (true) {
+            uint64_t requested;
+            {
+                std::unique_lock lock(mLock);
+                mCv.wait(lock, [this]() REQUIRES(mLock) { return mWritten != mRequested; });
+                requested = mRequested;
+            }
+            mWrite();
+            {
+                std::lock_guard lock(mLock);
+                mWritten = requested;
+                mCv.notify_all();
+            }
+        }
+    }
+
+    void (*const mWrite)();
+    std::mutex mLock;
+    std::condition_variable mCv;
+    bool mThreadStarted GUARDED_BY(mLock) = false;
+    uint64_t mRequested GUARDED_BY(mLock) = 0;
+    uint64_t mWritten GUARDED_BY(mLock) = 0;
+};
+
+// Never destroyed, because the writer thread is never stopped.
+TableNamesFileWriter& tableNamesFileWriter(void (*write)()) {
+    static TableNamesFileWriter* sWriter = new TableNamesFileWriter(write);
+    return *sWriter;
+}
+
+}  // namespace
+
+void RouteController::updateTableNamesFile() {
+    tableNamesFileWriter(writeTableNamesFile).requestWrite();
+}
+
+void RouteController::waitForTableNamesFile() {
+    tableNamesFileWriter(writeTableNamesFile).waitForWrites();
+}
+
+// Sets |length| to the length of |input| including the terminating NULL, or to 0 if |input| is
+// null. Returns 0 on success or negative errno on failure.
+static int getInterfaceNameLength(const char* input, size_t* length) {
     if (!input) {
         *length = 0;
-        *padding = 0;
         return 0;
     }
-    *length = strlcpy(name, input, IFNAMSIZ) + 1;
+    *length = strnlen(input, IFNAMSIZ) + 1;
     if (*length > IFNAMSIZ) {
         ALOGE("interface name too long (%zu > %u)", *length, IFNAMSIZ);
         return -ENAMETOOLONG;
     }
-    *padding = RTA_SPACE(*length) - RTA_LENGTH(*length);
     return 0;
 }
 
+static void logRuleError(uint16_t action, uint8_t family, int32_t priority, int ret) {
+    if (!(action == RTM_DELRULE && ret == -ENOENT && priority == RULE_PRIORITY_TETHERING)) {
+        // Don't log when deleting a tethering rule that's not there. This matches the
+        // behaviour of clearTetheringRules, which ignores ENOENT in this case.
+        ALOGE("Error %s %s rule: %s", actionName(action), familyName(family), strerror(-ret));
+    }
+}
+
+namespace {
+
+// The fields that identify an IP rule, as far as the rules created by this file are concerned.
+// Kernel-maintained flags such as FIB_RULE_IIF_DETACHED are deliberately ignored.
+struct RuleKey {
+    uint8_t family = AF_UNSPEC;
+    uint8_t action = FR_ACT_UNSPEC;
+    uint32_t priority = 0;
+    uint32_t table = RT_TABLE_UNSPEC;
+    uint32_t fwmark = 0;
+    uint32_t fwmask = 0;
+    // The kernel reports no UID range for rules that match all UIDs.
+    uint32_t uidStart = 0;
+    uint32_t uidEnd = UINT32_MAX;
+    std::string iif;
+    std::string oif;
+
+    bool operator<(const RuleKey& other) const {
+        return std::tie(family, action, priority, table, fwmark, fwmask, uidStart, uidEnd, iif,
+                        oif) < std::tie(other.family, other.action, other.priority, other.table,
+                                        other.fwmark, other.fwmask, other.uidStart, other.uidEnd,
+                                        other.iif, other.oif);
+    }
+};
+
+// Parses an RTM_NEWRULE message, either one built by modifyIpRule() or one dumped by the kernel.
+RuleKey getRuleKey(const nlmsghdr* nlh) {
+    RuleKey key;
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(fib_rule_hdr))) return key;
+
+    const fib_rule_hdr* rule = reinterpret_cast<const fib_rule_hdr*>(NLMSG_DATA(nlh));
+    key.family = rule->family;
+    key.action = rule->action;
+    key.table = rule->table;
+
+    const auto u32 = [](const rtattr* rta) {
+        uint32_t value = 0;
+        memcpy(&value, RTA_DATA(rta), std::min(sizeof(value), size_t{RTA_PAYLOAD(rta)}));
+        return value;
+    };
+    const auto str = [](const rtattr* rta) {
+        const char* name = reinterpret_cast<const char*>(RTA_DATA(rta));
+        return std::string(name, strnlen(name, RTA_PAYLOAD(rta)));
+    };
+
+    int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*rule));
+    for (const rtattr* rta = reinterpret_cast<const rtattr*>(
+                 reinterpret_cast<const uint8_t*>(rule) + NLMSG_ALIGN(sizeof(*rule)));
+         RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case FRA_PRIORITY: key.priority = u32(rta); break;
+            case FRA_TABLE: key.table = u32(rta); break;
+            case FRA_FWMARK: key.fwmark = u32(rta); break;
+            case FRA_FWMASK: key.fwmask = u32(rta); break;
+            case FRA_IIFNAME: key.iif = str(rta); break;
+            case FRA_OIFNAME: key.oif = str(rta); break;
+            case FRA_UID_RANGE:
+                if (RTA_PAYLOAD(rta) >= sizeof(fib_rule_uid_range)) {
+                    fib_rule_uid_range range;
+                    memcpy(&range, RTA_DATA(rta), sizeof(range));
+                    key.uidStart = range.start;
+                    key.uidEnd = range.end;
+                }
+                break;
+        }
+    }
+    return key;
+}
+
+// While in scope, modifyIpRule() calls made on this thread queue their requests instead of sending
+// them, and commit() sends them all in a few netlink round trips. This is used when modifying the
+// rules for every UID range of a network, which may be thousands of rules for a VPN.
+//
+// Argument errors are still returned by modifyIpRule(), but errors reported by the kernel are only
+// returned by commit(). If the batch goes out of scope without commit(), for example because a
+// caller returned early, the queued requests are still sent, as they would have been without the
+// batch.
+//
+// A batch created with |joinable| set absorbs the batches created on this thread while it is
+// current: their requests are queued in it instead, and their commit() only returns argument
+// errors. This is how RouteController::beginRuleTransaction() spans several operations.
+class ScopedRuleBatch {
+  public:
+    explicit ScopedRuleBatch(bool joinable = false)
+        : mPrevious(sCurrent), mJoined(sCurrent && sCurrent->mJoinable), mJoinable(joinable) {
+        if (!mJoined) sCurrent = this;
+    }
+    ~ScopedRuleBatch() {
+        if (!mCommitted) (void)commit();
+    }
+
+    ScopedRuleBatch(const ScopedRuleBatch&) = delete;
+    ScopedRuleBatch& operator=(const ScopedRuleBatch&) = delete;
+
+    static ScopedRuleBatch* current() { return sCurrent; }
+
+    void addRequest(uint16_t action, uint16_t flags, uint8_t family, int32_t priority,
+                    const iovec* iov, int iovlen) {
+        mBatch.addRequest(action, flags, iov, iovlen);
+        mRules.push_back({action, family, priority});
+    }
+
+    // Sends the queued requests. Returns 0 if all of them succeeded, or the first error.
+    [[nodiscard]] int commit() {
+        mCommitted = true;
+        if (mJoined) return 0;
+        sCurrent = mPrevious;
+        const int ret = mBatch.send();
+        if (ret) {
+            for (size_t i = 0; i < mRules.size(); ++i) {
+                if (int err = mBatch.result(i)) {
+                    logRuleError(mRules[i].action, mRules[i].family, mRules[i].priority, err);
+                }
+            }
+        }
+        mRules.clear();
+        return ret;
+    }
+
+    // Instead of sending the queued requests, which must all be RTM_NEWRULE, makes the kernel's
+    // rules that match |shouldManage| the same as the queued rules: rules that already exist are
+    // left alone, missing rules are added, and all other managed rules are deleted. Rules are
+    // added before stale rules are deleted, so there is no window in which neither is present.
+    // Returns 0 on success or the first error.
+    [[nodiscard]] int reconcile(const NetlinkDumpFilter& shouldManage) {
+        mCommitted = true;
+        sCurrent = mPrevious;
+
+        std::multimap<RuleKey, size_t> missing;
+        for (size_t i = 0; i < mBatch.size(); ++i) {
+            missing.emplace(getRuleKey(mBatch.request(i)), i);
+        }
+
+        // Copies of the stale rules, which are deleted by sending them back as RTM_DELRULE.
+        std::vector<std::vector<uint8_t>> stale;
+        NetlinkDumpCallback callback = [&](nlmsghdr* nlh) {
+            if (!shouldManage(nlh)) return;
+            auto iter = missing.find(getRuleKey(nlh));
+            if (iter != missing.end()) {
+                missing.erase(iter);
+                return;
+            }
+            const uint8_t* payload = reinterpret_cast<const uint8_t*>(NLMSG_DATA(nlh));
+            stale.emplace_back(payload, payload + (nlh->nlmsg_len - NLMSG_HDRLEN));
+        };
+
+        for (const uint8_t family : AF_FAMILIES) {
+            rtmsg rule = {.rtm_family = family};
+            iovec iov[] = {
+                    {nullptr, 0},
+                    {&rule, sizeof(rule)},
+            };
+            if (int ret = sendNetlinkRequest(RTM_GETRULE, NETLINK_DUMP_FLAGS, iov, ARRAY_SIZE(iov),
+                                             &callback)) {
+                ALOGE("Error dumping %s rules: %s", familyName(family), strerror(-ret));
+                mBatch.clear();
+                mRules.clear();
+                return ret;
+            }
+        }
+
+        std::vector<size_t> toAdd;
+        for (const auto& [key, i] : missing) {
+            toAdd.push_back(i);
+        }
+        std::sort(toAdd.begin(), toAdd.end());
+
+        NetlinkBatch changes;
+        std::vector<Rule> rules;
+        for (size_t i : toAdd) {
+            const nlmsghdr* nlh = mBatch.request(i);
+            iovec iov[] = {
+                    {nullptr, 0},
+                    {NLMSG_DATA(nlh), nlh->nlmsg_len - NLMSG_HDRLEN},
+            };
+            changes.addRequest(nlh->nlmsg_type, nlh->nlmsg_flags, iov, ARRAY_SIZE(iov));
+            rules.push_back(mRules[i]);
+        }
+        for (std::vector<uint8_t>& rule : stale) {
+            iovec iov[] = {
+                    {nullptr, 0},
+                    {rule.data(), rule.size()},
+            };
+            changes.addRequest(RTM_DELRULE, NETLINK_REQUEST_FLAGS, iov, ARRAY_SIZE(iov));
+        }
+        const size_t unchanged = mBatch.size() - toAdd.size();
+        mBatch.clear();
+        mRules.clear();
+
+        const size_t numChanges = changes.size();
+        (void)changes.send();
+        int ret = 0;
+        for (size_t i = 0; i < numChanges; ++i) {
+            const int err = changes.result(i);
+            if (!err) continue;
+            if (i < rules.size()) {
+                logRuleError(rules[i].action, rules[i].family, rules[i].priority, err);
+            } else if (err == -ENOENT) {
+                // As in rtNetlinkFlush, something else may have deleted the rule since the dump.
+                continue;
+            } else {
+                ALOGW("Error deleting stale rule: %s", strerror(-err));
+            }
+            if (!ret) ret = err;
+        }
+        ALOGI("Reconciled rules: %zu added, %zu deleted, %zu unchanged", toAdd.size(),
+              stale.size(), unchanged);
+        return ret;
+    }
+
+  private:
+    struct Rule {
+        uint16_t action;
+        uint8_t family;
+        int32_t priority;
+    };
+
+    static thread_local ScopedRuleBatch* sCurrent;
+
+    ScopedRuleBatch* const mPrevious;
+    const bool mJoined;
+    const bool mJoinable;
+    NetlinkBatch mBatch;
+    std::vector<Rule> mRules;
+    bool mCommitted = false;
+};
+
+thread_local ScopedRuleBatch* ScopedRuleBatch::sCurrent = nullptr;
+
+// The batch opened by RouteController::beginRuleTransaction() on this thread, if any.
+thread_local std::unique_ptr<ScopedRuleBatch> sRuleTransaction;
+
+// While in scope, modifyIpRoute() calls made on this thread don't wait for the kernel's ACK, and
+// return 0 as soon as the request has been sent. Since the kernel applies a request while it is
+// being sent, ordering is unaffected; errors reported by the kernel are only logged, except EEXIST
+// when adding a route, which modifyRoute() ignores anyway. Only use this for routes whose failure
+// the caller would not act on.
+class ScopedAsyncRouteAcks {
+  public:
+    ScopedAsyncRouteAcks() : mWasActive(sActive) { sActive = true; }
+    ~ScopedAsyncRouteAcks() { sActive = mWasActive; }
+
+    ScopedAsyncRouteAcks(const ScopedAsyncRouteAcks&) = delete;
+    ScopedAsyncRouteAcks& operator=(const ScopedAsyncRouteAcks&) = delete;
+
+    static bool active() { return sActive; }
+
+  private:
+    static thread_local bool sActive;
+    const bool mWasActive;
+};
+
+thread_local bool ScopedAsyncRouteAcks::sActive = false;
+
+// While in scope, modifyIpRoute() calls made on this thread queue their request instead of sending
+// it, and return 0. The requests are sent by send(), and are discarded if it is not called. Routes
+// that use nexthop objects are still sent immediately, so that a stale nexthop can be recreated.
+class ScopedRouteBatch {
+  public:
+    ScopedRouteBatch() : mPrevious(sCurrent) { sCurrent = this; }
+    ~ScopedRouteBatch() { sCurrent = mPrevious; }
+
+    ScopedRouteBatch(const ScopedRouteBatch&) = delete;
+    ScopedRouteBatch& operator=(const ScopedRouteBatch&) = delete;
+
+    static NetlinkBatch* current() { return sCurrent ? &sCurrent->mBatch : nullptr; }
+
+    [[nodiscard]] int send() { return mBatch.send(); }
+
+    // As send(), but ignores routes that already exist, as modifyRoute() does, and stores the
+    // index of the first request that failed in |*failed|. The kernel keeps processing the requests
+    // after a failed one, so those that succeeded are undone, as if the batch had stopped at the
+    // failure: added routes are deleted, and deleted routes are added back with the attributes of
+    // their request. If they cannot all be undone, |*failed| is the number of requests instead.
+    [[nodiscard]] int send(size_t* failed) {
+        // send() clears the queue, so keep what is needed to undo each request.
+        struct Request {
+            bool isAdd;
+            std::vector<uint8_t> payload;
+        };
+        std::vector<Request> requests(mBatch.size());
+        for (size_t i = 0; i < requests.size(); ++i) {
+            const nlmsghdr* nlh = mBatch.request(i);
+            const uint8_t* payload = reinterpret_cast<const uint8_t*>(NLMSG_DATA(nlh));
+            requests[i].isAdd = nlh->nlmsg_type == RTM_NEWROUTE;
+            requests[i].payload.assign(payload, payload + (nlh->nlmsg_len - NLMSG_HDRLEN));
+        }
+        if (mBatch.send() == 0) return 0;
+
+        size_t first = 0;
+        int ret = 0;
+        for (; first < requests.size(); ++first) {
+            ret = mBatch.result(first);
+            if (requests[first].isAdd && ret == -EEXIST) ret = 0;
+            if (ret) break;
+        }
+        if (!ret) return 0;
+        *failed = first;
+
+        NetlinkBatch undo;
+        for (size_t i = first + 1; i < requests.size(); ++i) {
+            if (mBatch.result(i)) continue;
+            iovec iov[] = {
+                    {nullptr, 0},
+                    {requests[i].payload.data(), requests[i].payload.size()},
+            };
+            if (requests[i].isAdd) {
+                undo.addRequest(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, iov, ARRAY_SIZE(iov));
+            } else {
+                undo.addRequest(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, iov, ARRAY_SIZE(iov));
+            }
+        }
+        if (undo.send()) {
+            ALOGE("Failed to undo the route changes after failed change %zu of %zu", first,
+                  requests.size());
+            *failed = requests.size();
+        }
+        return ret;
+    }
+
+  private:
+    static thread_local ScopedRouteBatch* sCurrent;
+    ScopedRouteBatch* const mPrevious;
+    NetlinkBatch mBatch;
+};
+
+thread_local ScopedRouteBatch* ScopedRouteBatch::sCurrent = nullptr;
+
+// The batch opened by RouteController::beginRouteBatch() on this thread, if any.
+thread_local std::unique_ptr<ScopedRouteBatch> sRouteBatch;
+
+}  // namespace
+
 // Adds or removes a routing rule for IPv4 and IPv6.
 //
 // + If |table| is non-zero, the rule points at the specified routing table. Otherwise, the table is
@@ -279,13 +734,11 @@ int padInterfaceName(const char* input, char* name, size_t* length, uint16_t* pa
 
     // Interface names must include exactly one terminating NULL and be properly padded, or older
     // kernels will refuse to delete rules.
-    char iifName[IFNAMSIZ], oifName[IFNAMSIZ];
     size_t iifLength, oifLength;
-    uint16_t iifPadding, oifPadding;
-    if (int ret = padInterfaceName(iif, iifName, &iifLength, &iifPadding)) {
+    if (int ret = getInterfaceNameLength(iif, &iifLength)) {
         return ret;
     }
-    if (int ret = padInterfaceName(oif, oifName, &oifLength, &oifPadding)) {
+    if (int ret = getInterfaceNameLength(oif, &oifLength)) {
         return ret;
     }
 
@@ -297,56 +750,56 @@ int padInterfaceName(const char* input, char* name, size_t* length, uint16_t* pa
 
     bool isUidRule = (uidStart != INVALID_UID);
 
-    // Assemble a rule request and put it in an array of iovec structures.
-    fib_rule_hdr rule = {
-        .action = ruleType,
-        // Note that here we're implicitly setting rule.table to 0. When we want to specify a
-        // non-zero table, we do this via the FRATTR_TABLE attribute.
-    };
-
     // Don't ever create a rule that looks up table 0, because table 0 is the local table.
     // It's OK to specify a table ID of 0 when deleting a rule, because that doesn't actually select
     // table 0, it's a wildcard that matches anything.
-    if (table == RT_TABLE_UNSPEC && rule.action == FR_ACT_TO_TBL && action != RTM_DELRULE) {
+    if (table == RT_TABLE_UNSPEC && ruleType == FR_ACT_TO_TBL && action != RTM_DELRULE) {
         ALOGE("RT_TABLE_UNSPEC only allowed when deleting rules");
         return -ENOTUNIQ;
     }
 
-    rtattr fraIifName = { U16_RTA_LENGTH(iifLength), FRA_IIFNAME };
-    rtattr fraOifName = { U16_RTA_LENGTH(oifLength), FRA_OIFNAME };
-    struct fib_rule_uid_range uidRange = { uidStart, uidEnd };
+    // Assemble the rule request once; only the family differs between IPv4 and IPv6.
+    // Note that here we're implicitly setting rule.table to 0. When we want to specify a non-zero
+    // table, we do this via the FRA_TABLE attribute.
+    NetlinkRequestBuffer<fib_rule_hdr, RULE_REQUEST_CAPACITY> request({.action = ruleType});
+    request.addAttribute(FRA_PRIORITY, priority);
+    if (table != RT_TABLE_UNSPEC) {
+        request.addAttribute(FRA_TABLE, table);
+    }
+    if (mask) {
+        request.addAttribute(FRA_FWMARK, fwmark);
+        request.addAttribute(FRA_FWMASK, mask);
+    }
+    if (isUidRule) {
+        request.addAttribute(FRA_UID_RANGE, fib_rule_uid_range{uidStart, uidEnd});
+    }
+    if (iif != IIF_NONE) {
+        request.addAttribute(FRA_IIFNAME, iif, iifLength);
+    }
+    if (oif != OIF_NONE) {
+        request.addAttribute(FRA_OIFNAME, oif, oifLength);
+    }
+    if (request.overflowed()) {
+        ALOGE("impossible! rule request too long");
+        return -ENOBUFS;
+    }
 
     iovec iov[] = {
-        { nullptr,              0 },
-        { &rule,             sizeof(rule) },
-        { &FRATTR_PRIORITY,  sizeof(FRATTR_PRIORITY) },
-        { &priority,         sizeof(priority) },
-        { &FRATTR_TABLE,     table != RT_TABLE_UNSPEC ? sizeof(FRATTR_TABLE) : 0 },
-        { &table,            table != RT_TABLE_UNSPEC ? sizeof(table) : 0 },
-        { &FRATTR_FWMARK,    mask ? sizeof(FRATTR_FWMARK) : 0 },
-        { &fwmark,           mask ? sizeof(fwmark) : 0 },
-        { &FRATTR_FWMASK,    mask ? sizeof(FRATTR_FWMASK) : 0 },
-        { &mask,             mask ? sizeof(mask) : 0 },
-        { &FRATTR_UID_RANGE, isUidRule ? sizeof(FRATTR_UID_RANGE) : 0 },
-        { &uidRange,         isUidRule ? sizeof(uidRange) : 0 },
-        { &fraIifName,       iif != IIF_NONE ? sizeof(fraIifName) : 0 },
-        { iifName,           iifLength },
-        { PADDING_BUFFER,    iifPadding },
-        { &fraOifName,       oif != OIF_NONE ? sizeof(fraOifName) : 0 },
-        { oifName,           oifLength },
-        { PADDING_BUFFER,    oifPadding },
+        { nullptr, 0 },
+        request.iov(),
     };
 
     uint16_t flags = (action == RTM_NEWRULE) ? NETLINK_RULE_CREATE_FLAGS : NETLINK_REQUEST_FLAGS;
+    sRuleChanges.inc(ARRAY_SIZE(AF_FAMILIES));
     for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
-        rule.family = AF_FAMILIES[i];
+        const uint8_t family = AF_FAMILIES[i];
+        request.header()->family = family;
+        if (ScopedRuleBatch* batch = ScopedRuleBatch::current()) {
+            batch->addRequest(action, flags, family, priority, iov, ARRAY_SIZE(iov));
+            continue;
+        }
         if (int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov), nullptr)) {
-            if (!(action == RTM_DELRULE && ret == -ENOENT && priority == RULE_PRIORITY_TETHERING)) {
-                // Don't log when deleting a tethering rule that's not there. This matches the
-                // behaviour of clearTetheringRules, which ignores ENOENT in this case.
-                ALOGE("Error %s %s rule: %s", actionName(action), familyName(rule.family),
-                      strerror(-ret));
-            }
+            logRuleError(action, family, priority, ret);
             return ret;
         }
     }
@@ -367,6 +820,151 @@ int padInterfaceName(const char* input, char* name, size_t* length, uint16_t* pa
                         INVALID_UID);
 }
 
+bool kernelSupportsNexthopObjects() {
+    nhmsg nhm = {.nh_family = AF_UNSPEC};
+    iovec iov[] = {
+            {nullptr, 0},
+            {&nhm, sizeof(nhm)},
+    };
+    NetlinkDumpCallback ignore = [](nlmsghdr*) {};
+    return sendNetlinkRequest(RTM_GETNEXTHOP, NETLINK_DUMP_FLAGS, iov, ARRAY_SIZE(iov), &ignore) ==
+           0;
+}
+
+static bool useNexthopObjects() {
+    static const bool sEnabled = GetBoolProperty("persist.netd.nexthop_objects", false) &&
+                                 kernelSupportsNexthopObjects();
+    return sEnabled;
+}
+
+namespace {
+
+// Routes via a gateway that are in the same table and go out of the same interface.
+struct NexthopKey {
+    uint32_t table;
+    uint8_t family;
+    uint32_t ifindex;
+    std::string gateway;  // Raw address.
+
+    bool operator<(const NexthopKey& other) const {
+        return std::tie(table, family, ifindex, gateway) <
+               std::tie(other.table, other.family, other.ifindex, other.gateway);
+    }
+};
+
+// The kernel nexthop objects (RTM_NEWNEXTHOP, Linux 5.3+) that routes created by modifyIpRoute()
+// refer to. Every route via the same gateway shares one object, so the gateway can be changed for
+// all of them in one message. Objects are never shared between tables, because deleting an object
+// also deletes every route that uses it, and tables are flushed independently.
+class NexthopRegistry {
+  public:
+    // Returns the ID of the object for |key|, creating it if needed, or 0 if it can't be created.
+    uint32_t acquire(const NexthopKey& key) {
+        std::lock_guard lock(mLock);
+        if (auto iter = mIds.find(key); iter != mIds.end()) {
+            return iter->second;
+        }
+        // IDs are global, and other processes may have created objects too. Skip IDs in use.
+        for (int attempts = 0; attempts < kMaxCreateAttempts; attempts++) {
+            const uint32_t id = mNextId++;
+            if (mNextId == 0) mNextId = kFirstId;
+            const int ret = sendNexthop(RTM_NEWNEXTHOP, NETLINK_ROUTE_CREATE_FLAGS, id, &key);
+            if (ret == 0) {
+                mIds[key] = id;
+                return id;
+            }
+            if (ret != -EEXIST) {
+                ALOGE("Error creating nexthop object %u: %s", id, strerror(-ret));
+                return 0;
+            }
+        }
+        return 0;
+    }
+
+    // Returns the ID of the object for |key|, or 0 if there is none.
+    uint32_t find(const NexthopKey& key) {
+        std::lock_guard lock(mLock);
+        auto iter = mIds.find(key);
+        return (iter != mIds.end()) ? iter->second : 0;
+    }
+
+    // Forgets the object for |key|, e.g. because the kernel deleted it when its interface went away.
+    void forget(const NexthopKey& key) {
+        std::lock_guard lock(mLock);
+        mIds.erase(key);
+    }
+
+    // Makes the object for |key| use |gateway| instead, which updates all routes that use it.
+    int replaceGateway(const NexthopKey& key, const std::string& gateway) {
+        std::lock_guard lock(mLock);
+        auto iter = mIds.find(key);
+        if (iter == mIds.end()) {
+            return -ENOENT;
+        }
+        NexthopKey newKey = key;
+        newKey.gateway = gateway;
+        if (mIds.count(newKey)) {
+            return -EEXIST;
+        }
+        const uint32_t id = iter->second;
+        if (int ret = sendNexthop(RTM_NEWNEXTHOP, NETLINK_ROUTE_REPLACE_FLAGS, id, &newKey)) {
+            return ret;
+        }
+        mIds.erase(iter);
+        mIds[newKey] = id;
+        return 0;
+    }
+
+    // Deletes the objects used by |table|. Must only be called once its routes are gone.
+    void releaseTable(uint32_t table) {
+        std::lock_guard lock(mLock);
+        for (auto iter = mIds.begin(); iter != mIds.end();) {
+            if (iter->first.table != table) {
+                ++iter;
+                continue;
+            }
+            const int ret = sendNexthop(RTM_DELNEXTHOP, NETLINK_REQUEST_FLAGS, iter->second, nullptr);
+            if (ret && ret != -ENOENT) {
+                ALOGW("Error deleting nexthop object %u: %s", iter->second, strerror(-ret));
+            }
+            iter = mIds.erase(iter);
+        }
+    }
+
+  private:
+    // Far from the small IDs that tools such as ip(8) pick by default.
+    static constexpr uint32_t kFirstId = 0x6e640000;
+    static constexpr int kMaxCreateAttempts = 16;
+
+    static int sendNexthop(uint16_t action, uint16_t flags, uint32_t id, const NexthopKey* key) {
+        NetlinkRequestBuffer<nhmsg, NEXTHOP_REQUEST_CAPACITY> request({
+                .nh_family = key ? key->family : static_cast<uint8_t>(AF_UNSPEC),
+                .nh_protocol = RTPROT_STATIC,
+        });
+        request.addAttribute(NHA_ID, id);
+        if (key) {
+            request.addAttribute(NHA_OIF, key->ifindex);
+            request.addAttribute(NHA_GATEWAY, key->gateway.data(), key->gateway.size());
+        }
+        iovec iov[] = {
+                {nullptr, 0},
+                request.iov(),
+        };
+        return sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov), nullptr);
+    }
+
+    std::mutex mLock;
+    std::map<NexthopKey, uint32_t> mIds GUARDED_BY(mLock);
+    uint32_t mNextId GUARDED_BY(mLock) = kFirstId;
+};
+
+NexthopRegistry& nexthopRegistry() {
+    static NexthopRegistry* sRegistry = new NexthopRegistry();
+    return *sRegistry;
+}
+
+}  // namespace
+
 // Adds or deletes an IPv4 or IPv6 route.
 // Returns 0 on success or negative errno on failure.
 int modifyIpRoute(uint16_t action, uint16_t flags, uint32_t table, const char* interface,
@@ -426,34 +1024,59 @@ int modifyIpRoute(uint16_t action, uint16_t flags, uint32_t table, const char* i
         }
     }
 
-    // Assemble a rtmsg and put it in an array of iovec structures.
-    rtmsg route = {
+    // With nexthop objects, a route via a gateway refers to an object shared by all routes in the
+    // table with the same gateway and interface, instead of carrying the gateway itself.
+    NexthopKey nexthopKey;
+    uint32_t nexthopId = 0;
+    if (type == RTN_UNICAST && nexthop && interface != OIF_NONE &&
+        RouteController::useNexthopObjectsFunction()) {
+        nexthopKey = {table, family, ifindex,
+                      std::string(reinterpret_cast<char*>(rawNexthop), rawLength)};
+        // If the object can't be created, fall back to a self-contained route.
+        nexthopId = (action == RTM_NEWROUTE) ? nexthopRegistry().acquire(nexthopKey)
+                                             : nexthopRegistry().find(nexthopKey);
+    }
+
+    // Assemble a rtmsg followed by its attributes in a single buffer.
+    NetlinkRequestBuffer<rtmsg, ROUTE_REQUEST_CAPACITY> request({
             .rtm_family = family,
             .rtm_dst_len = prefixLength,
             .rtm_protocol = RTPROT_STATIC,
             .rtm_scope = static_cast<uint8_t>(nexthop ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK),
             .rtm_type = type,
-    };
-
-    rtattr rtaDst     = { U16_RTA_LENGTH(rawLength), RTA_DST };
-    rtattr rtaGateway = { U16_RTA_LENGTH(rawLength), RTA_GATEWAY };
+    });
+    request.addAttribute(RTA_TABLE, table);
+    request.addAttribute(RTA_DST, rawAddress, rawLength);
+    void* nexthopIdData = nullptr;
+    if (nexthopId) {
+        nexthopIdData = request.addAttribute(RTA_NH_ID, nexthopId);
+    } else {
+        if (interface != OIF_NONE) {
+            request.addAttribute(RTA_OIF, ifindex);
+        }
+        if (nexthop) {
+            request.addAttribute(RTA_GATEWAY, rawNexthop, rawLength);
+        }
+    }
+    if (mtu != 0) {
+        // RTA_METRICS contains one or more nested attributes.
+        struct {
+            rtattr rta;
+            uint32_t value;
+        } metricsMtu = {{RTA_LENGTH(sizeof(mtu)), RTAX_MTU}, mtu};
+        request.addAttribute(RTA_METRICS, metricsMtu);
+    }
+    if (priority != 0) {
+        request.addAttribute(RTA_PRIORITY, priority);
+    }
+    if (request.overflowed()) {
+        ALOGE("impossible! route request too long");
+        return -ENOBUFS;
+    }
 
     iovec iov[] = {
             {nullptr, 0},
-            {&route, sizeof(route)},
-            {&RTATTR_TABLE, sizeof(RTATTR_TABLE)},
-            {&table, sizeof(table)},
-            {&rtaDst, sizeof(rtaDst)},
-            {rawAddress, static_cast<size_t>(rawLength)},
-            {&RTATTR_OIF, interface != OIF_NONE ? sizeof(RTATTR_OIF) : 0},
-            {&ifindex, interface != OIF_NONE ? sizeof(ifindex) : 0},
-            {&rtaGateway, nexthop ? sizeof(rtaGateway) : 0},
-            {rawNexthop, nexthop ? static_cast<size_t>(rawLength) : 0},
-            {&RTATTR_METRICS, mtu != 0 ? sizeof(RTATTR_METRICS) : 0},
-            {&RTATTRX_MTU, mtu != 0 ? sizeof(RTATTRX_MTU) : 0},
-            {&mtu, mtu != 0 ? sizeof(mtu) : 0},
-            {&RTATTR_PRIO, priority != 0 ? sizeof(RTATTR_PRIO) : 0},
-            {&priority, priority != 0 ? sizeof(priority) : 0},
+            request.iov(),
     };
 
     // Allow creating multiple link-local routes in the same table, so we can make IPv6
@@ -462,7 +1085,35 @@ int modifyIpRoute(uint16_t action, uint16_t flags, uint32_t table, const char* i
         flags &= ~NLM_F_EXCL;
     }
 
+    sRouteChanges.inc();
+    if (NetlinkBatch* batch = ScopedRouteBatch::current(); batch && !nexthopId) {
+        batch->addRequest(action, flags, iov, ARRAY_SIZE(iov));
+        return 0;
+    }
+
+    if (ScopedAsyncRouteAcks::active()) {
+        std::string description =
+                StringPrintf("%s route %s -> %s %s to table %u", actionName(action), destination,
+                             nexthop, interface, table);
+        const bool ignoreExisting = (action == RTM_NEWROUTE);
+        return NetlinkAckCollector::route().send(
+                action, flags, iov, ARRAY_SIZE(iov),
+                [description = std::move(description), ignoreExisting](int error) {
+                    if (error && !(ignoreExisting && error == -EEXIST)) {
+                        ALOGE("Error %s: %s", description.c_str(), strerror(-error));
+                    }
+                });
+    }
+
     int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov), nullptr);
+    if (ret == -EINVAL && nexthopId && action == RTM_NEWROUTE) {
+        // The kernel deletes nexthop objects when their interface goes away. Create it again.
+        nexthopRegistry().forget(nexthopKey);
+        if (uint32_t newId = nexthopRegistry().acquire(nexthopKey)) {
+            memcpy(nexthopIdData, &newId, sizeof(newId));
+            ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov), nullptr);
+        }
+    }
     if (ret) {
         ALOGE("Error %s route %s -> %s %s to table %u: %s",
               actionName(action), destination, nexthop, interface, table, strerror(-ret));
@@ -696,6 +1347,9 @@ int RouteController::modifyVpnLocalExclusionRule(bool add, const char* physicalI
 }
 
 int RouteController::addFixedLocalRoutes(const char* interface) {
+    // These routes are best-effort: the interface has already been added to the network, and
+    // nothing is rolled back if they fail. So don't make the caller wait for their ACKs.
+    ScopedAsyncRouteAcks async;
     for (size_t i = 0; i < ARRAY_SIZE(V4_FIXED_LOCAL_PREFIXES); ++i) {
         if (int ret = modifyRoute(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, interface,
                                   V4_FIXED_LOCAL_PREFIXES[i], nullptr /* nexthop */,
@@ -892,6 +1546,7 @@ int RouteController::modifyPhysicalNetwork(unsigned netId, const char* interface
         return -ESRCH;
     }
 
+    ScopedRuleBatch batch;
     for (const auto& [subPriority, uidRanges] : uidRangeMap) {
         for (const UidRangeParcel& range : uidRanges.getRanges()) {
             if (int ret = modifyUidNetworkRule(netId, table, range.start, range.stop, subPriority,
@@ -919,6 +1574,9 @@ int RouteController::modifyPhysicalNetwork(unsigned netId, const char* interface
             }
         }
     }
+    if (int ret = batch.commit()) {
+        return ret;
+    }
 
     if (!modifyNonUidBasedRules) {
         // we are done.
@@ -1047,6 +1705,7 @@ int RouteController::modifyUidLocalNetworkRule(const char* interface, uid_t uidS
 
 int RouteController::modifyUnreachableNetwork(unsigned netId, const UidRangeMap& uidRangeMap,
                                               bool add) {
+    ScopedRuleBatch batch;
     for (const auto& [subPriority, uidRanges] : uidRangeMap) {
         for (const UidRangeParcel& range : uidRanges.getRanges()) {
             if (int ret = modifyUidUnreachableRule(netId, range.start, range.stop, subPriority, add,
@@ -1064,7 +1723,7 @@ int RouteController::modifyUnreachableNetwork(unsigned netId, const UidRangeMap&
         }
     }
 
-    return 0;
+    return batch.commit();
 }
 
 [[nodiscard]] static int modifyRejectNonSecureNetworkRule(const UidRanges& uidRanges, bool add) {
@@ -1073,6 +1732,7 @@ int RouteController::modifyUnreachableNetwork(unsigned netId, const UidRangeMap&
     fwmark.protectedFromVpn = false;
     mask.protectedFromVpn = true;
 
+    ScopedRuleBatch batch;
     for (const UidRangeParcel& range : uidRanges.getRanges()) {
         if (int ret = modifyIpRule(add ? RTM_NEWRULE : RTM_DELRULE, RULE_PRIORITY_PROHIBIT_NON_VPN,
                                    FR_ACT_PROHIBIT, RT_TABLE_UNSPEC, fwmark.intValue, mask.intValue,
@@ -1081,7 +1741,7 @@ int RouteController::modifyUnreachableNetwork(unsigned netId, const UidRangeMap&
         }
     }
 
-    return 0;
+    return batch.commit();
 }
 
 int RouteController::modifyVirtualNetwork(unsigned netId, const char* interface,
@@ -1092,6 +1752,7 @@ int RouteController::modifyVirtualNetwork(unsigned netId, const char* interface,
         return -ESRCH;
     }
 
+    ScopedRuleBatch batch;
     for (const auto& [subPriority, uidRanges] : uidRangeMap) {
         for (const UidRangeParcel& range : uidRanges.getRanges()) {
             if (int ret = modifyVpnUidRangeRule(table, range.start, range.stop, subPriority, secure,
@@ -1108,6 +1769,9 @@ int RouteController::modifyVirtualNetwork(unsigned netId, const char* interface,
             }
         }
     }
+    if (int ret = batch.commit()) {
+        return ret;
+    }
 
     if (modifyNonUidBasedRules) {
         if (int ret = modifyIncomingPacketMark(netId, interface, PERMISSION_NONE, add)) {
@@ -1247,12 +1911,10 @@ uint32_t getRouteTable(const nlmsghdr *nlh) {
     return getRtmU32Attribute(nlh, RTA_TABLE);
 }
 
-[[nodiscard]] static int flushRules() {
-    NetlinkDumpFilter shouldDelete = [] (nlmsghdr *nlh) {
-        // Don't touch rules at priority 0 because by default they are used for local input.
-        return getRulePriority(nlh) != 0;
-    };
-    return rtNetlinkFlush(RTM_GETRULE, RTM_DELRULE, "rules", shouldDelete);
+// Whether netd owns a rule, and thus deletes it at startup if it does not create it again.
+static bool isManagedRule(nlmsghdr* nlh) {
+    // Don't touch rules at priority 0 because by default they are used for local input.
+    return getRulePriority(nlh) != 0;
 }
 
 int RouteController::flushRoutes(uint32_t table) {
@@ -1260,7 +1922,12 @@ int RouteController::flushRoutes(uint32_t table) {
         return getRouteTable(nlh) == table;
     };
 
-    return rtNetlinkFlush(RTM_GETROUTE, RTM_DELROUTE, "routes", shouldDelete);
+    int ret = rtNetlinkFlush(RTM_GETROUTE, RTM_DELROUTE, "routes", shouldDelete);
+    if (ret == 0) {
+        // Now that no route refers to them, the table's nexthop objects can go too.
+        nexthopRegistry().releaseTable(table);
+    }
+    return ret;
 }
 
 int RouteController::flushRoutes(const char* interface) {
@@ -1289,27 +1956,31 @@ int RouteController::flushRoutes(const char* interface, bool local) {
     // track of its name.
     // Skip erasing local fake interface since it does not exist in sInterfaceToTable.
     if (ret == 0 && !local) {
-        sInterfaceToTable.erase(interface);
+        eraseInterfaceTableLocked(interface);
     }
 
     return ret;
 }
 
 int RouteController::Init(unsigned localNetId) {
-    if (int ret = flushRules()) {
-        return ret;
-    }
-    if (int ret = addLegacyRouteRules()) {
-        return ret;
-    }
-    if (int ret = addLocalNetworkRules(localNetId)) {
-        return ret;
+    // Instead of flushing all rules and adding the static ones back, which leaves the device
+    // without routing rules for a moment when netd restarts, only add the rules that are missing
+    // and delete the ones that should not be there.
+    ScopedRuleBatch rules;
+    int ret = addLegacyRouteRules();
+    if (ret == 0) ret = addLocalNetworkRules(localNetId);
+    if (ret == 0) ret = addUnreachableRule();
+    if (ret == 0) {
+        // Don't complain if we can't add the dummy network, since not all devices support it.
+        configureDummyNetwork();
+    }
+    // Even if a rule could not be created, stale rules must not survive a restart.
+    if (int reconcileRet = rules.reconcile(isManagedRule)) {
+        if (ret == 0) ret = reconcileRet;
     }
-    if (int ret = addUnreachableRule()) {
+    if (ret) {
         return ret;
     }
-    // Don't complain if we can't add the dummy network, since not all devices support it.
-    configureDummyNetwork();
 
     updateTableNamesFile();
     return 0;
@@ -1320,7 +1991,7 @@ int RouteController::addInterfaceToLocalNetwork(unsigned netId, const char* inte
         return ret;
     }
     std::lock_guard lock(sInterfaceToTableLock);
-    sInterfaceToTable[interface] = ROUTE_TABLE_LOCAL_NETWORK;
+    setInterfaceTableLocked(interface, ROUTE_TABLE_LOCAL_NETWORK);
     return 0;
 }
 
@@ -1329,7 +2000,7 @@ int RouteController::removeInterfaceFromLocalNetwork(unsigned netId, const char*
         return ret;
     }
     std::lock_guard lock(sInterfaceToTableLock);
-    sInterfaceToTable.erase(interface);
+    eraseInterfaceTableLocked(interface);
     return 0;
 }
 
@@ -1414,10 +2085,12 @@ int RouteController::modifyPhysicalNetworkPermission(unsigned netId, const char*
 }
 
 int RouteController::addUsersToRejectNonSecureNetworkRule(const UidRanges& uidRanges) {
+    std::lock_guard guard(sRejectNonSecureNetworkLock);
     return modifyRejectNonSecureNetworkRule(uidRanges, true);
 }
 
 int RouteController::removeUsersFromRejectNonSecureNetworkRule(const UidRanges& uidRanges) {
+    std::lock_guard guard(sRejectNonSecureNetworkLock);
     return modifyRejectNonSecureNetworkRule(uidRanges, false);
 }
 
@@ -1453,6 +2126,32 @@ bool RouteController::isWithinIpv4LocalPrefix(const char* dst) {
     return false;
 }
 
+int RouteController::invalidateRouteCache(const std::set<std::string>& interfaces) {
+    // Higher than the priority of any other route, whether created by netd or by an IPv6 router
+    // advertisement.
+    constexpr int priority = 100000;
+
+    int ret = 0;
+    ScopedRouteBatch batch;
+    for (const std::string& interface : interfaces) {
+        for (const char* dst : {"0.0.0.0/0", "::/0"}) {
+            // Queueing only fails if the interface has no table. Carry on with the others.
+            if (int err = addRoute(interface.c_str(), dst, "throw", INTERFACE, 0 /* mtu */,
+                                   priority)) {
+                if (!ret) ret = err;
+                continue;
+            }
+            (void)removeRoute(interface.c_str(), dst, "throw", INTERFACE, priority);
+        }
+    }
+    if (int err = batch.send()) {
+        ALOGE("Error invalidating the route cache of %zu interfaces: %s", interfaces.size(),
+              strerror(-err));
+        if (!ret) ret = err;
+    }
+    return ret;
+}
+
 bool RouteController::isLocalRoute(TableType tableType, const char* destination,
                                    const char* nexthop) {
     IPPrefix prefix = IPPrefix::forString(destination);
@@ -1506,6 +2205,91 @@ int RouteController::updateRoute(const char* interface, const char* destination,
     return 0;
 }
 
+void RouteController::beginRuleTransaction() {
+    if (sRuleTransaction) {
+        ALOGE("Rule transaction already in progress");
+        return;
+    }
+    sRuleTransaction = std::make_unique<ScopedRuleBatch>(true /* joinable */);
+}
+
+void RouteController::beginRouteBatch() {
+    if (sRouteBatch) {
+        ALOGE("Route batch already in progress");
+        return;
+    }
+    sRouteBatch = std::make_unique<ScopedRouteBatch>();
+}
+
+size_t RouteController::routeBatchSize() {
+    const NetlinkBatch* batch = ScopedRouteBatch::current();
+    return batch ? batch->size() : 0;
+}
+
+int RouteController::commitRouteBatch(size_t* failedChange) {
+    if (!sRouteBatch) return 0;
+    const int ret = sRouteBatch->send(failedChange);
+    sRouteBatch.reset();
+    return ret;
+}
+
+int RouteController::commitRuleTransaction() {
+    if (!sRuleTransaction) return 0;
+    const int ret = sRuleTransaction->commit();
+    sRuleTransaction.reset();
+    return ret;
+}
+
+int RouteController::flushRuleTransaction() {
+    if (!sRuleTransaction) return 0;
+    const int ret = sRuleTransaction->commit();
+    sRuleTransaction = std::make_unique<ScopedRuleBatch>(true /* joinable */);
+    return ret;
+}
+
+int RouteController::replaceGateway(const char* interface, const char* oldGateway,
+                                    const char* newGateway) {
+    if (!useNexthopObjectsFunction()) {
+        return -EOPNOTSUPP;
+    }
+
+    uint32_t table = getRouteTableForInterface(interface, false /* local */);
+    if (table == RT_TABLE_UNSPEC) {
+        return -ESRCH;
+    }
+    uint32_t ifindex = ifNameToIndexFunction(interface);
+    if (!ifindex) {
+        ALOGE("cannot find interface %s", interface);
+        return -ENODEV;
+    }
+
+    // Parse both gateways as the same family, IPv4 or IPv6.
+    uint8_t family = AF_INET;
+    uint8_t rawOld[sizeof(in6_addr)], rawNew[sizeof(in6_addr)];
+    if (inet_pton(AF_INET, oldGateway, rawOld) <= 0) {
+        family = AF_INET6;
+        if (inet_pton(AF_INET6, oldGateway, rawOld) <= 0) {
+            ALOGE("inet_pton failed for gateway %s", oldGateway);
+            return -EINVAL;
+        }
+    }
+    if (inet_pton(family, newGateway, rawNew) <= 0) {
+        ALOGE("inet_pton failed for gateway %s", newGateway);
+        return -EINVAL;
+    }
+    const size_t rawLength = (family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+
+    const NexthopKey key = {table, family, ifindex,
+                            std::string(reinterpret_cast<char*>(rawOld), rawLength)};
+    int ret = nexthopRegistry().replaceGateway(
+            key, std::string(reinterpret_cast<char*>(rawNew), rawLength));
+    if (ret) {
+        ALOGE("Error replacing gateway %s with %s on %s: %s", oldGateway, newGateway, interface,
+              strerror(-ret));
+    }
+    return ret;
+}
+
 int RouteController::enableTethering(const char* inputInterface, const char* outputInterface) {
     return modifyTetheredNetwork(RTM_NEWRULE, inputInterface, outputInterface);
 }
@@ -1554,8 +2338,10 @@ int RouteController::removeUsersFromUnreachableNetwork(unsigned netId,
     return modifyUnreachableNetwork(netId, uidRangeMap, ACTION_DEL);
 }
 
-// Protects sInterfaceToTable.
+// Serializes changes to sInterfaceToTable.
 std::mutex RouteController::sInterfaceToTableLock;
-std::map<std::string, uint32_t> RouteController::sInterfaceToTable;
+std::mutex RouteController::sRejectNonSecureNetworkLock;
+std::shared_ptr<const RouteController::InterfaceToTableMap> RouteController::sInterfaceToTable =
+        std::make_shared<const RouteController::InterfaceToTableMap>();
 
 }  // namespace android::net
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "InterfaceController.h"  // getParameter
+#include "InterfaceRegistry.h"    // InterfaceId
 #include "NetdConstants.h"        // IptablesTarget
 #include "Network.h"              // UidRangeMap
 #include "Permission.h"
@@ -26,7 +27,11 @@
 #include <linux/netlink.h>
 #include <sys/types.h>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 namespace android::net {
 
@@ -114,7 +119,8 @@ public:
     // correspond to different interface indices over time. This way, even if the interface
     // index has changed, we can still free any map entries indexed by the ifindex that was
     // used to add them.
-    static uint32_t getIfIndex(const char* interface) EXCLUDES(sInterfaceToTableLock);
+    // Never blocks.
+    static uint32_t getIfIndex(const char* interface);
 
     [[nodiscard]] static int addInterfaceToLocalNetwork(unsigned netId, const char* interface);
     [[nodiscard]] static int removeInterfaceFromLocalNetwork(unsigned netId, const char* interface);
@@ -150,8 +156,10 @@ public:
                                                            const UidRangeMap& uidRangeMap,
                                                            bool excludeLocalRoutes);
 
-    [[nodiscard]] static int addUsersToRejectNonSecureNetworkRule(const UidRanges& uidRanges);
-    [[nodiscard]] static int removeUsersFromRejectNonSecureNetworkRule(const UidRanges& uidRanges);
+    [[nodiscard]] static int addUsersToRejectNonSecureNetworkRule(const UidRanges& uidRanges)
+            EXCLUDES(sRejectNonSecureNetworkLock);
+    [[nodiscard]] static int removeUsersFromRejectNonSecureNetworkRule(const UidRanges& uidRanges)
+            EXCLUDES(sRejectNonSecureNetworkLock);
 
     [[nodiscard]] static int addInterfaceToDefaultNetwork(const char* interface,
                                                           Permission permission);
@@ -168,6 +176,39 @@ public:
     [[nodiscard]] static int updateRoute(const char* interface, const char* destination,
                                          const char* nexthop, TableType tableType, int mtu);
 
+    // When routes use nexthop objects, makes every route in |interface|'s table that goes via
+    // |oldGateway| go via |newGateway| instead, with a single netlink message. Returns
+    // -EOPNOTSUPP if nexthop objects are not in use, and -ENOENT if no route uses |oldGateway|.
+    [[nodiscard]] static int replaceGateway(const char* interface, const char* oldGateway,
+                                            const char* newGateway);
+
+    // Makes the kernel drop the routes cached by sockets that use |interfaces|, so that they look
+    // up their route again, by adding and removing an IPv4 and an IPv6 throw route in each
+    // interface's table. All these changes are sent in one netlink batch. Returns 0, or the error
+    // of the first change that failed.
+    [[nodiscard]] static int invalidateRouteCache(const std::set<std::string>& interfaces);
+
+    // Until commitRuleTransaction(), routing rule changes made on this thread are queued instead
+    // of sent, and then sent together in as few netlink messages as possible. Errors reported by
+    // the kernel for those changes are only returned by commitRuleTransaction(). Routes are still
+    // modified immediately. Transactions do not nest.
+    static void beginRuleTransaction();
+    [[nodiscard]] static int commitRuleTransaction();
+    // Sends the rule changes queued so far by the transaction in progress, if any, and keeps it
+    // open. Returns 0, or the first error reported by the kernel for those changes.
+    [[nodiscard]] static int flushRuleTransaction();
+
+    // Until commitRouteBatch(), route changes made on this thread are queued instead of sent, and
+    // then sent together in as few netlink messages as possible. As with the other route batches,
+    // routes that use nexthop objects are still sent immediately. routeBatchSize() is the number
+    // of changes queued so far. commitRouteBatch() returns 0, or the error of the first change
+    // that failed, whose index it stores in |*failedChange|. The changes after it are undone, so
+    // that only the ones before it are applied; if that fails, |*failedChange| is the number of
+    // changes instead. Adding a route that already exists is not an error. Batches do not nest.
+    static void beginRouteBatch();
+    static size_t routeBatchSize();
+    [[nodiscard]] static int commitRouteBatch(size_t* failedChange);
+
     [[nodiscard]] static int enableTethering(const char* inputInterface,
                                              const char* outputInterface);
     [[nodiscard]] static int disableTethering(const char* inputInterface,
@@ -197,6 +238,13 @@ public:
     static int (*iptablesRestoreCommandFunction)(IptablesTarget, const std::string&,
                                                  const std::string&, std::string *);
     static uint32_t (*ifNameToIndexFunction)(const char*);
+    // Whether routes via a gateway use shared kernel nexthop objects (Linux 5.3+) instead of
+    // carrying their own gateway. Controlled by persist.netd.nexthop_objects.
+    static bool (*useNexthopObjectsFunction)();
+
+    // The rt_tables file is written asynchronously. Waits until it reflects every change made so
+    // far.
+    static void waitForTableNamesFile();
 
   private:
     friend class RouteControllerTest;
@@ -209,8 +257,34 @@ public:
             "224.0.0.0/24"  // Link-local multicast; non-internet routable
     };
 
+    // The global routing table of each interface name, indexed by its InterfaceId.
+    // RT_TABLE_UNSPEC for names that have none. Each name that has a table holds a reference in
+    // InterfaceRegistry, so that its ID is not reused while the map refers to it. An ID that a
+    // reader looked up can still be reused for another name before it takes the map, so each
+    // entry also has its name, which lookups check.
+    struct InterfaceTable {
+        uint32_t table = 0;  // RT_TABLE_UNSPEC
+        std::string name;
+    };
+    using InterfaceToTableMap = std::vector<InterfaceTable>;
+
+    // The map is copy-on-write: readers take a snapshot with interfaceToTableSnapshot() and never
+    // block, and writers, which are serialized by sInterfaceToTableLock, publish a modified copy.
     static std::mutex sInterfaceToTableLock;
-    static std::map<std::string, uint32_t> sInterfaceToTable GUARDED_BY(sInterfaceToTableLock);
+    static std::shared_ptr<const InterfaceToTableMap> sInterfaceToTable;
+
+    static std::shared_ptr<const InterfaceToTableMap> interfaceToTableSnapshot();
+    // Returns the global routing table of |interface|, whose ID is |id|, in |map|, or
+    // RT_TABLE_UNSPEC if it has none.
+    static uint32_t findInterfaceTable(const InterfaceToTableMap& map, InterfaceId id,
+                                       const char* interface);
+
+    // Serializes changes to the rule that rejects traffic from users not on a secure VPN. It is
+    // never held together with sInterfaceToTableLock.
+    static std::mutex sRejectNonSecureNetworkLock;
+    static void setInterfaceTableLocked(const char* interface, uint32_t table)
+            REQUIRES(sInterfaceToTableLock);
+    static void eraseInterfaceTableLocked(const char* interface) REQUIRES(sInterfaceToTableLock);
 
     static int configureDummyNetwork();
     [[nodiscard]] static int flushRoutes(const char* interface) EXCLUDES(sInterfaceToTableLock);
@@ -236,7 +310,9 @@ public:
     static int modifyVirtualNetwork(unsigned netId, const char* interface,
                                     const UidRangeMap& uidRangeMap, bool secure, bool add,
                                     bool modifyNonUidBasedRules, bool excludeLocalRoutes);
-    static void updateTableNamesFile() EXCLUDES(sInterfaceToTableLock);
+    // Schedules a rewrite of the rt_tables file on a background thread.
+    static void updateTableNamesFile();
+    static void writeTableNamesFile();
     static int modifyVpnLocalExclusionRule(bool add, const char* physicalInterface);
 
     static int modifyUidLocalNetworkRule(const char* interface, uid_t uidStart, uid_t uidEnd,
@@ -253,6 +329,7 @@ public:
                                 const char* interface, const char* destination, const char* nexthop,
                                 uint32_t mtu, uint32_t priority);
 uint32_t getRulePriority(const nlmsghdr *nlh);
+bool kernelSupportsNexthopObjects();
 [[nodiscard]] int modifyIncomingPacketMark(unsigned netId, const char* interface,
                                            Permission permission, bool add);
 
@@ -16,10 +16,12 @@
  * RouteControllerTest.cpp - unit tests for RouteController.cpp
  */
 
+#include <arpa/inet.h>
 #include <gtest/gtest.h>
 #include <fstream>
 
 #include "Fwmark.h"
+#include "InterfaceRegistry.h"
 #include "IptablesBaseTest.h"
 #include "NetlinkCommands.h"
 #include "RouteController.h"
@@ -49,6 +51,32 @@ public:
         return RouteController::flushRoutes(a);
     }
 
+    int flushRoutes(const char* iface) {
+        return RouteController::flushRoutes(iface);
+    }
+
+    uint32_t getRouteTableForInterface(const char* iface, bool local) {
+        return RouteController::getRouteTableForInterface(iface, local);
+    }
+
+    // The table of |iface| in the current snapshot of the map, or in |snapshot|.
+    uint32_t tableInSnapshot(
+            const char* iface,
+            std::shared_ptr<const RouteController::InterfaceToTableMap> snapshot = nullptr) {
+        if (!snapshot) snapshot = RouteController::interfaceToTableSnapshot();
+        const InterfaceId id = InterfaceRegistry::find(iface);
+        return id < snapshot->size() ? (*snapshot)[id].table : 0;
+    }
+
+    std::shared_ptr<const RouteController::InterfaceToTableMap> interfaceToTableSnapshot() {
+        return RouteController::interfaceToTableSnapshot();
+    }
+
+    uint32_t findInterfaceTable(const RouteController::InterfaceToTableMap& map, InterfaceId id,
+                                const char* iface) {
+        return RouteController::findInterfaceTable(map, id, iface);
+    }
+
     uint32_t static fakeIfaceNameToIndexFunction(const char* iface) {
         // "lo" is the same as the real one
         if (!strcmp(iface, "lo")) return LOOPBACK_IFINDEX;
@@ -133,6 +161,8 @@ TEST_F(RouteControllerTest, TestModifyIncomingPacketMark) {
 }
 
 bool hasLocalInterfaceInRouteTable(const char* iface) {
+    RouteController::waitForTableNamesFile();
+
     // Calculate the table index from interface index
     std::string index = std::to_string(RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX_FOR_LOCAL +
                                        RouteController::ifNameToIndexFunction(iface));
@@ -173,5 +203,284 @@ TEST_F(RouteControllerTest, TestCreateVirtualLocalInterfaceTable) {
     EXPECT_FALSE(hasLocalInterfaceInRouteTable(TEST_IFACE2));
 }
 
+TEST_F(RouteControllerTest, TestInterfaceToTableSnapshot) {
+    const uint32_t table = TEST_IFACE1_INDEX + RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX;
+    const uint32_t localTable =
+            TEST_IFACE1_INDEX + RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX_FOR_LOCAL;
+
+    // Forget about the interface, in case an earlier test left it behind.
+    EXPECT_EQ(0, flushRoutes(TEST_IFACE1));
+    auto before = interfaceToTableSnapshot();
+    EXPECT_EQ(0U, tableInSnapshot(TEST_IFACE1, before));
+
+    EXPECT_EQ(table, getRouteTableForInterface(TEST_IFACE1, false));
+    EXPECT_EQ(localTable, getRouteTableForInterface(TEST_IFACE1, true));
+    EXPECT_EQ(TEST_IFACE1_INDEX, RouteController::getIfIndex(TEST_IFACE1));
+
+    // Existing snapshots are never modified.
+    EXPECT_EQ(0U, tableInSnapshot(TEST_IFACE1, before));
+    auto after = interfaceToTableSnapshot();
+    EXPECT_EQ(table, tableInSnapshot(TEST_IFACE1, after));
+
+    // Once the interface has no table, nothing refers to its name any more, and it is dropped.
+    const InterfaceId id = InterfaceRegistry::find(TEST_IFACE1);
+    ASSERT_LT(id, after->size());
+    EXPECT_EQ(0, flushRoutes(TEST_IFACE1));
+    EXPECT_EQ(table, (*after)[id].table);
+    EXPECT_EQ(0U, (*interfaceToTableSnapshot())[id].table);
+    EXPECT_EQ(INVALID_INTERFACE_ID, InterfaceRegistry::find(TEST_IFACE1));
+    EXPECT_EQ(0U, RouteController::getIfIndex(TEST_IFACE1));
+
+    // An ID that was looked up before its name was dropped, and was then reused for another name,
+    // does not find the other name's table.
+    RouteController::InterfaceToTableMap map(id + 1);
+    map[id] = {table, TEST_IFACE2};
+    EXPECT_EQ(0U, findInterfaceTable(map, id, TEST_IFACE1));
+    EXPECT_EQ(table, findInterfaceTable(map, id, TEST_IFACE2));
+}
+
+TEST_F(RouteControllerTest, TestNetlinkSocketPool) {
+    NetlinkSocketPool pool(NETLINK_ROUTE, 1);
+
+    int fd;
+    uint32_t seq;
+    {
+        NetlinkSocketPool::Lease lease = pool.acquire();
+        ASSERT_LE(0, lease.fd());
+        fd = lease.fd();
+        seq = lease.nextSeq();
+        lease.setReusable();
+    }
+
+    {
+        // A reusable socket is handed out again, and keeps its sequence numbers.
+        NetlinkSocketPool::Lease lease = pool.acquire();
+        EXPECT_EQ(fd, lease.fd());
+        EXPECT_EQ(seq + 1, lease.nextSeq());
+
+        // While it is in use, other callers get a different socket.
+        NetlinkSocketPool::Lease other = pool.acquire();
+        ASSERT_LE(0, other.fd());
+        EXPECT_NE(fd, other.fd());
+        lease.setReusable();
+    }
+
+    // Sockets that are not marked reusable are closed, not returned to the pool.
+    {
+        NetlinkSocketPool::Lease lease = pool.acquire();
+        EXPECT_EQ(fd, lease.fd());
+    }
+    {
+        NetlinkSocketPool::Lease lease = pool.acquire();
+        ASSERT_LE(0, lease.fd());
+        EXPECT_EQ(1U, lease.nextSeq());
+        lease.setReusable();
+    }
+
+    // Requests made through the shared pool still see their own acks when repeated, including
+    // when the kernel reports an error.
+    const uint32_t table = 500;
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(0, modifyIpRoute(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, table, "lo",
+                                   "192.0.2.5/32", nullptr, 0 /* mtu */, 0 /* priority */));
+        EXPECT_EQ(-EEXIST, modifyIpRoute(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, table, "lo",
+                                         "192.0.2.5/32", nullptr, 0 /* mtu */, 0 /* priority */));
+        EXPECT_EQ(0, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo",
+                                   "192.0.2.5/32", nullptr, 0 /* mtu */, 0 /* priority */));
+    }
+    EXPECT_EQ(0, flushRoutes(table));
+}
+
+TEST_F(RouteControllerTest, TestNetlinkRequestBuffer) {
+    NetlinkRequestBuffer<rtmsg, 40> request({.rtm_family = AF_INET6});
+    request.addAttribute(RTA_TABLE, uint32_t{500});
+    request.addAttribute(RTA_IIF, "lo", 3);
+    EXPECT_FALSE(request.overflowed());
+
+    const uint8_t expected[] = {
+            // rtmsg.
+            AF_INET6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            // RTA_TABLE.
+            8, 0, RTA_TABLE, 0, 0xf4, 0x01, 0, 0,
+            // RTA_IIF, padded to 4 bytes with zeros.
+            7, 0, RTA_IIF, 0, 'l', 'o', 0, 0,
+    };
+    iovec iov = request.iov();
+    ASSERT_EQ(sizeof(expected), iov.iov_len);
+    EXPECT_EQ(0, memcmp(expected, iov.iov_base, sizeof(expected)));
+
+    request.header()->rtm_family = AF_INET;
+    EXPECT_EQ(AF_INET, static_cast<uint8_t*>(iov.iov_base)[0]);
+
+    // Attributes that don't fit are not appended.
+    request.addAttribute(RTA_DST, in6_addr{});
+    EXPECT_TRUE(request.overflowed());
+    EXPECT_EQ(sizeof(expected), request.iov().iov_len);
+}
+
+// Calls |send| with a request to add or delete the route 198.51.100.|host|/32 via lo in |table|.
+template <typename Send>
+static void withRouteRequest(uint16_t action, uint32_t table, uint8_t host, Send send) {
+    rtmsg route = {
+            .rtm_family = AF_INET,
+            .rtm_dst_len = 32,
+            .rtm_protocol = RTPROT_STATIC,
+            .rtm_scope = RT_SCOPE_LINK,
+            .rtm_type = RTN_UNICAST,
+    };
+    rtattr rtaTable = {RTA_LENGTH(sizeof(table)), RTA_TABLE};
+    in_addr dst = {htonl(0xc6336400 | host)};
+    rtattr rtaDst = {RTA_LENGTH(sizeof(dst)), RTA_DST};
+    uint32_t ifindex = LOOPBACK_IFINDEX;
+    rtattr rtaOif = {RTA_LENGTH(sizeof(ifindex)), RTA_OIF};
+    iovec iov[] = {
+            {nullptr, 0},
+            {&route, sizeof(route)},
+            {&rtaTable, sizeof(rtaTable)},
+            {&table, sizeof(table)},
+            {&rtaDst, sizeof(rtaDst)},
+            {&dst, sizeof(dst)},
+            {&rtaOif, sizeof(rtaOif)},
+            {&ifindex, sizeof(ifindex)},
+    };
+    const uint16_t flags =
+            (action == RTM_NEWROUTE) ? NETLINK_ROUTE_CREATE_FLAGS : NETLINK_REQUEST_FLAGS;
+    send(flags, iov, ARRAY_SIZE(iov));
+}
+
+// Queues a request to add or delete the route 198.51.100.|host|/32 via lo in |table|.
+static void addRouteRequest(NetlinkBatch* batch, uint16_t action, uint32_t table, uint8_t host) {
+    withRouteRequest(action, table, host, [&](uint16_t flags, iovec* iov, int iovlen) {
+        batch->addRequest(action, flags, iov, iovlen);
+    });
+}
+
+TEST_F(RouteControllerTest, TestNetlinkBatch) {
+    const uint32_t table = 500;
+    // More than fit in a single send, so that ACKs are collected for several sends.
+    const size_t numRoutes = NetlinkBatch::kMaxRequestsPerSend * 2 + 10;
+    ASSERT_LT(numRoutes, 255U);
+
+    NetlinkBatch batch;
+    EXPECT_EQ(0, batch.send());
+
+    for (size_t i = 0; i < numRoutes; i++) {
+        addRouteRequest(&batch, RTM_NEWROUTE, table, i + 1);
+    }
+    ASSERT_EQ(numRoutes, batch.size());
+    EXPECT_EQ(0, batch.send());
+    EXPECT_TRUE(batch.empty());
+
+    // Errors are reported per request, and don't stop later requests from being processed.
+    addRouteRequest(&batch, RTM_DELROUTE, table, 1);
+    addRouteRequest(&batch, RTM_NEWROUTE, table, 2);
+    addRouteRequest(&batch, RTM_DELROUTE, table, 1);
+    addRouteRequest(&batch, RTM_DELROUTE, table, 3);
+    EXPECT_EQ(-EEXIST, batch.send());
+    EXPECT_EQ(0, batch.result(0));
+    EXPECT_EQ(-EEXIST, batch.result(1));
+    EXPECT_EQ(-ESRCH, batch.result(2));
+    EXPECT_EQ(0, batch.result(3));
+
+    for (size_t i = 3; i < numRoutes; i++) {
+        addRouteRequest(&batch, RTM_DELROUTE, table, i + 1);
+    }
+    EXPECT_EQ(0, batch.send());
+
+    // Only 198.51.100.2 is left.
+    EXPECT_EQ(0, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo",
+                               "198.51.100.2/32", nullptr, 0 /* mtu */, 0 /* priority */));
+    EXPECT_EQ(0, flushRoutes(table));
+}
+
+TEST_F(RouteControllerTest, TestNetlinkAckCollector) {
+    const uint32_t table = 500;
+    auto sendRoute = [table](NetlinkAckCollector* collector, uint16_t action, uint8_t host) {
+        std::future<int> result;
+        withRouteRequest(action, table, host, [&](uint16_t flags, iovec* iov, int iovlen) {
+            result = collector->send(action, flags, iov, iovlen);
+        });
+        return result;
+    };
+
+    {
+        NetlinkAckCollector collector(NETLINK_ROUTE);
+        std::future<int> added = sendRoute(&collector, RTM_NEWROUTE, 1);
+        std::future<int> duplicate = sendRoute(&collector, RTM_NEWROUTE, 1);
+        std::future<int> missing = sendRoute(&collector, RTM_DELROUTE, 2);
+        EXPECT_EQ(0, added.get());
+        EXPECT_EQ(-EEXIST, duplicate.get());
+        EXPECT_EQ(-ESRCH, missing.get());
+
+        // Callbacks run on the collector thread, and waitForPending() waits for them.
+        int calls = 0;
+        int error = 1;
+        withRouteRequest(RTM_DELROUTE, table, 1, [&](uint16_t flags, iovec* iov, int iovlen) {
+            EXPECT_EQ(0, collector.send(RTM_DELROUTE, flags, iov, iovlen, [&](int ret) {
+                calls++;
+                error = ret;
+            }));
+        });
+        collector.waitForPending();
+        EXPECT_EQ(1, calls);
+        EXPECT_EQ(0, error);
+
+        // Requests whose ACKs have not been read when the collector is destroyed are cancelled, but
+        // they have still been applied.
+        withRouteRequest(RTM_NEWROUTE, table, 3, [&](uint16_t flags, iovec* iov, int iovlen) {
+            EXPECT_EQ(0, collector.send(RTM_NEWROUTE, flags, iov, iovlen, [](int) {}));
+        });
+    }
+    EXPECT_EQ(0, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo",
+                               "198.51.100.3/32", nullptr, 0 /* mtu */, 0 /* priority */));
+    EXPECT_EQ(0, flushRoutes(table));
+}
+
+TEST_F(RouteControllerTest, TestNexthopObjects) {
+    if (!kernelSupportsNexthopObjects()) {
+        GTEST_SKIP() << "Kernel does not support nexthop objects";
+    }
+    auto savedUseNexthopObjects = RouteController::useNexthopObjectsFunction;
+    RouteController::useNexthopObjectsFunction = [] { return true; };
+
+    const uint32_t table = getRouteTableForInterface("lo", false);
+    ASSERT_NE(0U, table);
+    EXPECT_EQ(-ENOENT, RouteController::replaceGateway("lo", "127.0.0.2", "127.0.0.3"));
+
+    // Both routes share one nexthop object, so replacing its gateway moves both of them.
+    EXPECT_EQ(0, modifyIpRoute(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, table, "lo",
+                               "192.0.2.2/32", "127.0.0.2", 0 /* mtu */, 0 /* priority */));
+    EXPECT_EQ(0, modifyIpRoute(RTM_NEWROUTE, NETLINK_ROUTE_CREATE_FLAGS, table, "lo",
+                               "192.0.2.3/32", "127.0.0.2", 0 /* mtu */, 0 /* priority */));
+    EXPECT_EQ(0, RouteController::replaceGateway("lo", "127.0.0.2", "127.0.0.3"));
+    EXPECT_EQ(-ENOENT, RouteController::replaceGateway("lo", "127.0.0.2", "127.0.0.3"));
+    EXPECT_EQ(0, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo",
+                               "192.0.2.2/32", "127.0.0.3", 0 /* mtu */, 0 /* priority */));
+
+    // Flushing the table deletes its nexthop objects along with the remaining route.
+    EXPECT_EQ(0, flushRoutes("lo"));
+    EXPECT_EQ(-ESRCH, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo",
+                                    "192.0.2.3/32", nullptr, 0 /* mtu */, 0 /* priority */));
+
+    RouteController::useNexthopObjectsFunction = [] { return false; };
+    EXPECT_EQ(-EOPNOTSUPP, RouteController::replaceGateway("lo", "127.0.0.3", "127.0.0.2"));
+    RouteController::useNexthopObjectsFunction = savedUseNexthopObjects;
+}
+
+TEST_F(RouteControllerTest, TestInvalidateRouteCache) {
+    const uint32_t table = getRouteTableForInterface("lo", false);
+    ASSERT_NE(0U, table);
+    EXPECT_EQ(0, RouteController::invalidateRouteCache({"lo"}));
+
+    // The throw routes were added and removed again.
+    for (const char* dst : {"0.0.0.0/0", "::/0"}) {
+        EXPECT_EQ(-ESRCH, modifyIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, "lo", dst,
+                                        "throw", 0 /* mtu */, 100000 /* priority */));
+    }
+
+    // An interface without a table is reported, but does not stop the others.
+    EXPECT_EQ(-ESRCH, RouteController::invalidateRouteCache({"lo", "netdtestnotable"}));
+}
+
 }  // namespace net
 }  // namespace android
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RpcStats.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <deque>
+
+#include <android-base/thread_annotations.h>
+
+#include "FlightRecorder.h"
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+std::mutex sRpcsLock;
+std::vector<const RpcStats::Rpc*> sRpcs GUARDED_BY(sRpcsLock);
+
+std::mutex sSlowCallsLock;
+std::deque<RpcStats::SlowCall> sSlowCalls GUARDED_BY(sSlowCallsLock);
+
+// The innermost call running on this thread.
+thread_local RpcStats::Trace* sCurrentTrace = nullptr;
+
+constexpr const char* kOpNames[RpcStats::kNumOps] = {"iptables-restore", "netlink", "sock_diag"};
+
+void updateMax(std::atomic_int64_t* max, int64_t value) {
+    int64_t current = max->load(std::memory_order_relaxed);
+    while (value > current &&
+           !max->compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+int64_t toUs(nanoseconds duration) {
+    return static_cast<int64_t>(duration_cast<microseconds>(duration).count());
+}
+
+}  // namespace
+
+void RpcStats::Histogram::record(nanoseconds duration) {
+    mCounts[bucketOf(duration)].fetch_add(1, std::memory_order_relaxed);
+}
+
+RpcStats::Histogram::Counts RpcStats::Histogram::getCounts() const {
+    Counts counts;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        counts[i] = mCounts[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+size_t RpcStats::Histogram::bucketOf(nanoseconds duration) {
+    const int64_t us = duration_cast<microseconds>(duration).count();
+    if (us <= 0) return 0;
+    return std::min<size_t>(std::bit_width(static_cast<uint64_t>(us)), kNumBuckets - 1);
+}
+
+microseconds RpcStats::Histogram::quantile(const Counts& counts, double fraction) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) total += count;
+    if (total == 0) return {};
+
+    const uint64_t rank =
+            std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) return microseconds(int64_t{1} << i);
+    }
+    return microseconds(int64_t{1} << (kNumBuckets - 1));
+}
+
+RpcStats::Trace::Trace(Rpc* rpc, nanoseconds wait, steady_clock::time_point start)
+    : mRpc(rpc), mWait(wait), mStart(start), mPrevious(sCurrentTrace) {
+    sCurrentTrace = this;
+}
+
+RpcStats::Trace::~Trace() {
+    sCurrentTrace = mPrevious;
+    const nanoseconds exec = mRpc->now() - mStart;
+    mRpc->recordExec(exec);
+    if (mWait + exec < kSlowCallThreshold) return;
+    if (mWait + exec >= FlightRecorder::kStallThreshold) {
+        // Keep what netd was doing in the run-up to the stall for the next dumpsys.
+        FlightRecorder::global().freeze(mRpc->name());
+    }
+
+    SlowCall call = {
+            .name = mRpc->name(),
+            .time = std::chrono::system_clock::now(),
+            .wait = mWait,
+            .exec = exec,
+            .opTime = mOpTime,
+            .opCount = mOpCount,
+    };
+    std::lock_guard guard(sSlowCallsLock);
+    if (sSlowCalls.size() == kMaxSlowCalls) sSlowCalls.pop_front();
+    sSlowCalls.push_back(std::move(call));
+}
+
+RpcStats::Rpc::Rpc(const char* name, Clock clock) : mName(name), mClock(clock) {
+    std::lock_guard guard(sRpcsLock);
+    sRpcs.push_back(this);
+}
+
+void RpcStats::Rpc::recordUncontended() {
+    mCalls.fetch_add(1, std::memory_order_relaxed);
+    mWait.record({});
+}
+
+void RpcStats::Rpc::record(nanoseconds wait) {
+    mCalls.fetch_add(1, std::memory_order_relaxed);
+    mContended.fetch_add(1, std::memory_order_relaxed);
+    mTotalWaitNs.fetch_add(wait.count(), std::memory_order_relaxed);
+    updateMax(&mMaxWaitNs, wait.count());
+    mWait.record(wait);
+}
+
+void RpcStats::Rpc::recordExec(nanoseconds exec) {
+    updateMax(&mMaxExecNs, exec.count());
+    mExec.record(exec);
+}
+
+RpcStats::Snapshot RpcStats::Rpc::getSnapshot() const {
+    return {
+            .name = mName,
+            .calls = mCalls.load(std::memory_order_relaxed),
+            .contended = mContended.load(std::memory_order_relaxed),
+            .totalWait = nanoseconds(mTotalWaitNs.load(std::memory_order_relaxed)),
+            .maxWait = nanoseconds(mMaxWaitNs.load(std::memory_order_relaxed)),
+            .maxExec = nanoseconds(mMaxExecNs.load(std::memory_order_relaxed)),
+            .wait = mWait.getCounts(),
+            .exec = mExec.getCounts(),
+    };
+}
+
+RpcStats::ScopedOp::ScopedOp(Op op)
+    : mOp(op),
+      mTrace(sCurrentTrace != nullptr &&
+                             sCurrentTrace->mOpDepth[static_cast<size_t>(op)]++ == 0
+                     ? sCurrentTrace
+                     : nullptr) {
+    if (mTrace != nullptr) mStart = steady_clock::now();
+}
+
+RpcStats::ScopedOp::~ScopedOp() {
+    const size_t op = static_cast<size_t>(mOp);
+    if (mTrace == nullptr) {
+        // Nested inside another ScopedOp for the same Op, if there is a call at all.
+        if (sCurrentTrace != nullptr && sCurrentTrace->mOpDepth[op] > 0) {
+            sCurrentTrace->mOpDepth[op]--;
+        }
+        return;
+    }
+    mTrace->mOpTime[op] += steady_clock::now() - mStart;
+    mTrace->mOpCount[op]++;
+    mTrace->mOpDepth[op]--;
+}
+
+std::vector<RpcStats::Snapshot> RpcStats::getSnapshots() {
+    std::vector<Snapshot> snapshots;
+    {
+        std::lock_guard guard(sRpcsLock);
+        for (const Rpc* rpc : sRpcs) snapshots.push_back(rpc->getSnapshot());
+    }
+    std::sort(snapshots.begin(), snapshots.end(),
+              [](const Snapshot& a, const Snapshot& b) { return a.name < b.name; });
+    return snapshots;
+}
+
+std::vector<RpcStats::SlowCall> RpcStats::getSlowCalls() {
+    std::lock_guard guard(sSlowCallsLock);
+    return {sSlowCalls.begin(), sSlowCalls.end()};
+}
+
+void RpcStats::dump(DumpWriter& dw) {
+    using Histogram = RpcStats::Histogram;
+
+    dw.incIndent();
+    dw.println("RPC stats (rpc: calls, contended, total wait, wait p50/p99/max, "
+               "exec p50/p99/max):");
+    dw.incIndent();
+    for (const auto& rpc : getSnapshots()) {
+        dw.println("%s: %" PRIu64 ", %" PRIu64 ", %" PRId64 "us, %" PRId64 "/%" PRId64 "/%" PRId64
+                   "us, %" PRId64 "/%" PRId64 "/%" PRId64 "us",
+                   rpc.name.c_str(), rpc.calls, rpc.contended, toUs(rpc.totalWait),
+                   toUs(Histogram::quantile(rpc.wait, 0.5)),
+                   toUs(Histogram::quantile(rpc.wait, 0.99)), toUs(rpc.maxWait),
+                   toUs(Histogram::quantile(rpc.exec, 0.5)),
+                   toUs(Histogram::quantile(rpc.exec, 0.99)), toUs(rpc.maxExec));
+    }
+    dw.decIndent();
+
+    dw.println("Slow RPCs (over %" PRId64 "ms):",
+               static_cast<int64_t>(kSlowCallThreshold.count()));
+    dw.incIndent();
+    for (const auto& call : getSlowCalls()) {
+        const auto sinceEpoch = call.time.time_since_epoch();
+        const time_t seconds = duration_cast<std::chrono::seconds>(sinceEpoch).count();
+        const int millis = duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000;
+        tm local;
+        char timestamp[32] = "";
+        if (localtime_r(&seconds, &local)) strftime(timestamp, sizeof(timestamp), "%T", &local);
+
+        std::string ops;
+        for (size_t i = 0; i < kNumOps; i++) {
+            if (call.opCount[i] == 0) continue;
+            ops += ", " + std::string(kOpNames[i]) + " " + std::to_string(toUs(call.opTime[i])) +
+                   "us (" + std::to_string(call.opCount[i]) + ")";
+        }
+        dw.println("%s.%03d %s: wait %" PRId64 "us, exec %" PRId64 "us%s", timestamp, millis,
+                   call.name.c_str(), toUs(call.wait), toUs(call.exec), ops.c_str());
+    }
+    dw.decIndent();
+    dw.decIndent();
+}
+
+}  // namespace android::net
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Per-RPC statistics for binder RPCs: how long they wait for the controller locks they take, and
+// how long they then take to run, as histograms. Each RPC has one function-local static Rpc, so
+// recording never takes a shared lock.
+//
+// Calls that take longer than kSlowCallThreshold are also kept, together with how much of their
+// time went to each Op, so that a slow call can be put down to the lock, iptables-restore or the
+// kernel.
+class RpcStats {
+  public:
+    static constexpr std::chrono::milliseconds kSlowCallThreshold{100};
+    static constexpr size_t kMaxSlowCalls = 32;
+
+    // Sub-operations that are timed when a traced call runs them on its own thread.
+    enum class Op { IPTABLES_RESTORE, NETLINK, SOCK_DIAG };
+    static constexpr size_t kNumOps = 3;
+
+    // Durations in power-of-two buckets of microseconds: bucket 0 counts durations under 1us,
+    // bucket i counts [2^(i-1), 2^i)us, and the last bucket also counts everything longer.
+    class Histogram {
+      public:
+        static constexpr size_t kNumBuckets = 24;
+        using Counts = std::array<uint64_t, kNumBuckets>;
+
+        void record(std::chrono::nanoseconds duration);
+        Counts getCounts() const;
+
+        static size_t bucketOf(std::chrono::nanoseconds duration);
+        // An upper bound on the |fraction| quantile of |counts|, or 0 if there are none.
+        static std::chrono::microseconds quantile(const Counts& counts, double fraction);
+
+      private:
+        std::array<std::atomic_uint64_t, kNumBuckets> mCounts{};
+    };
+
+    struct Snapshot {
+        std::string name;
+        uint64_t calls;
+        uint64_t contended;
+        std::chrono::nanoseconds totalWait;
+        std::chrono::nanoseconds maxWait;
+        std::chrono::nanoseconds maxExec;
+        Histogram::Counts wait;
+        Histogram::Counts exec;
+    };
+
+    struct SlowCall {
+        std::string name;
+        std::chrono::system_clock::time_point time;  // When the call returned.
+        std::chrono::nanoseconds wait;
+        std::chrono::nanoseconds exec;
+        std::array<std::chrono::nanoseconds, kNumOps> opTime;
+        std::array<uint32_t, kNumOps> opCount;
+    };
+
+    class Rpc;
+    class ScopedOp;
+
+    // Times a call from when it has its lock until it returns, and the Ops it runs on this thread
+    // in between.
+    class Trace {
+      public:
+        Trace(Rpc* rpc, std::chrono::nanoseconds wait, std::chrono::steady_clock::time_point start);
+        ~Trace();
+        Trace(const Trace&) = delete;
+        Trace& operator=(const Trace&) = delete;
+
+      private:
+        friend class ScopedOp;
+
+        Rpc* const mRpc;
+        const std::chrono::nanoseconds mWait;
+        const std::chrono::steady_clock::time_point mStart;
+        Trace* const mPrevious;
+        std::array<std::chrono::nanoseconds, kNumOps> mOpTime{};
+        std::array<uint32_t, kNumOps> mOpCount{};
+        std::array<uint32_t, kNumOps> mOpDepth{};
+    };
+
+    // Destroyed in reverse order, so the call is timed before the lock is released.
+    template <typename Mutex>
+    struct Call {
+        std::unique_lock<Mutex> lock;
+        Trace trace;
+    };
+
+    class Rpc {
+      public:
+        using Clock = std::chrono::steady_clock::time_point (*)();
+
+        // |name| must outlive the process, e.g. __func__. Tests may pass a fake |clock|.
+        explicit Rpc(const char* name, Clock clock = std::chrono::steady_clock::now);
+
+        // Locks |mutex| and starts timing the call. An uncontended acquisition is one try_lock().
+        template <typename Mutex>
+        Call<Mutex> lock(Mutex& mutex) {
+            std::unique_lock guard(mutex, std::try_to_lock);
+            if (guard.owns_lock()) {
+                recordUncontended();
+                return {std::move(guard), Trace(this, {}, mClock())};
+            }
+            const auto start = mClock();
+            guard.lock();
+            const auto end = mClock();
+            record(end - start);
+            return {std::move(guard), Trace(this, end - start, end)};
+        }
+
+        // Records a contended acquisition that waited for |wait|.
+        void record(std::chrono::nanoseconds wait);
+        void recordExec(std::chrono::nanoseconds exec);
+        Snapshot getSnapshot() const;
+        const char* name() const { return mName; }
+        std::chrono::steady_clock::time_point now() const { return mClock(); }
+
+      private:
+        void recordUncontended();
+
+        const char* const mName;
+        const Clock mClock;
+        std::atomic_uint64_t mCalls{0};
+        std::atomic_uint64_t mContended{0};
+        std::atomic_int64_t mTotalWaitNs{0};
+        std::atomic_int64_t mMaxWaitNs{0};
+        std::atomic_int64_t mMaxExecNs{0};
+        Histogram mWait;
+        Histogram mExec;
+    };
+
+    // Adds the time until it goes out of scope to |op| in the Trace of the call running on this
+    // thread, if there is one. Nested ScopedOps for the same Op count once.
+    class ScopedOp {
+      public:
+        explicit ScopedOp(Op op);
+        ~ScopedOp();
+        ScopedOp(const ScopedOp&) = delete;
+        ScopedOp& operator=(const ScopedOp&) = delete;
+
+      private:
+        const Op mOp;
+        Trace* const mTrace;
+        std::chrono::steady_clock::time_point mStart;
+    };
+
+    // All RPCs that have taken a lock at least once, in order of name.
+    static std::vector<Snapshot> getSnapshots();
+
+    // The most recent slow calls, oldest first.
+    static std::vector<SlowCall> getSlowCalls();
+
+    static void dump(netdutils::DumpWriter& dw);
+};
+
+}  // namespace android::net
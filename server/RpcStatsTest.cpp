@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "RpcStats.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+namespace {
+
+uint64_t sum(const RpcStats::Histogram::Counts& counts) {
+    return std::accumulate(counts.begin(), counts.end(), uint64_t{0});
+}
+
+std::chrono::steady_clock::time_point sFakeNow;
+
+std::chrono::steady_clock::time_point fakeNow() {
+    return sFakeNow;
+}
+
+// Always held by someone else: try_lock() fails, and lock() waits 20ms on the fake clock.
+struct ContendedMutex {
+    bool try_lock() { return false; }
+    void lock() { sFakeNow += 20ms; }
+    void unlock() {}
+};
+
+}  // namespace
+
+TEST(RpcStatsTest, CountsUncontendedCalls) {
+    static RpcStats::Rpc rpc("uncontendedRpc");
+    std::mutex mutex;
+    for (int i = 0; i < 3; i++) {
+        auto call = rpc.lock(mutex);
+        EXPECT_TRUE(call.lock.owns_lock());
+    }
+
+    const auto snapshot = rpc.getSnapshot();
+    EXPECT_EQ("uncontendedRpc", snapshot.name);
+    EXPECT_EQ(3U, snapshot.calls);
+    EXPECT_EQ(0U, snapshot.contended);
+    EXPECT_EQ(0ns, snapshot.totalWait);
+    EXPECT_EQ(3U, snapshot.wait[0]);
+    EXPECT_EQ(3U, sum(snapshot.exec));
+}
+
+TEST(RpcStatsTest, RecordsWaitTime) {
+    static RpcStats::Rpc rpc("contendedRpc", fakeNow);
+    ContendedMutex mutex;
+    {
+        auto call = rpc.lock(mutex);
+        sFakeNow += 1ms;
+    }
+
+    rpc.record(5ms);
+    const auto snapshot = rpc.getSnapshot();
+    EXPECT_EQ(2U, snapshot.calls);
+    EXPECT_EQ(2U, snapshot.contended);
+    EXPECT_EQ(20ms, snapshot.maxWait);
+    EXPECT_EQ(25ms, snapshot.totalWait);
+    EXPECT_EQ(2U, sum(snapshot.wait));
+    EXPECT_EQ(1U, snapshot.wait[RpcStats::Histogram::bucketOf(5ms)]);
+    EXPECT_EQ(1U, snapshot.wait[RpcStats::Histogram::bucketOf(20ms)]);
+    EXPECT_EQ(1ms, snapshot.maxExec);
+}
+
+TEST(RpcStatsTest, ListsRpcsByName) {
+    static RpcStats::Rpc second("listedRpcB");
+    static RpcStats::Rpc first("listedRpcA");
+
+    const auto snapshots = RpcStats::getSnapshots();
+    auto position = [&snapshots](const std::string& name) {
+        return std::find_if(snapshots.begin(), snapshots.end(),
+                            [&name](const auto& s) { return s.name == name; }) -
+               snapshots.begin();
+    };
+    ASSERT_LT(position("listedRpcB"), static_cast<ptrdiff_t>(snapshots.size()));
+    EXPECT_LT(position("listedRpcA"), position("listedRpcB"));
+}
+
+TEST(RpcStatsTest, HistogramBuckets) {
+    using Histogram = RpcStats::Histogram;
+    EXPECT_EQ(0U, Histogram::bucketOf(0ns));
+    EXPECT_EQ(0U, Histogram::bucketOf(999ns));
+    EXPECT_EQ(1U, Histogram::bucketOf(1us));
+    EXPECT_EQ(2U, Histogram::bucketOf(2us));
+    EXPECT_EQ(2U, Histogram::bucketOf(3us));
+    EXPECT_EQ(10U, Histogram::bucketOf(1ms));
+    EXPECT_EQ(Histogram::kNumBuckets - 1, Histogram::bucketOf(1h));
+
+    Histogram::Counts counts{};
+    EXPECT_EQ(0us, Histogram::quantile(counts, 0.5));
+    counts[2] = 90;
+    counts[11] = 10;
+    EXPECT_EQ(4us, Histogram::quantile(counts, 0.5));
+    EXPECT_EQ(4us, Histogram::quantile(counts, 0.9));
+    EXPECT_EQ(2048us, Histogram::quantile(counts, 0.99));
+}
+
+TEST(RpcStatsTest, TracesSlowCalls) {
+    static RpcStats::Rpc rpc("slowRpc");
+    std::mutex mutex;
+    {
+        auto call = rpc.lock(mutex);
+        RpcStats::ScopedOp iptables(RpcStats::Op::IPTABLES_RESTORE);
+        {
+            // Nested ops of the same kind are only counted once.
+            RpcStats::ScopedOp nested(RpcStats::Op::IPTABLES_RESTORE);
+            std::this_thread::sleep_for(RpcStats::kSlowCallThreshold);
+        }
+        RpcStats::ScopedOp netlink(RpcStats::Op::NETLINK);
+    }
+    {
+        auto call = rpc.lock(mutex);
+    }
+    // Outside any call, ops are not recorded anywhere.
+    RpcStats::ScopedOp untraced(RpcStats::Op::SOCK_DIAG);
+
+    const auto slowCalls = RpcStats::getSlowCalls();
+    ASSERT_FALSE(slowCalls.empty());
+    const auto& call = slowCalls.back();
+    EXPECT_EQ("slowRpc", call.name);
+    EXPECT_GE(call.exec, RpcStats::kSlowCallThreshold);
+    EXPECT_EQ(1U, call.opCount[static_cast<size_t>(RpcStats::Op::IPTABLES_RESTORE)]);
+    EXPECT_GE(call.opTime[static_cast<size_t>(RpcStats::Op::IPTABLES_RESTORE)],
+              RpcStats::kSlowCallThreshold);
+    EXPECT_EQ(1U, call.opCount[static_cast<size_t>(RpcStats::Op::NETLINK)]);
+    EXPECT_EQ(0U, call.opCount[static_cast<size_t>(RpcStats::Op::SOCK_DIAG)]);
+
+    const auto snapshot = rpc.getSnapshot();
+    EXPECT_EQ(2U, sum(snapshot.exec));
+    EXPECT_GE(snapshot.maxExec, RpcStats::kSlowCallThreshold);
+}
+
+}  // namespace android::net
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Netd"
+
+#include "RtNetlinkEvent.h"
+
+#include <arpa/inet.h>
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
+#include <netinet/icmp6.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <log/log.h>
+
+#include "InterfaceRegistry.h"
+
+namespace android::net {
+
+namespace {
+
+// From RFC 8106. Not in every libc's <netinet/icmp6.h>.
+constexpr uint8_t kNdOptRdnss = 25;
+
+struct nd_opt_rdnss_hdr {
+    uint8_t type;
+    uint8_t len;  // in units of 8 octets, including this header
+    uint16_t reserved;
+    uint32_t lifetime;
+};
+
+size_t addrLength(int family) {
+    switch (family) {
+        case AF_INET:
+            return sizeof(in_addr);
+        case AF_INET6:
+            return sizeof(in6_addr);
+        default:
+            return 0;
+    }
+}
+
+// Copies the address in |rta| into |out|. Returns false if it is too short for |family|.
+bool extractAddr(const rtattr* rta, int family, uint8_t* out) {
+    const size_t len = addrLength(family);
+    if (len == 0 || RTA_PAYLOAD(rta) < len) return false;
+    memcpy(out, RTA_DATA(rta), len);
+    return true;
+}
+
+void lookupIfName(RtNetlinkEvent* event) {
+    // The registry knows every interface that NetlinkHandler has seen a link message for, which
+    // saves an ioctl per event.
+    if (InterfaceRegistry::nameForIfindex(event->ifIndex, event->ifName)) return;
+    if (!if_indextoname(event->ifIndex, event->ifName)) event->ifName[0] = '\0';
+}
+
+bool parseAddress(const nlmsghdr* nlh, RtNetlinkEvent* event) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) return false;
+    const auto* ifa = reinterpret_cast<const ifaddrmsg*>(NLMSG_DATA(nlh));
+
+    event->type = (nlh->nlmsg_type == RTM_NEWADDR) ? RtNetlinkEvent::Type::ADDRESS_UPDATED
+                                                   : RtNetlinkEvent::Type::ADDRESS_REMOVED;
+    event->ifIndex = ifa->ifa_index;
+    event->family = ifa->ifa_family;
+    event->prefixLength = ifa->ifa_prefixlen;
+    event->scope = ifa->ifa_scope;
+    // Only the low 8 bits. IFA_FLAGS, which the kernel always sends, has all of them.
+    event->addrFlags = ifa->ifa_flags;
+
+    bool haveAddr = false;
+    int len = IFA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case IFA_ADDRESS:
+                // Only one change can be reported at a time, so only the first address is used.
+                if (!haveAddr) haveAddr = extractAddr(rta, event->family, event->addr);
+                break;
+            case IFA_FLAGS:
+                if (RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                    memcpy(&event->addrFlags, RTA_DATA(rta), sizeof(uint32_t));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if (!haveAddr) {
+        ALOGE("No usable IFA_ADDRESS in address message of family %d", event->family);
+        return false;
+    }
+    lookupIfName(event);
+    return true;
+}
+
+bool parseLink(const nlmsghdr* nlh, RtNetlinkEvent* event) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) return false;
+    const auto* ifi = reinterpret_cast<const ifinfomsg*>(NLMSG_DATA(nlh));
+    if (ifi->ifi_flags & IFF_LOOPBACK) return false;
+
+    int len = IFLA_PAYLOAD(nlh);
+    for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type != IFLA_IFNAME) continue;
+        const size_t nameLen = strnlen(static_cast<const char*>(RTA_DATA(rta)),
+                                       std::min<size_t>(RTA_PAYLOAD(rta), IFNAMSIZ - 1));
+        memcpy(event->ifName, RTA_DATA(rta), nameLen);
+        event->ifName[nameLen] = '\0';
+        event->ifIndex = ifi->ifi_index;
+        event->type = (ifi->ifi_flags & IFF_LOWER_UP) ? RtNetlinkEvent::Type::LINK_UP
+                                                      : RtNetlinkEvent::Type::LINK_DOWN;
+        return true;
+    }
+    return false;
+}
+
+bool parseRoute(const nlmsghdr* nlh, RtNetlinkEvent* event) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) return false;
+    const auto* rtm = reinterpret_cast<const rtmsg*>(NLMSG_DATA(nlh));
+
+    // Only kernel and RA routes are of interest: netd installed the others itself. Of those, only
+    // global unicast routes without source routing. Cloned routes are not real routes.
+    if ((rtm->rtm_protocol != RTPROT_KERNEL && rtm->rtm_protocol != RTPROT_RA) ||
+        rtm->rtm_scope != RT_SCOPE_UNIVERSE || rtm->rtm_type != RTN_UNICAST ||
+        rtm->rtm_src_len != 0 || (rtm->rtm_flags & RTM_F_CLONED)) {
+        return false;
+    }
+    if (addrLength(rtm->rtm_family) == 0) return false;
+
+    event->type = (nlh->nlmsg_type == RTM_NEWROUTE) ? RtNetlinkEvent::Type::ROUTE_UPDATED
+                                                    : RtNetlinkEvent::Type::ROUTE_REMOVED;
+    event->family = rtm->rtm_family;
+    event->prefixLength = rtm->rtm_dst_len;
+
+    bool haveDst = false;
+    int len = RTM_PAYLOAD(nlh);
+    for (const rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case RTA_DST:
+                if (haveDst) break;
+                if (!extractAddr(rta, event->family, event->addr)) return false;
+                haveDst = true;
+                break;
+            case RTA_GATEWAY:
+                if (event->hasGateway) break;
+                if (!extractAddr(rta, event->family, event->gateway)) return false;
+                event->hasGateway = true;
+                break;
+            case RTA_OIF:
+                if (event->ifIndex || RTA_PAYLOAD(rta) < sizeof(int)) break;
+                memcpy(&event->ifIndex, RTA_DATA(rta), sizeof(int));
+                lookupIfName(event);
+                if (!event->ifName[0]) return false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Without RTA_DST, a route is the default route if its prefix length is 0, and is not
+    // understood otherwise. |addr| is already all zeros.
+    if (!haveDst && event->prefixLength != 0) return false;
+
+    // A useful route has at least either a gateway or an interface.
+    return event->hasGateway || event->ifIndex != 0;
+}
+
+bool parseNdUserOpt(const nlmsghdr* nlh, RtNetlinkEvent* event) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nduseroptmsg))) return false;
+    const auto* msg = reinterpret_cast<const nduseroptmsg*>(NLMSG_DATA(nlh));
+    const size_t optsLen = msg->nduseropt_opts_len;
+    if (optsLen > NLMSG_PAYLOAD(nlh, sizeof(*msg))) {
+        ALOGE("ND option length %zu exceeds message", optsLen);
+        return false;
+    }
+    if (msg->nduseropt_family != AF_INET6 || msg->nduseropt_icmp_type != ND_ROUTER_ADVERT ||
+        msg->nduseropt_icmp_code != 0) {
+        return false;
+    }
+
+    // The kernel sends a separate message for each option in the RA, so only the first option in
+    // the message is used.
+    nd_opt_rdnss_hdr opt;
+    if (optsLen < sizeof(opt)) return false;
+    memcpy(&opt, msg + 1, sizeof(opt));
+    if (opt.type != kNdOptRdnss || opt.len * 8U > optsLen) return false;
+    // Each address takes 16 octets after the 8-octet header, so a valid option with at least one
+    // address has an odd length of 3 or more.
+    if (opt.len < 3 || !(opt.len & 1)) {
+        ALOGE("Invalid RDNSS option length %d", opt.len);
+        return false;
+    }
+
+    event->ifIndex = msg->nduseropt_ifindex;
+    lookupIfName(event);
+    if (!event->ifName[0]) return false;
+    event->type = RtNetlinkEvent::Type::RDNSS;
+    event->lifetime = ntohl(opt.lifetime);
+    event->servers = reinterpret_cast<const in6_addr*>(reinterpret_cast<const uint8_t*>(msg + 1) +
+                                                       sizeof(opt));
+    event->numServers = (opt.len - 1) / 2;
+    return true;
+}
+
+}  // namespace
+
+bool parseRtNetlinkEvent(const nlmsghdr* nlh, RtNetlinkEvent* event) {
+    *event = {};
+    switch (nlh->nlmsg_type) {
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            return parseAddress(nlh, event);
+        case RTM_NEWLINK:
+            return parseLink(nlh, event);
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+            return parseRoute(nlh, event);
+        case RTM_NEWNDUSEROPT:
+            return parseNdUserOpt(nlh, event);
+        default:
+            return false;
+    }
+}
+
+}  // namespace android::net
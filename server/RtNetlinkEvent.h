@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace android::net {
+
+// An rtnetlink multicast message decoded straight from its attributes, for the messages that
+// NetlinkHandler acts on. Decoding does not allocate, and leaves formatting the addresses to
+// whoever needs them as strings.
+struct RtNetlinkEvent {
+    enum class Type {
+        ADDRESS_UPDATED,  // RTM_NEWADDR
+        ADDRESS_REMOVED,  // RTM_DELADDR
+        LINK_UP,          // RTM_NEWLINK with IFF_LOWER_UP
+        LINK_DOWN,        // RTM_NEWLINK without IFF_LOWER_UP
+        ROUTE_UPDATED,    // RTM_NEWROUTE
+        ROUTE_REMOVED,    // RTM_DELROUTE
+        RDNSS,            // RTM_NEWNDUSEROPT carrying an RDNSS option from an RA
+    };
+
+    Type type;
+    int ifIndex;  // For routes, the outgoing interface, or 0 if there is none.
+    char ifName[IFNAMSIZ];  // "" if the interface could not be found, e.g. because it is gone.
+
+    // Addresses and routes. |addr| is the address or the route destination, in network byte
+    // order; 4 bytes are used for AF_INET and 16 for AF_INET6.
+    int family;
+    uint8_t addr[16];
+    uint8_t prefixLength;
+
+    // Addresses only.
+    uint32_t addrFlags;  // IFA_F_*
+    uint8_t scope;       // RT_SCOPE_*
+
+    // Routes only.
+    bool hasGateway;
+    uint8_t gateway[16];
+
+    // RDNSS only. |servers| points into the decoded message.
+    uint32_t lifetime;  // seconds
+    const in6_addr* servers;
+    size_t numServers;
+};
+
+// Decodes |nlh|, which must be followed by |nlh->nlmsg_len| bytes, into |event|. Returns false
+// if it is not one of the messages above, or if it is malformed or of no interest, such as a
+// route that netd installed itself or a link change on the loopback interface.
+bool parseRtNetlinkEvent(const nlmsghdr* nlh, RtNetlinkEvent* event);
+
+}  // namespace android::net
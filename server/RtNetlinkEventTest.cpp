@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/icmp6.h>
+
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "RtNetlinkEvent.h"
+
+namespace android::net {
+
+namespace {
+
+// Builds a netlink message of |type| with a fixed header |T| and any number of attributes.
+template <typename T>
+class MessageBuilder {
+  public:
+    explicit MessageBuilder(uint16_t type) : mBuf(NLMSG_SPACE(sizeof(T))) {
+        header()->nlmsg_type = type;
+        sync();
+    }
+
+    T* body() { return reinterpret_cast<T*>(NLMSG_DATA(header())); }
+
+    MessageBuilder& attr(uint16_t type, const void* data, size_t len) {
+        const size_t offset = mBuf.size();
+        mBuf.resize(offset + RTA_SPACE(len));
+        auto* rta = reinterpret_cast<rtattr*>(mBuf.data() + offset);
+        rta->rta_type = type;
+        rta->rta_len = RTA_LENGTH(len);
+        memcpy(RTA_DATA(rta), data, len);
+        sync();
+        return *this;
+    }
+
+    // Appends raw bytes after the fixed header, e.g. ND options.
+    MessageBuilder& raw(const void* data, size_t len) {
+        const size_t offset = mBuf.size();
+        mBuf.resize(offset + len);
+        memcpy(mBuf.data() + offset, data, len);
+        sync();
+        return *this;
+    }
+
+    const nlmsghdr* get() { return header(); }
+
+  private:
+    nlmsghdr* header() { return reinterpret_cast<nlmsghdr*>(mBuf.data()); }
+    void sync() { header()->nlmsg_len = mBuf.size(); }
+
+    std::vector<uint8_t> mBuf;
+};
+
+in6_addr parse6(const char* str) {
+    in6_addr addr = {};
+    EXPECT_EQ(1, inet_pton(AF_INET6, str, &addr)) << str;
+    return addr;
+}
+
+const int kLoIndex = if_nametoindex("lo");
+
+}  // namespace
+
+TEST(RtNetlinkEventTest, Address) {
+    const in6_addr addr = parse6("2001:db8::1");
+    const uint32_t flags = IFA_F_MANAGETEMPADDR;
+    MessageBuilder<ifaddrmsg> msg(RTM_NEWADDR);
+    msg.body()->ifa_family = AF_INET6;
+    msg.body()->ifa_prefixlen = 64;
+    msg.body()->ifa_scope = RT_SCOPE_UNIVERSE;
+    msg.body()->ifa_index = kLoIndex;
+    msg.attr(IFA_ADDRESS, &addr, sizeof(addr)).attr(IFA_FLAGS, &flags, sizeof(flags));
+
+    RtNetlinkEvent event;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::ADDRESS_UPDATED, event.type);
+    EXPECT_EQ(AF_INET6, event.family);
+    EXPECT_EQ(0, memcmp(&addr, event.addr, sizeof(addr)));
+    EXPECT_EQ(64, event.prefixLength);
+    EXPECT_EQ(flags, event.addrFlags);
+    EXPECT_EQ(RT_SCOPE_UNIVERSE, event.scope);
+    EXPECT_EQ(kLoIndex, event.ifIndex);
+    EXPECT_STREQ("lo", event.ifName);
+}
+
+TEST(RtNetlinkEventTest, AddressRemovedFromMissingInterface) {
+    const in_addr addr = {htonl(0xc0000201)};
+    MessageBuilder<ifaddrmsg> msg(RTM_DELADDR);
+    msg.body()->ifa_family = AF_INET;
+    msg.body()->ifa_prefixlen = 24;
+    msg.body()->ifa_index = 0x7fffffff;
+    msg.attr(IFA_ADDRESS, &addr, sizeof(addr));
+
+    RtNetlinkEvent event;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::ADDRESS_REMOVED, event.type);
+    EXPECT_EQ(0, memcmp(&addr, event.addr, sizeof(addr)));
+    EXPECT_STREQ("", event.ifName);
+}
+
+TEST(RtNetlinkEventTest, InvalidAddress) {
+    RtNetlinkEvent event;
+
+    MessageBuilder<ifaddrmsg> noAddress(RTM_NEWADDR);
+    noAddress.body()->ifa_family = AF_INET6;
+    EXPECT_FALSE(parseRtNetlinkEvent(noAddress.get(), &event));
+
+    // An IPv4 address is too short for AF_INET6.
+    const in_addr addr = {htonl(0xc0000201)};
+    MessageBuilder<ifaddrmsg> shortAddress(RTM_NEWADDR);
+    shortAddress.body()->ifa_family = AF_INET6;
+    shortAddress.attr(IFA_ADDRESS, &addr, sizeof(addr));
+    EXPECT_FALSE(parseRtNetlinkEvent(shortAddress.get(), &event));
+
+    nlmsghdr truncated = {};
+    truncated.nlmsg_len = sizeof(truncated);
+    truncated.nlmsg_type = RTM_NEWADDR;
+    EXPECT_FALSE(parseRtNetlinkEvent(&truncated, &event));
+}
+
+TEST(RtNetlinkEventTest, Link) {
+    const char kName[] = "wlan0";
+    MessageBuilder<ifinfomsg> msg(RTM_NEWLINK);
+    msg.body()->ifi_index = 42;
+    msg.body()->ifi_flags = IFF_UP | IFF_LOWER_UP;
+    msg.attr(IFLA_IFNAME, kName, sizeof(kName));
+
+    RtNetlinkEvent event;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::LINK_UP, event.type);
+    EXPECT_EQ(42, event.ifIndex);
+    EXPECT_STREQ(kName, event.ifName);
+
+    msg.body()->ifi_flags = IFF_UP;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::LINK_DOWN, event.type);
+
+    msg.body()->ifi_flags = IFF_LOOPBACK | IFF_LOWER_UP;
+    EXPECT_FALSE(parseRtNetlinkEvent(msg.get(), &event));
+}
+
+TEST(RtNetlinkEventTest, DefaultRoute) {
+    const in6_addr gateway = parse6("fe80::1");
+    MessageBuilder<rtmsg> msg(RTM_NEWROUTE);
+    msg.body()->rtm_family = AF_INET6;
+    msg.body()->rtm_protocol = RTPROT_RA;
+    msg.body()->rtm_scope = RT_SCOPE_UNIVERSE;
+    msg.body()->rtm_type = RTN_UNICAST;
+    msg.attr(RTA_GATEWAY, &gateway, sizeof(gateway)).attr(RTA_OIF, &kLoIndex, sizeof(kLoIndex));
+
+    RtNetlinkEvent event;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::ROUTE_UPDATED, event.type);
+    EXPECT_EQ(0, event.prefixLength);
+    EXPECT_EQ(0, memcmp(&in6addr_any, event.addr, sizeof(in6addr_any)));
+    EXPECT_TRUE(event.hasGateway);
+    EXPECT_EQ(0, memcmp(&gateway, event.gateway, sizeof(gateway)));
+    EXPECT_STREQ("lo", event.ifName);
+
+    // netd installs static routes itself.
+    msg.body()->rtm_protocol = RTPROT_STATIC;
+    EXPECT_FALSE(parseRtNetlinkEvent(msg.get(), &event));
+}
+
+TEST(RtNetlinkEventTest, RouteNeedsDestinationUnlessDefault) {
+    MessageBuilder<rtmsg> msg(RTM_DELROUTE);
+    msg.body()->rtm_family = AF_INET6;
+    msg.body()->rtm_dst_len = 64;
+    msg.body()->rtm_protocol = RTPROT_KERNEL;
+    msg.body()->rtm_type = RTN_UNICAST;
+    msg.attr(RTA_OIF, &kLoIndex, sizeof(kLoIndex));
+
+    RtNetlinkEvent event;
+    EXPECT_FALSE(parseRtNetlinkEvent(msg.get(), &event));
+
+    const in6_addr dst = parse6("2001:db8::");
+    msg.attr(RTA_DST, &dst, sizeof(dst));
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::ROUTE_REMOVED, event.type);
+    EXPECT_EQ(0, memcmp(&dst, event.addr, sizeof(dst)));
+    EXPECT_FALSE(event.hasGateway);
+}
+
+TEST(RtNetlinkEventTest, Rdnss) {
+    struct {
+        uint8_t type;
+        uint8_t len;
+        uint16_t reserved;
+        uint32_t lifetime;
+        in6_addr servers[2];
+    } opt = {
+            .type = 25,  // RDNSS
+            .len = 5,
+            .reserved = 0,
+            .lifetime = htonl(3600),
+            .servers = {parse6("2001:db8::53"), parse6("fe80::53")},
+    };
+    MessageBuilder<nduseroptmsg> msg(RTM_NEWNDUSEROPT);
+    msg.body()->nduseropt_family = AF_INET6;
+    msg.body()->nduseropt_opts_len = sizeof(opt);
+    msg.body()->nduseropt_ifindex = kLoIndex;
+    msg.body()->nduseropt_icmp_type = ND_ROUTER_ADVERT;
+    msg.raw(&opt, sizeof(opt));
+
+    RtNetlinkEvent event;
+    ASSERT_TRUE(parseRtNetlinkEvent(msg.get(), &event));
+    EXPECT_EQ(RtNetlinkEvent::Type::RDNSS, event.type);
+    EXPECT_STREQ("lo", event.ifName);
+    EXPECT_EQ(3600U, event.lifetime);
+    ASSERT_EQ(2U, event.numServers);
+    EXPECT_EQ(0, memcmp(&opt.servers[0], &event.servers[0], sizeof(in6_addr)));
+    EXPECT_EQ(0, memcmp(&opt.servers[1], &event.servers[1], sizeof(in6_addr)));
+
+    // An even length cannot hold whole addresses.
+    msg.body()->nduseropt_opts_len = sizeof(opt) - 8;
+    reinterpret_cast<uint8_t*>(msg.body() + 1)[1] = 4;
+    EXPECT_FALSE(parseRtNetlinkEvent(msg.get(), &event));
+}
+
+}  // namespace android::net
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ScopedTrace.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <cutils/trace.h>
+
+namespace android::net {
+
+namespace {
+
+// Long enough for a name and a few arguments. Longer names are truncated.
+constexpr size_t kMaxNameLength = 128;
+
+}  // namespace
+
+ScopedTrace::ScopedTrace(const char* format, ...)
+    : mEnabled(atrace_is_tag_enabled(ATRACE_TAG_NETWORK)) {
+    if (!mEnabled) return;
+    char name[kMaxNameLength];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(name, sizeof(name), format, ap);
+    va_end(ap);
+    atrace_begin(ATRACE_TAG_NETWORK, name);
+}
+
+ScopedTrace::~ScopedTrace() {
+    if (mEnabled) atrace_end(ATRACE_TAG_NETWORK);
+}
+
+void traceCounter(const char* name, int64_t value) {
+    atrace_int64(ATRACE_TAG_NETWORK, name, value);
+}
+
+}  // namespace android::net
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+namespace android::net {
+
+// Marks the enclosing scope as a section in system traces, under the "network" category, so that
+// a trace shows which RPC, iptables-restore run or netlink exchange the time went to. The name is
+// only formatted while the category is being traced; otherwise a section costs one atomic load.
+class ScopedTrace {
+  public:
+    explicit ScopedTrace(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    ~ScopedTrace();
+    ScopedTrace(const ScopedTrace&) = delete;
+    ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+  private:
+    const bool mEnabled;
+};
+
+// Sets the counter track |name| to |value|, if the "network" category is being traced.
+void traceCounter(const char* name, int64_t value);
+
+}  // namespace android::net
@@ -29,7 +29,11 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 
+#include <atomic>
 #include <cinttypes>
+#include <cstddef>
+#include <future>
+#include <vector>
 
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
@@ -38,7 +42,11 @@
 #include <netdutils/InternetAddresses.h>
 #include <netdutils/Stopwatch.h>
 
+#include "FlightRecorder.h"
+#include "NetdMetrics.h"
 #include "Permission.h"
+#include "RpcStats.h"
+#include "ScopedTrace.h"
 
 #ifndef SOCK_DESTROY
 #define SOCK_DESTROY 21
@@ -55,6 +63,9 @@ using netdutils::Stopwatch;
 namespace net {
 namespace {
 
+NetdMetrics::Counter sDumps("sock_diag.dumps");
+NetdMetrics::Counter sSocketsDestroyed("sock_diag.sockets_destroyed");
+
 int getAdbPort() {
     return android::base::GetIntProperty("service.adb.tcp.port", 0);
 }
@@ -83,6 +94,113 @@ int checkError(int fd) {
     }
 }
 
+// A SOCK_DIAG bytecode program that rejects sockets whose source or destination address is a
+// loopback address, so that the kernel does not send them to us at all. IPv4 conditions also match
+// IPv4-mapped IPv6 addresses. Sockets connected to their own non-loopback address are still left
+// for isLoopbackSocket() to find.
+class LoopbackFilter {
+  public:
+    LoopbackFilter() {
+        const in_addr v4 = {.s_addr = htonl(INADDR_LOOPBACK & IN_CLASSA_NET)};
+        const in6_addr v6 = IN6ADDR_LOOPBACK_INIT;
+        size_t offset = 0;
+        setCondition(&mBytecode.src4, INET_DIAG_BC_S_COND, AF_INET, 8, &offset);
+        mBytecode.src4.addr = v4;
+        setCondition(&mBytecode.dst4, INET_DIAG_BC_D_COND, AF_INET, 8, &offset);
+        mBytecode.dst4.addr = v4;
+        setCondition(&mBytecode.src6, INET_DIAG_BC_S_COND, AF_INET6, 128, &offset);
+        mBytecode.src6.addr = v6;
+        setCondition(&mBytecode.dst6, INET_DIAG_BC_D_COND, AF_INET6, 128, &offset);
+        mBytecode.dst6.addr = v6;
+
+        mNla.nla_len = sizeof(mNla) + sizeof(mBytecode);
+        mNla.nla_type = INET_DIAG_REQ_BYTECODE;
+    }
+
+    // The iovecs to append to a dump request.
+    iovec nla() { return {&mNla, sizeof(mNla)}; }
+    iovec bytecode() { return {&mBytecode, sizeof(mBytecode)}; }
+
+  private:
+    // Rejects the socket if the host condition matches, and otherwise continues with the next
+    // condition. Every "no" target must be reachable by "yes" jumps from the start of the program,
+    // so the rejection is done by a JMP, which always takes its "no" branch, and whose "yes" branch
+    // leads to the next condition.
+    // inet_diag_hostcond, without the flexible array member so that it can be followed by one.
+    struct HostCond {
+        uint8_t family;
+        uint8_t prefixLen;
+        int port;
+    };
+    static_assert(sizeof(HostCond) == sizeof(inet_diag_hostcond));
+
+    template <typename Addr>
+    struct Condition {
+        inet_diag_bc_op op;
+        HostCond cond;
+        Addr addr;
+        inet_diag_bc_op reject;
+    } __attribute__((__packed__));
+
+    struct {
+        Condition<in_addr> src4;
+        Condition<in_addr> dst4;
+        Condition<in6_addr> src6;
+        Condition<in6_addr> dst6;
+    } __attribute__((__packed__)) mBytecode;
+    nlattr mNla;
+
+    template <typename Addr>
+    void setCondition(Condition<Addr>* c, uint8_t code, uint8_t family, uint8_t prefixLen,
+                      size_t* offset) {
+        constexpr uint8_t condLen = offsetof(Condition<Addr>, reject);
+        constexpr uint8_t jmpLen = sizeof(inet_diag_bc_op);
+        // Jumping exactly this far past the end of the program rejects the socket.
+        constexpr uint16_t rejectOffset = sizeof(inet_diag_bc_op);
+        const uint16_t remaining = sizeof(mBytecode) - *offset - condLen;
+
+        c->op = {code, condLen, condLen + jmpLen};
+        c->cond = {family, prefixLen, -1};
+        c->reject = {INET_DIAG_BC_JMP, jmpLen, static_cast<uint16_t>(remaining + rejectOffset)};
+        *offset += sizeof(*c);
+    }
+};
+
+// A SOCK_DIAG bytecode program that rejects sockets without a mark. Needs CAP_NET_ADMIN, and a
+// 4.17 or later kernel, which rejects the program with EINVAL otherwise.
+class MarkedFilter {
+  public:
+    MarkedFilter() {
+        constexpr uint8_t condLen = offsetof(Bytecode, reject);
+        constexpr uint8_t jmpLen = sizeof(inet_diag_bc_op);
+        // As in LoopbackFilter, a matching condition leads to a JMP that rejects the socket by
+        // jumping past the end, and a failing one leads to the end, which accepts it.
+        mBytecode.op = {INET_DIAG_BC_MARK_COND, condLen, condLen + jmpLen};
+        mBytecode.cond = {.mark = 0, .mask = UINT32_MAX};
+        mBytecode.reject = {INET_DIAG_BC_JMP, jmpLen, jmpLen + sizeof(inet_diag_bc_op)};
+
+        mNla.nla_len = sizeof(mNla) + sizeof(mBytecode);
+        mNla.nla_type = INET_DIAG_REQ_BYTECODE;
+    }
+
+    // The iovecs to append to a dump request.
+    iovec nla() { return {&mNla, sizeof(mNla)}; }
+    iovec bytecode() { return {&mBytecode, sizeof(mBytecode)}; }
+
+    // Set once the kernel has rejected the program, so that later dumps do not try it again.
+    static std::atomic_bool sUnsupported;
+
+  private:
+    struct Bytecode {
+        inet_diag_bc_op op;
+        inet_diag_markcond cond;
+        inet_diag_bc_op reject;
+    } __attribute__((__packed__)) mBytecode;
+    nlattr mNla;
+};
+
+std::atomic_bool MarkedFilter::sUnsupported(false);
+
 }  // namespace
 
 bool SockDiag::open() {
@@ -107,8 +225,35 @@ bool SockDiag::open() {
     return true;
 }
 
+int SockDiag::openTcpDestroyListener() {
+    const int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                            NETLINK_INET_DIAG);
+    if (sock == -1) {
+        return -errno;
+    }
+
+    sockaddr_nl nl = { .nl_family = AF_NETLINK };
+    if (bind(sock, reinterpret_cast<sockaddr *>(&nl), sizeof(nl)) == -1) {
+        const int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    for (const int group : {SKNLGRP_INET_TCP_DESTROY, SKNLGRP_INET6_TCP_DESTROY}) {
+        if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) == -1) {
+            const int ret = -errno;
+            close(sock);
+            return ret;
+        }
+    }
+
+    return sock;
+}
+
 int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, uint8_t extensions, uint32_t states,
                               iovec *iov, int iovcnt) {
+    RpcStats::ScopedOp op(RpcStats::Op::SOCK_DIAG);
+    ScopedTrace trace("sock_diag dump proto=%u family=%u", proto, family);
+    sDumps.inc();
     struct {
         nlmsghdr nlh;
         inet_diag_req_v2 req;
@@ -219,44 +364,36 @@ int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr
     return sendDumpRequest(proto, family, 0, states, iov, ARRAY_SIZE(iov));
 }
 
-int SockDiag::readDiagMsg(uint8_t proto, const SockDiag::DestroyFilter& shouldDestroy) {
-    NetlinkDumpCallback callback = [this, proto, shouldDestroy] (nlmsghdr *nlh) {
-        const inet_diag_msg *msg = reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
-        if (shouldDestroy(proto, msg)) {
-            sockDestroy(proto, msg);
+template <typename Filter>
+int SockDiag::destroyMatching(uint8_t proto, const Filter& shouldDestroy) {
+    RpcStats::ScopedOp op(RpcStats::Op::SOCK_DIAG);
+    ScopedTrace trace("sock_diag destroy proto=%u", proto);
+    FlightRecorder::Scope record(FlightRecorder::Event::SOCK_DIAG_DESTROY, proto);
+    const int destroyedBefore = mSocketsDestroyed;
+    const int ret = forEach([this, proto, &shouldDestroy](const DiagMsgView& sock) {
+        if (shouldDestroy(proto, sock.msg())) {
+            queueDestroy(proto, sock.msg());
         }
-    };
+    });
+    flushDestroys();
+    record.setArgs(proto, mSocketsDestroyed - destroyedBefore);
+    record.setResult(ret);
+    return ret;
+}
 
-    return processNetlinkDump(mSock, callback);
+int SockDiag::readDiagMsg(uint8_t proto, const SockDiag::DestroyFilter& shouldDestroy) {
+    return destroyMatching(proto, shouldDestroy);
 }
 
 int SockDiag::readDiagMsgWithTcpInfo(const TcpInfoReader& tcpInfoReader) {
-    NetlinkDumpCallback callback = [tcpInfoReader] (nlmsghdr *nlh) {
-        if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY) {
-            ALOGE("expected nlmsg_type=SOCK_DIAG_BY_FAMILY, got nlmsg_type=%d", nlh->nlmsg_type);
-            return;
-        }
-        Fwmark mark;
-        struct tcp_info *tcpinfo = nullptr;
+    RpcStats::ScopedOp op(RpcStats::Op::SOCK_DIAG);
+    ScopedTrace trace("sock_diag tcp_info");
+    return forEach([&tcpInfoReader](const DiagMsgView& sock) {
         uint32_t tcpinfoLength = 0;
-        inet_diag_msg *msg = reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
-        uint32_t attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
-        struct rtattr *attr = reinterpret_cast<struct rtattr*>(msg+1);
-        while (RTA_OK(attr, attr_len)) {
-            if (attr->rta_type == INET_DIAG_INFO) {
-                tcpinfo = reinterpret_cast<struct tcp_info*>(RTA_DATA(attr));
-                tcpinfoLength = RTA_PAYLOAD(attr);
-            }
-            if (attr->rta_type == INET_DIAG_MARK) {
-                mark.intValue = *reinterpret_cast<uint32_t*>(RTA_DATA(attr));
-            }
-            attr = RTA_NEXT(attr, attr_len);
-        }
-
-        tcpInfoReader(mark, msg, tcpinfo, tcpinfoLength);
-    };
-
-    return processNetlinkDump(mSock, callback);
+        const void* tcpinfo = sock.attr(INET_DIAG_INFO, &tcpinfoLength);
+        tcpInfoReader(sock.mark(), sock.msg(), static_cast<const struct tcp_info*>(tcpinfo),
+                      tcpinfoLength);
+    });
 }
 
 // Determines whether a socket is a loopback socket. Does not check socket state.
@@ -309,6 +446,69 @@ int SockDiag::sockDestroy(uint8_t proto, const inet_diag_msg *msg) {
     return ret;
 }
 
+void SockDiag::queueDestroy(uint8_t proto, const inet_diag_msg* msg) {
+    if (msg == nullptr) {
+        return;
+    }
+
+    mPendingDestroys.push_back({
+        .nlh = {
+            .nlmsg_len = sizeof(DestroyRequest),
+            .nlmsg_type = SOCK_DESTROY,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+            .nlmsg_seq = static_cast<uint32_t>(mPendingDestroys.size() + 1),
+        },
+        .req = {
+            .sdiag_family = msg->idiag_family,
+            .sdiag_protocol = proto,
+            .idiag_states = (uint32_t) (1 << msg->idiag_state),
+            .id = msg->id,
+        },
+    });
+    if (mPendingDestroys.size() >= kMaxDestroysPerSend) {
+        flushDestroys();
+    }
+}
+
+void SockDiag::flushDestroys() {
+    static_assert(sizeof(DestroyRequest) == NLMSG_ALIGN(sizeof(DestroyRequest)),
+                  "DestroyRequests must be packed back to back");
+    const size_t count = mPendingDestroys.size();
+    if (count == 0) {
+        return;
+    }
+    const size_t len = count * sizeof(DestroyRequest);
+    const ssize_t written = write(mWriteSock, mPendingDestroys.data(), len);
+    mPendingDestroys.clear();
+    if (written != (ssize_t) len) {
+        ALOGE("Failed to send %zu SOCK_DESTROY requests: %s", count, strerror(errno));
+        return;
+    }
+
+    // The kernel processes the requests while they are being written, so every ACK is already
+    // queued. Never block: if some ACKs were dropped, there is nothing to wait for.
+    size_t acked = 0;
+    char buf[kNetlinkDumpBufferSize];
+    while (acked < count) {
+        const ssize_t bytesread = recv(mWriteSock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (bytesread <= 0) {
+            ALOGE("Missing %zu SOCK_DESTROY ACKs: %s", count - acked,
+                  bytesread ? strerror(errno) : "EOF");
+            return;
+        }
+        uint32_t msglen = bytesread;
+        for (nlmsghdr* nlh = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(nlh, msglen);
+             nlh = NLMSG_NEXT(nlh, msglen)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_seq == 0 || nlh->nlmsg_seq > count ||
+                nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+                continue;
+            }
+            ++acked;
+            if (reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nlh))->error == 0) mSocketsDestroyed++;
+        }
+    }
+}
+
 int SockDiag::destroySockets(uint8_t proto, int family, const char* addrstr, int ifindex) {
     if (!hasSocks()) {
         return -EBADFD;
@@ -323,27 +523,35 @@ int SockDiag::destroySockets(uint8_t proto, int family, const char* addrstr, int
         return ifindex == 0 || ifindex == (int)msg->id.idiag_if;
     };
 
-    return readDiagMsg(proto, shouldDestroy);
+    return destroyMatching(proto, shouldDestroy);
 }
 
 int SockDiag::destroySockets(const char* addrstr, int ifindex) {
+    ScopedTrace trace("destroySockets addr=%s ifindex=%d", addrstr, ifindex);
     Stopwatch s;
     mSocketsDestroyed = 0;
 
     std::string where = addrstr;
     if (ifindex) where += StringPrintf(" ifindex %d", ifindex);
 
-    if (!strchr(addrstr, ':')) {  // inet_ntop never returns something like ::ffff:192.0.2.1
-        if (int ret = destroySockets(IPPROTO_TCP, AF_INET, addrstr, ifindex)) {
-            ALOGE("Failed to destroy IPv4 sockets on %s: %s", where.c_str(), strerror(-ret));
+    auto destroyer = [addrstr, ifindex, &where](SockDiag* sd, int family) {
+        if (int ret = sd->destroySockets(IPPROTO_TCP, family, addrstr, ifindex)) {
+            ALOGE("Failed to destroy %s sockets on %s: %s", family == AF_INET ? "IPv4" : "IPv6",
+                  where.c_str(), strerror(-ret));
             return ret;
         }
-    }
-    if (int ret = destroySockets(IPPROTO_TCP, AF_INET6, addrstr, ifindex)) {
-        ALOGE("Failed to destroy IPv6 sockets on %s: %s", where.c_str(), strerror(-ret));
+        return 0;
+    };
+
+    // inet_ntop never returns something like ::ffff:192.0.2.1
+    const int ret = strchr(addrstr, ':') ? destroyPerFamily({AF_INET6}, destroyer)
+                                         : destroyPerFamily({AF_INET, AF_INET6}, destroyer);
+    if (ret) {
         return ret;
     }
 
+    traceCounter("sockets destroyed", mSocketsDestroyed);
+    sSocketsDestroyed.inc(mSocketsDestroyed);
     if (mSocketsDestroyed > 0) {
         ALOGI("Destroyed %d sockets on %s in %" PRId64 "us", mSocketsDestroyed, where.c_str(),
               s.timeTakenUs());
@@ -352,43 +560,116 @@ int SockDiag::destroySockets(const char* addrstr, int ifindex) {
     return mSocketsDestroyed;
 }
 
-int SockDiag::destroyLiveSockets(const DestroyFilter& destroyFilter, const char *what,
+int SockDiag::destroyPerFamily(std::initializer_list<int> families,
+                               const FamilyDestroyer& destroyer) {
+    if (!mParallel || families.size() < 2) {
+        for (const int family : families) {
+            if (int ret = destroyer(this, family)) return ret;
+        }
+        return 0;
+    }
+
+    // The first family runs on this thread and this object's sockets, the others on their own.
+    struct Result {
+        int ret;
+        int socketsDestroyed;
+    };
+    std::vector<std::future<Result>> others;
+    const size_t dumpBufferSize = mDumpBuffer.size();
+    if (mPeers.size() < families.size() - 1) mPeers.resize(families.size() - 1);
+    for (size_t i = 1; i < families.size(); ++i) {
+        std::unique_ptr<SockDiag>& peer = mPeers[i - 1];
+        if (peer == nullptr) peer = std::make_unique<SockDiag>(dumpBufferSize);
+        others.push_back(std::async(std::launch::async, [&destroyer, family = families.begin()[i],
+                                                         sd = peer.get()] {
+            if (!sd->isOpen() && !sd->open()) {
+                return Result{-EBADFD, 0};
+            }
+            sd->mSocketsDestroyed = 0;
+            const int ret = destroyer(sd, family);
+            return Result{ret, sd->mSocketsDestroyed};
+        }));
+    }
+
+    int ret = destroyer(this, *families.begin());
+    for (auto& other : others) {
+        const Result result = other.get();
+        mSocketsDestroyed += result.socketsDestroyed;
+        if (!ret) ret = result.ret;
+    }
+    return ret;
+}
+
+template <typename Filter>
+int SockDiag::destroyLiveSockets(const Filter& destroyFilter, const char *what,
                                  iovec *iov, int iovcnt) {
     const int proto = IPPROTO_TCP;
     const uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
+    const std::vector<iovec> filter(iov, iov + iovcnt);
 
-    for (const int family : {AF_INET, AF_INET6}) {
+    return destroyPerFamily({AF_INET, AF_INET6}, [&](SockDiag* sd, int family) {
         const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
-        if (int ret = sendDumpRequest(proto, family, 0, states, iov, iovcnt)) {
+        // sendDumpRequest() stores the request header in the first iovec, so each family needs
+        // its own copy.
+        std::vector<iovec> familyIov(filter);
+        if (int ret = sd->sendDumpRequest(proto, family, 0, states, familyIov.data(),
+                                          familyIov.size())) {
             ALOGE("Failed to dump %s sockets for %s: %s", familyName, what, strerror(-ret));
             return ret;
         }
-        if (int ret = readDiagMsg(proto, destroyFilter)) {
+        if (int ret = sd->destroyMatching(proto, destroyFilter)) {
             ALOGE("Failed to destroy %s sockets for %s: %s", familyName, what, strerror(-ret));
             return ret;
         }
-    }
-
-    return 0;
+        return 0;
+    });
 }
 
-int SockDiag::getLiveTcpInfos(const TcpInfoReader& tcpInfoReader) {
+int SockDiag::sendLiveTcpInfoDumpRequest(int family, bool markedOnly) {
     const int proto = IPPROTO_TCP;
     const uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
     const uint8_t extensions = (1 << INET_DIAG_MEMINFO); // flag for dumping struct tcp_info.
 
+    if (markedOnly && !MarkedFilter::sUnsupported.load(std::memory_order_relaxed)) {
+        MarkedFilter markedFilter;
+        iovec iov[] = {
+            { nullptr, 0 },
+            markedFilter.nla(),
+            markedFilter.bytecode(),
+        };
+        const int ret = sendDumpRequest(proto, family, extensions, states, iov, ARRAY_SIZE(iov));
+        if (ret != -EINVAL && ret != -EPERM) {
+            if (ret) {
+                ALOGE("Failed to dump %s sockets struct tcp_info: %s",
+                      (family == AF_INET) ? "IPv4" : "IPv6", strerror(-ret));
+            }
+            return ret;
+        }
+        ALOGI("Kernel cannot filter sock_diag dumps by mark (%s), dumping unmarked sockets too",
+              strerror(-ret));
+        MarkedFilter::sUnsupported.store(true, std::memory_order_relaxed);
+    }
+
     iovec iov[] = {
         { nullptr, 0 },
     };
 
+    if (int ret = sendDumpRequest(proto, family, extensions, states, iov, ARRAY_SIZE(iov))) {
+        ALOGE("Failed to dump %s sockets struct tcp_info: %s",
+              (family == AF_INET) ? "IPv4" : "IPv6", strerror(-ret));
+        return ret;
+    }
+    return 0;
+}
+
+int SockDiag::getLiveTcpInfos(const TcpInfoReader& tcpInfoReader) {
     for (const int family : {AF_INET, AF_INET6}) {
-        const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
-        if (int ret = sendDumpRequest(proto, family, extensions, states, iov, ARRAY_SIZE(iov))) {
-            ALOGE("Failed to dump %s sockets struct tcp_info: %s", familyName, strerror(-ret));
+        if (int ret = sendLiveTcpInfoDumpRequest(family, false)) {
             return ret;
         }
         if (int ret = readDiagMsgWithTcpInfo(tcpInfoReader)) {
-            ALOGE("Failed to read %s sockets struct tcp_info: %s", familyName, strerror(-ret));
+            ALOGE("Failed to read %s sockets struct tcp_info: %s",
+                  (family == AF_INET) ? "IPv4" : "IPv6", strerror(-ret));
             return ret;
         }
     }
@@ -397,6 +678,7 @@ int SockDiag::getLiveTcpInfos(const TcpInfoReader& tcpInfoReader) {
 }
 
 int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopback) {
+    ScopedTrace trace("destroySockets uid=%u", uid);
     mSocketsDestroyed = 0;
     Stopwatch s;
 
@@ -406,19 +688,36 @@ int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopbac
                !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    for (const int family : {AF_INET, AF_INET6}) {
+    LoopbackFilter loopbackFilter;
+    iovec iov[] = {
+        { nullptr, 0 },
+        loopbackFilter.nla(),
+        loopbackFilter.bytecode(),
+    };
+    const std::vector<iovec> filter(iov, iov + (excludeLoopback ? ARRAY_SIZE(iov) : 1));
+
+    int ret = destroyPerFamily({AF_INET, AF_INET6}, [&](SockDiag* sd, int family) {
         const char *familyName = family == AF_INET ? "IPv4" : "IPv6";
         uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
-        if (int ret = sendDumpRequest(proto, family, states)) {
+        // sendDumpRequest() stores the request header in the first iovec.
+        std::vector<iovec> familyIov(filter);
+        if (int ret = sd->sendDumpRequest(proto, family, 0, states, familyIov.data(),
+                                          familyIov.size())) {
             ALOGE("Failed to dump %s sockets for UID: %s", familyName, strerror(-ret));
             return ret;
         }
-        if (int ret = readDiagMsg(proto, shouldDestroy)) {
+        if (int ret = sd->destroyMatching(proto, shouldDestroy)) {
             ALOGE("Failed to destroy %s sockets for UID: %s", familyName, strerror(-ret));
             return ret;
         }
+        return 0;
+    });
+    if (ret) {
+        return ret;
     }
 
+    traceCounter("sockets destroyed", mSocketsDestroyed);
+    sSocketsDestroyed.inc(mSocketsDestroyed);
     if (mSocketsDestroyed > 0) {
         ALOGI("Destroyed %d sockets for UID in %" PRId64 "us", mSocketsDestroyed, s.timeTakenUs());
     }
@@ -428,25 +727,36 @@ int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopbac
 
 int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>& skipUids,
                              bool excludeLoopback) {
+    ScopedTrace trace("destroySockets uidRanges=%zu skipUids=%zu", uidRanges.getRanges().size(),
+                      skipUids.size());
     mSocketsDestroyed = 0;
     Stopwatch s;
 
+    const int adbPort = getAdbPort();
     auto shouldDestroy = [&] (uint8_t, const inet_diag_msg *msg) {
         return msg != nullptr &&
                uidRanges.hasUid(msg->idiag_uid) &&
                skipUids.find(msg->idiag_uid) == skipUids.end() &&
                !(excludeLoopback && isLoopbackSocket(msg)) &&
-               !isAdbSocket(msg, getAdbPort());
+               !isAdbSocket(msg, adbPort);
     };
 
+    // The kernel has no UID condition, but it can leave out loopback sockets before they are
+    // copied to us.
+    LoopbackFilter loopbackFilter;
     iovec iov[] = {
         { nullptr, 0 },
+        loopbackFilter.nla(),
+        loopbackFilter.bytecode(),
     };
+    const int iovcnt = excludeLoopback ? ARRAY_SIZE(iov) : 1;
 
-    if (int ret = destroyLiveSockets(shouldDestroy, "UID", iov, ARRAY_SIZE(iov))) {
+    if (int ret = destroyLiveSockets(shouldDestroy, "UID", iov, iovcnt)) {
         return ret;
     }
 
+    traceCounter("sockets destroyed", mSocketsDestroyed);
+    sSocketsDestroyed.inc(mSocketsDestroyed);
     if (mSocketsDestroyed > 0) {
         ALOGI("Destroyed %d sockets for %s skip={%s} in %" PRId64 "us", mSocketsDestroyed,
               uidRanges.toString().c_str(), android::base::Join(skipUids, " ").c_str(),
@@ -529,6 +839,7 @@ int SockDiag::destroySocketsLackingPermission(unsigned netId, Permission permiss
         { &bytecode, bytecodelen },
     };
 
+    ScopedTrace trace("destroySocketsLackingPermission netId=%u permission=%d", netId, permission);
     mSocketsDestroyed = 0;
     Stopwatch s;
 
@@ -540,6 +851,8 @@ int SockDiag::destroySocketsLackingPermission(unsigned netId, Permission permiss
         return ret;
     }
 
+    traceCounter("sockets destroyed", mSocketsDestroyed);
+    sSocketsDestroyed.inc(mSocketsDestroyed);
     if (mSocketsDestroyed > 0) {
         ALOGI("Destroyed %d sockets for netId %d permission=%d in %" PRId64 "us", mSocketsDestroyed,
               netId, permission, s.timeTakenUs());
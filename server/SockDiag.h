@@ -17,15 +17,25 @@
 #ifndef _SOCK_DIAG_H
 #define _SOCK_DIAG_H
 
+#include <errno.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include <linux/netlink.h>
 #include <linux/sock_diag.h>
 #include <linux/inet_diag.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include <cstddef>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <set>
+#include <vector>
 
 #include "Fwmark.h"
 #include "NetlinkCommands.h"
@@ -38,10 +48,103 @@ struct tcp_info;
 namespace android {
 namespace net {
 
+// One message of a SOCK_DIAG dump. Points into the buffer the dump was read into, so it is only
+// valid until the next datagram of the dump is read.
+class DiagMsgView {
+  public:
+    explicit DiagMsgView(const nlmsghdr* nlh) : mNlh(nlh) {}
+
+    uint16_t type() const { return mNlh->nlmsg_type; }
+    const nlmsghdr* nlh() const { return mNlh; }
+    const inet_diag_msg* msg() const {
+        return reinterpret_cast<const inet_diag_msg*>(NLMSG_DATA(mNlh));
+    }
+
+    // Returns the payload of the first INET_DIAG_* attribute of the specified type, or nullptr if
+    // there is none. If |len| is not null, stores the length of the payload there.
+    const void* attr(uint16_t attrType, uint32_t* len = nullptr) const {
+        uint32_t attrLen = mNlh->nlmsg_len - NLMSG_LENGTH(sizeof(inet_diag_msg));
+        for (const rtattr* rta = reinterpret_cast<const rtattr*>(msg() + 1); RTA_OK(rta, attrLen);
+             rta = RTA_NEXT(rta, attrLen)) {
+            if (rta->rta_type == attrType) {
+                if (len != nullptr) *len = RTA_PAYLOAD(rta);
+                return RTA_DATA(rta);
+            }
+        }
+        return nullptr;
+    }
+
+    // The socket's mark, or an empty mark if the dump did not include INET_DIAG_MARK.
+    Fwmark mark() const {
+        Fwmark mark;
+        uint32_t len = 0;
+        const void* data = attr(INET_DIAG_MARK, &len);
+        if (data != nullptr && len >= sizeof(mark.intValue)) {
+            memcpy(&mark.intValue, data, sizeof(mark.intValue));
+        }
+        return mark;
+    }
+
+  private:
+    const nlmsghdr* mNlh;
+};
+
+// The messages of one datagram of a SOCK_DIAG dump, as a range of DiagMsgViews.
+class DiagMsgRange {
+  public:
+    class iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = DiagMsgView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = DiagMsgView;
+
+        iterator() : mNlh(nullptr), mLen(0) {}
+        iterator(const void* data, uint32_t len)
+            : mNlh(static_cast<const nlmsghdr*>(data)), mLen(len) {
+            if (!NLMSG_OK(mNlh, mLen)) mNlh = nullptr;
+        }
+
+        DiagMsgView operator*() const { return DiagMsgView(mNlh); }
+        iterator& operator++() {
+            mNlh = NLMSG_NEXT(mNlh, mLen);
+            if (!NLMSG_OK(mNlh, mLen)) mNlh = nullptr;
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+        bool operator==(const iterator& other) const { return mNlh == other.mNlh; }
+        bool operator!=(const iterator& other) const { return mNlh != other.mNlh; }
+
+      private:
+        const nlmsghdr* mNlh;
+        uint32_t mLen;
+    };
+
+    DiagMsgRange(const void* data, size_t len) : mData(data), mLen(len) {}
+
+    iterator begin() const { return iterator(mData, mLen); }
+    iterator end() const { return iterator(); }
+
+  private:
+    const void* mData;
+    uint32_t mLen;
+};
+
 class SockDiag {
 
   public:
-    static const int kBufferSize = 4096;
+    // The default size of the buffer that dumps are read into. Netlink sizes dump datagrams by
+    // the largest read seen on the socket, up to 32 KiB.
+    static constexpr size_t kDefaultDumpBufferSize = 32768;
+
+    // SOCK_DESTROY requests queued during a dump are sent this many per write(), and their ACKs
+    // are collected afterwards. Bounded so that the ACKs always fit in the socket's receive buffer.
+    static constexpr size_t kMaxDestroysPerSend = 64;
 
     // Callback function that is called once for every socket in the sockDestroy dump.
     // A return value of true means destroy the socket.
@@ -59,15 +162,29 @@ class SockDiag {
         inet_diag_req_v2 req;
     } __attribute__((__packed__));
 
-    SockDiag() : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0) {}
+    explicit SockDiag(size_t dumpBufferSize = kDefaultDumpBufferSize)
+        : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0), mParallel(false),
+          mDumpBuffer(dumpBufferSize) {}
     bool open();
+    bool isOpen() { return hasSocks(); }
     virtual ~SockDiag() { closeSocks(); }
 
+    // In parallel mode, the destroySockets*() methods dump and destroy each address family on its
+    // own pair of netlink sockets and its own thread, instead of one family after the other. This
+    // shortens the time it takes to abort every socket when a network goes away.
+    void setParallel(bool parallel) { mParallel = parallel; }
+
     int sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states);
     int sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr);
     int readDiagMsg(uint8_t proto, const DestroyFilter& callback);
     int readDiagMsgWithTcpInfo(const TcpInfoReader& callback);
 
+    // Calls |fn| with a DiagMsgView for every socket in the dump requested by the last
+    // sendDumpRequest(). Unlike the std::function callbacks above, |fn| can be inlined. Returns 0
+    // or a negative errno.
+    template <typename Fn>
+    int forEach(Fn&& fn);
+
     int sockDestroy(uint8_t proto, const inet_diag_msg *);
     // Destroys all sockets on the given IPv4 or IPv6 address.
     int destroySockets(const char* addrstr, int ifindex);
@@ -81,23 +198,120 @@ class SockDiag {
     int destroySocketsLackingPermission(unsigned netId, Permission permission,
                                         bool excludeLoopback);
 
+    // Opens a non-blocking socket subscribed to the kernel's notifications of destroyed IPv4 and
+    // IPv6 TCP sockets. Each notification is a SOCK_DIAG_BY_FAMILY message with the socket's cookie
+    // and its final INET_DIAG_INFO, but without mark or UID. Returns the socket, or -errno.
+    static int openTcpDestroyListener();
+    // Reads every notification pending on |sock| into |buffer| and calls |fn| with a DiagMsgView
+    // for each. Returns 0 once none are left, or -errno. -ENOBUFS means that some notifications
+    // were dropped because the socket's receive buffer was full.
+    template <typename Fn>
+    static int drainNotifications(int sock, std::vector<uint8_t>* buffer, Fn&& fn);
+
     // Dump struct tcp_info for all "live" (CONNECTED, SYN_SENT, SYN_RECV) TCP sockets.
     int getLiveTcpInfos(const TcpInfoReader& sockInfoReader);
+    // Like getLiveTcpInfos(), but calls |fn| with a DiagMsgView that has INET_DIAG_INFO and
+    // INET_DIAG_MARK attributes. If |markedOnly|, the kernel leaves out sockets without a mark,
+    // where it supports filtering by mark; |fn| may still see some on older kernels.
+    template <typename Fn>
+    int forEachLiveTcpSocket(Fn&& fn, bool markedOnly = false);
 
   private:
     friend class SockDiagTest;
     int mSock;
     int mWriteSock;
     int mSocketsDestroyed;
+    bool mParallel;
+    // Reused by every dump, and grown if a datagram does not fit.
+    std::vector<uint8_t> mDumpBuffer;
+    // SOCK_DESTROY requests not yet sent.
+    std::vector<DestroyRequest> mPendingDestroys;
+    // In parallel mode, the objects that dump the second and later families. Kept open so that
+    // repeated calls reuse their sockets.
+    std::vector<std::unique_ptr<SockDiag>> mPeers;
     int sendDumpRequest(uint8_t proto, uint8_t family, uint8_t extensions, uint32_t states,
                         iovec *iov, int iovcnt);
     int destroySockets(uint8_t proto, int family, const char* addrstr, int ifindex);
-    int destroyLiveSockets(const DestroyFilter& destroy, const char *what, iovec *iov, int iovcnt);
+    // Sends a dump request for "live" TCP sockets of |family| with struct tcp_info, only for marked
+    // sockets if |markedOnly| and the kernel can filter by mark.
+    int sendLiveTcpInfoDumpRequest(int family, bool markedOnly);
+    // Like readDiagMsg(), but lets the compiler inline |shouldDestroy|.
+    template <typename Filter>
+    int destroyMatching(uint8_t proto, const Filter& shouldDestroy);
+    template <typename Filter>
+    int destroyLiveSockets(const Filter& destroy, const char *what, iovec *iov, int iovcnt);
+    // Dumps and destroys the sockets of one address family using the specified SockDiag, which is
+    // either this object or, in parallel mode, one opened for the family.
+    typedef std::function<int(SockDiag* sd, int family)> FamilyDestroyer;
+    // Runs |destroyer| for each of |families|, adds up the sockets destroyed in mSocketsDestroyed,
+    // and returns the first error. In parallel mode, the families run concurrently.
+    int destroyPerFamily(std::initializer_list<int> families, const FamilyDestroyer& destroyer);
+    // Queues a SOCK_DESTROY request for the socket described by |msg|, sending the queue if it is
+    // full.
+    void queueDestroy(uint8_t proto, const inet_diag_msg* msg);
+    // Sends all queued SOCK_DESTROY requests in one write() and counts the sockets destroyed.
+    void flushDestroys();
     bool hasSocks() { return mSock != -1 && mWriteSock != -1; }
     void closeSocks() { close(mSock); close(mWriteSock); mSock = mWriteSock = -1; }
     static bool isLoopbackSocket(const inet_diag_msg *msg);
 };
 
+template <typename Fn>
+int SockDiag::forEach(Fn&& fn) {
+    while (true) {
+        const ssize_t len = recvNetlinkDatagram(mSock, &mDumpBuffer);
+        if (len <= 0) {
+            return static_cast<int>(len);
+        }
+        for (const DiagMsgView sock : DiagMsgRange(mDumpBuffer.data(), len)) {
+            switch (sock.type()) {
+                case NLMSG_DONE:
+                    return 0;
+                case NLMSG_ERROR:
+                    return reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(sock.nlh()))->error;
+                case SOCK_DIAG_BY_FAMILY:
+                    fn(sock);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+template <typename Fn>
+int SockDiag::drainNotifications(int sock, std::vector<uint8_t>* buffer, Fn&& fn) {
+    int ret = 0;
+    while (true) {
+        const ssize_t len = recvNetlinkDatagram(sock, buffer);
+        if (len == -EAGAIN) {
+            return ret;
+        } else if (len == -ENOBUFS) {
+            // The datagrams still queued are intact, so keep reading.
+            ret = -ENOBUFS;
+            continue;
+        } else if (len <= 0) {
+            return static_cast<int>(len);
+        }
+        for (const DiagMsgView msg : DiagMsgRange(buffer->data(), len)) {
+            if (msg.type() == SOCK_DIAG_BY_FAMILY) fn(msg);
+        }
+    }
+}
+
+template <typename Fn>
+int SockDiag::forEachLiveTcpSocket(Fn&& fn, bool markedOnly) {
+    for (const int family : {AF_INET, AF_INET6}) {
+        if (int ret = sendLiveTcpInfoDumpRequest(family, markedOnly)) {
+            return ret;
+        }
+        if (int ret = forEach(fn)) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 }  // namespace net
 }  // namespace android
 
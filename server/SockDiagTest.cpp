@@ -22,6 +22,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <linux/inet_diag.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 #include <netdutils/NetNativeTestBase.h>
@@ -181,6 +182,127 @@ TEST_F(SockDiagTest, TestDump) {
     close(accepted6);
 }
 
+TEST_F(SockDiagTest, TestForEachLiveTcpSocket) {
+    int listensocket = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, listensocket) << "Failed to open listen socket: " << strerror(errno);
+    uint16_t port = bindAndListen(listensocket);
+    ASSERT_NE(0, port) << "Can't bind to server port";
+
+    int client = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, client) << "Failed to open IPv6 socket: " << strerror(errno);
+    Fwmark fwmark;
+    fwmark.netId = 42;
+    fwmark.explicitlySelected = true;
+    ASSERT_EQ(0, setsockopt(client, SOL_SOCKET, SO_MARK, &fwmark.intValue,
+                            sizeof(fwmark.intValue)));
+    sockaddr_in6 server = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+    ASSERT_EQ(0, connect(client, (sockaddr *) &server, sizeof(server)))
+        << "IPv6 connect failed: " << strerror(errno);
+    sockaddr_in6 clientAddr;
+    socklen_t clientlen = sizeof(clientAddr);
+    int accepted = accept4(listensocket, (sockaddr *) &clientAddr, &clientlen, SOCK_CLOEXEC);
+    ASSERT_NE(-1, accepted);
+
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+
+    int clientSeen = 0;
+    int ret = sd.forEachLiveTcpSocket([&](const DiagMsgView& sock) {
+        if (sock.msg()->id.idiag_sport != clientAddr.sin6_port) return;
+        clientSeen++;
+        EXPECT_EQ(fwmark.intValue, sock.mark().intValue);
+        uint32_t tcpinfoLen = 0;
+        EXPECT_NE(nullptr, sock.attr(INET_DIAG_INFO, &tcpinfoLen));
+        EXPECT_LT(0U, tcpinfoLen);
+    });
+    EXPECT_EQ(0, ret) << strerror(-ret);
+    EXPECT_EQ(1, clientSeen);
+
+    close(client);
+    close(accepted);
+    close(listensocket);
+}
+
+TEST_F(SockDiagTest, TestForEachLiveTcpSocketMarkedOnly) {
+    int listensocket = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, listensocket) << "Failed to open listen socket: " << strerror(errno);
+    uint16_t port = bindAndListen(listensocket);
+    ASSERT_NE(0, port) << "Can't bind to server port";
+    sockaddr_in6 server = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+
+    int marked = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int unmarked = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, marked) << "Failed to open IPv6 socket: " << strerror(errno);
+    ASSERT_NE(-1, unmarked) << "Failed to open IPv6 socket: " << strerror(errno);
+    Fwmark fwmark;
+    fwmark.netId = 42;
+    ASSERT_EQ(0, setsockopt(marked, SOL_SOCKET, SO_MARK, &fwmark.intValue,
+                            sizeof(fwmark.intValue)));
+    sockaddr_in6 markedAddr, unmarkedAddr;
+    for (auto [fd, addr] : {std::pair{marked, &markedAddr}, std::pair{unmarked, &unmarkedAddr}}) {
+        ASSERT_EQ(0, connect(fd, (sockaddr *) &server, sizeof(server)))
+            << "IPv6 connect failed: " << strerror(errno);
+        socklen_t addrlen = sizeof(*addr);
+        ASSERT_EQ(0, getsockname(fd, (sockaddr *) addr, &addrlen));
+    }
+
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+
+    int markedSeen = 0;
+    int unmarkedSeen = 0;
+    int ret = sd.forEachLiveTcpSocket([&](const DiagMsgView& sock) {
+        if (sock.msg()->id.idiag_sport == markedAddr.sin6_port) markedSeen++;
+        if (sock.msg()->id.idiag_sport == unmarkedAddr.sin6_port) unmarkedSeen++;
+    }, /* markedOnly= */ true);
+    EXPECT_EQ(0, ret) << strerror(-ret);
+    EXPECT_EQ(1, markedSeen);
+    EXPECT_EQ(0, unmarkedSeen);
+
+    close(marked);
+    close(unmarked);
+    close(listensocket);
+}
+
+TEST_F(SockDiagTest, TestTcpDestroyListener) {
+    const int listener = SockDiag::openTcpDestroyListener();
+    ASSERT_LE(0, listener) << "Failed to open destroy listener: " << strerror(-listener);
+
+    int listensocket = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, listensocket) << "Failed to open listen socket: " << strerror(errno);
+    uint16_t port = bindAndListen(listensocket);
+    ASSERT_NE(0, port) << "Can't bind to server port";
+    int client = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_NE(-1, client) << "Failed to open IPv6 socket: " << strerror(errno);
+    sockaddr_in6 server = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+    ASSERT_EQ(0, connect(client, (sockaddr *) &server, sizeof(server)))
+        << "IPv6 connect failed: " << strerror(errno);
+    sockaddr_in6 clientAddr;
+    socklen_t clientlen = sizeof(clientAddr);
+    int accepted = accept4(listensocket, (sockaddr *) &clientAddr, &clientlen, SOCK_CLOEXEC);
+    ASSERT_NE(-1, accepted);
+
+    close(client);
+    close(accepted);
+    close(listensocket);
+
+    // The kernel frees the sockets asynchronously.
+    std::vector<uint8_t> buffer;
+    bool seenClient = false;
+    for (int i = 0; i < 100 && !seenClient; i++) {
+        usleep(10 * 1000);
+        int ret = SockDiag::drainNotifications(listener, &buffer, [&](const DiagMsgView& sock) {
+            if (sock.msg()->id.idiag_sport != clientAddr.sin6_port) return;
+            seenClient = true;
+            EXPECT_NE(nullptr, sock.attr(INET_DIAG_INFO));
+        });
+        ASSERT_EQ(0, ret) << strerror(-ret);
+    }
+    EXPECT_TRUE(seenClient);
+
+    close(listener);
+}
+
 bool fillDiagAddr(__be32 addr[4], const sockaddr *sa) {
     switch (sa->sa_family) {
         case AF_INET: {
@@ -451,9 +573,11 @@ protected:
             << msg << ": unexpected error: " << strerror(err);
         return (err == ECONNABORTED);  // Return true iff. SOCK_DESTROY closed this socket.
     }
+
+    void runMicroBenchmark();
 };
 
-TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmark) {
+void SockDiagMicroBenchmarkTest::runMicroBenchmark() {
     MicroBenchmarkTestType mode = GetParam();
 
     int numSockets = howManySockets();
@@ -521,6 +645,17 @@ TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmark) {
     close(listensocket);
 }
 
+TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmark) {
+    runMicroBenchmark();
+}
+
+TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmarkParallel) {
+    mSd.setParallel(true);
+    runMicroBenchmark();
+    // Running again reuses the SockDiag that dumped IPv6, which must not count any socket twice.
+    EXPECT_EQ(0, destroySockets());
+}
+
 // "SockDiagTest.cpp:232: error: undefined reference to 'SockDiagMicroBenchmarkTest::CLOSE_UID'".
 constexpr int SockDiagMicroBenchmarkTest::CLOSE_UID;
 
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StartupProfile.h"
+
+#include <cinttypes>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+StartupProfile::StartupProfile() : mCreated(std::chrono::steady_clock::now()) {}
+
+void StartupProfile::record(const std::string& name, int64_t durationUs) {
+    const int64_t endUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - mCreated)
+                                  .count();
+    std::lock_guard guard(mMutex);
+    mPhases.push_back({name, endUs, durationUs});
+}
+
+std::vector<StartupProfile::Phase> StartupProfile::getPhases() const {
+    std::lock_guard guard(mMutex);
+    return mPhases;
+}
+
+void StartupProfile::dump(DumpWriter& dw) const {
+    dw.incIndent();
+    dw.println("Startup profile (phase: duration, end):");
+    dw.incIndent();
+    for (const auto& phase : getPhases()) {
+        dw.println("%s: %" PRId64 "us, at %" PRId64 "us", phase.name.c_str(), phase.durationUs,
+                   phase.endUs);
+    }
+    dw.decIndent();
+    dw.decIndent();
+}
+
+}  // namespace android::net
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// How long each phase of netd startup took, in the order the phases finished. Phases may overlap,
+// since some of them run concurrently, so each one also records when it ended, relative to when
+// the profile was created.
+class StartupProfile {
+  public:
+    struct Phase {
+        std::string name;
+        int64_t endUs;
+        int64_t durationUs;
+    };
+
+    StartupProfile();
+
+    void record(const std::string& name, int64_t durationUs);
+    std::vector<Phase> getPhases() const;
+
+    void dump(netdutils::DumpWriter& dw) const;
+
+  private:
+    const std::chrono::steady_clock::time_point mCreated;
+    mutable std::mutex mMutex;
+    std::vector<Phase> mPhases GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "StartupProfile.h"
+
+namespace android::net {
+
+TEST(StartupProfileTest, RecordsPhasesInOrder) {
+    StartupProfile profile;
+    EXPECT_TRUE(profile.getPhases().empty());
+
+    profile.record("iptables", 1500);
+    profile.record("RouteController", 200);
+
+    const auto phases = profile.getPhases();
+    ASSERT_EQ(2U, phases.size());
+    EXPECT_EQ("iptables", phases[0].name);
+    EXPECT_EQ(1500, phases[0].durationUs);
+    EXPECT_EQ("RouteController", phases[1].name);
+    EXPECT_EQ(200, phases[1].durationUs);
+    EXPECT_LE(phases[0].endUs, phases[1].endUs);
+}
+
+}  // namespace android::net
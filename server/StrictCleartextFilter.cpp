@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "StrictCleartextFilter.h"
+
+#include <inttypes.h>
+
+#include <android-base/properties.h>
+
+using android::base::GetUintProperty;
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+constexpr char INTERVAL_PROPERTY[] = "persist.netd.strict_cleartext_interval_ms";
+constexpr unsigned DEFAULT_INTERVAL_MS = 1000;
+constexpr unsigned MAX_INTERVAL_MS = 60 * 60 * 1000;
+
+}  // namespace
+
+StrictCleartextFilter::StrictCleartextFilter(std::chrono::milliseconds interval, Clock clock)
+    : mInterval(interval), mClock(std::move(clock)) {}
+
+std::chrono::milliseconds StrictCleartextFilter::readIntervalProperty() {
+    return std::chrono::milliseconds(
+            GetUintProperty<unsigned>(INTERVAL_PROPERTY, DEFAULT_INTERVAL_MS, MAX_INTERVAL_MS));
+}
+
+bool StrictCleartextFilter::shouldReport(uid_t uid) {
+    std::lock_guard lock(mMutex);
+    const auto now = mClock();
+    auto [it, inserted] = mUids.try_emplace(uid);
+    UidState& state = it->second;
+    if (!inserted && now - state.reportedAt < mInterval) {
+        state.suppressed++;
+        return false;
+    }
+    state.reportedAt = now;
+    state.reported++;
+    return true;
+}
+
+void StrictCleartextFilter::dump(DumpWriter& dw) {
+    std::lock_guard lock(mMutex);
+    dw.println("Cleartext reports (interval %" PRId64 "ms; uid: reported, suppressed):",
+               static_cast<int64_t>(mInterval.count()));
+    dw.incIndent();
+    for (const auto& [uid, state] : mUids) {
+        dw.println("%u: %" PRIu64 ", %" PRIu64, uid, state.reported, state.suppressed);
+    }
+    dw.decIndent();
+}
+
+}  // namespace android::net
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Rate limits the cleartext packets that StrictController's NFLOG rules report, per UID, so that
+// an app sending cleartext traffic in a loop cannot flood netd's listeners with events. At most
+// one packet per UID is reported per interval; the others are counted as suppressed. With an
+// interval of 0, every packet is reported.
+//
+// The interval is read from persist.netd.strict_cleartext_interval_ms when netd starts.
+class StrictCleartextFilter {
+  public:
+    using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+    explicit StrictCleartextFilter(std::chrono::milliseconds interval = readIntervalProperty(),
+                                   Clock clock = std::chrono::steady_clock::now);
+
+    // Returns whether a cleartext packet sent by |uid| should be reported.
+    bool shouldReport(uid_t uid);
+
+    void dump(netdutils::DumpWriter& dw);
+
+    static std::chrono::milliseconds readIntervalProperty();
+
+  private:
+    struct UidState {
+        std::chrono::steady_clock::time_point reportedAt;
+        uint64_t reported = 0;
+        uint64_t suppressed = 0;
+    };
+
+    const std::chrono::milliseconds mInterval;
+    const Clock mClock;
+
+    std::mutex mMutex;
+    std::map<uid_t, UidState> mUids GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "StrictCleartextFilter.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class StrictCleartextFilterTest : public ::testing::Test {
+  protected:
+    StrictCleartextFilterTest() : mFilter(100ms, [this] { return mNow; }) {}
+
+    std::chrono::steady_clock::time_point mNow;
+    StrictCleartextFilter mFilter;
+};
+
+TEST_F(StrictCleartextFilterTest, OnePacketPerIntervalPerUid) {
+    EXPECT_TRUE(mFilter.shouldReport(10000));
+    EXPECT_FALSE(mFilter.shouldReport(10000));
+    // Other UIDs are not affected.
+    EXPECT_TRUE(mFilter.shouldReport(10001));
+
+    mNow += 99ms;
+    EXPECT_FALSE(mFilter.shouldReport(10000));
+    mNow += 1ms;
+    EXPECT_TRUE(mFilter.shouldReport(10000));
+    EXPECT_FALSE(mFilter.shouldReport(10000));
+}
+
+TEST(StrictCleartextFilterNoIntervalTest, EveryPacketReported) {
+    std::chrono::steady_clock::time_point now;
+    StrictCleartextFilter filter(0ms, [&now] { return now; });
+    EXPECT_TRUE(filter.shouldReport(10000));
+    EXPECT_TRUE(filter.shouldReport(10000));
+}
+
+}  // namespace android::net
@@ -26,8 +26,8 @@
 #define LOG_NDEBUG 0
 #include <log/log.h>
 
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 
 #include "ConnmarkFlags.h"
 #include "NetdConstants.h"
@@ -41,158 +41,196 @@ const char* StrictController::LOCAL_CLEAR_CAUGHT = "st_clear_caught";
 const char* StrictController::LOCAL_PENALTY_LOG = "st_penalty_log";
 const char* StrictController::LOCAL_PENALTY_REJECT = "st_penalty_reject";
 
-using android::base::Join;
+using android::base::GetUintProperty;
 using android::base::StringPrintf;
+using android::net::IptablesRuleSet;
+using android::netdutils::DumpWriter;
 
-StrictController::StrictController(void) {
-}
+using Rules = IptablesRuleSet::Rules;
+
+namespace {
+
+// The packet is hex-encoded into every event that reports it, so only capture as much of it as
+// identifies the connection and the start of its payload.
+constexpr char CAPTURE_BYTES_PROPERTY[] = "persist.netd.strict_cleartext_capture_bytes";
+constexpr unsigned DEFAULT_CAPTURE_BYTES = 256;
+constexpr unsigned MAX_CAPTURE_BYTES = 65535;
+
+}  // namespace
+
+StrictController::StrictController(void)
+    : mRules([](IptablesTarget target, const std::string& commands) {
+          return execIptablesRestore(target, commands);
+      }) {}
 
 int StrictController::setupIptablesHooks(void) {
-    char connmarkFlagAccept[16];
-    char connmarkFlagReject[16];
-    char connmarkFlagTestAccept[32];
-    char connmarkFlagTestReject[32];
-    sprintf(connmarkFlagAccept, "0x%x", ConnmarkFlags::STRICT_RESOLVED_ACCEPT);
-    sprintf(connmarkFlagReject, "0x%x", ConnmarkFlags::STRICT_RESOLVED_REJECT);
-    sprintf(connmarkFlagTestAccept, "0x%x/0x%x",
-            ConnmarkFlags::STRICT_RESOLVED_ACCEPT,
+    const std::string connmarkFlagAccept =
+            StringPrintf("0x%x", ConnmarkFlags::STRICT_RESOLVED_ACCEPT);
+    const std::string connmarkFlagReject =
+            StringPrintf("0x%x", ConnmarkFlags::STRICT_RESOLVED_REJECT);
+    const std::string connmarkFlagTestAccept = StringPrintf(
+            "0x%x/0x%x", ConnmarkFlags::STRICT_RESOLVED_ACCEPT,
             ConnmarkFlags::STRICT_RESOLVED_ACCEPT);
-    sprintf(connmarkFlagTestReject, "0x%x/0x%x",
-            ConnmarkFlags::STRICT_RESOLVED_REJECT,
+    const std::string connmarkFlagTestReject = StringPrintf(
+            "0x%x/0x%x", ConnmarkFlags::STRICT_RESOLVED_REJECT,
             ConnmarkFlags::STRICT_RESOLVED_REJECT);
 
-    resetChains();
-
-    int res = 0;
-    std::vector<std::string> v4, v6;
+    mPenalties.clear();
+    // The chains may hold anything, e.g. the rules of a previous netd, so rewrite all of them.
+    mRules.invalidate();
 
-#define CMD_V4(...) { auto cmd = StringPrintf(__VA_ARGS__); v4.push_back(cmd); }
-#define CMD_V6(...) { auto cmd = StringPrintf(__VA_ARGS__); v6.push_back(cmd); }
-#define CMD_V4V6(...) { CMD_V4(__VA_ARGS__); CMD_V6(__VA_ARGS__); };
+    Rules v4, v6;
+#define RULE_V4(...) v4.push_back(StringPrintf(__VA_ARGS__))
+#define RULE_V6(...) v6.push_back(StringPrintf(__VA_ARGS__))
+#define RULE_V4V6(...) { RULE_V4(__VA_ARGS__); RULE_V6(__VA_ARGS__); }
 
-    CMD_V4V6("*filter");
+    mRules.setChain(V4V6, "filter", LOCAL_OUTPUT, {});
+    mRules.setChain(V4V6, "filter", LOCAL_CLEAR_CAUGHT, {});
 
     // Chain triggered when cleartext socket detected and penalty is log
-    CMD_V4V6("-A %s -j CONNMARK --or-mark %s", LOCAL_PENALTY_LOG, connmarkFlagAccept);
-    CMD_V4V6("-A %s -j NFLOG --nflog-group 0", LOCAL_PENALTY_LOG);
+    const unsigned captureBytes = getCaptureBytes();
+    mRules.setChain(V4V6, "filter", LOCAL_PENALTY_LOG, {
+            "-j CONNMARK --or-mark " + connmarkFlagAccept,
+            StringPrintf("-j NFLOG --nflog-group 0 --nflog-size %u", captureBytes),
+    });
 
     // Chain triggered when cleartext socket detected and penalty is reject
-    CMD_V4V6("-A %s -j CONNMARK --or-mark %s", LOCAL_PENALTY_REJECT, connmarkFlagReject);
-    CMD_V4V6("-A %s -j NFLOG --nflog-group 0", LOCAL_PENALTY_REJECT);
-    CMD_V4V6("-A %s -j REJECT", LOCAL_PENALTY_REJECT);
+    mRules.setChain(V4V6, "filter", LOCAL_PENALTY_REJECT, {
+            "-j CONNMARK --or-mark " + connmarkFlagReject,
+            StringPrintf("-j NFLOG --nflog-group 0 --nflog-size %u", captureBytes),
+            "-j REJECT",
+    });
 
     // We use a high-order mark bit to keep track of connections that we've already resolved.
     // Quickly skip connections that we've already resolved
-    CMD_V4V6("-A %s -m connmark --mark %s -j REJECT", LOCAL_CLEAR_DETECT, connmarkFlagTestReject);
-    CMD_V4V6("-A %s -m connmark --mark %s -j RETURN", LOCAL_CLEAR_DETECT, connmarkFlagTestAccept);
+    RULE_V4V6("-m connmark --mark %s -j REJECT", connmarkFlagTestReject.c_str());
+    RULE_V4V6("-m connmark --mark %s -j RETURN", connmarkFlagTestAccept.c_str());
 
     // Look for IPv4 TCP/UDP connections with TLS/DTLS header
     const char *u32;
     u32 = "0>>22&0x3C@ 12>>26&0x3C@ 0&0xFFFF0000=0x16030000 &&"
           "0>>22&0x3C@ 12>>26&0x3C@ 4&0x00FF0000=0x00010000";
-    CMD_V4("-A %s -p tcp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s",
-           LOCAL_CLEAR_DETECT, u32, connmarkFlagAccept);
+    RULE_V4("-p tcp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s", u32,
+            connmarkFlagAccept.c_str());
 
     u32 = "0>>22&0x3C@ 8&0xFFFF0000=0x16FE0000 &&"
           "0>>22&0x3C@ 20&0x00FF0000=0x00010000";
-    CMD_V4("-A %s -p udp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s",
-           LOCAL_CLEAR_DETECT, u32, connmarkFlagAccept);
+    RULE_V4("-p udp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s", u32,
+            connmarkFlagAccept.c_str());
 
     // Look for IPv6 TCP/UDP connections with TLS/DTLS header.  The IPv6 header
     // doesn't have an IHL field to shift with, so we have to manually add in
     // the 40-byte offset at every step.
     u32 = "52>>26&0x3C@ 40&0xFFFF0000=0x16030000 &&"
           "52>>26&0x3C@ 44&0x00FF0000=0x00010000";
-    CMD_V6("-A %s -p tcp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s",
-           LOCAL_CLEAR_DETECT, u32, connmarkFlagAccept);
+    RULE_V6("-p tcp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s", u32,
+            connmarkFlagAccept.c_str());
 
     u32 = "48&0xFFFF0000=0x16FE0000 &&"
           "60&0x00FF0000=0x00010000";
-    CMD_V6("-A %s -p udp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s",
-           LOCAL_CLEAR_DETECT, u32, connmarkFlagAccept);
+    RULE_V6("-p udp -m u32 --u32 \"%s\" -j CONNMARK --or-mark %s", u32,
+            connmarkFlagAccept.c_str());
 
     // Skip newly classified connections from above
-    CMD_V4V6("-A %s -m connmark --mark %s -j RETURN", LOCAL_CLEAR_DETECT, connmarkFlagTestAccept);
+    RULE_V4V6("-m connmark --mark %s -j RETURN", connmarkFlagTestAccept.c_str());
 
     // Handle TCP/UDP payloads that didn't match TLS/DTLS filters above,
     // which means we've probably found cleartext data.  The TCP variant
     // depends on u32 returning false when we try reading into the message
     // body to ignore empty ACK packets.
     u32 = "0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0";
-    CMD_V4("-A %s -p tcp -m state --state ESTABLISHED -m u32 --u32 \"%s\" -j %s",
-           LOCAL_CLEAR_DETECT, u32, LOCAL_CLEAR_CAUGHT);
+    RULE_V4("-p tcp -m state --state ESTABLISHED -m u32 --u32 \"%s\" -j %s", u32,
+            LOCAL_CLEAR_CAUGHT);
 
     u32 = "52>>26&0x3C@ 40&0x0=0x0";
-    CMD_V6("-A %s -p tcp -m state --state ESTABLISHED -m u32 --u32 \"%s\" -j %s",
-           LOCAL_CLEAR_DETECT, u32, LOCAL_CLEAR_CAUGHT);
+    RULE_V6("-p tcp -m state --state ESTABLISHED -m u32 --u32 \"%s\" -j %s", u32,
+            LOCAL_CLEAR_CAUGHT);
 
-    CMD_V4V6("-A %s -p udp -j %s", LOCAL_CLEAR_DETECT, LOCAL_CLEAR_CAUGHT);
-    CMD_V4V6("COMMIT\n");
+    RULE_V4V6("-p udp -j %s", LOCAL_CLEAR_CAUGHT);
 
-    res |= execIptablesRestore(V4, Join(v4, '\n'));
-    res |= execIptablesRestore(V6, Join(v6, '\n'));
+#undef RULE_V4
+#undef RULE_V6
+#undef RULE_V4V6
 
-#undef CMD_V4
-#undef CMD_V6
-#undef CMD_V4V6
-
-    return res ? -EREMOTEIO : 0;
+    mRules.setChain(V4, "filter", LOCAL_CLEAR_DETECT, v4);
+    mRules.setChain(V6, "filter", LOCAL_CLEAR_DETECT, v6);
+    return mRules.commit();
 }
 
 int StrictController::resetChains(void) {
+    mPenalties.clear();
     // Flush any existing rules
-#define CLEAR_CHAIN(x) StringPrintf(":%s -", (x))
-    std::vector<std::string> commandList = {
-        "*filter",
-        CLEAR_CHAIN(LOCAL_OUTPUT),
-        CLEAR_CHAIN(LOCAL_PENALTY_LOG),
-        CLEAR_CHAIN(LOCAL_PENALTY_REJECT),
-        CLEAR_CHAIN(LOCAL_CLEAR_CAUGHT),
-        CLEAR_CHAIN(LOCAL_CLEAR_DETECT),
-        "COMMIT\n"
-    };
-    const std::string commands = Join(commandList, '\n');
-    return (execIptablesRestore(V4V6, commands) == 0) ? 0 : -EREMOTEIO;
-#undef CLEAR_CHAIN
+    mRules.invalidate();
+    for (const char* chain : {LOCAL_OUTPUT, LOCAL_PENALTY_LOG, LOCAL_PENALTY_REJECT,
+                              LOCAL_CLEAR_CAUGHT, LOCAL_CLEAR_DETECT}) {
+        mRules.setChain(V4V6, "filter", chain, {});
+    }
+    return mRules.commit();
+}
+
+namespace {
+
+const char* penaltyChain(StrictPenalty penalty) {
+    switch (penalty) {
+        case LOG:
+            return StrictController::LOCAL_PENALTY_LOG;
+        case REJECT:
+            return StrictController::LOCAL_PENALTY_REJECT;
+        default:
+            return nullptr;
+    }
 }
 
+}  // namespace
+
 int StrictController::setUidCleartextPenalty(uid_t uid, StrictPenalty penalty) {
-    // When a penalty is set, we don't know what penalty the UID previously had. In order to be able
-    // to clear the previous penalty without causing an iptables error by deleting rules that don't
-    // exist, put each UID's rules in a chain specific to that UID. That way, the commands we need
-    // to run to clear the previous penalty don't depend on what the penalty actually was - all we
-    // need to do is clear the chain.
-    std::string perUidChain = StringPrintf("st_clear_caught_%u", uid);
-
-    std::vector<std::string> commands;
+    // A UID with a penalty has one rule in st_OUTPUT, which sends its packets to be inspected, and
+    // one in st_clear_caught, which jumps straight to the shared chain for its penalty. Only the
+    // rules that change are sent.
+    const auto it = mPenalties.find(uid);
+    const StrictPenalty previous = (it == mPenalties.end()) ? ACCEPT : it->second;
+    if (penalty == previous) return 0;
+
+    const IptablesRuleSet previousV4 = mRules.desired(V4);
+    const IptablesRuleSet previousV6 = mRules.desired(V6);
+    const std::string detectRule =
+            StringPrintf("-m owner --uid-owner %d -j %s", uid, LOCAL_CLEAR_DETECT);
+    const auto caughtRule = [uid](StrictPenalty p) {
+        return StringPrintf("-m owner --uid-owner %d -j %s", uid, penaltyChain(p));
+    };
+    if (previous != ACCEPT) {
+        if (penalty == ACCEPT) mRules.deleteRule(V4V6, "filter", LOCAL_OUTPUT, detectRule);
+        mRules.deleteRule(V4V6, "filter", LOCAL_CLEAR_CAUGHT, caughtRule(previous));
+    }
+    if (penalty != ACCEPT) {
+        if (previous == ACCEPT) mRules.appendRule(V4V6, "filter", LOCAL_OUTPUT, detectRule);
+        mRules.appendRule(V4V6, "filter", LOCAL_CLEAR_CAUGHT, caughtRule(penalty));
+    }
+
+    if (mRules.commit() != 0) {
+        // Keep the rules in line with mPenalties. The failed commit made the compiler forget what
+        // the kernel has, so the next commit rewrites the chains from them.
+        mRules.desired(V4) = previousV4;
+        mRules.desired(V6) = previousV6;
+        return -EREMOTEIO;
+    }
     if (penalty == ACCEPT) {
-        // Clean up any old rules
-        commands = {
-            "*filter",
-            StringPrintf("-D %s -m owner --uid-owner %d -j %s",
-                         LOCAL_OUTPUT, uid, LOCAL_CLEAR_DETECT),
-            StringPrintf("-D %s -m owner --uid-owner %d -j %s",
-                         LOCAL_CLEAR_CAUGHT, uid, perUidChain.c_str()),
-            StringPrintf("-F %s", perUidChain.c_str()),
-            StringPrintf("-X %s", perUidChain.c_str()),
-        };
+        mPenalties.erase(uid);
     } else {
-        // Always take a detour to investigate this UID
-        commands.push_back("*filter");
-        commands.push_back(StringPrintf(":%s -", perUidChain.c_str()));
-        commands.push_back(StringPrintf("-I %s -m owner --uid-owner %d -j %s",
-                                        LOCAL_OUTPUT, uid, LOCAL_CLEAR_DETECT));
-        commands.push_back(StringPrintf("-I %s -m owner --uid-owner %d -j %s",
-                                        LOCAL_CLEAR_CAUGHT, uid, perUidChain.c_str()));
-
-        if (penalty == LOG) {
-            commands.push_back(StringPrintf("-A %s -j %s", perUidChain.c_str(), LOCAL_PENALTY_LOG));
-        } else if (penalty == REJECT) {
-            commands.push_back(StringPrintf("-A %s -j %s", perUidChain.c_str(),
-                                            LOCAL_PENALTY_REJECT));
-        }
+        mPenalties[uid] = penalty;
     }
-    commands.push_back("COMMIT\n");
+    return 0;
+}
+
+unsigned StrictController::getCaptureBytes() {
+    return GetUintProperty<unsigned>(CAPTURE_BYTES_PROPERTY, DEFAULT_CAPTURE_BYTES,
+                                     MAX_CAPTURE_BYTES);
+}
 
-    return (execIptablesRestore(V4V6, Join(commands, "\n")) == 0) ? 0 : -EREMOTEIO;
+void StrictController::dump(DumpWriter& dw) {
+    dw.println("StrictController");
+    dw.incIndent();
+    dw.println("Capture bytes: %u", getCaptureBytes());
+    cleartextFilter.dump(dw);
+    dw.decIndent();
 }
@@ -17,9 +17,16 @@
 #ifndef _STRICT_CONTROLLER_H
 #define _STRICT_CONTROLLER_H
 
+#include <map>
+#include <mutex>
 #include <string>
 
+#include <android-base/thread_annotations.h>
+
+#include "IptablesRuleSet.h"
 #include "NetdConstants.h"
+#include "StrictCleartextFilter.h"
+#include "netdutils/DumpWriter.h"
 
 enum StrictPenalty { INVALID, ACCEPT, LOG, REJECT };
 
@@ -31,10 +38,16 @@ class StrictController {
 public:
     StrictController();
 
-    int setupIptablesHooks(void);
-    int resetChains(void);
+    int setupIptablesHooks(void) REQUIRES(lock);
+    int resetChains(void) REQUIRES(lock);
+
+    int setUidCleartextPenalty(uid_t, StrictPenalty) REQUIRES(lock);
+
+    void dump(android::netdutils::DumpWriter& dw);
 
-    int setUidCleartextPenalty(uid_t, StrictPenalty);
+    // Returns the number of bytes of each cleartext packet that the NFLOG rules capture, as read
+    // from persist.netd.strict_cleartext_capture_bytes.
+    static unsigned getCaptureBytes();
 
     static const char* LOCAL_OUTPUT;
     static const char* LOCAL_CLEAR_DETECT;
@@ -43,6 +56,16 @@ public:
     static const char* LOCAL_PENALTY_REJECT;
     std::mutex lock;
 
+    // Decides which of the detected cleartext packets are reported to listeners.
+    android::net::StrictCleartextFilter cleartextFilter;
+
+  private:
+    // The penalty of every UID that has one other than ACCEPT.
+    std::map<uid_t, StrictPenalty> mPenalties GUARDED_BY(lock);
+
+    // The rules of the st_* chains, which are only changed through it.
+    android::net::IptablesRuleCompiler mRules GUARDED_BY(lock);
+
   protected:
     // For testing.
     friend class StrictControllerTest;
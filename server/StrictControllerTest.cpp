@@ -35,25 +35,28 @@ public:
 };
 
 TEST_F(StrictControllerTest, TestSetupIptablesHooks) {
+    std::lock_guard lock(mStrictCtrl.lock);
     mStrictCtrl.setupIptablesHooks();
 
-    std::vector<std::string> common = {
+    std::vector<std::string> chains = {
         "*filter",
         ":st_OUTPUT -",
-        ":st_penalty_log -",
-        ":st_penalty_reject -",
         ":st_clear_caught -",
         ":st_clear_detect -",
-        "COMMIT\n"
+        ":st_penalty_log -",
+        ":st_penalty_reject -",
     };
 
-    std::vector<std::string> v4 = {
-        "*filter",
+    std::vector<std::string> penalties = {
         "-A st_penalty_log -j CONNMARK --or-mark 0x1000000",
-        "-A st_penalty_log -j NFLOG --nflog-group 0",
+        "-A st_penalty_log -j NFLOG --nflog-group 0 --nflog-size 256",
         "-A st_penalty_reject -j CONNMARK --or-mark 0x2000000",
-        "-A st_penalty_reject -j NFLOG --nflog-group 0",
+        "-A st_penalty_reject -j NFLOG --nflog-group 0 --nflog-size 256",
         "-A st_penalty_reject -j REJECT",
+        "COMMIT\n"
+    };
+
+    std::vector<std::string> v4 = {
         "-A st_clear_detect -m connmark --mark 0x2000000/0x2000000 -j REJECT",
         "-A st_clear_detect -m connmark --mark 0x1000000/0x1000000 -j RETURN",
         "-A st_clear_detect -p tcp -m u32 --u32 \""
@@ -68,16 +71,9 @@ TEST_F(StrictControllerTest, TestSetupIptablesHooks) {
         "-A st_clear_detect -p tcp -m state --state ESTABLISHED -m u32 --u32 "
             "\"0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0\" -j st_clear_caught",
         "-A st_clear_detect -p udp -j st_clear_caught",
-        "COMMIT\n"
     };
 
     std::vector<std::string> v6 = {
-        "*filter",
-        "-A st_penalty_log -j CONNMARK --or-mark 0x1000000",
-        "-A st_penalty_log -j NFLOG --nflog-group 0",
-        "-A st_penalty_reject -j CONNMARK --or-mark 0x2000000",
-        "-A st_penalty_reject -j NFLOG --nflog-group 0",
-        "-A st_penalty_reject -j REJECT",
         "-A st_clear_detect -m connmark --mark 0x2000000/0x2000000 -j REJECT",
         "-A st_clear_detect -m connmark --mark 0x1000000/0x1000000 -j RETURN",
 
@@ -93,58 +89,65 @@ TEST_F(StrictControllerTest, TestSetupIptablesHooks) {
         "-A st_clear_detect -p tcp -m state --state ESTABLISHED -m u32 --u32 "
             "\"52>>26&0x3C@ 40&0x0=0x0\" -j st_clear_caught",
         "-A st_clear_detect -p udp -j st_clear_caught",
-        "COMMIT\n"
     };
 
-    std::string commandsCommon = android::base::Join(common, '\n');
-    std::string commands4 = android::base::Join(v4, '\n');
-    std::string commands6 = android::base::Join(v6, '\n');
+    // Both families are set up in a single iptables-restore call each.
+    const auto commands = [&](const std::vector<std::string>& detect) {
+        std::vector<std::string> lines = chains;
+        lines.insert(lines.end(), detect.begin(), detect.end());
+        lines.insert(lines.end(), penalties.begin(), penalties.end());
+        return android::base::Join(lines, '\n');
+    };
 
     std::vector<std::pair<IptablesTarget, std::string>> expected = {
-        { V4V6, commandsCommon },
-        { V4, commands4 },
-        { V6, commands6 },
+        { V4, commands(v4) },
+        { V6, commands(v6) },
     };
     expectIptablesRestoreCommands(expected);
 }
 
-TEST_F(StrictControllerTest, TestResetChains) {
-    mStrictCtrl.resetChains();
-
-    const std::string expected =
+const std::string kResetCommands =
         "*filter\n"
         ":st_OUTPUT -\n"
-        ":st_penalty_log -\n"
-        ":st_penalty_reject -\n"
         ":st_clear_caught -\n"
         ":st_clear_detect -\n"
+        ":st_penalty_log -\n"
+        ":st_penalty_reject -\n"
         "COMMIT\n";
-    expectIptablesRestoreCommands({ expected });
+
+TEST_F(StrictControllerTest, TestResetChains) {
+    std::lock_guard lock(mStrictCtrl.lock);
+    mStrictCtrl.resetChains();
+    expectIptablesRestoreCommands({ kResetCommands });
 }
 
 TEST_F(StrictControllerTest, TestSetUidCleartextPenalty) {
-    std::vector<std::string> acceptCommands = {
+    std::lock_guard lock(mStrictCtrl.lock);
+    mStrictCtrl.resetChains();
+    expectIptablesRestoreCommands({ kResetCommands });
+
+    std::vector<std::string> logCommands = {
         "*filter\n"
-        "-D st_OUTPUT -m owner --uid-owner 12345 -j st_clear_detect\n"
-        "-D st_clear_caught -m owner --uid-owner 12345 -j st_clear_caught_12345\n"
-        "-F st_clear_caught_12345\n"
-        "-X st_clear_caught_12345\n"
+        "-I st_OUTPUT 1 -m owner --uid-owner 12345 -j st_clear_detect\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 12345 -j st_penalty_log\n"
         "COMMIT\n"
     };
-    std::vector<std::string> logCommands = {
+    std::vector<std::string> logToAcceptCommands = {
         "*filter\n"
-        ":st_clear_caught_12345 -\n"
-        "-I st_OUTPUT -m owner --uid-owner 12345 -j st_clear_detect\n"
-        "-I st_clear_caught -m owner --uid-owner 12345 -j st_clear_caught_12345\n"
-        "-A st_clear_caught_12345 -j st_penalty_log\n"
+        "-D st_OUTPUT 1\n"
+        "-D st_clear_caught 1\n"
         "COMMIT\n"
     };
     std::vector<std::string> rejectCommands = {
         "*filter\n"
-        ":st_clear_caught_12345 -\n"
-        "-I st_OUTPUT -m owner --uid-owner 12345 -j st_clear_detect\n"
-        "-I st_clear_caught -m owner --uid-owner 12345 -j st_clear_caught_12345\n"
-        "-A st_clear_caught_12345 -j st_penalty_reject\n"
+        "-I st_OUTPUT 1 -m owner --uid-owner 12345 -j st_clear_detect\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 12345 -j st_penalty_reject\n"
+        "COMMIT\n"
+    };
+    std::vector<std::string> rejectToLogCommands = {
+        "*filter\n"
+        "-D st_clear_caught 1\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 12345 -j st_penalty_log\n"
         "COMMIT\n"
     };
 
@@ -152,15 +155,76 @@ TEST_F(StrictControllerTest, TestSetUidCleartextPenalty) {
     expectIptablesRestoreCommands(logCommands);
 
     mStrictCtrl.setUidCleartextPenalty(12345, ACCEPT);
-    expectIptablesRestoreCommands(acceptCommands);
+    expectIptablesRestoreCommands(logToAcceptCommands);
 
-    // StrictController doesn't keep any state and it is not correct to call its methods in the
-    // wrong order (e.g., to go from LOG to REJECT without passing through ACCEPT).
-    // NetworkManagementService does keep state (not just to ensure correctness, but also so it can
-    // reprogram the rules when netd crashes).
     mStrictCtrl.setUidCleartextPenalty(12345, REJECT);
     expectIptablesRestoreCommands(rejectCommands);
 
+    // Changing from one penalty to another only replaces the rule that applies it.
+    mStrictCtrl.setUidCleartextPenalty(12345, LOG);
+    expectIptablesRestoreCommands(rejectToLogCommands);
+
+    mStrictCtrl.setUidCleartextPenalty(12345, ACCEPT);
+    expectIptablesRestoreCommands(logToAcceptCommands);
+}
+
+TEST_F(StrictControllerTest, TestSetUidCleartextPenaltyOfSeveralUids) {
+    std::lock_guard lock(mStrictCtrl.lock);
+    mStrictCtrl.resetChains();
+    expectIptablesRestoreCommands({ kResetCommands });
+
+    mStrictCtrl.setUidCleartextPenalty(12345, LOG);
+    mStrictCtrl.setUidCleartextPenalty(23456, REJECT);
+    expectIptablesRestoreCommands(std::vector<std::string>{
+        "*filter\n"
+        "-I st_OUTPUT 1 -m owner --uid-owner 12345 -j st_clear_detect\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 12345 -j st_penalty_log\n"
+        "COMMIT\n",
+        "*filter\n"
+        "-I st_OUTPUT 2 -m owner --uid-owner 23456 -j st_clear_detect\n"
+        "-I st_clear_caught 2 -m owner --uid-owner 23456 -j st_penalty_reject\n"
+        "COMMIT\n",
+    });
+
+    // Rules are deleted by position, which only works while the model matches the kernel.
     mStrictCtrl.setUidCleartextPenalty(12345, ACCEPT);
-    expectIptablesRestoreCommands(acceptCommands);
+    expectIptablesRestoreCommands({
+        "*filter\n"
+        "-D st_OUTPUT 1\n"
+        "-D st_clear_caught 1\n"
+        "COMMIT\n"
+    });
+    mStrictCtrl.setUidCleartextPenalty(23456, LOG);
+    expectIptablesRestoreCommands({
+        "*filter\n"
+        "-D st_clear_caught 1\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 23456 -j st_penalty_log\n"
+        "COMMIT\n"
+    });
+}
+
+TEST_F(StrictControllerTest, TestSetUidCleartextPenaltyUnchanged) {
+    std::lock_guard lock(mStrictCtrl.lock);
+    mStrictCtrl.resetChains();
+    expectIptablesRestoreCommands({ kResetCommands });
+
+    // ACCEPT is the default, so there is nothing to delete.
+    EXPECT_EQ(0, mStrictCtrl.setUidCleartextPenalty(12345, ACCEPT));
+    expectIptablesRestoreCommands(std::vector<std::string>{});
+
+    mStrictCtrl.setUidCleartextPenalty(12345, REJECT);
+    expectIptablesRestoreCommands({
+        "*filter\n"
+        "-I st_OUTPUT 1 -m owner --uid-owner 12345 -j st_clear_detect\n"
+        "-I st_clear_caught 1 -m owner --uid-owner 12345 -j st_penalty_reject\n"
+        "COMMIT\n"
+    });
+    EXPECT_EQ(0, mStrictCtrl.setUidCleartextPenalty(12345, REJECT));
+    expectIptablesRestoreCommands(std::vector<std::string>{});
+
+    // Resetting the chains forgets every penalty.
+    mStrictCtrl.resetChains();
+    expectIptablesRestoreCommands({ kResetCommands });
+    EXPECT_EQ(0, mStrictCtrl.setUidCleartextPenalty(12345, ACCEPT));
+    expectIptablesRestoreCommands(std::vector<std::string>{});
 }
@@ -16,6 +16,7 @@
 
 #define LOG_TAG "TcpSocketMonitor"
 
+#include <algorithm>
 #include <chrono>
 #include <cinttypes>
 #include <thread>
@@ -26,8 +27,10 @@
 #include <linux/tcp.h>
 
 #include "Controllers.h"
+#include "DumpBuffer.h"
 #include "SockDiag.h"
 #include "TcpSocketMonitor.h"
+#include "netd_dump.pb.h"
 #include "netdutils/DumpWriter.h"
 
 using android::netdutils::DumpWriter;
@@ -75,6 +78,11 @@ constexpr const char* getTcpStateName(int t) {
              ? (ptr)->fld                                                                \
              : (zero))
 
+static uint64_t socketCookie(const struct inet_diag_msg *sockinfo) {
+    return (static_cast<uint64_t>(sockinfo->id.idiag_cookie[0]) << 32)
+            | static_cast<uint64_t>(sockinfo->id.idiag_cookie[1]);
+}
+
 static void tcpInfoPrint(DumpWriter &dw, Fwmark mark, const struct inet_diag_msg *sockinfo,
                          const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) {
     char saddr[INET6_ADDRSTRLEN] = {};
@@ -102,20 +110,46 @@ const String16 TcpSocketMonitor::DUMP_KEYWORD = String16("tcp_socket_info");
 const milliseconds TcpSocketMonitor::kDefaultPollingInterval = milliseconds(30000);
 
 void TcpSocketMonitor::dump(DumpWriter& dw) {
-    std::lock_guard guard(mLock);
-
     dw.println("TcpSocketMonitor");
     ScopedIndent tcpSocketMonitorDetails(dw);
 
+    DumpBuffer buffer;
+    {
+        std::lock_guard guard(mLock);
+        dumpLocked(buffer.writer());
+    }
+    buffer.flushTo(dw);
+
+    // Read straight from the kernel, so this needs no lock.
+    SockDiag sd;
+    if (sd.open()) {
+        dw.blankline();
+        dw.println("Current socket dump:");
+        const auto tcpInfoReader = [&dw](Fwmark mark, const struct inet_diag_msg *sockinfo,
+                                         const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) {
+            tcpInfoPrint(dw, mark, sockinfo, tcpinfo, tcpinfoLen);
+        };
+
+        if (int ret = sd.getLiveTcpInfos(tcpInfoReader)) {
+            ALOGE("Failed to dump TCP socket info: %s", strerror(-ret));
+        }
+    } else {
+        ALOGE("Error opening sock diag for dumping TCP socket info");
+    }
+}
+
+void TcpSocketMonitor::dumpLocked(DumpWriter& dw) {
     const auto now = steady_clock::now();
     const auto d = duration_cast<milliseconds>(now - mLastPoll);
-    dw.println("running=%d, suspended=%d, last poll %lld ms ago",
-            mIsRunning, mIsSuspended, d.count());
+    dw.println("running=%d, suspended=%d, destroy_events=%d, last poll %lld ms ago",
+            mIsRunning, mIsSuspended, mDestroyListener != -1, d.count());
+    dw.println("polling interval %lld ms (base %lld ms)", mAdaptiveSleepDurationMs.count(),
+               mNextSleepDurationMs.count());
 
-    if (!mNetworkStats.empty()) {
+    if (!mCurrent.networkStats.empty()) {
         dw.blankline();
         dw.println("Network stats:");
-        for (const std::pair<const uint32_t, TcpStats>& stats : mNetworkStats) {
+        for (const std::pair<const uint32_t, TcpStats>& stats : mCurrent.networkStats) {
             if (stats.second.nSockets == 0) {
                 continue;
             }
@@ -128,29 +162,51 @@ void TcpSocketMonitor::dump(DumpWriter& dw) {
         }
     }
 
-    if (!mSocketEntries.empty()) {
+    if (!mCurrent.networkQuality.empty()) {
         dw.blankline();
-        dw.println("Socket entries:");
-        for (const std::pair<const uint64_t, SocketEntry>& stats : mSocketEntries) {
-            dw.println("netId=%u uid=%u cookie=%" PRIu64, stats.second.mark.netId, stats.second.uid,
-                       stats.first);
+        dw.println("Network quality:");
+        for (const auto& [netId, quality] : mCurrent.networkQuality) {
+            dw.println("netId=%u rtt p50=%gms p95=%gms p99=%gms loss p95=%g%% (%" PRIu64
+                       " sockets)",
+                       netId, quality.rttUs.quantile(0.5) / 1000.0,
+                       quality.rttUs.quantile(0.95) / 1000.0, quality.rttUs.quantile(0.99) / 1000.0,
+                       quality.lossPerMille.quantile(0.95) / 10.0, quality.rttUs.count());
         }
     }
 
-    SockDiag sd;
-    if (sd.open()) {
+    const TcpSocketTable& socketEntries = mCurrent.socketEntries;
+    dw.println("socket table: %zu entries, %zu slots, %zu bytes", socketEntries.currentSize(),
+               socketEntries.capacity(), socketEntries.memoryUsage());
+    if (socketEntries.currentSize() > 0) {
         dw.blankline();
-        dw.println("Current socket dump:");
-        const auto tcpInfoReader = [&dw](Fwmark mark, const struct inet_diag_msg *sockinfo,
-                                         const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) {
-            tcpInfoPrint(dw, mark, sockinfo, tcpinfo, tcpinfoLen);
-        };
+        dw.println("Socket entries:");
+        socketEntries.forEachCurrent([&dw](uint64_t cookie, const SocketEntry& entry) {
+            dw.println("netId=%u uid=%u cookie=%" PRIu64, entry.mark.netId, entry.uid, cookie);
+        });
+    }
+}
 
-        if (int ret = sd.getLiveTcpInfos(tcpInfoReader)) {
-            ALOGE("Failed to dump TCP socket info: %s", strerror(-ret));
-        }
-    } else {
-        ALOGE("Error opening sock diag for dumping TCP socket info");
+void TcpSocketMonitor::dumpProto(netd::TcpSocketMonitorProto* proto) {
+    std::lock_guard guard(mLock);
+
+    const auto lastPollAge = duration_cast<milliseconds>(steady_clock::now() - mLastPoll);
+    proto->set_last_poll_age_ms(lastPollAge.count());
+    proto->set_polling_interval_ms(mAdaptiveSleepDurationMs.count());
+    for (const auto& [netId, stats] : mCurrent.networkStats) {
+        if (stats.nSockets == 0) continue;
+        auto* network = proto->add_networks();
+        network->set_net_id(netId);
+        network->set_sockets(stats.nSockets);
+        network->set_sent(stats.sent);
+        network->set_lost(stats.lost);
+        network->set_mean_rtt_us(stats.rttUs / stats.nSockets);
+        const auto iter = mCurrent.networkQuality.find(netId);
+        if (iter == mCurrent.networkQuality.end()) continue;
+        const TcpQuality& quality = iter->second;
+        network->set_rtt_p50_us(static_cast<uint32_t>(quality.rttUs.quantile(0.5)));
+        network->set_rtt_p95_us(static_cast<uint32_t>(quality.rttUs.quantile(0.95)));
+        network->set_rtt_p99_us(static_cast<uint32_t>(quality.rttUs.quantile(0.99)));
+        network->set_loss_p95_per_mille(static_cast<uint32_t>(quality.lossPerMille.quantile(0.95)));
     }
 }
 
@@ -158,10 +214,41 @@ void TcpSocketMonitor::setPollingInterval(milliseconds nextSleepDurationMs) {
     std::lock_guard guard(mLock);
 
     mNextSleepDurationMs = nextSleepDurationMs;
+    mAdaptiveSleepDurationMs = nextSleepDurationMs;
 
     ALOGD("tcpinfo polling interval set to %lld ms", mNextSleepDurationMs.count());
 }
 
+int32_t TcpSocketMonitor::getRttPercentileUs(uint32_t netId, int percentile) {
+    std::lock_guard guard(mLock);
+    const auto it = mCurrent.networkQuality.find(netId);
+    if (it == mCurrent.networkQuality.end() || it->second.rttUs.count() == 0) return -1;
+    return static_cast<int32_t>(it->second.rttUs.quantile(percentile / 100.0));
+}
+
+int32_t TcpSocketMonitor::getLossPercentilePerMille(uint32_t netId, int percentile) {
+    std::lock_guard guard(mLock);
+    const auto it = mCurrent.networkQuality.find(netId);
+    if (it == mCurrent.networkQuality.end() || it->second.lossPerMille.count() == 0) return -1;
+    return static_cast<int32_t>(it->second.lossPerMille.quantile(percentile / 100.0));
+}
+
+std::vector<TcpSocketMonitor::SocketInfo> TcpSocketMonitor::getSocketInfos() {
+    std::lock_guard guard(mLock);
+    return mCurrent.socketInfos;
+}
+
+void TcpSocketMonitor::requestPoll() {
+    {
+        std::lock_guard guard(mLock);
+        if (mIsSuspended) {
+            return;
+        }
+        mPollRequested = true;
+    }
+    mCv.notify_all();
+}
+
 void TcpSocketMonitor::resumePolling() {
     bool wasSuspended;
     {
@@ -170,6 +257,14 @@ void TcpSocketMonitor::resumePolling() {
         wasSuspended = mIsSuspended;
         mIsSuspended = false;
         ALOGD("resuming tcpinfo polling (interval=%lldms)", mNextSleepDurationMs.count());
+        if (!mPollingThread.joinable()) {
+            mPollingThread = std::thread([this] {
+                while (isRunning()) {
+                    poll();
+                    waitForNextPoll();
+                }
+            });
+        }
     }
 
     if (wasSuspended) {
@@ -184,73 +279,135 @@ void TcpSocketMonitor::suspendPolling() {
     mIsSuspended = true;
     ALOGD("suspending tcpinfo polling");
 
-    if (!wasSuspended) {
-        mSocketEntries.clear();
+    // A poll in progress reads mCurrent without the lock. It clears the table itself when it
+    // finishes and sees that polling was suspended.
+    if (!wasSuspended && !mPollInProgress) {
+        mCurrent.socketEntries.clear();
     }
 }
 
-void TcpSocketMonitor::poll() {
-    std::lock_guard guard(mLock);
+void TcpSocketMonitor::PollResult::reset() {
+    socketEntries.expireAll();
+    networkStats.clear();
+    networkQuality.clear();
+    socketInfos.clear();
+}
 
-    if (mIsSuspended) {
-        return;
+void TcpSocketMonitor::poll() {
+    {
+        std::lock_guard guard(mLock);
+        if (mIsSuspended) {
+            return;
+        }
+        mPollInProgress = true;
     }
 
+    // Build the result of this poll into mNext without holding mLock: the sock_diag dump can take
+    // a while with many sockets, and dump() and the binder calls should not wait for it.
+    const TcpSocketTable& previous = mCurrent.socketEntries;
+    PollResult* next = &mNext;
+    next->reset();
+
     SockDiag sd;
     if (!sd.open()) {
         ALOGE("Error opening sock diag for polling TCP socket info");
+        std::lock_guard guard(mLock);
+        mPollInProgress = false;
         return;
     }
 
     const auto now = steady_clock::now();
-    const auto tcpInfoReader = [this, now](Fwmark mark, const struct inet_diag_msg *sockinfo,
-                                           const struct tcp_info *tcpinfo,
-                                           uint32_t tcpinfoLen) NO_THREAD_SAFETY_ANALYSIS {
-        if (sockinfo == nullptr || tcpinfo == nullptr || tcpinfoLen == 0 || mark.intValue == 0) {
+    const auto socketReader = [&previous, next](const DiagMsgView& sock) {
+        uint32_t tcpinfoLen = 0;
+        const auto* tcpinfo =
+                static_cast<const struct tcp_info*>(sock.attr(INET_DIAG_INFO, &tcpinfoLen));
+        const Fwmark mark = sock.mark();
+        if (tcpinfo == nullptr || tcpinfoLen == 0 || mark.intValue == 0) {
             return;
         }
-        updateSocketStats(now, mark, sockinfo, tcpinfo, tcpinfoLen);
+        updateSocketStats(previous, next, mark, sock.msg(), tcpinfo, tcpinfoLen);
     };
 
-    // Reset mNetworkStats
-    mNetworkStats.clear();
+    // Credit the sockets destroyed since the last poll.
+    if (mDestroyListener != -1) {
+        const auto socketRetirer = [&previous, next](const DiagMsgView& sock) {
+            uint32_t tcpinfoLen = 0;
+            const auto* tcpinfo =
+                    static_cast<const struct tcp_info*>(sock.attr(INET_DIAG_INFO, &tcpinfoLen));
+            retireSocket(previous, next, sock.msg(), tcpinfo, tcpinfoLen);
+        };
+        const int ret = SockDiag::drainNotifications(mDestroyListener, &mNotificationBuffer,
+                                                     socketRetirer);
+        if (ret && ret != -ENOBUFS) {
+            ALOGE("Failed to read TCP socket destroy notifications: %s", strerror(-ret));
+        }
+    }
 
-    if (int ret = sd.getLiveTcpInfos(tcpInfoReader)) {
+    // Unmarked sockets belong to no network, so have the kernel leave them out of the dump.
+    if (int ret = sd.forEachLiveTcpSocket(socketReader, /* markedOnly= */ true)) {
         ALOGE("Failed to poll TCP socket info: %s", strerror(-ret));
+        std::lock_guard guard(mLock);
+        mPollInProgress = false;
         return;
     }
 
-    // Remove any SocketEntry not updated
-    for (auto it = mSocketEntries.cbegin(); it != mSocketEntries.cend();) {
-        if (it->second.lastUpdate < now) {
-            it = mSocketEntries.erase(it);
-        } else {
-            it++;
+    std::vector<int> netIds;
+    std::vector<int> sentPackets;
+    std::vector<int> lostPackets;
+    std::vector<int> rtts;
+    std::vector<int> sentAckDiffs;
+    for (auto const& stats : next->networkStats) {
+        int32_t nSockets = stats.second.nSockets;
+        if (nSockets == 0) {
+            continue;
+        }
+        netIds.push_back(stats.first);
+        sentPackets.push_back(stats.second.sent);
+        lostPackets.push_back(stats.second.lost);
+        rtts.push_back(stats.second.rttUs / nSockets);
+        sentAckDiffs.push_back(stats.second.sentAckDiffMs / nSockets);
+    }
+
+    {
+        std::lock_guard guard(mLock);
+        std::swap(mCurrent, mNext);
+        if (mIsSuspended) {
+            // suspendPolling() was called during the poll and left clearing the table to us.
+            mCurrent.socketEntries.clear();
         }
+        mPollInProgress = false;
+        adaptPollingInterval();
+        mLastPoll = now;
     }
 
     const auto listener = gCtls->eventReporter.getNetdEventListener();
     if (listener != nullptr) {
-        std::vector<int> netIds;
-        std::vector<int> sentPackets;
-        std::vector<int> lostPackets;
-        std::vector<int> rtts;
-        std::vector<int> sentAckDiffs;
-        for (auto const& stats : mNetworkStats) {
-            int32_t nSockets = stats.second.nSockets;
-            if (nSockets == 0) {
-                continue;
-            }
-            netIds.push_back(stats.first);
-            sentPackets.push_back(stats.second.sent);
-            lostPackets.push_back(stats.second.lost);
-            rtts.push_back(stats.second.rttUs / nSockets);
-            sentAckDiffs.push_back(stats.second.sentAckDiffMs / nSockets);
-        }
         listener->onTcpSocketStatsEvent(netIds, sentPackets, lostPackets, rtts, sentAckDiffs);
     }
+}
 
-    mLastPoll = now;
+void TcpSocketMonitor::adaptPollingInterval() {
+    int64_t sent = 0;
+    int64_t lost = 0;
+    for (const auto& stats : mCurrent.networkStats) {
+        sent += stats.second.sent;
+        // The lost deltas track lost_out, which goes down as lost segments are recovered. A
+        // network whose delta is negative had no new loss, and must not hide another's.
+        const int64_t networkLost = static_cast<int32_t>(stats.second.lost);
+        if (networkLost > 0) lost += networkLost;
+    }
+
+    const milliseconds minInterval = mNextSleepDurationMs / kMaxSpeedup;
+    const milliseconds maxInterval = mNextSleepDurationMs * kMaxSlowdown;
+    if (lost > 0 && lost * 100 >= sent * kLossSpikePercent) {
+        // Look again soon, so a burst of loss is reported while it is still happening.
+        mAdaptiveSleepDurationMs = std::max(mAdaptiveSleepDurationMs / 2, minInterval);
+    } else if (sent < kIdleSegments) {
+        // Nothing to report. Back off to save power.
+        mAdaptiveSleepDurationMs = std::min(mAdaptiveSleepDurationMs * 2, maxInterval);
+    } else {
+        mAdaptiveSleepDurationMs = mNextSleepDurationMs;
+    }
 }
 
 void TcpSocketMonitor::waitForNextPoll() {
@@ -259,15 +416,18 @@ void TcpSocketMonitor::waitForNextPoll() {
     {
         std::lock_guard guard(mLock);
         isSuspended = mIsSuspended;
-        nextSleepDurationMs= mNextSleepDurationMs;
+        nextSleepDurationMs = mAdaptiveSleepDurationMs;
     }
 
     std::unique_lock<std::mutex> ul(mLock);
     if (isSuspended) {
         mCv.wait(ul);
     } else {
-        mCv.wait_for(ul, nextSleepDurationMs);
+        mCv.wait_for(ul, nextSleepDurationMs, [this]() NO_THREAD_SAFETY_ANALYSIS {
+            return mPollRequested || !mIsRunning || mIsSuspended;
+        });
     }
+    mPollRequested = false;
 }
 
 bool TcpSocketMonitor::isRunning() {
@@ -275,10 +435,9 @@ bool TcpSocketMonitor::isRunning() {
     return mIsRunning;
 }
 
-void TcpSocketMonitor::updateSocketStats(time_point now, Fwmark mark,
-                                         const struct inet_diag_msg *sockinfo,
-                                         const struct tcp_info *tcpinfo,
-                                         uint32_t tcpinfoLen) NO_THREAD_SAFETY_ANALYSIS {
+void TcpSocketMonitor::updateSocketStats(const TcpSocketTable& previous, PollResult* next,
+                                         Fwmark mark, const struct inet_diag_msg *sockinfo,
+                                         const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) {
     int32_t lastAck = TCPINFO_GET(tcpinfo, tcpi_last_ack_recv, tcpinfoLen, 0);
     int32_t lastSent = TCPINFO_GET(tcpinfo, tcpi_last_data_sent, tcpinfoLen, 0);
     TcpStats diff = {
@@ -291,24 +450,44 @@ void TcpSocketMonitor::updateSocketStats(time_point now, Fwmark mark,
 
     {
         // Update socket stats with the newest entry, computing the diff w.r.t the previous entry.
-        const uint64_t cookie = (static_cast<uint64_t>(sockinfo->id.idiag_cookie[0]) << 32)
-                | static_cast<uint64_t>(sockinfo->id.idiag_cookie[1]);
-        const SocketEntry previous = mSocketEntries[cookie];
-        mSocketEntries[cookie] = {
+        const uint64_t cookie = socketCookie(sockinfo);
+        const SocketEntry* previousEntry = previous.find(cookie);
+        const SocketEntry last = previousEntry ? *previousEntry : SocketEntry{};
+        next->socketEntries.update(cookie, {
             .sent = diff.sent,
             .lost = diff.lost,
-            .lastUpdate = now,
             .mark = mark,
             .uid = sockinfo->idiag_uid,
-        };
+        });
 
-        diff.sent -= previous.sent;
-        diff.lost -= previous.lost;
+        diff.sent -= last.sent;
+        diff.lost -= last.lost;
+    }
+
+    next->socketInfos.push_back({
+            .cookie = socketCookie(sockinfo),
+            .uid = sockinfo->idiag_uid,
+            .netId = mark.netId,
+            .rttUs = diff.rttUs,
+            .cwnd = TCPINFO_GET(tcpinfo, tcpi_snd_cwnd, tcpinfoLen, 0),
+            .totalRetrans = TCPINFO_GET(tcpinfo, tcpi_total_retrans, tcpinfoLen, 0),
+            .deliveryRate = TCPINFO_GET(tcpinfo, tcpi_delivery_rate, tcpinfoLen, 0),
+    });
+
+    {
+        // Add the socket to the quality distributions of its network. diff.lost tracks lost_out,
+        // which can go down, so it is only a loss rate if it did not.
+        auto& quality = next->networkQuality[mark.netId];
+        quality.rttUs.add(diff.rttUs);
+        if (diff.sent > 0 && static_cast<int32_t>(diff.lost) >= 0) {
+            quality.lossPerMille.add(
+                    std::min<uint64_t>(uint64_t{diff.lost} * 1000 / diff.sent, 1000));
+        }
     }
 
     {
         // Aggregate the diff per network id.
-        auto& stats = mNetworkStats[mark.netId];
+        auto& stats = next->networkStats[mark.netId];
         stats.sent += diff.sent;
         stats.lost += diff.lost;
         stats.rttUs += diff.rttUs;
@@ -317,19 +496,38 @@ void TcpSocketMonitor::updateSocketStats(time_point now, Fwmark mark,
     }
 }
 
+void TcpSocketMonitor::retireSocket(const TcpSocketTable& previous, PollResult* next,
+                                    const struct inet_diag_msg *sockinfo,
+                                    const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) {
+    const SocketEntry* entry = previous.find(socketCookie(sockinfo));
+    if (entry == nullptr || tcpinfo == nullptr) {
+        return;
+    }
+
+    // The socket is gone, so it no longer counts towards the per-socket averages, but what it sent
+    // and lost since it was last seen still counts.
+    auto& stats = next->networkStats[entry->mark.netId];
+    stats.sent += TCPINFO_GET(tcpinfo, tcpi_segs_out, tcpinfoLen, 0) - entry->sent;
+    stats.lost += TCPINFO_GET(tcpinfo, tcpi_lost, tcpinfoLen, 0) - entry->lost;
+}
+
 TcpSocketMonitor::TcpSocketMonitor() {
     std::lock_guard guard(mLock);
 
+    const int listener = SockDiag::openTcpDestroyListener();
+    if (listener < 0) {
+        ALOGW("TCP socket destroy notifications unavailable, sweeping by timestamp: %s",
+              strerror(-listener));
+    } else {
+        mDestroyListener.reset(listener);
+    }
+
     mNextSleepDurationMs = kDefaultPollingInterval;
+    mAdaptiveSleepDurationMs = kDefaultPollingInterval;
+    mPollRequested = false;
+    mPollInProgress = false;
     mIsRunning = true;
     mIsSuspended = true;
-    mPollingThread = std::thread([this] {
-        (void) this;
-        while (isRunning()) {
-            poll();
-            waitForNextPoll();
-        }
-    });
 }
 
 TcpSocketMonitor::~TcpSocketMonitor() {
@@ -339,7 +537,8 @@ TcpSocketMonitor::~TcpSocketMonitor() {
         mIsSuspended = true;
     }
     mCv.notify_all();
-    mPollingThread.join();
+    // Only resumePolling() starts the thread, and nothing calls it once the destructor runs.
+    if (mPollingThread.joinable()) mPollingThread.join();
 }
 
 }  // namespace net
@@ -22,12 +22,16 @@
 #include <mutex>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
 #include "netdutils/DumpWriter.h"
 #include "utils/String16.h"
 
 #include "Fwmark.h"
+#include "QuantileSketch.h"
+#include "TcpSocketTable.h"
 
 struct inet_diag_msg;
 struct tcp_info;
@@ -35,6 +39,10 @@ struct tcp_info;
 namespace android {
 namespace net {
 
+namespace netd {
+class TcpSocketMonitorProto;
+}
+
 using std::chrono::milliseconds;
 
 class TcpSocketMonitor {
@@ -43,6 +51,14 @@ class TcpSocketMonitor {
 
     static const String16 DUMP_KEYWORD;
     static const milliseconds kDefaultPollingInterval;
+    // The adaptive polling interval stays within [base / kMaxSpeedup, base * kMaxSlowdown], where
+    // base is the interval set by setPollingInterval().
+    static constexpr int kMaxSpeedup = 4;
+    static constexpr int kMaxSlowdown = 8;
+    // A poll that sees fewer segments sent than this, across all networks, is idle.
+    static constexpr uint32_t kIdleSegments = 16;
+    // A poll where at least this percentage of the segments sent were lost is a loss spike.
+    static constexpr uint32_t kLossSpikePercent = 5;
 
     // A subset of fields found in struct inet_diag_msg and struct tcp_info.
     struct TcpStats {
@@ -59,59 +75,123 @@ class TcpSocketMonitor {
         int32_t nSockets;
     };
 
-    // Socket metadata used for computing TcpStats diff across sock_diag dumps.
-    struct SocketEntry {
-        // Number of packets sent. Tracks struct tcp_sock data_segs_out.
-        // Not available on 3.18 kernels.
-        uint32_t sent;
-        // Number of packets lost. Tracks struct tcp_sock lost_out.
-        uint32_t lost;
-        // Last update timestamp for that socket.
-        time_point lastUpdate;
-        // Socket mark.
-        Fwmark mark;
-        // The uid owning the socket.
+    // Distributions of per-socket TCP quality on one network, over the sockets of one poll.
+    struct TcpQuality {
+        // Smoothed round trip time of each socket, in microseconds.
+        QuantileSketch rttUs;
+        // Segments lost per thousand sent by each socket that sent data since the previous poll.
+        QuantileSketch lossPerMille;
+    };
+
+    // The state of one socket at the last poll, for export to analytics.
+    struct SocketInfo {
+        uint64_t cookie;
         uint32_t uid;
+        uint32_t netId;
+        // Smoothed round trip time. Tracks struct tcp_sock srtt_us.
+        uint32_t rttUs;
+        // Congestion window, in segments.
+        uint32_t cwnd;
+        // Total number of retransmitted segments.
+        uint32_t totalRetrans;
+        // Most recent delivery rate in bytes per second. Not available before 4.15 kernels.
+        uint64_t deliveryRate;
     };
 
+    using SocketEntry = TcpSocketTable::Entry;
+
     TcpSocketMonitor();
     ~TcpSocketMonitor();
 
     void dump(netdutils::DumpWriter& dw);
+    // The state of the last poll. Unlike dump(), does not dump the live sockets.
+    void dumpProto(netd::TcpSocketMonitorProto* proto);
+    // Sets the base polling interval. The actual interval doubles after every idle poll and halves
+    // after every poll that sees a loss spike, and returns to the base otherwise.
     void setPollingInterval(milliseconds duration);
+    // Starts the polling thread the first time it is called, so that devices that never resume
+    // polling never pay for the thread.
     void resumePolling();
     void suspendPolling();
+    // Wakes up the polling thread to poll now, unless polling is suspended.
+    void requestPoll();
+
+    // Returns the specified percentile (0 to 100) of the RTTs, in microseconds, or of the loss
+    // rates, in segments per thousand, of the sockets on |netId| at the last poll. Returns -1 if
+    // the last poll saw no such socket.
+    int32_t getRttPercentileUs(uint32_t netId, int percentile);
+    int32_t getLossPercentilePerMille(uint32_t netId, int percentile);
+    // Returns the state of every socket seen by the last poll.
+    std::vector<SocketInfo> getSocketInfos();
 
   private:
+    // The state built by one poll: the sockets it saw, and what they did since the previous poll.
+    struct PollResult {
+        // Table of SocketEntry structs keyed by socket cookie. This table tracks per-socket data
+        // needed for computing diffs between sock_diag dumps.
+        TcpSocketTable socketEntries;
+        // Map of TcpStats entries aggregated per network and keyed per network id.
+        std::unordered_map<uint32_t, TcpStats> networkStats;
+        // Map of TcpQuality entries keyed per network id.
+        std::unordered_map<uint32_t, TcpQuality> networkQuality;
+        // The state of every socket seen, in dump order.
+        std::vector<SocketInfo> socketInfos;
+
+        // Forgets everything, keeping the memory allocated for reuse by the next poll.
+        void reset();
+    };
+
     void poll();
     void waitForNextPoll();
     bool isRunning();
-    void updateSocketStats(time_point now, Fwmark mark, const struct inet_diag_msg *sockinfo,
-                           const struct tcp_info *tcpinfo, uint32_t tcpinfoLen) REQUIRES(mLock);
-
-    // Lock guarding all reads and writes to member variables.
+    static void updateSocketStats(const TcpSocketTable& previous, PollResult* next, Fwmark mark,
+                                  const struct inet_diag_msg *sockinfo,
+                                  const struct tcp_info *tcpinfo, uint32_t tcpinfoLen);
+    // Credits what a socket the kernel has destroyed sent and lost since the last poll to its
+    // network. The socket is not carried over to the next poll's table.
+    static void retireSocket(const TcpSocketTable& previous, PollResult* next,
+                             const struct inet_diag_msg *sockinfo, const struct tcp_info *tcpinfo,
+                             uint32_t tcpinfoLen);
+    // Picks the interval until the next poll from the traffic seen by the last one.
+    void adaptPollingInterval() REQUIRES(mLock);
+    // The state kept between polls. The live sockets are dumped by dump().
+    void dumpLocked(netdutils::DumpWriter& dw) REQUIRES(mLock);
+
+    // Lock guarding all reads and writes to member variables, except those documented as owned by
+    // the polling thread. The polling thread does not hold it while it talks to the kernel or to
+    // the event listener.
     std::mutex mLock;
     // Used by the polling thread for sleeping between poll operations.
     std::condition_variable mCv;
-    // The thread that polls sock_diag continuously.
+    // The thread that polls sock_diag continuously. Started by the first resumePolling(), under
+    // mLock, and joined by the destructor.
     std::thread mPollingThread;
     // The duration of a sleep between polls. Can be updated by the instance owner for dynamically
     // adjusting the polling rate.
     milliseconds mNextSleepDurationMs GUARDED_BY(mLock);
+    // The duration of the next sleep, adapted from mNextSleepDurationMs to recent traffic.
+    milliseconds mAdaptiveSleepDurationMs GUARDED_BY(mLock);
+    // True if requestPoll() was called since the last poll.
+    bool mPollRequested GUARDED_BY(mLock);
+    // True while the polling thread is building mNext.
+    bool mPollInProgress GUARDED_BY(mLock);
     // The time of the last successful poll operation.
     time_point mLastPoll GUARDED_BY(mLock);
     // True if the polling thread should sleep until notified.
     bool mIsSuspended GUARDED_BY(mLock);
     // True while the polling thread should poll.
     bool mIsRunning GUARDED_BY(mLock);
-    // Map of SocketEntry structs keyed by socket cookie. This map tracks per-socket data needed for
-    // computing diffs between sock_diag dumps. Entries for closed sockets are continuously cleaned
-    // after every dump operation based on timestamps of last updates.
-    std::unordered_map<uint64_t, SocketEntry> mSocketEntries GUARDED_BY(mLock);
-    // Map of TcpStats entries aggregated per network and keyed per network id.
-    // This map tracks per-network data for a single sock_diag dump and is cleared before every dump
-    // operation.
-    std::unordered_map<uint32_t, TcpStats> mNetworkStats GUARDED_BY(mLock);
+    // Subscribed to the kernel's notifications of destroyed TCP sockets, or -1 if they are not
+    // available. Set by the constructor, then owned by the polling thread.
+    base::unique_fd mDestroyListener;
+    // The buffer the destroy notifications are read into. Owned by the polling thread.
+    std::vector<uint8_t> mNotificationBuffer;
+    // The result of the last poll. Only modified under mLock, and only while mPollInProgress is
+    // false or by the polling thread itself, so the polling thread may read it without the lock
+    // while it builds mNext.
+    PollResult mCurrent;
+    // The result of the poll in progress. Owned by the polling thread.
+    PollResult mNext;
 };
 
 }  // namespace net
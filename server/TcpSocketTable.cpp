@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TcpSocketTable.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace android::net {
+
+size_t TcpSocketTable::indexFor(uint64_t cookie) const {
+    // Fibonacci hashing. Cookies are allocated sequentially, so their low bits alone would cluster.
+    return static_cast<size_t>((cookie * 0x9e3779b97f4a7c15ULL) >> (64 - mBits));
+}
+
+size_t TcpSocketTable::findIndex(uint64_t cookie) const {
+    if (mSlots.empty()) {
+        return 0;
+    }
+    const size_t mask = mSlots.size() - 1;
+    for (size_t i = indexFor(cookie);; i = (i + 1) & mask) {
+        const Slot& slot = mSlots[i];
+        if (slot.epoch == kEmpty) {
+            return mSlots.size();
+        }
+        if (slot.cookie == cookie && isLive(slot)) {
+            return i;
+        }
+    }
+}
+
+const TcpSocketTable::Entry* TcpSocketTable::find(uint64_t cookie) const {
+    const size_t i = findIndex(cookie);
+    return (i < mSlots.size()) ? &mSlots[i].entry : nullptr;
+}
+
+void TcpSocketTable::update(uint64_t cookie, const Entry& entry) {
+    // Keep at least a quarter of the slots empty, so that probe sequences are short and end.
+    if ((mUsed + 1) * 4 > mSlots.size() * 3) {
+        rehash();
+    }
+
+    const size_t mask = mSlots.size() - 1;
+    size_t reusable = mSlots.size();
+    size_t i = indexFor(cookie);
+    for (;; i = (i + 1) & mask) {
+        Slot& slot = mSlots[i];
+        if (slot.epoch == kEmpty) {
+            break;
+        }
+        if (!isLive(slot)) {
+            if (reusable == mSlots.size()) reusable = i;
+        } else if (slot.cookie == cookie) {
+            slot.epoch = mEpoch;
+            slot.entry = entry;
+            return;
+        }
+    }
+
+    if (reusable == mSlots.size()) {
+        reusable = i;
+        ++mUsed;
+    }
+    mSlots[reusable] = {.cookie = cookie, .epoch = mEpoch, .entry = entry};
+}
+
+void TcpSocketTable::erase(uint64_t cookie) {
+    const size_t i = findIndex(cookie);
+    if (i < mSlots.size()) {
+        mSlots[i].epoch = kErased;
+    }
+}
+
+void TcpSocketTable::clear() {
+    std::vector<Slot>().swap(mSlots);
+    mBits = 0;
+    mUsed = 0;
+}
+
+size_t TcpSocketTable::currentSize() const {
+    return std::count_if(mSlots.begin(), mSlots.end(),
+                         [this](const Slot& slot) { return slot.epoch == mEpoch; });
+}
+
+void TcpSocketTable::rehash() {
+    std::vector<Slot> old;
+    old.swap(mSlots);
+
+    size_t live = std::count_if(old.begin(), old.end(),
+                                [this](const Slot& slot) { return isLive(slot); });
+    // At most half full after rehashing, so that the next rehash is far away.
+    const size_t capacity = std::bit_ceil(std::max(kMinCapacity, (live + 1) * 2));
+    mSlots.assign(capacity, Slot{.cookie = 0, .epoch = kEmpty, .entry = {}});
+    mBits = std::countr_zero(capacity);
+    mUsed = 0;
+
+    const size_t mask = capacity - 1;
+    for (const Slot& slot : old) {
+        if (!isLive(slot)) continue;
+        size_t i = indexFor(slot.cookie);
+        while (mSlots[i].epoch != kEmpty) i = (i + 1) & mask;
+        mSlots[i] = slot;
+        ++mUsed;
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Fwmark.h"
+
+namespace android::net {
+
+// The sockets seen by TcpSocketMonitor, keyed by socket cookie. An open-addressing hash table with
+// linear probing, stored in a single array.
+//
+// Every entry is tagged with the epoch (i.e., the poll) that last updated it. An entry stays live
+// for the epoch after that, so that the next poll can diff against it, and is dead from then on.
+// Expiring the sockets that a poll did not see is therefore free: it happens when the epoch
+// advances. Dead slots are reused by later insertions and dropped when the table is rehashed.
+class TcpSocketTable {
+  public:
+    // Socket metadata used for computing TcpStats diff across sock_diag dumps.
+    struct Entry {
+        // Number of packets sent. Tracks struct tcp_sock data_segs_out.
+        // Not available on 3.18 kernels.
+        uint32_t sent;
+        // Number of packets lost. Tracks struct tcp_sock lost_out.
+        uint32_t lost;
+        // Socket mark.
+        Fwmark mark;
+        // The uid owning the socket.
+        uint32_t uid;
+    };
+
+    // Starts a new epoch. Entries last updated before the previous epoch are dead from now on.
+    void advanceEpoch() { ++mEpoch; }
+
+    // Makes every entry dead, like clear(), but keeps the memory for reuse by later insertions.
+    void expireAll() { mEpoch += 2; }
+
+    // Returns the live entry for |cookie|, or nullptr if there is none. The pointer is valid until
+    // the next call to a non-const method.
+    const Entry* find(uint64_t cookie) const;
+
+    // Inserts or replaces the entry for |cookie|, tagged with the current epoch.
+    void update(uint64_t cookie, const Entry& entry);
+
+    // Removes the entry for |cookie|, if any.
+    void erase(uint64_t cookie);
+
+    // Removes all entries and frees the memory used by the table.
+    void clear();
+
+    // Calls |fn| with the cookie and entry of every socket updated in the current epoch.
+    template <typename Fn>
+    void forEachCurrent(Fn&& fn) const {
+        for (const Slot& slot : mSlots) {
+            if (slot.epoch == mEpoch) fn(slot.cookie, slot.entry);
+        }
+    }
+
+    // The number of entries updated in the current epoch.
+    size_t currentSize() const;
+    // The number of slots in the table, live or not.
+    size_t capacity() const { return mSlots.size(); }
+    // The heap memory used by the table, in bytes.
+    size_t memoryUsage() const { return mSlots.capacity() * sizeof(Slot); }
+
+  private:
+    // Slots that were never used end probe sequences. Erased slots, like dead ones, do not.
+    static constexpr uint32_t kEmpty = 0;
+    static constexpr uint32_t kErased = 1;
+    static constexpr uint32_t kFirstEpoch = 2;
+    static constexpr size_t kMinCapacity = 64;
+
+    struct Slot {
+        uint64_t cookie;
+        uint32_t epoch;
+        Entry entry;
+    };
+
+    bool isLive(const Slot& slot) const {
+        return slot.epoch >= kFirstEpoch && slot.epoch + 1 >= mEpoch;
+    }
+    size_t indexFor(uint64_t cookie) const;
+    // Returns the index of the live slot for |cookie|, or mSlots.size() if there is none.
+    size_t findIndex(uint64_t cookie) const;
+    // Resizes the table to fit the live entries, dropping all others.
+    void rehash();
+
+    std::vector<Slot> mSlots;
+    // log2(mSlots.size()), or 0 if the table is empty.
+    unsigned mBits = 0;
+    // The number of slots that are not kEmpty.
+    size_t mUsed = 0;
+    uint32_t mEpoch = kFirstEpoch;
+};
+
+}  // namespace android::net
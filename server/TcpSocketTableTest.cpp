@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "TcpSocketTable.h"
+
+namespace android::net {
+
+namespace {
+
+TcpSocketTable::Entry makeEntry(uint32_t sent) {
+    return {.sent = sent, .lost = 0, .mark = Fwmark(), .uid = 10000};
+}
+
+}  // namespace
+
+TEST(TcpSocketTableTest, UpdateAndFind) {
+    TcpSocketTable table;
+    EXPECT_EQ(nullptr, table.find(1));
+
+    table.update(1, makeEntry(10));
+    table.update(2, makeEntry(20));
+    ASSERT_NE(nullptr, table.find(1));
+    EXPECT_EQ(10U, table.find(1)->sent);
+    ASSERT_NE(nullptr, table.find(2));
+    EXPECT_EQ(20U, table.find(2)->sent);
+    EXPECT_EQ(nullptr, table.find(3));
+
+    table.update(1, makeEntry(11));
+    EXPECT_EQ(11U, table.find(1)->sent);
+    EXPECT_EQ(2U, table.currentSize());
+}
+
+TEST(TcpSocketTableTest, EntriesExpireAfterOneEpoch) {
+    TcpSocketTable table;
+    table.update(1, makeEntry(10));
+    table.update(2, makeEntry(20));
+
+    // The next poll still sees the previous one's entries, but only updates socket 1.
+    table.advanceEpoch();
+    ASSERT_NE(nullptr, table.find(2));
+    table.update(1, makeEntry(11));
+    EXPECT_EQ(1U, table.currentSize());
+
+    // Socket 2 was not seen by the last poll, so it is gone.
+    table.advanceEpoch();
+    EXPECT_NE(nullptr, table.find(1));
+    EXPECT_EQ(nullptr, table.find(2));
+
+    table.advanceEpoch();
+    EXPECT_EQ(nullptr, table.find(1));
+}
+
+TEST(TcpSocketTableTest, ExpireAllKeepsMemory) {
+    TcpSocketTable table;
+    table.update(1, makeEntry(10));
+    table.update(2, makeEntry(20));
+    const size_t capacity = table.capacity();
+
+    table.expireAll();
+    EXPECT_EQ(nullptr, table.find(1));
+    EXPECT_EQ(nullptr, table.find(2));
+    EXPECT_EQ(0U, table.currentSize());
+    EXPECT_EQ(capacity, table.capacity());
+
+    table.update(2, makeEntry(21));
+    ASSERT_NE(nullptr, table.find(2));
+    EXPECT_EQ(21U, table.find(2)->sent);
+    EXPECT_EQ(1U, table.currentSize());
+}
+
+TEST(TcpSocketTableTest, Erase) {
+    TcpSocketTable table;
+    table.update(1, makeEntry(10));
+    table.update(2, makeEntry(20));
+    table.erase(1);
+    table.erase(3);
+    EXPECT_EQ(nullptr, table.find(1));
+    EXPECT_NE(nullptr, table.find(2));
+
+    table.update(1, makeEntry(12));
+    ASSERT_NE(nullptr, table.find(1));
+    EXPECT_EQ(12U, table.find(1)->sent);
+}
+
+TEST(TcpSocketTableTest, ManyEpochsDoNotGrowTheTable) {
+    constexpr uint64_t kSockets = 1000;
+    TcpSocketTable table;
+    uint64_t cookie = 0;
+    for (int epoch = 0; epoch < 100; ++epoch) {
+        table.advanceEpoch();
+        // A new set of sockets every epoch, as if all the old ones had closed.
+        for (uint64_t i = 0; i < kSockets; ++i) {
+            table.update(++cookie, makeEntry(i));
+        }
+        EXPECT_EQ(kSockets, table.currentSize());
+    }
+    for (uint64_t i = 0; i < kSockets; ++i) {
+        ASSERT_NE(nullptr, table.find(cookie - i));
+        EXPECT_EQ(kSockets - 1 - i, table.find(cookie - i)->sent);
+    }
+    // Two epochs of live entries, at most half full after a rehash, rounded up to a power of two.
+    EXPECT_LE(table.capacity(), 8 * kSockets);
+
+    size_t visited = 0;
+    table.forEachCurrent([&](uint64_t, const TcpSocketTable::Entry&) { ++visited; });
+    EXPECT_EQ(kSockets, visited);
+
+    table.clear();
+    EXPECT_EQ(0U, table.capacity());
+    EXPECT_EQ(0U, table.memoryUsage());
+    EXPECT_EQ(nullptr, table.find(cookie));
+}
+
+}  // namespace android::net
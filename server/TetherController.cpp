@@ -29,10 +29,11 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <algorithm>
 #include <array>
 #include <cstdlib>
-#include <regex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define LOG_TAG "TetherController"
@@ -47,13 +48,19 @@
 #include <netdutils/StatusOr.h>
 
 #include "Controllers.h"
+#include "DumpBuffer.h"
 #include "Fwmark.h"
 #include "InterfaceController.h"
+#include "IptablesScript.h"
+#include "IptablesTokenizer.h"
 #include "NetdConstants.h"
+#include "NetdMetrics.h"
 #include "NetworkController.h"
+#include "ParameterCache.h"
 #include "Permission.h"
 #include "TcUtils.h"
 #include "TetherController.h"
+#include "netd_dump.pb.h"
 
 #include "android/net/TetherOffloadRuleParcel.h"
 
@@ -63,6 +70,7 @@ namespace net {
 using android::base::Join;
 using android::base::Pipe;
 using android::base::Result;
+using android::base::StringAppendF;
 using android::base::StringPrintf;
 using android::base::unique_fd;
 using android::netdutils::DumpWriter;
@@ -72,6 +80,11 @@ using android::netdutils::StatusOr;
 
 namespace {
 
+NetdMetrics::Counter sStatsPolls("tether.stats_polls");
+// Polls of one address family that had to run iptables because the counters could not be read
+// from the kernel.
+NetdMetrics::Counter sStatsIptablesFallbacks("tether.stats_iptables_fallbacks");
+
 const char BP_TOOLS_MODE[] = "bp-tools";
 const char IPV4_FORWARDING_PROC_FILE[] = "/proc/sys/net/ipv4/ip_forward";
 const char IPV6_FORWARDING_PROC_FILE[] = "/proc/sys/net/ipv6/conf/all/forwarding";
@@ -81,20 +94,19 @@ constexpr const char kTcpBeLiberal[] = "/proc/sys/net/netfilter/nf_conntrack_tcp
 // Chosen to match AID_DNS_TETHER, as made "friendly" by fs_config_generator.py.
 constexpr const char kDnsmasqUsername[] = "dns_tether";
 
-bool writeToFile(const char* filename, const char* value) {
-    int fd = open(filename, O_WRONLY | O_CLOEXEC);
-    if (fd < 0) {
-        ALOGE("Failed to open %s: %s", filename, strerror(errno));
-        return false;
-    }
+// When set, stopTethering() leaves dnsmasq running but idle, and the next startTethering() with
+// the same DHCP ranges reuses it instead of starting another.
+constexpr const char kDnsmasqResidentProperty[] = "persist.netd.dnsmasq_resident";
+
+// What an idle dnsmasq listens on: nothing that a tethered client can reach. dnsmasq cannot be
+// told to listen on no interface at all.
+constexpr const char kDnsmasqIdleIfacesCmd[] = "update_ifaces|lo";
 
-    const ssize_t len = strlen(value);
-    if (write(fd, value, len) != len) {
-        ALOGE("Failed to write %s to %s: %s", value, filename, strerror(errno));
-        close(fd);
+bool writeToFile(const char* filename, const char* value) {
+    if (int ret = ParameterCache::write(filename, value)) {
+        ALOGE("Failed to write %s to %s: %s", value, filename, strerror(-ret));
         return false;
     }
-    close(fd);
     return true;
 }
 
@@ -118,6 +130,11 @@ void configureForIPv6Client(const char *interface) {
     InterfaceController::setEnableIPv6(interface, 0);
 }
 
+// The only source and destination that the tether counting rules match.
+bool isWildcardAddress(std::string_view address) {
+    return address == "0.0.0.0/0" || address == "::/0";
+}
+
 bool inBpToolsMode() {
     // In BP tools mode, do not disable IP forwarding
     char bootmode[PROPERTY_VALUE_MAX] = {0};
@@ -128,6 +145,7 @@ bool inBpToolsMode() {
 }  // namespace
 
 auto TetherController::iptablesRestoreFunction = execIptablesRestoreWithOutput;
+auto TetherController::getChainCountersFunction = getIptablesChainCounters;
 
 const std::string GET_TETHER_STATS_COMMAND = StringPrintf(
     "*filter\n"
@@ -150,10 +168,25 @@ int TetherController::DnsmasqState::sendCmd(int daemonFd, const std::string& cmd
 void TetherController::DnsmasqState::clear() {
     update_ifaces_cmd.clear();
     update_dns_cmd.clear();
+    sent_ifaces_cmd.clear();
+    sent_dns_cmd.clear();
 }
 
-int TetherController::DnsmasqState::sendAllState(int daemonFd) const {
-    return sendCmd(daemonFd, update_ifaces_cmd) | sendCmd(daemonFd, update_dns_cmd);
+int TetherController::DnsmasqState::sendAllState(int daemonFd) {
+    int ret = 0;
+    for (auto [cmd, sent] : {std::pair{&update_ifaces_cmd, &sent_ifaces_cmd},
+                             std::pair{&update_dns_cmd, &sent_dns_cmd}}) {
+        // dnsmasq re-applies every update it gets, resetting its upstream servers or listening
+        // sockets, so skip the ones that would not change anything. Otherwise every tethered or
+        // untethered interface would also reset the DNS servers.
+        if (*cmd == *sent) continue;
+        if (sendCmd(daemonFd, *cmd) != 0) {
+            ret = -1;
+            continue;
+        }
+        *sent = *cmd;
+    }
+    return ret;
 }
 
 TetherController::TetherController() {
@@ -214,15 +247,6 @@ int TetherController::startTethering(bool usingLegacyDnsProxy, int num_addrs, ch
         return -errno;
     }
 
-    ALOGD("Starting tethering services");
-
-    unique_fd pipeRead, pipeWrite;
-    if (!Pipe(&pipeRead, &pipeWrite, O_CLOEXEC)) {
-        int res = errno;
-        ALOGE("pipe2() failed (%s)", strerror(errno));
-        return -res;
-    }
-
     // Set parameters
     Fwmark fwmark;
     fwmark.netId = NetworkController::LOCAL_NET_ID;
@@ -232,7 +256,7 @@ int TetherController::startTethering(bool usingLegacyDnsProxy, int num_addrs, ch
     char markStr[UINT32_HEX_STRLEN];
     snprintf(markStr, sizeof(markStr), "0x%x", fwmark.intValue);
 
-    std::vector<const std::string> argVector = {
+    std::vector<std::string> argVector = {
             "/system/bin/dnsmasq",
             "--keep-in-foreground",
             "--no-resolv",
@@ -257,6 +281,30 @@ int TetherController::startTethering(bool usingLegacyDnsProxy, int num_addrs, ch
                                          dhcp_ranges[addrIndex + 1]));
     }
 
+    if (mDaemonPid != 0) {
+        // Left running by stopTethering() in resident mode.
+        if (!isDaemonRunning()) {
+            ALOGE("Resident dnsmasq %d exited", mDaemonPid);
+            mDaemonPid = 0;
+        } else if (argVector == mDaemonArgs) {
+            ALOGD("Reusing resident tethering services");
+            configureForTethering(true);
+            mIsTetheringStarted = true;
+            applyDnsInterfaces();
+            return 0;
+        }
+        stopDaemon();
+    }
+
+    ALOGD("Starting tethering services");
+
+    unique_fd pipeRead, pipeWrite;
+    if (!Pipe(&pipeRead, &pipeWrite, O_CLOEXEC)) {
+        int res = errno;
+        ALOGE("pipe2() failed (%s)", strerror(errno));
+        return -res;
+    }
+
     std::vector<char*> args(argVector.size() + 1);
     for (unsigned i = 0; i < argVector.size(); i++) {
         args[i] = (char*)argVector[i].c_str();
@@ -305,6 +353,7 @@ int TetherController::startTethering(bool usingLegacyDnsProxy, int num_addrs, ch
     }
     mDaemonPid = pid;
     mDaemonFd = pipeWrite.release();
+    mDaemonArgs = std::move(argVector);
     configureForTethering(true);
     mIsTetheringStarted = true;
     applyDnsInterfaces();
@@ -348,15 +397,34 @@ int TetherController::stopTethering() {
         return 0;
     }
 
+    if (property_get_bool(kDnsmasqResidentProperty, false)) {
+        // Stop serving, but keep dnsmasq and its DNS configuration for the next session. If it
+        // cannot be told, stop it as usual.
+        mDnsmasqState.update_ifaces_cmd = kDnsmasqIdleIfacesCmd;
+        if (mDnsmasqState.sendAllState(mDaemonFd) == 0) {
+            ALOGD("Tethering services idle");
+            return 0;
+        }
+    }
+
     ALOGD("Stopping tethering services");
+    stopDaemon();
+    ALOGD("Tethering services stopped");
+    return 0;
+}
 
-    ::stopProcess(mDaemonPid, "tethering(dnsmasq)");
+bool TetherController::isDaemonRunning() {
+    // A dnsmasq that exited is reaped here, so its PID cannot be reused behind our back.
+    return waitpid(mDaemonPid, nullptr, WNOHANG) == 0;
+}
+
+void TetherController::stopDaemon() {
+    if (mDaemonPid != 0) ::stopProcess(mDaemonPid, "tethering(dnsmasq)");
     mDaemonPid = 0;
     close(mDaemonFd);
     mDaemonFd = -1;
+    mDaemonArgs.clear();
     mDnsmasqState.clear();
-    ALOGD("Tethering services stopped");
-    return 0;
 }
 
 bool TetherController::isTetheringStarted() {
@@ -428,6 +496,10 @@ const std::list<std::string> &TetherController::getDnsForwarders() const {
 }
 
 bool TetherController::applyDnsInterfaces() {
+    // A resident dnsmasq left idle by stopTethering() keeps serving only lo. startTethering()
+    // applies the interfaces when tethering starts again.
+    if (!mIsTetheringStarted) return true;
+
     std::string daemonCmd = "update_ifaces";
     bool haveInterfaces = false;
 
@@ -607,6 +679,142 @@ int TetherController::enableNat(const char* intIface, const char* extIface) {
     return 0;
 }
 
+int TetherController::enableNatForDownstreams(const std::string& extIface,
+                                              const std::vector<std::string>& intIfaces) {
+    ALOGV("enableNatForDownstreams(extIface=<%s>, intIfaces=<%s>)", extIface.c_str(),
+          Join(intIfaces, ' ').c_str());
+
+    if (!isIfaceName(extIface)) {
+        return -ENODEV;
+    }
+
+    std::vector<std::string> newIfaces;
+    for (const std::string& intIface : intIfaces) {
+        if (!isIfaceName(intIface)) {
+            return -ENODEV;
+        }
+        if (intIface == extIface) {
+            ALOGE("Duplicate interface specified: %s %s", intIface.c_str(), extIface.c_str());
+            return -EINVAL;
+        }
+        if (isForwardingPairEnabled(intIface, extIface) ||
+            std::find(newIfaces.begin(), newIfaces.end(), intIface) != newIfaces.end()) {
+            continue;
+        }
+        newIfaces.push_back(intIface);
+    }
+    if (newIfaces.empty()) {
+        return 0;
+    }
+
+    ForwardRules rules;
+    const bool firstNat = !isAnyForwardingPairEnabled();
+    if (firstNat) {
+        // The same as setupIPv6CountersChain() and setTetherGlobalAlertRule().
+        const std::string alertRule = StringPrintf("-I %s -j %s\n", LOCAL_FORWARD,
+                                                   BandwidthController::LOCAL_GLOBAL_ALERT);
+        rules.v4Filter += alertRule;
+        StringAppendF(&rules.v6Filter, "-A %s -g %s\n", LOCAL_FORWARD, LOCAL_TETHER_COUNTERS_CHAIN);
+        rules.v6Filter += alertRule;
+    }
+    for (const std::string& intIface : newIfaces) {
+        makeForwardRules(true, intIface.c_str(), extIface.c_str(), &rules);
+    }
+
+    std::string v4Cmds;
+    if (!isAnyForwardingEnabledOnUpstream(extIface)) {
+        v4Cmds = StringPrintf("*nat\n-A %s -o %s -j MASQUERADE\nCOMMIT\n", LOCAL_NAT_POSTROUTING,
+                              extIface.c_str());
+    }
+    v4Cmds += makeRestoreCommands(rules.v4Raw, rules.v4Filter, true);
+    const std::string v6Cmds = makeRestoreCommands(rules.v6Raw, rules.v6Filter, false);
+
+    if (iptablesRestoreFunction(V6, v6Cmds, nullptr) ||
+        iptablesRestoreFunction(V4, v4Cmds, nullptr)) {
+        ALOGE("Error setting NAT rules: extIface=%s", extIface.c_str());
+        // unwind what's been done, but don't care about success - what more could we do?
+        if (firstNat) {
+            setDefaults();
+        } else {
+            for (const std::string& intIface : newIfaces) {
+                setForwardRules(false, intIface.c_str(), extIface.c_str());
+            }
+        }
+        return -EREMOTEIO;
+    }
+
+    for (const std::string& intIface : newIfaces) {
+        addForwardingPair(intIface, extIface);
+    }
+    return 0;
+}
+
+int TetherController::switchUpstream(const std::string& oldExtIface,
+                                     const std::string& newExtIface) {
+    ALOGV("switchUpstream(oldExtIface=<%s>, newExtIface=<%s>)", oldExtIface.c_str(),
+          newExtIface.c_str());
+
+    if (!isIfaceName(oldExtIface) || !isIfaceName(newExtIface)) {
+        return -ENODEV;
+    }
+    if (oldExtIface == newExtIface) {
+        return 0;
+    }
+
+    std::vector<std::string> intIfaces;
+    auto extIfaceMatches = mFwdIfaces.equal_range(oldExtIface);
+    for (auto it = extIfaceMatches.first; it != extIfaceMatches.second; ++it) {
+        if (!it->second.active) continue;
+        if (it->second.iface == newExtIface) {
+            ALOGE("Duplicate interface specified: %s %s", newExtIface.c_str(),
+                  newExtIface.c_str());
+            return -EINVAL;
+        }
+        intIfaces.push_back(it->second.iface);
+    }
+    if (intIfaces.empty()) {
+        return 0;
+    }
+
+    // Only the rules that name the upstream change. The per-downstream raw table rules, the
+    // global alert and the MSS clamping in the mangle table stay as they are.
+    ForwardRules removed;
+    ForwardRules added;
+    for (const std::string& intIface : intIfaces) {
+        makeForwardRules(false, intIface.c_str(), oldExtIface.c_str(), &removed);
+        if (!isForwardingPairEnabled(intIface, newExtIface)) {
+            makeForwardRules(true, intIface.c_str(), newExtIface.c_str(), &added);
+        }
+    }
+    const std::string v4Filter = removed.v4Filter + added.v4Filter;
+
+    // Everything that changes for IPv4 is in a single iptables-restore call, with the filter
+    // table first since that is where stale state is most likely to make a command fail.
+    std::string v4Cmds = makeRestoreCommands({}, v4Filter, true);
+    v4Cmds += StringPrintf("*nat\n-D %s -o %s -j MASQUERADE\n", LOCAL_NAT_POSTROUTING,
+                           oldExtIface.c_str());
+    if (!isAnyForwardingEnabledOnUpstream(newExtIface)) {
+        v4Cmds += StringPrintf("-A %s -o %s -j MASQUERADE\n", LOCAL_NAT_POSTROUTING,
+                               newExtIface.c_str());
+    }
+    v4Cmds += "COMMIT\n";
+
+    // IPv6 is not NATed, so it only needs the counting rules of any new pairs.
+    if ((!added.v6Filter.empty() &&
+         iptablesRestoreFunction(V6, makeRestoreCommands({}, added.v6Filter, false), nullptr)) ||
+        iptablesRestoreFunction(V4, v4Cmds, nullptr)) {
+        ALOGE("Error switching upstream from %s to %s", oldExtIface.c_str(),
+              newExtIface.c_str());
+        return -EREMOTEIO;
+    }
+
+    for (const std::string& intIface : intIfaces) {
+        markForwardingPairDisabled(intIface, oldExtIface);
+        addForwardingPair(intIface, newExtIface);
+    }
+    return 0;
+}
+
 int TetherController::setTetherGlobalAlertRule() {
     // Only add this if we are the first enabled nat
     if (isAnyForwardingPairEnabled()) {
@@ -711,59 +919,68 @@ std::string TetherController::makeTetherCountingRule(const char *if1, const char
     return StringPrintf("-A %s -i %s -o %s -j RETURN", LOCAL_TETHER_COUNTERS_CHAIN, if1, if2);
 }
 
-int TetherController::setForwardRules(bool add, const char *intIface, const char *extIface) {
+void TetherController::makeForwardRules(bool add, const char* intIface, const char* extIface,
+                                        ForwardRules* rules) {
     const char *op = add ? "-A" : "-D";
 
-    std::string rpfilterCmd = StringPrintf(
-        "*raw\n"
-        "%s %s -i %s -m rpfilter --invert ! -s fe80::/64 -j DROP\n"
-        "COMMIT\n", op, LOCAL_RAW_PREROUTING, intIface);
-    if (iptablesRestoreFunction(V6, rpfilterCmd, nullptr) == -1 && add) {
-        return -EREMOTEIO;
-    }
-
-    std::vector<std::string> v4 = {
-            "*raw",
-            StringPrintf("%s %s -p tcp --dport 21 -i %s -j CT --helper ftp", op,
-                         LOCAL_RAW_PREROUTING, intIface),
-            StringPrintf("%s %s -p tcp --dport 1723 -i %s -j CT --helper pptp", op,
-                         LOCAL_RAW_PREROUTING, intIface),
-            "COMMIT",
-            "*filter",
-            StringPrintf("%s %s -i %s -o %s -m state --state ESTABLISHED,RELATED -g %s", op,
-                         LOCAL_FORWARD, extIface, intIface, LOCAL_TETHER_COUNTERS_CHAIN),
-            StringPrintf("%s %s -i %s -o %s -m state --state INVALID -j DROP", op, LOCAL_FORWARD,
-                         intIface, extIface),
-            StringPrintf("%s %s -i %s -o %s -g %s", op, LOCAL_FORWARD, intIface, extIface,
-                         LOCAL_TETHER_COUNTERS_CHAIN),
-    };
-
-    std::vector<std::string> v6 = {
-        "*filter",
-    };
+    StringAppendF(&rules->v6Raw, "%s %s -i %s -m rpfilter --invert ! -s fe80::/64 -j DROP\n", op,
+                  LOCAL_RAW_PREROUTING, intIface);
+
+    StringAppendF(&rules->v4Raw, "%s %s -p tcp --dport 21 -i %s -j CT --helper ftp\n", op,
+                  LOCAL_RAW_PREROUTING, intIface);
+    StringAppendF(&rules->v4Raw, "%s %s -p tcp --dport 1723 -i %s -j CT --helper pptp\n", op,
+                  LOCAL_RAW_PREROUTING, intIface);
+    StringAppendF(&rules->v4Filter,
+                  "%s %s -i %s -o %s -m state --state ESTABLISHED,RELATED -g %s\n", op,
+                  LOCAL_FORWARD, extIface, intIface, LOCAL_TETHER_COUNTERS_CHAIN);
+    StringAppendF(&rules->v4Filter, "%s %s -i %s -o %s -m state --state INVALID -j DROP\n", op,
+                  LOCAL_FORWARD, intIface, extIface);
+    StringAppendF(&rules->v4Filter, "%s %s -i %s -o %s -g %s\n", op, LOCAL_FORWARD, intIface,
+                  extIface, LOCAL_TETHER_COUNTERS_CHAIN);
 
     // We only ever add tethering quota rules so that they stick.
     if (add && !tetherCountingRuleExists(intIface, extIface)) {
-        v4.push_back(makeTetherCountingRule(intIface, extIface));
-        v4.push_back(makeTetherCountingRule(extIface, intIface));
-        v6.push_back(makeTetherCountingRule(intIface, extIface));
-        v6.push_back(makeTetherCountingRule(extIface, intIface));
+        const std::string inbound = makeTetherCountingRule(intIface, extIface) + "\n";
+        const std::string outbound = makeTetherCountingRule(extIface, intIface) + "\n";
+        rules->v4Filter.append(inbound).append(outbound);
+        rules->v6Filter.append(inbound).append(outbound);
     }
+}
 
+/* static */
+std::string TetherController::makeRestoreCommands(std::string_view raw, std::string_view filter,
+                                                  bool moveDropToEnd) {
+    IptablesScript script(raw.size() + filter.size() + 128);
+    if (!raw.empty()) {
+        script.table("raw").append(raw).commit();
+    }
+    script.table("filter").append(filter);
     // Always make sure the drop rule is at the end.
     // TODO: instead of doing this, consider just rebuilding LOCAL_FORWARD completely from scratch
     // every time, starting with ":tetherctrl_FORWARD -\n". This would likely be a bit simpler.
-    if (add) {
-        v4.push_back(StringPrintf("-D %s -j DROP", LOCAL_FORWARD));
-        v4.push_back(StringPrintf("-A %s -j DROP", LOCAL_FORWARD));
+    if (moveDropToEnd) {
+        script.appendf("-D %s -j DROP", LOCAL_FORWARD);
+        script.appendf("-A %s -j DROP", LOCAL_FORWARD);
     }
+    script.commit();
+    return script.str();
+}
+
+int TetherController::setForwardRules(bool add, const char *intIface, const char *extIface) {
+    ForwardRules rules;
+    makeForwardRules(add, intIface, extIface, &rules);
 
-    v4.push_back("COMMIT\n");
-    v6.push_back("COMMIT\n");
+    IptablesScript rpfilterCmd;
+    rpfilterCmd.table("raw").append(rules.v6Raw).commit();
+    if (iptablesRestoreFunction(V6, rpfilterCmd.str(), nullptr) == -1 && add) {
+        return -EREMOTEIO;
+    }
 
     // We only add IPv6 rules here, never remove them.
-    if (iptablesRestoreFunction(V4, Join(v4, '\n'), nullptr) == -1 ||
-        (add && iptablesRestoreFunction(V6, Join(v6, '\n'), nullptr) == -1)) {
+    if (iptablesRestoreFunction(V4, makeRestoreCommands(rules.v4Raw, rules.v4Filter, add),
+                                nullptr) == -1 ||
+        (add && iptablesRestoreFunction(V6, makeRestoreCommands({}, rules.v6Filter, false),
+                                        nullptr) == -1)) {
         // unwind what's been done, but don't care about success - what more could we do?
         if (add) {
             setForwardRules(false, intIface, extIface);
@@ -791,14 +1008,15 @@ int TetherController::disableNat(const char* intIface, const char* extIface) {
     return 0;
 }
 
-void TetherController::addStats(TetherStatsList& statsList, const TetherStats& stats) {
-    for (TetherStats& existing : statsList) {
-        if (existing.addStatsIfMatch(stats)) {
-            return;
-        }
+void TetherController::TetherStatsAccumulator::add(const TetherStats& stats) {
+    const auto [it, inserted] =
+            mIndex.try_emplace(stats.intIface + ' ' + stats.extIface, mStats.size());
+    if (inserted) {
+        // No match. Insert a new interface pair.
+        mStats.push_back(stats);
+        return;
     }
-    // No match. Insert a new interface pair.
-    statsList.push_back(stats);
+    mStats[it->second].addStatsIfMatch(stats);
 }
 
 /*
@@ -816,33 +1034,14 @@ void TetherController::addStats(TetherStatsList& statsList, const TetherStats& s
  *          0        0 RETURN     all      rmnet_data0 wlan0   ::/0                 ::/0
  *
  */
-int TetherController::addForwardChainStats(TetherStatsList& statsList,
+int TetherController::addForwardChainStats(TetherStatsAccumulator& accumulator,
                                            const std::string& statsOutput,
                                            std::string &extraProcessingInfo) {
-    enum IndexOfIptChain {
-        ORIG_LINE,
-        PACKET_COUNTS,
-        BYTE_COUNTS,
-        HYPHEN,
-        IFACE0_NAME,
-        IFACE1_NAME,
-        SOURCE,
-        DESTINATION
-    };
-    TetherStats stats;
-    const TetherStats empty;
-
-    static const std::string NUM = "(\\d+)";
-    static const std::string IFACE = "([^\\s]+)";
-    static const std::string DST = "(0.0.0.0/0|::/0)";
-    static const std::string COUNTERS = "\\s*" + NUM + "\\s+" + NUM +
-                                        " RETURN     all(  --  |      )" + IFACE + "\\s+" + IFACE +
-                                        "\\s+" + DST + "\\s+" + DST;
-    static const std::regex IP_RE(COUNTERS);
-
-    const std::vector<std::string> lines = base::Split(statsOutput, "\n");
+    std::vector<IptablesRuleCounters> rules;
+    LineTokenizer lines(statsOutput);
+    std::string_view line;
     int headerLine = 0;
-    for (const std::string& line : lines) {
+    while (lines.next(&line)) {
         // Skip headers.
         if (headerLine < 2) {
             if (line.empty()) {
@@ -856,23 +1055,51 @@ int TetherController::addForwardChainStats(TetherStatsList& statsList,
         if (line.empty()) continue;
 
         extraProcessingInfo = line;
-        std::smatch matches;
-        if (!std::regex_search(line, matches, IP_RE)) return -EREMOTEIO;
-        // Here use IP_RE to distiguish IPv4 and IPv6 iptables.
-        // IPv4 has "--" indicating what to do with fragments...
-        //		 26 	2373 RETURN     all  --  wlan0	rmnet0	0.0.0.0/0			 0.0.0.0/0
+        // The fields are: pkts bytes target prot opt in out source destination. IPv4 has "--"
+        // indicating what to do with fragments...
+        //       26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
         // ... but IPv6 does not.
-        //		 26 	2373 RETURN 	all      wlan0	rmnet0	::/0				 ::/0
-        // TODO: Replace strtoXX() calls with ParseUint() /ParseInt()
-        int64_t packets = strtoul(matches[PACKET_COUNTS].str().c_str(), nullptr, 10);
-        int64_t bytes = strtoul(matches[BYTE_COUNTS].str().c_str(), nullptr, 10);
-        std::string iface0 = matches[IFACE0_NAME].str();
-        std::string iface1 = matches[IFACE1_NAME].str();
-        std::string rest = matches[SOURCE].str();
-
-        ALOGV("parse iface0=<%s> iface1=<%s> pkts=%" PRId64 " bytes=%" PRId64
-              " rest=<%s> orig line=<%s>",
-              iface0.c_str(), iface1.c_str(), packets, bytes, rest.c_str(), line.c_str());
+        //       26     2373 RETURN     all      wlan0  rmnet0  ::/0                 ::/0
+        FieldTokenizer fields(line);
+        IptablesRuleCounters rule;
+        if (!fields.nextUint64(&rule.packets) || !fields.nextUint64(&rule.bytes) ||
+            fields.next() != "RETURN" || fields.next() != "all") {
+            return -EREMOTEIO;
+        }
+        std::string_view iface0 = fields.next();
+        if (iface0 == "--") iface0 = fields.next();
+        const std::string_view iface1 = fields.next();
+        const std::string_view source = fields.next();
+        const std::string_view destination = fields.next();
+        if (iface0.empty() || iface1.empty() || !isWildcardAddress(source) ||
+            !isWildcardAddress(destination)) {
+            return -EREMOTEIO;
+        }
+        rule.inIface = iface0;
+        rule.outIface = iface1;
+        ALOGV("parse iface0=<%s> iface1=<%s> pkts=%" PRIu64 " bytes=%" PRIu64 " orig line=<%s>",
+              rule.inIface.c_str(), rule.outIface.c_str(), rule.packets, rule.bytes,
+              extraProcessingInfo.c_str());
+        rules.push_back(std::move(rule));
+    }
+    if (headerLine < 2) {
+        ALOGV("Missing header while parsing tethering stats");
+        return -EREMOTEIO;
+    }
+
+    return addForwardChainStats(accumulator, rules);
+}
+
+int TetherController::addForwardChainStats(TetherStatsAccumulator& accumulator,
+                                           const std::vector<IptablesRuleCounters>& rules) {
+    TetherStats stats;
+    const TetherStats empty;
+
+    for (const IptablesRuleCounters& rule : rules) {
+        const int64_t packets = rule.packets;
+        const int64_t bytes = rule.bytes;
+        const std::string& iface0 = rule.inIface;
+        const std::string& iface1 = rule.outIface;
         /*
          * The following assumes that the 1st rule has in:extIface out:intIface,
          * which is what TetherController sets up.
@@ -893,7 +1120,7 @@ int TetherController::addForwardChainStats(TetherStatsList& statsList,
         }
         if (stats.rxBytes != -1 && stats.txBytes != -1) {
             ALOGV("rx_bytes=%" PRId64" tx_bytes=%" PRId64, stats.rxBytes, stats.txBytes);
-            addStats(statsList, stats);
+            accumulator.add(stats);
             stats = empty;
         }
     }
@@ -906,24 +1133,37 @@ int TetherController::addForwardChainStats(TetherStatsList& statsList,
 }
 
 StatusOr<TetherController::TetherStatsList> TetherController::getTetherStats() {
-    TetherStatsList statsList;
+    TetherStatsAccumulator accumulator;
     std::string parsedIptablesOutput;
+    sStatsPolls.inc();
 
     for (const IptablesTarget target : {V4, V6}) {
+        // Read the counters straight from the kernel if possible, which is much cheaper than
+        // running iptables and parsing its output.
+        std::vector<IptablesRuleCounters> rules;
+        if (getChainCountersFunction(target, "filter", LOCAL_TETHER_COUNTERS_CHAIN, &rules) == 0) {
+            if (int ret = addForwardChainStats(accumulator, rules)) {
+                return statusFromErrno(-ret, StringPrintf("unpaired %s tether counters",
+                                                          target == V4 ? "IPv4" : "IPv6"));
+            }
+            continue;
+        }
+
+        sStatsIptablesFallbacks.inc();
         std::string statsString;
         if (int ret = iptablesRestoreFunction(target, GET_TETHER_STATS_COMMAND, &statsString)) {
             return statusFromErrno(-ret, StringPrintf("failed to fetch tether stats (%d): %d",
                                                       target, ret));
         }
 
-        if (int ret = addForwardChainStats(statsList, statsString, parsedIptablesOutput)) {
+        if (int ret = addForwardChainStats(accumulator, statsString, parsedIptablesOutput)) {
             return statusFromErrno(-ret, StringPrintf("failed to parse %s tether stats:\n%s",
                                                       target == V4 ? "IPv4": "IPv6",
                                                       parsedIptablesOutput.c_str()));
         }
     }
 
-    return statsList;
+    return accumulator.release();
 }
 
 void TetherController::dumpIfaces(DumpWriter& dw) {
@@ -937,22 +1177,42 @@ void TetherController::dumpIfaces(DumpWriter& dw) {
 }
 
 void TetherController::dump(DumpWriter& dw) {
-    std::lock_guard guard(lock);
-
     ScopedIndent tetherControllerIndent(dw);
     dw.println("TetherController");
-    dw.incIndent();
-
-    dw.println("Forwarding requests: " + Join(mForwardingRequests, ' '));
-    if (mDnsNetId != 0) {
-        dw.println(StringPrintf("DNS: netId %d servers [%s]", mDnsNetId,
-                                Join(mDnsForwarders, ", ").c_str()));
-    }
-    if (mDaemonPid != 0) {
-        dw.println("dnsmasq PID: %d", mDaemonPid);
+    ScopedIndent tetherControllerDetails(dw);
+
+    DumpBuffer buffer;
+    {
+        std::lock_guard guard(lock);
+        DumpWriter& out = buffer.writer();
+        out.println("Forwarding requests: " + Join(mForwardingRequests, ' '));
+        if (mDnsNetId != 0) {
+            out.println(StringPrintf("DNS: netId %d servers [%s]", mDnsNetId,
+                                     Join(mDnsForwarders, ", ").c_str()));
+        }
+        if (mDaemonPid != 0) {
+            out.println("dnsmasq PID: %d%s", mDaemonPid, mIsTetheringStarted ? "" : " (idle)");
+        }
+        dumpIfaces(out);
     }
+    buffer.flushTo(dw);
+}
 
-    dumpIfaces(dw);
+void TetherController::dumpProto(netd::TetherControllerProto* proto) {
+    std::lock_guard guard(lock);
+    for (const auto& request : mForwardingRequests) proto->add_forwarding_requests(request);
+
+    const auto statsList = getTetherStats();
+    if (!isOk(statsList)) return;
+    for (const auto& stats : statsList.value()) {
+        auto* statsProto = proto->add_stats();
+        statsProto->set_internal_interface(stats.intIface);
+        statsProto->set_external_interface(stats.extIface);
+        statsProto->set_rx_bytes(stats.rxBytes);
+        statsProto->set_rx_packets(stats.rxPackets);
+        statsProto->set_tx_bytes(stats.txBytes);
+        statsProto->set_tx_packets(stats.txPackets);
+    }
 }
 
 }  // namespace net
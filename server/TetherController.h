@@ -20,11 +20,15 @@
 #include <list>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <netdutils/DumpWriter.h>
 #include <netdutils/StatusOr.h>
 #include <sysutils/SocketClient.h>
 
+#include "IptablesCounters.h"
 #include "NetdConstants.h"
 #include "android-base/result.h"
 
@@ -35,6 +39,10 @@
 namespace android {
 namespace net {
 
+namespace netd {
+class TetherControllerProto;
+}
+
 class TetherController {
   private:
     struct ForwardingDownstream {
@@ -56,6 +64,8 @@ class TetherController {
     std::list<std::string> mDnsForwarders;
     pid_t                  mDaemonPid = 0;
     int                    mDaemonFd = -1;
+    // The command line dnsmasq was started with, to tell whether a resident dnsmasq can be reused.
+    std::vector<std::string> mDaemonArgs;
     std::set<std::string>  mForwardingRequests;
 
     struct DnsmasqState {
@@ -68,8 +78,13 @@ class TetherController {
         //     update_dns|<hex_socket_mark>|<ip1>|<ip2>|...
         std::string update_dns_cmd;
 
+        // The commands dnsmasq last accepted, so that commands it already has are not sent again.
+        std::string sent_ifaces_cmd;
+        std::string sent_dns_cmd;
+
         void clear();
-        int sendAllState(int daemonFd) const;
+        // Sends whichever of the commands differ from what dnsmasq last accepted.
+        int sendAllState(int daemonFd);
     } mDnsmasqState{};
 
   public:
@@ -97,7 +112,15 @@ class TetherController {
     bool applyDnsInterfaces();
 
     int enableNat(const char* intIface, const char* extIface);
+    // Enables NAT from each of intIfaces to extIface, with one iptables-restore call per IP
+    // version instead of several per pair. Pairs that are already enabled are left alone.
+    int enableNatForDownstreams(const std::string& extIface,
+                                const std::vector<std::string>& intIfaces);
     int disableNat(const char* intIface, const char* extIface);
+    // Moves every downstream forwarded to oldExtIface over to newExtIface, rewriting only the
+    // rules that name the upstream. This is much faster than disableNat() and enableNat() for
+    // each downstream, so tethered clients lose connectivity for less time during handover.
+    int switchUpstream(const std::string& oldExtIface, const std::string& newExtIface);
     int setupIptablesHooks();
 
     class TetherStats {
@@ -130,6 +153,19 @@ class TetherController {
 
     typedef std::vector<TetherStats> TetherStatsList;
 
+    // Sums TetherStats by interface pair, keeping the pairs in the order they were first added.
+    class TetherStatsAccumulator {
+      public:
+        void add(const TetherStats& stats);
+        TetherStatsList release() { mIndex.clear(); return std::move(mStats); }
+
+      private:
+        TetherStatsList mStats;
+        // Index in mStats of each pair, keyed by intIface and extIface separated by a space, which
+        // cannot appear in an interface name.
+        std::unordered_map<std::string, size_t> mIndex;
+    };
+
     netdutils::StatusOr<TetherStatsList> getTetherStats();
 
     /*
@@ -139,8 +175,12 @@ class TetherController {
      *  in:extIface out:intIface
      * and the rules are grouped in pairs when more that one tethering was setup.
      */
-    static int addForwardChainStats(TetherStatsList& statsList, const std::string& iptOutput,
+    static int addForwardChainStats(TetherStatsAccumulator& accumulator,
+                                    const std::string& iptOutput,
                                     std::string &extraProcessingInfo);
+    // The same, from the counters read from the kernel by getIptablesChainCounters().
+    static int addForwardChainStats(TetherStatsAccumulator& accumulator,
+                                    const std::vector<IptablesRuleCounters>& rules);
 
     static constexpr const char* LOCAL_FORWARD               = "tetherctrl_FORWARD";
     static constexpr const char* LOCAL_MANGLE_FORWARD        = "tetherctrl_mangle_FORWARD";
@@ -152,9 +192,12 @@ class TetherController {
 
     void dump(netdutils::DumpWriter& dw);
     void dumpIfaces(netdutils::DumpWriter& dw);
+    void dumpProto(netd::TetherControllerProto* proto);
 
   private:
     bool setIpFwdEnabled();
+    bool isDaemonRunning();
+    void stopDaemon();
     std::vector<char*> toCstrVec(const std::vector<std::string>& addrs);
     int setupIPv6CountersChain();
     static std::string makeTetherCountingRule(const char *if1, const char *if2);
@@ -170,14 +213,26 @@ class TetherController {
 
     int setDefaults();
     int setTetherGlobalAlertRule();
+    // Forwarding rules for one or more interface pairs, by IP version and table. Each is a block
+    // of newline-terminated iptables-restore lines.
+    struct ForwardRules {
+        std::string v4Raw;
+        std::string v4Filter;
+        std::string v6Raw;
+        std::string v6Filter;
+    };
+    void makeForwardRules(bool add, const char* intIface, const char* extIface,
+                          ForwardRules* rules);
+    static std::string makeRestoreCommands(std::string_view raw, std::string_view filter,
+                                           bool moveDropToEnd);
     int setForwardRules(bool set, const char *intIface, const char *extIface);
     int setTetherCountingRules(bool add, const char *intIface, const char *extIface);
 
-    static void addStats(TetherStatsList& statsList, const TetherStats& stats);
-
     // For testing.
     friend class TetherControllerTest;
     static int (*iptablesRestoreFunction)(IptablesTarget, const std::string&, std::string *);
+    static int (*getChainCountersFunction)(IptablesTarget, const char*, const char*,
+                                           std::vector<IptablesRuleCounters>*);
 };
 
 }  // namespace net
@@ -16,6 +16,7 @@
  * TetherControllerTest.cpp - unit tests for TetherController.cpp
  */
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -29,6 +30,7 @@
 
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gmock/gmock.h>
 #include <netdutils/StatusOr.h>
 
@@ -49,11 +51,27 @@ class TetherControllerTest : public IptablesBaseTest {
 public:
     TetherControllerTest() {
         TetherController::iptablesRestoreFunction = fakeExecIptablesRestoreWithOutput;
+        TetherController::getChainCountersFunction = fakeGetChainCounters;
+        sChainCounters.clear();
     }
 
 protected:
     TetherController mTetherCtrl;
 
+    // The counters returned by fakeGetChainCounters() per target. A target without counters fails
+    // with EOPNOTSUPP, so that getTetherStats() falls back to parsing iptables output.
+    static std::map<IptablesTarget, std::vector<IptablesRuleCounters>> sChainCounters;
+
+    static int fakeGetChainCounters(IptablesTarget target, const char* table, const char* chain,
+                                    std::vector<IptablesRuleCounters>* rules) {
+        EXPECT_STREQ("filter", table);
+        EXPECT_STREQ(TetherController::LOCAL_TETHER_COUNTERS_CHAIN, chain);
+        const auto it = sChainCounters.find(target);
+        if (it == sChainCounters.end()) return -EOPNOTSUPP;
+        *rules = it->second;
+        return 0;
+    }
+
     int setDefaults() {
         return mTetherCtrl.setDefaults();
     }
@@ -254,6 +272,39 @@ TEST_F(TetherControllerTest, TestSetupIptablesHooks) {
     expectIptablesRestoreCommands(SETUP_COMMANDS);
 }
 
+TEST_F(TetherControllerTest, TestIdleResidentDnsmasqOnlyServesLoopback) {
+    // The state that stopTethering() leaves a resident dnsmasq in.
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_CLOEXEC | O_NONBLOCK));
+    const android::base::unique_fd readFd(fds[0]);
+    mTetherCtrl.mDaemonFd = fds[1];
+    mTetherCtrl.mDnsmasqState.update_ifaces_cmd = "update_ifaces|lo";
+    mTetherCtrl.mDnsmasqState.sent_ifaces_cmd = "update_ifaces|lo";
+    char buf[64];
+
+    // Tethering and untethering interfaces, which applies them, sends nothing while idle.
+    mTetherCtrl.mInterfaces.push_back("test_tether0");
+    EXPECT_TRUE(mTetherCtrl.applyDnsInterfaces());
+    mTetherCtrl.mInterfaces.clear();
+    EXPECT_TRUE(mTetherCtrl.applyDnsInterfaces());
+    EXPECT_EQ(-1, read(readFd, buf, sizeof(buf)));
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_EQ("update_ifaces|lo", mTetherCtrl.mDnsmasqState.update_ifaces_cmd);
+
+    // Once tethering starts again, dnsmasq serves the tethered interfaces.
+    mTetherCtrl.mIsTetheringStarted = true;
+    mTetherCtrl.mInterfaces.push_back("test_tether0");
+    EXPECT_TRUE(mTetherCtrl.applyDnsInterfaces());
+    const std::string expected = "update_ifaces|test_tether0";
+    ASSERT_EQ(static_cast<ssize_t>(expected.size() + 1), read(readFd, buf, sizeof(buf)));
+    EXPECT_EQ(expected, buf);
+
+    close(mTetherCtrl.mDaemonFd);
+    mTetherCtrl.mDaemonFd = -1;
+    mTetherCtrl.mIsTetheringStarted = false;
+    mTetherCtrl.mInterfaces.clear();
+}
+
 TEST_F(TetherControllerTest, TestSetDefaults) {
     setDefaults();
     expectIptablesRestoreCommands(FLUSH_COMMANDS);
@@ -296,6 +347,109 @@ TEST_F(TetherControllerTest, TestAddAndRemoveNat) {
     expectIptablesRestoreCommands(stopLastNat);
 }
 
+TEST_F(TetherControllerTest, TestEnableNatForDownstreams) {
+    // All the rules of the first NAT, for two downstreams at once and in one call per IP version.
+    // Duplicate downstreams are ignored.
+    const std::string v6Cmds =
+            "*raw\n"
+            "-A tetherctrl_raw_PREROUTING -i wlan0 -m rpfilter --invert ! -s fe80::/64 -j DROP\n"
+            "-A tetherctrl_raw_PREROUTING -i usb0 -m rpfilter --invert ! -s fe80::/64 -j DROP\n"
+            "COMMIT\n"
+            "*filter\n"
+            "-A tetherctrl_FORWARD -g tetherctrl_counters\n"
+            "-I tetherctrl_FORWARD -j bw_global_alert\n"
+            "-A tetherctrl_counters -i wlan0 -o rmnet0 -j RETURN\n"
+            "-A tetherctrl_counters -i rmnet0 -o wlan0 -j RETURN\n"
+            "-A tetherctrl_counters -i usb0 -o rmnet0 -j RETURN\n"
+            "-A tetherctrl_counters -i rmnet0 -o usb0 -j RETURN\n"
+            "COMMIT\n";
+    const std::string v4Cmds =
+            "*nat\n"
+            "-A tetherctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE\n"
+            "COMMIT\n"
+            "*raw\n"
+            "-A tetherctrl_raw_PREROUTING -p tcp --dport 21 -i wlan0 -j CT --helper ftp\n"
+            "-A tetherctrl_raw_PREROUTING -p tcp --dport 1723 -i wlan0 -j CT --helper pptp\n"
+            "-A tetherctrl_raw_PREROUTING -p tcp --dport 21 -i usb0 -j CT --helper ftp\n"
+            "-A tetherctrl_raw_PREROUTING -p tcp --dport 1723 -i usb0 -j CT --helper pptp\n"
+            "COMMIT\n"
+            "*filter\n"
+            "-I tetherctrl_FORWARD -j bw_global_alert\n"
+            "-A tetherctrl_FORWARD -i rmnet0 -o wlan0 -m state --state ESTABLISHED,RELATED "
+            "-g tetherctrl_counters\n"
+            "-A tetherctrl_FORWARD -i wlan0 -o rmnet0 -m state --state INVALID -j DROP\n"
+            "-A tetherctrl_FORWARD -i wlan0 -o rmnet0 -g tetherctrl_counters\n"
+            "-A tetherctrl_counters -i wlan0 -o rmnet0 -j RETURN\n"
+            "-A tetherctrl_counters -i rmnet0 -o wlan0 -j RETURN\n"
+            "-A tetherctrl_FORWARD -i rmnet0 -o usb0 -m state --state ESTABLISHED,RELATED "
+            "-g tetherctrl_counters\n"
+            "-A tetherctrl_FORWARD -i usb0 -o rmnet0 -m state --state INVALID -j DROP\n"
+            "-A tetherctrl_FORWARD -i usb0 -o rmnet0 -g tetherctrl_counters\n"
+            "-A tetherctrl_counters -i usb0 -o rmnet0 -j RETURN\n"
+            "-A tetherctrl_counters -i rmnet0 -o usb0 -j RETURN\n"
+            "-D tetherctrl_FORWARD -j DROP\n"
+            "-A tetherctrl_FORWARD -j DROP\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mTetherCtrl.enableNatForDownstreams("rmnet0", {"wlan0", "usb0", "wlan0"}));
+    expectIptablesRestoreCommands({{V6, v6Cmds}, {V4, v4Cmds}});
+
+    // Enabled pairs are skipped, and so are the upstream rules once the upstream has NAT.
+    EXPECT_EQ(0, mTetherCtrl.enableNatForDownstreams("rmnet0", {"wlan0", "usb0"}));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // They can be disabled one at a time.
+    mTetherCtrl.disableNat("wlan0", "rmnet0");
+    expectIptablesRestoreCommands(stopNatCommands("wlan0", "rmnet0"));
+
+    EXPECT_EQ(-EINVAL, mTetherCtrl.enableNatForDownstreams("rmnet0", {"rmnet0"}));
+    EXPECT_EQ(-ENODEV, mTetherCtrl.enableNatForDownstreams("rmnet0", {"wlan0", "bad/iface"}));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+}
+
+TEST_F(TetherControllerTest, TestSwitchUpstream) {
+    mTetherCtrl.enableNat("wlan0", "rmnet0");
+    expectIptablesRestoreCommands(
+            allNewNatCommands("wlan0", "rmnet0", WITH_COUNTERS, WITH_IPV6, true));
+
+    // Only the rules that name the upstream are replaced, and IPv4 in a single call.
+    const std::string v6Cmds =
+            "*filter\n"
+            "-A tetherctrl_counters -i wlan0 -o wlan1 -j RETURN\n"
+            "-A tetherctrl_counters -i wlan1 -o wlan0 -j RETURN\n"
+            "COMMIT\n";
+    const std::string v4Cmds =
+            "*filter\n"
+            "-D tetherctrl_FORWARD -i rmnet0 -o wlan0 -m state --state ESTABLISHED,RELATED "
+            "-g tetherctrl_counters\n"
+            "-D tetherctrl_FORWARD -i wlan0 -o rmnet0 -m state --state INVALID -j DROP\n"
+            "-D tetherctrl_FORWARD -i wlan0 -o rmnet0 -g tetherctrl_counters\n"
+            "-A tetherctrl_FORWARD -i wlan1 -o wlan0 -m state --state ESTABLISHED,RELATED "
+            "-g tetherctrl_counters\n"
+            "-A tetherctrl_FORWARD -i wlan0 -o wlan1 -m state --state INVALID -j DROP\n"
+            "-A tetherctrl_FORWARD -i wlan0 -o wlan1 -g tetherctrl_counters\n"
+            "-A tetherctrl_counters -i wlan0 -o wlan1 -j RETURN\n"
+            "-A tetherctrl_counters -i wlan1 -o wlan0 -j RETURN\n"
+            "-D tetherctrl_FORWARD -j DROP\n"
+            "-A tetherctrl_FORWARD -j DROP\n"
+            "COMMIT\n"
+            "*nat\n"
+            "-D tetherctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE\n"
+            "-A tetherctrl_nat_POSTROUTING -o wlan1 -j MASQUERADE\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mTetherCtrl.switchUpstream("rmnet0", "wlan1"));
+    expectIptablesRestoreCommands({{V6, v6Cmds}, {V4, v4Cmds}});
+
+    // The downstream is now forwarded to the new upstream only, so this was the last NAT.
+    ExpectedIptablesCommands stopLastNat = stopNatCommands("wlan0", "wlan1");
+    appendAll(stopLastNat, FLUSH_COMMANDS);
+    mTetherCtrl.disableNat("wlan0", "wlan1");
+    expectIptablesRestoreCommands(stopLastNat);
+
+    // Nothing to move.
+    EXPECT_EQ(0, mTetherCtrl.switchUpstream("rmnet0", "wlan1"));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+}
+
 TEST_F(TetherControllerTest, TestMultipleUpstreams) {
     // Start first NAT on first upstream interface. Expect the upstream and NAT rules to be created.
     ExpectedIptablesCommands firstNat =
@@ -328,6 +482,8 @@ TEST_F(TetherControllerTest, TestMultipleUpstreams) {
     expectIptablesRestoreCommands(stopFirstNat);
 }
 
+std::map<IptablesTarget, std::vector<IptablesRuleCounters>> TetherControllerTest::sChainCounters;
+
 std::string kTetherCounterHeaders = Join(std::vector<std::string> {
     "Chain tetherctrl_counters (4 references)",
     "    pkts      bytes target     prot opt in     out     source               destination",
@@ -438,5 +594,55 @@ TEST_F(TetherControllerTest, TestGetTetherStats) {
     EXPECT_TRUE(std::equal(expectedError.rbegin(), expectedError.rend(), err.rbegin()));
 }
 
+TEST_F(TetherControllerTest, TestGetTetherStatsFromKernelCounters) {
+    sChainCounters[V4] = {
+            {.inIface = "wlan0", .outIface = "rmnet0", .packets = 26, .bytes = 2373},
+            {.inIface = "rmnet0", .outIface = "wlan0", .packets = 27, .bytes = 2002},
+            {.inIface = "bt-pan", .outIface = "rmnet0", .packets = 1040, .bytes = 107471},
+            {.inIface = "rmnet0", .outIface = "bt-pan", .packets = 1450, .bytes = 1708806},
+    };
+    sChainCounters[V6] = {
+            {.inIface = "wlan0", .outIface = "rmnet0", .packets = 10000, .bytes = 10000000},
+            {.inIface = "rmnet0", .outIface = "wlan0", .packets = 20000, .bytes = 20000000},
+    };
+
+    // The same totals as from the equivalent iptables output, without running iptables.
+    StatusOr<TetherStatsList> result = mTetherCtrl.getTetherStats();
+    ASSERT_TRUE(isOk(result));
+    ASSERT_EQ(2U, result.value().size());
+    expectTetherStatsEqual(TetherStats("wlan0", "rmnet0", 20002002, 20027, 10002373, 10026),
+                           result.value()[0]);
+    expectTetherStatsEqual(TetherStats("bt-pan", "rmnet0", 1708806, 1450, 107471, 1040),
+                           result.value()[1]);
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // If one family cannot be read from the kernel, only that one is read with iptables.
+    sChainCounters.erase(V6);
+    addIptablesRestoreOutput(kIPv6TetherCounters);
+    result = mTetherCtrl.getTetherStats();
+    ASSERT_TRUE(isOk(result));
+    ASSERT_EQ(2U, result.value().size());
+    expectTetherStatsEqual(TetherStats("wlan0", "rmnet0", 20002002, 20027, 10002373, 10026),
+                           result.value()[0]);
+    clearIptablesRestoreOutput();
+
+    // Unpaired counters are an error.
+    sChainCounters[V6] = {{.inIface = "wlan0", .outIface = "rmnet0", .packets = 1, .bytes = 1}};
+    EXPECT_FALSE(isOk(mTetherCtrl.getTetherStats()));
+}
+
+TEST_F(TetherControllerTest, TestTetherStatsAccumulator) {
+    TetherController::TetherStatsAccumulator accumulator;
+    accumulator.add(TetherStats("wlan0", "rmnet0", 1, 2, 3, 4));
+    accumulator.add(TetherStats("rmnet0", "wlan0", 10, 20, 30, 40));
+    accumulator.add(TetherStats("wlan0", "rmnet0", 100, 200, 300, 400));
+
+    // Pairs are summed, and stay in the order they were first added.
+    TetherStatsList actual = accumulator.release();
+    ASSERT_EQ(2U, actual.size());
+    expectTetherStatsEqual(TetherStats("wlan0", "rmnet0", 101, 202, 303, 404), actual[0]);
+    expectTetherStatsEqual(TetherStats("rmnet0", "wlan0", 10, 20, 30, 40), actual[1]);
+}
+
 }  // namespace net
 }  // namespace android
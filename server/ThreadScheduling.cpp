@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ThreadScheduling"
+
+#include "ThreadScheduling.h"
+
+#include <errno.h>
+#include <linux/sched.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <cinttypes>
+#include <mutex>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/thread_annotations.h>
+#include <log/log.h>
+
+using android::base::GetProperty;
+using android::base::Join;
+using android::base::ParseInt;
+using android::base::ParseUint;
+using android::base::Split;
+using android::base::StringPrintf;
+using android::netdutils::DumpWriter;
+using android::netdutils::statusFromErrno;
+using android::netdutils::StatusOr;
+
+namespace android::net {
+
+namespace {
+
+constexpr const char* kRoleNames[] = {"fwmark", "netlink", "nflog", "binder"};
+constexpr size_t kNumRoles = std::size(kRoleNames);
+constexpr const char* kPropertyPrefix = "persist.netd.sched.";
+constexpr int kUclampMax = 1024;
+
+struct RoleConfig {
+    std::string spec;
+    SchedPolicy policy;
+    std::string error;
+};
+
+struct ThreadRecord {
+    ThreadRole role;
+    pid_t tid;
+    std::string effective;
+    std::string errors;
+};
+
+std::once_flag sConfigRead;
+std::array<RoleConfig, kNumRoles> sConfig;
+
+std::mutex sThreadsMutex;
+std::vector<ThreadRecord> sThreads GUARDED_BY(sThreadsMutex);
+
+thread_local bool tApplied = false;
+
+// The kernel's struct sched_attr, which not every libc declares.
+struct SchedAttr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+    uint32_t sched_util_min;
+    uint32_t sched_util_max;
+};
+
+const char* roleName(ThreadRole role) {
+    return kRoleNames[static_cast<size_t>(role)];
+}
+
+void readConfig() {
+    for (size_t i = 0; i < kNumRoles; i++) {
+        RoleConfig& config = sConfig[i];
+        config.spec = GetProperty(std::string(kPropertyPrefix) + kRoleNames[i], "");
+        auto policy = ThreadScheduling::parse(config.spec);
+        if (isOk(policy)) {
+            config.policy = policy.value();
+        } else {
+            config.error = netdutils::toString(policy);
+            ALOGE("Ignoring %s%s: %s", kPropertyPrefix, kRoleNames[i], config.error.c_str());
+        }
+    }
+}
+
+// sched_setattr() and sched_getattr() have no libc wrappers.
+int setUclamp(const SchedPolicy& policy) {
+    SchedAttr attr = {};
+    attr.size = sizeof(attr);
+    attr.sched_flags = SCHED_FLAG_KEEP_ALL;
+    if (policy.uclampMin) {
+        attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MIN;
+        attr.sched_util_min = *policy.uclampMin;
+    }
+    if (policy.uclampMax) {
+        attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MAX;
+        attr.sched_util_max = *policy.uclampMax;
+    }
+    return syscall(__NR_sched_setattr, 0, &attr, 0);
+}
+
+// Returns the errors, if any.
+std::string apply(const SchedPolicy& policy) {
+    std::vector<std::string> errors;
+    const auto check = [&errors](const char* what, int ret) {
+        if (ret == -1) errors.push_back(StringPrintf("%s: %s", what, strerror(errno)));
+    };
+    if (policy.fifoPriority) {
+        const sched_param param = {.sched_priority = *policy.fifoPriority};
+        check("fifo", sched_setscheduler(0, SCHED_FIFO, &param));
+    } else if (policy.nice) {
+        check("nice", setpriority(PRIO_PROCESS, gettid(), *policy.nice));
+    }
+    if (policy.uclampMin || policy.uclampMax) {
+        check("uclamp", setUclamp(policy));
+    }
+    if (policy.cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (*policy.cpus & (uint64_t{1} << cpu)) CPU_SET(cpu, &set);
+        }
+        check("cpus", sched_setaffinity(0, sizeof(set), &set));
+    }
+    return Join(errors, ", ");
+}
+
+// Reads back the settings of the calling thread.
+std::string effectiveSettings() {
+    std::vector<std::string> settings;
+    if (sched_getscheduler(0) == SCHED_FIFO) {
+        sched_param param = {};
+        sched_getparam(0, &param);
+        settings.push_back(StringPrintf("fifo %d", param.sched_priority));
+    } else {
+        settings.push_back(StringPrintf("nice %d", getpriority(PRIO_PROCESS, gettid())));
+    }
+    // Kernels without uclamp report both clamps as 0.
+    SchedAttr attr = {};
+    if (syscall(__NR_sched_getattr, 0, &attr, sizeof(attr), 0) == 0 && attr.sched_util_max != 0) {
+        settings.push_back(StringPrintf("uclamp %u-%u", attr.sched_util_min, attr.sched_util_max));
+    }
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        uint64_t mask = 0;
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (CPU_ISSET(cpu, &set)) mask |= uint64_t{1} << cpu;
+        }
+        settings.push_back(StringPrintf("cpus 0x%" PRIx64, mask));
+    }
+    return Join(settings, ", ");
+}
+
+}  // namespace
+
+bool SchedPolicy::empty() const {
+    return !nice && !fifoPriority && !uclampMin && !uclampMax && !cpus;
+}
+
+std::string SchedPolicy::toString() const {
+    std::vector<std::string> settings;
+    if (nice) settings.push_back(StringPrintf("nice=%d", *nice));
+    if (fifoPriority) settings.push_back(StringPrintf("fifo=%d", *fifoPriority));
+    if (uclampMin) settings.push_back(StringPrintf("uclamp_min=%d", *uclampMin));
+    if (uclampMax) settings.push_back(StringPrintf("uclamp_max=%d", *uclampMax));
+    if (cpus) settings.push_back(StringPrintf("cpus=0x%" PRIx64, *cpus));
+    return Join(settings, ",");
+}
+
+StatusOr<SchedPolicy> ThreadScheduling::parse(const std::string& spec) {
+    SchedPolicy policy;
+    if (spec.empty()) return policy;
+    for (const std::string& setting : Split(spec, ",")) {
+        const std::vector<std::string> keyValue = Split(setting, "=");
+        if (keyValue.size() != 2) return statusFromErrno(EINVAL, "Bad setting: " + setting);
+        const std::string& key = keyValue[0];
+        const std::string& value = keyValue[1];
+        int number = 0;
+        uint64_t mask = 0;
+        if (key == "nice" && ParseInt(value, &number, -20, 19)) {
+            policy.nice = number;
+        } else if (key == "fifo" && ParseInt(value, &number, 1, 99)) {
+            policy.fifoPriority = number;
+        } else if (key == "uclamp_min" && ParseInt(value, &number, 0, kUclampMax)) {
+            policy.uclampMin = number;
+        } else if (key == "uclamp_max" && ParseInt(value, &number, 0, kUclampMax)) {
+            policy.uclampMax = number;
+        } else if (key == "cpus" && ParseUint(value, &mask) && mask != 0) {
+            policy.cpus = mask;
+        } else {
+            return statusFromErrno(EINVAL, "Bad setting: " + setting);
+        }
+    }
+    if (policy.nice && policy.fifoPriority) {
+        return statusFromErrno(EINVAL, "nice and fifo are exclusive");
+    }
+    if (policy.uclampMin && policy.uclampMax && *policy.uclampMin > *policy.uclampMax) {
+        return statusFromErrno(EINVAL, "uclamp_min is above uclamp_max");
+    }
+    return policy;
+}
+
+void ThreadScheduling::applyToCurrentThread(ThreadRole role) {
+    if (tApplied) return;
+    tApplied = true;
+
+    SchedPolicy policy = getPolicy(role);
+    if (role == ThreadRole::BINDER) {
+        policy.nice.reset();
+        policy.fifoPriority.reset();
+    }
+    if (policy.empty()) return;
+
+    ThreadRecord record = {role, gettid(), "", apply(policy)};
+    record.effective = effectiveSettings();
+    if (!record.errors.empty()) {
+        ALOGW("Could not fully apply %s scheduling to thread %d: %s", roleName(role), record.tid,
+              record.errors.c_str());
+    }
+    std::lock_guard guard(sThreadsMutex);
+    sThreads.push_back(std::move(record));
+}
+
+SchedPolicy ThreadScheduling::getPolicy(ThreadRole role) {
+    std::call_once(sConfigRead, readConfig);
+    return sConfig[static_cast<size_t>(role)].policy;
+}
+
+void ThreadScheduling::dump(DumpWriter& dw) {
+    dw.println("Thread scheduling:");
+    dw.incIndent();
+    std::call_once(sConfigRead, readConfig);
+    for (size_t i = 0; i < kNumRoles; i++) {
+        const RoleConfig& config = sConfig[i];
+        dw.println("%s: %s%s", kRoleNames[i],
+                   config.policy.empty() ? "default" : config.policy.toString().c_str(),
+                   config.error.empty() ? "" : (" (ignored: " + config.error + ")").c_str());
+    }
+
+    std::vector<ThreadRecord> threads;
+    {
+        std::lock_guard guard(sThreadsMutex);
+        threads = sThreads;
+    }
+    if (!threads.empty()) {
+        dw.println("Threads (role tid: effective settings):");
+        dw.incIndent();
+        for (const auto& thread : threads) {
+            dw.println("%s %d: %s%s", roleName(thread.role), thread.tid, thread.effective.c_str(),
+                       thread.errors.empty() ? "" : (" (failed: " + thread.errors + ")").c_str());
+        }
+        dw.decIndent();
+    }
+    dw.decIndent();
+}
+
+}  // namespace android::net
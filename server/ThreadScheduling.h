@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "netdutils/DumpWriter.h"
+#include "netdutils/Status.h"
+#include "netdutils/StatusOr.h"
+
+namespace android::net {
+
+// The netd threads whose scheduling can be configured.
+enum class ThreadRole {
+    FWMARK,   // The FwmarkServer listener and workers.
+    NETLINK,  // The NetlinkHandler threads.
+    NFLOG,    // The NFLogListener thread.
+    BINDER,   // The threads serving INetd.
+};
+
+// How the threads of one role are scheduled. Settings that are not set are left alone.
+struct SchedPolicy {
+    std::optional<int> nice;
+    // Runs the threads in SCHED_FIFO at this priority. Excludes |nice|.
+    std::optional<int> fifoPriority;
+    std::optional<int> uclampMin;
+    std::optional<int> uclampMax;
+    // The CPUs the threads may run on, one bit per CPU.
+    std::optional<uint64_t> cpus;
+
+    bool empty() const;
+    // In the format that ThreadScheduling::parse() reads.
+    std::string toString() const;
+};
+
+// Schedules each kind of latency-critical netd thread as configured by the system property
+// persist.netd.sched.<role>, where <role> is fwmark, netlink, nflog or binder. The value is a
+// comma-separated list of settings, e.g., "nice=-10,uclamp_min=512,cpus=0xf" or "fifo=2":
+//
+//  - nice=<-20..19>: the nice value.
+//  - fifo=<1..99>: run in SCHED_FIFO at this priority.
+//  - uclamp_min=<0..1024>, uclamp_max=<0..1024>: the utilization clamps.
+//  - cpus=<mask>: the CPU affinity mask, e.g., 0xf for CPUs 0 to 3.
+//
+// The properties are read when the first thread applies its policy, so changes take effect when
+// netd restarts.
+class ThreadScheduling {
+  public:
+    static netdutils::StatusOr<SchedPolicy> parse(const std::string& spec);
+
+    // Applies the policy of |role| to the calling thread the first time the thread calls this, and
+    // records the settings that the thread ended up with for dump(). Later calls return at once,
+    // so this can be called on every event that the thread handles.
+    //
+    // The binder driver restores the scheduling policy and priority of a binder thread when it
+    // replies to a transaction, so for BINDER, nice and fifo are left out here. The service sets
+    // them as its minimum scheduler policy instead, see getPolicy().
+    static void applyToCurrentThread(ThreadRole role);
+
+    // The configured policy of |role|.
+    static SchedPolicy getPolicy(ThreadRole role);
+
+    // Prints the configured policies, and the effective settings of each thread that applied one.
+    static void dump(netdutils::DumpWriter& dw);
+};
+
+}  // namespace android::net
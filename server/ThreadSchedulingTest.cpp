@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "ThreadScheduling.h"
+
+namespace android::net {
+
+TEST(ThreadSchedulingTest, ParsesSettings) {
+    auto policy = ThreadScheduling::parse("nice=-10,uclamp_min=512,uclamp_max=1024,cpus=0xf");
+    ASSERT_TRUE(isOk(policy));
+    EXPECT_EQ(-10, policy.value().nice);
+    EXPECT_FALSE(policy.value().fifoPriority);
+    EXPECT_EQ(512, policy.value().uclampMin);
+    EXPECT_EQ(1024, policy.value().uclampMax);
+    EXPECT_EQ(0xfU, policy.value().cpus);
+    EXPECT_EQ("nice=-10,uclamp_min=512,uclamp_max=1024,cpus=0xf", policy.value().toString());
+
+    policy = ThreadScheduling::parse("fifo=2");
+    ASSERT_TRUE(isOk(policy));
+    EXPECT_EQ(2, policy.value().fifoPriority);
+    EXPECT_EQ("fifo=2", policy.value().toString());
+}
+
+TEST(ThreadSchedulingTest, EmptySpecLeavesThreadsAlone) {
+    const auto policy = ThreadScheduling::parse("");
+    ASSERT_TRUE(isOk(policy));
+    EXPECT_TRUE(policy.value().empty());
+}
+
+TEST(ThreadSchedulingTest, RejectsBadSpecs) {
+    for (const char* spec : {"nice", "nice=-30", "fifo=0", "fifo=100", "uclamp_min=2000",
+                             "cpus=0", "cpus=zero", "priority=1", "nice=1,,fifo=1",
+                             "nice=-5,fifo=2", "uclamp_min=800,uclamp_max=200"}) {
+        EXPECT_FALSE(isOk(ThreadScheduling::parse(spec))) << spec;
+    }
+}
+
+}  // namespace android::net
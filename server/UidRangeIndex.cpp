@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UidRangeIndex.h"
+
+#include <algorithm>
+#include <tuple>
+
+namespace android::net {
+
+void UidRangeIndex::setNetwork(unsigned netId, const std::map<int32_t, UidRanges>& uidRangeMap) {
+    if (uidRangeMap.empty()) {
+        if (mNetworks.erase(netId) == 0) return;
+    } else {
+        mNetworks[netId] = uidRangeMap;
+    }
+    rebuild();
+}
+
+const std::vector<UidRangeIndex::Entry>& UidRangeIndex::lookup(uid_t uid) const {
+    static const std::vector<Entry> kNoEntries;
+    if (uid > static_cast<uid_t>(INT32_MAX)) {
+        return kNoEntries;
+    }
+    const int32_t intUid = static_cast<int32_t>(uid);
+
+    // Find the last segment that starts at or before |uid|.
+    auto iter = std::upper_bound(
+            mSegments.begin(), mSegments.end(), intUid,
+            [](int32_t value, const Segment& segment) { return value < segment.start; });
+    if (iter == mSegments.begin() || (--iter)->stop < intUid) {
+        return kNoEntries;
+    }
+    return iter->entries;
+}
+
+size_t UidRangeIndex::memoryUsage() const {
+    size_t bytes = mSegments.capacity() * sizeof(Segment);
+    for (const Segment& segment : mSegments) {
+        bytes += segment.entries.capacity() * sizeof(Entry);
+    }
+    return bytes;
+}
+
+// Sweeps over the start and end points of all ranges in order, keeping track of the entries that
+// cover the current position. Lookups are far more frequent than changes, so the whole array is
+// recomputed on every change: O(n log n) in the total number of ranges.
+void UidRangeIndex::rebuild() {
+    // (position, isEnd, entry). A range [start, stop] ends just before stop + 1.
+    std::vector<std::tuple<int64_t, bool, Entry>> events;
+    for (const auto& [netId, uidRangeMap] : mNetworks) {
+        for (const auto& [subPriority, uidRanges] : uidRangeMap) {
+            for (const UidRangeParcel& range : uidRanges.getRanges()) {
+                if (range.start < 0 || range.stop < range.start) continue;
+                const Entry entry = {netId, subPriority};
+                events.emplace_back(range.start, false, entry);
+                events.emplace_back(static_cast<int64_t>(range.stop) + 1, true, entry);
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(), [](const auto& a, const auto& b) {
+        return std::get<0>(a) < std::get<0>(b);
+    });
+
+    mSegments.clear();
+    // Ranges of the same entry may overlap, so count how many ranges of each entry are active.
+    std::map<Entry, int> active;
+    int64_t openStart = 0;
+    std::vector<Entry> openEntries;
+    for (size_t i = 0; i < events.size();) {
+        const int64_t position = std::get<0>(events[i]);
+        for (; i < events.size() && std::get<0>(events[i]) == position; i++) {
+            const auto& [_, isEnd, entry] = events[i];
+            if (isEnd) {
+                if (--active[entry] == 0) active.erase(entry);
+            } else {
+                active[entry]++;
+            }
+        }
+
+        std::vector<Entry> entries;
+        entries.reserve(active.size());
+        for (const auto& [entry, _] : active) {
+            entries.push_back(entry);
+        }
+        if (entries == openEntries) continue;
+
+        // The set of covering entries changes here, so the open segment ends just before.
+        if (!openEntries.empty()) {
+            mSegments.push_back({static_cast<int32_t>(openStart),
+                                 static_cast<int32_t>(position - 1), std::move(openEntries)});
+        }
+        openStart = position;
+        openEntries = std::move(entries);
+    }
+}
+
+}  // namespace android::net
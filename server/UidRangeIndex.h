@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <map>
+#include <vector>
+
+#include "UidRanges.h"
+
+namespace android::net {
+
+// Maps a UID to every (netId, subPriority) pair whose UID ranges include it, across all networks,
+// in O(log n). The ranges of all networks are flattened into a sorted array of disjoint segments,
+// each of which lists the entries that cover it. Not thread-safe.
+class UidRangeIndex {
+  public:
+    struct Entry {
+        unsigned netId;
+        int32_t subPriority;
+
+        bool operator<(const Entry& other) const {
+            return subPriority != other.subPriority ? subPriority < other.subPriority
+                                                    : netId < other.netId;
+        }
+        bool operator==(const Entry& other) const {
+            return netId == other.netId && subPriority == other.subPriority;
+        }
+    };
+
+    // Replaces the ranges of |netId| with |uidRangeMap|, which maps each subsidiary priority to
+    // the UID ranges at that priority. An empty map removes the network from the index.
+    void setNetwork(unsigned netId, const std::map<int32_t, UidRanges>& uidRangeMap);
+    void removeNetwork(unsigned netId) { setNetwork(netId, {}); }
+
+    // Returns the entries that cover |uid|, ordered by subsidiary priority and then by netId. The
+    // result is invalidated by the next call to setNetwork() or removeNetwork().
+    const std::vector<Entry>& lookup(uid_t uid) const;
+
+    size_t segmentCount() const { return mSegments.size(); }
+    // Approximate heap memory used by the lookup array, in bytes.
+    size_t memoryUsage() const;
+
+  private:
+    // A maximal run of UIDs that are all covered by the same entries.
+    struct Segment {
+        int32_t start;
+        int32_t stop;
+        std::vector<Entry> entries;
+    };
+
+    void rebuild();
+
+    std::map<unsigned, std::map<int32_t, UidRanges>> mNetworks;  // Map keys are NetIds.
+    std::vector<Segment> mSegments;                              // Sorted by start.
+};
+
+}  // namespace android::net
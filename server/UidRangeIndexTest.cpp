@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "UidRangeIndex.h"
+
+namespace android {
+namespace net {
+
+namespace {
+
+using Entry = UidRangeIndex::Entry;
+
+UidRanges makeUidRanges(const std::vector<std::pair<int32_t, int32_t>>& ranges) {
+    std::vector<UidRangeParcel> parcels;
+    for (const auto& [start, stop] : ranges) {
+        UidRangeParcel parcel;
+        parcel.start = start;
+        parcel.stop = stop;
+        parcels.push_back(parcel);
+    }
+    return UidRanges(parcels);
+}
+
+}  // namespace
+
+TEST(UidRangeIndexTest, Lookup) {
+    UidRangeIndex index;
+    EXPECT_TRUE(index.lookup(10000).empty());
+
+    index.setNetwork(100, {{1, makeUidRanges({{10000, 19999}, {30000, 30000}})},
+                           {999, makeUidRanges({{0, INT32_MAX}})}});
+    index.setNetwork(101, {{1, makeUidRanges({{15000, 25000}})}});
+
+    const std::vector<Entry> kDefault = {{100, 999}};
+    EXPECT_EQ(kDefault, index.lookup(0));
+    EXPECT_EQ(kDefault, index.lookup(9999));
+    EXPECT_EQ((std::vector<Entry>{{100, 1}, {100, 999}}), index.lookup(10000));
+    // Ordered by subsidiary priority, then by netId.
+    EXPECT_EQ((std::vector<Entry>{{100, 1}, {101, 1}, {100, 999}}), index.lookup(15000));
+    EXPECT_EQ((std::vector<Entry>{{100, 1}, {101, 1}, {100, 999}}), index.lookup(19999));
+    EXPECT_EQ((std::vector<Entry>{{101, 1}, {100, 999}}), index.lookup(20000));
+    EXPECT_EQ((std::vector<Entry>{{101, 1}, {100, 999}}), index.lookup(25000));
+    EXPECT_EQ(kDefault, index.lookup(25001));
+    EXPECT_EQ((std::vector<Entry>{{100, 1}, {100, 999}}), index.lookup(30000));
+    EXPECT_EQ(kDefault, index.lookup(INT32_MAX));
+    EXPECT_TRUE(index.lookup(static_cast<uid_t>(INT32_MAX) + 1).empty());
+}
+
+TEST(UidRangeIndexTest, SetAndRemoveNetwork) {
+    UidRangeIndex index;
+    index.setNetwork(100, {{1, makeUidRanges({{10000, 10999}})}});
+    index.setNetwork(101, {{2, makeUidRanges({{10500, 11999}})}});
+    EXPECT_EQ(3U, index.segmentCount());
+
+    // Replacing a network's ranges drops the old ones.
+    index.setNetwork(100, {{1, makeUidRanges({{20000, 20999}})}});
+    EXPECT_EQ((std::vector<Entry>{{101, 2}}), index.lookup(10500));
+    EXPECT_EQ((std::vector<Entry>{{100, 1}}), index.lookup(20000));
+    EXPECT_EQ(2U, index.segmentCount());
+
+    index.removeNetwork(100);
+    EXPECT_TRUE(index.lookup(20000).empty());
+    index.setNetwork(101, {});
+    EXPECT_TRUE(index.lookup(10500).empty());
+    EXPECT_EQ(0U, index.segmentCount());
+}
+
+TEST(UidRangeIndexTest, OverlappingRangesOfOneNetwork) {
+    UidRangeIndex index;
+    // Adjacent and overlapping ranges of the same entry collapse into a single segment.
+    index.setNetwork(100, {{1, makeUidRanges({{10000, 10999}, {10500, 11999}, {12000, 12999}})}});
+    EXPECT_EQ(1U, index.segmentCount());
+    EXPECT_EQ((std::vector<Entry>{{100, 1}}), index.lookup(12999));
+    EXPECT_TRUE(index.lookup(13000).empty());
+}
+
+}  // namespace net
+}  // namespace android
@@ -22,6 +22,9 @@
 #include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include <android-base/stringprintf.h>
 #include <log/log.h>
 
@@ -50,6 +53,19 @@ UidRangeParcel makeUidRangeParcel(int start, int stop) {
     return res;
 }
 
+// Merges overlapping and adjacent ranges of |sorted|, which must be sorted by start.
+std::vector<UidRangeParcel> coalesce(const std::vector<UidRangeParcel>& sorted) {
+    std::vector<UidRangeParcel> out;
+    for (const auto& range : sorted) {
+        if (!out.empty() && range.start <= static_cast<int64_t>(out.back().stop) + 1) {
+            out.back().stop = std::max(out.back().stop, range.stop);
+        } else {
+            out.push_back(range);
+        }
+    }
+    return out;
+}
+
 uint32_t length(const UidRangeParcel& t) {
     if (t.start == -1 || t.stop == -1) {
         return 0;
@@ -134,17 +150,73 @@ void UidRanges::remove(const UidRanges& other) {
 }
 
 bool UidRanges::overlapsSelf() const {
-    // Compare each element one by one
-    for (size_t i = 0; i < mRanges.size(); i++) {
-        for (size_t j = i + 1; j < mRanges.size(); j++) {
-            if (isOverlapped(mRanges[i], mRanges[j])) {
-                return true;
-            }
+    // The ranges are sorted by start, so one overlaps an earlier one iff it overlaps the earlier
+    // one that reaches furthest.
+    for (size_t i = 1, furthest = 0; i < mRanges.size(); i++) {
+        if (isOverlapped(mRanges[furthest], mRanges[i])) {
+            return true;
         }
+        if (mRanges[i].stop > mRanges[furthest].stop) furthest = i;
     }
     return false;
 }
 
+UidRanges UidRanges::coalesced() const {
+    UidRanges result;
+    result.mRanges = coalesce(mRanges);
+    return result;
+}
+
+UidRanges UidRanges::merge(const UidRanges& other) const {
+    std::vector<UidRangeParcel> all;
+    all.reserve(mRanges.size() + other.mRanges.size());
+    std::merge(mRanges.begin(), mRanges.end(), other.mRanges.begin(), other.mRanges.end(),
+               std::back_inserter(all), compUidRangeParcel);
+    UidRanges result;
+    result.mRanges = coalesce(all);
+    return result;
+}
+
+UidRanges UidRanges::subtract(const UidRanges& other) const {
+    const std::vector<UidRangeParcel> kept = coalesce(mRanges);
+    const std::vector<UidRangeParcel> removed = coalesce(other.mRanges);
+    UidRanges result;
+    size_t j = 0;
+    for (const auto& range : kept) {
+        // Ranges of |removed| that end before this one also end before all the following ones.
+        while (j < removed.size() && removed[j].stop < range.start) j++;
+        int64_t start = range.start;
+        for (size_t k = j; k < removed.size() && removed[k].start <= range.stop; k++) {
+            if (removed[k].start > start) {
+                result.mRanges.push_back(
+                        makeUidRangeParcel(static_cast<int32_t>(start), removed[k].start - 1));
+            }
+            start = static_cast<int64_t>(removed[k].stop) + 1;
+        }
+        if (start <= range.stop) {
+            result.mRanges.push_back(makeUidRangeParcel(static_cast<int32_t>(start), range.stop));
+        }
+    }
+    return result;
+}
+
+UidRanges UidRanges::intersect(const UidRanges& other) const {
+    const std::vector<UidRangeParcel> a = coalesce(mRanges);
+    const std::vector<UidRangeParcel> b = coalesce(other.mRanges);
+    UidRanges result;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        const int32_t start = std::max(a[i].start, b[j].start);
+        const int32_t stop = std::min(a[i].stop, b[j].stop);
+        if (start <= stop) result.mRanges.push_back(makeUidRangeParcel(start, stop));
+        if (a[i].stop < b[j].stop) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return result;
+}
+
 std::string UidRanges::toString() const {
     std::string s("uids{ ");
     for (const auto &range : mRanges) {
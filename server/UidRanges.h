@@ -46,12 +46,22 @@ public:
     bool parseFrom(int argc, char* argv[]);
     std::string toString() const;
 
+    // Each range is kept as given, so that it can be matched to the routing rule that it was
+    // installed with. remove() only removes ranges that are exactly the same as one in |other|.
     void add(const UidRanges& other);
     void remove(const UidRanges& other);
 
     // check if 'mRanges' has uid overlap between elements.
     bool overlapsSelf() const;
 
+    // These treat ranges as sets of UIDs, and return the fewest sorted, disjoint ranges that hold
+    // the result. They take linear time.
+    UidRanges coalesced() const;
+    UidRanges merge(const UidRanges& other) const;
+    // Splits ranges that are only partly in |other|.
+    UidRanges subtract(const UidRanges& other) const;
+    UidRanges intersect(const UidRanges& other) const;
+
     bool empty() const { return mRanges.empty(); }
 
   private:
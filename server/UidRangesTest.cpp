@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "UidRanges.h"
+
+namespace android {
+namespace net {
+
+namespace {
+
+using Ranges = std::vector<std::pair<int32_t, int32_t>>;
+
+UidRanges makeUidRanges(const Ranges& ranges) {
+    std::vector<UidRangeParcel> parcels;
+    for (const auto& [start, stop] : ranges) {
+        UidRangeParcel parcel;
+        parcel.start = start;
+        parcel.stop = stop;
+        parcels.push_back(parcel);
+    }
+    return UidRanges(parcels);
+}
+
+Ranges toPairs(const UidRanges& uidRanges) {
+    Ranges pairs;
+    for (const auto& range : uidRanges.getRanges()) pairs.emplace_back(range.start, range.stop);
+    return pairs;
+}
+
+}  // namespace
+
+TEST(UidRangesTest, OverlapsSelf) {
+    EXPECT_FALSE(makeUidRanges({}).overlapsSelf());
+    EXPECT_FALSE(makeUidRanges({{1, 5}, {6, 10}, {20, 20}}).overlapsSelf());
+    EXPECT_TRUE(makeUidRanges({{1, 5}, {5, 10}}).overlapsSelf());
+    EXPECT_TRUE(makeUidRanges({{3, 3}, {3, 3}}).overlapsSelf());
+    // Only overlaps a range before the one just before it.
+    EXPECT_TRUE(makeUidRanges({{1, 100}, {10, 20}, {50, 60}}).overlapsSelf());
+}
+
+TEST(UidRangesTest, AddAndRemoveKeepRangesAsGiven) {
+    UidRanges uidRanges = makeUidRanges({{1, 10}});
+    uidRanges.add(makeUidRanges({{5, 20}, {21, 30}}));
+    EXPECT_EQ((Ranges{{1, 10}, {5, 20}, {21, 30}}), toPairs(uidRanges));
+
+    uidRanges.remove(makeUidRanges({{5, 20}, {1, 5}}));
+    EXPECT_EQ((Ranges{{1, 10}, {21, 30}}), toPairs(uidRanges));
+}
+
+TEST(UidRangesTest, Coalesced) {
+    EXPECT_EQ((Ranges{{1, 30}, {40, 40}}),
+              toPairs(makeUidRanges({{5, 20}, {1, 10}, {21, 30}, {40, 40}, {40, 40}}).coalesced()));
+    EXPECT_EQ((Ranges{{0, INT32_MAX}}),
+              toPairs(makeUidRanges({{0, 9}, {10, INT32_MAX}}).coalesced()));
+}
+
+TEST(UidRangesTest, Merge) {
+    const UidRanges a = makeUidRanges({{1, 10}, {50, 60}});
+    const UidRanges b = makeUidRanges({{11, 20}, {55, 70}, {100, 100}});
+    EXPECT_EQ((Ranges{{1, 20}, {50, 70}, {100, 100}}), toPairs(a.merge(b)));
+    EXPECT_EQ(toPairs(a.merge(b)), toPairs(b.merge(a)));
+}
+
+TEST(UidRangesTest, Subtract) {
+    const UidRanges a = makeUidRanges({{1, 100}, {200, 300}});
+    EXPECT_EQ((Ranges{{1, 9}, {21, 100}, {200, 300}}),
+              toPairs(a.subtract(makeUidRanges({{10, 20}}))));
+    EXPECT_EQ((Ranges{{1, 49}, {251, 300}}), toPairs(a.subtract(makeUidRanges({{50, 250}}))));
+    EXPECT_EQ((Ranges{{2, 99}}),
+              toPairs(a.subtract(makeUidRanges({{1, 1}, {100, 100}, {150, 400}}))));
+    EXPECT_EQ(Ranges{}, toPairs(a.subtract(makeUidRanges({{0, INT32_MAX}}))));
+    EXPECT_EQ(toPairs(a), toPairs(a.subtract(makeUidRanges({}))));
+    const UidRanges all = makeUidRanges({{0, INT32_MAX}});
+    EXPECT_EQ((Ranges{{INT32_MAX, INT32_MAX}}),
+              toPairs(all.subtract(makeUidRanges({{0, INT32_MAX - 1}}))));
+}
+
+TEST(UidRangesTest, Intersect) {
+    const UidRanges a = makeUidRanges({{1, 100}, {200, 300}});
+    EXPECT_EQ((Ranges{{50, 100}, {200, 250}}), toPairs(a.intersect(makeUidRanges({{50, 250}}))));
+    EXPECT_EQ((Ranges{{5, 5}, {90, 100}, {200, 200}}),
+              toPairs(a.intersect(makeUidRanges({{5, 5}, {90, 110}, {150, 200}}))));
+    EXPECT_EQ(Ranges{}, toPairs(a.intersect(makeUidRanges({{101, 199}}))));
+}
+
+}  // namespace net
+}  // namespace android
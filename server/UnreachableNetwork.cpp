@@ -31,8 +31,9 @@ int UnreachableNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority
         return -EINVAL;
     }
 
-    int ret = RouteController::addUsersToUnreachableNetwork(mNetId, {{subPriority, uidRanges}});
-    if (ret) {
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, true /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
         ALOGE("failed to add users to unreachable network");
         return ret;
     }
@@ -43,9 +44,9 @@ int UnreachableNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority
 int UnreachableNetwork::removeUsers(const UidRanges& uidRanges, int32_t subPriority) {
     if (!isValidSubPriority(subPriority)) return -EINVAL;
 
-    int ret =
-            RouteController::removeUsersFromUnreachableNetwork(mNetId, {{subPriority, uidRanges}});
-    if (ret) {
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, false /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
         ALOGE("failed to remove users from unreachable network");
         return ret;
     }
@@ -53,6 +54,15 @@ int UnreachableNetwork::removeUsers(const UidRanges& uidRanges, int32_t subPrior
     return 0;
 }
 
+int UnreachableNetwork::modifyUidRules(const UidRangeMap& rulesToAdd,
+                                       const UidRangeMap& rulesToRemove) {
+    // Rules are added before the ones they replace are removed, so the UIDs are always blocked.
+    if (int ret = RouteController::addUsersToUnreachableNetwork(mNetId, rulesToAdd)) {
+        return ret;
+    }
+    return RouteController::removeUsersFromUnreachableNetwork(mNetId, rulesToRemove);
+}
+
 bool UnreachableNetwork::isValidSubPriority(int32_t priority) {
     return priority >= UidRanges::SUB_PRIORITY_HIGHEST &&
            priority <= UidRanges::SUB_PRIORITY_LOWEST;
@@ -32,6 +32,8 @@ class UnreachableNetwork : public Network {
   private:
     std::string getTypeString() const override { return "UNREACHABLE"; };
     bool isValidSubPriority(int32_t priority) override;
+    [[nodiscard]] int modifyUidRules(const UidRangeMap& rulesToAdd,
+                                     const UidRangeMap& rulesToRemove);
 };
 
 }  // namespace android::net
\ No newline at end of file
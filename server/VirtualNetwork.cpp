@@ -37,14 +37,11 @@ int VirtualNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority) {
         return -EINVAL;
     }
 
-    for (const std::string& interface : mInterfaces) {
-        int ret = RouteController::addUsersToVirtualNetwork(mNetId, interface.c_str(), mSecure,
-                                                            {{subPriority, uidRanges}},
-                                                            mExcludeLocalRoutes);
-        if (ret) {
-            ALOGE("failed to add users on interface %s of netId %u", interface.c_str(), mNetId);
-            return ret;
-        }
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, true /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
+        ALOGE("failed to add users to netId %u", mNetId);
+        return ret;
     }
     addToUidRangeMap(uidRanges, subPriority);
     return 0;
@@ -53,16 +50,31 @@ int VirtualNetwork::addUsers(const UidRanges& uidRanges, int32_t subPriority) {
 int VirtualNetwork::removeUsers(const UidRanges& uidRanges, int32_t subPriority) {
     if (!isValidSubPriority(subPriority)) return -EINVAL;
 
+    UidRangeMap rulesToAdd, rulesToRemove;
+    getRuleChanges(uidRanges, subPriority, false /* add */, &rulesToAdd, &rulesToRemove);
+    if (int ret = modifyUidRules(rulesToAdd, rulesToRemove)) {
+        ALOGE("failed to remove users from netId %u", mNetId);
+        return ret;
+    }
+    removeFromUidRangeMap(uidRanges, subPriority);
+    return 0;
+}
+
+int VirtualNetwork::modifyUidRules(const UidRangeMap& rulesToAdd,
+                                   const UidRangeMap& rulesToRemove) {
+    // Rules are added before the ones they replace are removed, so the UIDs never leave the VPN.
     for (const std::string& interface : mInterfaces) {
-        int ret = RouteController::removeUsersFromVirtualNetwork(mNetId, interface.c_str(), mSecure,
-                                                                 {{subPriority, uidRanges}},
-                                                                 mExcludeLocalRoutes);
-        if (ret) {
-            ALOGE("failed to remove users on interface %s of netId %u", interface.c_str(), mNetId);
+        if (int ret = RouteController::addUsersToVirtualNetwork(
+                    mNetId, interface.c_str(), mSecure, rulesToAdd, mExcludeLocalRoutes)) {
+            ALOGE("failed to add UID rules on interface %s", interface.c_str());
+            return ret;
+        }
+        if (int ret = RouteController::removeUsersFromVirtualNetwork(
+                    mNetId, interface.c_str(), mSecure, rulesToRemove, mExcludeLocalRoutes)) {
+            ALOGE("failed to remove UID rules on interface %s", interface.c_str());
             return ret;
         }
     }
-    removeFromUidRangeMap(uidRanges, subPriority);
     return 0;
 }
 
@@ -71,7 +83,7 @@ int VirtualNetwork::addInterface(const std::string& interface) {
         return 0;
     }
     if (int ret = RouteController::addInterfaceToVirtualNetwork(
-                mNetId, interface.c_str(), mSecure, mUidRangeMap, mExcludeLocalRoutes)) {
+                mNetId, interface.c_str(), mSecure, getRuleUidRangeMap(), mExcludeLocalRoutes)) {
         ALOGE("failed to add interface %s to VPN netId %u", interface.c_str(), mNetId);
         return ret;
     }
@@ -84,7 +96,7 @@ int VirtualNetwork::removeInterface(const std::string& interface) {
         return 0;
     }
     if (int ret = RouteController::removeInterfaceFromVirtualNetwork(
-                mNetId, interface.c_str(), mSecure, mUidRangeMap, mExcludeLocalRoutes)) {
+                mNetId, interface.c_str(), mSecure, getRuleUidRangeMap(), mExcludeLocalRoutes)) {
         ALOGE("failed to remove interface %s from VPN netId %u", interface.c_str(), mNetId);
         return ret;
     }
@@ -46,6 +46,7 @@ private:
   [[nodiscard]] int addInterface(const std::string& interface) override;
   [[nodiscard]] int removeInterface(const std::string& interface) override;
   bool isValidSubPriority(int32_t priority) override;
+  [[nodiscard]] int modifyUidRules(const UidRangeMap& rulesToAdd, const UidRangeMap& rulesToRemove);
   // Whether the local traffic will be excluded from the VPN network.
   [[maybe_unused]] const bool mExcludeLocalRoutes;
 };
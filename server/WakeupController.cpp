@@ -20,7 +20,9 @@
 #include <iostream>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_log.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <netinet/if_ether.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -35,13 +37,16 @@
 #include <netdutils/Netlink.h>
 
 #include "IptablesRestoreController.h"
+#include "NetdMetrics.h"
 #include "NetlinkManager.h"
 #include "WakeupController.h"
+#include "netd_dump.pb.h"
 
 namespace android {
 namespace net {
 
 using base::StringPrintf;
+using netdutils::DumpWriter;
 using netdutils::Slice;
 using netdutils::Status;
 
@@ -50,6 +55,9 @@ const char WakeupController::LOCAL_MANGLE_INPUT[] = "wakeupctrl_mangle_INPUT";
 const uint32_t WakeupController::kDefaultPacketCopyRange =
         sizeof(struct tcphdr) + sizeof(struct ip6_hdr);
 
+static NetdMetrics::Counter sWakeupPackets("wakeup.packets");
+static NetdMetrics::Counter sWakeupReports("wakeup.reports");
+
 static void extractIpPorts(WakeupController::ReportArgs& args, Slice payload) {
     switch (args.ipNextHeader) {
         case IPPROTO_TCP: {
@@ -83,11 +91,8 @@ static void extractIpHeader(WakeupController::ReportArgs& args, Slice payload) {
                 return;
             }
             args.ipNextHeader = header.protocol;
-            char addr[INET_ADDRSTRLEN] = {};
-            inet_ntop(AF_INET, &header.saddr, addr, sizeof(addr));
-            args.srcIp = addr;
-            inet_ntop(AF_INET, &header.daddr, addr, sizeof(addr));
-            args.dstIp = addr;
+            memcpy(args.srcIp, &header.saddr, sizeof(header.saddr));
+            memcpy(args.dstIp, &header.daddr, sizeof(header.daddr));
             extractIpPorts(args, drop(payload, header.ihl * 4)); // ipv4 IHL counts 32 bit words.
             break;
         }
@@ -97,11 +102,8 @@ static void extractIpHeader(WakeupController::ReportArgs& args, Slice payload) {
                 return;
             }
             args.ipNextHeader = header.ip6_nxt;
-            char addr[INET6_ADDRSTRLEN] = {};
-            inet_ntop(AF_INET6, &header.ip6_src, addr, sizeof(addr));
-            args.srcIp = addr;
-            inet_ntop(AF_INET6, &header.ip6_dst, addr, sizeof(addr));
-            args.dstIp = addr;
+            memcpy(args.srcIp, &header.ip6_src, sizeof(header.ip6_src));
+            memcpy(args.dstIp, &header.ip6_dst, sizeof(header.ip6_dst));
             // TODO: also deal with extension headers
             if (args.ipNextHeader == IPPROTO_TCP || args.ipNextHeader == IPPROTO_UDP) {
                 extractIpPorts(args, drop(payload, sizeof(header)));
@@ -113,6 +115,19 @@ static void extractIpHeader(WakeupController::ReportArgs& args, Slice payload) {
     }
 }
 
+static uint64_t bootTimeNs() {
+    timespec ts = {};
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+std::string WakeupController::ReportArgs::formatIp(const uint8_t* addr) const {
+    if (ipNextHeader == -1) return "";
+    char buf[INET6_ADDRSTRLEN] = {};
+    inet_ntop((ethertype == ETH_P_IPV6) ? AF_INET6 : AF_INET, addr, buf, sizeof(buf));
+    return buf;
+}
+
 WakeupController::~WakeupController() {
     expectOk(mListener->unsubscribe(NetlinkManager::NFLOG_WAKEUP_GROUP));
 }
@@ -130,9 +145,9 @@ netdutils::Status WakeupController::init(NFLogListenerInterface* listener) {
             .dstPort = -1,
             // and all other fields set to 0 as the default
         };
-        bool parseAgain = false;
+        Slice packet;
 
-        const auto attrHandler = [&args, &parseAgain](const nlattr attr, const Slice payload) {
+        const auto attrHandler = [&args, &packet](const nlattr attr, const Slice payload) {
             switch (attr.nla_type) {
                 case NFULA_TIMESTAMP: {
                     timespec ts = {};
@@ -141,10 +156,14 @@ netdutils::Status WakeupController::init(NFLogListenerInterface* listener) {
                     args.timestampNs = ntohl(ts.tv_nsec) + (ntohl(ts.tv_sec) * kNsPerS);
                     break;
                 }
-                case NFULA_PREFIX:
-                    // Strip trailing '\0'
-                    args.prefix = toString(take(payload, payload.size() - 1));
+                case NFULA_PREFIX: {
+                    // Strip trailing '\0', and truncate anything longer than NFLOG allows.
+                    const Slice prefix = take(payload, std::min(payload.size() - 1,
+                                                                sizeof(args.prefix) - 1));
+                    memcpy(args.prefix, prefix.base(), prefix.size());
+                    args.prefix[prefix.size()] = '\0';
                     break;
+                }
                 case NFULA_UID:
                     extract(payload, args.uid);
                     args.uid = ntohl(args.uid);
@@ -157,8 +176,8 @@ netdutils::Status WakeupController::init(NFLogListenerInterface* listener) {
                     struct nfulnl_msg_packet_hw hwaddr = {};
                     extract(payload, hwaddr);
                     size_t hwAddrLen = ntohs(hwaddr.hw_addrlen);
-                    hwAddrLen = std::min(hwAddrLen, sizeof(hwaddr.hw_addr));
-                    args.dstHw.assign(hwaddr.hw_addr, hwaddr.hw_addr + hwAddrLen);
+                    args.dstHwLen = std::min(hwAddrLen, sizeof(hwaddr.hw_addr));
+                    memcpy(args.dstHw, hwaddr.hw_addr, args.dstHwLen);
                     break;
                 }
                 case NFULA_PACKET_HDR: {
@@ -168,11 +187,9 @@ netdutils::Status WakeupController::init(NFLogListenerInterface* listener) {
                     break;
                 }
                 case NFULA_PAYLOAD:
-                    // The packet payload is expected to come last in the Netlink message.
-                    // At that point NFULA_PACKET_HDR has already been parsed and processed.
-                    // If this is not the case, set parseAgain to true.
-                    parseAgain = (args.ethertype == -1);
-                    extractIpHeader(args, payload);
+                    // Parsed once all attributes have been seen, since it can only be decoded
+                    // once NFULA_PACKET_HDR has given the ethertype.
+                    packet = payload;
                     break;
                 default:
                     break;
@@ -180,17 +197,40 @@ netdutils::Status WakeupController::init(NFLogListenerInterface* listener) {
         };
 
         forEachNetlinkAttribute(msg, attrHandler);
-        if (parseAgain) {
-            // NFULA_PAYLOAD was parsed before NFULA_PACKET_HDR.
-            // Now that the ethertype is known, reparse msg for correctly extracting the payload.
-            forEachNetlinkAttribute(msg, attrHandler);
-        }
+        extractIpHeader(args, packet);
+
+        // The packet timestamp is wall clock time and may be missing, so the rates are kept on
+        // the boot time clock instead.
+        mStats.record(args.prefix, args.uid, args.ipNextHeader, args.dstPort, bootTimeNs());
+        sWakeupPackets.inc();
+
+        if (++mUnreportedPackets < mReportSampling) return;
+        mUnreportedPackets = 0;
+        sWakeupReports.inc();
         mReport(args);
     };
     return mListener->subscribe(NetlinkManager::NFLOG_WAKEUP_GROUP,
             WakeupController::kDefaultPacketCopyRange, msgHandler);
 }
 
+void WakeupController::dump(DumpWriter& dw) const {
+    dw.println("WakeupController");
+    mStats.dump(dw, bootTimeNs());
+}
+
+void WakeupController::dumpProto(netd::WakeupControllerProto* proto) const {
+    for (const WakeupStats::Entry& entry : mStats.getEntries(bootTimeNs())) {
+        auto* entryProto = proto->add_entries();
+        entryProto->set_prefix(entry.prefix);
+        entryProto->set_uid(entry.uid);
+        entryProto->set_ip_next_header(entry.ipNextHeader);
+        entryProto->set_dst_port(entry.dstPort);
+        entryProto->set_count(entry.count);
+        entryProto->set_rate_per_hour(entry.ratePerHour);
+    }
+    proto->set_dropped(mStats.getDropped());
+}
+
 Status WakeupController::addInterface(const std::string& ifName, const std::string& prefix,
                                     uint32_t mark, uint32_t mask) {
     return execIptables("-A", ifName, prefix, mark, mask);
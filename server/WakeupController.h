@@ -17,35 +17,59 @@
 #ifndef WAKEUP_CONTROLLER_H
 #define WAKEUP_CONTROLLER_H
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <string>
+#include <vector>
 
+#include <netdutils/DumpWriter.h>
 #include <netdutils/Status.h>
 
 #include "IptablesRestoreController.h"
 #include "NFLogListener.h"
+#include "WakeupStats.h"
 
 namespace android {
 namespace net {
 
+namespace netd {
+class WakeupControllerProto;
+}
+
 class WakeupController {
   public:
 
+    // NFLOG prefixes are at most 63 characters long, plus the terminating NUL.
+    static constexpr size_t kPrefixSize = 64;
+
     // Simple data struct for passing back packet wakeup event information to the ReportFn callback.
+    // It is filled without allocating memory, and formatting the addresses is left to the callback,
+    // since wakeup packets come in bursts.
     struct ReportArgs {
-        std::string prefix;
+        char prefix[kPrefixSize];  // NUL-terminated
         uint64_t timestampNs;
         int uid;
         int gid;
         int ethertype;
-        int ipNextHeader;
-        std::vector<uint8_t> dstHw;
-        std::string srcIp;
-        std::string dstIp;
+        int ipNextHeader;  // -1 if the IP header could not be parsed
+        uint8_t dstHw[8];
+        size_t dstHwLen;
+        uint8_t srcIp[16];  // raw address: 4 bytes for ETH_P_IP, 16 for ETH_P_IPV6
+        uint8_t dstIp[16];
         int srcPort;
         int dstPort;
+
+        // The source or destination address as a string, or "" if the IP header was not parsed.
+        std::string srcIpString() const { return formatIp(srcIp); }
+        std::string dstIpString() const { return formatIp(dstIp); }
+        std::vector<uint8_t> dstHwVector() const { return {dstHw, dstHw + dstHwLen}; }
+
+      private:
+        std::string formatIp(const uint8_t* addr) const;
     };
 
-    // Callback that is triggered for every wakeup event.
+    // Callback that is triggered for wakeup events, subject to setReportSampling().
     using ReportFn = std::function<void(const struct ReportArgs&)>;
 
     // iptables chain where wakeup packets are matched
@@ -73,6 +97,15 @@ class WakeupController {
     netdutils::Status delInterface(const std::string& ifName, const std::string& prefix,
                                    uint32_t mark, uint32_t mask);
 
+    // Only pass every |n|th wakeup packet to the ReportFn. All packets are still counted in the
+    // statistics shown by dump(). 0 and 1 both mean every packet, which is the default.
+    void setReportSampling(uint32_t n) { mReportSampling = n; }
+
+    const WakeupStats& getStats() const { return mStats; }
+
+    void dump(netdutils::DumpWriter& dw) const;
+    void dumpProto(netd::WakeupControllerProto* proto) const;
+
   private:
     netdutils::Status execIptables(const std::string& action, const std::string& ifName,
                                    const std::string& prefix, uint32_t mark, uint32_t mask);
@@ -80,6 +113,9 @@ class WakeupController {
     ReportFn const mReport;
     IptablesRestoreInterface* const mIptables;
     NFLogListenerInterface* mListener;
+    WakeupStats mStats;
+    std::atomic<uint32_t> mReportSampling{1};
+    uint32_t mUnreportedPackets = 0;  // only used on the NFLOG listener thread
 };
 
 }  // namespace net
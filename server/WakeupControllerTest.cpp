@@ -20,7 +20,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -63,6 +65,8 @@ class MockNFLogListener : public NFLogListenerInterface {
     MOCK_METHOD2(subscribe, netdutils::Status(uint16_t nfLogGroup, const DispatchFn& fn));
     MOCK_METHOD3(subscribe,
             netdutils::Status(uint16_t nfLogGroup, uint32_t copyRange, const DispatchFn& fn));
+    MOCK_METHOD3(subscribe, netdutils::Status(uint16_t nfLogGroup, const SubscribeOptions& options,
+                                              const DispatchFn& fn));
     MOCK_METHOD1(unsubscribe, netdutils::Status(uint16_t nfLogGroup));
 };
 
@@ -83,8 +87,9 @@ class WakeupControllerTest : public Test {
     WakeupController mController{
         [this](const WakeupController::ReportArgs& args) {
             mEventListener.onWakeupEvent(args.prefix, args.uid, args.ethertype, args.ipNextHeader,
-                                         args.dstHw, args.srcIp, args.dstIp, args.srcPort,
-                                         args.dstPort, args.timestampNs);
+                                         args.dstHwVector(), args.srcIpString(),
+                                         args.dstIpString(), args.srcPort, args.dstPort,
+                                         args.timestampNs);
         },
         &mIptables};
     NFLogListenerInterface::DispatchFn mMessageHandler;
@@ -209,6 +214,50 @@ TEST_F(WakeupControllerTest, msgHandler) {
     mMessageHandler(msg.nlmsg, msg.nfmsg, payload);
 }
 
+TEST_F(WakeupControllerTest, payloadBeforePacketHeader) {
+    const char kPrefix[] = "test:prefix";
+    const char* kSrcIpAddr = "2001:db8::1";
+    const char* kDstIpAddr = "2001:db8::2";
+    const uint16_t kEthertype = 0x86dd;
+    const uint16_t kSrcPort = 1238;
+    const uint16_t kDstPort = 4567;
+
+    struct Msg {
+        nlmsghdr nlmsg;
+        nfgenmsg nfmsg;
+        nlattr packetPayloadAttr;
+        struct ip6_hdr ipHeader;
+        struct udphdr udpHeader;
+        nlattr prefixAttr;
+        char prefix[sizeof(kPrefix)];
+        nlattr packetHeaderAttr;
+        struct nfulnl_msg_packet_hdr packetHeader;
+    } msg = {};
+
+    msg.packetPayloadAttr.nla_type = NFULA_PAYLOAD;
+    msg.packetPayloadAttr.nla_len =
+            sizeof(msg.packetPayloadAttr) + sizeof(msg.ipHeader) + sizeof(msg.udpHeader);
+    msg.ipHeader.ip6_nxt = IPPROTO_UDP;
+    inet_pton(AF_INET6, kSrcIpAddr, &msg.ipHeader.ip6_src);
+    inet_pton(AF_INET6, kDstIpAddr, &msg.ipHeader.ip6_dst);
+    msg.udpHeader.uh_sport = htons(kSrcPort);
+    msg.udpHeader.uh_dport = htons(kDstPort);
+
+    msg.prefixAttr.nla_type = NFULA_PREFIX;
+    msg.prefixAttr.nla_len = sizeof(msg.prefixAttr) + sizeof(msg.prefix);
+    memcpy(msg.prefix, kPrefix, sizeof(kPrefix));
+
+    msg.packetHeaderAttr.nla_type = NFULA_PACKET_HDR;
+    msg.packetHeaderAttr.nla_len = sizeof(msg.packetHeaderAttr) + sizeof(msg.packetHeader);
+    msg.packetHeader.hw_protocol = htons(kEthertype);
+
+    auto payload = drop(netdutils::makeSlice(msg), offsetof(Msg, packetPayloadAttr));
+    EXPECT_CALL(mEventListener,
+                onWakeupEvent(kPrefix, -1, kEthertype, IPPROTO_UDP, std::vector<uint8_t>(),
+                              kSrcIpAddr, kDstIpAddr, kSrcPort, kDstPort, 0));
+    mMessageHandler(msg.nlmsg, msg.nfmsg, payload);
+}
+
 TEST_F(WakeupControllerTest, badAttr) {
     const char kPrefix[] = "test:prefix";
     const uid_t kUid = 8734;
@@ -281,6 +330,36 @@ TEST_F(WakeupControllerTest, unterminatedString) {
     mMessageHandler(msg.nlmsg, msg.nfmsg, payload);
 }
 
+TEST_F(WakeupControllerTest, reportSampling) {
+    const char kPrefix[] = "test:prefix";
+
+    struct Msg {
+        nlmsghdr nlmsg;
+        nfgenmsg nfmsg;
+        nlattr prefixAttr;
+        char prefix[sizeof(kPrefix)];
+    } msg = {};
+
+    msg.prefixAttr.nla_type = NFULA_PREFIX;
+    msg.prefixAttr.nla_len = sizeof(msg.prefixAttr) + sizeof(msg.prefix);
+    memcpy(msg.prefix, kPrefix, sizeof(kPrefix));
+
+    // Only every third packet is reported, but all of them are counted.
+    mController.setReportSampling(3);
+    auto payload = drop(netdutils::makeSlice(msg), offsetof(Msg, prefixAttr));
+    EXPECT_CALL(mEventListener,
+            onWakeupEvent(kPrefix, -1, -1, -1, std::vector<uint8_t>(), "", "", -1, -1, 0))
+            .Times(2);
+    for (int i = 0; i < 7; ++i) {
+        mMessageHandler(msg.nlmsg, msg.nfmsg, payload);
+    }
+
+    const auto entries = mController.getStats().getEntries(0);
+    ASSERT_EQ(1U, entries.size());
+    EXPECT_EQ(kPrefix, entries[0].prefix);
+    EXPECT_EQ(7U, entries[0].count);
+}
+
 TEST_F(WakeupControllerTest, addInterface) {
     const char kPrefix[] = "test:prefix";
     const char kIfName[] = "wlan8";
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WakeupStats.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+using android::netdutils::DumpWriter;
+
+namespace android::net {
+
+namespace {
+
+constexpr double kMeanLifeNs = std::chrono::nanoseconds(WakeupStats::kMeanLife).count();
+constexpr double kHoursPerMeanLife =
+        std::chrono::duration<double, std::ratio<3600>>(WakeupStats::kMeanLife).count();
+
+size_t hashKey(uint8_t prefixId, int uid, int ipNextHeader, int dstPort) {
+    uint64_t h = static_cast<uint32_t>(uid);
+    h = h * 0x9E3779B97F4A7C15ULL + prefixId;
+    h = h * 0x9E3779B97F4A7C15ULL + static_cast<uint16_t>(ipNextHeader);
+    h = h * 0x9E3779B97F4A7C15ULL + static_cast<uint32_t>(dstPort);
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+}  // namespace
+
+uint8_t WakeupStats::prefixIdLocked(const char* prefix) {
+    for (size_t i = 0; i < mNumPrefixes; ++i) {
+        if (strncmp(mPrefixes[i].data(), prefix, kPrefixSize - 1) == 0) return i;
+    }
+    if (mNumPrefixes == kMaxPrefixes) return kMaxPrefixes - 1;
+    strlcpy(mPrefixes[mNumPrefixes].data(), prefix, kPrefixSize);
+    // The last slot is shared once the others are taken, so it is never named after one prefix.
+    if (mNumPrefixes == kMaxPrefixes - 1) strlcpy(mPrefixes[mNumPrefixes].data(), "?", 2);
+    return mNumPrefixes++;
+}
+
+double WakeupStats::decayed(const Slot& slot, uint64_t nowNs) {
+    if (nowNs <= slot.lastNs) return slot.score;
+    return slot.score * std::exp(-static_cast<double>(nowNs - slot.lastNs) / kMeanLifeNs);
+}
+
+void WakeupStats::record(const char* prefix, int uid, int ipNextHeader, int dstPort,
+                         uint64_t nowNs) {
+    std::lock_guard lock(mMutex);
+    const uint8_t prefixId = prefixIdLocked(prefix);
+    const size_t start = hashKey(prefixId, uid, ipNextHeader, dstPort);
+    const auto count = [&](Slot& slot, bool isNew) {
+        if (isNew) {
+            slot = {.used = true,
+                    .prefixId = prefixId,
+                    .ipNextHeader = static_cast<int16_t>(ipNextHeader),
+                    .uid = uid,
+                    .dstPort = dstPort,
+                    .count = 0,
+                    .score = 0,
+                    .lastNs = nowNs};
+        }
+        slot.count++;
+        slot.score = decayed(slot, nowNs) + 1;
+        slot.lastNs = std::max(slot.lastNs, nowNs);
+    };
+
+    Slot* leastCounted = nullptr;
+    for (size_t probe = 0; probe < kCapacity; ++probe) {
+        Slot& slot = mSlots[(start + probe) & (kCapacity - 1)];
+        if (slot.used && (slot.prefixId != prefixId || slot.uid != uid ||
+                          slot.ipNextHeader != ipNextHeader || slot.dstPort != dstPort)) {
+            if (leastCounted == nullptr || slot.count < leastCounted->count) {
+                leastCounted = &slot;
+            }
+            continue;
+        }
+        count(slot, !slot.used);
+        return;
+    }
+
+    // The table is full. Replace the entry with the fewest packets, so that a key that starts
+    // waking the device up late is still seen. Slots are never emptied, so probing for the other
+    // keys still finds them.
+    mDropped += leastCounted->count;
+    count(*leastCounted, true);
+}
+
+std::vector<WakeupStats::Entry> WakeupStats::getEntries(uint64_t nowNs) const {
+    std::vector<Entry> entries;
+    {
+        std::lock_guard lock(mMutex);
+        for (const Slot& slot : mSlots) {
+            if (!slot.used) continue;
+            entries.push_back({.prefix = mPrefixes[slot.prefixId].data(),
+                               .uid = slot.uid,
+                               .ipNextHeader = slot.ipNextHeader,
+                               .dstPort = slot.dstPort,
+                               .count = slot.count,
+                               .ratePerHour = decayed(slot, nowNs) / kHoursPerMeanLife});
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.ratePerHour > b.ratePerHour;
+    });
+    return entries;
+}
+
+uint64_t WakeupStats::getDropped() const {
+    std::lock_guard lock(mMutex);
+    return mDropped;
+}
+
+void WakeupStats::dump(DumpWriter& dw, uint64_t nowNs) const {
+    dw.incIndent();
+    dw.println("Wakeup packets (prefix uid proto dst_port: count rate/h)");
+    dw.incIndent();
+    for (const Entry& entry : getEntries(nowNs)) {
+        dw.println("%s %d %d %d: %llu %.2f", entry.prefix.c_str(), entry.uid, entry.ipNextHeader,
+                   entry.dstPort, static_cast<unsigned long long>(entry.count),
+                   entry.ratePerHour);
+    }
+    dw.decIndent();
+    dw.println("Dropped: %llu", static_cast<unsigned long long>(getDropped()));
+    dw.decIndent();
+}
+
+}  // namespace android::net
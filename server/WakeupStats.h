@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "netdutils/DumpWriter.h"
+
+namespace android::net {
+
+// Counts of the wakeup packets seen by WakeupController, per (uid, NFLOG prefix, IP protocol,
+// destination port), each with an exponentially decayed rate, so that what wakes the device up
+// can be seen without sending every packet to the framework. The table has a fixed number of
+// entries and does not allocate after construction; once it is full, a packet with a new key
+// replaces the entry with the fewest packets.
+class WakeupStats {
+  public:
+    static constexpr size_t kCapacity = 256;  // a power of 2
+    // Beyond this many, prefixes share the last slot and are shown as "?".
+    static constexpr size_t kMaxPrefixes = 16;
+    static constexpr size_t kPrefixSize = 64;
+    // The rates are averages over roughly this long, weighted towards recent packets.
+    static constexpr std::chrono::seconds kMeanLife = std::chrono::hours(1);
+
+    struct Entry {
+        std::string prefix;
+        int uid;
+        int ipNextHeader;
+        int dstPort;
+        uint64_t count;
+        double ratePerHour;
+    };
+
+    WakeupStats() = default;
+
+    // Counts one wakeup packet seen at |nowNs| on the CLOCK_BOOTTIME timeline. -1 means unknown
+    // for |uid|, |ipNextHeader| and |dstPort|, as in WakeupController::ReportArgs.
+    void record(const char* prefix, int uid, int ipNextHeader, int dstPort, uint64_t nowNs);
+
+    // Returns every entry, its rate decayed to |nowNs|, highest rate first.
+    std::vector<Entry> getEntries(uint64_t nowNs) const;
+
+    // Packets that were counted by entries since replaced by new keys.
+    uint64_t getDropped() const;
+
+    void dump(netdutils::DumpWriter& dw, uint64_t nowNs) const;
+
+  private:
+    struct Slot {
+        bool used;
+        uint8_t prefixId;
+        int16_t ipNextHeader;
+        int32_t uid;
+        int32_t dstPort;
+        uint64_t count;
+        // The rate is score / kMeanLife. score decays by a factor of e every kMeanLife.
+        double score;
+        uint64_t lastNs;
+    };
+
+    uint8_t prefixIdLocked(const char* prefix);
+    static double decayed(const Slot& slot, uint64_t nowNs);
+
+    mutable std::mutex mMutex;
+    // All guarded by mMutex.
+    std::array<Slot, kCapacity> mSlots = {};
+    std::array<std::array<char, kPrefixSize>, kMaxPrefixes> mPrefixes = {};
+    size_t mNumPrefixes = 0;
+    uint64_t mDropped = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "WakeupStats.h"
+
+namespace android::net {
+
+namespace {
+
+constexpr uint64_t kMeanLifeNs = std::chrono::nanoseconds(WakeupStats::kMeanLife).count();
+
+}  // namespace
+
+TEST(WakeupStatsTest, CountsPerKey) {
+    WakeupStats stats;
+    for (int i = 0; i < 3; ++i) stats.record("wlan", 10001, IPPROTO_UDP, 53, 0);
+    stats.record("wlan", 10001, IPPROTO_TCP, 443, 0);
+    stats.record("rmnet", 10001, IPPROTO_UDP, 53, 0);
+
+    const auto entries = stats.getEntries(0);
+    ASSERT_EQ(3U, entries.size());
+    EXPECT_EQ("wlan", entries[0].prefix);
+    EXPECT_EQ(10001, entries[0].uid);
+    EXPECT_EQ(IPPROTO_UDP, entries[0].ipNextHeader);
+    EXPECT_EQ(53, entries[0].dstPort);
+    EXPECT_EQ(3U, entries[0].count);
+    EXPECT_DOUBLE_EQ(3, entries[0].ratePerHour);
+    EXPECT_EQ(1U, entries[1].count);
+    EXPECT_EQ(1U, entries[2].count);
+    EXPECT_EQ(0U, stats.getDropped());
+}
+
+TEST(WakeupStatsTest, RateDecays) {
+    WakeupStats stats;
+    stats.record("wlan", -1, -1, -1, 0);
+    stats.record("wlan", 10002, IPPROTO_UDP, 5353, kMeanLifeNs);
+
+    // After one mean life, the older entry has decayed by e and sorts last.
+    const auto entries = stats.getEntries(kMeanLifeNs);
+    ASSERT_EQ(2U, entries.size());
+    EXPECT_EQ(10002, entries[0].uid);
+    EXPECT_DOUBLE_EQ(1, entries[0].ratePerHour);
+    EXPECT_EQ(-1, entries[1].uid);
+    EXPECT_NEAR(std::exp(-1), entries[1].ratePerHour, 1e-9);
+    EXPECT_EQ(1U, entries[1].count);
+
+    // A new packet adds to what is left of the old rate, and the count is not decayed.
+    stats.record("wlan", -1, -1, -1, kMeanLifeNs);
+    const auto updated = stats.getEntries(kMeanLifeNs);
+    EXPECT_EQ(-1, updated[0].uid);
+    EXPECT_NEAR(1 + std::exp(-1), updated[0].ratePerHour, 1e-9);
+    EXPECT_EQ(2U, updated[0].count);
+}
+
+TEST(WakeupStatsTest, FullTableEvictsLeastCounted) {
+    WakeupStats stats;
+    // uid 0 is counted twice, so it is never the entry with the fewest packets.
+    stats.record("wlan", 0, IPPROTO_TCP, 80, 0);
+    for (size_t i = 0; i < WakeupStats::kCapacity + 10; ++i) {
+        stats.record("wlan", i, IPPROTO_TCP, 80, 0);
+    }
+    const auto entries = stats.getEntries(0);
+    EXPECT_EQ(WakeupStats::kCapacity, entries.size());
+    EXPECT_EQ(10U, stats.getDropped());
+
+    const auto find = [&](int uid) {
+        return std::find_if(entries.begin(), entries.end(),
+                            [uid](const WakeupStats::Entry& e) { return e.uid == uid; });
+    };
+    ASSERT_NE(entries.end(), find(0));
+    EXPECT_EQ(2U, find(0)->count);
+    // The most recent new key took the place of another entry.
+    EXPECT_NE(entries.end(), find(WakeupStats::kCapacity + 9));
+
+    // Existing keys are still counted.
+    stats.record("wlan", 0, IPPROTO_TCP, 80, 0);
+    EXPECT_EQ(10U, stats.getDropped());
+}
+
+TEST(WakeupStatsTest, TooManyPrefixesShareOne) {
+    WakeupStats stats;
+    for (size_t i = 0; i < WakeupStats::kMaxPrefixes + 4; ++i) {
+        stats.record(("prefix" + std::to_string(i)).c_str(), 1000, IPPROTO_UDP, 67, 0);
+    }
+    const auto entries = stats.getEntries(0);
+    ASSERT_EQ(WakeupStats::kMaxPrefixes, entries.size());
+    EXPECT_EQ("?", entries[0].prefix);
+    EXPECT_EQ(5U, entries[0].count);
+}
+
+}  // namespace android::net
@@ -15,8 +15,13 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <functional>
+#include <optional>
 #include <random>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <ctype.h>
@@ -56,6 +61,7 @@
 #include "Fwmark.h"
 #include "InterfaceController.h"
 #include "NetdConstants.h"
+#include "NetdMetrics.h"
 #include "NetlinkCommands.h"
 #include "Permission.h"
 #include "XfrmController.h"
@@ -93,6 +99,9 @@ constexpr uint32_t REPLAY_WINDOW_SIZE_ESN = 4096;
 
 namespace {
 
+NetdMetrics::Counter sSaUpdates("xfrm.sa_updates");
+NetdMetrics::Counter sSaDeletes("xfrm.sa_deletes");
+
 constexpr uint32_t RAND_SPI_MIN = 256;
 constexpr uint32_t RAND_SPI_MAX = 0xFFFFFFFE;
 
@@ -148,6 +157,41 @@ const char* xfrmMsgTypeToString(uint16_t msg) {
 uint8_t kPadBytesArray[] = {0, 0, 0};
 void* kPadBytes = static_cast<void*>(kPadBytesArray);
 
+// An XFRM request built in place in one buffer on the stack: the fixed-size Body struct, followed
+// by attributes of the types Attrs, each padded to NLA_ALIGNTO. The buffer is sized at compile
+// time to hold the body and one of each attribute type, so that building a request needs neither
+// a heap allocation nor an iovec for every struct and every pad.
+template <typename Body, typename... Attrs>
+class XfrmRequest {
+  public:
+    XfrmRequest() { memset(mBuf, 0, kBodyLen); }
+
+    Body* body() { return reinterpret_cast<Body*>(mBuf); }
+
+    // Returns a zeroed Attr at the end of the request. It is not part of the request until
+    // commitAttr() is called with the attribute length; a length of 0 leaves it out.
+    template <typename Attr>
+    Attr* nextAttr() {
+        static_assert((std::is_same_v<Attr, Attrs> || ...), "Attribute not in the request type");
+        static_assert(alignof(Attr) <= NLA_ALIGNTO, "Attribute would be misaligned");
+        LOG_ALWAYS_FATAL_IF(mLen + NLA_ALIGN(sizeof(Attr)) > kCapacity,
+                            "XFRM request overflow: %zu bytes used of %zu", mLen, kCapacity);
+        memset(mBuf + mLen, 0, NLA_ALIGN(sizeof(Attr)));
+        return reinterpret_cast<Attr*>(mBuf + mLen);
+    }
+    void commitAttr(size_t len) { mLen += NLA_ALIGN(len); }
+
+    // The whole request, for sending after the iovec reserved for the nlmsghdr.
+    iovec iov() { return {mBuf, mLen}; }
+
+  private:
+    static constexpr size_t kBodyLen = NLMSG_ALIGN(sizeof(Body));
+    static constexpr size_t kCapacity = kBodyLen + (NLA_ALIGN(sizeof(Attrs)) + ... + 0);
+
+    alignas(Body) uint8_t mBuf[kCapacity];
+    size_t mLen = kBodyLen;
+};
+
 #define LOG_HEX(__desc16__, __buf__, __len__)                                                      \
     do {                                                                                           \
         if (isEngBuild()) {                                                                        \
@@ -218,6 +262,14 @@ StatusOr<uint16_t> convertStringAddress(const std::string& addr, uint8_t* buffer
 // TODO: Need to consider a way to refer to the sSycalls instance
 inline Syscalls& getSyscallInstance() { return netdutils::sSyscalls.get(); }
 
+// The NETLINK_XFRM sockets used by XfrmSocketImpl. IKE rekeys make several XFRM requests in quick
+// succession, and opening and connecting a socket for each one was a good part of their cost.
+// Never destroyed, so that it can be used at exit.
+NetlinkSocketPool& xfrmSocketPool() {
+    static NetlinkSocketPool* sPool = new NetlinkSocketPool(NETLINK_XFRM, 2);
+    return *sPool;
+}
+
 class XfrmSocketImpl : public XfrmSocket {
 private:
     static constexpr int NLMSG_DEFAULTSIZE = 8192;
@@ -236,8 +288,12 @@ private:
     };
 
 public:
+    // The socket belongs to mLease, which returns it to the pool if it can be reused.
+    ~XfrmSocketImpl() override { mSock = -1; }
+
     netdutils::Status open() override {
-        mSock = openNetlinkSocket(NETLINK_XFRM);
+        mLease.emplace(xfrmSocketPool().acquire());
+        mSock = mLease->fd();
         if (mSock < 0) {
             ALOGW("Could not get a new socket, line=%d", __LINE__);
             return netdutils::statusFromErrno(-mSock, "Could not open netlink socket");
@@ -283,10 +339,83 @@ public:
 
     netdutils::Status sendMessage(uint16_t nlMsgType, uint16_t nlMsgFlags, uint16_t nlMsgSeqNum,
                                   std::vector<iovec>* iovecs) const override {
+        // The socket may have been used before, so responses are matched to the request by
+        // sequence number.
+        const uint32_t seq = nlMsgSeqNum ? nlMsgSeqNum : mLease->nextSeq();
+        // Until the response is read, the socket is in an unknown state and must not be reused.
+        mLease->setReusable(false);
+        RETURN_IF_NOT_OK(writeMessage(nlMsgType, nlMsgFlags, seq, iovecs));
+
+        NetlinkResponse response = {};
+
+        StatusOr<Slice> readResult = readResponse(seq, &response);
+        if (!isOk(readResult)) {
+            ALOGE("netlink response error (%s)", toString(readResult).c_str());
+            return readResult;
+        }
+        mLease->setReusable();
+
+        LOG_HEX("netlink msg resp", reinterpret_cast<char*>(readResult.value().base()),
+                readResult.value().size());
+
+        Status validateStatus = validateResponse(response, readResult.value().size());
+        if (!isOk(validateStatus)) {
+            ALOGE("netlink response contains error (%s)", toString(validateStatus).c_str());
+        }
+
+        return validateStatus;
+    }
+
+    netdutils::Status dumpMessages(
+            uint16_t nlMsgType, std::vector<iovec>* iovecs,
+            const std::function<void(const nlmsghdr&)>& onMessage) const override {
+        const uint32_t seq = mLease->nextSeq();
+        mLease->setReusable(false);
+        RETURN_IF_NOT_OK(writeMessage(nlMsgType, NETLINK_DUMP_FLAGS, seq, iovecs));
+
+        NetlinkResponse response = {};
+        while (true) {
+            StatusOr<Slice> readResult =
+                    getSyscallInstance().read(Fd(mSock), netdutils::makeSlice(response));
+            if (!isOk(readResult)) {
+                ALOGE("netlink dump read error (%s)", toString(readResult).c_str());
+                return readResult;
+            }
+            if (readResult.value().size() == 0) {
+                return netdutils::statusFromErrno(EBADMSG, "Netlink dump ended without NLMSG_DONE");
+            }
+
+            uint32_t len = readResult.value().size();
+            for (const nlmsghdr* msg = &response.hdr; NLMSG_OK(msg, len);
+                 msg = NLMSG_NEXT(msg, len)) {
+                // Skip anything left from earlier requests.
+                if (msg->nlmsg_seq != seq) continue;
+
+                if (msg->nlmsg_type == NLMSG_DONE) {
+                    mLease->setReusable();
+                    return netdutils::status::ok;
+                }
+                if (msg->nlmsg_type == NLMSG_ERROR) {
+                    if (msg->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+                        return netdutils::statusFromErrno(EBADMSG, "Truncated netlink error");
+                    }
+                    const int error = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(msg))->error;
+                    ALOGE("netlink dump of %s failed (%s)", xfrmMsgTypeToString(nlMsgType),
+                          strerror(-error));
+                    return netdutils::statusFromErrno(-error, "Netlink dump failed");
+                }
+                onMessage(*msg);
+            }
+        }
+    }
+
+private:
+    netdutils::Status writeMessage(uint16_t nlMsgType, uint16_t nlMsgFlags, uint32_t seq,
+                                   std::vector<iovec>* iovecs) const {
         nlmsghdr nlMsg = {
             .nlmsg_type = nlMsgType,
             .nlmsg_flags = nlMsgFlags,
-            .nlmsg_seq = nlMsgSeqNum,
+            .nlmsg_seq = seq,
         };
 
         (*iovecs)[0].iov_base = &nlMsg;
@@ -309,25 +438,23 @@ public:
             return netdutils::statusFromErrno(EBADMSG, "Invalid message length");
         }
 
-        NetlinkResponse response = {};
-
-        StatusOr<Slice> readResult =
-            getSyscallInstance().read(Fd(mSock), netdutils::makeSlice(response));
-        if (!isOk(readResult)) {
-            ALOGE("netlink response error (%s)", toString(readResult).c_str());
-            return readResult;
-        }
-
-        LOG_HEX("netlink msg resp", reinterpret_cast<char*>(readResult.value().base()),
-                readResult.value().size());
+        return netdutils::status::ok;
+    }
 
-        Status validateStatus = validateResponse(response, readResult.value().size());
-        if (!isOk(validateStatus)) {
-            ALOGE("netlink response contains error (%s)", toString(validateStatus).c_str());
+    // Reads the response to the request with sequence number seq, skipping anything left from
+    // earlier requests, such as the ACK that follows the reply to XFRM_MSG_ALLOCSPI.
+    StatusOr<Slice> readResponse(uint32_t seq, NetlinkResponse* response) const {
+        while (true) {
+            StatusOr<Slice> readResult =
+                    getSyscallInstance().read(Fd(mSock), netdutils::makeSlice(*response));
+            if (!isOk(readResult) || readResult.value().size() < sizeof(nlmsghdr) ||
+                response->hdr.nlmsg_seq == seq) {
+                return readResult;
+            }
         }
-
-        return validateStatus;
     }
+
+    mutable std::optional<NetlinkSocketPool::Lease> mLease;
 };
 
 StatusOr<int> convertToXfrmAddr(const std::string& strAddr, xfrm_address_t* xfrmAddr) {
@@ -360,6 +487,41 @@ void fillXfrmLifetimeDefaults(xfrm_lifetime_cfg* cfg) {
     cfg->hard_packet_limit = XFRM_INF;
 }
 
+// Calls onAttr with the type and payload of each attribute in attrs, stopping at the first
+// malformed attribute.
+template <typename F>
+void forEachXfrmAttr(const Slice attrs, F onAttr) {
+    uint8_t* next = attrs.base();
+    size_t remaining = attrs.size();
+    while (remaining >= NLA_HDRLEN) {
+        const nlattr* attr = reinterpret_cast<const nlattr*>(next);
+        if (attr->nla_len < NLA_HDRLEN || attr->nla_len > remaining) return;
+        onAttr(attr->nla_type & NLA_TYPE_MASK,
+               Slice(next + NLA_HDRLEN, attr->nla_len - NLA_HDRLEN));
+        const size_t step = std::min<size_t>(NLA_ALIGN(attr->nla_len), remaining);
+        next += step;
+        remaining -= step;
+    }
+}
+
+// Copies an attribute payload into value, which is left alone if the payload is too short.
+template <typename T>
+void extractXfrmAttr(const Slice payload, T* value) {
+    if (payload.size() >= sizeof(*value)) {
+        netdutils::extract(payload, *value);
+    }
+}
+
+bool xfrmAddressEquals(int family, const xfrm_address_t& a, const xfrm_address_t& b) {
+    return memcmp(&a, &b, (family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr)) == 0;
+}
+
+std::string xfrmAddressToString(int family, const xfrm_address_t& addr) {
+    char buf[INET6_ADDRSTRLEN] = "?";
+    inet_ntop(family, &addr, buf, sizeof(buf));
+    return buf;
+}
+
 /*
  * Allocate SPIs within an (inclusive) range of min-max.
  * returns 0 (INVALID_SPI) once the entire range has been parsed.
@@ -417,14 +579,15 @@ netdutils::Status XfrmController::flushInterfaces() {
     RETURN_IF_NOT_OK(ifaces);
     const String8 ifPrefix8 = String8(INetd::IPSEC_INTERFACE_PREFIX().string());
 
+    std::vector<std::string> staleIfaces;
     for (const std::string& iface : ifaces.value()) {
-        netdutils::Status status;
         // Look for the reserved interface prefix, which must be in the name at position 0
         if (android::base::StartsWith(iface.c_str(), ifPrefix8.c_str())) {
-            RETURN_IF_NOT_OK(ipSecRemoveTunnelInterface(iface));
+            staleIfaces.push_back(iface);
         }
     }
-    return netdutils::status::ok;
+    // Removed in one batch, since there can be many after a restart with VPNs connected.
+    return ipSecRemoveTunnelInterfaces(staleIfaces);
 }
 
 netdutils::Status XfrmController::flushSaDb(const XfrmSocket& s) {
@@ -442,6 +605,108 @@ netdutils::Status XfrmController::flushPolicyDb(const XfrmSocket& s) {
     return s.sendMessage(XFRM_MSG_FLUSHPOLICY, NETLINK_REQUEST_FLAGS, 0, &iov);
 }
 
+XfrmSaState XfrmController::parseSaState(const ::xfrm_usersa_info& info, const Slice attrs) {
+    XfrmSaState sa = {
+            .transformId = static_cast<int>(info.reqid),
+            .addrFamily = info.family,
+            .srcAddr = info.saddr,
+            .dstAddr = info.id.daddr,
+            .spi = ntohl(info.id.spi),
+            .mode = static_cast<XfrmMode>(info.mode),
+            .mark = {},
+            .xfrm_if_id = 0,
+            .offloadIfIndex = 0,
+            .lifetime = info.curlft,
+    };
+    forEachXfrmAttr(attrs, [&sa](uint16_t type, const Slice payload) {
+        if (type == XFRMA_MARK) {
+            extractXfrmAttr(payload, &sa.mark);
+        } else if (type == XFRMA_IF_ID) {
+            extractXfrmAttr(payload, &sa.xfrm_if_id);
+        } else if (type == XFRMA_OFFLOAD_DEV) {
+            // The kernel only reports this if a device is actually doing the crypto.
+            xfrm_user_offload offload{};
+            extractXfrmAttr(payload, &offload);
+            sa.offloadIfIndex = offload.ifindex;
+        }
+    });
+    return sa;
+}
+
+XfrmSpState XfrmController::parseSpState(const ::xfrm_userpolicy_info& info, const Slice attrs) {
+    XfrmSpState sp = {
+            .transformId = 0,
+            .tmplAddrFamily = 0,
+            .tmplSrcAddr = {},
+            .tmplDstAddr = {},
+            .tmplMode = {},
+            .selAddrFamily = info.sel.family,
+            .direction = static_cast<XfrmDirection>(info.dir),
+            .index = info.index,
+            .mark = {},
+            .xfrm_if_id = 0,
+            .lifetime = info.curlft,
+    };
+    bool haveTemplate = false;
+    forEachXfrmAttr(attrs, [&](uint16_t type, const Slice payload) {
+        if (type == XFRMA_TMPL && !haveTemplate && payload.size() >= sizeof(xfrm_user_tmpl)) {
+            xfrm_user_tmpl tmpl;
+            netdutils::extract(payload, tmpl);
+            sp.transformId = static_cast<int>(tmpl.reqid);
+            sp.tmplAddrFamily = tmpl.family;
+            sp.tmplSrcAddr = tmpl.saddr;
+            sp.tmplDstAddr = tmpl.id.daddr;
+            sp.tmplMode = static_cast<XfrmMode>(tmpl.mode);
+            haveTemplate = true;
+        } else if (type == XFRMA_MARK) {
+            extractXfrmAttr(payload, &sp.mark);
+        } else if (type == XFRMA_IF_ID) {
+            extractXfrmAttr(payload, &sp.xfrm_if_id);
+        }
+    });
+    return sp;
+}
+
+netdutils::Status XfrmController::dumpSecurityAssociations(
+        const XfrmSocket& sock, const std::function<void(const XfrmSaState&)>& onSa) {
+    // A dump request has no body; the kernel lists the whole database.
+    std::vector<iovec> iov = {{nullptr, 0}}; // reserved for the eventual addition of a NLMSG_HDR
+    return sock.dumpMessages(XFRM_MSG_GETSA, &iov, [&onSa](const nlmsghdr& msg) {
+        const Slice payload(NLMSG_DATA(&msg), msg.nlmsg_len - NLMSG_HDRLEN);
+        xfrm_usersa_info info;
+        if (msg.nlmsg_type != XFRM_MSG_NEWSA || payload.size() < NLMSG_ALIGN(sizeof(info))) {
+            return;
+        }
+        // Messages in the buffer are only 32-bit aligned, so the 64-bit counters cannot be read
+        // in place.
+        netdutils::extract(payload, info);
+        onSa(parseSaState(info, drop(payload, NLMSG_ALIGN(sizeof(info)))));
+    });
+}
+
+netdutils::Status XfrmController::dumpSecurityPolicies(
+        const XfrmSocket& sock, const std::function<void(const XfrmSpState&)>& onSp) {
+    std::vector<iovec> iov = {{nullptr, 0}}; // reserved for the eventual addition of a NLMSG_HDR
+    return sock.dumpMessages(XFRM_MSG_GETPOLICY, &iov, [&onSp](const nlmsghdr& msg) {
+        const Slice payload(NLMSG_DATA(&msg), msg.nlmsg_len - NLMSG_HDRLEN);
+        xfrm_userpolicy_info info;
+        if (msg.nlmsg_type != XFRM_MSG_NEWPOLICY || payload.size() < NLMSG_ALIGN(sizeof(info))) {
+            return;
+        }
+        netdutils::extract(payload, info);
+        onSp(parseSpState(info, drop(payload, NLMSG_ALIGN(sizeof(info)))));
+    });
+}
+
+netdutils::Status XfrmController::ipSecDumpState(
+        const std::function<void(const XfrmSaState&)>& onSa,
+        const std::function<void(const XfrmSpState&)>& onSp) {
+    XfrmSocketImpl sock;
+    RETURN_IF_NOT_OK(sock.open());
+    RETURN_IF_NOT_OK(dumpSecurityAssociations(sock, onSa));
+    return dumpSecurityPolicies(sock, onSp);
+}
+
 bool XfrmController::isXfrmIntfSupported() {
     const char* IPSEC_TEST_INTF_NAME = "ipsec_test";
     const int32_t XFRM_TEST_IF_ID = 0xFFFF;
@@ -533,7 +798,8 @@ netdutils::Status XfrmController::ipSecAddSecurityAssociation(
         const std::vector<uint8_t>& authKey, int32_t authTruncBits, const std::string& cryptAlgo,
         const std::vector<uint8_t>& cryptKey, int32_t cryptTruncBits, const std::string& aeadAlgo,
         const std::vector<uint8_t>& aeadKey, int32_t aeadIcvBits, int32_t encapType,
-        int32_t encapLocalPort, int32_t encapRemotePort, int32_t xfrmInterfaceId) {
+        int32_t encapLocalPort, int32_t encapRemotePort, int32_t xfrmInterfaceId,
+        int32_t offloadIfIndex, int32_t offloadDirection, bool* outOffloaded) {
     ALOGD("XfrmController::%s, line=%d", __FUNCTION__, __LINE__);
     ALOGD("transformId=%d", transformId);
     ALOGD("mode=%d", mode);
@@ -553,6 +819,8 @@ netdutils::Status XfrmController::ipSecAddSecurityAssociation(
     ALOGD("encapLocalPort=%d", encapLocalPort);
     ALOGD("encapRemotePort=%d", encapRemotePort);
     ALOGD("xfrmInterfaceId=%d", xfrmInterfaceId);
+    ALOGD("offloadIfIndex=%d", offloadIfIndex);
+    ALOGD("offloadDirection=%d", offloadDirection);
 
     XfrmSaInfo saInfo{};
     netdutils::Status ret = fillXfrmCommonInfo(sourceAddress, destinationAddress, spi, markValue,
@@ -603,9 +871,32 @@ netdutils::Status XfrmController::ipSecAddSecurityAssociation(
 
     saInfo.netId = underlyingNetId;
 
+    if (offloadIfIndex != 0) {
+        switch (static_cast<XfrmDirection>(offloadDirection)) {
+            case XfrmDirection::IN:
+            case XfrmDirection::OUT:
+                saInfo.offload.ifIndex = offloadIfIndex;
+                saInfo.offload.direction = static_cast<XfrmDirection>(offloadDirection);
+                break;
+            default:
+                return netdutils::statusFromErrno(EINVAL, "Invalid offload direction");
+        }
+    }
+
     ret = updateSecurityAssociation(saInfo, sock);
+    if (!isOk(ret) && saInfo.offload.ifIndex != 0 &&
+        (ret.code() == EINVAL || ret.code() == ENODEV || ret.code() == EOPNOTSUPP)) {
+        // The device is gone, or it or the kernel cannot offload this SA. Nothing was installed,
+        // so retry with software crypto.
+        ALOGW("Cannot offload SA to ifindex %d (%s), using software crypto", offloadIfIndex,
+              toString(ret).c_str());
+        saInfo.offload = {};
+        ret = updateSecurityAssociation(saInfo, sock);
+    }
     if (!isOk(ret)) {
         ALOGD("Failed updating a Security Association, line=%d", __LINE__);
+    } else if (outOffloaded != nullptr) {
+        *outOffloaded = (saInfo.offload.ifIndex != 0);
     }
 
     return ret;
@@ -698,6 +989,32 @@ netdutils::Status XfrmController::ipSecMigrate(int32_t transformId, int32_t selA
     return ret;
 }
 
+netdutils::Status XfrmController::ipSecMigrateAll(const std::string& oldLocalAddress,
+                                                  const std::string& oldRemoteAddress,
+                                                  const std::string& newLocalAddress,
+                                                  const std::string& newRemoteAddress,
+                                                  int32_t* outMigrated) {
+    ALOGD("XfrmController:%s, line=%d", __FUNCTION__, __LINE__);
+    ALOGD("oldLocalAddress=%s", oldLocalAddress.c_str());
+    ALOGD("oldRemoteAddress=%s", oldRemoteAddress.c_str());
+    ALOGD("newLocalAddress=%s", newLocalAddress.c_str());
+    ALOGD("newRemoteAddress=%s", newRemoteAddress.c_str());
+
+    XfrmEndpointPair oldEndpoints{};
+    XfrmEndpointPair newEndpoints{};
+    RETURN_IF_NOT_OK(fillXfrmEndpointPair(oldLocalAddress, oldRemoteAddress, &oldEndpoints));
+    RETURN_IF_NOT_OK(fillXfrmEndpointPair(newLocalAddress, newRemoteAddress, &newEndpoints));
+
+    XfrmSocketImpl sock;
+    Status socketStatus = sock.open();
+    if (!socketStatus.ok()) {
+        ALOGD("Sock open failed for XFRM, line=%d", __LINE__);
+        return socketStatus;
+    }
+
+    return migrateAll(oldEndpoints, newEndpoints, sock, outMigrated);
+}
+
 netdutils::Status XfrmController::fillXfrmEndpointPair(const std::string& sourceAddress,
                                                        const std::string& destinationAddress,
                                                        XfrmEndpointPair* endpointPair) {
@@ -940,60 +1257,7 @@ void XfrmController::fillXfrmSelector(const int selAddrFamily, xfrm_selector* se
 
 netdutils::Status XfrmController::updateSecurityAssociation(const XfrmSaInfo& record,
                                                             const XfrmSocket& sock) {
-    xfrm_usersa_info usersa{};
-    nlattr_algo_crypt crypt{};
-    nlattr_algo_auth auth{};
-    nlattr_algo_aead aead{};
-    nlattr_xfrm_mark xfrmmark{};
-    nlattr_xfrm_output_mark xfrmoutputmark{};
-    nlattr_encap_tmpl encap{};
-    nlattr_xfrm_interface_id xfrm_if_id{};
-    nlattr_xfrm_replay_esn xfrm_replay_esn{};
-
-    enum {
-        NLMSG_HDR,
-        USERSA,
-        USERSA_PAD,
-        CRYPT,
-        CRYPT_PAD,
-        AUTH,
-        AUTH_PAD,
-        AEAD,
-        AEAD_PAD,
-        MARK,
-        MARK_PAD,
-        OUTPUT_MARK,
-        OUTPUT_MARK_PAD,
-        ENCAP,
-        ENCAP_PAD,
-        INTF_ID,
-        INTF_ID_PAD,
-        REPLAY_ESN,  // Used to enable BMP (extended replay window) mode
-        REPLAY_ESN_PAD,
-    };
-
-    std::vector<iovec> iov = {
-            {nullptr, 0},           // reserved for the eventual addition of a NLMSG_HDR
-            {&usersa, 0},           // main usersa_info struct
-            {kPadBytes, 0},         // up to NLMSG_ALIGNTO pad bytes of padding
-            {&crypt, 0},            // adjust size if crypt algo is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&auth, 0},             // adjust size if auth algo is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&aead, 0},             // adjust size if aead algo is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&xfrmmark, 0},         // adjust size if xfrm mark is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&xfrmoutputmark, 0},   // adjust size if xfrm output mark is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&encap, 0},            // adjust size if encapsulating
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&xfrm_if_id, 0},       // adjust size if interface ID is present
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-            {&xfrm_replay_esn, 0},  // Always use BMP mode with a large replay window
-            {kPadBytes, 0},         // up to NLATTR_ALIGNTO pad bytes
-    };
-
+    sSaUpdates.inc();
     if (!record.aead.name.empty() && (!record.auth.name.empty() || !record.crypt.name.empty())) {
         return netdutils::statusFromErrno(EINVAL, "Invalid xfrm algo selection; AEAD is mutually "
                                                   "exclusive with both Authentication and "
@@ -1014,34 +1278,28 @@ netdutils::Status XfrmController::updateSecurityAssociation(const XfrmSaInfo& re
         return netdutils::statusFromErrno(EINVAL, "xfrm_if_id set for VTI Security Association");
     }
 
-    int len;
-    len = iov[USERSA].iov_len = fillUserSaInfo(record, &usersa);
-    iov[USERSA_PAD].iov_len = NLMSG_ALIGN(len) - len;
-
-    len = iov[CRYPT].iov_len = fillNlAttrXfrmAlgoEnc(record.crypt, &crypt);
-    iov[CRYPT_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[AUTH].iov_len = fillNlAttrXfrmAlgoAuth(record.auth, &auth);
-    iov[AUTH_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[AEAD].iov_len = fillNlAttrXfrmAlgoAead(record.aead, &aead);
-    iov[AEAD_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[MARK].iov_len = fillNlAttrXfrmMark(record, &xfrmmark);
-    iov[MARK_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[OUTPUT_MARK].iov_len = fillNlAttrXfrmOutputMark(record, &xfrmoutputmark);
-    iov[OUTPUT_MARK_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[ENCAP].iov_len = fillNlAttrXfrmEncapTmpl(record, &encap);
-    iov[ENCAP_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[INTF_ID].iov_len = fillNlAttrXfrmIntfId(record.xfrm_if_id, &xfrm_if_id);
-    iov[INTF_ID_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[REPLAY_ESN].iov_len = fillNlAttrXfrmReplayEsn(&xfrm_replay_esn);
-    iov[REPLAY_ESN_PAD].iov_len = NLA_ALIGN(len) - len;
+    XfrmRequest<xfrm_usersa_info, nlattr_algo_crypt, nlattr_algo_auth, nlattr_algo_aead,
+                nlattr_xfrm_mark, nlattr_xfrm_output_mark, nlattr_encap_tmpl,
+                nlattr_xfrm_interface_id, nlattr_xfrm_replay_esn, nlattr_xfrm_user_offload>
+            request;
+    fillUserSaInfo(record, request.body());
+    request.commitAttr(fillNlAttrXfrmAlgoEnc(record.crypt, request.nextAttr<nlattr_algo_crypt>()));
+    request.commitAttr(fillNlAttrXfrmAlgoAuth(record.auth, request.nextAttr<nlattr_algo_auth>()));
+    request.commitAttr(fillNlAttrXfrmAlgoAead(record.aead, request.nextAttr<nlattr_algo_aead>()));
+    request.commitAttr(fillNlAttrXfrmMark(record, request.nextAttr<nlattr_xfrm_mark>()));
+    request.commitAttr(
+            fillNlAttrXfrmOutputMark(record, request.nextAttr<nlattr_xfrm_output_mark>()));
+    request.commitAttr(fillNlAttrXfrmEncapTmpl(record, request.nextAttr<nlattr_encap_tmpl>()));
+    request.commitAttr(fillNlAttrXfrmIntfId(record.xfrm_if_id,
+                                            request.nextAttr<nlattr_xfrm_interface_id>()));
+    // Always use BMP (extended replay window) mode with a large replay window.
+    request.commitAttr(fillNlAttrXfrmReplayEsn(request.nextAttr<nlattr_xfrm_replay_esn>()));
+    request.commitAttr(fillNlAttrXfrmOffload(record, request.nextAttr<nlattr_xfrm_user_offload>()));
 
+    std::vector<iovec> iov = {
+            {nullptr, 0},  // reserved for the eventual addition of a NLMSG_HDR
+            request.iov(),
+    };
     return sock.sendMessage(XFRM_MSG_UPDSA, NETLINK_REQUEST_FLAGS, 0, &iov);
 }
 
@@ -1153,6 +1411,7 @@ int XfrmController::fillUserSaId(const XfrmCommonInfo& record, xfrm_usersa_id* s
 
 netdutils::Status XfrmController::deleteSecurityAssociation(const XfrmCommonInfo& record,
                                                             const XfrmSocket& sock) {
+    sSaDeletes.inc();
     xfrm_usersa_id said{};
     nlattr_xfrm_mark xfrmmark{};
     nlattr_xfrm_interface_id xfrm_if_id{};
@@ -1200,6 +1459,61 @@ netdutils::Status XfrmController::migrate(const XfrmMigrateInfo& record, const X
     return sock.sendMessage(XFRM_MSG_MIGRATE, NETLINK_REQUEST_FLAGS, 0, &iov);
 }
 
+netdutils::Status XfrmController::migrateAll(const XfrmEndpointPair& oldEndpoints,
+                                             const XfrmEndpointPair& newEndpoints,
+                                             const XfrmSocket& sock, int32_t* outMigrated) {
+    // Collect the policies first: the socket cannot be used for anything else during the dump.
+    std::vector<XfrmMigrateInfo> migrations;
+    RETURN_IF_NOT_OK(dumpSecurityPolicies(sock, [&](const XfrmSpState& sp) {
+        if (sp.transformId == 0 || sp.tmplMode != XfrmMode::TUNNEL ||
+            sp.tmplAddrFamily != oldEndpoints.addrFamily) {
+            return;
+        }
+        const int family = sp.tmplAddrFamily;
+        bool reversed;
+        if (xfrmAddressEquals(family, sp.tmplSrcAddr, oldEndpoints.srcAddr) &&
+            xfrmAddressEquals(family, sp.tmplDstAddr, oldEndpoints.dstAddr)) {
+            reversed = false;
+        } else if (xfrmAddressEquals(family, sp.tmplSrcAddr, oldEndpoints.dstAddr) &&
+                   xfrmAddressEquals(family, sp.tmplDstAddr, oldEndpoints.srcAddr)) {
+            reversed = true;  // Inbound and forward policies use the remote address as source.
+        } else {
+            return;
+        }
+
+        XfrmMigrateInfo info{};
+        info.transformId = sp.transformId;
+        info.xfrm_if_id = sp.xfrm_if_id;
+        info.mode = XfrmMode::TUNNEL;
+        info.selAddrFamily = sp.selAddrFamily;
+        info.direction = sp.direction;
+        info.addrFamily = family;
+        info.srcAddr = sp.tmplSrcAddr;
+        info.dstAddr = sp.tmplDstAddr;
+        info.newEndpointInfo = newEndpoints;
+        if (reversed) {
+            std::swap(info.newEndpointInfo.srcAddr, info.newEndpointInfo.dstAddr);
+        }
+        migrations.push_back(info);
+    }));
+
+    // Every policy using an SA migrates it, so after the first one the SA has already moved and
+    // the kernel only updates the policy.
+    Status ret = netdutils::status::ok;
+    *outMigrated = 0;
+    for (const XfrmMigrateInfo& info : migrations) {
+        const Status status = migrate(info, sock);
+        if (!isOk(status)) {
+            ALOGE("Failed to migrate policy reqid=%d dir=%d family=%d (%s)", info.transformId,
+                  static_cast<int>(info.direction), info.selAddrFamily, toString(status).c_str());
+            if (isOk(ret)) ret = status;
+            continue;
+        }
+        (*outMigrated)++;
+    }
+    return ret;
+}
+
 netdutils::Status XfrmController::allocateSpi(const XfrmSaInfo& record, uint32_t minSpi,
                                               uint32_t maxSpi, uint32_t* outSpi,
                                               const XfrmSocket& sock) {
@@ -1251,48 +1565,19 @@ netdutils::Status XfrmController::allocateSpi(const XfrmSaInfo& record, uint32_t
 netdutils::Status XfrmController::updateTunnelModeSecurityPolicy(const XfrmSpInfo& record,
                                                                  const XfrmSocket& sock,
                                                                  uint16_t msgType) {
-    xfrm_userpolicy_info userpolicy{};
-    nlattr_user_tmpl usertmpl{};
-    nlattr_xfrm_mark xfrmmark{};
-    nlattr_xfrm_interface_id xfrm_if_id{};
-
-    enum {
-        NLMSG_HDR,
-        USERPOLICY,
-        USERPOLICY_PAD,
-        USERTMPL,
-        USERTMPL_PAD,
-        MARK,
-        MARK_PAD,
-        INTF_ID,
-        INTF_ID_PAD,
-    };
+    XfrmRequest<xfrm_userpolicy_info, nlattr_user_tmpl, nlattr_xfrm_mark,
+                nlattr_xfrm_interface_id>
+            request;
+    fillUserSpInfo(record, request.body());
+    request.commitAttr(fillNlAttrUserTemplate(record, request.nextAttr<nlattr_user_tmpl>()));
+    request.commitAttr(fillNlAttrXfrmMark(record, request.nextAttr<nlattr_xfrm_mark>()));
+    request.commitAttr(fillNlAttrXfrmIntfId(record.xfrm_if_id,
+                                            request.nextAttr<nlattr_xfrm_interface_id>()));
 
     std::vector<iovec> iov = {
-            {nullptr, 0},      // reserved for the eventual addition of a NLMSG_HDR
-            {&userpolicy, 0},  // main xfrm_userpolicy_info struct
-            {kPadBytes, 0},    // up to NLMSG_ALIGNTO pad bytes of padding
-            {&usertmpl, 0},    // adjust size if xfrm_user_tmpl struct is present
-            {kPadBytes, 0},    // up to NLATTR_ALIGNTO pad bytes
-            {&xfrmmark, 0},    // adjust size if xfrm mark is present
-            {kPadBytes, 0},    // up to NLATTR_ALIGNTO pad bytes
-            {&xfrm_if_id, 0},  // adjust size if interface ID is present
-            {kPadBytes, 0},    // up to NLATTR_ALIGNTO pad bytes
+            {nullptr, 0},  // reserved for the eventual addition of a NLMSG_HDR
+            request.iov(),
     };
-
-    int len;
-    len = iov[USERPOLICY].iov_len = fillUserSpInfo(record, &userpolicy);
-    iov[USERPOLICY_PAD].iov_len = NLMSG_ALIGN(len) - len;
-
-    len = iov[USERTMPL].iov_len = fillNlAttrUserTemplate(record, &usertmpl);
-    iov[USERTMPL_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[MARK].iov_len = fillNlAttrXfrmMark(record, &xfrmmark);
-    iov[MARK_PAD].iov_len = NLA_ALIGN(len) - len;
-
-    len = iov[INTF_ID].iov_len = fillNlAttrXfrmIntfId(record.xfrm_if_id, &xfrm_if_id);
-    iov[INTF_ID_PAD].iov_len = NLA_ALIGN(len) - len;
-
     return sock.sendMessage(msgType, NETLINK_REQUEST_FLAGS, 0, &iov);
 }
 
@@ -1443,6 +1728,27 @@ int XfrmController::fillNlAttrXfrmReplayEsn(nlattr_xfrm_replay_esn* replay_esn)
     return len;
 }
 
+int XfrmController::fillNlAttrXfrmOffload(const XfrmSaInfo& record,
+                                          nlattr_xfrm_user_offload* offload) {
+    // Do not set if we were not given an offload device
+    if (record.offload.ifIndex == 0) {
+        return 0;
+    }
+
+    offload->offload.ifindex = record.offload.ifIndex;
+    offload->offload.flags = 0;
+    if (record.addrFamily == AF_INET6) {
+        offload->offload.flags |= XFRM_OFFLOAD_IPV6;
+    }
+    if (record.offload.direction == XfrmDirection::IN) {
+        offload->offload.flags |= XFRM_OFFLOAD_INBOUND;
+    }
+
+    int len = NLA_HDRLEN + sizeof(xfrm_user_offload);
+    fillXfrmNlaHdr(&offload->hdr, XFRMA_OFFLOAD_DEV, len);
+    return len;
+}
+
 int XfrmController::fillNlAttrXfrmMigrate(const XfrmMigrateInfo& record,
                                           nlattr_xfrm_user_migrate* migrate) {
     migrate->migrate.old_daddr = record.dstAddr;
@@ -1710,34 +2016,54 @@ netdutils::Status XfrmController::ipSecRemoveTunnelInterface(const std::string&
     ALOGD("XfrmController::%s, line=%d", __FUNCTION__, __LINE__);
     ALOGD("deviceName=%s", deviceName.c_str());
 
-    if (deviceName.empty()) {
+    return ipSecRemoveTunnelInterfaces({deviceName});
+}
+
+netdutils::Status XfrmController::ipSecRemoveTunnelInterfaces(
+        const std::vector<std::string>& deviceNames) {
+    if (std::any_of(deviceNames.begin(), deviceNames.end(),
+                    [](const std::string& name) { return name.empty(); })) {
         return netdutils::statusFromErrno(EINVAL, "Required parameter not provided");
     }
 
-    uint8_t PADDING_BUFFER[] = {0, 0, 0, 0};
+    NetlinkBatch batch;
+    for (const std::string& deviceName : deviceNames) {
+        uint8_t PADDING_BUFFER[] = {0, 0, 0, 0};
 
-    ifinfomsg ifInfoMsg{};
-    nlattr iflaIfName;
-    char iflaIfNameStrValue[deviceName.length() + 1];
-    size_t iflaIfNameLength =
-        strlcpy(iflaIfNameStrValue, deviceName.c_str(), sizeof(iflaIfNameStrValue));
-    size_t iflaIfNamePad = fillNlAttr(IFLA_IFNAME, iflaIfNameLength, &iflaIfName);
+        ifinfomsg ifInfoMsg{};
+        nlattr iflaIfName;
+        char iflaIfNameStrValue[deviceName.length() + 1];
+        size_t iflaIfNameLength =
+            strlcpy(iflaIfNameStrValue, deviceName.c_str(), sizeof(iflaIfNameStrValue));
+        size_t iflaIfNamePad = fillNlAttr(IFLA_IFNAME, iflaIfNameLength, &iflaIfName);
 
-    iovec iov[] = {
-        {nullptr, 0},
-        {&ifInfoMsg, sizeof(ifInfoMsg)},
+        iovec iov[] = {
+            {nullptr, 0},
+            {&ifInfoMsg, sizeof(ifInfoMsg)},
 
-        {&iflaIfName, sizeof(iflaIfName)},
-        {iflaIfNameStrValue, iflaIfNameLength},
-        {&PADDING_BUFFER, iflaIfNamePad},
-    };
+            {&iflaIfName, sizeof(iflaIfName)},
+            {iflaIfNameStrValue, iflaIfNameLength},
+            {&PADDING_BUFFER, iflaIfNamePad},
+        };
 
-    uint16_t action = RTM_DELLINK;
-    uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+        // The batch copies the request, so the buffers above need not outlive this iteration.
+        batch.addRequest(RTM_DELLINK, NLM_F_REQUEST, iov, ARRAY_SIZE(iov));
+    }
+    if (batch.empty()) return netdutils::status::ok;
 
-    // sendNetlinkRequest returns -errno
-    int ret = -1 * sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov), nullptr);
-    return netdutils::statusFromErrno(ret, "Error in deleting IpSec interface " + deviceName);
+    // All the requests are sent together, and the kernel processes every one of them even if an
+    // earlier one fails.
+    const int ret = batch.send();
+    std::string failed;
+    for (size_t i = 0; i < deviceNames.size(); i++) {
+        if (batch.result(i) != 0) {
+            ALOGE("Error in deleting IpSec interface %s: %s", deviceNames[i].c_str(),
+                  strerror(-batch.result(i)));
+            if (failed.empty()) failed = deviceNames[i];
+        }
+    }
+    // NetlinkBatch::send returns -errno
+    return netdutils::statusFromErrno(-ret, "Error in deleting IpSec interface " + failed);
 }
 
 void XfrmController::dump(DumpWriter& dw) {
@@ -1746,6 +2072,35 @@ void XfrmController::dump(DumpWriter& dw) {
 
     ScopedIndent indentForXfrmISupport(dw);
     dw.println("XFRM-I support: %d", mIsXfrmIntfSupported);
+
+    const Status status = ipSecDumpState(
+            [&dw](const XfrmSaState& sa) {
+                dw.println("SA reqid=%d spi=0x%08x %s -> %s mode=%d mark=0x%x/0x%x if_id=0x%x "
+                           "offload=%d bytes=%" PRIu64 " packets=%" PRIu64 " added=%" PRIu64
+                           " used=%" PRIu64,
+                           sa.transformId, sa.spi,
+                           xfrmAddressToString(sa.addrFamily, sa.srcAddr).c_str(),
+                           xfrmAddressToString(sa.addrFamily, sa.dstAddr).c_str(),
+                           static_cast<int>(sa.mode), sa.mark.v, sa.mark.m, sa.xfrm_if_id,
+                           sa.offloadIfIndex,
+                           static_cast<uint64_t>(sa.lifetime.bytes),
+                           static_cast<uint64_t>(sa.lifetime.packets),
+                           static_cast<uint64_t>(sa.lifetime.add_time),
+                           static_cast<uint64_t>(sa.lifetime.use_time));
+            },
+            [&dw](const XfrmSpState& sp) {
+                dw.println("SP reqid=%d index=%u dir=%d family=%d mark=0x%x/0x%x if_id=0x%x "
+                           "bytes=%" PRIu64 " packets=%" PRIu64 " added=%" PRIu64 " used=%" PRIu64,
+                           sp.transformId, sp.index, static_cast<int>(sp.direction),
+                           sp.selAddrFamily, sp.mark.v, sp.mark.m, sp.xfrm_if_id,
+                           static_cast<uint64_t>(sp.lifetime.bytes),
+                           static_cast<uint64_t>(sp.lifetime.packets),
+                           static_cast<uint64_t>(sp.lifetime.add_time),
+                           static_cast<uint64_t>(sp.lifetime.use_time));
+            });
+    if (!isOk(status)) {
+        dw.println("Failed to dump IPsec state: %s", toString(status).c_str());
+    }
 }
 
 } // namespace net
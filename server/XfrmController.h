@@ -17,6 +17,7 @@
 #define _XFRM_CONTROLLER_H
 
 #include <atomic>
+#include <functional>
 #include <list>
 #include <map>
 #include <string>
@@ -75,6 +76,12 @@ public:
                                           uint16_t nlMsgSeqNum,
                                           std::vector<iovec>* iovecs) const = 0;
 
+    // Sends a dump request containing iovecs and calls onMessage for each message of the reply
+    // until the dump is done. Like sendMessage, this populates iovecs[0].
+    virtual netdutils::Status dumpMessages(
+            uint16_t nlMsgType, std::vector<iovec>* iovecs,
+            const std::function<void(const nlmsghdr&)>& onMessage) const = 0;
+
 protected:
     int mSock;
 };
@@ -109,6 +116,12 @@ struct XfrmEncap {
     uint16_t dstPort;
 };
 
+// Inline crypto offload of an SA to a network device. An ifIndex of 0 means no offload.
+struct XfrmOffload {
+    int ifIndex;
+    XfrmDirection direction;  // IN or OUT; the device needs to know which way the SA is used
+};
+
 struct XfrmEndpointPair {
     xfrm_address_t dstAddr; // network order
     xfrm_address_t srcAddr;
@@ -132,6 +145,7 @@ struct XfrmSaInfo : XfrmCommonInfo {
     XfrmAlgo aead;
     int netId;
     XfrmEncap encap;
+    XfrmOffload offload;
 };
 
 struct XfrmSpInfo : XfrmCommonInfo {
@@ -145,6 +159,37 @@ struct XfrmMigrateInfo : XfrmSpInfo {
     XfrmEndpointPair newEndpointInfo;
 };
 
+// An SA installed in the kernel, as listed by ipSecDumpState(). The lifetime holds the kernel's
+// byte and packet counters for the SA, and when it was added and last used.
+struct XfrmSaState {
+    int transformId;  // requestId
+    int addrFamily;
+    xfrm_address_t srcAddr;  // network order
+    xfrm_address_t dstAddr;
+    uint32_t spi;  // host order
+    XfrmMode mode;
+    xfrm_mark mark;
+    uint32_t xfrm_if_id;
+    int offloadIfIndex;  // device doing the crypto, or 0 if done in software
+    xfrm_lifetime_cur lifetime;
+};
+
+// A policy installed in the kernel, as listed by ipSecDumpState().
+struct XfrmSpState {
+    int transformId;  // requestId of the first template, or 0 if the policy has none
+    // The endpoints and mode of the first template, zero if the policy has none.
+    int tmplAddrFamily;
+    xfrm_address_t tmplSrcAddr;  // network order
+    xfrm_address_t tmplDstAddr;
+    XfrmMode tmplMode;
+    int selAddrFamily;
+    XfrmDirection direction;
+    uint32_t index;
+    xfrm_mark mark;
+    uint32_t xfrm_if_id;
+    xfrm_lifetime_cur lifetime;
+};
+
 /*
  * This is a workaround for a kernel bug in the 32bit netlink compat layer
  * that has been present on x86_64 kernels since 2010 with no fix on the
@@ -169,6 +214,22 @@ struct xfrm_userspi_info {
 };
 struct xfrm_userpolicy_info : ::xfrm_userpolicy_info {
 } __attribute__((aligned(8)));
+// Shadow the kernel's versions of the XfrmEventListener events, which embed the above, since
+// the kernel sends them with the same 64-bit layout.
+struct xfrm_user_expire {
+    struct xfrm_usersa_info state;
+    __u8 hard;
+};
+struct xfrm_user_acquire {
+    struct xfrm_id id;
+    xfrm_address_t saddr;
+    struct xfrm_selector sel;
+    struct xfrm_userpolicy_info policy;
+    __u32 aalgos;
+    __u32 ealgos;
+    __u32 calgos;
+    __u32 seq;
+};
 
 /*
  * Anyone who encounters a failure when sending netlink messages should look here
@@ -204,6 +265,15 @@ static_assert(sizeof(xfrm_userpolicy_info) % 8 == 0,
               "struct xfrm_userpolicy_info is not 64-bit "
               "aligned. Please consider whether this patch "
               "is needed.");
+static_assert(offsetof(::xfrm_user_expire, hard) == sizeof(::xfrm_usersa_info) &&
+                      offsetof(::xfrm_user_acquire, policy) == offsetof(xfrm_user_acquire, policy),
+              "struct xfrm_user_expire or xfrm_user_acquire has changed and does not match the "
+              "kernel struct.");
+static_assert(sizeof(::xfrm_user_acquire) - offsetof(::xfrm_user_acquire, aalgos) ==
+                      sizeof(xfrm_user_acquire) - offsetof(xfrm_user_acquire, aalgos),
+              "struct xfrm_user_acquire probably misaligned with kernel struct.");
+static_assert(sizeof(xfrm_user_expire) % 8 == 0 && sizeof(xfrm_user_acquire) % 8 == 0,
+              "struct xfrm_user_expire or xfrm_user_acquire is not 64-bit aligned.");
 #endif
 
 class XfrmController {
@@ -221,6 +291,9 @@ public:
                                               const std::string& remoteAddress, int32_t inSpi,
                                               int32_t* outSpi);
 
+    // If offloadIfIndex is not 0, asks for the SA's crypto to be done inline by that device, for
+    // traffic in offloadDirection (an XfrmDirection). If the kernel rejects the offload, the SA is
+    // installed with software crypto instead; *outOffloaded, if given, says which one was used.
     static netdutils::Status ipSecAddSecurityAssociation(
             int32_t transformId, int32_t mode, const std::string& sourceAddress,
             const std::string& destinationAddress, int32_t underlyingNetId, int32_t spi,
@@ -229,7 +302,9 @@ public:
             const std::string& cryptAlgo, const std::vector<uint8_t>& cryptKey,
             int32_t cryptTruncBits, const std::string& aeadAlgo,
             const std::vector<uint8_t>& aeadKey, int32_t aeadIcvBits, int32_t encapType,
-            int32_t encapLocalPort, int32_t encapRemotePort, int32_t xfrmInterfaceId);
+            int32_t encapLocalPort, int32_t encapRemotePort, int32_t xfrmInterfaceId,
+            int32_t offloadIfIndex = 0, int32_t offloadDirection = 0,
+            bool* outOffloaded = nullptr);
 
     static netdutils::Status ipSecDeleteSecurityAssociation(int32_t transformId,
                                                             const std::string& sourceAddress,
@@ -272,6 +347,12 @@ public:
 
     static netdutils::Status ipSecRemoveTunnelInterface(const std::string& deviceName);
 
+    // Removes all of the given tunnel interfaces, sending the requests to the kernel in batches
+    // rather than waiting for each deletion in turn. Every interface is attempted even if some
+    // fail; the first error is returned.
+    static netdutils::Status ipSecRemoveTunnelInterfaces(
+            const std::vector<std::string>& deviceNames);
+
     // Only available for Tunnel must already have a matching tunnel SA and policy
     static netdutils::Status ipSecMigrate(int32_t transformId, int32_t selAddrFamily,
                                           int32_t direction, const std::string& oldSourceAddress,
@@ -279,6 +360,29 @@ public:
                                           const std::string& newSourceAddress,
                                           const std::string& newDestinationAddress,
                                           int32_t xfrmInterfaceId);
+
+    // Migrates every tunnel-mode policy between the old local and remote addresses, in either
+    // direction, and the SAs they use, to the new addresses, as ipSecMigrate() would one by one.
+    // The policies are found with a single dump and migrated over one socket. Every policy is
+    // attempted even if some fail; the first error is returned, and *outMigrated is set to the
+    // number of policies migrated.
+    static netdutils::Status ipSecMigrateAll(const std::string& oldLocalAddress,
+                                             const std::string& oldRemoteAddress,
+                                             const std::string& newLocalAddress,
+                                             const std::string& newRemoteAddress,
+                                             int32_t* outMigrated);
+
+    // Calls onSa for each SA and then onSp for each policy installed in the kernel. Each database
+    // is read with a single dump instead of one query per entry. The records are filled from the
+    // dump buffer without any allocation, and are only valid during the callback.
+    static netdutils::Status ipSecDumpState(const std::function<void(const XfrmSaState&)>& onSa,
+                                            const std::function<void(const XfrmSpState&)>& onSp);
+
+    // Decode an SA or a policy, and the attributes that follow it, from a message sent by the
+    // kernel: a dump reply, or an event such as XFRM_MSG_EXPIRE or XFRM_MSG_ACQUIRE.
+    static XfrmSaState parseSaState(const ::xfrm_usersa_info& info, netdutils::Slice attrs);
+    static XfrmSpState parseSpState(const ::xfrm_userpolicy_info& info, netdutils::Slice attrs);
+
     void dump(netdutils::DumpWriter& dw);
 
     // Some XFRM netlink attributes comprise a header, a struct, and some data
@@ -368,6 +472,13 @@ public:
         xfrm_user_migrate migrate;
     };
 
+    // Container for the content of an XFRMA_OFFLOAD_DEV netlink attribute.
+    // Exposed for testing
+    struct nlattr_xfrm_user_offload {
+        nlattr hdr;
+        xfrm_user_offload offload;
+    };
+
     // Exposed for testing
     struct nlattr_payload_u32 {
         nlattr hdr;
@@ -423,6 +534,7 @@ public:
                                         nlattr_xfrm_output_mark* output_mark);
     static int fillNlAttrXfrmIntfId(const __u32 intf_id_value, nlattr_xfrm_interface_id* intf_id);
     static int fillNlAttrXfrmReplayEsn(nlattr_xfrm_replay_esn* replay_esn);
+    static int fillNlAttrXfrmOffload(const XfrmSaInfo& record, nlattr_xfrm_user_offload* offload);
     static int fillNlAttrXfrmMigrate(const XfrmMigrateInfo& record,
                                      nlattr_xfrm_user_migrate* migrate);
 
@@ -441,9 +553,16 @@ public:
     static netdutils::Status deleteTunnelModeSecurityPolicy(const XfrmSpInfo& record,
                                                             const XfrmSocket& sock);
     static netdutils::Status migrate(const XfrmMigrateInfo& record, const XfrmSocket& sock);
+    static netdutils::Status migrateAll(const XfrmEndpointPair& oldEndpoints,
+                                        const XfrmEndpointPair& newEndpoints,
+                                        const XfrmSocket& sock, int32_t* outMigrated);
     static netdutils::Status flushInterfaces();
     static netdutils::Status flushSaDb(const XfrmSocket& s);
     static netdutils::Status flushPolicyDb(const XfrmSocket& s);
+    static netdutils::Status dumpSecurityAssociations(
+            const XfrmSocket& sock, const std::function<void(const XfrmSaState&)>& onSa);
+    static netdutils::Status dumpSecurityPolicies(
+            const XfrmSocket& sock, const std::function<void(const XfrmSpState&)>& onSp);
 
     static netdutils::Status ipSecAddXfrmInterface(const std::string& deviceName,
                                                    int32_t interfaceId, uint16_t flags);
@@ -16,10 +16,12 @@
  * xfrm_ctrl_test.cpp - unit tests for xfrm controllers.
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <set>
 #include <vector>
 
@@ -78,6 +80,36 @@ ACTION_TEMPLATE(SetArgSlice, HAS_1_TEMPLATE_PARAMS(int, N), AND_1_VALUE_PARAMS(v
     android::netdutils::copy(orig, value);
 }
 
+/**
+ * Like SetArgSlice, but for a netlink response: also copies the sequence number of the request,
+ * which has been flattened into the vector pointed to by request, into the response.
+ */
+ACTION_TEMPLATE(SetArgSliceAsReplyTo, HAS_1_TEMPLATE_PARAMS(int, N),
+                AND_2_VALUE_PARAMS(value, request)) {
+    Slice orig = ::testing::get<N>(args);
+    android::netdutils::copy(orig, value);
+    nlmsghdr requestHdr{};
+    memcpy(&requestHdr, request->data(), std::min(request->size(), sizeof(requestHdr)));
+    reinterpret_cast<nlmsghdr*>(orig.base())->nlmsg_seq = requestHdr.nlmsg_seq;
+}
+
+/**
+ * Like SetArgSliceAsReplyTo, but for the reply to a dump, which may contain many messages: copies
+ * the sequence number of the request into all of them.
+ */
+ACTION_TEMPLATE(SetArgSliceAsDumpReplyTo, HAS_1_TEMPLATE_PARAMS(int, N),
+                AND_2_VALUE_PARAMS(value, request)) {
+    Slice orig = ::testing::get<N>(args);
+    android::netdutils::copy(orig, value);
+    nlmsghdr requestHdr{};
+    memcpy(&requestHdr, request->data(), std::min(request->size(), sizeof(requestHdr)));
+    uint32_t len = value.size();
+    for (nlmsghdr* msg = reinterpret_cast<nlmsghdr*>(orig.base()); NLMSG_OK(msg, len);
+         msg = NLMSG_NEXT(msg, len)) {
+        msg->nlmsg_seq = requestHdr.nlmsg_seq;
+    }
+}
+
 /**
  * This gMock action works like SaveArg, but is specialized for vector<iovec>.
  * It copies the memory pointed to by each of the iovecs into a single vector<uint8_t>.
@@ -272,7 +304,8 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecAllocateSpi) {
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     int outSpi = 0;
@@ -350,7 +383,8 @@ void testIpSecAddSecurityAssociation(testCaseParams params, const MockSyscalls&
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     Status res = ctrl.ipSecAddSecurityAssociation(
@@ -477,6 +511,102 @@ TEST_F(XfrmControllerTest, TestIpSecAddSecurityAssociationIPv4Encap) {
     // TestIpSecAddSecurityAssociation.
 }
 
+// Returns the XFRMA_OFFLOAD_DEV attribute of the SA update request in nlMsgBuf, if it has one.
+bool findOffloadAttr(const std::vector<uint8_t>& nlMsgBuf, xfrm_user_offload* offload) {
+    Slice attrs = drop(netdutils::makeSlice(nlMsgBuf),
+                       NLMSG_HDRLEN + NLA_ALIGN(sizeof(xfrm_usersa_info)));
+    bool found = false;
+    forEachNetlinkAttribute(attrs, [&](const nlattr& attr, const Slice& payload) {
+        if (attr.nla_type == XFRMA_OFFLOAD_DEV) {
+            netdutils::extract(payload, *offload);
+            found = true;
+        }
+    });
+    return found;
+}
+
+Status addOffloadedSa(XfrmController& ctrl, bool* offloaded) {
+    std::vector<uint8_t> authKey(KEY_LENGTH, 0);
+    std::vector<uint8_t> cryptKey(KEY_LENGTH, 1);
+    return ctrl.ipSecAddSecurityAssociation(
+            1 /* resourceId */, static_cast<int>(XfrmMode::TRANSPORT), LOCALHOST_V6, TEST_ADDR_V6,
+            0 /* underlying netid */, DROID_SPI, 0 /* mark */, 0 /* mask */,
+            "hmac(sha256)" /* auth algo */, authKey, 128 /* auth trunc length */,
+            "cbc(aes)" /* encryption algo */, cryptKey, 0 /* crypt trunc length? */,
+            "" /* AEAD algo */, {}, 0, static_cast<int>(XfrmEncapType::NONE), 0 /* local port */,
+            0 /* remote port */, 0 /* xfrm_if_id */, 42 /* offload ifindex */,
+            static_cast<int>(XfrmDirection::IN), offloaded);
+}
+
+constexpr size_t kSoftwareSaMsgLength =
+        NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(xfrm_usersa_info)) +
+        NLA_ALIGN(offsetof(XfrmController::nlattr_algo_crypt, key) + KEY_LENGTH) +
+        NLA_ALIGN(offsetof(XfrmController::nlattr_algo_auth, key) + KEY_LENGTH) +
+        NLA_ALIGN(sizeof(XfrmController::nlattr_xfrm_replay_esn));
+constexpr size_t kOffloadedSaMsgLength =
+        kSoftwareSaMsgLength + NLA_ALIGN(sizeof(XfrmController::nlattr_xfrm_user_offload));
+
+TEST_F(XfrmControllerTest, TestIpSecAddSecurityAssociationOffload) {
+    NetlinkResponse response{};
+    response.hdr.nlmsg_type = XFRM_MSG_ALLOCSPI;
+    Slice responseSlice = netdutils::makeSlice(response);
+
+    std::vector<uint8_t> nlMsgBuf;
+    EXPECT_CALL(mockSyscalls, writev(_, _))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(kOffloadedSaMsgLength)));
+    EXPECT_CALL(mockSyscalls, read(_, _))
+            .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                            Return(responseSlice)));
+
+    XfrmController ctrl;
+    bool offloaded = false;
+    Status res = addOffloadedSa(ctrl, &offloaded);
+    EXPECT_TRUE(isOk(res)) << res;
+    EXPECT_TRUE(offloaded);
+
+    xfrm_user_offload offload{};
+    ASSERT_TRUE(findOffloadAttr(nlMsgBuf, &offload));
+    EXPECT_EQ(42, offload.ifindex);
+    EXPECT_EQ(XFRM_OFFLOAD_IPV6 | XFRM_OFFLOAD_INBOUND, offload.flags);
+}
+
+TEST_F(XfrmControllerTest, TestIpSecAddSecurityAssociationOffloadFallsBackToSoftware) {
+    struct {
+        nlmsghdr hdr;
+        nlmsgerr err;
+    } refused{};
+    refused.hdr.nlmsg_type = NLMSG_ERROR;
+    refused.hdr.nlmsg_len = sizeof(refused);
+    refused.err.error = -EOPNOTSUPP;
+    Slice refusedSlice = netdutils::makeSlice(refused);
+
+    NetlinkResponse response{};
+    response.hdr.nlmsg_type = XFRM_MSG_ALLOCSPI;
+    Slice responseSlice = netdutils::makeSlice(response);
+
+    std::vector<uint8_t> offloadMsgBuf;
+    std::vector<uint8_t> softwareMsgBuf;
+    EXPECT_CALL(mockSyscalls, writev(_, _))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&offloadMsgBuf), Return(kOffloadedSaMsgLength)))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&softwareMsgBuf), Return(kSoftwareSaMsgLength)));
+    EXPECT_CALL(mockSyscalls, read(_, _))
+            .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(refusedSlice, &offloadMsgBuf),
+                            Return(refusedSlice)))
+            .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &softwareMsgBuf),
+                            Return(responseSlice)));
+
+    XfrmController ctrl;
+    bool offloaded = true;
+    Status res = addOffloadedSa(ctrl, &offloaded);
+    EXPECT_TRUE(isOk(res)) << res;
+    EXPECT_FALSE(offloaded);
+
+    xfrm_user_offload offload{};
+    EXPECT_TRUE(findOffloadAttr(offloadMsgBuf, &offload));
+    EXPECT_FALSE(findOffloadAttr(softwareMsgBuf, &offload));
+    EXPECT_EQ(kSoftwareSaMsgLength, softwareMsgBuf.size());
+}
+
 TEST_F(XfrmControllerTest, TestIpSecApplyTransportModeTransformChecksFamily) {
     struct sockaddr socketaddr;
     socketaddr.sa_family = AF_INET;
@@ -601,7 +731,8 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecDeleteSecurityAssociation) {
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     Status res = ctrl.ipSecDeleteSecurityAssociation(1 /* resourceId */, localAddr, remoteAddr,
@@ -652,7 +783,8 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecAddSecurityPolicy) {
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     Status res = ctrl.ipSecAddSecurityPolicy(
@@ -726,7 +858,8 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecUpdateSecurityPolicy) {
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     Status res = ctrl.ipSecUpdateSecurityPolicy(
@@ -761,7 +894,8 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecDeleteSecurityPolicy) {
     EXPECT_CALL(mockSyscalls, writev(_, _))
         .WillOnce(DoAll(SaveFlattenedIovecs<1>(&nlMsgBuf), Return(expectedMsgLength)));
     EXPECT_CALL(mockSyscalls, read(_, _))
-        .WillOnce(DoAll(SetArgSlice<1>(responseSlice), Return(responseSlice)));
+        .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &nlMsgBuf),
+                        Return(responseSlice)));
 
     XfrmController ctrl(params.xfrmInterfacesEnabled);
     Status res = ctrl.ipSecDeleteSecurityPolicy(1 /* resourceId */, family,
@@ -794,6 +928,216 @@ TEST_P(XfrmControllerParameterizedTest, TestIpSecDeleteSecurityPolicy) {
     }
 }
 
+template <typename T>
+void appendAligned(std::vector<uint8_t>* buf, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buf->insert(buf->end(), bytes, bytes + sizeof(value));
+    buf->resize(NLMSG_ALIGN(buf->size()));
+}
+
+// Appends a netlink message made of the given parts to a dump reply.
+template <typename... T>
+void appendNetlinkMessage(std::vector<uint8_t>* buf, uint16_t type, const T&... parts) {
+    const size_t start = buf->size();
+    nlmsghdr hdr{};
+    hdr.nlmsg_type = type;
+    hdr.nlmsg_flags = NLM_F_MULTI;
+    appendAligned(buf, hdr);
+    (appendAligned(buf, parts), ...);
+    reinterpret_cast<nlmsghdr*>(buf->data() + start)->nlmsg_len = buf->size() - start;
+}
+
+TEST_F(XfrmControllerTest, TestIpSecDumpState) {
+    XfrmController::nlattr_xfrm_mark mark{};
+    mark.hdr.nla_len = sizeof(mark);
+    mark.hdr.nla_type = XFRMA_MARK;
+    mark.mark = {TEST_XFRM_MARK, TEST_XFRM_MASK};
+    XfrmController::nlattr_xfrm_interface_id ifId{};
+    ifId.hdr.nla_len = sizeof(ifId);
+    ifId.hdr.nla_type = XFRMA_IF_ID;
+    ifId.if_id = TEST_XFRM_IF_ID;
+
+    xfrm_usersa_info sa{};
+    sa.reqid = 1;
+    sa.family = AF_INET6;
+    sa.mode = XFRM_MODE_TUNNEL;
+    sa.id.spi = htonl(DROID_SPI);
+    inet_pton(AF_INET6, LOCALHOST_V6, &sa.saddr);
+    inet_pton(AF_INET6, TEST_ADDR_V6, &sa.id.daddr);
+    sa.curlft.bytes = 123456;
+    sa.curlft.packets = 789;
+    std::vector<uint8_t> saReply;
+    appendNetlinkMessage(&saReply, XFRM_MSG_NEWSA, sa, mark, ifId);
+    appendNetlinkMessage(&saReply, NLMSG_DONE, int32_t{0});
+
+    XfrmController::nlattr_user_tmpl tmpl{};
+    tmpl.hdr.nla_len = sizeof(tmpl);
+    tmpl.hdr.nla_type = XFRMA_TMPL;
+    tmpl.tmpl.reqid = 1;
+
+    xfrm_userpolicy_info sp{};
+    sp.dir = XFRM_POLICY_OUT;
+    sp.index = 42;
+    sp.sel.family = AF_INET6;
+    sp.curlft.bytes = 123000;
+    std::vector<uint8_t> spReply;
+    appendNetlinkMessage(&spReply, XFRM_MSG_NEWPOLICY, sp, tmpl, mark, ifId);
+    appendNetlinkMessage(&spReply, NLMSG_DONE, int32_t{0});
+
+    // Dump requests have no body.
+    size_t expectedMsgLength = NLMSG_HDRLEN;
+
+    std::vector<uint8_t> saRequest;
+    std::vector<uint8_t> spRequest;
+    EXPECT_CALL(mockSyscalls, writev(_, _))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&saRequest), Return(expectedMsgLength)))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&spRequest), Return(expectedMsgLength)));
+    EXPECT_CALL(mockSyscalls, read(_, _))
+            .WillOnce(DoAll(SetArgSliceAsDumpReplyTo<1>(netdutils::makeSlice(saReply), &saRequest),
+                            Return(netdutils::makeSlice(saReply))))
+            .WillOnce(DoAll(SetArgSliceAsDumpReplyTo<1>(netdutils::makeSlice(spReply), &spRequest),
+                            Return(netdutils::makeSlice(spReply))));
+
+    std::vector<XfrmSaState> sas;
+    std::vector<XfrmSpState> sps;
+    XfrmController ctrl;
+    Status res = ctrl.ipSecDumpState([&sas](const XfrmSaState& state) { sas.push_back(state); },
+                                     [&sps](const XfrmSpState& state) { sps.push_back(state); });
+    EXPECT_TRUE(isOk(res)) << res;
+
+    for (const std::vector<uint8_t>* request : {&saRequest, &spRequest}) {
+        ASSERT_EQ(expectedMsgLength, request->size());
+        EXPECT_EQ(NLM_F_REQUEST | NLM_F_DUMP,
+                  reinterpret_cast<const nlmsghdr*>(request->data())->nlmsg_flags);
+    }
+    EXPECT_EQ(XFRM_MSG_GETSA, reinterpret_cast<const nlmsghdr*>(saRequest.data())->nlmsg_type);
+    EXPECT_EQ(XFRM_MSG_GETPOLICY,
+              reinterpret_cast<const nlmsghdr*>(spRequest.data())->nlmsg_type);
+
+    ASSERT_EQ(1U, sas.size());
+    EXPECT_EQ(1, sas[0].transformId);
+    EXPECT_EQ(AF_INET6, sas[0].addrFamily);
+    expectAddressEquals(AF_INET6, LOCALHOST_V6, sas[0].srcAddr);
+    expectAddressEquals(AF_INET6, TEST_ADDR_V6, sas[0].dstAddr);
+    EXPECT_EQ(static_cast<uint32_t>(DROID_SPI), sas[0].spi);
+    EXPECT_EQ(XfrmMode::TUNNEL, sas[0].mode);
+    EXPECT_EQ(TEST_XFRM_MARK, sas[0].mark.v);
+    EXPECT_EQ(TEST_XFRM_MASK, sas[0].mark.m);
+    EXPECT_EQ(TEST_XFRM_IF_ID, sas[0].xfrm_if_id);
+    EXPECT_EQ(123456U, sas[0].lifetime.bytes);
+    EXPECT_EQ(789U, sas[0].lifetime.packets);
+
+    ASSERT_EQ(1U, sps.size());
+    EXPECT_EQ(1, sps[0].transformId);
+    EXPECT_EQ(AF_INET6, sps[0].selAddrFamily);
+    EXPECT_EQ(XfrmDirection::OUT, sps[0].direction);
+    EXPECT_EQ(42U, sps[0].index);
+    EXPECT_EQ(TEST_XFRM_MARK, sps[0].mark.v);
+    EXPECT_EQ(TEST_XFRM_IF_ID, sps[0].xfrm_if_id);
+    EXPECT_EQ(123000U, sps[0].lifetime.bytes);
+}
+
+TEST_F(XfrmControllerTest, TestIpSecMigrateAll) {
+    constexpr char kNewLocal[] = "2001:db8::101";
+    constexpr char kNewRemote[] = "2001:db8::102";
+
+    auto makeTemplate = [](const char* src, const char* dst, uint8_t mode) {
+        XfrmController::nlattr_user_tmpl tmpl{};
+        tmpl.hdr.nla_len = sizeof(tmpl);
+        tmpl.hdr.nla_type = XFRMA_TMPL;
+        tmpl.tmpl.reqid = 1;
+        tmpl.tmpl.family = AF_INET6;
+        tmpl.tmpl.mode = mode;
+        inet_pton(AF_INET6, src, &tmpl.tmpl.saddr);
+        inet_pton(AF_INET6, dst, &tmpl.tmpl.id.daddr);
+        return tmpl;
+    };
+    auto makePolicy = [](uint8_t dir) {
+        xfrm_userpolicy_info sp{};
+        sp.dir = dir;
+        sp.sel.family = AF_INET;
+        return sp;
+    };
+
+    // An outbound and an inbound policy of the tunnel, and policies that must not be migrated:
+    // one to another remote address, and one in transport mode.
+    std::vector<uint8_t> spReply;
+    appendNetlinkMessage(&spReply, XFRM_MSG_NEWPOLICY, makePolicy(XFRM_POLICY_OUT),
+                         makeTemplate(LOCALHOST_V6, TEST_ADDR_V6, XFRM_MODE_TUNNEL));
+    appendNetlinkMessage(&spReply, XFRM_MSG_NEWPOLICY, makePolicy(XFRM_POLICY_IN),
+                         makeTemplate(TEST_ADDR_V6, LOCALHOST_V6, XFRM_MODE_TUNNEL));
+    appendNetlinkMessage(&spReply, XFRM_MSG_NEWPOLICY, makePolicy(XFRM_POLICY_OUT),
+                         makeTemplate(LOCALHOST_V6, kNewRemote, XFRM_MODE_TUNNEL));
+    appendNetlinkMessage(&spReply, XFRM_MSG_NEWPOLICY, makePolicy(XFRM_POLICY_OUT),
+                         makeTemplate(LOCALHOST_V6, TEST_ADDR_V6, XFRM_MODE_TRANSPORT));
+    appendNetlinkMessage(&spReply, NLMSG_DONE, int32_t{0});
+
+    NetlinkResponse response{};
+    response.hdr.nlmsg_type = XFRM_MSG_ALLOCSPI;
+    Slice responseSlice = netdutils::makeSlice(response);
+
+    const size_t expectedMigrateLength =
+            NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(xfrm_userpolicy_id)) +
+            NLMSG_ALIGN(sizeof(XfrmController::nlattr_xfrm_user_migrate));
+    std::vector<uint8_t> dumpRequest;
+    std::vector<uint8_t> migrateRequests[2];
+    EXPECT_CALL(mockSyscalls, writev(_, _))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&dumpRequest), Return(size_t{NLMSG_HDRLEN})))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&migrateRequests[0]),
+                            Return(expectedMigrateLength)))
+            .WillOnce(DoAll(SaveFlattenedIovecs<1>(&migrateRequests[1]),
+                            Return(expectedMigrateLength)));
+    EXPECT_CALL(mockSyscalls, read(_, _))
+            .WillOnce(DoAll(SetArgSliceAsDumpReplyTo<1>(netdutils::makeSlice(spReply),
+                                                        &dumpRequest),
+                            Return(netdutils::makeSlice(spReply))))
+            .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &migrateRequests[0]),
+                            Return(responseSlice)))
+            .WillOnce(DoAll(SetArgSliceAsReplyTo<1>(responseSlice, &migrateRequests[1]),
+                            Return(responseSlice)));
+
+    XfrmController ctrl;
+    int32_t migrated = 0;
+    Status res = ctrl.ipSecMigrateAll(LOCALHOST_V6, TEST_ADDR_V6, kNewLocal, kNewRemote,
+                                      &migrated);
+    EXPECT_TRUE(isOk(res)) << res;
+    EXPECT_EQ(2, migrated);
+    EXPECT_EQ(XFRM_MSG_GETPOLICY,
+              reinterpret_cast<const nlmsghdr*>(dumpRequest.data())->nlmsg_type);
+
+    // The inbound policy's endpoints are the other way round.
+    const struct {
+        uint8_t dir;
+        const char* oldSrc;
+        const char* oldDst;
+        const char* newSrc;
+        const char* newDst;
+    } kExpected[] = {
+            {XFRM_POLICY_OUT, LOCALHOST_V6, TEST_ADDR_V6, kNewLocal, kNewRemote},
+            {XFRM_POLICY_IN, TEST_ADDR_V6, LOCALHOST_V6, kNewRemote, kNewLocal},
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(kExpected); i++) {
+        const std::vector<uint8_t>& request = migrateRequests[i];
+        ASSERT_EQ(expectedMigrateLength, request.size());
+        EXPECT_EQ(XFRM_MSG_MIGRATE, reinterpret_cast<const nlmsghdr*>(request.data())->nlmsg_type);
+
+        Slice nlMsgSlice = drop(netdutils::makeSlice(request), NLMSG_HDRLEN);
+        xfrm_userpolicy_id policyId{};
+        netdutils::extract(nlMsgSlice, policyId);
+        EXPECT_EQ(kExpected[i].dir, policyId.dir);
+        EXPECT_EQ(AF_INET, policyId.sel.family);
+
+        XfrmController::nlattr_xfrm_user_migrate migrate{};
+        netdutils::extract(drop(nlMsgSlice, NLMSG_ALIGN(sizeof(xfrm_userpolicy_id))), migrate);
+        EXPECT_EQ(XFRMA_MIGRATE, migrate.hdr.nla_type);
+        EXPECT_EQ(1U, migrate.migrate.reqid);
+        expectAddressEquals(AF_INET6, kExpected[i].oldSrc, migrate.migrate.old_saddr);
+        expectAddressEquals(AF_INET6, kExpected[i].oldDst, migrate.migrate.old_daddr);
+        expectAddressEquals(AF_INET6, kExpected[i].newSrc, migrate.migrate.new_saddr);
+        expectAddressEquals(AF_INET6, kExpected[i].newDst, migrate.migrate.new_daddr);
+    }
+}
+
 // TODO: Add tests for VTIs, ensuring that we are sending the correct data over netlink.
 
 } // namespace net
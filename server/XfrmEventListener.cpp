@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "XfrmEventListener"
+
+#include <linux/netlink.h>
+#include <linux/xfrm.h>
+
+#include <log/log.h>
+#include <netdutils/Misc.h>
+#include <netdutils/Syscalls.h>
+
+#include "XfrmEventListener.h"
+
+namespace android {
+namespace net {
+
+using netdutils::extract;
+using netdutils::NetlinkListener;
+using netdutils::NetlinkListenerInterface;
+using netdutils::Slice;
+using netdutils::sSyscalls;
+using netdutils::Status;
+using netdutils::StatusOr;
+
+namespace {
+
+constexpr uint32_t groupMask(uint32_t group) {
+    return 1U << (group - 1);
+}
+
+}  // namespace
+
+XfrmEventListener::XfrmEventListener(std::shared_ptr<NetlinkListenerInterface> listener)
+    : mListener(std::move(listener)) {
+    // xfrm_user_expire and xfrm_user_acquire are unqualified, so that on 32-bit x86 they are the
+    // versions in XfrmController.h that match the layout of the 64-bit kernel.
+
+    // The SA, followed by its mark and interface ID attributes.
+    const auto expireHandler = [this](const nlmsghdr&, const Slice msg) {
+        xfrm_user_expire expire = {};
+        if (msg.size() < NLMSG_ALIGN(sizeof(expire))) {
+            ALOGE("Truncated XFRM_MSG_EXPIRE: %zu bytes", msg.size());
+            return;
+        }
+        extract(msg, expire);
+        const XfrmSaState sa =
+                XfrmController::parseSaState(expire.state, drop(msg, NLMSG_ALIGN(sizeof(expire))));
+        std::lock_guard guard(mMutex);
+        if (mExpireFn) mExpireFn(sa, expire.hard != 0);
+    };
+    expectOk(mListener->subscribe(XFRM_MSG_EXPIRE, expireHandler));
+
+    // The policy that matched, followed by its templates, mark and interface ID attributes.
+    const auto acquireHandler = [this](const nlmsghdr&, const Slice msg) {
+        xfrm_user_acquire acquire = {};
+        if (msg.size() < NLMSG_ALIGN(sizeof(acquire))) {
+            ALOGE("Truncated XFRM_MSG_ACQUIRE: %zu bytes", msg.size());
+            return;
+        }
+        extract(msg, acquire);
+        const XfrmSpState policy = XfrmController::parseSpState(
+                acquire.policy, drop(msg, NLMSG_ALIGN(sizeof(acquire))));
+        std::lock_guard guard(mMutex);
+        if (mAcquireFn) mAcquireFn(policy, acquire.seq);
+    };
+    expectOk(mListener->subscribe(XFRM_MSG_ACQUIRE, acquireHandler));
+}
+
+XfrmEventListener::~XfrmEventListener() {
+    expectOk(mListener->unsubscribe(XFRM_MSG_EXPIRE));
+    expectOk(mListener->unsubscribe(XFRM_MSG_ACQUIRE));
+}
+
+void XfrmEventListener::setExpireHandler(const ExpireFn& fn) {
+    std::lock_guard guard(mMutex);
+    mExpireFn = fn;
+}
+
+void XfrmEventListener::setAcquireHandler(const AcquireFn& fn) {
+    std::lock_guard guard(mMutex);
+    mAcquireFn = fn;
+}
+
+StatusOr<std::unique_ptr<XfrmEventListener>> makeXfrmEventListener() {
+    const auto& sys = sSyscalls.get();
+    ASSIGN_OR_RETURN(auto event, sys.eventfd(0, EFD_CLOEXEC));
+    const auto domain = AF_NETLINK;
+    const auto flags = SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK;
+    const auto protocol = NETLINK_XFRM;
+    ASSIGN_OR_RETURN(auto sock, sys.socket(domain, flags, protocol));
+
+    // Unlike NFLOG, XFRM events are delivered to multicast groups, joined by binding to them.
+    const sockaddr_nl addr = {
+            .nl_family = AF_NETLINK,
+            .nl_groups = groupMask(XFRMNLGRP_ACQUIRE) | groupMask(XFRMNLGRP_EXPIRE),
+    };
+    RETURN_IF_NOT_OK(sys.bind(sock, addr));
+
+    std::shared_ptr<NetlinkListenerInterface> listener =
+            std::make_unique<NetlinkListener>(std::move(event), std::move(sock), "XfrmListener");
+    return std::unique_ptr<XfrmEventListener>(new XfrmEventListener(std::move(listener)));
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef XFRM_EVENT_LISTENER_H
+#define XFRM_EVENT_LISTENER_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "XfrmController.h"
+#include "netdutils/NetlinkListener.h"
+#include "netdutils/StatusOr.h"
+
+namespace android {
+namespace net {
+
+// XfrmEventListener receives the events the kernel multicasts on NETLINK_XFRM when an SA reaches
+// one of its lifetime limits or when outbound traffic needs an SA that does not exist yet, so
+// that they can be acted upon when they happen instead of being found by polling.
+class XfrmEventListener {
+  public:
+    // Called when an SA reaches its soft or hard lifetime limit. After a hard expiry, the kernel
+    // has deleted the SA.
+    using ExpireFn = std::function<void(const XfrmSaState& sa, bool hard)>;
+
+    // Called when outbound traffic matches a policy with no SA to apply. seq is the sequence number
+    // that the SA must be allocated with.
+    using AcquireFn = std::function<void(const XfrmSpState& policy, uint32_t seq)>;
+
+    // Do not invoke this constructor directly outside of tests. Use
+    // makeXfrmEventListener() instead.
+    explicit XfrmEventListener(std::shared_ptr<netdutils::NetlinkListenerInterface> listener);
+
+    ~XfrmEventListener();
+
+    // Threadsafe. Handlers are invoked on the listener's service thread and replace any handler
+    // set before. They must not call these methods.
+    void setExpireHandler(const ExpireFn& fn);
+    void setAcquireHandler(const AcquireFn& fn);
+
+  private:
+    std::shared_ptr<netdutils::NetlinkListenerInterface> mListener;
+    std::mutex mMutex;
+    ExpireFn mExpireFn;    // guarded by mMutex
+    AcquireFn mAcquireFn;  // guarded by mMutex
+};
+
+// Allocate and return a new XfrmEventListener subscribed to the XFRM expire and acquire groups.
+// On success, the returned listener is ready to use with a running service thread.
+netdutils::StatusOr<std::unique_ptr<XfrmEventListener>> makeXfrmEventListener();
+
+}  // namespace net
+}  // namespace android
+
+#endif /* XFRM_EVENT_LISTENER_H */
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <linux/xfrm.h>
+
+#include <netdutils/NetNativeTestBase.h>
+#include "XfrmEventListener.h"
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::Return;
+using ::testing::SaveArg;
+using ::testing::StrictMock;
+
+namespace android {
+namespace net {
+
+using netdutils::makeSlice;
+using netdutils::NetlinkListenerInterface;
+using netdutils::Slice;
+using netdutils::status::ok;
+
+namespace {
+
+constexpr uint32_t kSpi = 0xD1201D;
+constexpr uint32_t kIfId = 0x1234;
+constexpr uint32_t kMark = 0x123;
+constexpr uint32_t kMask = 0xFFFFFFFF;
+
+class MockNetlinkListener : public NetlinkListenerInterface {
+  public:
+    ~MockNetlinkListener() override = default;
+
+    MOCK_METHOD1(send, netdutils::Status(const Slice msg));
+    MOCK_METHOD2(subscribe, netdutils::Status(uint16_t type, const DispatchFn& fn));
+    MOCK_METHOD1(unsubscribe, netdutils::Status(uint16_t type));
+    MOCK_METHOD0(join, void());
+    MOCK_METHOD1(registerSkErrorHandler, void(const SkErrorHandler& handler));
+};
+
+// A message body followed by the mark and interface ID attributes, as the kernel sends them.
+template <typename T>
+struct EventWithAttrs {
+    T event;
+    XfrmController::nlattr_xfrm_mark mark;
+    XfrmController::nlattr_xfrm_interface_id ifId;
+
+    EventWithAttrs() {
+        memset(this, 0, sizeof(*this));  // Including padding, which would be parsed as attributes.
+        mark.hdr.nla_len = sizeof(mark);
+        mark.hdr.nla_type = XFRMA_MARK;
+        mark.mark = {kMark, kMask};
+        ifId.hdr.nla_len = sizeof(ifId);
+        ifId.hdr.nla_type = XFRMA_IF_ID;
+        ifId.if_id = kIfId;
+    }
+};
+
+}  // namespace
+
+class XfrmEventListenerTest : public NetNativeTestBase {
+  protected:
+    XfrmEventListenerTest() {
+        EXPECT_CALL(*mNLListener, subscribe(XFRM_MSG_EXPIRE, _))
+                .WillOnce(DoAll(SaveArg<1>(&mExpireFn), Return(ok)));
+        EXPECT_CALL(*mNLListener, subscribe(XFRM_MSG_ACQUIRE, _))
+                .WillOnce(DoAll(SaveArg<1>(&mAcquireFn), Return(ok)));
+        mListener.reset(new XfrmEventListener(mNLListener));
+    }
+
+    ~XfrmEventListenerTest() {
+        EXPECT_CALL(*mNLListener, unsubscribe(XFRM_MSG_EXPIRE)).WillOnce(Return(ok));
+        EXPECT_CALL(*mNLListener, unsubscribe(XFRM_MSG_ACQUIRE)).WillOnce(Return(ok));
+    }
+
+    template <typename T>
+    static void deliver(const NetlinkListenerInterface::DispatchFn& fn, uint16_t type, T& msg) {
+        nlmsghdr hdr = {};
+        hdr.nlmsg_type = type;
+        hdr.nlmsg_len = NLMSG_LENGTH(sizeof(msg));
+        fn(hdr, makeSlice(msg));
+    }
+
+    NetlinkListenerInterface::DispatchFn mExpireFn;
+    NetlinkListenerInterface::DispatchFn mAcquireFn;
+    std::shared_ptr<StrictMock<MockNetlinkListener>> mNLListener{
+            new StrictMock<MockNetlinkListener>()};
+    std::unique_ptr<XfrmEventListener> mListener;
+};
+
+TEST_F(XfrmEventListenerTest, Expire) {
+    std::vector<std::pair<XfrmSaState, bool>> expired;
+    mListener->setExpireHandler(
+            [&expired](const XfrmSaState& sa, bool hard) { expired.push_back({sa, hard}); });
+
+    EventWithAttrs<xfrm_user_expire> msg;
+    msg.event.state.reqid = 1;
+    msg.event.state.family = AF_INET;
+    msg.event.state.id.spi = htonl(kSpi);
+    msg.event.state.curlft.bytes = 4096;
+    msg.event.hard = 1;
+    deliver(mExpireFn, XFRM_MSG_EXPIRE, msg);
+
+    msg.event.hard = 0;
+    deliver(mExpireFn, XFRM_MSG_EXPIRE, msg);
+
+    ASSERT_EQ(2U, expired.size());
+    EXPECT_TRUE(expired[0].second);
+    EXPECT_FALSE(expired[1].second);
+    const XfrmSaState& sa = expired[0].first;
+    EXPECT_EQ(1, sa.transformId);
+    EXPECT_EQ(AF_INET, sa.addrFamily);
+    EXPECT_EQ(kSpi, sa.spi);
+    EXPECT_EQ(kMark, sa.mark.v);
+    EXPECT_EQ(kMask, sa.mark.m);
+    EXPECT_EQ(kIfId, sa.xfrm_if_id);
+    EXPECT_EQ(4096U, sa.lifetime.bytes);
+}
+
+TEST_F(XfrmEventListenerTest, Acquire) {
+    std::vector<std::pair<XfrmSpState, uint32_t>> acquired;
+    mListener->setAcquireHandler([&acquired](const XfrmSpState& policy, uint32_t seq) {
+        acquired.push_back({policy, seq});
+    });
+
+    EventWithAttrs<xfrm_user_acquire> msg;
+    msg.event.policy.dir = XFRM_POLICY_OUT;
+    msg.event.policy.index = 42;
+    msg.event.policy.sel.family = AF_INET6;
+    msg.event.seq = 7;
+    deliver(mAcquireFn, XFRM_MSG_ACQUIRE, msg);
+
+    ASSERT_EQ(1U, acquired.size());
+    const XfrmSpState& policy = acquired[0].first;
+    EXPECT_EQ(7U, acquired[0].second);
+    EXPECT_EQ(XfrmDirection::OUT, policy.direction);
+    EXPECT_EQ(42U, policy.index);
+    EXPECT_EQ(AF_INET6, policy.selAddrFamily);
+    EXPECT_EQ(kMark, policy.mark.v);
+    EXPECT_EQ(kIfId, policy.xfrm_if_id);
+}
+
+TEST_F(XfrmEventListenerTest, IgnoresTruncatedAndUnhandledEvents) {
+    int calls = 0;
+
+    // No handler set yet.
+    EventWithAttrs<xfrm_user_expire> msg;
+    deliver(mExpireFn, XFRM_MSG_EXPIRE, msg);
+
+    mListener->setExpireHandler([&calls](const XfrmSaState&, bool) { calls++; });
+    uint8_t truncated[sizeof(xfrm_user_expire) / 2] = {};
+    deliver(mExpireFn, XFRM_MSG_EXPIRE, truncated);
+    EXPECT_EQ(0, calls);
+
+    deliver(mExpireFn, XFRM_MSG_EXPIRE, msg);
+    EXPECT_EQ(1, calls);
+}
+
+}  // namespace net
+}  // namespace android
@@ -26,8 +26,6 @@ using android::fuzzService;
 using android::net::gCtls;
 using android::net::NetdNativeService;
 
-std::mutex android::net::gBigNetdLock;
-
 extern "C" int LLVMFuzzerInitialize(int /**argc*/, char /****argv*/) {
     gCtls = new android::net::Controllers();
     gCtls->init();
@@ -74,8 +74,6 @@ using android::netdutils::Stopwatch;
 const char* const PID_FILE_PATH = "/data/misc/net/netd_pid";
 constexpr const char DNSPROXYLISTENER_SOCKET_NAME[] = "dnsproxyd";
 
-std::mutex android::net::gBigNetdLock;
-
 namespace {
 
 void getNetworkContextCallback(uint32_t netId, uint32_t uid, android_net_context* netcontext) {
@@ -159,7 +157,17 @@ int main() {
     gLog.info("NetlinkManager instanced");
 
     gCtls = new android::net::Controllers();
-    gCtls->init();
+
+    // Publish the binder service right away, so that clients do not wait in waitForService for
+    // all of init(). Each RPC waits for the controllers that it needs, see Controllers::Readiness.
+    Stopwatch serviceTime;
+    if (status_t ret = NetdNativeService::start(); ret != android::OK) {
+        ALOGE("Unable to start NetdNativeService: %d", ret);
+        exit(1);
+    }
+    gCtls->recordStartupPhase("Registering NetdNativeService", serviceTime.timeTakenUs());
+
+    gCtls->initControllers();
 
     if (nm->start()) {
         ALOGE("Unable to start NetlinkManager (%s)", strerror(errno));
@@ -192,25 +200,22 @@ int main() {
         exit(1);
     }
 
-    FwmarkServer fwmarkServer(&gCtls->netCtrl, &gCtls->eventReporter);
-    if (fwmarkServer.startListener()) {
+    FwmarkServer fwmarkServer(&gCtls->netCtrl, &gCtls->eventReporter, &gCtls->fwmarkServerStats);
+    if (fwmarkServer.start()) {
         ALOGE("Unable to start FwmarkServer (%s)", strerror(errno));
         exit(1);
     }
 
+    gCtls->markAllReady();
+    gLog.info("Netd ready to serve all RPCs");
+
     Stopwatch subTime;
     status_t ret;
-    if ((ret = NetdNativeService::start()) != android::OK) {
-        ALOGE("Unable to start NetdNativeService: %d", ret);
-        exit(1);
-    }
-    gLog.info("Registering NetdNativeService: %" PRId64 "us", subTime.getTimeAndResetUs());
-
     if ((ret = MDnsService::start()) != android::OK) {
         ALOGE("Unable to start MDnsService: %d", ret);
         exit(1);
     }
-    gLog.info("Registering MDnsService: %" PRId64 "us", subTime.getTimeAndResetUs());
+    gCtls->recordStartupPhase("Registering MDnsService", subTime.getTimeAndResetUs());
 
     android::net::process::ScopedPidFile pidFile(PID_FILE_PATH);
 
@@ -229,8 +234,8 @@ int main() {
         startedHidlService = false;
     }
 
-    gLog.info("Registering NetdHwService: %" PRId64 "us", subTime.getTimeAndResetUs());
-    gLog.info("Netd started in %" PRId64 "us", s.timeTakenUs());
+    gCtls->recordStartupPhase("Registering NetdHwService", subTime.getTimeAndResetUs());
+    gCtls->recordStartupPhase("Netd started", s.timeTakenUs());
     if (startedHidlService) {
         IPCThreadState::self()->joinThreadPool();
     }
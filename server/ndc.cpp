@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "NdcDispatcher.h"
 
@@ -23,6 +25,8 @@ namespace {
 
 void usage(char* progname) {
     fprintf(stderr, "Usage: %s (<cmd> [arg ...])\n", progname);
+    fprintf(stderr, "       %s batch [<file>]  (one command per line, from stdin by default)\n",
+            progname);
     exit(1);
 }
 
@@ -33,6 +37,22 @@ int main(int argc, char** argv) {
         usage(argv[0]);
     }
 
+    if (!strcmp(argv[1], "batch")) {
+        if (argc > 3) {
+            usage(argv[0]);
+        }
+        FILE* in = stdin;
+        if (argc == 3 && strcmp(argv[2], "-") != 0) {
+            in = fopen(argv[2], "re");
+            if (in == nullptr) {
+                fprintf(stderr, "Cannot open %s: %s\n", argv[2], strerror(errno));
+                exit(1);
+            }
+        }
+        android::net::NdcDispatcher nd;
+        exit(nd.dispatchBatch(in));
+    }
+
     android::net::NdcDispatcher nd;
     exit(nd.dispatchCommand(argc - 1, argv + 1));
 }
@@ -32,6 +32,8 @@ namespace {
 
 const char OEM_SCRIPT_PATH[] = "/system/bin/oem-iptables-init.sh";
 
+// Only used when the OEM script fails. At startup, the oem_* chains are cleared by the batch that
+// creates the child chains.
 bool oemCleanupHooks() {
     static const std::string cmd4 =
             "*filter\n"
@@ -65,10 +67,9 @@ bool oemInitChains() {
 
 void setupOemIptablesHook() {
     if (0 == access(OEM_SCRIPT_PATH, R_OK | X_OK)) {
-        // The call to oemCleanupHooks() is superfluous when done on bootup,
-        // but is needed for the case where netd has crashed/stopped and is
-        // restarted.
-        if (oemCleanupHooks() && oemInitChains()) {
+        // No need to clean up first, even if netd has crashed/stopped and is restarted:
+        // Controllers::initChildChains() has just flushed the oem_* chains along with the others.
+        if (oemInitChains()) {
             ALOGI("OEM iptable hook installed.");
         }
     }
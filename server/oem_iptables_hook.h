@@ -22,6 +22,8 @@
 #define OEM_IPTABLES_NAT_PREROUTING "oem_nat_pre"
 #define OEM_IPTABLES_MANGLE_POSTROUTING "oem_mangle_post"
 
+// Runs the OEM script that fills the oem_* chains. Must be called once the child chains, including
+// the oem_* chains, have been created and flushed.
 void setupOemIptablesHook();
 
 #endif
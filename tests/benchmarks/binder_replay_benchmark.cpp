@@ -0,0 +1,662 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "binder_replay_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This benchmark replays sequences of INetd calls, as the framework makes them during a
+ * connectivity change, and measures how long netd takes to run them. It is meant as an end-to-end
+ * check that a change to netd does not make a whole handover, VPN connection or hotspot start
+ * slower, even if each call on its own looks the same.
+ *
+ * Recording a trace
+ * =================
+ *
+ *   adb shell setprop persist.netd.binder_call_trace 1
+ *   adb shell stop netd && adb shell start netd   # or reboot
+ *   (switch from Wi-Fi to cellular, connect a VPN, start the hotspot, ...)
+ *   adb shell dumpsys netd --binder-trace > handover.trace
+ *   adb push handover.trace /data/local/tmp/netd_traces/
+ *
+ * The format is described in server/BinderCallTrace.h. Lines can be deleted or commented out with
+ * '#' to cut a trace down to the event of interest. Every *.trace file in
+ * /data/local/tmp/netd_traces becomes a benchmark named "replay/<file name>". A few small example
+ * traces are built in. They are written by hand after the calls the framework makes, not recorded,
+ * so they show the shape of each event but not the exact calls or timing of any device.
+ *
+ * Replaying
+ * =========
+ *
+ * Calls run back to back; the time between them in the trace is ignored. Interfaces named in the
+ * trace are replaced by tun interfaces created by the benchmark and netIds by netIds from a test
+ * range, so that the device's own networks are left alone. Whatever the trace set up is undone
+ * after each iteration, untimed: the networks it created are destroyed, forwarding it enabled is
+ * disabled and the default network is restored. Calls that this harness does not know how to
+ * replay are skipped.
+ *
+ * netd itself cannot be moved into a separate network namespace, so the replay runs on the
+ * device's netd. Must run as root.
+ *
+ * Useful measurements
+ * ===================
+ *
+ *  - real_time: the time netd took to run all the calls of the trace once.
+ *
+ *  - <method>_us: the mean time a call to <method> took.
+ *
+ *  - skipped: calls in the trace that were not replayed.
+ *
+ *  - failed: replayed calls that returned an error. A trace recorded on another device may
+ *            depend on state that the replay does not have, but the number should not change
+ *            between runs.
+ */
+
+#include <dirent.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android/net/INetd.h>
+#include <benchmark/benchmark.h>
+#include <binder/Enums.h>
+#include <binder/IServiceManager.h>
+
+#include "BinderCallTrace.h"
+#include "tun_interface.h"
+
+using android::IBinder;
+using android::IServiceManager;
+using android::sp;
+using android::String16;
+using android::base::ParseInt;
+using android::base::StringPrintf;
+using android::binder::Status;
+using android::net::BinderCallTrace;
+using android::net::INetd;
+using android::net::NativeNetworkConfig;
+using android::net::NativeNetworkType;
+using android::net::NativeVpnType;
+using android::net::RouteInfoParcel;
+using android::net::TunInterface;
+using android::net::UidRangeParcel;
+using android::net::netd::aidl::NativeUidRangeConfig;
+
+namespace {
+
+constexpr char TRACE_DIR[] = "/data/local/tmp/netd_traces";
+constexpr char TRACE_SUFFIX[] = ".trace";
+
+// Interfaces in a trace are mapped to tun interfaces, in order of first use.
+constexpr size_t kMaxInterfaces = 8;
+// NetIds in a trace are mapped to netIds from here on, in order of first use. netIds below 100
+// are netd's own (local, dummy, unreachable) and are replayed as they are.
+constexpr int kFirstTestNetId = 65400;
+constexpr int kFirstSystemNetId = 100;
+
+// Built-in traces, written by hand. Each one sets up everything that it later tears down.
+const std::map<std::string, std::string> kBuiltInTraces = {
+        {"wifi_to_cellular",
+         "# Wi-Fi is the default network. Cellular comes up, becomes the default network, and\n"
+         "# Wi-Fi goes away.\n"
+         "0\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 100, networkType: PHYSICAL, "
+         "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}\n"
+         "700\tnetworkAddInterface\tnetId=100\tiface=wlan0\n"
+         "1500\tnetworkAddRoute\tnetId=100\tifName=wlan0\tdestination=192.168.1.0/24\tnextHop=\n"
+         "2100\tnetworkAddRoute\tnetId=100\tifName=wlan0\tdestination=0.0.0.0/0\t"
+         "nextHop=192.168.1.1\n"
+         "2800\tnetworkSetDefault\tnetId=100\n"
+         "40000\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 101, networkType: PHYSICAL, "
+         "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}\n"
+         "40900\tnetworkAddInterface\tnetId=101\tiface=rmnet_data0\n"
+         "42900\tinterfaceSetMtu\tifName=rmnet_data0\tmtuValue=1500\n"
+         "43500\tnetworkAddRoute\tnetId=101\tifName=rmnet_data0\tdestination=fe80::/64\t"
+         "nextHop=\n"
+         "44000\tnetworkAddRoute\tnetId=101\tifName=rmnet_data0\tdestination=::/0\t"
+         "nextHop=fe80::1\n"
+         "44600\tnetworkAddRoute\tnetId=101\tifName=rmnet_data0\tdestination=10.0.0.0/8\t"
+         "nextHop=\n"
+         "45200\tnetworkAddRoute\tnetId=101\tifName=rmnet_data0\tdestination=0.0.0.0/0\t"
+         "nextHop=10.0.0.1\n"
+         "91300\tnetworkSetDefault\tnetId=101\n"
+         "92000\tnetworkSetPermissionForNetwork\tnetId=101\tpermission=0\n"
+         "138800\tnetworkRemoveInterface\tnetId=100\tiface=wlan0\n"
+         "139500\tnetworkDestroy\tnetId=100\n"},
+        {"vpn_connect",
+         "# An app VPN connects on top of Wi-Fi and takes over the traffic of user 0.\n"
+         "0\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 100, networkType: PHYSICAL, "
+         "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}\n"
+         "702\tnetworkAddInterface\tnetId=100\tiface=wlan0\n"
+         "1534\tnetworkAddRoute\tnetId=100\tifName=wlan0\tdestination=192.168.1.0/24\tnextHop=\n"
+         "2106\tnetworkAddRoute\tnetId=100\tifName=wlan0\tdestination=0.0.0.0/0\t"
+         "nextHop=192.168.1.1\n"
+         "2811\tnetworkSetDefault\tnetId=100\n"
+         "40377\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 102, networkType: VIRTUAL, "
+         "permission: 0, secure: true, vpnType: SERVICE, excludeLocalRoutes: false}\n"
+         "41239\tnetworkAddInterface\tnetId=102\tiface=tun0\n"
+         "41998\tinterfaceAddAddress\tifName=tun0\taddrString=10.10.0.2\tprefixLength=32\n"
+         "42670\tnetworkAddRoute\tnetId=102\tifName=tun0\tdestination=0.0.0.0/0\tnextHop=\n"
+         "43307\tnetworkAddRoute\tnetId=102\tifName=tun0\tdestination=::/0\tnextHop=\n"
+         "44151\tnetworkRejectNonSecureVpn\tadd=true\tuidRanges=[UidRangeParcel{start: 0, "
+         "stop: 99999}]\n"
+         "45012\tnetworkAddUidRangesParcel\tuidRangesConfig=NativeUidRangeConfig{netId: 102, "
+         "uidRanges: [UidRangeParcel{start: 0, stop: 1012}, UidRangeParcel{start: 1014, "
+         "stop: 99999}], subPriority: 0}\n"},
+        {"hotspot_start",
+         "# The hotspot starts on wlan1, with cellular as the upstream.\n"
+         "0\tnetworkCreate\tconfig=NativeNetworkConfig{netId: 101, networkType: PHYSICAL, "
+         "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}\n"
+         "811\tnetworkAddInterface\tnetId=101\tiface=rmnet_data0\n"
+         "1650\tnetworkAddRoute\tnetId=101\tifName=rmnet_data0\tdestination=0.0.0.0/0\t"
+         "nextHop=\n"
+         "30122\tinterfaceAddAddress\tifName=wlan1\taddrString=192.168.43.1\tprefixLength=24\n"
+         "31006\ttetherInterfaceAdd\tifName=wlan1\n"
+         "31891\tnetworkAddInterface\tnetId=99\tiface=wlan1\n"
+         "32540\tnetworkAddRoute\tnetId=99\tifName=wlan1\tdestination=192.168.43.0/24\t"
+         "nextHop=\n"
+         "33207\tipfwdEnableForwarding\trequester=tethering\n"
+         "34399\ttetherAddForward\tintIface=wlan1\textIface=rmnet_data0\n"
+         "35121\tipfwdAddInterfaceForward\tfromIface=wlan1\ttoIface=rmnet_data0\n"},
+};
+
+std::string trim(std::string_view s) {
+    return android::base::Trim(std::string(s));
+}
+
+// Splits |s| at the commas that are not inside braces or brackets.
+std::vector<std::string> splitTopLevel(std::string_view s) {
+    std::vector<std::string> parts;
+    int depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '{' || s[i] == '[') depth++;
+        if (s[i] == '}' || s[i] == ']') depth--;
+        if (s[i] == ',' && depth == 0) {
+            parts.push_back(trim(s.substr(start, i - start)));
+            start = i + 1;
+        }
+    }
+    if (!trim(s.substr(start)).empty()) parts.push_back(trim(s.substr(start)));
+    return parts;
+}
+
+std::optional<int32_t> parseInt(const std::string& s) {
+    int32_t value;
+    if (!ParseInt(s, &value)) return std::nullopt;
+    return value;
+}
+
+std::optional<bool> parseBool(const std::string& s) {
+    if (s == "true") return true;
+    if (s == "false") return false;
+    return std::nullopt;
+}
+
+// "[a, b]" as formatted for a vector.
+std::optional<std::vector<std::string>> parseList(const std::string& s) {
+    if (s.size() < 2 || s.front() != '[' || s.back() != ']') return std::nullopt;
+    return splitTopLevel(std::string_view(s).substr(1, s.size() - 2));
+}
+
+// "Name{field: value, ...}" as formatted for a parcelable.
+std::optional<std::map<std::string, std::string>> parseParcel(const std::string& s) {
+    const size_t open = s.find('{');
+    if (open == std::string::npos || s.back() != '}') return std::nullopt;
+    std::map<std::string, std::string> fields;
+    for (const std::string& field :
+         splitTopLevel(std::string_view(s).substr(open + 1, s.size() - open - 2))) {
+        const size_t colon = field.find(':');
+        if (colon == std::string::npos) return std::nullopt;
+        fields[trim(field.substr(0, colon))] = trim(field.substr(colon + 1));
+    }
+    return fields;
+}
+
+// AIDL enums are formatted by name.
+template <typename Enum>
+std::optional<Enum> parseEnum(const std::string& s) {
+    for (const Enum value : android::enum_range<Enum>()) {
+        if (toString(value) == s || std::to_string(static_cast<int>(value)) == s) return value;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::vector<UidRangeParcel>> parseUidRanges(const std::string& s) {
+    const auto list = parseList(s);
+    if (!list) return std::nullopt;
+    std::vector<UidRangeParcel> ranges;
+    for (const std::string& item : *list) {
+        const auto fields = parseParcel(item);
+        if (!fields) return std::nullopt;
+        const auto start = parseInt((*fields)["start"]);
+        const auto stop = parseInt((*fields)["stop"]);
+        if (!start || !stop) return std::nullopt;
+        UidRangeParcel range;
+        range.start = *start;
+        range.stop = *stop;
+        ranges.push_back(range);
+    }
+    return ranges;
+}
+
+// Runs the calls of one trace against netd.
+class Replay {
+  public:
+    using Args = BinderCallTrace::Args;
+    // Returns nullopt if the call cannot be replayed.
+    using Handler = std::function<std::optional<Status>(Replay*, const Args&)>;
+
+    Replay(sp<INetd> netd, std::vector<TunInterface>* tuns) : mNetd(netd), mTuns(tuns) {}
+
+    std::optional<Status> call(const BinderCallTrace::Call& call) {
+        const auto& all = handlers();
+        const auto it = all.find(call.method);
+        if (it == all.end()) return std::nullopt;
+        return it->second(this, call.args);
+    }
+
+    // Undoes what the calls so far set up, most recent first. Errors are ignored: the trace may
+    // already have undone some of it itself.
+    void undo() {
+        for (auto it = mUndo.rbegin(); it != mUndo.rend(); ++it) (*it)();
+        mUndo.clear();
+        mInterfaces.clear();
+        mNetIds.clear();
+    }
+
+  private:
+    static const std::map<std::string, Handler>& handlers();
+
+    // The tun interface standing in for |name|, or nullopt if there are no more of them.
+    std::optional<std::string> iface(const std::string& name) {
+        if (name.empty()) return name;
+        if (const auto it = mInterfaces.find(name); it != mInterfaces.end()) return it->second;
+        if (mInterfaces.size() == mTuns->size()) return std::nullopt;
+        return mInterfaces[name] = (*mTuns)[mInterfaces.size()].name();
+    }
+
+    std::optional<int32_t> netId(const std::string& s) {
+        const auto id = parseInt(s);
+        if (!id || *id < kFirstSystemNetId) return id;
+        if (const auto it = mNetIds.find(*id); it != mNetIds.end()) return it->second;
+        return mNetIds[*id] = kFirstTestNetId + static_cast<int32_t>(mNetIds.size());
+    }
+
+    std::optional<RouteInfoParcel> route(const std::string& s) {
+        auto fields = parseParcel(s);
+        if (!fields) return std::nullopt;
+        const auto ifName = iface((*fields)["ifName"]);
+        const auto mtu = parseInt((*fields)["mtu"]);
+        if (!ifName || !mtu) return std::nullopt;
+        RouteInfoParcel parcel;
+        parcel.destination = (*fields)["destination"];
+        parcel.ifName = *ifName;
+        parcel.nextHop = (*fields)["nextHop"];
+        parcel.mtu = *mtu;
+        return parcel;
+    }
+
+    std::optional<NativeUidRangeConfig> uidRangeConfig(const std::string& s) {
+        auto fields = parseParcel(s);
+        if (!fields) return std::nullopt;
+        const auto id = netId((*fields)["netId"]);
+        const auto ranges = parseUidRanges((*fields)["uidRanges"]);
+        const auto subPriority = parseInt((*fields)["subPriority"]);
+        if (!id || !ranges || !subPriority) return std::nullopt;
+        NativeUidRangeConfig config;
+        config.netId = *id;
+        config.uidRanges = *ranges;
+        config.subPriority = *subPriority;
+        return config;
+    }
+
+    const sp<INetd> mNetd;
+    std::vector<TunInterface>* const mTuns;
+    std::map<std::string, std::string> mInterfaces;
+    std::map<int32_t, int32_t> mNetIds;
+    std::vector<std::function<void()>> mUndo;
+};
+
+const std::map<std::string, Replay::Handler>& Replay::handlers() {
+    using Args = Replay::Args;
+    // The calls of |method| that take a netId and an interface.
+    const auto netIdAndIface = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 2) return std::nullopt;
+            const auto id = r->netId(a[0].second);
+            const auto ifName = r->iface(a[1].second);
+            if (!id || !ifName) return std::nullopt;
+            return ((*r->mNetd).*method)(*id, *ifName);
+        };
+    };
+    const auto route = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 4) return std::nullopt;
+            const auto id = r->netId(a[0].second);
+            const auto ifName = r->iface(a[1].second);
+            if (!id || !ifName) return std::nullopt;
+            return ((*r->mNetd).*method)(*id, *ifName, a[2].second, a[3].second);
+        };
+    };
+    const auto routeParcel = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 2) return std::nullopt;
+            const auto id = r->netId(a[0].second);
+            const auto parcel = r->route(a[1].second);
+            if (!id || !parcel) return std::nullopt;
+            return ((*r->mNetd).*method)(*id, *parcel);
+        };
+    };
+    const auto uidRanges = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 2) return std::nullopt;
+            const auto id = r->netId(a[0].second);
+            const auto ranges = parseUidRanges(a[1].second);
+            if (!id || !ranges) return std::nullopt;
+            return ((*r->mNetd).*method)(*id, *ranges);
+        };
+    };
+    const auto uidRangesParcel = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 1) return std::nullopt;
+            const auto config = r->uidRangeConfig(a[0].second);
+            if (!config) return std::nullopt;
+            return ((*r->mNetd).*method)(*config);
+        };
+    };
+    const auto ifacePair = [](auto method) -> Handler {
+        return [method](Replay* r, const Args& a) -> std::optional<Status> {
+            if (a.size() != 2) return std::nullopt;
+            const auto from = r->iface(a[0].second);
+            const auto to = r->iface(a[1].second);
+            if (!from || !to) return std::nullopt;
+            return ((*r->mNetd).*method)(*from, *to);
+        };
+    };
+
+    static const auto* const sHandlers = new std::map<std::string, Handler>{
+            {"networkCreate",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 auto fields = parseParcel(a[0].second);
+                 if (!fields) return std::nullopt;
+                 const auto id = r->netId((*fields)["netId"]);
+                 const auto type = parseEnum<NativeNetworkType>((*fields)["networkType"]);
+                 const auto permission = parseInt((*fields)["permission"]);
+                 const auto secure = parseBool((*fields)["secure"]);
+                 const auto vpnType = parseEnum<NativeVpnType>((*fields)["vpnType"]);
+                 const auto excludeLocalRoutes = parseBool((*fields)["excludeLocalRoutes"]);
+                 if (!id || !type || !permission || !secure || !vpnType || !excludeLocalRoutes) {
+                     return std::nullopt;
+                 }
+                 NativeNetworkConfig config;
+                 config.netId = *id;
+                 config.networkType = *type;
+                 config.permission = *permission;
+                 config.secure = *secure;
+                 config.vpnType = *vpnType;
+                 config.excludeLocalRoutes = *excludeLocalRoutes;
+                 r->mUndo.push_back([netd = r->mNetd, id = *id] { netd->networkDestroy(id); });
+                 return r->mNetd->networkCreate(config);
+             }},
+            {"networkDestroy",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 const auto id = r->netId(a[0].second);
+                 if (!id) return std::nullopt;
+                 return r->mNetd->networkDestroy(*id);
+             }},
+            {"networkAddInterface", netIdAndIface(&INetd::networkAddInterface)},
+            {"networkRemoveInterface", netIdAndIface(&INetd::networkRemoveInterface)},
+            {"networkAddRoute", route(&INetd::networkAddRoute)},
+            {"networkRemoveRoute", route(&INetd::networkRemoveRoute)},
+            {"networkAddRouteParcel", routeParcel(&INetd::networkAddRouteParcel)},
+            {"networkUpdateRouteParcel", routeParcel(&INetd::networkUpdateRouteParcel)},
+            {"networkRemoveRouteParcel", routeParcel(&INetd::networkRemoveRouteParcel)},
+            {"networkAddUidRanges", uidRanges(&INetd::networkAddUidRanges)},
+            {"networkRemoveUidRanges", uidRanges(&INetd::networkRemoveUidRanges)},
+            {"networkAddUidRangesParcel", uidRangesParcel(&INetd::networkAddUidRangesParcel)},
+            {"networkRemoveUidRangesParcel",
+             uidRangesParcel(&INetd::networkRemoveUidRangesParcel)},
+            {"networkSetDefault",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 const auto id = r->netId(a[0].second);
+                 if (!id) return std::nullopt;
+                 return r->mNetd->networkSetDefault(*id);
+             }},
+            {"networkClearDefault",
+             [](Replay* r, const Args&) -> std::optional<Status> {
+                 return r->mNetd->networkClearDefault();
+             }},
+            {"networkSetPermissionForNetwork",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 2) return std::nullopt;
+                 const auto id = r->netId(a[0].second);
+                 const auto permission = parseInt(a[1].second);
+                 if (!id || !permission) return std::nullopt;
+                 return r->mNetd->networkSetPermissionForNetwork(*id, *permission);
+             }},
+            {"networkRejectNonSecureVpn",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 2) return std::nullopt;
+                 const auto add = parseBool(a[0].second);
+                 const auto ranges = parseUidRanges(a[1].second);
+                 if (!add || !ranges) return std::nullopt;
+                 r->mUndo.push_back([netd = r->mNetd, add = *add, ranges = *ranges] {
+                     netd->networkRejectNonSecureVpn(!add, ranges);
+                 });
+                 return r->mNetd->networkRejectNonSecureVpn(*add, *ranges);
+             }},
+            {"interfaceSetMtu",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 2) return std::nullopt;
+                 const auto ifName = r->iface(a[0].second);
+                 const auto mtu = parseInt(a[1].second);
+                 if (!ifName || !mtu) return std::nullopt;
+                 return r->mNetd->interfaceSetMtu(*ifName, *mtu);
+             }},
+            {"interfaceAddAddress",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 3) return std::nullopt;
+                 const auto ifName = r->iface(a[0].second);
+                 const auto prefixLength = parseInt(a[2].second);
+                 if (!ifName || !prefixLength) return std::nullopt;
+                 r->mUndo.push_back([netd = r->mNetd, ifName = *ifName, addr = a[1].second,
+                                     prefixLength = *prefixLength] {
+                     netd->interfaceDelAddress(ifName, addr, prefixLength);
+                 });
+                 return r->mNetd->interfaceAddAddress(*ifName, a[1].second, *prefixLength);
+             }},
+            {"interfaceDelAddress",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 3) return std::nullopt;
+                 const auto ifName = r->iface(a[0].second);
+                 const auto prefixLength = parseInt(a[2].second);
+                 if (!ifName || !prefixLength) return std::nullopt;
+                 return r->mNetd->interfaceDelAddress(*ifName, a[1].second, *prefixLength);
+             }},
+            {"tetherInterfaceAdd",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 const auto ifName = r->iface(a[0].second);
+                 if (!ifName) return std::nullopt;
+                 r->mUndo.push_back([netd = r->mNetd, ifName = *ifName] {
+                     netd->tetherInterfaceRemove(ifName);
+                 });
+                 return r->mNetd->tetherInterfaceAdd(*ifName);
+             }},
+            {"tetherInterfaceRemove",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 const auto ifName = r->iface(a[0].second);
+                 if (!ifName) return std::nullopt;
+                 return r->mNetd->tetherInterfaceRemove(*ifName);
+             }},
+            {"tetherAddForward",
+             [ifacePair](Replay* r, const Args& a) -> std::optional<Status> {
+                 const auto status = ifacePair(&INetd::tetherAddForward)(r, a);
+                 if (status) {
+                     r->mUndo.push_back([netd = r->mNetd, in = *r->iface(a[0].second),
+                                         out = *r->iface(a[1].second)] {
+                         netd->tetherRemoveForward(in, out);
+                     });
+                 }
+                 return status;
+             }},
+            {"tetherRemoveForward", ifacePair(&INetd::tetherRemoveForward)},
+            {"ipfwdAddInterfaceForward",
+             [ifacePair](Replay* r, const Args& a) -> std::optional<Status> {
+                 const auto status = ifacePair(&INetd::ipfwdAddInterfaceForward)(r, a);
+                 if (status) {
+                     r->mUndo.push_back([netd = r->mNetd, from = *r->iface(a[0].second),
+                                         to = *r->iface(a[1].second)] {
+                         netd->ipfwdRemoveInterfaceForward(from, to);
+                     });
+                 }
+                 return status;
+             }},
+            {"ipfwdRemoveInterfaceForward", ifacePair(&INetd::ipfwdRemoveInterfaceForward)},
+            // Requesters get a prefix, so that the replay cannot turn off forwarding that
+            // something else on the device asked for.
+            {"ipfwdEnableForwarding",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 const std::string requester = "replay_" + a[0].second;
+                 r->mUndo.push_back([netd = r->mNetd, requester] {
+                     netd->ipfwdDisableForwarding(requester);
+                 });
+                 return r->mNetd->ipfwdEnableForwarding(requester);
+             }},
+            {"ipfwdDisableForwarding",
+             [](Replay* r, const Args& a) -> std::optional<Status> {
+                 if (a.size() != 1) return std::nullopt;
+                 return r->mNetd->ipfwdDisableForwarding("replay_" + a[0].second);
+             }},
+    };
+    return *sHandlers;
+}
+
+std::vector<BinderCallTrace::Call> parseTrace(const std::string& text) {
+    std::vector<BinderCallTrace::Call> calls;
+    for (const std::string& line : android::base::Split(text, "\n")) {
+        if (auto call = BinderCallTrace::parseCall(line)) calls.push_back(std::move(*call));
+    }
+    return calls;
+}
+
+void replayTrace(benchmark::State& state, const std::vector<BinderCallTrace::Call>& calls) {
+    sp<INetd> netd;
+    sp<IServiceManager> sm = android::defaultServiceManager();
+    if (sp<IBinder> binder = sm->getService(String16("netd")); binder != nullptr) {
+        netd = android::interface_cast<INetd>(binder);
+    }
+    if (netd == nullptr) {
+        state.SkipWithError("Cannot get the netd binder service");
+        return;
+    }
+    std::vector<TunInterface> tuns(kMaxInterfaces);
+    for (TunInterface& tun : tuns) {
+        if (tun.init() != 0) {
+            state.SkipWithError("Cannot create the tun interfaces");
+            return;
+        }
+    }
+    int32_t defaultNetId = 0;
+    if (!netd->networkGetDefault(&defaultNetId).isOk()) {
+        state.SkipWithError("Cannot get the default network");
+        return;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    std::map<std::string, std::pair<Clock::duration, int64_t>> perMethod;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    Replay replay(netd, &tuns);
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        Clock::duration total{};
+        for (const auto& call : calls) {
+            const auto start = Clock::now();
+            const std::optional<Status> status = replay.call(call);
+            const auto elapsed = Clock::now() - start;
+            if (!status) {
+                skipped++;
+                continue;
+            }
+            if (!status->isOk()) failed++;
+            total += elapsed;
+            auto& [methodTotal, count] = perMethod[call.method];
+            methodTotal += elapsed;
+            count++;
+        }
+        state.SetIterationTime(std::chrono::duration<double>(total).count());
+
+        replay.undo();
+        if (defaultNetId == 0) {
+            netd->networkClearDefault();
+        } else {
+            netd->networkSetDefault(defaultNetId);
+        }
+    }
+
+    for (const auto& [method, timing] : perMethod) {
+        const auto& [methodTotal, count] = timing;
+        state.counters[method + "_us"] =
+                std::chrono::duration<double, std::micro>(methodTotal).count() / count;
+    }
+    state.counters["skipped"] = benchmark::Counter(skipped, benchmark::Counter::kAvgIterations);
+    state.counters["failed"] = benchmark::Counter(failed, benchmark::Counter::kAvgIterations);
+}
+
+void registerTrace(const std::string& name, const std::string& text) {
+    benchmark::RegisterBenchmark(("replay/" + name).c_str(),
+                                 [calls = parseTrace(text)](benchmark::State& state) {
+                                     replayTrace(state, calls);
+                                 })
+            ->UseManualTime()
+            ->Unit(benchmark::kMillisecond);
+}
+
+const bool sRegistered = [] {
+    for (const auto& [name, text] : kBuiltInTraces) registerTrace(name, text);
+
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(TRACE_DIR), closedir);
+    if (dir == nullptr) return true;
+    while (const dirent* entry = readdir(dir.get())) {
+        const std::string fileName = entry->d_name;
+        if (!android::base::EndsWith(fileName, TRACE_SUFFIX)) continue;
+        std::string text;
+        if (!android::base::ReadFileToString(StringPrintf("%s/%s", TRACE_DIR, fileName.c_str()),
+                                             &text)) {
+            continue;
+        }
+        registerTrace(fileName.substr(0, fileName.size() - strlen(TRACE_SUFFIX)), text);
+    }
+    return true;
+}();
+
+}  // namespace
@@ -14,8 +14,21 @@
  * limitations under the License.
  */
 
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <benchmark/benchmark.h>
 
 #define BPF_MAP_MAKE_VISIBLE_FOR_TESTING
@@ -25,6 +38,7 @@ constexpr uint32_t TEST_MAP_SIZE = 10000;
 
 using android::base::Result;
 using android::base::StringPrintf;
+using android::base::unique_fd;
 using android::bpf::BpfMap;
 
 class BpfBenchMark : public ::benchmark::Fixture {
@@ -74,11 +88,295 @@ BENCHMARK_DEFINE_F(BpfBenchMark, WaitForRcu)(benchmark::State& state) {
     }
 }
 
+namespace {
+
+// The benchmarks below talk to the kernel directly, because BpfMap has no batch operations and
+// assumes that values are the same size in the kernel and in userspace, which is not the case
+// for per-CPU maps.
+
+int bpfCmd(bpf_cmd cmd, bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr)) == -1 ? -errno : 0;
+}
+
+unique_fd createMap(bpf_map_type type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+                    uint32_t flags) {
+    bpf_attr attr = {};
+    attr.map_type = type;
+    attr.key_size = keySize;
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    attr.map_flags = flags;
+    return unique_fd(syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr)));
+}
+
+int updateElem(int fd, const void* key, const void* value, uint64_t flags) {
+    bpf_attr attr = {};
+    attr.map_fd = fd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    attr.value = reinterpret_cast<uint64_t>(value);
+    attr.flags = flags;
+    return bpfCmd(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int lookupElem(int fd, const void* key, void* value) {
+    bpf_attr attr = {};
+    attr.map_fd = fd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    attr.value = reinterpret_cast<uint64_t>(value);
+    return bpfCmd(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+int getNextKey(int fd, const void* key, void* nextKey) {
+    bpf_attr attr = {};
+    attr.map_fd = fd;
+    attr.key = reinterpret_cast<uint64_t>(key);
+    attr.next_key = reinterpret_cast<uint64_t>(nextKey);
+    return bpfCmd(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+// The number of values in each element of a per-CPU map, as the kernel counts them.
+uint32_t possibleCpus() {
+    static const uint32_t count = [] {
+        std::string possible;
+        if (!android::base::ReadFileToString("/sys/devices/system/cpu/possible", &possible)) {
+            return 1U;
+        }
+        uint32_t total = 0;
+        for (const std::string& range : android::base::Split(android::base::Trim(possible), ",")) {
+            const std::vector<std::string> bounds = android::base::Split(range, "-");
+            uint32_t first, last;
+            if (!android::base::ParseUint(bounds[0], &first)) return 1U;
+            if (!android::base::ParseUint(bounds.back(), &last)) return 1U;
+            total += last - first + 1;
+        }
+        return std::max(total, 1U);
+    }();
+    return count;
+}
+
+void skipWithErrno(benchmark::State& state, const char* what, int ret) {
+    state.SkipWithError(StringPrintf("%s failed: %s", what, strerror(-ret)).c_str());
+}
+
+// Fills a uint32_t -> uint64_t hash map with keys 0 to |size| - 1.
+bool fillHashMap(int fd, uint32_t size) {
+    for (uint32_t key = 0; key < size; key++) {
+        const uint64_t value = key;
+        if (updateElem(fd, &key, &value, BPF_ANY)) return false;
+    }
+    return true;
+}
+
+// Updates every element of a map of |state.range(0)| elements, with one BPF_MAP_UPDATE_ELEM
+// per element or with a single BPF_MAP_UPDATE_BATCH (Linux 5.6+).
+void mapUpdate(benchmark::State& state, bool batch) {
+    const uint32_t size = state.range(0);
+    unique_fd map(createMap(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint64_t), size, 0));
+    if (map == -1) {
+        skipWithErrno(state, "BPF_MAP_CREATE", -errno);
+        return;
+    }
+    std::vector<uint32_t> keys(size);
+    std::vector<uint64_t> values(size);
+    for (uint32_t i = 0; i < size; i++) keys[i] = values[i] = i;
+
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        int ret = 0;
+        if (batch) {
+            bpf_attr attr = {};
+            attr.batch.map_fd = map;
+            attr.batch.keys = reinterpret_cast<uint64_t>(keys.data());
+            attr.batch.values = reinterpret_cast<uint64_t>(values.data());
+            attr.batch.count = size;
+            ret = bpfCmd(BPF_MAP_UPDATE_BATCH, &attr);
+        } else {
+            for (uint32_t i = 0; i < size && ret == 0; i++) {
+                ret = updateElem(map, &keys[i], &values[i], BPF_ANY);
+            }
+        }
+        if (ret) {
+            skipWithErrno(state, batch ? "BPF_MAP_UPDATE_BATCH" : "BPF_MAP_UPDATE_ELEM", ret);
+            return;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+// Reads every element of a map of |state.range(0)| elements, with BPF_MAP_GET_NEXT_KEY and
+// BPF_MAP_LOOKUP_ELEM as BpfMap::iterateWithValue() does, or with BPF_MAP_LOOKUP_BATCH.
+void mapLookup(benchmark::State& state, bool batch) {
+    const uint32_t size = state.range(0);
+    unique_fd map(createMap(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint64_t), size, 0));
+    if (map == -1 || !fillHashMap(map, size)) {
+        skipWithErrno(state, "Creating the map", -errno);
+        return;
+    }
+    std::vector<uint32_t> keys(size);
+    std::vector<uint64_t> values(size);
+
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        uint32_t read = 0;
+        int ret = 0;
+        if (batch) {
+            // The position in the map, opaque to userspace.
+            uint64_t token = 0;
+            bool first = true;
+            while (ret == 0 && read < size) {
+                bpf_attr attr = {};
+                attr.batch.map_fd = map;
+                attr.batch.in_batch = first ? 0 : reinterpret_cast<uint64_t>(&token);
+                attr.batch.out_batch = reinterpret_cast<uint64_t>(&token);
+                attr.batch.keys = reinterpret_cast<uint64_t>(keys.data() + read);
+                attr.batch.values = reinterpret_cast<uint64_t>(values.data() + read);
+                attr.batch.count = size - read;
+                ret = bpfCmd(BPF_MAP_LOOKUP_BATCH, &attr);
+                // -ENOENT marks the end of the map, and still returns the last elements.
+                read += attr.batch.count;
+                first = false;
+            }
+            if (ret == -ENOENT) ret = 0;
+        } else {
+            uint32_t key;
+            ret = getNextKey(map, nullptr, &key);
+            while (ret == 0) {
+                ret = lookupElem(map, &key, &values[read++]);
+                if (ret == 0) ret = getNextKey(map, &key, &key);
+            }
+            if (ret == -ENOENT) ret = 0;
+        }
+        if (ret || read != size) {
+            skipWithErrno(state, batch ? "BPF_MAP_LOOKUP_BATCH" : "Iterating the map",
+                          ret ? ret : -EIO);
+            return;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+// The map shared by the threads of the contention benchmarks.
+unique_fd sSharedMap;
+
+// From |state.threads()| threads at once, updates random elements of a map of |state.range(0)|
+// elements, as BPF programs and netd do for counters. For a per-CPU map, every update from
+// userspace writes the values of all CPUs.
+void mapUpdateContended(benchmark::State& state, bpf_map_type type) {
+    const uint32_t size = state.range(0);
+    const bool perCpu = type == BPF_MAP_TYPE_PERCPU_HASH;
+    const uint32_t valueSize = sizeof(uint64_t);
+    // Thread 0 creates sSharedMap before the timed loop and closes it after. This is safe without
+    // a lock because all the threads wait on a barrier as they enter and leave the loop, so none
+    // of them reads sSharedMap before it is set up or after it is reset.
+    if (state.thread_index() == 0) {
+        sSharedMap = createMap(type, sizeof(uint32_t), valueSize, size, 0);
+        std::vector<uint64_t> value(perCpu ? possibleCpus() : 1);
+        for (uint32_t key = 0; key < size && sSharedMap != -1; key++) {
+            if (updateElem(sSharedMap, &key, value.data(), BPF_ANY)) sSharedMap.reset();
+        }
+    }
+
+    std::vector<uint64_t> value(perCpu ? possibleCpus() : 1, state.thread_index());
+    uint32_t seed = state.thread_index() + 1;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        if (sSharedMap == -1) {
+            state.SkipWithError("Cannot create the map");
+            break;
+        }
+        // xorshift, so that the random numbers cost nothing next to the syscall.
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        const uint32_t key = seed % size;
+        if (int ret = updateElem(sSharedMap, &key, value.data(), BPF_EXIST)) {
+            skipWithErrno(state, "BPF_MAP_UPDATE_ELEM", ret);
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    // Every thread has left the loop, see above.
+    if (state.thread_index() == 0) sSharedMap.reset();
+}
+
+// The key of an IPv6 LPM trie.
+struct LpmKey {
+    uint32_t prefixLen;
+    uint8_t addr[16];
+};
+
+// Looks up an address in an LPM trie of |state.range(0)| IPv6 /64 prefixes, as a lookup by
+// destination or source network would.
+void lpmTrieLookup(benchmark::State& state) {
+    const uint32_t size = state.range(0);
+    // LPM tries must be created without preallocation.
+    unique_fd map(createMap(BPF_MAP_TYPE_LPM_TRIE, sizeof(LpmKey), sizeof(uint64_t), size,
+                            BPF_F_NO_PREALLOC));
+    if (map == -1) {
+        skipWithErrno(state, "BPF_MAP_CREATE", -errno);
+        return;
+    }
+    // 2001:db8:<i>::/64, with i spread over 32 bits.
+    LpmKey key = {.prefixLen = 64, .addr = {0x20, 0x01, 0x0d, 0xb8}};
+    for (uint32_t i = 0; i < size; i++) {
+        const uint32_t subnet = i * 2654435761U;
+        memcpy(key.addr + 4, &subnet, sizeof(subnet));
+        const uint64_t value = i;
+        if (int ret = updateElem(map, &key, &value, BPF_ANY)) {
+            skipWithErrno(state, "BPF_MAP_UPDATE_ELEM", ret);
+            return;
+        }
+    }
+
+    LpmKey address = key;
+    address.prefixLen = 128;
+    address.addr[15] = 1;
+    uint64_t value;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        if (int ret = lookupElem(map, &address, &value)) {
+            skipWithErrno(state, "BPF_MAP_LOOKUP_ELEM", ret);
+            return;
+        }
+    }
+}
+
+void mapSizes(benchmark::internal::Benchmark* b) {
+    b->RangeMultiplier(10)->Range(1, 100000);
+}
+
+}  // namespace
+
+static void MapUpdateLoop(benchmark::State& state) {
+    mapUpdate(state, false);
+}
+static void MapUpdateBatch(benchmark::State& state) {
+    mapUpdate(state, true);
+}
+static void MapLookupLoop(benchmark::State& state) {
+    mapLookup(state, false);
+}
+static void MapLookupBatch(benchmark::State& state) {
+    mapLookup(state, true);
+}
+static void HashMapUpdateContended(benchmark::State& state) {
+    mapUpdateContended(state, BPF_MAP_TYPE_HASH);
+}
+static void PerCpuHashMapUpdateContended(benchmark::State& state) {
+    mapUpdateContended(state, BPF_MAP_TYPE_PERCPU_HASH);
+}
+static void LpmTrieLookup(benchmark::State& state) {
+    lpmTrieLookup(state);
+}
+
 namespace {
 BENCHMARK_REGISTER_F(BpfBenchMark, MapUpdateEntry)->Arg(1);
 BENCHMARK_REGISTER_F(BpfBenchMark, MapWriteNewEntry)->Arg(1);
 BENCHMARK_REGISTER_F(BpfBenchMark, MapDeleteAddEntry)->Arg(1);
 BENCHMARK_REGISTER_F(BpfBenchMark, WaitForRcu)->Arg(1);
+BENCHMARK(MapUpdateLoop)->Apply(mapSizes);
+BENCHMARK(MapUpdateBatch)->Apply(mapSizes);
+BENCHMARK(MapLookupLoop)->Apply(mapSizes);
+BENCHMARK(MapLookupBatch)->Apply(mapSizes);
+BENCHMARK(HashMapUpdateContended)->Apply(mapSizes)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(PerCpuHashMapUpdateContended)->Apply(mapSizes)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(LpmTrieLookup)->Apply(mapSizes);
 }  // namespace
 
 BENCHMARK_MAIN();
@@ -55,6 +55,28 @@
  *  - label: a manually-recorded time giving the 90th-percentile value of real_time over all
  *           individual runs. Should be compared to real_time.
  *
+ * FwmarkServer scenarios
+ * ======================
+ *
+ * The tests named fwmark_* measure socket() + connect() + accept4() over IPv6 loopback in the
+ * situations where FwmarkServer has the most work to do, with one and with many threads:
+ *
+ *  - fwmark_vpn_bypassable, fwmark_vpn_secure: a VPN covers the calling UID. The argument is
+ *    the number of UID ranges of the VPN.
+ *
+ *  - fwmark_vpn_protected: as fwmark_vpn_secure, but each socket is protected from the VPN
+ *    before it connects.
+ *
+ *  - fwmark_explicit_network: each socket is bound to a network with setNetworkForSocket()
+ *    before it connects.
+ *
+ *  - fwmark_udp: socket() + connect() of a UDP socket, with no accept.
+ *
+ *  - fwmark_accept: only the accept4() call, which sends ON_ACCEPT, is timed.
+ *
+ * The networks are created through the netd binder interface on tun interfaces, and destroyed
+ * when the test ends. The benchmark runs as root, so root's traffic goes through the test VPN
+ * while the VPN tests run. Loopback traffic is unaffected.
  */
 
 #include <arpa/inet.h>
@@ -68,15 +90,30 @@
 #include <thread>
 
 #include <android-base/stringprintf.h>
+#include <android/net/INetd.h>
 #include <benchmark/benchmark.h>
+#include <binder/IServiceManager.h>
 #include <log/log.h>
 #include <netdutils/Stopwatch.h>
 #include <utils/StrongPointer.h>
 
 #include "FwmarkClient.h"
+#include "NetdClient.h"
 #include "SockDiag.h"
+#include "tun_interface.h"
 
+using android::IBinder;
+using android::IServiceManager;
+using android::sp;
+using android::String16;
 using android::base::StringPrintf;
+using android::binder::Status;
+using android::net::INetd;
+using android::net::NativeNetworkConfig;
+using android::net::NativeNetworkType;
+using android::net::NativeVpnType;
+using android::net::TunInterface;
+using android::net::UidRangeParcel;
 using android::netdutils::Stopwatch;
 
 static int bindAndListen(int s) {
@@ -242,3 +279,220 @@ static void ipv6_high_load(::benchmark::State& state) {
     run(ipv6_loopback, state, false);
 }
 BENCHMARK(ipv6_high_load)->ThreadRange(MIN_THREADS, MAX_THREADS)->MinTime(MIN_TIME)->UseRealTime();
+
+enum class Scenario {
+    VPN_BYPASSABLE,
+    VPN_SECURE,
+    VPN_PROTECTED,
+    EXPLICIT_NETWORK,
+    UDP,
+    ACCEPT,
+};
+
+constexpr int MAX_SCENARIO_THREADS = 8;
+constexpr unsigned SCENARIO_PHYSICAL_NET_ID = 65500;
+constexpr unsigned SCENARIO_VPN_NET_ID = 65501;
+
+// The networks of one FwmarkServer scenario, set up by the first thread before the test starts
+// and torn down by it after the test ends.
+class ScenarioNetworks {
+  public:
+    // Returns an error message, or an empty string on success.
+    std::string setUp(Scenario scenario, int uidRanges) {
+        sp<IServiceManager> sm = android::defaultServiceManager();
+        if (sp<IBinder> binder = sm->getService(String16("netd")); binder != nullptr) {
+            mNetd = android::interface_cast<INetd>(binder);
+        }
+        if (mNetd == nullptr) return "Cannot get the netd binder service";
+
+        switch (scenario) {
+            case Scenario::VPN_BYPASSABLE:
+            case Scenario::VPN_SECURE:
+            case Scenario::VPN_PROTECTED:
+                return createVpn(scenario != Scenario::VPN_BYPASSABLE, uidRanges);
+            case Scenario::EXPLICIT_NETWORK:
+                return createNetwork(SCENARIO_PHYSICAL_NET_ID, NativeNetworkType::PHYSICAL, false,
+                                     &mPhysical);
+            case Scenario::UDP:
+            case Scenario::ACCEPT:
+                break;
+        }
+        return "";
+    }
+
+    void tearDown() {
+        for (unsigned netId : mNetIds) mNetd->networkDestroy(netId);
+        mNetIds.clear();
+        mPhysical.destroy();
+        mVpn.destroy();
+    }
+
+  private:
+    std::string createNetwork(unsigned netId, NativeNetworkType type, bool secure,
+                              TunInterface* tun) {
+        if (tun->init() != 0) return "Cannot create a tun interface";
+        NativeNetworkConfig config;
+        config.netId = netId;
+        config.networkType = type;
+        config.secure = secure;
+        config.vpnType = NativeVpnType::SERVICE;
+        Status status = mNetd->networkCreate(config);
+        if (status.isOk()) {
+            mNetIds.push_back(netId);
+            status = mNetd->networkAddInterface(netId, tun->name());
+        }
+        return status.isOk() ? "" : status.toString8().c_str();
+    }
+
+    // A VPN with |count| UID ranges, the first of which covers the calling UID.
+    std::string createVpn(bool secure, int count) {
+        std::string error =
+                createNetwork(SCENARIO_VPN_NET_ID, NativeNetworkType::VIRTUAL, secure, &mVpn);
+        if (!error.empty()) return error;
+        std::vector<UidRangeParcel> ranges(count);
+        ranges[0].start = ranges[0].stop = getuid();
+        for (int i = 1; i < count; i++) {
+            ranges[i].start = i * 100000 + 10000;
+            ranges[i].stop = i * 100000 + 19999;
+        }
+        const Status status = mNetd->networkAddUidRanges(SCENARIO_VPN_NET_ID, ranges);
+        return status.isOk() ? "" : status.toString8().c_str();
+    }
+
+    sp<INetd> mNetd;
+    TunInterface mPhysical;
+    TunInterface mVpn;
+    std::vector<unsigned> mNetIds;
+};
+
+static ScenarioNetworks sScenarioNetworks;
+
+static void fwmark_scenario(::benchmark::State& state, const Scenario scenario) {
+    // Only the first thread sets up and tears down the networks. The other threads wait for it
+    // at the start and at the end of the loop.
+    if (state.thread_index == 0) {
+        const std::string error = sScenarioNetworks.setUp(scenario, state.range(0));
+        if (!error.empty()) {
+            sScenarioNetworks.tearDown();
+            state.SkipWithError(error.c_str());
+        }
+    }
+
+    const int type = scenario == Scenario::UDP ? SOCK_DGRAM : SOCK_STREAM;
+    const int listensocket = socket(AF_INET6, type | SOCK_CLOEXEC, 0);
+    sockaddr_in6 server = {.sin6_family = AF_INET6, .sin6_addr = in6addr_loopback};
+    socklen_t serverlen = sizeof(server);
+    if (bind(listensocket, (sockaddr*) &server, sizeof(server)) ||
+        getsockname(listensocket, (sockaddr*) &server, &serverlen) ||
+        (type == SOCK_STREAM && listen(listensocket, 1))) {
+        state.SkipWithError("Unable to bind server socket");
+    }
+
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        int sock = socket(AF_INET6, type | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            state.SkipWithError(StringPrintf("socket() failed with errno=%d", errno).c_str());
+            break;
+        }
+        int error = 0;
+        if (scenario == Scenario::VPN_PROTECTED) error = protectFromVpn(sock);
+        if (scenario == Scenario::EXPLICIT_NETWORK) {
+            error = setNetworkForSocket(SCENARIO_PHYSICAL_NET_ID, sock);
+        }
+        if (error) {
+            state.SkipWithError(StringPrintf("Selecting the network failed with %d", error).c_str());
+            close(sock);
+            break;
+        }
+
+        if (connect(sock, (sockaddr*) &server, sizeof(server))) {
+            state.SkipWithError(StringPrintf("connect() failed with errno=%d", errno).c_str());
+            close(sock);
+            break;
+        }
+        if (type == SOCK_DGRAM) {
+            close(sock);
+            continue;
+        }
+
+        const Stopwatch stopwatch;
+        int accepted = accept4(listensocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (scenario == Scenario::ACCEPT) {
+            state.SetIterationTime(static_cast<double>(stopwatch.timeTakenUs()) / 1.0e6L);
+        }
+        if (accepted < 0) {
+            state.SkipWithError(StringPrintf("accept() failed with errno=%d", errno).c_str());
+            close(sock);
+            break;
+        }
+
+        close(accepted);
+        close(sock);
+    }
+    close(listensocket);
+
+    if (state.thread_index == 0) sScenarioNetworks.tearDown();
+}
+
+static void fwmark_vpn_bypassable(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::VPN_BYPASSABLE);
+}
+BENCHMARK(fwmark_vpn_bypassable)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseRealTime();
+
+static void fwmark_vpn_secure(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::VPN_SECURE);
+}
+BENCHMARK(fwmark_vpn_secure)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseRealTime();
+
+static void fwmark_vpn_protected(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::VPN_PROTECTED);
+}
+BENCHMARK(fwmark_vpn_protected)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseRealTime();
+
+static void fwmark_explicit_network(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::EXPLICIT_NETWORK);
+}
+BENCHMARK(fwmark_explicit_network)
+        ->Arg(0)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseRealTime();
+
+static void fwmark_udp(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::UDP);
+}
+BENCHMARK(fwmark_udp)
+        ->Arg(0)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseRealTime();
+
+static void fwmark_accept(::benchmark::State& state) {
+    fwmark_scenario(state, Scenario::ACCEPT);
+}
+BENCHMARK(fwmark_accept)
+        ->Arg(0)
+        ->Threads(MIN_THREADS)
+        ->Threads(MAX_SCENARIO_THREADS)
+        ->MinTime(MIN_TIME)
+        ->UseManualTime();
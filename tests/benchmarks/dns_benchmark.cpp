@@ -32,14 +32,30 @@
  *  - iterations: total number of runs finished within the time limit. Higher is better. This is
  *                roughly proportional to MinTime * nThreads / real_time.
  *
+ * Other benchmarks
+ * ================
+ *
+ *  - resnsend: the same lookups made with resNetworkQuery() and resNetworkResult(), which is what
+ *              android_res_nsend() calls. The argument selects a warm cache, where every host has
+ *              been looked up before the test starts, or a cold one, where each query is sent with
+ *              ANDROID_RESOLV_NO_CACHE_LOOKUP and goes to the DNS server.
+ *
+ *  - proxy_connect: only the socket() and connect() to dnsproxyd that dns_open_proxy() makes for
+ *                   every lookup. Subtracting this from the real_time of resnsend with the same
+ *                   number of threads gives the time spent sending the query and processing it.
+ *
  */
 
+#include <arpa/nameser.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <android-base/stringprintf.h>
+#include <android/multinetwork.h>
 #include <benchmark/benchmark.h>
 
 #include "NetdClient.h"
@@ -50,6 +66,8 @@ using android::base::StringPrintf;
 constexpr int MIN_THREADS = 1;
 constexpr int MAX_THREADS = 32;
 
+enum CacheState { WARM, COLD };
+
 class DnsFixture : public ::benchmark::Fixture {
 protected:
     static constexpr unsigned num_hosts = 1000;
@@ -100,6 +118,51 @@ public:
             }
         }
     }
+
+    // Returns the length of the answer, or a negative errno.
+    static int query(const std::string& host, uint32_t flags) {
+        const int fd = resNetworkQuery(NETWORK_UNSPECIFIED, host.c_str(), ns_c_in, ns_t_a, flags);
+        if (fd < 0) return fd;
+        int rcode = 0;
+        uint8_t answer[NS_PACKETSZ];
+        return resNetworkResult(fd, &rcode, answer, sizeof(answer));
+    }
+
+    void benchmarkResNsend(benchmark::State& state) {
+        const auto cache = static_cast<CacheState>(state.range(0));
+        if (cache == WARM) {
+            // Each thread looks up its share of the hosts. The benchmark library waits for all
+            // threads before it starts timing.
+            for (size_t i = state.thread_index; i < getMappings().size(); i += state.threads) {
+                query(getMappings()[i].host, 0);
+            }
+        }
+        const uint32_t flags = cache == COLD ? ANDROID_RESOLV_NO_CACHE_LOOKUP : 0;
+        for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+            const uint32_t ofs = arc4random_uniform(getMappings().size());
+            if (int ret = query(getMappings()[ofs].host, flags); ret < 0) {
+                state.SkipWithError(StringPrintf("resNetworkQuery failed with %d", ret).c_str());
+                break;
+            }
+        }
+    }
+
+    void benchmarkProxyConnect(benchmark::State& state) {
+        const sockaddr_un proxyAddr = {
+                .sun_family = AF_UNIX,
+                .sun_path = "/dev/socket/dnsproxyd",
+        };
+        for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+            const int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (s == -1 || connect(s, (const sockaddr*) &proxyAddr, sizeof(proxyAddr))) {
+                state.SkipWithError(StringPrintf("Cannot connect to dnsproxyd, errno=%d",
+                        errno).c_str());
+                if (s != -1) close(s);
+                break;
+            }
+            close(s);
+        }
+    }
 };
 
 BENCHMARK_DEFINE_F(DnsFixture, getaddrinfo)(benchmark::State& state) {
@@ -108,3 +171,20 @@ BENCHMARK_DEFINE_F(DnsFixture, getaddrinfo)(benchmark::State& state) {
 BENCHMARK_REGISTER_F(DnsFixture, getaddrinfo)
     ->ThreadRange(MIN_THREADS, MAX_THREADS)
     ->UseRealTime();
+
+BENCHMARK_DEFINE_F(DnsFixture, resnsend)(benchmark::State& state) {
+    benchmarkResNsend(state);
+}
+BENCHMARK_REGISTER_F(DnsFixture, resnsend)
+    ->ArgName("cold")
+    ->Arg(WARM)
+    ->Arg(COLD)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
+
+BENCHMARK_DEFINE_F(DnsFixture, proxy_connect)(benchmark::State& state) {
+    benchmarkProxyConnect(state);
+}
+BENCHMARK_REGISTER_F(DnsFixture, proxy_connect)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fwmark_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This set of benchmarks measures the round trip time of each FwmarkCommand sent to the fwmark
+ * server with FwmarkClient::send(), bypassing the libc hooks, at 1 to MAX_THREADS client threads.
+ *
+ * Besides the usual statistics, each benchmark records the following counters, averaged over
+ * threads:
+ *
+ *  - p50_us: the median latency of one command, in microseconds
+ *
+ *  - p99_us: the 99th-percentile latency of one command, in microseconds
+ *
+ * Commands that need privileges the benchmark does not have (e.g. QUERY_USER_ACCESS without
+ * PERMISSION_SYSTEM) are skipped with an error rather than timed.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "FwmarkClient.h"
+#include "FwmarkCommand.h"
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace {
+
+constexpr int MAX_THREADS = 16;
+constexpr double MIN_TIME = 0.5 /* seconds */;
+
+// The latency of the |percentile|th-percentile command in |latenciesNs|, in microseconds.
+double percentileUs(std::vector<int64_t>* latenciesNs, size_t percentile) {
+    if (latenciesNs->empty()) return 0;
+    const size_t index = std::min(latenciesNs->size() * percentile / 100, latenciesNs->size() - 1);
+    std::nth_element(latenciesNs->begin(), latenciesNs->begin() + index, latenciesNs->end());
+    return static_cast<double>((*latenciesNs)[index]) / 1000.0;
+}
+
+void fwmarkCommand(benchmark::State& state, FwmarkCommand::CmdId cmdId) {
+    const unique_fd sock(socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (sock == -1) {
+        state.SkipWithError(StringPrintf("socket() failed with errno=%d", errno).c_str());
+        return;
+    }
+
+    FwmarkCommand command = {cmdId, 0, 0, 0};
+    switch (cmdId) {
+        case FwmarkCommand::QUERY_USER_ACCESS:
+        case FwmarkCommand::SELECT_FOR_USER:
+            command.uid = getuid();
+            break;
+        case FwmarkCommand::TAG_SOCKET:
+            command.uid = getuid();
+            command.trafficCtrlInfo = 0xbe0000;
+            break;
+        default:
+            // SELECT_NETWORK with netId 0 clears the selection, which anyone may do.
+            break;
+    }
+    // The server expects ON_CONNECT and ON_CONNECT_COMPLETE to carry the destination address.
+    const sockaddr_in6 dst = {.sin6_family = AF_INET6, .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+    FwmarkConnectInfo connectInfo(0, 0, reinterpret_cast<const sockaddr*>(&dst));
+    FwmarkConnectInfo* const info = (cmdId == FwmarkCommand::ON_CONNECT ||
+                                     cmdId == FwmarkCommand::ON_CONNECT_COMPLETE)
+                                            ? &connectInfo
+                                            : nullptr;
+
+    std::vector<int64_t> latenciesNs;
+    latenciesNs.reserve(1 << 16);
+
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        const int ret = FwmarkClient().send(&command, sock, info);
+        const auto latency = std::chrono::steady_clock::now() - start;
+        if (ret != 0) {
+            state.SkipWithError(StringPrintf("send() failed with %d", ret).c_str());
+            break;
+        }
+        latenciesNs.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    }
+
+    state.counters["p50_us"] =
+            benchmark::Counter(percentileUs(&latenciesNs, 50), benchmark::Counter::kAvgThreads);
+    state.counters["p99_us"] =
+            benchmark::Counter(percentileUs(&latenciesNs, 99), benchmark::Counter::kAvgThreads);
+}
+
+}  // namespace
+
+#define FWMARK_BENCHMARK(CMD)                                 \
+    BENCHMARK_CAPTURE(fwmarkCommand, CMD, FwmarkCommand::CMD) \
+            ->ThreadRange(1, MAX_THREADS)                     \
+            ->MinTime(MIN_TIME)                               \
+            ->UseRealTime()
+
+FWMARK_BENCHMARK(ON_ACCEPT);
+FWMARK_BENCHMARK(ON_CONNECT);
+FWMARK_BENCHMARK(ON_CONNECT_COMPLETE);
+FWMARK_BENCHMARK(SELECT_NETWORK);
+FWMARK_BENCHMARK(PROTECT_FROM_VPN);
+FWMARK_BENCHMARK(SELECT_FOR_USER);
+FWMARK_BENCHMARK(QUERY_USER_ACCESS);
+FWMARK_BENCHMARK(TAG_SOCKET);
+FWMARK_BENCHMARK(UNTAG_SOCKET);
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ipsec_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This set of benchmarks measures how long netd takes to run the IPsec operations that the
+ * framework's IpSecService makes: allocating an SPI, adding and deleting SAs, adding, updating and
+ * deleting policies, migrating an SA and its policy to new addresses, adding and removing tunnel
+ * interfaces, and rekeying a tunnel. All calls go through the netd binder interface and program
+ * the kernel, so the times include the binder call and the netlink round trips.
+ *
+ * netd programs the network namespace it runs in, so the benchmarks cannot run in a namespace of
+ * their own. Instead, they only use documentation addresses, and an XFRM interface ID and request
+ * ID that nothing else uses, and they remove everything they add.
+ *
+ * Useful measurements
+ * ===================
+ *
+ * All benchmarks are manually timed. Only the operation being measured is timed; setting up its
+ * preconditions and undoing it between iterations is not.
+ *
+ *  - real_time: the mean time taken by one operation.
+ *
+ *  - p50_us, p99_us: the median and 99th-percentile time taken by one operation, in microseconds.
+ *                    The latency distribution is usually spiky, so these say more than the mean.
+ *
+ *  - The benchmark argument is the IP version of the addresses of the SAs and templates.
+ *
+ * rekeyTunnel times a full rekey of the SA pair of a tunnel, in the order IpSecService makes the
+ * calls: allocating the SPI of the new inbound SA, adding the new inbound and outbound SAs,
+ * pointing the outbound policy at the new outbound SA and deleting the two old SAs.
+ */
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <linux/xfrm.h>
+#include <netdutils/Stopwatch.h>
+#include <sys/socket.h>
+
+#include "netd_binder_fixture.h"
+
+using android::net::IpSecMigrateInfoParcel;
+using android::netdutils::Stopwatch;
+
+class IpSecFixture : public NetdBinderFixture {
+  protected:
+    static constexpr int32_t kRequestId = 0x5EC;
+    static constexpr int32_t kInterfaceId = 0xFFF0;
+    static constexpr char kTunnelName[] = "ipsec_bench";
+
+    int mFamily = AF_UNSPEC;
+    std::string mLocal;
+    std::string mRemote;
+    std::string mNewLocal;
+    std::string mNewRemote;
+    int32_t mNextSpi = 0x10000;
+
+  public:
+    void SetUp(const ::benchmark::State& state) override {
+        NetdBinderFixture::SetUp(state);
+
+        if (state.range(0) == 6) {
+            mFamily = AF_INET6;
+            mLocal = "2001:db8::1";
+            mRemote = "2001:db8::2";
+            mNewLocal = "2001:db8::101";
+            mNewRemote = "2001:db8::102";
+        } else {
+            mFamily = AF_INET;
+            mLocal = "192.0.2.1";
+            mRemote = "192.0.2.2";
+            mNewLocal = "192.0.2.101";
+            mNewRemote = "192.0.2.102";
+        }
+    }
+
+    // Runs op once per iteration and reports how long it took. before and after are run, untimed,
+    // on either side of op, to set up what op needs and to undo what it did. All three return
+    // false, after failing the benchmark, on error.
+    void measure(benchmark::State& state, const std::function<bool()>& before,
+                 const std::function<bool()>& op, const std::function<bool()>& after) {
+        std::vector<double> latencies;
+        for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+            if (!before()) break;
+            const Stopwatch stopwatch;
+            const bool ok = op();
+            const double us = stopwatch.timeTakenUs();
+            if (!ok) break;
+            state.SetIterationTime(us / 1.0e6);
+            latencies.push_back(us);
+            if (!after()) break;
+        }
+
+        if (latencies.empty()) return;
+        std::sort(latencies.begin(), latencies.end());
+        state.counters["p50_us"] = latencies[latencies.size() / 2];
+        state.counters["p99_us"] = latencies[latencies.size() * 99 / 100];
+    }
+
+    static bool nothing() { return true; }
+
+    int32_t nextSpi() { return mNextSpi++; }
+
+    // Outbound SAs go from local to remote, and inbound SAs the other way.
+    bool addSa(benchmark::State& state, int32_t spi, bool inbound, const std::string& local,
+               const std::string& remote) {
+        return check(state,
+                     mNetd->ipSecAddSecurityAssociation(
+                             kRequestId, XFRM_MODE_TUNNEL, inbound ? remote : local,
+                             inbound ? local : remote, 0 /* underlyingNetid */, spi,
+                             0 /* markValue */, 0 /* markMask */, "digest_null" /* authAlgo */,
+                             {} /* authKey */, 0 /* authTruncBits */,
+                             "ecb(cipher_null)" /* cryptAlgo */, {} /* cryptKey */,
+                             0 /* cryptTruncBits */, "" /* aeadAlgo */, {} /* aeadKey */,
+                             0 /* aeadIcvBits */, 0 /* encapType == ENCAP_NONE */,
+                             0 /* encapLocalPort */, 0 /* encapRemotePort */, kInterfaceId),
+                     "ipSecAddSecurityAssociation");
+    }
+
+    bool addSa(benchmark::State& state, int32_t spi, bool inbound) {
+        return addSa(state, spi, inbound, mLocal, mRemote);
+    }
+
+    bool deleteSa(benchmark::State& state, int32_t spi, bool inbound, const std::string& local,
+                  const std::string& remote) {
+        return check(state,
+                     mNetd->ipSecDeleteSecurityAssociation(
+                             kRequestId, inbound ? remote : local, inbound ? local : remote, spi,
+                             0 /* markValue */, 0 /* markMask */, kInterfaceId),
+                     "ipSecDeleteSecurityAssociation");
+    }
+
+    bool deleteSa(benchmark::State& state, int32_t spi, bool inbound) {
+        return deleteSa(state, spi, inbound, mLocal, mRemote);
+    }
+
+    bool addPolicy(benchmark::State& state, int32_t spi) {
+        return check(state,
+                     mNetd->ipSecAddSecurityPolicy(kRequestId, mFamily, XFRM_POLICY_OUT, mLocal,
+                                                   mRemote, spi, 0 /* markValue */,
+                                                   0 /* markMask */, kInterfaceId),
+                     "ipSecAddSecurityPolicy");
+    }
+
+    bool updatePolicy(benchmark::State& state, int32_t spi) {
+        return check(state,
+                     mNetd->ipSecUpdateSecurityPolicy(kRequestId, mFamily, XFRM_POLICY_OUT, mLocal,
+                                                      mRemote, spi, 0 /* markValue */,
+                                                      0 /* markMask */, kInterfaceId),
+                     "ipSecUpdateSecurityPolicy");
+    }
+
+    bool deletePolicy(benchmark::State& state) {
+        return check(state,
+                     mNetd->ipSecDeleteSecurityPolicy(kRequestId, mFamily, XFRM_POLICY_OUT,
+                                                      0 /* markValue */, 0 /* markMask */,
+                                                      kInterfaceId),
+                     "ipSecDeleteSecurityPolicy");
+    }
+
+    bool migrate(benchmark::State& state, const std::string& oldLocal,
+                 const std::string& oldRemote, const std::string& newLocal,
+                 const std::string& newRemote) {
+        IpSecMigrateInfoParcel parcel;
+        parcel.requestId = kRequestId;
+        parcel.selAddrFamily = mFamily;
+        parcel.direction = XFRM_POLICY_OUT;
+        parcel.oldSourceAddress = oldLocal;
+        parcel.oldDestinationAddress = oldRemote;
+        parcel.newSourceAddress = newLocal;
+        parcel.newDestinationAddress = newRemote;
+        parcel.interfaceId = kInterfaceId;
+        return check(state, mNetd->ipSecMigrate(parcel), "ipSecMigrate");
+    }
+
+    bool addTunnel(benchmark::State& state) {
+        return check(state,
+                     mNetd->ipSecAddTunnelInterface(kTunnelName, mLocal, mRemote, 0 /* iKey */,
+                                                    0 /* oKey */, kInterfaceId),
+                     "ipSecAddTunnelInterface");
+    }
+
+    bool removeTunnel(benchmark::State& state) {
+        return check(state, mNetd->ipSecRemoveTunnelInterface(kTunnelName),
+                     "ipSecRemoveTunnelInterface");
+    }
+};
+
+BENCHMARK_DEFINE_F(IpSecFixture, allocateSpi)(benchmark::State& state) {
+    if (!ready(state)) return;
+    int32_t spi = 0;
+    measure(
+            state, nothing,
+            [&] {
+                int32_t outSpi = 0;
+                spi = nextSpi();
+                return check(state,
+                             mNetd->ipSecAllocateSpi(kRequestId, mRemote, mLocal, spi, &outSpi),
+                             "ipSecAllocateSpi");
+            },
+            [&] { return deleteSa(state, spi, true /* inbound */); });
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, addSa)(benchmark::State& state) {
+    if (!ready(state)) return;
+    int32_t spi = 0;
+    measure(
+            state, nothing,
+            [&] {
+                spi = nextSpi();
+                return addSa(state, spi, false /* inbound */);
+            },
+            [&] { return deleteSa(state, spi, false /* inbound */); });
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, deleteSa)(benchmark::State& state) {
+    if (!ready(state)) return;
+    int32_t spi = 0;
+    measure(
+            state,
+            [&] {
+                spi = nextSpi();
+                return addSa(state, spi, false /* inbound */);
+            },
+            [&] { return deleteSa(state, spi, false /* inbound */); }, nothing);
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, addPolicy)(benchmark::State& state) {
+    if (!ready(state)) return;
+    measure(
+            state, nothing, [&] { return addPolicy(state, nextSpi()); },
+            [&] { return deletePolicy(state); });
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, updatePolicy)(benchmark::State& state) {
+    if (!ready(state) || !addPolicy(state, nextSpi())) return;
+    measure(state, nothing, [&] { return updatePolicy(state, nextSpi()); }, nothing);
+    deletePolicy(state);
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, deletePolicy)(benchmark::State& state) {
+    if (!ready(state)) return;
+    measure(
+            state, [&] { return addPolicy(state, nextSpi()); },
+            [&] { return deletePolicy(state); }, nothing);
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, migrate)(benchmark::State& state) {
+    if (!ready(state)) return;
+    const int32_t spi = nextSpi();
+    if (!addSa(state, spi, false /* inbound */)) return;
+    if (!addPolicy(state, spi)) {
+        deleteSa(state, spi, false /* inbound */);
+        return;
+    }
+
+    // Move the SA and policy back and forth between the two pairs of addresses.
+    bool moved = false;
+    measure(
+            state, nothing,
+            [&] {
+                const bool ok = moved ? migrate(state, mNewLocal, mNewRemote, mLocal, mRemote)
+                                      : migrate(state, mLocal, mRemote, mNewLocal, mNewRemote);
+                if (ok) moved = !moved;
+                return ok;
+            },
+            nothing);
+
+    deletePolicy(state);
+    if (moved) {
+        deleteSa(state, spi, false /* inbound */, mNewLocal, mNewRemote);
+    } else {
+        deleteSa(state, spi, false /* inbound */);
+    }
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, addTunnelInterface)(benchmark::State& state) {
+    if (!ready(state)) return;
+    measure(
+            state, nothing, [&] { return addTunnel(state); }, [&] { return removeTunnel(state); });
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, removeTunnelInterface)(benchmark::State& state) {
+    if (!ready(state)) return;
+    measure(
+            state, [&] { return addTunnel(state); }, [&] { return removeTunnel(state); }, nothing);
+}
+
+BENCHMARK_DEFINE_F(IpSecFixture, rekeyTunnel)(benchmark::State& state) {
+    if (!ready(state) || !addTunnel(state)) return;
+    int32_t inSpi = nextSpi();
+    int32_t outSpi = nextSpi();
+    if (!addSa(state, inSpi, true /* inbound */) || !addSa(state, outSpi, false /* inbound */) ||
+        !addPolicy(state, outSpi)) {
+        removeTunnel(state);
+        return;
+    }
+
+    measure(
+            state, nothing,
+            [&] {
+                int32_t newInSpi = 0;
+                const int32_t newOutSpi = nextSpi();
+                if (!check(state,
+                           mNetd->ipSecAllocateSpi(kRequestId, mRemote, mLocal, nextSpi(),
+                                                   &newInSpi),
+                           "ipSecAllocateSpi") ||
+                    !addSa(state, newInSpi, true /* inbound */) ||
+                    !addSa(state, newOutSpi, false /* inbound */) ||
+                    !updatePolicy(state, newOutSpi) ||
+                    !deleteSa(state, inSpi, true /* inbound */) ||
+                    !deleteSa(state, outSpi, false /* inbound */)) {
+                    return false;
+                }
+                inSpi = newInSpi;
+                outSpi = newOutSpi;
+                return true;
+            },
+            nothing);
+
+    deletePolicy(state);
+    deleteSa(state, inSpi, true /* inbound */);
+    deleteSa(state, outSpi, false /* inbound */);
+    removeTunnel(state);
+}
+
+BENCHMARK_REGISTER_F(IpSecFixture, allocateSpi)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, addSa)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, deleteSa)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, addPolicy)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, updatePolicy)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, deletePolicy)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, migrate)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, addTunnelInterface)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, removeTunnelInterface)->Arg(4)->Arg(6)->UseManualTime();
+BENCHMARK_REGISTER_F(IpSecFixture, rekeyTunnel)->Arg(4)->Arg(6)->UseManualTime();
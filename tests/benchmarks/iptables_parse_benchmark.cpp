@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "iptables_parse_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This set of benchmarks compares the std::regex and std::getline parsers that netd used for
+ * iptables listings with the zero-copy tokenizers in IptablesTokenizer.h, on synthetic listings of
+ * 10 to 10000 rules. The listings are the ones parsed by TetherController::addForwardChainStats()
+ * and BandwidthController::parseAndFlushCostlyTables(). Each benchmark reports the number of
+ * rules parsed per second.
+ */
+
+#include <cinttypes>
+#include <cstdlib>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+
+#include "IptablesTokenizer.h"
+
+using android::base::StartsWith;
+using android::base::StringAppendF;
+using android::net::FieldTokenizer;
+using android::net::LineTokenizer;
+
+namespace {
+
+struct RuleCounters {
+    std::string inIface;
+    std::string outIface;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+std::string tetherCountersListing(int rules) {
+    std::string listing =
+            "Chain tetherctrl_counters (4 references)\n"
+            "    pkts      bytes target     prot opt in     out     source               "
+            "destination\n";
+    for (int i = 0; i < rules; i++) {
+        StringAppendF(&listing,
+                      "%8d %8d RETURN     all  --  wlan%d  rmnet%d  0.0.0.0/0            "
+                      "0.0.0.0/0\n",
+                      i * 7, i * 1500, i % 4, i / 4);
+    }
+    return listing;
+}
+
+std::string costlyChainsListing(int chains) {
+    std::string listing;
+    for (int i = 0; i < chains; i++) {
+        StringAppendF(&listing, "-N bw_costly_rmnet%d\n", i);
+        StringAppendF(&listing, "-A bw_costly_rmnet%d -j bw_penalty_box\n", i);
+    }
+    listing += "-N bw_costly_shared\n";
+    return listing;
+}
+
+// The parser TetherController used before IptablesTokenizer.h.
+int parseTetherCountersWithRegex(const std::string& listing, std::vector<RuleCounters>* rules) {
+    static const std::string NUM = "(\\d+)";
+    static const std::string IFACE = "([^\\s]+)";
+    static const std::string DST = "(0.0.0.0/0|::/0)";
+    static const std::string COUNTERS = "\\s*" + NUM + "\\s+" + NUM +
+                                        " RETURN     all(  --  |      )" + IFACE + "\\s+" + IFACE +
+                                        "\\s+" + DST + "\\s+" + DST;
+    static const std::regex IP_RE(COUNTERS);
+
+    rules->clear();
+    int headerLine = 0;
+    for (const std::string& line : android::base::Split(listing, "\n")) {
+        if (headerLine < 2) {
+            headerLine++;
+            continue;
+        }
+        if (line.empty()) continue;
+        std::smatch matches;
+        if (!std::regex_search(line, matches, IP_RE)) return -1;
+        rules->push_back({
+                .inIface = matches[4].str(),
+                .outIface = matches[5].str(),
+                .packets = strtoul(matches[1].str().c_str(), nullptr, 10),
+                .bytes = strtoul(matches[2].str().c_str(), nullptr, 10),
+        });
+    }
+    return 0;
+}
+
+int parseTetherCountersWithTokenizer(const std::string& listing,
+                                     std::vector<RuleCounters>* rules) {
+    rules->clear();
+    LineTokenizer lines(listing);
+    std::string_view line;
+    int headerLine = 0;
+    while (lines.next(&line)) {
+        if (headerLine < 2) {
+            headerLine++;
+            continue;
+        }
+        if (line.empty()) continue;
+        FieldTokenizer fields(line);
+        RuleCounters rule;
+        if (!fields.nextUint64(&rule.packets) || !fields.nextUint64(&rule.bytes) ||
+            fields.next() != "RETURN" || fields.next() != "all") {
+            return -1;
+        }
+        std::string_view iface0 = fields.next();
+        if (iface0 == "--") iface0 = fields.next();
+        rule.inIface = iface0;
+        rule.outIface = fields.next();
+        rules->push_back(std::move(rule));
+    }
+    return 0;
+}
+
+// The parser BandwidthController used before IptablesTokenizer.h.
+size_t countCostlyChainsWithGetline(const std::string& listing) {
+    static const std::string NEW_CHAIN_COMMAND = "-N ";
+    std::stringstream stream(listing);
+    std::string rule;
+    size_t chains = 0;
+    while (std::getline(stream, rule, '\n')) {
+        if (!StartsWith(rule, NEW_CHAIN_COMMAND)) continue;
+        std::string chainName = rule.substr(NEW_CHAIN_COMMAND.size());
+        if (!StartsWith(chainName, "bw_costly_") || chainName == "bw_costly_shared") continue;
+        chains++;
+    }
+    return chains;
+}
+
+size_t countCostlyChainsWithTokenizer(const std::string& listing) {
+    LineTokenizer lines(listing);
+    std::string_view rule;
+    size_t chains = 0;
+    while (lines.next(&rule)) {
+        if (!rule.starts_with("-N ")) continue;
+        std::string_view chainName = rule.substr(3);
+        if (!chainName.starts_with("bw_costly_") || chainName == "bw_costly_shared") continue;
+        chains++;
+    }
+    return chains;
+}
+
+template <int (*parse)(const std::string&, std::vector<RuleCounters>*)>
+void BM_TetherCounters(benchmark::State& state) {
+    const std::string listing = tetherCountersListing(state.range(0));
+    std::vector<RuleCounters> rules;
+    for (auto _ : state) {
+        if (parse(listing, &rules) != 0 || rules.size() != static_cast<size_t>(state.range(0))) {
+            state.SkipWithError("parse failed");
+            break;
+        }
+        benchmark::DoNotOptimize(rules.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <size_t (*count)(const std::string&)>
+void BM_CostlyChains(benchmark::State& state) {
+    const std::string listing = costlyChainsListing(state.range(0));
+    for (auto _ : state) {
+        if (count(listing) != static_cast<size_t>(state.range(0))) {
+            state.SkipWithError("parse failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_TetherCounters, parseTetherCountersWithRegex)->Range(10, 10000);
+BENCHMARK_TEMPLATE(BM_TetherCounters, parseTetherCountersWithTokenizer)->Range(10, 10000);
+BENCHMARK_TEMPLATE(BM_CostlyChains, countCostlyChainsWithGetline)->Range(10, 10000);
+BENCHMARK_TEMPLATE(BM_CostlyChains, countCostlyChainsWithTokenizer)->Range(10, 10000);
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "iptables_restore_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This benchmark measures the throughput and latency of IptablesRestoreController::execute().
+ *
+ *  - iptables_restore_execute: runs a script on a target, from 1 to 8 threads at once. The small
+ *    script adds and deletes one rule; the large one flushes a chain and adds 1000 rules to it.
+ *    items_per_second is commands per second across all threads, and p99_us is the 99th
+ *    percentile of the time one execute() call took, averaged over the threads.
+ *
+ *  - iptables_restore_recovery: kills the iptables-restore and ip6tables-restore processes, waits
+ *    until they are dead, and then times the next command, which has to notice the death and
+ *    start or take over another process. The kill and the wait are not timed.
+ *
+ * The benchmark runs in its own network namespace, so that it starts from empty tables and does
+ * not touch the device's rules. Must run as root.
+ */
+
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include "IptablesRestoreController.h"
+#include "NetdConstants.h"
+
+using android::base::ReadFileToString;
+using android::base::StringAppendF;
+using android::base::StringPrintf;
+
+// Reaches the process IDs that IptablesRestoreController only exposes to its friends.
+class IptablesRestoreBenchmark {
+  public:
+    static pid_t getPid(IptablesRestoreController* controller,
+                        IptablesRestoreController::IptablesProcessType type) {
+        return controller->getIpRestorePid(type);
+    }
+};
+
+namespace {
+
+constexpr char CHAIN[] = "bench_iptables_restore";
+constexpr int kLargeScriptRules = 1000;
+constexpr auto kDeathTimeout = std::chrono::seconds(1);
+
+enum ScriptSize { SMALL, LARGE };
+
+// Threads created by the benchmark library inherit the namespace of the main thread, so enter it
+// before any benchmark runs.
+const bool sInNewNetns = [] {
+    blockSigpipe();
+    return unshare(CLONE_NEWNET) == 0;
+}();
+
+// Shared by all threads, as gCtls->iptablesRestoreCtrl is in netd. Returns nullptr if the
+// benchmark cannot run.
+IptablesRestoreController* controller() {
+    static IptablesRestoreController* const instance = []() -> IptablesRestoreController* {
+        if (!sInNewNetns) return nullptr;
+        auto* c = new IptablesRestoreController();
+        const std::string createChain = StringPrintf("*filter\n:%s -\nCOMMIT\n", CHAIN);
+        if (c->execute(V4V6, createChain, nullptr)) return nullptr;
+        return c;
+    }();
+    return instance;
+}
+
+std::string script(ScriptSize size) {
+    if (size == SMALL) {
+        return StringPrintf(
+                "*filter\n"
+                "-A %s -m owner --uid-owner 2000000000 -j RETURN\n"
+                "-D %s -m owner --uid-owner 2000000000 -j RETURN\n"
+                "COMMIT\n",
+                CHAIN, CHAIN);
+    }
+    std::string s = StringPrintf("*filter\n-F %s\n", CHAIN);
+    for (int i = 0; i < kLargeScriptRules; i++) {
+        StringAppendF(&s, "-A %s -m owner --uid-owner %d -j RETURN\n", CHAIN, 10000 + i);
+    }
+    s += "COMMIT\n";
+    return s;
+}
+
+// Whether |pid| has exited, i.e., is gone or a zombie.
+bool isDead(pid_t pid) {
+    std::string stat;
+    if (!ReadFileToString(StringPrintf("/proc/%d/stat", pid), &stat)) return true;
+    // The state follows the command name, which is in parentheses.
+    const size_t end = stat.rfind(')');
+    return end == std::string::npos || stat.compare(end, 3, ") Z") == 0;
+}
+
+bool killAndWait(pid_t pid) {
+    if (pid == 0 || kill(pid, SIGKILL)) return false;
+    const auto deadline = std::chrono::steady_clock::now() + kDeathTimeout;
+    while (!isDead(pid)) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        usleep(1000);
+    }
+    return true;
+}
+
+}  // namespace
+
+static void iptables_restore_execute(benchmark::State& state) {
+    IptablesRestoreController* con = controller();
+    if (con == nullptr) {
+        state.SkipWithError("Cannot set up a network namespace");
+        return;
+    }
+    const auto target = static_cast<IptablesTarget>(state.range(0));
+    const std::string command = script(static_cast<ScriptSize>(state.range(1)));
+
+    std::vector<double> latenciesUs;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        const auto start = std::chrono::steady_clock::now();
+        const int ret = con->execute(target, command, nullptr);
+        const std::chrono::duration<double, std::micro> elapsed =
+                std::chrono::steady_clock::now() - start;
+        if (ret) {
+            state.SkipWithError("execute() failed");
+            return;
+        }
+        latenciesUs.push_back(elapsed.count());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    if (!latenciesUs.empty()) {
+        const size_t rank = std::ceil(0.99 * latenciesUs.size()) - 1;
+        std::nth_element(latenciesUs.begin(), latenciesUs.begin() + rank, latenciesUs.end());
+        state.counters["p99_us"] =
+                benchmark::Counter(latenciesUs[rank], benchmark::Counter::kAvgThreads);
+    }
+}
+BENCHMARK(iptables_restore_execute)
+        ->ArgNames({"target", "large"})
+        ->ArgsProduct({{V4, V6, V4V6}, {SMALL, LARGE}})
+        ->ThreadRange(1, 8)
+        ->UseRealTime()
+        ->Unit(benchmark::kMicrosecond);
+
+static void iptables_restore_recovery(benchmark::State& state) {
+    IptablesRestoreController* con = controller();
+    if (con == nullptr) {
+        state.SkipWithError("Cannot set up a network namespace");
+        return;
+    }
+    const std::string command = script(SMALL);
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        state.PauseTiming();
+        // Make sure that both processes are running, then kill them.
+        bool killed = con->execute(V4V6, command, nullptr) == 0;
+        for (auto type : {IptablesRestoreController::IPTABLES_PROCESS,
+                          IptablesRestoreController::IP6TABLES_PROCESS}) {
+            killed = killed && killAndWait(IptablesRestoreBenchmark::getPid(con, type));
+        }
+        state.ResumeTiming();
+        if (!killed) {
+            state.SkipWithError("Cannot kill iptables-restore");
+            return;
+        }
+        if (con->execute(V4V6, command, nullptr)) {
+            state.SkipWithError("execute() failed after the kill");
+            return;
+        }
+    }
+}
+BENCHMARK(iptables_restore_recovery)->Unit(benchmark::kMillisecond)->Iterations(20);
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/stringprintf.h>
+#include <android/net/INetd.h>
+#include <benchmark/benchmark.h>
+#include <binder/IServiceManager.h>
+
+// A fixture for benchmarks that call netd through its binder interface.
+class NetdBinderFixture : public ::benchmark::Fixture {
+  protected:
+    android::sp<android::net::INetd> mNetd;
+
+  public:
+    void SetUp(const ::benchmark::State&) override {
+        android::sp<android::IBinder> binder =
+                android::defaultServiceManager()->getService(android::String16("netd"));
+        if (binder != nullptr) {
+            mNetd = android::interface_cast<android::net::INetd>(binder);
+        }
+    }
+
+    // Returns false, and fails the benchmark with a message, if a binder call failed.
+    static bool check(benchmark::State& state, const android::binder::Status& status,
+                      const char* what) {
+        if (status.isOk()) return true;
+        state.SkipWithError(android::base::StringPrintf("%s failed: %s", what,
+                                                        status.toString8().c_str())
+                                    .c_str());
+        return false;
+    }
+
+    // Returns false, and fails the benchmark with a message, if what SetUp() needed to set up is
+    // missing.
+    virtual bool ready(benchmark::State& state) {
+        if (mNetd == nullptr) {
+            state.SkipWithError("Cannot get the netd binder service");
+            return false;
+        }
+        return true;
+    }
+};
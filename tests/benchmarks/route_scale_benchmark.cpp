@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "route_scale_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This benchmark measures how routing programming scales with the number of UID ranges, as when a
+ * VPN or a per-app default network applies to many users or apps. Each benchmark takes N, the
+ * number of UID ranges, and times one RouteController operation:
+ *
+ *  - route_scale_add_users: addUsersToVirtualNetwork() with N ranges.
+ *
+ *  - route_scale_add_interface: addInterfaceToPhysicalNetwork() on a network that already has N
+ *                               ranges.
+ *
+ *  - route_scale_set_default: addInterfaceToDefaultNetwork(), with a VPN that has N ranges.
+ *
+ *  - route_scale_flush_routes: removeInterfaceFromPhysicalNetwork(), which deletes the routing
+ *                              rules of the interface and flushes its table. Here N is the number
+ *                              of routes in the table.
+ *
+ * The operation is undone after each iteration, untimed. Two counters describe the state that
+ * the operation left behind:
+ *
+ *  - rules: the number of IPv4 and IPv6 routing rules in the kernel.
+ *
+ *  - lookup_us: the mean time for the kernel to look up a route for a UID that none of the ranges
+ *               contain, so that the lookup goes past every UID rule.
+ *
+ * The benchmark runs in its own network namespace, on tun interfaces that it creates. It writes
+ * the routing table names file like netd does. Must run as root.
+ */
+
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "NetlinkCommands.h"
+#include "RouteController.h"
+#include "UidRanges.h"
+#include "tun_interface.h"
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+using android::net::kNetlinkDumpBufferSize;
+using android::net::NETLINK_DUMP_FLAGS;
+using android::net::NetlinkDumpCallback;
+using android::net::RouteController;
+using android::net::TunInterface;
+using android::net::UidRangeMap;
+using android::net::UidRangeParcel;
+using android::net::UidRanges;
+
+namespace {
+
+constexpr unsigned LOCAL_NET_ID = 99;
+constexpr unsigned PHYSICAL_NET_ID = 100;
+constexpr unsigned VPN_NET_ID = 101;
+constexpr int32_t SUB_PRIORITY = 0;
+
+// Ranges are one per Android user, as for a VPN that applies to every user.
+constexpr int32_t kPerUserRange = 100000;
+constexpr int32_t kFirstAppUid = 10000;
+constexpr int32_t kLastAppUid = 19999;
+// Below every range.
+constexpr uint32_t kLookupUid = 1000;
+constexpr int kLookups = 100;
+
+struct Setup {
+    TunInterface physical;
+    TunInterface vpn;
+};
+
+Setup* setUp() {
+    static Setup* const setup = []() -> Setup* {
+        if (unshare(CLONE_NEWNET)) return nullptr;
+        if (RouteController::Init(LOCAL_NET_ID)) return nullptr;
+        auto* s = new Setup();
+        if (s->physical.init() || s->vpn.init()) return nullptr;
+        return s;
+    }();
+    return setup;
+}
+
+UidRangeMap uidRanges(int count) {
+    std::vector<UidRangeParcel> parcels;
+    for (int user = 0; user < count; user++) {
+        UidRangeParcel parcel;
+        parcel.start = user * kPerUserRange + kFirstAppUid;
+        parcel.stop = user * kPerUserRange + kLastAppUid;
+        parcels.push_back(parcel);
+    }
+    return {{SUB_PRIORITY, UidRanges(parcels)}};
+}
+
+int countRules() {
+    int count = 0;
+    NetlinkDumpCallback callback = [&count](nlmsghdr*) { count++; };
+    rtmsg rtm = {.rtm_family = AF_UNSPEC};
+    iovec iov[] = {
+            {nullptr, 0},
+            {&rtm, sizeof(rtm)},
+    };
+    if (android::net::sendNetlinkRequest(RTM_GETRULE, NETLINK_DUMP_FLAGS, iov, std::size(iov),
+                                         &callback)) {
+        return -1;
+    }
+    return count;
+}
+
+// The mean time taken by an RTM_GETROUTE for kLookupUid, in microseconds, or -1 on error.
+double measureLookup() {
+    unique_fd sock(android::net::openNetlinkSocket(NETLINK_ROUTE));
+    if (sock < 0) return -1;
+
+    struct {
+        nlmsghdr hdr;
+        rtmsg rtm;
+        rtattr dstAttr;
+        in_addr dst;
+        rtattr uidAttr;
+        uint32_t uid;
+    } request = {
+            .hdr = {.nlmsg_len = sizeof(request),
+                    .nlmsg_type = RTM_GETROUTE,
+                    .nlmsg_flags = NLM_F_REQUEST},
+            .rtm = {.rtm_family = AF_INET, .rtm_dst_len = 32},
+            .dstAttr = {.rta_len = RTA_LENGTH(sizeof(in_addr)), .rta_type = RTA_DST},
+            .uidAttr = {.rta_len = RTA_LENGTH(sizeof(uint32_t)), .rta_type = RTA_UID},
+            .uid = kLookupUid,
+    };
+    inet_pton(AF_INET, "192.0.2.1", &request.dst);
+
+    // Whether a route is found does not matter, only how long the kernel took to decide.
+    char response[kNetlinkDumpBufferSize];
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kLookups; i++) {
+        request.hdr.nlmsg_seq = i;
+        if (send(sock, &request, sizeof(request), 0) != sizeof(request)) return -1;
+        if (recv(sock, response, sizeof(response), 0) < 0) return -1;
+    }
+    const std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+    return elapsed.count() / kLookups;
+}
+
+// Runs |op| once per iteration, timed, and |undo| after it, untimed. The counters are measured
+// after the first run of |op|.
+template <typename Op, typename Undo>
+void run(benchmark::State& state, Op op, Undo undo) {
+    bool measured = false;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        const auto start = std::chrono::steady_clock::now();
+        const int ret = op();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (ret) {
+            state.SkipWithError(StringPrintf("Operation failed: %s", strerror(-ret)).c_str());
+            return;
+        }
+        state.SetIterationTime(elapsed.count());
+        if (!measured) {
+            state.counters["rules"] = countRules();
+            state.counters["lookup_us"] = measureLookup();
+            measured = true;
+        }
+        if (undo()) {
+            state.SkipWithError("Cannot undo the operation");
+            return;
+        }
+    }
+}
+
+}  // namespace
+
+static void route_scale_add_users(benchmark::State& state) {
+    Setup* setup = setUp();
+    if (setup == nullptr) {
+        state.SkipWithError("Cannot create a network namespace and interfaces");
+        return;
+    }
+    const char* vpn = setup->vpn.name().c_str();
+    const UidRangeMap ranges = uidRanges(state.range(0));
+    const UidRangeMap noRanges;
+    if (RouteController::addInterfaceToVirtualNetwork(VPN_NET_ID, vpn, true /* secure */,
+                                                      noRanges, false)) {
+        state.SkipWithError("Cannot create the VPN");
+        return;
+    }
+    run(state,
+        [&] {
+            return RouteController::addUsersToVirtualNetwork(VPN_NET_ID, vpn, true, ranges, false);
+        },
+        [&] {
+            return RouteController::removeUsersFromVirtualNetwork(VPN_NET_ID, vpn, true, ranges,
+                                                                  false);
+        });
+    (void)RouteController::removeInterfaceFromVirtualNetwork(VPN_NET_ID, vpn, true, noRanges,
+                                                             false);
+}
+BENCHMARK(route_scale_add_users)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->UseManualTime()
+        ->Unit(benchmark::kMicrosecond);
+
+static void route_scale_add_interface(benchmark::State& state) {
+    Setup* setup = setUp();
+    if (setup == nullptr) {
+        state.SkipWithError("Cannot create a network namespace and interfaces");
+        return;
+    }
+    const char* physical = setup->physical.name().c_str();
+    const UidRangeMap ranges = uidRanges(state.range(0));
+    run(state,
+        [&] {
+            return RouteController::addInterfaceToPhysicalNetwork(PHYSICAL_NET_ID, physical,
+                                                                  PERMISSION_NONE, ranges, false);
+        },
+        [&] {
+            return RouteController::removeInterfaceFromPhysicalNetwork(
+                    PHYSICAL_NET_ID, physical, PERMISSION_NONE, ranges, false);
+        });
+}
+BENCHMARK(route_scale_add_interface)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->UseManualTime()
+        ->Unit(benchmark::kMicrosecond);
+
+static void route_scale_set_default(benchmark::State& state) {
+    Setup* setup = setUp();
+    if (setup == nullptr) {
+        state.SkipWithError("Cannot create a network namespace and interfaces");
+        return;
+    }
+    const char* physical = setup->physical.name().c_str();
+    const char* vpn = setup->vpn.name().c_str();
+    const UidRangeMap ranges = uidRanges(state.range(0));
+    const UidRangeMap noRanges;
+    if (RouteController::addInterfaceToPhysicalNetwork(PHYSICAL_NET_ID, physical,
+                                                       PERMISSION_NONE, noRanges, false) ||
+        RouteController::addInterfaceToVirtualNetwork(VPN_NET_ID, vpn, true, ranges, false)) {
+        state.SkipWithError("Cannot create the networks");
+        return;
+    }
+    run(state,
+        [&] { return RouteController::addInterfaceToDefaultNetwork(physical, PERMISSION_NONE); },
+        [&] {
+            return RouteController::removeInterfaceFromDefaultNetwork(physical, PERMISSION_NONE);
+        });
+    (void)RouteController::removeInterfaceFromVirtualNetwork(VPN_NET_ID, vpn, true, ranges, false);
+    (void)RouteController::removeInterfaceFromPhysicalNetwork(PHYSICAL_NET_ID, physical,
+                                                              PERMISSION_NONE, noRanges, false);
+}
+BENCHMARK(route_scale_set_default)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->UseManualTime()
+        ->Unit(benchmark::kMicrosecond);
+
+static void route_scale_flush_routes(benchmark::State& state) {
+    Setup* setup = setUp();
+    if (setup == nullptr) {
+        state.SkipWithError("Cannot create a network namespace and interfaces");
+        return;
+    }
+    const char* physical = setup->physical.name().c_str();
+    const UidRangeMap noRanges;
+    const int routes = state.range(0);
+    // The undo step of this benchmark is what sets the network up.
+    const auto addNetwork = [&] {
+        if (int ret = RouteController::addInterfaceToPhysicalNetwork(
+                    PHYSICAL_NET_ID, physical, PERMISSION_NONE, noRanges, false)) {
+            return ret;
+        }
+        for (int i = 0; i < routes; i++) {
+            const std::string destination = StringPrintf("10.%d.%d.0/24", i / 256, i % 256);
+            if (int ret = RouteController::addRoute(physical, destination.c_str(), nullptr,
+                                                    RouteController::INTERFACE, 0 /* mtu */,
+                                                    0 /* priority */)) {
+                return ret;
+            }
+        }
+        return 0;
+    };
+    if (addNetwork()) {
+        state.SkipWithError("Cannot create the network");
+        return;
+    }
+    run(state,
+        [&] {
+            return RouteController::removeInterfaceFromPhysicalNetwork(
+                    PHYSICAL_NET_ID, physical, PERMISSION_NONE, noRanges, false);
+        },
+        addNetwork);
+    (void)RouteController::removeInterfaceFromPhysicalNetwork(PHYSICAL_NET_ID, physical,
+                                                              PERMISSION_NONE, noRanges, false);
+}
+BENCHMARK(route_scale_flush_routes)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000)
+        ->UseManualTime()
+        ->Unit(benchmark::kMicrosecond);
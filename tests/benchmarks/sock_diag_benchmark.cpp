@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sock_diag_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This benchmark measures how long SockDiag takes to find and destroy sockets when there are many
+ * of them, as when a network with thousands of connections goes away. Each benchmark takes the
+ * number of sockets, N, and whether SockDiag runs in parallel mode:
+ *
+ *  - sock_diag_destroy_addr: destroySockets(addrstr, ifindex), for the address every socket uses.
+ *
+ *  - sock_diag_destroy_uid: destroySockets(proto, uid, excludeLoopback), for the UDP sockets of
+ *                           one UID.
+ *
+ *  - sock_diag_destroy_uid_ranges: destroySockets(uidRanges, skipUids, excludeLoopback), for the
+ *                                  TCP sockets of half of the UIDs.
+ *
+ *  - sock_diag_destroy_lacking_permission: destroySocketsLackingPermission(), for the TCP sockets
+ *                                          of one network.
+ *
+ *  - sock_diag_tcp_poll: the sock_diag dump that TcpSocketMonitor::poll() makes to read the
+ *                        tcp_info and mark of every live TCP socket. poll() itself also reports to
+ *                        the event listener, which needs the rest of netd.
+ *
+ * Half of the N sockets are TCP and half are UDP, spread over several UIDs and networks. Every TCP
+ * socket is connected over loopback to a peer owned by root, which none of the filters match but
+ * which the kernel still has to look at. The sockets are created again, untimed, before each
+ * destroy. As netd does, each call uses a new SockDiag.
+ *
+ * The benchmark runs in its own network namespace. Must run as root, with an open file limit of
+ * at least 1.5 * N.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <linux/if.h>
+
+#include "Fwmark.h"
+#include "SockDiag.h"
+#include "UidRanges.h"
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+using android::net::DiagMsgView;
+using android::net::SockDiag;
+using android::net::UidRangeParcel;
+using android::net::UidRanges;
+
+namespace {
+
+constexpr char LOOPBACK[] = "127.0.0.1";
+constexpr uid_t kFirstUid = 10000;
+constexpr int kUids = 10;
+constexpr unsigned kFirstNetId = 100;
+constexpr int kNetworks = 4;
+
+bool setUp() {
+    static const bool ok = [] {
+        if (unshare(CLONE_NEWNET)) return false;
+        // Loopback is down in a new namespace.
+        unique_fd s(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+        ifreq ifr = {};
+        strlcpy(ifr.ifr_name, "lo", sizeof(ifr.ifr_name));
+        ifr.ifr_flags = IFF_UP;
+        if (s == -1 || ioctl(s, SIOCSIFFLAGS, &ifr)) return false;
+
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit)) return false;
+        limit.rlim_cur = limit.rlim_max;
+        return setrlimit(RLIMIT_NOFILE, &limit) == 0;
+    }();
+    return ok;
+}
+
+// N sockets, as described above.
+class Sockets {
+  public:
+    // Returns false and leaves |error| set if the sockets could not be created.
+    bool open(int count, std::string* error) {
+        mFds.clear();
+        mFds.reserve(count + count / 2);
+        if (!listen()) return fail("Cannot listen", error);
+        for (int i = 0; i < count; i++) {
+            const bool tcp = i % 2 == 0;
+            const uid_t uid = kFirstUid + (i / 2) % kUids;
+            Fwmark mark;
+            mark.netId = kFirstNetId + (i / 2) % kNetworks;
+
+            // Sockets belong to the effective UID of their creator.
+            if (seteuid(uid)) return fail("Cannot change UID", error);
+            unique_fd fd(socket(AF_INET, (tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC, 0));
+            if (seteuid(0) || fd == -1) return fail("Cannot create socket", error);
+            if (setsockopt(fd, SOL_SOCKET, SO_MARK, &mark.intValue, sizeof(mark.intValue))) {
+                return fail("Cannot set mark", error);
+            }
+            const sockaddr_in& peer = tcp ? mTcpAddr : mUdpAddr;
+            if (connect(fd, reinterpret_cast<const sockaddr*>(&peer), sizeof(peer))) {
+                return fail("Cannot connect", error);
+            }
+            mFds.push_back(std::move(fd));
+            if (tcp) {
+                unique_fd accepted(accept4(mListener, nullptr, nullptr, SOCK_CLOEXEC));
+                if (accepted == -1) return fail("Cannot accept", error);
+                mFds.push_back(std::move(accepted));
+            }
+        }
+        return true;
+    }
+
+  private:
+    bool listen() {
+        if (mListener != -1) return true;
+        mListener.reset(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        mUdpPeer.reset(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+        for (auto [fd, addr] :
+             {std::pair(&mListener, &mTcpAddr), std::pair(&mUdpPeer, &mUdpAddr)}) {
+            *addr = {.sin_family = AF_INET};
+            inet_pton(AF_INET, LOOPBACK, &addr->sin_addr);
+            socklen_t len = sizeof(*addr);
+            if (*fd == -1 || bind(*fd, reinterpret_cast<sockaddr*>(addr), len) ||
+                getsockname(*fd, reinterpret_cast<sockaddr*>(addr), &len)) {
+                mListener.reset();
+                return false;
+            }
+        }
+        return ::listen(mListener, SOMAXCONN) == 0;
+    }
+
+    bool fail(const char* what, std::string* error) {
+        *error = StringPrintf("%s: %s", what, strerror(errno));
+        mFds.clear();
+        return false;
+    }
+
+    unique_fd mListener;
+    unique_fd mUdpPeer;
+    sockaddr_in mTcpAddr;
+    sockaddr_in mUdpAddr;
+    std::vector<unique_fd> mFds;
+};
+
+// Runs |destroy| on a new SockDiag once per iteration, after creating the sockets again.
+template <typename Destroy>
+void benchmarkDestroy(benchmark::State& state, Destroy destroy) {
+    if (!setUp()) {
+        state.SkipWithError("Cannot set up a network namespace");
+        return;
+    }
+    Sockets sockets;
+    std::string error;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        state.PauseTiming();
+        const bool ok = sockets.open(state.range(0), &error);
+        state.ResumeTiming();
+        if (!ok) {
+            state.SkipWithError(error.c_str());
+            return;
+        }
+        SockDiag sd;
+        if (!sd.open()) {
+            state.SkipWithError("Cannot open sock_diag");
+            return;
+        }
+        sd.setParallel(state.range(1));
+        if (int ret = destroy(sd)) {
+            state.SkipWithError(StringPrintf("Destroy failed: %s", strerror(-ret)).c_str());
+            return;
+        }
+    }
+}
+
+void sockDiagArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"sockets", "parallel"});
+    for (int sockets : {1000, 10000, 50000}) {
+        for (int parallel : {0, 1}) b->Args({sockets, parallel});
+    }
+    b->Iterations(3)->Unit(benchmark::kMillisecond);
+}
+
+}  // namespace
+
+static void sock_diag_destroy_addr(benchmark::State& state) {
+    benchmarkDestroy(state, [](SockDiag& sd) { return sd.destroySockets(LOOPBACK, 0); });
+}
+BENCHMARK(sock_diag_destroy_addr)->Apply(sockDiagArgs);
+
+static void sock_diag_destroy_uid(benchmark::State& state) {
+    benchmarkDestroy(state, [](SockDiag& sd) {
+        return sd.destroySockets(IPPROTO_UDP, kFirstUid, false /* excludeLoopback */);
+    });
+}
+BENCHMARK(sock_diag_destroy_uid)->Apply(sockDiagArgs);
+
+static void sock_diag_destroy_uid_ranges(benchmark::State& state) {
+    UidRangeParcel range;
+    range.start = kFirstUid;
+    range.stop = kFirstUid + kUids / 2 - 1;
+    const UidRanges uidRanges({range});
+    benchmarkDestroy(state, [&uidRanges](SockDiag& sd) {
+        return sd.destroySockets(uidRanges, {} /* skipUids */, false /* excludeLoopback */);
+    });
+}
+BENCHMARK(sock_diag_destroy_uid_ranges)->Apply(sockDiagArgs);
+
+static void sock_diag_destroy_lacking_permission(benchmark::State& state) {
+    benchmarkDestroy(state, [](SockDiag& sd) {
+        return sd.destroySocketsLackingPermission(kFirstNetId, PERMISSION_NETWORK,
+                                                  false /* excludeLoopback */);
+    });
+}
+BENCHMARK(sock_diag_destroy_lacking_permission)->Apply(sockDiagArgs);
+
+static void sock_diag_tcp_poll(benchmark::State& state) {
+    if (!setUp()) {
+        state.SkipWithError("Cannot set up a network namespace");
+        return;
+    }
+    Sockets sockets;
+    std::string error;
+    if (!sockets.open(state.range(0), &error)) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        SockDiag sd;
+        if (!sd.open()) {
+            state.SkipWithError("Cannot open sock_diag");
+            return;
+        }
+        uint32_t marks = 0;
+        const int ret = sd.forEachLiveTcpSocket([&marks](const DiagMsgView& sock) {
+            uint32_t tcpinfoLen = 0;
+            benchmark::DoNotOptimize(sock.attr(INET_DIAG_INFO, &tcpinfoLen));
+            marks |= sock.mark().intValue;
+        });
+        benchmark::DoNotOptimize(marks);
+        if (ret) {
+            state.SkipWithError(StringPrintf("Dump failed: %s", strerror(-ret)).c_str());
+            return;
+        }
+    }
+}
+BENCHMARK(sock_diag_tcp_poll)->Arg(1000)->Arg(10000)->Arg(50000)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "startup_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This benchmark measures netd startup. Each iteration runs Controllers::init() in a child process
+ * in a fresh network namespace, so that every run starts from empty iptables tables and routing
+ * rules, as at boot. The manual time is the time taken by Controllers::init(). Each phase in
+ * Controllers::startupProfile is also reported as a counter holding its mean duration in
+ * microseconds, so that, for example, a new iptables hook that slows down startup shows up in the
+ * phase that sets it up.
+ *
+ * Must run as root.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <map>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "Controllers.h"
+
+using android::base::ParseInt;
+using android::base::ReadFdToString;
+using android::base::Split;
+using android::base::StringAppendF;
+using android::base::unique_fd;
+using android::base::WriteStringToFd;
+using android::net::Controllers;
+using android::net::gCtls;
+
+namespace {
+
+constexpr char INIT_PHASE[] = "Initializing controllers";
+
+// Runs Controllers::init() in a new network namespace and returns its startup profile as lines
+// of "<phase>\t<duration in us>". Forking keeps each run's controllers, iptables-restore
+// processes and namespace separate.
+bool runInitInNewNetns(std::string* profile) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) return false;
+    unique_fd readFd(fds[0]);
+    unique_fd writeFd(fds[1]);
+
+    const pid_t pid = fork();
+    if (pid == -1) return false;
+    if (pid == 0) {
+        readFd.reset();
+        if (unshare(CLONE_NEWNET)) _exit(1);
+        gCtls = new Controllers();
+        gCtls->init();
+        std::string out;
+        for (const auto& phase : gCtls->startupProfile.getPhases()) {
+            StringAppendF(&out, "%s\t%" PRId64 "\n", phase.name.c_str(), phase.durationUs);
+        }
+        _exit(WriteStringToFd(out, writeFd) ? 0 : 1);
+    }
+
+    writeFd.reset();
+    const bool ok = ReadFdToString(readFd, profile);
+    int status;
+    if (waitpid(pid, &status, 0) != pid) return false;
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}  // namespace
+
+static void controllers_init(benchmark::State& state) {
+    std::map<std::string, int64_t> totalUs;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        std::string profile;
+        if (!runInitInNewNetns(&profile)) {
+            state.SkipWithError("Controllers::init() failed in a new network namespace");
+            return;
+        }
+        int64_t initUs = 0;
+        for (const auto& line : Split(profile, "\n")) {
+            const auto fields = Split(line, "\t");
+            int64_t us;
+            if (fields.size() != 2 || !ParseInt(fields[1], &us)) continue;
+            totalUs[fields[0]] += us;
+            if (fields[0] == INIT_PHASE) initUs = us;
+        }
+        state.SetIterationTime(initUs / 1e6);
+    }
+    for (const auto& [phase, us] : totalUs) {
+        state.counters[phase] = benchmark::Counter(us, benchmark::Counter::kAvgIterations);
+    }
+}
+BENCHMARK(controllers_init)->UseManualTime()->Unit(benchmark::kMillisecond)->Iterations(10);
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "tether_benchmark"
+
+/*
+ * See README.md for general notes.
+ *
+ * This set of benchmarks measures how long netd takes to set up and tear down tethering NAT, to
+ * read the tethering counters and to move tethering to another upstream, with between 1 and 64
+ * downstream interfaces. The interfaces are tun interfaces created by the fixture, and all calls
+ * go through the netd binder interface, as the tethering module makes them.
+ *
+ * Useful measurements
+ * ===================
+ *
+ *  - real_time: the time taken to run the operation on all N downstreams, or to read the stats
+ *               once with N downstreams tethered. Only the operation being measured is timed;
+ *               undoing it between iterations is not.
+ *
+ *  - N (the benchmark argument): the number of downstreams. The time should grow linearly with N;
+ *                                anything worse points at per-pair work that scans all pairs.
+ *
+ * An upstream switch is timed as tetherRemoveForward() from the old upstream and
+ * tetherAddForward() to the new one for every downstream, which is what the framework does.
+ */
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "netd_binder_fixture.h"
+#include "tun_interface.h"
+
+using android::net::TetherStatsParcel;
+using android::net::TunInterface;
+
+class TetherFixture : public NetdBinderFixture {
+  protected:
+    std::vector<TunInterface> mDownstreams;
+    TunInterface mUpstreams[2];
+    bool mInterfacesCreated = false;
+
+  public:
+    void SetUp(const ::benchmark::State& state) override {
+        NetdBinderFixture::SetUp(state);
+
+        mInterfacesCreated = true;
+        mDownstreams = std::vector<TunInterface>(state.range(0));
+        for (TunInterface& tun : mDownstreams) {
+            if (tun.init() != 0) mInterfacesCreated = false;
+        }
+        for (TunInterface& tun : mUpstreams) {
+            if (tun.init() != 0) mInterfacesCreated = false;
+        }
+    }
+
+    void TearDown(const ::benchmark::State&) override {
+        mDownstreams.clear();
+        for (TunInterface& tun : mUpstreams) {
+            tun.destroy();
+        }
+    }
+
+    bool ready(benchmark::State& state) override {
+        if (!NetdBinderFixture::ready(state)) return false;
+        if (!mInterfacesCreated) {
+            state.SkipWithError("Cannot create the tun interfaces");
+            return false;
+        }
+        return true;
+    }
+
+    bool addForwards(benchmark::State& state, const TunInterface& upstream) {
+        for (const TunInterface& tun : mDownstreams) {
+            if (!check(state, mNetd->tetherAddForward(tun.name(), upstream.name()),
+                       "tetherAddForward")) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool removeForwards(benchmark::State& state, const TunInterface& upstream) {
+        for (const TunInterface& tun : mDownstreams) {
+            if (!check(state, mNetd->tetherRemoveForward(tun.name(), upstream.name()),
+                       "tetherRemoveForward")) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+BENCHMARK_DEFINE_F(TetherFixture, enableNat)(benchmark::State& state) {
+    if (!ready(state)) return;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        if (!addForwards(state, mUpstreams[0])) break;
+        state.PauseTiming();
+        const bool ok = removeForwards(state, mUpstreams[0]);
+        state.ResumeTiming();
+        if (!ok) break;
+    }
+}
+
+BENCHMARK_DEFINE_F(TetherFixture, disableNat)(benchmark::State& state) {
+    if (!ready(state)) return;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        state.PauseTiming();
+        const bool ok = addForwards(state, mUpstreams[0]);
+        state.ResumeTiming();
+        if (!ok || !removeForwards(state, mUpstreams[0])) break;
+    }
+}
+
+BENCHMARK_DEFINE_F(TetherFixture, getTetherStats)(benchmark::State& state) {
+    if (!ready(state) || !addForwards(state, mUpstreams[0])) return;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        std::vector<TetherStatsParcel> stats;
+        if (!check(state, mNetd->tetherGetStats(&stats), "tetherGetStats")) break;
+    }
+    removeForwards(state, mUpstreams[0]);
+}
+
+BENCHMARK_DEFINE_F(TetherFixture, switchUpstream)(benchmark::State& state) {
+    if (!ready(state) || !addForwards(state, mUpstreams[0])) return;
+    int current = 0;
+    for (auto _ : state) {  // NOLINT(clang-analyzer-deadcode.DeadStores)
+        if (!removeForwards(state, mUpstreams[current]) ||
+            !addForwards(state, mUpstreams[1 - current])) {
+            break;
+        }
+        current = 1 - current;
+    }
+    removeForwards(state, mUpstreams[current]);
+}
+
+BENCHMARK_REGISTER_F(TetherFixture, enableNat)->RangeMultiplier(4)->Range(1, 64)->UseRealTime();
+BENCHMARK_REGISTER_F(TetherFixture, disableNat)->RangeMultiplier(4)->Range(1, 64)->UseRealTime();
+BENCHMARK_REGISTER_F(TetherFixture, getTetherStats)
+        ->RangeMultiplier(4)
+        ->Range(1, 64)
+        ->UseRealTime();
+BENCHMARK_REGISTER_F(TetherFixture, switchUpstream)
+        ->RangeMultiplier(4)
+        ->Range(1, 64)
+        ->UseRealTime();
@@ -62,6 +62,7 @@
 #include <netdutils/NetNativeTestBase.h>
 #include <netutils/ifc.h>
 #include <utils/Errors.h>
+#include "BinderCallLog.h"
 #include "Fwmark.h"
 #include "InterfaceController.h"
 #include "NetdClient.h"
@@ -4001,24 +4002,34 @@ TEST_F(NetdBinderTest, TestServiceDump) {
     std::vector<TestData> testData;
 
     // Send some IPCs and for each one add an element to testData telling us what to expect.
+    // netd only logs a hash of the arguments, so compute it from what their AIDL toString() is.
+    const auto expectedCall = [](const std::string& method, const std::vector<std::string>& args,
+                                 const std::string& result) {
+        uint64_t argsHash = BinderCallLog::kHashSeed;
+        for (const auto& arg : args) argsHash = BinderCallLog::hash(arg, argsHash);
+        return StringPrintf("%s(args %016" PRIx64 ") -> %s", method.c_str(), argsHash,
+                            result.c_str());
+    };
+    const std::string configString =
+            "NativeNetworkConfig{netId: 65123, networkType: PHYSICAL, permission: 0, "
+            "secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}";
+
     const auto& config = makeNativeNetworkConfig(TEST_DUMP_NETID, NativeNetworkType::PHYSICAL,
                                                  INetd::PERMISSION_NONE, false, false);
     EXPECT_TRUE(mNetd->networkCreate(config).isOk());
-    testData.push_back(
-            {"networkCreate(NativeNetworkConfig{netId: 65123, networkType: PHYSICAL, "
-             "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false})",
-             "networkCreate.*65123"});
+    testData.push_back({expectedCall("networkCreate", {configString}, "ok"), "networkCreate"});
 
     EXPECT_EQ(EEXIST, mNetd->networkCreate(config).serviceSpecificErrorCode());
     testData.push_back(
-            {"networkCreate(NativeNetworkConfig{netId: 65123, networkType: PHYSICAL, "
-             "permission: 0, secure: false, vpnType: PLATFORM, excludeLocalRoutes: false}) "
-             "-> ServiceSpecificException(17, \"File exists\")",
-             "networkCreate.*65123.*17"});
+            {expectedCall("networkCreate", {configString},
+                          StringPrintf("exception %d error 17",
+                                       binder::Status::EX_SERVICE_SPECIFIC)),
+             "networkCreate.*error 17"});
 
     EXPECT_TRUE(mNetd->networkAddInterface(TEST_DUMP_NETID, sTun.name()).isOk());
-    testData.push_back({StringPrintf("networkAddInterface(65123, %s)", sTun.name().c_str()),
-                        StringPrintf("networkAddInterface.*65123.*%s", sTun.name().c_str())});
+    testData.push_back(
+            {expectedCall("networkAddInterface", {"65123", sTun.name()}, "ok"),
+             "networkAddInterface"});
 
     android::net::RouteInfoParcel parcel;
     parcel.ifName = sTun.name();
@@ -4027,14 +4038,16 @@ TEST_F(NetdBinderTest, TestServiceDump) {
     parcel.mtu = 1234;
     EXPECT_TRUE(mNetd->networkAddRouteParcel(TEST_DUMP_NETID, parcel).isOk());
     testData.push_back(
-            {StringPrintf("networkAddRouteParcel(65123, RouteInfoParcel{destination:"
-                          " 2001:db8:dead:beef::/64, ifName: %s, nextHop: fe80::dead:beef,"
-                          " mtu: 1234})",
-                          sTun.name().c_str()),
-             "networkAddRouteParcel.*65123.*dead:beef"});
+            {expectedCall("networkAddRouteParcel",
+                          {"65123",
+                           StringPrintf("RouteInfoParcel{destination: 2001:db8:dead:beef::/64, "
+                                        "ifName: %s, nextHop: fe80::dead:beef, mtu: 1234}",
+                                        sTun.name().c_str())},
+                          "ok"),
+             "networkAddRouteParcel"});
 
     EXPECT_TRUE(mNetd->networkDestroy(TEST_DUMP_NETID).isOk());
-    testData.push_back({"networkDestroy(65123)", "networkDestroy.*65123"});
+    testData.push_back({expectedCall("networkDestroy", {"65123"}, "ok"), "networkDestroy"});
 
     // Send the service dump request to netd.
     std::vector<std::string> lines = {};
@@ -4043,9 +4056,9 @@ TEST_F(NetdBinderTest, TestServiceDump) {
 
     // Basic regexp to match dump output lines. Matches the beginning and end of the line, and
     // puts the output of the command itself into the first match group.
-    // Example: "      11-05 00:23:39.481 myCommand(args) <2.02ms>".
+    // Example: "    00:23:39.481 myCommand(args 0123456789abcdef) -> ok <2.02ms>".
     const std::basic_regex lineRegex(
-            "^      [0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}[.][0-9]{3} "
+            "^ +[0-9]{2}:[0-9]{2}:[0-9]{2}[.][0-9]{3} "
             "(.*)"
             " <[0-9]+[.][0-9]{2}ms>$");
 
@@ -4245,6 +4258,29 @@ TEST_F(NetdBinderTest, PerAppDefaultNetwork_OverlappedUidRanges) {
     EXPECT_EQ(EINVAL, status.serviceSpecificErrorCode());
 }
 
+// Verify that adjacent UID ranges share IP rules, and get their own back when they are split.
+TEST_F(NetdBinderTest, PerAppDefaultNetwork_CoalescesAdjacentRanges) {
+    const auto& config = makeNativeNetworkConfig(APP_DEFAULT_NETID, NativeNetworkType::PHYSICAL,
+                                                 INetd::PERMISSION_NONE, false, false);
+    EXPECT_TRUE(mNetd->networkCreate(config).isOk());
+    EXPECT_TRUE(mNetd->networkAddInterface(APP_DEFAULT_NETID, sTun.name()).isOk());
+
+    std::vector<UidRangeParcel> uidRanges = {makeUidRangeParcel(BASE_UID + 8000, BASE_UID + 8009),
+                                             makeUidRangeParcel(BASE_UID + 8010, BASE_UID + 8019),
+                                             makeUidRangeParcel(BASE_UID + 8000, BASE_UID + 8019)};
+
+    EXPECT_TRUE(mNetd->networkAddUidRanges(APP_DEFAULT_NETID, {uidRanges.at(0)}).isOk());
+    EXPECT_TRUE(mNetd->networkAddUidRanges(APP_DEFAULT_NETID, {uidRanges.at(1)}).isOk());
+    verifyAppUidRules({false, false, true} /*expectedResults*/, uidRanges, sTun.name(),
+                      UidRanges::SUB_PRIORITY_HIGHEST);
+    EXPECT_TRUE(mNetd->networkRemoveUidRanges(APP_DEFAULT_NETID, {uidRanges.at(0)}).isOk());
+    verifyAppUidRules({false, true, false} /*expectedResults*/, uidRanges, sTun.name(),
+                      UidRanges::SUB_PRIORITY_HIGHEST);
+    EXPECT_TRUE(mNetd->networkRemoveUidRanges(APP_DEFAULT_NETID, {uidRanges.at(1)}).isOk());
+    verifyAppUidRules({false, false, false} /*expectedResults*/, uidRanges, sTun.name(),
+                      UidRanges::SUB_PRIORITY_HIGHEST);
+}
+
 // Verify whether IP rules for app default network are correctly configured.
 TEST_F(NetdBinderTest, PerAppDefaultNetwork_VerifyIpRules) {
     const auto& config = makeNativeNetworkConfig(APP_DEFAULT_NETID, NativeNetworkType::PHYSICAL,